@@ -0,0 +1,235 @@
+/**
+ * Collision benchmark
+ *
+ * This program measures the speed of the collision search for all
+ * collision modules on four standardized scenes which are based on
+ * the examples bouncing_balls, granulardynamics, shearing_sheet and
+ * solar_system_with_testparticles. Every scene is scaled from 10^3
+ * particles up to a maximum number of particles (10^5 by default,
+ * the first command line argument, e.g. 10000000) by increasing the
+ * size of the domain at a fixed particle density. If REBOUND is
+ * compiled with OpenMP, every benchmark is repeated for 1, 2, 4, ...
+ * threads, up to the maximum number of threads.
+ *
+ * Between collision searches, the particles move along straight
+ * lines and the boundary conditions are applied. Only
+ * reb_collision_search() is timed. Collisions are counted but not
+ * resolved, so that all collision modules see exactly the same
+ * particles. The direct and line searches are skipped if they would
+ * need to test more than 10^9 pairs per step.
+ *
+ * The number of timed steps can be set with the second command line
+ * argument. The results are written as JSON to the file given by the
+ * third command line argument (collision.json by default).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <sys/time.h>
+#ifdef OPENMP
+#include <omp.h>
+#endif // OPENMP
+#include "rebound.h"
+#include "collision.h"
+#include "boundary.h"
+
+// Collisions are only counted, the particles remain unchanged.
+int collision_count(struct reb_simulation* const r, struct reb_collision c){
+    return 0;
+}
+
+void scene_bouncing_balls(struct reb_simulation* r, int N){
+    // Balls with radius 0.1 filling 1% of an open box.
+    const double radius = 0.1;
+    const double boxsize = pow(N*4./3.*M_PI*radius*radius*radius/0.01, 1./3.);
+    r->boundary      = REB_BOUNDARY_OPEN;
+    r->dt            = 1e-2;
+    reb_configure_box(r, boxsize, 1, 1, 1);
+    for (int i=0;i<N;i++){
+        struct reb_particle p = {0};
+        p.x  = reb_random_uniform(r, -boxsize/2., boxsize/2.);
+        p.y  = reb_random_uniform(r, -boxsize/2., boxsize/2.);
+        p.z  = reb_random_uniform(r, -boxsize/2., boxsize/2.);
+        p.vx = reb_random_normal(r, 1.);
+        p.vy = reb_random_normal(r, 1.);
+        p.vz = reb_random_normal(r, 1.);
+        p.m  = 1;
+        p.r  = radius;
+        reb_add(r, p);
+    }
+}
+
+void scene_granulardynamics(struct reb_simulation* r, int N){
+    // Same particle density and root box layout as in the granulardynamics example, without the walls.
+    const double boxsize = pow(N/(0.00937*4.), 1./3.);
+    r->boundary      = REB_BOUNDARY_PERIODIC;
+    r->dt            = 1e-1;
+    reb_configure_box(r, boxsize, 1, 1, 4);
+    r->nghostx = 1; r->nghosty = 1; r->nghostz = 0;
+    for (int i=0;i<N;i++){
+        struct reb_particle p = {0};
+        p.x  = reb_random_uniform(r, -r->boxsize.x/2., r->boxsize.x/2.);
+        p.y  = reb_random_uniform(r, -r->boxsize.y/2., r->boxsize.y/2.);
+        p.z  = reb_random_uniform(r, -r->boxsize.z/2., r->boxsize.z/2.);
+        p.vx = reb_random_normal(r, 1.);
+        p.vy = reb_random_normal(r, 1.);
+        p.vz = reb_random_normal(r, 1.);
+        p.m  = 1;
+        p.r  = 1;
+        reb_add(r, p);
+    }
+}
+
+void scene_shearing_sheet(struct reb_simulation* r, int N){
+    // Same surface density and size distribution as in the shearing_sheet example.
+    const double OMEGA = 0.00013143527;
+    const double surfacedensity = 400;
+    const double particle_density = 400;
+    const double mean_mass = particle_density*4./3.*M_PI*6.4; // <r^3> = 6.4 m^3 for a slope of -3 between 1 m and 4 m
+    const double boxsize = sqrt(N*mean_mass/surfacedensity)/2.;
+    r->boundary      = REB_BOUNDARY_SHEAR;
+    r->ri_sei.OMEGA  = OMEGA;
+    r->dt            = 1e-3*2.*M_PI/OMEGA;
+    reb_configure_box(r, boxsize, 2, 2, 1);
+    r->nghostx = 2; r->nghosty = 2; r->nghostz = 0;
+    for (int i=0;i<N;i++){
+        struct reb_particle p = {0};
+        p.x  = reb_random_uniform(r, -r->boxsize.x/2., r->boxsize.x/2.);
+        p.y  = reb_random_uniform(r, -r->boxsize.y/2., r->boxsize.y/2.);
+        p.z  = reb_random_normal(r, 1.);
+        p.vy = -1.5*p.x*OMEGA;
+        p.r  = reb_random_powerlaw(r, 1., 4., -3.);
+        p.m  = particle_density*4./3.*M_PI*p.r*p.r*p.r;
+        reb_add(r, p);
+    }
+}
+
+void scene_solar_system_with_testparticles(struct reb_simulation* r, int N){
+    // Sun, the giant planets and test particles between 0.4 and 20 AU. Pairs of test particles are not checked.
+    r->boundary      = REB_BOUNDARY_OPEN;
+    r->dt            = 4./365.25*2.*M_PI;        // 4days
+    r->collision_skip_testparticle_pairs = 1;
+    reb_configure_box(r, 100., 1, 1, 1);
+    reb_add_fmt(r, "m r", 1., 0.00465);
+    reb_add_fmt(r, "m r a e", 9.55e-4, 4.67e-4, 5.20, 0.049);
+    reb_add_fmt(r, "m r a e", 2.86e-4, 3.89e-4, 9.58, 0.057);
+    reb_add_fmt(r, "m r a e", 4.37e-5, 1.69e-4, 19.2, 0.046);
+    reb_add_fmt(r, "m r a e", 5.15e-5, 1.64e-4, 30.1, 0.010);
+    r->N_active = r->N;
+    for (int i=r->N;i<N;i++){
+        double a = reb_random_uniform(r, 0.4,20.);
+        double e = reb_random_uniform(r, 0.01,0.2);
+        double omega = reb_random_uniform(r, 0.,2.*M_PI);
+        double f = reb_random_uniform(r, 0.,2.*M_PI);
+        struct reb_particle p = reb_tools_orbit_to_particle(1.,r->particles[0],0.,a,e,0.,0.,omega,f);
+        p.r = 1e-5;
+        reb_add(r, p);
+    }
+}
+
+struct scene {
+    const char* name;
+    void (*setup)(struct reb_simulation* r, int N);
+};
+
+struct mode {
+    const char* name;
+    int collision;
+    int quadratic; // 1 if the search tests all pairs
+};
+
+static double walltime(){
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return tv.tv_sec+tv.tv_usec/1e6;
+}
+
+int main(int argc, char* argv[]){
+    const int Nmax = argc>1?atoi(argv[1]):100000;
+    const int steps = argc>2?atoi(argv[2]):10;
+    const char* filename = argc>3?argv[3]:"collision.json";
+    FILE* of = fopen(filename, "w");
+    if (of==NULL){
+        fprintf(stderr, "Cannot open %s.\n", filename);
+        return EXIT_FAILURE;
+    }
+    const struct scene scenes[] = {
+        {"bouncing_balls", scene_bouncing_balls},
+        {"granulardynamics", scene_granulardynamics},
+        {"shearing_sheet", scene_shearing_sheet},
+        {"solar_system_with_testparticles", scene_solar_system_with_testparticles},
+    };
+    const struct mode modes[] = {
+        {"direct", REB_COLLISION_DIRECT, 1},
+        {"line", REB_COLLISION_LINE, 1},
+        {"tree", REB_COLLISION_TREE, 0},
+        {"linetree", REB_COLLISION_LINETREE, 0},
+        {"grid", REB_COLLISION_GRID, 0},
+        {"sap", REB_COLLISION_SAP, 0},
+        {"linesap", REB_COLLISION_LINESAP, 0},
+        {"neighbourlist", REB_COLLISION_NEIGHBOURLIST, 0},
+    };
+    int threads_max = 1;
+#ifdef OPENMP
+    threads_max = omp_get_max_threads();
+#endif // OPENMP
+
+    fprintf(of, "[\n");
+    int first = 1;
+    for (int s=0;s<sizeof(scenes)/sizeof(scenes[0]);s++){
+    for (int N=1000;N<=Nmax;N*=10){
+    for (int m=0;m<sizeof(modes)/sizeof(modes[0]);m++){
+    for (int threads=1;threads<=threads_max;threads*=2){
+#ifdef OPENMP
+        omp_set_num_threads(threads);
+#endif // OPENMP
+        struct reb_simulation* r = reb_create_simulation();
+        r->rand_seed = 1;
+        r->collision = modes[m].collision;
+        r->collision_resolve = collision_count;
+        r->track_collision_statistics = 1;
+        scenes[s].setup(r, N);
+        const double Nsearch = r->collision_skip_testparticle_pairs?r->N_active:r->N;
+        const int skipped = modes[m].quadratic && Nsearch*r->N>1e9;
+        double time = 0.;
+        long pairs = 0;
+        long hits = 0;
+        long particle_steps = 0;
+        if (!skipped){
+            // The first search builds the tree, grid, sorted list or neighbour list.
+            reb_collision_search(r);
+            for (int k=0;k<steps;k++){
+                for (int i=0;i<r->N;i++){
+                    struct reb_particle* const p = &r->particles[i];
+                    p->x += r->dt*p->vx;
+                    p->y += r->dt*p->vy;
+                    p->z += r->dt*p->vz;
+                }
+                r->t += r->dt;
+                reb_boundary_check(r);
+                const double start = walltime();
+                reb_collision_search(r);
+                time += walltime()-start;
+                pairs += r->collision_statistics.pairs;
+                hits += r->collision_statistics.hits;
+                particle_steps += r->N;
+            }
+        }
+        printf("%s, %s, N=%d, threads=%d: %s\n", scenes[s].name, modes[m].name, N, threads, skipped?"skipped":"done");
+        fprintf(of, "%s  {\"scene\": \"%s\", \"mode\": \"%s\", \"N\": %d, \"threads\": %d, \"steps\": %d, ", first?"":",\n", scenes[s].name, modes[m].name, N, threads, steps);
+        if (skipped){
+            fprintf(of, "\"skipped\": true}");
+        }else{
+            fprintf(of, "\"time\": %e, \"pairs\": %ld, \"collisions\": %ld, \"pairs_per_s\": %e, \"collisions_per_s\": %e, \"ns_per_particle_step\": %e}", time, pairs, hits, pairs/time, hits/time, time/particle_steps*1e9);
+        }
+        fflush(of);
+        first = 0;
+        reb_free_simulation(r);
+    }
+    }
+    }
+    }
+    fprintf(of, "\n]\n");
+    fclose(of);
+    return EXIT_SUCCESS;
+}
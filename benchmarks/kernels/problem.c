@@ -0,0 +1,303 @@
+/**
+ * Kernel benchmark
+ *
+ * This program measures the speed of the main building blocks of
+ * REBOUND on standardized, seeded workloads:
+ *
+ *  - gravity:  every gravity routine (basic, compensated, tree, fmm,
+ *              and ewald with periodic boundary conditions) on a
+ *              uniform sphere of equal mass particles, integrated
+ *              with the leapfrog integrator.
+ *  - integrator: timesteps of IAS15, WHFast, WHFast512, MERCURIUS,
+ *              SABA, EOS, BS and TES for a star with up to 8 planets
+ *              and test particles.
+ *  - tree:     reb_tree_update() on a uniform sphere.
+ *  - simulationarchive: writing a snapshot and reading the last
+ *              snapshot back.
+ *  - copy:     reb_copy_simulation().
+ *
+ * The collision modules are covered by benchmarks/collision. Run
+ * `make bench` in the benchmarks directory to run both.
+ *
+ * Every workload is scaled from 10 particles up to a maximum number of
+ * particles (10^5 by default, the first command line argument) in
+ * factors of 10. The integrator benchmarks use at most 10^4 particles
+ * (10^3 for TES). Direct summation is skipped if it would need to
+ * calculate more than 10^9 particle pairs per step (10^7 for Ewald
+ * summation). If REBOUND is compiled with OpenMP,
+ * every benchmark is repeated for 1, 2, 4, ... threads, up to the
+ * maximum number of threads.
+ *
+ * The number of timed steps can be set with the second command line
+ * argument. The results are written as JSON to the file given by the
+ * third command line argument (kernels.json by default). For the
+ * gravity benchmarks, pairs_per_s is the number of particle pairs
+ * direct summation would need to calculate per second to achieve the
+ * same speed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+#ifdef OPENMP
+#include <omp.h>
+#endif // OPENMP
+#include "rebound.h"
+#include "tree.h"
+
+void scene_sphere(struct reb_simulation* r, int N){
+    // Uniform sphere of equal mass particles in virial equilibrium (G=1, M=1, R=1).
+    r->boundary      = REB_BOUNDARY_OPEN;
+    r->integrator    = REB_INTEGRATOR_LEAPFROG;
+    r->dt            = 1e-3;
+    r->softening     = 0.01;
+    r->opening_angle2 = 0.25;
+    reb_configure_box(r, 4., 1, 1, 1);
+    const double sigma = sqrt(0.6/3.);
+    for (int i=0;i<N;i++){
+        struct reb_particle p = {0};
+        do{
+            p.x = reb_random_uniform(r, -1., 1.);
+            p.y = reb_random_uniform(r, -1., 1.);
+            p.z = reb_random_uniform(r, -1., 1.);
+        }while(p.x*p.x+p.y*p.y+p.z*p.z>1.);
+        p.vx = reb_random_normal(r, sigma);
+        p.vy = reb_random_normal(r, sigma);
+        p.vz = reb_random_normal(r, sigma);
+        p.m  = 1./N;
+        reb_add(r, p);
+    }
+}
+
+void scene_periodic(struct reb_simulation* r, int N){
+    // Equal mass particles in a periodic box.
+    r->boundary      = REB_BOUNDARY_PERIODIC;
+    r->integrator    = REB_INTEGRATOR_LEAPFROG;
+    r->dt            = 1e-3;
+    r->softening     = 0.01;
+    r->opening_angle2 = 0.25;
+    r->nghostx = 1; r->nghosty = 1; r->nghostz = 1;
+    reb_configure_box(r, 2., 1, 1, 1);
+    for (int i=0;i<N;i++){
+        struct reb_particle p = {0};
+        p.x  = reb_random_uniform(r, -1., 1.);
+        p.y  = reb_random_uniform(r, -1., 1.);
+        p.z  = reb_random_uniform(r, -1., 1.);
+        p.vx = reb_random_normal(r, 0.1);
+        p.vy = reb_random_normal(r, 0.1);
+        p.vz = reb_random_normal(r, 0.1);
+        p.m  = 1./N;
+        reb_add(r, p);
+    }
+}
+
+void scene_planetary(struct reb_simulation* r, int N){
+    // A star, up to 8 planets, and test particles between the planets.
+    r->dt            = 1e-2;
+    reb_add_fmt(r, "m r", 1., 0.005);
+    const int N_planets = N-1<8?N-1:8;
+    for (int i=0;i<N_planets;i++){
+        const double a = 1.+0.5*i;
+        reb_add_fmt(r, "m r a e inc f", 1e-5, 1e-4, a, reb_random_uniform(r, 0., 0.05), reb_random_uniform(r, 0., 0.02), reb_random_uniform(r, 0., 2.*M_PI));
+    }
+    r->N_active = r->N;
+    while (r->N<N){
+        const double a = reb_random_uniform(r, 0.5, 5.);
+        reb_add_fmt(r, "a e inc f", a, reb_random_uniform(r, 0., 0.1), reb_random_uniform(r, 0., 0.05), reb_random_uniform(r, 0., 2.*M_PI));
+    }
+    reb_move_to_com(r);
+}
+
+struct workload {
+    const char* benchmark;
+    const char* name;
+    void (*setup)(struct reb_simulation* r, int N);
+    int gravity;
+    int integrator;
+    int Nmax;           // Maximum number of particles, 0 for no limit
+    double pairs_max;   // Skip if more particle pairs per step would be needed, 0 for no limit
+};
+
+enum timed {
+    TIMED_STEPS,
+    TIMED_TREE,
+    TIMED_SIMULATIONARCHIVE_WRITE,
+    TIMED_SIMULATIONARCHIVE_READ,
+    TIMED_COPY,
+};
+
+static double walltime(){
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return tv.tv_sec+tv.tv_usec/1e6;
+}
+
+// Runs the timed part of a workload. Returns the time in seconds or a negative number if an error occurred.
+static double run(struct reb_simulation* r, enum timed timed, int steps){
+    double time = 0.;
+    switch (timed){
+        case TIMED_STEPS:
+            {
+                // The first step initializes the integrator and builds the tree.
+                reb_step(r);
+                const double start = walltime();
+                reb_steps(r, steps);
+                time = walltime()-start;
+            }
+            break;
+        case TIMED_TREE:
+            reb_tree_update(r);
+            for (int k=0;k<steps;k++){
+                for (int i=0;i<r->N;i++){
+                    struct reb_particle* const p = &r->particles[i];
+                    p->x += r->dt*p->vx;
+                    p->y += r->dt*p->vy;
+                    p->z += r->dt*p->vz;
+                }
+                const double start = walltime();
+                reb_tree_update(r);
+                time += walltime()-start;
+            }
+            break;
+        case TIMED_SIMULATIONARCHIVE_WRITE:
+        case TIMED_SIMULATIONARCHIVE_READ:
+            {
+                const char* filename = "kernels.bin";
+                const char* filename_index = "kernels.bin.index";
+                remove(filename);
+                remove(filename_index);
+                for (int k=0;k<steps;k++){
+                    reb_step(r);
+                    const double start = walltime();
+                    reb_simulationarchive_snapshot(r, filename);
+                    if (timed==TIMED_SIMULATIONARCHIVE_WRITE){
+                        time += walltime()-start;
+                    }
+                }
+                if (timed==TIMED_SIMULATIONARCHIVE_READ){
+                    for (int k=0;k<steps;k++){
+                        const double start = walltime();
+                        struct reb_simulationarchive* sa = reb_open_simulationarchive(filename);
+                        struct reb_simulation* r2 = sa?reb_create_simulation_from_simulationarchive(sa, -1):NULL;
+                        time += walltime()-start;
+                        if (r2==NULL){
+                            time = -1.;
+                        }else{
+                            reb_free_simulation(r2);
+                        }
+                        if (sa) reb_close_simulationarchive(sa);
+                        if (time<0.) break;
+                    }
+                }
+                remove(filename);
+                remove(filename_index);
+            }
+            break;
+        case TIMED_COPY:
+            for (int k=0;k<steps;k++){
+                const double start = walltime();
+                struct reb_simulation* r2 = reb_copy_simulation(r);
+                time += walltime()-start;
+                if (r2==NULL){
+                    return -1.;
+                }
+                reb_free_simulation(r2);
+            }
+            break;
+    }
+    if (r->status==REB_EXIT_ERROR){
+        return -1.;
+    }
+    return time;
+}
+
+int main(int argc, char* argv[]){
+    const int Nmax = argc>1?atoi(argv[1]):100000;
+    const int steps = argc>2?atoi(argv[2]):10;
+    const char* filename = argc>3?argv[3]:"kernels.json";
+    FILE* of = fopen(filename, "w");
+    if (of==NULL){
+        fprintf(stderr, "Cannot open %s.\n", filename);
+        return EXIT_FAILURE;
+    }
+    const struct {
+        struct workload w;
+        enum timed timed;
+    } workloads[] = {
+        {{"gravity", "basic", scene_sphere, REB_GRAVITY_BASIC, REB_INTEGRATOR_LEAPFROG, 0, 1e9}, TIMED_STEPS},
+        {{"gravity", "compensated", scene_sphere, REB_GRAVITY_COMPENSATED, REB_INTEGRATOR_LEAPFROG, 0, 1e9}, TIMED_STEPS},
+        {{"gravity", "tree", scene_sphere, REB_GRAVITY_TREE, REB_INTEGRATOR_LEAPFROG, 0, 0}, TIMED_STEPS},
+        {{"gravity", "fmm", scene_sphere, REB_GRAVITY_FMM, REB_INTEGRATOR_LEAPFROG, 0, 0}, TIMED_STEPS},
+        {{"gravity", "ewald", scene_periodic, REB_GRAVITY_EWALD, REB_INTEGRATOR_LEAPFROG, 0, 1e7}, TIMED_STEPS},
+        {{"integrator", "ias15", scene_planetary, REB_GRAVITY_BASIC, REB_INTEGRATOR_IAS15, 10000, 0}, TIMED_STEPS},
+        {{"integrator", "whfast", scene_planetary, REB_GRAVITY_BASIC, REB_INTEGRATOR_WHFAST, 10000, 0}, TIMED_STEPS},
+        {{"integrator", "whfast512", scene_planetary, REB_GRAVITY_BASIC, REB_INTEGRATOR_WHFAST512, 10000, 0}, TIMED_STEPS},
+        {{"integrator", "mercurius", scene_planetary, REB_GRAVITY_MERCURIUS, REB_INTEGRATOR_MERCURIUS, 10000, 0}, TIMED_STEPS},
+        {{"integrator", "saba", scene_planetary, REB_GRAVITY_BASIC, REB_INTEGRATOR_SABA, 10000, 0}, TIMED_STEPS},
+        {{"integrator", "eos", scene_planetary, REB_GRAVITY_BASIC, REB_INTEGRATOR_EOS, 10000, 0}, TIMED_STEPS},
+        {{"integrator", "bs", scene_planetary, REB_GRAVITY_BASIC, REB_INTEGRATOR_BS, 10000, 0}, TIMED_STEPS},
+        {{"integrator", "tes", scene_planetary, REB_GRAVITY_BASIC, REB_INTEGRATOR_TES, 1000, 0}, TIMED_STEPS},
+        {{"tree", "update", scene_sphere, REB_GRAVITY_TREE, REB_INTEGRATOR_LEAPFROG, 0, 0}, TIMED_TREE},
+        {{"simulationarchive", "write", scene_planetary, REB_GRAVITY_BASIC, REB_INTEGRATOR_WHFAST, 0, 0}, TIMED_SIMULATIONARCHIVE_WRITE},
+        {{"simulationarchive", "read", scene_planetary, REB_GRAVITY_BASIC, REB_INTEGRATOR_WHFAST, 0, 0}, TIMED_SIMULATIONARCHIVE_READ},
+        {{"copy", "copy", scene_planetary, REB_GRAVITY_BASIC, REB_INTEGRATOR_WHFAST, 0, 0}, TIMED_COPY},
+    };
+    int threads_max = 1;
+#ifdef OPENMP
+    threads_max = omp_get_max_threads();
+#endif // OPENMP
+
+    fprintf(of, "[\n");
+    int first = 1;
+    for (int b=0;b<sizeof(workloads)/sizeof(workloads[0]);b++){
+    const struct workload* const w = &workloads[b].w;
+    for (int N=10;N<=Nmax && (w->Nmax==0 || N<=w->Nmax);N*=10){
+    for (int threads=1;threads<=threads_max;threads*=2){
+#ifdef OPENMP
+        omp_set_num_threads(threads);
+#endif // OPENMP
+        struct reb_simulation* r = reb_create_simulation();
+        r->rand_seed = 1;
+        // Particles are only added to the tree if the gravity routine is set first.
+        r->gravity = w->gravity;
+        w->setup(r, N);
+        r->integrator = w->integrator;
+        if (r->integrator==REB_INTEGRATOR_WHFAST || r->integrator==REB_INTEGRATOR_WHFAST512){
+            r->exact_finish_time = 0;
+        }
+        if (r->integrator==REB_INTEGRATOR_WHFAST){
+            // Jacobi coordinates are not supported by WHFast with OpenMP.
+            r->ri_whfast.coordinates = REB_WHFAST_COORDINATES_DEMOCRATICHELIOCENTRIC;
+        }
+        const double Nactive = r->N_active==-1?r->N:r->N_active;
+        const double pairs = Nactive*(r->N-1.)/2.;
+        const int skipped = w->pairs_max>0 && pairs>w->pairs_max;
+        double time = 0.;
+        if (!skipped){
+            time = run(r, workloads[b].timed, steps);
+        }
+        const int error = time<0.;
+        printf("%s, %s, N=%d, threads=%d: %s\n", w->benchmark, w->name, N, threads, skipped?"skipped":(error?"error":"done"));
+        fprintf(of, "%s  {\"benchmark\": \"%s\", \"name\": \"%s\", \"N\": %d, \"threads\": %d, \"steps\": %d, ", first?"":",\n", w->benchmark, w->name, N, threads, steps);
+        if (skipped){
+            fprintf(of, "\"skipped\": true}");
+        }else if (error){
+            fprintf(of, "\"error\": true}");
+        }else{
+            fprintf(of, "\"time\": %e, \"ns_per_particle_step\": %e", time, time/((double)N*steps)*1e9);
+            if (workloads[b].timed==TIMED_STEPS && strcmp(w->benchmark, "gravity")==0){
+                fprintf(of, ", \"pairs_per_s\": %e", pairs*steps/time);
+            }
+            fprintf(of, "}");
+        }
+        fflush(of);
+        first = 0;
+        reb_free_simulation(r);
+    }
+    }
+    }
+    fprintf(of, "\n]\n");
+    fclose(of);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,228 @@
+# -*- coding: utf-8 -*-
+"""
+Performance regression harness.
+
+Runs the benchmarks in collision/ and kernels/ several times, and
+compares the median time per particle-step of every benchmark with a
+baseline stored for this type of machine. A benchmark counts as a
+regression if it got slower by more than the threshold (5% by default)
+and by more than the noise of both measurements. The noise is estimated
+from the median absolute deviation (MAD) of the repeated trials.
+
+It also checks that a set of seeded simulations still produce
+bit-identical results. This uses reb_diff_simulations() (the == operator
+of the python module) to compare the final states with those stored
+with the baseline.
+
+Baselines are stored in baselines/ using a fingerprint of the machine
+(CPU model, number of CPUs, operating system). Nodes of the same type
+in a cluster share the same baseline.
+
+Usage:
+
+    python regression.py --save         # Measure and store a new baseline
+    python regression.py                # Measure and compare with the baseline
+
+The script returns a non-zero exit code if a regression was found or if
+the results are no longer bit-identical. Run `python regression.py -h`
+for all options.
+"""
+import argparse
+import json
+import os
+import platform
+import random
+import re
+import statistics
+import subprocess
+import sys
+import tempfile
+import warnings
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+BENCHMARKS = ["collision", "kernels"]
+
+
+def fingerprint():
+    cpu = platform.processor()
+    try:
+        with open("/proc/cpuinfo") as f:
+            for line in f:
+                if line.startswith("model name"):
+                    cpu = line.split(":", 1)[1]
+                    break
+    except IOError:
+        pass
+    name = "%s_%dcpu_%s_%s" % (cpu.strip(), os.cpu_count() or 1, platform.system(), platform.machine())
+    return re.sub(r"[^A-Za-z0-9_.-]+", "_", name)
+
+
+def key(result):
+    # The collision benchmark uses scene/mode, the kernel benchmark benchmark/name.
+    group = result.get("scene", result.get("benchmark"))
+    name = result.get("mode", result.get("name"))
+    return "%s/%s/N=%d/threads=%d" % (group, name, result["N"], result["threads"])
+
+
+def run_benchmarks(args):
+    trials = {}
+    for benchmark in BENCHMARKS:
+        directory = os.path.join(HERE, benchmark)
+        if not args.no_build:
+            subprocess.check_call(["make", "-s", "-C", directory, "all"], stdout=subprocess.DEVNULL)
+        for trial in range(args.trials):
+            print("Running %s (trial %d/%d) ..." % (benchmark, trial+1, args.trials))
+            with tempfile.NamedTemporaryFile(suffix=".json") as f:
+                subprocess.check_call(["./rebound", str(args.Nmax), str(args.steps), f.name], cwd=directory, stdout=subprocess.DEVNULL)
+                results = json.load(open(f.name))
+            for result in results:
+                if "ns_per_particle_step" in result:
+                    trials.setdefault("%s:%s" % (benchmark, key(result)), []).append(result["ns_per_particle_step"])
+    summary = {}
+    for k, values in trials.items():
+        median = statistics.median(values)
+        mad = statistics.median([abs(v-median) for v in values])
+        summary[k] = {"median": median, "mad": mad, "trials": len(values)}
+    return summary
+
+
+def compare_benchmarks(current, baseline, threshold):
+    regressions = []
+    for k in sorted(current):
+        if k not in baseline:
+            continue
+        c, b = current[k], baseline[k]
+        # 1.4826*MAD estimates the standard deviation for normally distributed noise.
+        noise = 3.*1.4826*max(c["mad"], b["mad"])
+        change = c["median"]/b["median"]-1. if b["median"]>0. else 0.
+        if abs(change)>threshold and abs(c["median"]-b["median"])>noise:
+            label = "REGRESSION" if change>0. else "improvement"
+            print("%-11s %-70s %+7.1f%%  (%.3e ns -> %.3e ns)" % (label, k, change*100., b["median"], c["median"]))
+            if change>0.:
+                regressions.append(k)
+    return regressions
+
+
+def identity_simulations():
+    # Seeded simulations whose results should not change unless the algorithms change.
+    import rebound
+    simulations = {}
+
+    def sphere(gravity):
+        sim = rebound.Simulation()
+        sim.rand_seed = 1
+        rng = random.Random(1)
+        sim.integrator = "leapfrog"
+        sim.gravity = gravity
+        sim.dt = 1e-3
+        sim.softening = 0.01
+        sim.configure_box(4.)
+        for i in range(200):
+            sim.add(m=1./200, x=rng.uniform(-1, 1), y=rng.uniform(-1, 1), z=rng.uniform(-1, 1), vx=rng.gauss(0, 0.3), vy=rng.gauss(0, 0.3), vz=rng.gauss(0, 0.3))
+        sim.steps(50)
+        return sim
+
+    def balls(collision):
+        sim = rebound.Simulation()
+        sim.rand_seed = 1
+        rng = random.Random(1)
+        sim.integrator = "leapfrog"
+        sim.gravity = "none"
+        sim.collision = collision
+        sim.collision_resolve = "hardsphere"
+        sim.boundary = "periodic"
+        sim.dt = 1e-2
+        sim.configure_box(10.)
+        for i in range(300):
+            sim.add(m=1., r=0.2, x=rng.uniform(-5, 5), y=rng.uniform(-5, 5), z=rng.uniform(-5, 5), vx=rng.gauss(0, 1), vy=rng.gauss(0, 1), vz=rng.gauss(0, 1))
+        sim.steps(50)
+        return sim
+
+    def planetary(integrator):
+        sim = rebound.Simulation()
+        sim.rand_seed = 1
+        sim.integrator = integrator
+        sim.dt = 1e-2
+        sim.add(m=1.)
+        for i in range(5):
+            sim.add(m=1e-4, a=1.+0.5*i, e=0.05, inc=0.01*i, f=1.3*i)
+        sim.move_to_com()
+        sim.integrate(20.)
+        return sim
+
+    for gravity in ["basic", "compensated", "tree", "fmm"]:
+        simulations["gravity_"+gravity] = lambda gravity=gravity: sphere(gravity)
+    for collision in ["direct", "tree", "grid", "sap", "line", "linetree", "neighbourlist"]:
+        simulations["collision_"+collision] = lambda collision=collision: balls(collision)
+    for integrator in ["ias15", "whfast", "mercurius", "saba", "eos", "bs"]:
+        simulations["integrator_"+integrator] = lambda integrator=integrator: planetary(integrator)
+    return simulations
+
+
+def check_identity(directory, save):
+    try:
+        import rebound
+    except ImportError:
+        print("The rebound python module is not available. Skipping the bit-identity checks.")
+        return []
+    different = []
+    os.makedirs(directory, exist_ok=True)
+    for name, create in identity_simulations().items():
+        sim = create()
+        sim.walltime = 0.
+        filename = os.path.join(directory, name+".bin")
+        if save:
+            if os.path.isfile(filename):
+                os.remove(filename)
+            sim.save(filename)
+        elif os.path.isfile(filename):
+            with warnings.catch_warnings():
+                warnings.simplefilter("ignore")
+                other = rebound.Simulation(filename)
+            if name.startswith("collision_"):
+                # Function pointers are not stored in binary files.
+                other.collision_resolve = "hardsphere"
+            if sim != other:
+                print("DIFFERENT   %s" % name)
+                different.append(name)
+    return different
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Compares the benchmarks with a stored baseline.")
+    parser.add_argument("--save", action="store_true", help="Store the results as the new baseline for this machine.")
+    parser.add_argument("--trials", type=int, default=5, help="Number of times every benchmark is run (default 5).")
+    parser.add_argument("--threshold", type=float, default=0.05, help="Relative slowdown counted as a regression (default 0.05).")
+    parser.add_argument("--Nmax", type=int, default=10000, help="Maximum number of particles (default 10000).")
+    parser.add_argument("--steps", type=int, default=10, help="Number of timed steps (default 10).")
+    parser.add_argument("--baselines", default=os.path.join(HERE, "baselines"), help="Directory with the baselines.")
+    parser.add_argument("--no-build", action="store_true", help="Do not compile the benchmarks.")
+    parser.add_argument("--no-identity", action="store_true", help="Skip the bit-identity checks.")
+    args = parser.parse_args()
+
+    name = fingerprint()
+    filename = os.path.join(args.baselines, name+".json")
+    print("Machine fingerprint: %s" % name)
+    current = run_benchmarks(args)
+    different = [] if args.no_identity else check_identity(os.path.join(args.baselines, name), args.save)
+
+    if args.save:
+        os.makedirs(args.baselines, exist_ok=True)
+        with open(filename, "w") as f:
+            json.dump({"fingerprint": name, "trials": args.trials, "Nmax": args.Nmax, "steps": args.steps, "results": current}, f, indent=1, sort_keys=True)
+        print("Baseline saved to %s." % filename)
+        return 0
+    if not os.path.isfile(filename):
+        print("No baseline for this machine. Run with --save first.")
+        return 1
+    with open(filename) as f:
+        baseline = json.load(f)
+    if baseline["Nmax"]!=args.Nmax or baseline["steps"]!=args.steps:
+        print("Warning: the baseline was measured with Nmax=%d and steps=%d." % (baseline["Nmax"], baseline["steps"]))
+    regressions = compare_benchmarks(current, baseline["results"], args.threshold)
+    print("%d benchmarks compared, %d regressions, %d simulations not bit-identical." % (len(current), len(regressions), len(different)))
+    return 1 if regressions or different else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
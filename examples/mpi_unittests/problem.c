@@ -14,6 +14,7 @@
 #include <assert.h>
 #include "rebound.h"
 #include "tools.h"
+#include "communication_mpi.h"
 
 
 void test_twobody(){
@@ -67,7 +68,59 @@ void test_twobody(){
 
 }
 
+// Sums up the number of particles, the mass, and the x momentum on all nodes.
+void sum_mass_momentum(struct reb_simulation* const r, double total[3]){
+    double local[3] = {r->N, 0., 0.};
+    for (int i=0;i<r->N;i++){
+        local[1] += r->particles[i].m;
+        local[2] += r->particles[i].m*r->particles[i].vx;
+    }
+    MPI_Allreduce(local, total, 3, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+}
+
+void test_collision_merge(){
+    // Particles merge across the boundary between two root boxes.
+    struct reb_simulation* const r = reb_create_simulation();
+    r->integrator       = REB_INTEGRATOR_LEAPFROG;
+    r->gravity          = REB_GRAVITY_NONE;
+    r->collision        = REB_COLLISION_TREE;
+    r->collision_resolve = reb_collision_resolve_merge;
+    r->boundary         = REB_BOUNDARY_OPEN;
+    r->dt               = 0.01;
+    reb_configure_box(r,10,2,2,1);
+
+    reb_mpi_init(r);
+    if (r->mpi_id==0){
+        srand(3);
+        for (int i=0;i<400;i++){
+            double x = ((double)rand()/RAND_MAX-0.5)*2.;
+            double y = ((double)rand()/RAND_MAX-0.5)*8.;
+            double z = ((double)rand()/RAND_MAX-0.5)*8.;
+            double vx = ((double)rand()/RAND_MAX-0.5)*2.;
+            reb_add_fmt(r, "x y z vx m r", x, y, z, vx, 1., 0.15);
+        }
+    }
+
+    // Particles added on node 0 are only sent to their root boxes during the first step.
+    reb_communication_mpi_distribute_particles(r);
+    double initial[3];
+    sum_mass_momentum(r, initial);
+
+    printf("Starting the integration...\n");
+    reb_integrate(r, 1.);
+
+    printf("Checking conservation of mass and momentum...\n");
+    double total[3];
+    sum_mass_momentum(r, total);
+    assert(total[0]<initial[0]);
+    assert(fabs(total[1]-initial[1])<1e-12);
+    assert(fabs(total[2]-initial[2])<1e-9);
+
+    reb_free_simulation(r); 
+}
+
 int main(int argc, char* argv[]){
+    test_collision_merge();
     test_twobody();
 }
 
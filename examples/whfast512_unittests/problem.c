@@ -230,11 +230,127 @@ int test_restart(){
     return 1;
 }
 
+struct reb_simulation* setup_sim_testparticles(){
+    struct reb_simulation* r = setup_sim();
+    r->N_active = r->N;
+    // 21 test particles: two full groups of 8 and one partially filled group
+    for (int i=0; i<21; i++){
+        double a = 1.5 + 0.1*i;
+        double f = 0.3*i;
+        struct reb_particle p = reb_tools_orbit_to_particle(r->G, r->particles[0], 0., a, 0.05, 0.01*i, 0., 0., f);
+        reb_add(r, p);
+    }
+    return r;
+}
+
+int test_testparticles(){
+    struct reb_simulation* r = setup_sim_testparticles();
+    struct reb_simulation* r512 = reb_copy_simulation(r);
+     
+    r512->integrator = REB_INTEGRATOR_WHFAST512;
+    r->integrator = REB_INTEGRATOR_WHFAST;
+    r->ri_whfast.coordinates = REB_WHFAST_COORDINATES_DEMOCRATICHELIOCENTRIC;
+    r->ri_whfast.safe_mode = 0;
+
+    double tmax = 1e2;
+    if (reb_integrate(r, tmax)>0) return 0;
+    if (reb_integrate(r512, tmax)>0) return 0;
+
+    for (int i=0;i<r->N;i++){
+        if (fabs(r->particles[i].x - r512->particles[i].x)>1e-11){
+            printf("Accuracy not met in test particle test.\n");
+            printf("%.16e\n",fabs(r->particles[i].x - r512->particles[i].x));
+            return 0;
+        }
+    }
+
+    reb_free_simulation(r);
+    reb_free_simulation(r512);
+    return 1;
+}
+
+int test_testparticles_restart(){
+    struct reb_simulation* r512 = setup_sim_testparticles();
+    r512->integrator = REB_INTEGRATOR_WHFAST512;
+    r512->ri_whfast512.gr_potential = 1;
+    r512->ri_whfast512.keep_unsynchronized = 1;
+    
+    double tmax = 1e2;
+    struct reb_simulation* r512c = reb_copy_simulation(r512);
+    if (reb_integrate(r512c, 2.*tmax)>0) return 0;
+
+    if (reb_integrate(r512, tmax)>0) return 0;
+    reb_output_binary(r512, "test.bin");
+    if (reb_integrate(r512, 2.*tmax)>0) return 0;
+    
+    struct reb_simulation* r512c2 = reb_create_simulation_from_binary("test.bin");
+    if (r512c2 == NULL) return 0;
+    if (reb_integrate(r512c2, 2.*tmax)>0) return 0;
+
+    for (int i=0;i<r512->N;i++){
+        assert(r512->particles[i].x == r512c->particles[i].x);
+        assert(r512->particles[i].vx == r512c->particles[i].vx);
+        assert(r512->particles[i].x == r512c2->particles[i].x);
+        assert(r512->particles[i].vx == r512c2->particles[i].vx);
+    }
+
+    reb_free_simulation(r512);
+    reb_free_simulation(r512c);
+    reb_free_simulation(r512c2);
+    return 1;
+}
+
+int test_ensemble(int gr_potential){
+    // 13 simulations: one full group of 8 and one partially filled group
+    const int N_sims = 13;
+    struct reb_simulation* sims[13];
+    struct reb_simulation* sims512[13];
+    for (int s=0; s<N_sims; s++){
+        struct reb_simulation* r = reb_create_simulation();
+        r->dt = 4.0/365.25*2*M_PI;
+        r->exact_finish_time = 0;
+        r->integrator = REB_INTEGRATOR_WHFAST512;
+        r->ri_whfast512.gr_potential = gr_potential;
+        reb_add_fmt(r, "m", 1.);
+        reb_add_fmt(r, "m a e f", 1e-4, 0.5+0.01*s, 0.01, 0.1*s);
+        reb_add_fmt(r, "m a e f", 1e-3, 1.0+0.02*s, 0.02, 0.2*s);
+        reb_add_fmt(r, "m a e f", 2e-4, 2.0+0.03*s, 0.05, 0.3*s);
+        reb_move_to_com(r);
+        sims[s] = r;
+        sims512[s] = reb_copy_simulation(r);
+    }
+
+    double tmax = 1e2;
+    for (int s=0; s<N_sims; s++){
+        if (reb_integrate(sims512[s], tmax)>0) return 0;
+    }
+    if (reb_whfast512_ensemble_integrate(sims, N_sims, tmax)>0) return 0;
+
+    for (int s=0; s<N_sims; s++){
+        assert(sims[s]->t == sims512[s]->t);
+        assert(sims[s]->steps_done == sims512[s]->steps_done);
+        for (int i=0;i<sims[s]->N;i++){
+            if (fabs(sims[s]->particles[i].x - sims512[s]->particles[i].x)>1e-12){
+                printf("Accuracy not met in ensemble test.\n");
+                printf("%.16e\n",fabs(sims[s]->particles[i].x - sims512[s]->particles[i].x));
+                return 0;
+            }
+        }
+        reb_free_simulation(sims[s]);
+        reb_free_simulation(sims512[s]);
+    }
+    return 1;
+}
+
 int main(int argc, char* argv[]) {
     assert(test_basic());
     assert(test_restart());
     assert(test_com());
     assert(test_twobody());
     assert(test_gr());
+    assert(test_testparticles());
+    assert(test_testparticles_restart());
+    assert(test_ensemble(0));
+    assert(test_ensemble(1));
     printf("All tests passed.\n");
 }
@@ -83,11 +83,12 @@ class ParticleNotFound(Exception):
     """Particle was not found in the simulation."""
     pass
 
-from .tools import hash, mod2pi, M_to_f, E_to_f, M_to_E, spherical_to_xyz, xyz_to_spherical
-from .simulation import Simulation, Orbit, Variation, reb_simulation_integrator_saba, reb_simulation_integrator_whfast, reb_simulation_integrator_sei, reb_simulation_integrator_mercurius, reb_simulation_integrator_ias15, ODE, Rotation, Vec3d, _Vec3d
+from .tools import hash, mod2pi, M_to_f, E_to_f, M_to_E, M_to_f_array, M_to_E_array, spherical_to_xyz, xyz_to_spherical, read_columns, read_positions_quantized, read_collision_log
+from .simulation import Simulation, integrate_ensemble, integrate_ensemble_fork, orbits_to_cartesian, Orbit, Variation, reb_simulation_integrator_saba, reb_simulation_integrator_whfast, reb_simulation_integrator_sei, reb_simulation_integrator_mercurius, reb_simulation_integrator_ias15, ODE, Rotation, Vec3d, _Vec3d
 from .particle import Particle
 from .plotting import OrbitPlot, OrbitPlotSet
 from .simulationarchive import SimulationArchive
+from .ephemeris import Ephemeris
 
 import sys
 if "pyodide" in sys.modules:
@@ -97,4 +98,4 @@ if "pyodide" in sys.modules:
 else:
     from .interruptible_pool import InterruptiblePool
 
-__all__ = ["__libpath__", "__version__", "__build__", "__githash__", "SimulationArchive", "Simulation", "Orbit", "OrbitPlot", "OrbitPlotSet", "Particle", "SimulationError", "Encounter", "Collision", "Escape", "NoParticles", "ParticleNotFound", "InterruptiblePool","Variation", "reb_simulation_integrator_whfast", "reb_simulation_integrator_ias15", "reb_simulation_integrator_saba", "reb_simulation_integrator_sei","reb_simulation_integrator_mercurius", "clibrebound", "mod2pi", "M_to_f", "E_to_f", "M_to_E", "ODE", "Rotation", "Vec3d", "spherical_to_xyz", "xyz_to_spherical"]
+__all__ = ["__libpath__", "__version__", "__build__", "__githash__", "SimulationArchive", "Ephemeris", "Simulation", "integrate_ensemble", "integrate_ensemble_fork", "orbits_to_cartesian", "Orbit", "OrbitPlot", "OrbitPlotSet", "Particle", "SimulationError", "Encounter", "Collision", "Escape", "NoParticles", "ParticleNotFound", "InterruptiblePool","Variation", "reb_simulation_integrator_whfast", "reb_simulation_integrator_ias15", "reb_simulation_integrator_saba", "reb_simulation_integrator_sei","reb_simulation_integrator_mercurius", "clibrebound", "mod2pi", "M_to_f", "E_to_f", "M_to_E", "M_to_f_array", "M_to_E_array", "ODE", "Rotation", "Vec3d", "spherical_to_xyz", "xyz_to_spherical", "read_columns", "read_positions_quantized", "read_collision_log"]
@@ -0,0 +1,109 @@
+from ctypes import Structure, c_double, POINTER, c_int, c_long, c_uint32, c_char_p, byref
+from .simulation import Simulation
+from .particle import Particle
+from . import clibrebound
+
+class Ephemeris(Structure):
+    """
+    Ephemeris Class.
+
+    An ephemeris stores the trajectories of the massive bodies of a
+    simulation as piecewise Chebyshev polynomials. Simulations with an
+    ephemeris attached only integrate their test particles. The massive
+    bodies follow the precomputed trajectories and do not feel the test
+    particles. This is useful if many test particle simulations share
+    the same massive bodies. The massive bodies are integrated only once
+    and the test particle simulations can be run in parallel, for example
+    with `rebound.integrate_ensemble()`.
+
+    Only the IAS15 and LEAPFROG integrators support ephemerides.
+
+    Examples
+    --------
+
+    >>> sim = rebound.Simulation()
+    >>> sim.add(m=1.)
+    >>> sim.add(m=1e-3, a=1.)
+    >>> eph = rebound.Ephemeris(sim, tmax=100., segment=0.5)
+    >>> eph.save("ephemeris.bin")
+    >>> tp = rebound.Simulation()
+    >>> tp.ephemeris = eph
+    >>> tp.add(a=1.5)
+    >>> tp.integrate(100.)
+
+    """
+    _fields_ = [("N", c_int),
+                ("order", c_int),
+                ("segments_N", c_long),
+                ("t_start", c_double),
+                ("segment", c_double),
+                ("G", c_double),
+                ("_m", POINTER(c_double)),
+                ("_radius", POINTER(c_double)),
+                ("_hash", POINTER(c_uint32)),
+                ("_coefficients", POINTER(c_double))]
+
+    def __init__(self, sim=None, tmax=None, segment=None, order=12, filename=None):
+        """
+        Arguments
+        ---------
+        sim : Simulation
+            Simulation with the massive bodies (the first `N_active` particles).
+            The simulation is integrated to `tmax` to compute the ephemeris.
+            Alternatively, the filename of a previously saved ephemeris.
+        tmax : float
+            Time up to which the ephemeris is computed.
+        segment : float
+            Length of one Chebyshev segment in simulation time. Should be a
+            small fraction of the shortest orbital period.
+        order : int
+            Number of Chebyshev coefficients per coordinate and segment (2 to 32, default 12).
+        filename : str
+            Load the ephemeris from this file instead of computing it.
+        """
+        if isinstance(sim, str):
+            filename = sim
+        if filename is not None:
+            if clibrebound.reb_ephemeris_read(byref(self), c_char_p(filename.encode("ascii"))):
+                raise RuntimeError("Cannot read ephemeris from file %s." % filename)
+            return
+        if not isinstance(sim, Simulation) or tmax is None or segment is None:
+            raise ValueError("Need a simulation, tmax and segment to compute an ephemeris.")
+        ret = clibrebound.reb_ephemeris_compute(byref(self), byref(sim), c_double(tmax), c_double(segment), c_int(order))
+        sim.process_messages()
+        if ret:
+            raise RuntimeError("Could not compute the ephemeris.")
+
+    def __del__(self):
+        if self._b_needsfree_ == 1:
+            clibrebound.reb_free_ephemeris_pointers(byref(self))
+
+    def __repr__(self):
+        return '<{0}.{1} object at {2}, N={3}, t_start={4}, t_end={5}>'.format(self.__module__, type(self).__name__, hex(id(self)), self.N, self.t_start, self.t_end)
+
+    @property
+    def t_end(self):
+        """
+        End of the time range covered by the ephemeris.
+        """
+        return self.t_start + self.segments_N*self.segment
+
+    def save(self, filename):
+        """
+        Saves the ephemeris to a binary file.
+        """
+        if clibrebound.reb_ephemeris_write(byref(self), c_char_p(filename.encode("ascii"))):
+            raise RuntimeError("Cannot write ephemeris to file %s." % filename)
+
+    def evaluate(self, t):
+        """
+        Returns a list of particles with the positions, velocities and
+        accelerations of the massive bodies at time t.
+        """
+        particles = (Particle*self.N)()
+        clibrebound.reb_ephemeris_evaluate(byref(self), c_double(t), particles)
+        for i in range(self.N):
+            particles[i].m = self._m[i]
+            particles[i].r = self._radius[i]
+            particles[i].hash = self._hash[i]
+        return list(particles)
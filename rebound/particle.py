@@ -887,6 +887,20 @@ class Particle(Structure):
         else:
             raise AttributeError("Hash must be set to an integer, a ctypes.c_uint32 or a string. See UniquelyIdentifyingParticlesWithHashes.ipynb ipython_example.")
 
+    @property
+    def frozen(self):
+        """
+        True if the particle is frozen. Use Simulation.freeze() to freeze a particle.
+        """
+        return (self._frozen & 1)==1
+
+    @property
+    def asleep(self):
+        """
+        True if the particle is asleep. See Simulation.sleep_v.
+        """
+        return (self._frozen & 2)==2
+
     def _cpcoords(self, p):
         """
         Copy coordinates (and only coordinates) from particle p to self
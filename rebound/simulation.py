@@ -1,11 +1,12 @@
-from ctypes import Structure, c_double, POINTER, c_uint32, c_float, c_int, c_uint, c_uint32, c_int64, c_long, c_ulong, c_ulonglong, c_void_p, c_char_p, CFUNCTYPE, byref, create_string_buffer, addressof, pointer, cast
+from ctypes import Structure, c_double, POINTER, c_uint32, c_float, c_int, c_uint, c_uint32, c_int64, c_long, c_ulong, c_ulonglong, c_size_t, c_void_p, c_char_p, CFUNCTYPE, byref, create_string_buffer, addressof, pointer, cast, Array
 from . import clibrebound, Escape, NoParticles, Encounter, Collision, SimulationError, ParticleNotFound, M_to_E
 from .citations import cite
 from .particle import Particle
 from .units import units_convert_particle, check_units, convert_G, hash_to_unit
-from .tools import hash as rebhash
+from .tools import hash as rebhash, output_columns_mask, OUTPUT_QUANTIZED_FORMATS
 import math
 import os
+import re
 import sys
 import ctypes.util
 import warnings
@@ -21,11 +22,14 @@ import types
 ### The following enum and class definitions need to
 ### consitent with those in rebound.h
         
-INTEGRATORS = {"ias15": 0, "whfast": 1, "sei": 2, "leapfrog": 4, "none": 7, "janus": 8, "mercurius": 9, "saba": 10, "eos": 11, "bs": 12, "tes": 20, "whfast512":21}
+INTEGRATORS = {"ias15": 0, "whfast": 1, "sei": 2, "leapfrog": 4, "none": 7, "janus": 8, "mercurius": 9, "saba": 10, "eos": 11, "bs": 12, "tes": 20, "whfast512":21, "block":22}
 BOUNDARIES = {"none": 0, "open": 1, "periodic": 2, "shear": 3}
-GRAVITIES = {"none": 0, "basic": 1, "compensated": 2, "tree": 3, "mercurius": 4, "jacobi": 5}
-COLLISIONS = {"none": 0, "direct": 1, "tree": 2, "mercurius": 3, "line": 4, "linetree": 5}
+GRAVITIES = {"none": 0, "basic": 1, "compensated": 2, "tree": 3, "mercurius": 4, "jacobi": 5, "fmm": 6, "auto": 7, "ewald": 8}
+COLLISIONS = {"none": 0, "direct": 1, "tree": 2, "mercurius": 3, "line": 4, "linetree": 5, "grid": 6, "sap": 7, "linesap": 8, "neighbourlist": 9, "auto": 10, "lineauto": 11, "activelist": 12, "bvh": 13, "linebvh": 14}
 VISUALIZATIONS = {"none": 0, "opengl": 1, "webgl": 2}
+PROFILING_SCOPES = {"step": 0, "integrator part1": 1, "integrator part2": 2, "kepler": 3, "interaction": 4, "jump": 5, "coordinates": 6, "boundary": 7, "tree build": 8, "tree moments": 9, "gravity": 10, "additional forces": 11, "collision search": 12, "collision resolve": 13, "heartbeat": 14, "io": 15, "mpi": 16}
+MEMORY_SUBSYSTEMS = {"particles": 0, "lookup table": 1, "gravity": 2, "tree": 3, "collision": 4, "boundary": 5, "integrator": 6, "mpi": 7, "display": 8, "other": 9}
+PROFILING_COUNTERS = {"cycles": 0, "instructions": 1, "cache references": 2, "cache misses": 3, "branch misses": 4}
 WHFAST_KERNELS = {"default": 0, "modifiedkick": 1, "composition": 2, "lazy": 3}
 WHFAST_COORDINATES = {"jacobi": 0, "democraticheliocentric": 1, "whds": 2}
 SABA_TYPES = {
@@ -47,6 +51,9 @@ EOS_TYPES = {
         "pmlf6": 0x08,
         }
 
+# Groups of fields that can be skipped when loading a simulation (see enum REB_INPUT_SKIP)
+INPUT_SKIP = {"ias15": 1, "tes": 2}
+
 # Format: Majorerror, id, message
 BINARY_WARNINGS = [
     (True,  1, "Cannot read binary file. Check filename and file contents."),
@@ -393,12 +400,69 @@ class reb_collision(Structure):
     _fields_ = [("p1", c_int),
                 ("p2", c_int),
                 ("gb", reb_ghostbox),
-                ("ri", c_int)]
+                ("ri", c_int),
+                ("t", c_double)]
     
     def __repr__(self):
         return '<{0}.{1} object at {2}, p1={3}, p2={4}>'.format(self.__module__, type(self).__name__, hex(id(self)), self.p1, self.p2)
     
 
+class reb_collision_statistics(Structure):
+    """
+    Work done by the last collision search. Only updated if 
+    ``track_collision_statistics`` is set.
+    """
+    _fields_ = [("pairs", c_long),
+                ("nodes", c_long),
+                ("ghostboxes", c_long),
+                ("hits", c_long),
+                ("resolved", c_long),
+                ("removed", c_long)]
+    
+    def __repr__(self):
+        return '<{0}.{1} object at {2}, pairs={3}, nodes={4}, ghostboxes={5}, hits={6}, resolved={7}, removed={8}>'.format(self.__module__, type(self).__name__, hex(id(self)), self.pairs, self.nodes, self.ghostboxes, self.hits, self.resolved, self.removed)
+    
+
+class reb_memory_report(Structure):
+    """
+    Heap memory allocated by a simulation, in bytes per subsystem.
+    See ``Simulation.memory_usage()``.
+    """
+    _fields_ = [("bytes", c_size_t*10),
+                ("total", c_size_t)]
+
+
+class reb_compact_particles(Structure):
+    """
+    Massless test particles stored in single precision.
+    See ``Simulation.compact_add()``.
+    """
+    _fields_ = [("N", c_int),
+                ("_allocatedN", c_int),
+                ("_precision", c_int),
+                ("N_removed", c_long),
+                ("_origin", POINTER(c_double)),
+                ("_xyz", POINTER(c_float)),
+                ("_vxyz", POINTER(c_float)),
+                ("_r", POINTER(c_float)),
+                ("_hash", POINTER(c_uint32))]
+
+
+class reb_autotune(Structure):
+    """
+    Internal state of the automatic selection of the gravity or collision 
+    routine (``'auto'`` and ``'lineauto'``). 
+    """
+    _fields_ = [("mode", c_int),
+                ("selected", c_int),
+                ("candidates", c_int*8),
+                ("candidates_N", c_int),
+                ("current", c_int),
+                ("steps", c_int),
+                ("time", c_double*8),
+                ("N", c_int),
+                ("threads", c_int)]
+
 class reb_simulation_integrator_sei(Structure):
     """
     This class is an abstraction of the C-struct reb_simulation_integrator_sei.
@@ -448,6 +512,15 @@ class reb_simulation_integrator_ias15(Structure):
     :ivar float epsilon_global:          
         Determines how the adaptive timestep is chosen. 
     
+    :ivar int testparticle_substeps:          
+        If set to 1, test particles (with testparticle_type 0) are not included
+        in the timestep criterion. Test particles which need a smaller timestep 
+        are integrated individually with substeps.
+    
+    :ivar int testparticle_compensated:          
+        If set to 0, test particles (particles with an index of at least 
+        N_active) use plain instead of compensated summation. Default: 1.
+    
     """
     def __repr__(self):
         return '<{0}.{1} object at {2}, dt_mode={3}, epsilon={4}, min_dt={5}>'.format(self.__module__, type(self).__name__, hex(id(self)), self.dt_mode, self.epsilon, self.min_dt)
@@ -457,6 +530,8 @@ class reb_simulation_integrator_ias15(Structure):
                 ("min_dt", c_double),
                 ("epsilon_global", c_uint),
                 ("dt_mode", c_uint),
+                ("testparticle_substeps", c_uint),
+                ("testparticle_compensated", c_uint),
                 ("_iterations_max_exceeded", c_ulong),
                 ("_allocatedN", c_int),
                 ("_at", POINTER(c_double)),
@@ -580,6 +655,18 @@ class reb_simulation_integrator_whfast(Structure):
         If you set safe_mode to 0, the speed and accuracy of WHFast improve.
         However, make sure you are aware of the consequences. Read the iPython tutorial
         on advanced WHFast usage to learn more.
+    :ivar int testparticle_partitions:
+        If larger than 0, the test particles (type 0) are split into this
+        many contiguous partitions. Each partition is drifted, kicked and
+        transformed by one thread in a single pass per timestep while
+        the massive bodies are advanced only once and shared read-only.
+        Requires democratic heliocentric or WHDS coordinates, the default
+        kernel and BASIC gravity. Default is 0 (off).
+    :ivar int kepler_warmstart:
+        If set to 1, the Kepler solver corrects its initial guess by the 
+        error the guess had in the previous step. This saves iterations 
+        but the results are not bit-wise identical to those with the flag 
+        turned off. Also used by SABA. Default is 0 (off).
     """
     _fields_ = [("corrector", c_uint),
                 ("corrector2", c_uint),
@@ -588,8 +675,12 @@ class reb_simulation_integrator_whfast(Structure):
                 ("recalculate_coordinates_this_timestep", c_uint),
                 ("safe_mode", c_uint),
                 ("keep_unsynchronized", c_uint),
+                ("testparticle_partitions", c_uint),
+                ("kepler_warmstart", c_uint),
+                ("_testparticles_deferred", c_uint),
                 ("_p_jh", POINTER(Particle)),
                 ("_p_temp", POINTER(Particle)),
+                ("_kepler_guess", POINTER(c_double)),
                 ("is_synchronized", c_uint),
                 ("_allocatedN", c_uint),
                 ("_allocatedNtmp", c_uint),
@@ -792,6 +883,12 @@ class Simulation(Structure):
     
     >>> sim = rebound.Simulation(filename="archive.bin", snapshot=34)
 
+    If you only need the particles (for example for analysis), you can 
+    skip reading the integrator's internal state. It is rebuilt 
+    from the particles if you integrate the simulation further.
+
+    >>> sim = rebound.Simulation("archive.bin", skip=["ias15", "tes"])
+
     """
     def __new__(cls, *args, **kw):
         # Handle arguments
@@ -805,6 +902,12 @@ class Simulation(Structure):
             snapshot = args[1]
         if "snapshot" in kw:
             snapshot = kw["snapshot"]
+        skip = 0
+        for group in kw.get("skip", []):
+            try:
+                skip |= INPUT_SKIP[group.lower()]
+            except KeyError:
+                raise ValueError("Unknown field group '%s'. Valid groups are: %s." % (group, ", ".join(INPUT_SKIP)))
        
         # Create simulation
         if filename is None:
@@ -818,7 +921,7 @@ class Simulation(Structure):
             sim = super(Simulation,cls).__new__(cls)
             clibrebound.reb_init_simulation(byref(sim))
             w = sa.warnings # warnings will be appended to previous warnings (as to not repeat them) 
-            clibrebound.reb_create_simulation_from_simulationarchive_with_messages(byref(sim),byref(sa),c_int(snapshot),byref(w))
+            clibrebound.reb_create_simulation_from_simulationarchive_with_skip(byref(sim),byref(sa),c_int(snapshot),c_uint(skip),byref(w))
             for majorerror, value, message in BINARY_WARNINGS:
                 if w.value & value:
                     if majorerror:
@@ -828,7 +931,7 @@ class Simulation(Structure):
                         warnings.warn(message, RuntimeWarning)
             return sim
 
-    def __init__(self,filename=None,snapshot=None):
+    def __init__(self,filename=None,snapshot=None,skip=None):
         self.save_messages = 1 # Warnings will be checked within python
 
     def __repr__(self):
@@ -983,6 +1086,7 @@ class Simulation(Structure):
         if modes != 1:
             raise AttributeError("Need to specify either interval, walltime, or step")
         if deletefile and os.path.isfile(filename):
+            self.simulationarchive_flush()
             os.remove(filename)
             
             # reset intervals so that automate functions C set sim->next consistently
@@ -1013,10 +1117,20 @@ class Simulation(Structure):
 
         """
         if deletefile and os.path.isfile(filename):
+            self.simulationarchive_flush()
             os.remove(filename)
         clibrebound.reb_simulationarchive_snapshot(byref(self), c_char_p(filename.encode("ascii")))
         self.process_messages()
 
+    def simulationarchive_flush(self):
+        """
+        Waits until all snapshots have been written to the SimulationArchive.
+        This is only needed if simulationarchive_async is set to 1 and the 
+        SimulationArchive is read while the simulation still exists. 
+        """
+        clibrebound.reb_simulationarchive_flush(byref(self))
+        self.process_messages()
+
     @property
     def simulationarchive_filename(self):
         """
@@ -1150,6 +1264,17 @@ class Simulation(Structure):
         ode_p = clibrebound.reb_create_ode(byref(self), c_int(length))
         ode_p.contents.needs_nbody = c_int(needs_nbody)
         return ODE.from_address(ctypes.addressof(ode_p.contents))
+    
+    def create_ode_batch(self, length, N, needs_nbody=True):
+        """
+        Creates one ODE which holds N identical systems with length components each.
+        System i uses the components y[i*length] to y[(i+1)*length-1].
+        The derivatives function is called once for all systems.
+        """
+        clibrebound.reb_create_ode_batch.restype = POINTER(ODE)
+        ode_p = clibrebound.reb_create_ode_batch(byref(self), c_uint(length), c_uint(N))
+        ode_p.contents.needs_nbody = c_int(needs_nbody)
+        return ODE.from_address(ctypes.addressof(ode_p.contents))
 
 # Status functions
     def status(self):
@@ -1192,6 +1317,48 @@ class Simulation(Structure):
         self._afp = AFF(func)
         self._additional_forces = self._afp
 
+    @property
+    def additional_forces_soa(self):
+        """
+        Get or set a function for calculating additional forces which 
+        works on arrays rather than on individual particles.
+
+        A python function set here is called with four arguments: a 
+        pointer to the simulation, and three numpy arrays with shape 
+        (3,N) for the positions, velocities, and accelerations of the 
+        N = sim.N - sim.N_var real particles. For example, pos[0] 
+        contains the x coordinates of all particles. The function needs 
+        to write the additional accelerations into the third array which 
+        is set to zero before the call. REBOUND adds them to the 
+        particles afterwards. This allows the forces to be calculated 
+        with numpy expressions rather than by looping over particles.
+
+        Alternatively, the argument can be a C function of type 
+        CFUNCTYPE(None,POINTER(Simulation),c_int,POINTER(c_double),POINTER(c_double),POINTER(c_double)).
+        As for additional_forces, the flag force_is_velocity_dependent 
+        needs to be set to 1 if the forces depend on the velocities.
+
+        Examples
+        --------
+        A simple drag force:
+
+        >>> def drag(simp, pos, vel, acc):
+        >>>     acc[:] = -1e-3*vel
+        >>> sim.additional_forces_soa = drag
+        >>> sim.force_is_velocity_dependent = 1
+        """
+        raise AttributeError("You can only set C function pointers from python.")
+    @additional_forces_soa.setter
+    def additional_forces_soa(self, func):
+        if isinstance(func, ctypes._CFuncPtr):
+            self._afsoap = ctypes.cast(func, AFSOAFF)
+        else:
+            import numpy as np
+            def wrapper(simp, N, pos, vel, acc):
+                func(simp, np.ctypeslib.as_array(pos, shape=(3,N)), np.ctypeslib.as_array(vel, shape=(3,N)), np.ctypeslib.as_array(acc, shape=(3,N)))
+            self._afsoap = AFSOAFF(wrapper)
+        self._additional_forces_soa = self._afsoap
+
     @property
     def pre_timestep_modifications(self):
         """
@@ -1233,6 +1400,10 @@ class Simulation(Structure):
 
         The function called will receive a pointer to the simulation
         object as its argument.
+
+        If heartbeat_async is set to 1 (skip if busy) or 2 (block if busy),
+        the function runs on a helper thread and receives a read-only copy
+        of the simulation instead.
         
         Examples
         --------
@@ -1256,6 +1427,77 @@ class Simulation(Structure):
         self._hb = AFF(func)
         self._heartbeat = self._hb
 
+    @property
+    def ephemeris(self):
+        """
+        Get or set the ephemeris of the massive bodies (see `rebound.Ephemeris`).
+
+        Setting the ephemeris adds the massive bodies to the simulation, which
+        needs to be empty. Test particles can be added afterwards. The massive 
+        bodies then follow the ephemeris and only the test particles are 
+        integrated. Only IAS15 and LEAPFROG are supported.
+        The ephemeris is not stored in binary files. Copies of the simulation
+        share the same ephemeris.
+        """
+        return getattr(self, "_ephemeris_ref", None)
+    @ephemeris.setter
+    def ephemeris(self, eph):
+        clibrebound.reb_attach_ephemeris(byref(self), byref(eph))
+        self.process_messages()
+        # Keep a reference so that the ephemeris outlives the simulation
+        self._ephemeris_ref = eph
+
+    @property
+    def memory_grown(self):
+        """
+        Set a function pointer which is called at the end of a timestep
+        if any subsystem allocated more memory during that timestep.
+
+        The function receives a pointer to the simulation and a pointer
+        to a `reb_memory_report` with the new number of bytes per subsystem.
+
+        Examples
+        --------
+
+        >>> def memory_grown(simp, report):
+        >>>     print(report.contents.total)
+        >>> sim.memory_grown = memory_grown
+
+        """
+        raise AttributeError("You can only set C function pointers from python.")
+    @memory_grown.setter
+    def memory_grown(self, func):
+        self._mgfp = MGFF(func)
+        self._memory_grown = self._mgfp
+
+    @property
+    def injector(self):
+        """
+        Set a function pointer which creates new test particles.
+
+        The function is called `inject_rate*dt` times per timestep on average, 
+        at the beginning of the timestep. It receives a pointer to the simulation 
+        and a pointer to a particle which it needs to fill in. The particles are 
+        added with `inject()`, so they reuse free slots of removed particles 
+        (see `sink()` and `inject_pool`).
+
+        Examples
+        --------
+
+        >>> import random
+        >>> def injector(simp, pp):
+        >>>     sim = simp.contents
+        >>>     pp[0] = rebound.Particle(simulation=sim, primary=sim.particles[0], a=1.+random.random())
+        >>> sim.injector = injector
+        >>> sim.inject_rate = 100.
+
+        """
+        raise AttributeError("You can only set C function pointers from python.")
+    @injector.setter
+    def injector(self, func):
+        self._injfp = INJFF(func)
+        self._injector = self._injfp
+
     @property 
     def coefficient_of_restitution(self):
         """
@@ -1293,6 +1535,38 @@ class Simulation(Structure):
             self._colrfp = COLRFF(func)
             self._collision_resolve = self._colrfp
     
+    @property 
+    def collision_resolve_batch(self):
+        """
+        Get or set a function pointer for a batched collision resolving routine.
+        If set, the function is called only once per timestep with all collisions 
+        and collision_resolve is ignored. The function receives a pointer to the 
+        simulation, a pointer to the collision array, the number of collisions and
+        a pointer to an integer array in which the outcome of every collision has
+        to be stored (same meaning as the return value of collision_resolve).
+        
+        Possible options for setting:
+          1) Function pointer
+          2) "merge": same as "merge" for collision_resolve
+          3) "hardsphere": same as "hardsphere" for collision_resolve
+          4) None: use collision_resolve
+        """
+        raise AttributeError("You can only set C function pointers from python.")
+    @collision_resolve_batch.setter
+    def collision_resolve_batch(self, func):
+        if func == "merge":
+            clibrebound.reb_set_collision_resolve_batch.restype = None
+            clibrebound.reb_set_collision_resolve_batch(byref(self), clibrebound.reb_collision_resolve_merge_batch)
+        elif func == "hardsphere":
+            clibrebound.reb_set_collision_resolve_batch.restype = None
+            clibrebound.reb_set_collision_resolve_batch(byref(self), clibrebound.reb_collision_resolve_hardsphere_batch)
+        elif func is None:
+            self._colrbfp = None
+            self._collision_resolve_batch = COLRBFF()
+        else:
+            self._colrbfp = COLRBFF(func)
+            self._collision_resolve_batch = self._colrbfp
+    
     @property 
     def free_particle_ap(self):
         """
@@ -1335,6 +1609,7 @@ class Simulation(Structure):
         - ``'EOS'`` 
         - ``'BS'`` 
         - ``'TES'``
+        - ``'BLOCK'``
         - ``'none'``
         
         Check the online documentation for a full description of each of the integrators. 
@@ -1420,6 +1695,8 @@ class Simulation(Structure):
         - ``'basic'`` (default)
         - ``'compensated'``
         - ``'tree'``
+        - ``'fmm'``
+        - ``'auto'`` (times the routines which can be used and selects the fastest one)
         
         Check the online documentation for a full description of each of the modules. 
         """
@@ -1450,7 +1727,15 @@ class Simulation(Structure):
         - ``'direct'``
         - ``'tree'``
         - ``'mercurius'`` 
-        - ``'direct'``
+        - ``'line'``
+        - ``'linetree'``
+        - ``'grid'``
+        - ``'sap'``
+        - ``'linesap'``
+        - ``'neighbourlist'``
+        - ``'auto'`` (times the routines which check for overlaps and selects the fastest one)
+        - ``'lineauto'`` (times the line based routines and selects the fastest one)
+        - ``'activelist'`` (neighbour list of the active particles, test particle pairs are skipped)
         
         Check the online documentation for a full description of each of the modules. 
         """
@@ -1651,16 +1936,29 @@ class Simulation(Structure):
         3) The primary as a Particle structure, the particle's mass and a set of orbital elements: primary,m,a,anom,e,omega,inv,Omega,MEAN (see :class:`.Orbit` for the definition of orbital elements).
         4) A name of an object (uses NASA Horizons to look up coordinates)
         5) A list of particles or names.
+        6) A ctypes array of Particle structures, e.g. (rebound.Particle*N)(). 
+           A NumPy structured array can be filled through numpy.ctypeslib.as_array(). 
+
+        Lists of Particle structures and ctypes arrays are added in one call to
+        reb_add_many() which grows the particle array only once.
         """
         if particle is not None:
             if isinstance(particle, Particle):
-                if (self.gravity == "tree" or self.collision == "tree") and self.root_size <=0.:
+                if (self.gravity == "tree" or self.gravity == "fmm" or self.collision == "tree") and self.root_size <=0.:
                     raise ValueError("The tree code for gravity and/or collision detection has been selected. However, the simulation box has not been configured yet. You cannot add particles until the the simulation box has a finite size.")
 
                 clibrebound.reb_add(byref(self), particle)
+            elif isinstance(particle, Array) and getattr(particle, "_type_", None) is Particle:
+                if (self.gravity == "tree" or self.gravity == "fmm" or self.collision == "tree") and self.root_size <=0.:
+                    raise ValueError("The tree code for gravity and/or collision detection has been selected. However, the simulation box has not been configured yet. You cannot add particles until the the simulation box has a finite size.")
+                clibrebound.reb_add_many(byref(self), particle, c_int(len(particle)))
+                self.process_messages()
             elif isinstance(particle, list):
-                for p in particle:
-                    self.add(p, **kwargs)
+                if len(kwargs)==0 and len(particle)>0 and all(isinstance(p, Particle) for p in particle):
+                    self.add((Particle*len(particle))(*particle))
+                else:
+                    for p in particle:
+                        self.add(p, **kwargs)
             elif isinstance(particle,str):
                 if self.python_unit_l == 0 or self.python_unit_m == 0 or self.python_unit_t == 0:
                     self.units = ('AU', 'yr2pi', 'Msun')
@@ -1683,6 +1981,60 @@ class Simulation(Structure):
         if hasattr(self, '_widgets'):
             self._display_heartbeat(pointer(self))
 
+    def add_many(self, a, e=0., inc=0., Omega=0., omega=0., f=None, M=None, m=0., r=None, primary=None):
+        """
+        Adds many particles with orbital elements at once.
+
+        The orbital elements are converted to Cartesian coordinates with
+        one call to the C library (using OpenMP if enabled) and all 
+        particles are then added with reb_add_many(), which grows the 
+        particle array only once. This is much faster than calling add() 
+        for every particle, for example to set up a disc with 10^6 test 
+        particles. The arguments can be numpy arrays or scalars; they are 
+        broadcast against each other. See also orbits_to_cartesian().
+
+        Parameters
+        ----------
+        a, e, inc, Omega, omega : float or array
+            Semi-major axis, eccentricity, inclination, longitude of the 
+            ascending node, and argument of pericenter.
+        f, M : float or array, optional
+            True or mean anomaly. Only one of them can be passed. Default: f=0.
+        m, r : float or array, optional
+            Masses and radii of the particles. Default: 0.
+        primary : Particle, int or str, optional
+            The primary shared by all orbits. Default: the center of mass 
+            of the particles in the simulation before the call. 
+
+        Examples
+        --------
+
+        >>> a = np.random.uniform(1., 2., 1000000)
+        >>> sim.add_many(a=a, e=0.01, f=np.random.uniform(0., 2.*np.pi, len(a)))
+
+        """
+        if (self.gravity == "tree" or self.gravity == "fmm" or self.collision == "tree") and self.root_size <=0.:
+            raise ValueError("The tree code for gravity and/or collision detection has been selected. However, the simulation box has not been configured yet. You cannot add particles until the the simulation box has a finite size.")
+        if primary is None:
+            clibrebound.reb_get_com.restype = Particle
+            primary = clibrebound.reb_get_com(byref(self))
+        elif isinstance(primary, (str,int)):
+            primary = self.particles[primary]
+        particles = _orbits_to_particles(self.G, primary, a, e, inc, Omega, omega, f, M, m, r)
+        clibrebound.reb_add_many(byref(self), particles, c_int(len(particles)))
+        self.process_messages()
+        if hasattr(self, '_widgets'):
+            self._display_heartbeat(pointer(self))
+
+    def reserve(self, N):
+        """
+        Preallocates memory for at least N particles. 
+
+        Calling this function before adding a large number of particles 
+        one by one avoids repeatedly reallocating the particle array.
+        """
+        clibrebound.reb_reserve(byref(self), c_int(N))
+
 # Particle getter functions
     @property
     def particles(self):
@@ -1740,6 +2092,184 @@ class Simulation(Structure):
 
         self.process_messages()
 
+    def remove_many(self, indices=None, hashes=None, keepSorted=True):
+        """ 
+        Removes several particles from the simulation at once.
+
+        This is much faster than calling remove() repeatedly if many particles are removed, 
+        because the particles array is only compacted once. 
+
+        Parameters
+        ----------
+        indices : list of int, optional
+            Indices of the particles to remove. All indices refer to the particles array before any particle is removed.
+        hashes : list of c_uint32, int or string, optional
+            Hashes of the particles to remove (if a string is passed, the corresponding hash is calculated).
+        keepSorted : bool, optional
+            By default, the order of the remaining particles is preserved. 
+        """
+        if indices is not None:
+            indices = list(indices)
+            clibrebound.reb_remove_many(byref(self), (c_int*len(indices))(*indices), len(indices), keepSorted)
+        if hashes is not None:
+            values = []
+            for h in hashes:
+                if isinstance(h, str):
+                    values.append(rebhash(h).value)
+                elif isinstance(h, int):
+                    values.append(c_uint32(h).value)
+                else:
+                    values.append(h.value)
+            clibrebound.reb_remove_by_hash_many(byref(self), (c_uint32*len(values))(*values), len(values), keepSorted)
+        if hasattr(self, '_widgets'):
+            self._display_heartbeat(pointer(self))
+
+        self.process_messages()
+
+    def _particle_index(self, index, hash):
+        if hash is not None:
+            return self.particles[hash].index
+        return index
+
+    def freeze(self, index=None, hash=None):
+        """
+        Freezes a test particle.
+
+        Frozen particles keep their index, position and velocity, but they are 
+        skipped by the integrators and the gravity routines, and they do not collide.
+        Unlike remove(), freezing does not change the index of any other particle.
+        Frozen particles can later be removed all at once with remove_frozen().
+        Only test particles (index >= N_active) can be frozen.
+
+        Parameters
+        ----------
+        index : int, optional
+            Specify particle to freeze by index.
+        hash : c_uint32, int or string, optional
+            Specifiy particle to freeze by hash.
+        """
+        clibrebound.reb_freeze(byref(self), self._particle_index(index, hash))
+        self.process_messages()
+
+    def unfreeze(self, index=None, hash=None):
+        """
+        Unfreezes a particle previously frozen with freeze(). 
+        
+        The particle continues its orbit from where it was frozen. 
+        """
+        clibrebound.reb_unfreeze(byref(self), self._particle_index(index, hash))
+        self.process_messages()
+
+    def remove_frozen(self):
+        """
+        Removes all frozen particles at once and returns the number of removed particles.
+        
+        The order of the remaining particles is preserved.
+        """
+        N = clibrebound.reb_remove_frozen(byref(self))
+        self.process_messages()
+        return N
+
+    def compact_add(self, particle=None, **kwargs):
+        """
+        Adds a compact test particle. Accepts the same arguments as add().
+
+        Compact test particles are massless and stored in single precision 
+        (32 instead of 128 bytes per particle). They feel the gravity of the 
+        active particles but no additional forces, and they are integrated 
+        with the LEAPFROG integrator. They are removed if they hit an active 
+        particle (if collisions are enabled) or leave an open box. 
+        Use this for very large numbers of dust particles. See also 
+        compact_precision.
+        """
+        if particle is None:
+            particle = Particle(simulation=self, **kwargs)
+        elif isinstance(particle, list):
+            for p in particle:
+                self.compact_add(p, **kwargs)
+            return
+        elif not isinstance(particle, Particle):
+            raise ValueError("Argument passed to compact_add() not supported.")
+        clibrebound.reb_compact_add(byref(self), particle)
+        self.process_messages()
+
+    def compact_particle(self, index):
+        """
+        Returns a copy of the compact test particle with the given index 
+        as a Particle in double precision.
+        """
+        if index<0:
+            index += self.compact.N
+        if index<0 or index>=self.compact.N:
+            raise IndexError("Index out of range.")
+        clibrebound.reb_compact_get.restype = Particle
+        return clibrebound.reb_compact_get(byref(self), c_int(index))
+
+    @property
+    def N_compact(self):
+        """
+        Number of compact test particles (see compact_add()).
+        """
+        return self.compact.N
+
+    @property
+    def compact_precision(self):
+        """
+        Get or set the storage format of the compact test particles.
+
+        - ``'float32'`` (default): positions and velocities are stored as float.
+        - ``'chunked'``: positions and velocities are stored as float relative 
+          to a double precision origin shared by 256 consecutive particles. 
+          This is more accurate if consecutive particles are close to each 
+          other, for example if they have been released from the same source.
+
+        Can only be changed before compact test particles are added.
+        """
+        return ["float32", "chunked"][self.compact._precision]
+    @compact_precision.setter
+    def compact_precision(self, value):
+        formats = {"float32": 0, "chunked": 1}
+        if value not in formats:
+            raise ValueError("Compact precision not supported. Use 'float32' or 'chunked'.")
+        if self.compact.N and formats[value]!=self.compact._precision:
+            raise RuntimeError("The storage format cannot be changed once compact test particles have been added.")
+        self.compact._precision = formats[value]
+
+    def sink(self, index=None, hash=None):
+        """
+        Removes a test particle without changing the index of any other particle.
+
+        If frozen particles are supported (see freeze()), the particle becomes a 
+        frozen free slot which is reused by the next call to inject(). Otherwise 
+        it is removed with remove(). If `inject_pool` is larger than 0, test 
+        particles removed in collisions become free slots as well.
+
+        Parameters
+        ----------
+        index : int, optional
+            Specify particle to remove by index.
+        hash : c_uint32, int or string, optional
+            Specifiy particle to remove by hash.
+        """
+        success = clibrebound.reb_sink(byref(self), self._particle_index(index, hash))
+        self.process_messages()
+        return success==1
+
+    def inject(self, particle=None, **kwargs):
+        """
+        Adds a test particle and returns its index. Accepts the same arguments as add().
+
+        The particle is added in the first free slot left by sink() or at the end 
+        of the particle array if there is no free slot.
+        """
+        if particle is None:
+            particle = Particle(simulation=self, **kwargs)
+        elif not isinstance(particle, Particle):
+            raise ValueError("Argument passed to inject() not supported.")
+        index = clibrebound.reb_inject(byref(self), particle)
+        self.process_messages()
+        return index
+
     def particles_ascii(self, prec=8):
         """
         Returns an ASCII string with all particles' masses, radii, positions and velocities.
@@ -1819,6 +2349,50 @@ class Simulation(Structure):
 
         return orbits
 
+    def calculate_orbits_array(self, primary=None):
+        """
+        Calculate orbital parameters for all particles in the simulation
+        and return them as numpy arrays.
+
+        This function does the same as calculate_orbits() but converts all
+        particles with one call to the C library, using OpenMP if enabled. 
+        It is much faster for a large number of particles, e.g. test particles 
+        in a debris disk. Particles for which the orbit can not be calculated
+        have NaN elements instead of raising an exception.
+        Jacobi masses are not supported.
+
+        Parameters
+        ----------
+
+        primary     : rebound.Particle, optional
+            Set the primary against which to reference the osculating orbits. Default (use Jacobi center of mass).
+            For heliocentric coordinates, pass the central object to this parameter. 
+
+        Returns
+        -------
+        A dictionary with one numpy array of length N-1 for each float attribute 
+        of rebound.Orbit (e.g. "a", "e", "inc", "Omega", "omega", "f", "l", "P").
+
+        Examples
+        --------
+
+        >>> orbits = sim.calculate_orbits_array(primary=sim.particles[0])
+        >>> print(orbits["e"].max())
+
+        """
+        import numpy as np
+        N = self.N_real
+        if N < 2:
+            return {name: np.zeros(0) for name, ctype in Orbit._fields_ if ctype is c_double}
+        orbits = (Orbit*N)()
+        if primary is None:
+            clibrebound.reb_tools_particles_to_orbits_err(c_double(self.G), self._particles, None, c_int(0), c_int(N), orbits, None)
+        else:
+            clibrebound.reb_tools_particles_to_orbits_err(c_double(self.G), self._particles, byref(primary), c_int(1), c_int(N), orbits, None)
+        size = ctypes.sizeof(Orbit)
+        data = np.ndarray((N-1, size//ctypes.sizeof(c_double)), dtype=np.float64, buffer=orbits, offset=size)
+        return {name: data[:,getattr(Orbit, name).offset//ctypes.sizeof(c_double)].copy() for name, ctype in Orbit._fields_ if ctype is c_double}
+
 # COM calculation 
     def calculate_com(self, first=0, last=None):
         """
@@ -1967,6 +2541,59 @@ class Simulation(Structure):
 
         clibrebound.reb_set_serialized_particle_data(byref(self), d["hash"], d["m"], d["r"], d["xyz"], d["vxvyvz"], d["xyzvxvyvz"])
 
+    def particle_view(self, key):
+        """
+        Returns a numpy array which is a view onto the particle data.
+
+        Unlike serialize_particle_data(), no data is copied. The array
+        points directly to the memory of the particle array on the C side
+        using a stride of sizeof(struct reb_particle). Changes made to
+        the array are immediately seen by the simulation and vice versa.
+
+        Possible keys are "x", "y", "z", "vx", "vy", "vz", "ax", "ay",
+        "az", "m", "r", "lastcollision", and "hash" which return arrays
+        of length sim.N, as well as "xyz", "vxvyvz", and "xyzvxvyvz"
+        which return arrays with shape (sim.N,3) and (sim.N,6).
+        The datatype for the "hash" array is uint32, all other arrays
+        have a datatype of float64.
+
+        The view becomes invalid as soon as the particle array gets
+        reallocated, for example when particles are added or removed.
+        Using the array after that point accesses freed memory.
+        Request a new view after changing the number of particles.
+
+        Examples
+        --------
+        This shifts all particles in the x direction:
+
+        >>> x = sim.particle_view("x")
+        >>> x += 1.
+
+        To get the positions of all particles as an array with shape (sim.N,3):
+
+        >>> xyz = sim.particle_view("xyz")
+        >>> print(xyz)
+
+        """
+        import numpy as np
+        N = self.N
+        size = ctypes.sizeof(Particle)
+        dsize = ctypes.sizeof(c_double)
+        if key == "hash":
+            dtype, offset, shape, strides = np.uint32, Particle._hash.offset, (N,), (size,)
+        elif key in ["xyz", "vxvyvz", "xyzvxvyvz"]:
+            offset = Particle.vx.offset if key == "vxvyvz" else Particle.x.offset
+            dtype, shape, strides = np.float64, (N, 6 if key == "xyzvxvyvz" else 3), (size, dsize)
+        elif key in ["x", "y", "z", "vx", "vy", "vz", "ax", "ay", "az", "m", "r", "lastcollision"]:
+            dtype, offset, shape, strides = np.float64, getattr(Particle, key).offset, (N,), (size,)
+        else:
+            raise AttributeError("Only 'x', 'y', 'z', 'vx', 'vy', 'vz', 'ax', 'ay', 'az', 'm', 'r', 'lastcollision', 'hash', 'xyz', 'vxvyvz', and 'xyzvxvyvz' are currently supported keys for particle views.")
+        if N == 0:
+            return np.zeros(shape, dtype=dtype)
+        buf = (ctypes.c_ubyte*(N*size)).from_address(ctypes.addressof(self._particles.contents))
+        buf._sim = self # keep reference to sim until the view is deallocated
+        return np.ndarray(shape, dtype=dtype, buffer=buf, offset=offset, strides=strides)
+
     def move_to_hel(self):
         """
         This function moves all particles in the simulation to the heliocentric frame.
@@ -1984,6 +2611,118 @@ class Simulation(Structure):
         """
         clibrebound.reb_move_to_com(byref(self))
 
+    def sort_particles_spatially(self):
+        """
+        This function sorts the particles along a Morton (Z-order) curve. 
+        Particles which are close to each other in space are then also close to each other in memory, 
+        which speeds up tree and collision searches with many particles.
+        If N_active is set, only test particles are sorted. 
+        Particle indices change, use hashes to identify particles.
+        Set `spatial_sort_interval` to sort particles automatically every few timesteps.
+        """
+        clibrebound.reb_sort_particles_spatially(byref(self))
+        self.process_messages()
+
+    def profiling_report(self, thread=-1):
+        """
+        Returns the time spent in different parts of the code.
+
+        Times are only recorded while `profiling` is set to 1. The result is a
+        dictionary with one entry per scope. Each entry contains the time in 
+        seconds including nested scopes (`time`), the time excluding nested 
+        scopes (`self`), and the number of times the scope was entered (`calls`).
+        Scopes that have never been entered are omitted.
+        If REBOUND was compiled with PERF_EVENTS=1 and hardware performance 
+        counters are available, each entry also contains the counters 
+        (`cycles`, `instructions`, `cache references`, `cache misses`, 
+        `branch misses`) averaged per timestep in `counters`.
+        
+        Arguments
+        ---------
+        thread : int
+            Only return the times of one OpenMP thread. By default (-1), the times of all threads are added up.
+
+        Examples
+        --------
+
+        >>> sim.profiling = 1
+        >>> sim.integrate(100.)
+        >>> print(sim.profiling_report()["gravity"]["time"])
+        
+        """
+        clibrebound.reb_profiling_time.restype = c_double
+        clibrebound.reb_profiling_time_self.restype = c_double
+        clibrebound.reb_profiling_calls.restype = c_ulong
+        clibrebound.reb_profiling_counter.restype = c_ulonglong
+        steps = clibrebound.reb_profiling_calls(byref(self), c_int(PROFILING_SCOPES["step"]), c_int(thread))
+        report = {}
+        for name, i in PROFILING_SCOPES.items():
+            calls = clibrebound.reb_profiling_calls(byref(self), c_int(i), c_int(thread))
+            if calls==0:
+                continue
+            report[name] = {
+                    "time": clibrebound.reb_profiling_time(byref(self), c_int(i), c_int(thread)),
+                    "self": clibrebound.reb_profiling_time_self(byref(self), c_int(i), c_int(thread)),
+                    "calls": calls,
+                    }
+            counters = {}
+            for counter_name, c in PROFILING_COUNTERS.items():
+                value = clibrebound.reb_profiling_counter(byref(self), c_int(i), c_int(c), c_int(thread))
+                if value:
+                    counters[counter_name] = value/max(steps,1)
+            if counters:
+                report[name]["counters"] = counters
+        return report
+
+    def reset_profiling(self):
+        """
+        Sets all times recorded by the profiler to zero.
+        """
+        clibrebound.reb_profiling_reset(byref(self))
+
+    def write_profiling_trace(self, filename):
+        """
+        Writes a timeline of the most recent profiling scopes to a file.
+
+        Events are only recorded if `profiling` is set to 1 and `profiling_trace`
+        is set to the number of events to keep per thread. The file uses the 
+        Chrome trace format and can be opened with https://ui.perfetto.dev.
+
+        Examples
+        --------
+
+        >>> sim.profiling = 1
+        >>> sim.profiling_trace = 10000
+        >>> sim.integrate(100.)
+        >>> sim.write_profiling_trace("trace.json")
+        
+        """
+        clibrebound.reb_profiling_trace_write(byref(self), c_char_p(filename.encode("ascii")))
+        self.process_messages()
+
+    def memory_usage(self):
+        """
+        Returns the heap memory allocated by the simulation.
+
+        The result is a dictionary with the number of bytes allocated by 
+        every subsystem (see `MEMORY_SUBSYSTEMS`) and the sum of all of them 
+        as `total`. Buffers are counted with their allocated size, which can 
+        be larger than what the current number of particles requires.
+
+        Examples
+        --------
+
+        >>> sim.integrator = "ias15"
+        >>> sim.integrate(1.)
+        >>> print(sim.memory_usage()["integrator"])
+        
+        """
+        report = reb_memory_report()
+        clibrebound.reb_memory_usage(byref(self), byref(report))
+        usage = {name: report.bytes[i] for name, i in MEMORY_SUBSYSTEMS.items()}
+        usage["total"] = report.total
+        return usage
+
     def calculate_energy(self):
         """
         Returns the sum of potential and kinetic energy of all particles in the simulation.
@@ -1991,6 +2730,22 @@ class Simulation(Structure):
         warnings.warn( "sim.calculate_energy() is deprecated and will be removed in the future. Use sim.energy() instead", FutureWarning)
         clibrebound.reb_tools_energy.restype = c_double
         return clibrebound.reb_tools_energy(byref(self))
+
+    def energy_tree(self):
+        """
+        Returns an approximation of the sum of potential and kinetic energy of all particles in the simulation.
+
+        The potential energy is calculated with the multipole moments of the 
+        tree, using the same opening angle (opening_angle2) as the tree 
+        gravity routine. All particles are treated as active particles.
+        This is much faster than energy() for large simulations and is 
+        intended for monitoring. The simulation needs to use the tree 
+        for gravity or collisions. Otherwise energy() is used.
+        """
+        clibrebound.reb_tools_energy_tree.restype = c_double
+        e = clibrebound.reb_tools_energy_tree(byref(self))
+        self.process_messages()
+        return e
     
     def energy(self):
         """
@@ -2059,6 +2814,107 @@ class Simulation(Structure):
         """
         clibrebound.reb_output_binary(byref(self), c_char_p(filename.encode("ascii")))
 
+    def output_columns(self, filename, columns):
+        """
+        Append the selected columns of all particles to a binary file.
+
+        Each call appends one output. Every column is stored as one contiguous array, 
+        so that individual columns can be read without reading full snapshots. 
+        Use rebound.read_columns() to read the file.
+
+        Arguments
+        ---------
+        filename : str
+            Filename of the binary file.
+        columns : list of str
+            Any of "hash", "x", "y", "z", "vx", "vy", "vz", "m", "r", and the
+            Jacobi orbital elements "a", "e", "inc", "Omega", "omega", "l", "f".
+            Orbital elements are NaN for the particle with index 0.
+        """
+        clibrebound.reb_output_columns(byref(self), c_char_p(filename.encode("ascii")), c_uint(output_columns_mask(columns)))
+        self.process_messages()
+
+    def output_positions_quantized(self, filename, format="uint16", stride=1, hashes=False):
+        """
+        Queue one frame with low precision positions for live monitoring.
+
+        A background thread appends the frame to a file or named pipe. The simulation
+        never waits for the output. If the previous frame has not been written yet, 
+        it is replaced by the new one. Use rebound.read_positions_quantized() to read the file.
+
+        Arguments
+        ---------
+        filename : str
+            Filename of the file or named pipe.
+        format : str, optional
+            "uint16" (default) stores positions as 16 bit integers relative to the 
+            bounding box of the particles. "float32" stores 32 bit floats.
+        stride : int, optional
+            Only every stride-th particle is included. Default 1.
+        hashes : bool, optional
+            If True, the hashes of the particles are included. Default False.
+        """
+        if format not in OUTPUT_QUANTIZED_FORMATS:
+            raise ValueError("Unknown format '%s'. Available formats: %s" % (format, ", ".join(OUTPUT_QUANTIZED_FORMATS)))
+        clibrebound.reb_output_positions_quantized(byref(self), c_char_p(filename.encode("ascii")), c_int(OUTPUT_QUANTIZED_FORMATS.index(format)), c_int(stride), c_int(1 if hashes else 0))
+        self.process_messages()
+
+    def output_positions_quantized_close(self):
+        """
+        Write the last queued frame of output_positions_quantized() and stop the background thread.
+        """
+        clibrebound.reb_output_positions_quantized_close(byref(self))
+        self.process_messages()
+
+    def collision_log_open(self, filename):
+        """
+        Log every resolved collision to a binary file.
+
+        Each entry contains the time, the hashes of both particles, their relative 
+        position and velocity before the collision was resolved, and the return 
+        value of the resolve function. This works with all collision resolve 
+        functions, including "merge", "hardsphere" and "halt", so no Python 
+        callback is needed. Entries are buffered and appended to the file by a 
+        background thread. Use rebound.read_collision_log() to read the file after 
+        calling collision_log_flush() or collision_log_close().
+
+        Arguments
+        ---------
+        filename : str
+            Filename of the binary file. The header is only written if the file is empty.
+        """
+        clibrebound.reb_collision_log_open(byref(self), c_char_p(filename.encode("ascii")))
+        self.process_messages()
+
+    def collision_log_flush(self):
+        """
+        Wait until all logged collisions have been written to the file.
+        """
+        clibrebound.reb_collision_log_flush(byref(self))
+        self.process_messages()
+
+    def collision_log_close(self):
+        """
+        Write all logged collisions and stop logging.
+        """
+        clibrebound.reb_collision_log_close(byref(self))
+        self.process_messages()
+
+    def output_ascii(self, filename):
+        """
+        Append the positions and velocities of all particles to an ASCII file.
+        """
+        clibrebound.reb_output_ascii(byref(self), c_char_p(filename.encode("ascii")))
+        self.process_messages()
+
+    def output_orbits(self, filename):
+        """
+        Append the time and the Jacobi orbital elements of all particles (except the 
+        one with index 0) to an ASCII file. The columns are t, a, e, inc, Omega, omega, l, P, and f.
+        """
+        clibrebound.reb_output_orbits(byref(self), c_char_p(filename.encode("ascii")))
+        self.process_messages()
+
 # Integration
     def step(self):
         """
@@ -2076,6 +2932,17 @@ class Simulation(Structure):
         clibrebound.reb_steps(byref(self),c_uint(N_steps))
         self.process_messages()
 
+    def steps_fast(self, N_steps):
+        """
+        Same as steps() but with less overhead per step. 
+        The walltime is only measured once for all N_steps steps.
+        This can make a difference for integrators such as WHFast512 where a single step is very fast.
+        If pre_timestep_modifications or post_timestep_modifications are set, or if the gravity or collision
+        routine is selected automatically, this is the same as steps().
+        """
+        clibrebound.reb_steps_fast(byref(self),c_uint(N_steps))
+        self.process_messages()
+
     def integrate(self, tmax, exact_finish_time=1):
         """
         Main integration function. Call this function when you have setup your simulation and want to integrate it forward (or backward) in time. The function might be called many times to integrate the simulation in steps and create outputs in-between steps.
@@ -2114,7 +2981,7 @@ class Simulation(Structure):
             else:
                 raise NoParticles("No more particles left in simulation.")
         if ret_value == 3:
-            raise Encounter("Two particles had a close encounter (d<exit_min_distance).")
+            raise Encounter("Two particles had a close encounter (d<exit_min_distance). Particle indices: %d and %d." % (self.exit_encounter_i, self.exit_encounter_j))
         if ret_value == 4:
             raise Escape("A particle escaped (r>exit_max_distance).")
         if ret_value == 5:
@@ -2143,13 +3010,272 @@ class Simulation(Structure):
         Call this function if safe-mode is disabled and you need to synchronize particle positions and velocities between timesteps.
         """
         clibrebound.reb_integrator_synchronize(byref(self))
+
+    def synchronized_particles(self, index=None, hash=None):
+        """
+        Returns the synchronized positions and velocities of some particles
+        without synchronizing the simulation.
+
+        Unlike `integrator_synchronize()`, this does not change the
+        state of the integrator. The integration continues exactly as if 
+        this function had not been called. This is useful for observers
+        that only need a few particles of a large simulation.
+        WHFast only synchronizes the massive bodies and the requested
+        test particles (if test particles are of type 0).
+
+        Parameters
+        ----------
+        index : int, slice, range or list of ints, optional
+            Indices of the particles. Default: all particles.
+        hash : list of hashes (int, str or c_uint32), optional
+            Hashes of the particles. Used instead of index if given.
+
+        Returns
+        -------
+        A list of Particle objects (copies).
+        """
+        if hash is not None:
+            if not isinstance(hash, (list, tuple)):
+                hash = [hash]
+            indices = [self.particles[h].index for h in hash]
+        elif index is None:
+            indices = range(self.N)
+        elif isinstance(index, slice):
+            indices = range(*index.indices(self.N))
+        elif isinstance(index, int):
+            indices = [index]
+        else:
+            indices = index
+        indices = [i+self.N if i<0 else i for i in indices]
+        for i in indices:
+            if i<0 or i>=self.N:
+                raise IndexError("Particle index out of range.")
+        N = len(indices)
+        particles = (Particle*N)()
+        clibrebound.reb_integrator_synchronize_particles(byref(self), (c_int*N)(*indices), c_int(N), particles)
+        self.process_messages()
+        return list(particles)
     
     def tree_update(self):
         """
         Call this function to update the tree structure manually after removing particles.
         """
         clibrebound.reb_tree_update(byref(self))
-    
+
+def integrate_ensemble(sims, tmax, N_threads=0, exact_finish_time=1):
+    """
+    Integrates a list of independent simulations to the time tmax.
+
+    The simulations are integrated in parallel on a pool of threads 
+    within the current process. Every simulation runs single-threaded.
+    As soon as a thread has finished one simulation, it picks up the 
+    next one, so ensembles in which some runs take much longer than 
+    others are balanced automatically. Unlike InterruptiblePool, no 
+    simulations are pickled or copied between processes.
+    The GIL is released during the integration. Python callbacks
+    such as heartbeat functions still work but will serialize the 
+    threads while they run.
+
+    Parameters
+    ----------
+    sims : list
+        A list of Simulation objects. 
+    tmax : float
+        The final time of all simulations.
+    N_threads : int, optional
+        The number of threads. The default (0) uses all available cores.
+    exact_finish_time: int, optional
+        Same as in Simulation.integrate(). Applied to all simulations.
+
+    Returns
+    -------
+    A list with the exit status of each simulation (0 means success, 
+    see REB_STATUS in rebound.h for other values). Unlike 
+    Simulation.integrate(), no exceptions are raised if individual 
+    simulations fail.
+
+    Examples
+    --------
+
+    >>> sims = [create_sim(seed) for seed in range(100)]
+    >>> status = rebound.integrate_ensemble(sims, 1e4)
+
+    """
+    N = len(sims)
+    for sim in sims:
+        sim.exact_finish_time = c_int(exact_finish_time)
+    simps = (POINTER(Simulation)*N)(*[pointer(sim) for sim in sims])
+    clibrebound.reb_ensemble_integrate(simps, c_int(N), c_double(tmax), c_int(N_threads))
+    for sim in sims:
+        sim.process_messages()
+    return [sim._status for sim in sims]
+
+def integrate_ensemble_fork(sim, N, tmax, setup=None, result=None, N_columns=1, N_procs=0, filename=None, exact_finish_time=1):
+    """
+    Integrates N members of an ensemble derived from one simulation to the time tmax.
+
+    Every member runs in its own process, forked from the current
+    process (POSIX only). Members share all memory with sim
+    copy-on-write, so neither the simulation nor its particles are
+    copied or pickled. This is useful for ensembles in which one
+    simulation is perturbed many times, for example for chaos maps.
+    sim itself is not modified.
+
+    Parameters
+    ----------
+    sim : Simulation
+        The simulation from which all members start.
+    N : int
+        The number of members.
+    tmax : float
+        The final time of all members.
+    setup : function, optional
+        Called as setup(sim, member) in the member's process before
+        the integration, e.g. to perturb the initial conditions.
+    result : function, optional
+        Called as result(sim, member) after the integration. Needs to
+        return a float or a list of N_columns floats.
+    N_columns : int, optional
+        The number of values returned by result.
+    N_procs : int, optional
+        The number of worker processes. The default (0) uses all available cores.
+    filename : str, optional
+        If set, every member writes a SimulationArchive. The filename
+        is formatted with the member index, e.g. "member{:04d}.bin".
+        The automatic snapshot interval of sim is used. If none is
+        set, the initial and final states are stored.
+    exact_finish_time: int, optional
+        Same as in Simulation.integrate(). Applied to all members.
+
+    Returns
+    -------
+    A list with the exit status of each member, and a list with the
+    values returned by result for each member (None if result is not
+    set). Members which did not finish return zeros.
+
+    Examples
+    --------
+
+    >>> def setup(sim, member):
+    >>>     sim.particles[2].x += 1e-8*member
+    >>> def result(sim, member):
+    >>>     return sim.megno()
+    >>> status, megno = rebound.integrate_ensemble_fork(sim, 1000, 1e4, setup, result)
+
+    """
+    if N<=0:
+        return [], ([] if result else None)
+    sim.exact_finish_time = c_int(exact_finish_time)
+    setupf = None
+    if setup:
+        def _setup(simp, member):
+            setup(simp.contents, member)
+        setupf = ENSFF(_setup)
+    resultf = None
+    results = None
+    if result:
+        def _result(simp, member, row):
+            values = result(simp.contents, member)
+            if N_columns==1 and not hasattr(values, "__len__"):
+                values = [values]
+            for j in range(N_columns):
+                row[j] = values[j]
+        resultf = ENSRFF(_result)
+        results = (c_double*(N*N_columns))()
+    filename_format = None
+    if filename is not None:
+        # Translate format fields such as {} or {:04d} to the printf syntax used by the C library.
+        fmt = re.sub(r"\{(?::(0?[0-9]*)d)?\}", lambda m: "%"+(m.group(1) or "")+"d", filename.replace("%","%%"))
+        filename_format = c_char_p(fmt.encode("ascii"))
+    status = (c_int*N)()
+    clibrebound.reb_ensemble_integrate_fork(byref(sim), c_int(N), c_double(tmax), c_int(N_procs), setupf, resultf, c_int(N_columns), results, status, filename_format)
+    sim.process_messages()
+    if results is None:
+        return list(status), None
+    if N_columns==1:
+        return list(status), list(results)
+    return list(status), [list(results[i*N_columns:(i+1)*N_columns]) for i in range(N)]
+
+def orbits_to_cartesian(G, primary, a, e=0., inc=0., Omega=0., omega=0., f=None, M=None, m=0.):
+    """
+    Converts arrays of orbital elements to Cartesian coordinates.
+
+    All conversions are done with one call to the C library (using OpenMP
+    if enabled), which is much faster than adding particles with orbital
+    elements one at a time. The same primary is used for all particles.
+    The element arguments can be numpy arrays or scalars; they are 
+    broadcast against each other.
+
+    Parameters
+    ----------
+    G : float
+        The gravitational constant, e.g. sim.G.
+    primary : rebound.Particle
+        The primary shared by all orbits.
+    a, e, inc, Omega, omega : float or array
+        Semi-major axis, eccentricity, inclination, longitude of the 
+        ascending node, and argument of pericenter.
+    f, M : float or array, optional
+        True or mean anomaly. Only one of them can be passed. If the mean
+        anomaly is passed, Kepler's equation is solved for all orbits at 
+        once. Default: f=0.
+    m : float or array, optional
+        Masses of the particles. Default: 0.
+
+    Returns
+    -------
+    A numpy array with shape (N,6) containing x, y, z, vx, vy, vz.
+    A ValueError is raised if any of the orbits is invalid.
+
+    Examples
+    --------
+
+    >>> a = np.random.uniform(1., 2., 1000000)
+    >>> xyzvxvyvz = rebound.orbits_to_cartesian(sim.G, sim.particles[0], a, e=0.01)
+
+    """
+    import numpy as np
+    particles = _orbits_to_particles(G, primary, a, e, inc, Omega, omega, f, M, m)
+    N = len(particles)
+    if N == 0:
+        return np.zeros((0,6))
+    data = np.ndarray((N, ctypes.sizeof(Particle)//ctypes.sizeof(c_double)), dtype=np.float64, buffer=particles)
+    offset = Particle.x.offset//ctypes.sizeof(c_double)
+    return data[:,offset:offset+6].copy()
+
+def _orbits_to_particles(G, primary, a, e=0., inc=0., Omega=0., omega=0., f=None, M=None, m=0., r=None):
+    # Converts arrays of orbital elements to a ctypes array of particles. See orbits_to_cartesian().
+    import numpy as np
+    if f is not None and M is not None:
+        raise ValueError("You can only pass one of f and M.")
+    anomaly = M if M is not None else (f if f is not None else 0.)
+    elements = [np.ascontiguousarray(x, dtype=np.float64).ravel() for x in np.broadcast_arrays(m, a, e, inc, Omega, omega, anomaly, 0. if r is None else r)]
+    radii = elements.pop()
+    N = len(elements[0])
+    particles = (Particle*N)()
+    if N == 0:
+        return particles
+    err = np.zeros(N, dtype=np.intc)
+    ptrs = [x.ctypes.data_as(POINTER(c_double)) for x in elements]
+    if M is not None:
+        ptrs = ptrs[:-1] + [None, ptrs[-1]]
+    else:
+        ptrs = ptrs + [None]
+    clibrebound.reb_tools_orbits_to_particles_err(c_double(G), byref(primary), c_int(1), c_int(N), *ptrs, particles, err.ctypes.data_as(POINTER(c_int)))
+    if err.any():
+        messages = {1: "Can't set e exactly to 1.",
+                    2: "Eccentricity must be greater than or equal to zero.",
+                    3: "Bound orbit (a > 0) must have e < 1.",
+                    4: "Unbound orbit (a < 0) must have e > 1.",
+                    5: "Unbound orbit can't have f beyond the range allowed by the asymptotes set by the hyperbola.",
+                    6: "Primary has no mass."}
+        i = int(np.flatnonzero(err)[0])
+        raise ValueError("Orbit %d: %s" % (i, messages[err[i]]))
+    if r is not None:
+        data = np.ndarray((N, ctypes.sizeof(Particle)//ctypes.sizeof(c_double)), dtype=np.float64, buffer=particles)
+        data[:,Particle.r.offset//ctypes.sizeof(c_double)] = radii
+    return particles
+
 class Variation(Structure):
     """
     REBOUND Variational Configuration Object.
@@ -2405,6 +3531,14 @@ class reb_simulation_integrator_mercurius(Structure):
     
     :ivar float hillfac:      
         Switching radius in units of the hill radius.
+    
+    :ivar int split_tponly_encounters:      
+        If set to 1, close encounters which only involve test particles 
+        are integrated independently for each test particle.
+
+    :ivar int kepler_warmstart:      
+        If set to 1, the Kepler solver corrects its initial guess by the 
+        error the guess had in the previous step. Default is 0 (off).
 
     Example usage:
     
@@ -2421,6 +3555,8 @@ class reb_simulation_integrator_mercurius(Structure):
                 ("recalculate_coordinates_this_timestep", c_uint),
                 ("recalculate_dcrit_this_timestep", c_uint),
                 ("safe_mode", c_uint),
+                ("split_tponly_encounters", c_uint),
+                ("kepler_warmstart", c_uint),
                 ("is_synchronized", c_uint),
                 ("mode", c_uint),
                 ("_encounterN", c_uint),
@@ -2429,10 +3565,16 @@ class reb_simulation_integrator_mercurius(Structure):
                 ("_allocatedN", c_uint),
                 ("_allocatedN_additionalforces", c_uint),
                 ("_dcrit_allocatedN", c_uint),
+                ("_dcrit_pending", c_uint),
                 ("_dcrit", POINTER(c_double)),
+                ("_kepler_guess_allocatedN", c_uint),
+                ("_kepler_guess", POINTER(c_double)),
                 ("_particles_backup", POINTER(Particle)),
                 ("_particles_backup_additionalforces", POINTER(Particle)),
                 ("_encounter_map", POINTER(c_int)),
+                ("_encounter_pairs", POINTER(c_int)),
+                ("_encounter_pairs_N", c_uint),
+                ("_encounter_pairs_allocatedN", c_uint),
                 ("_com_pos", _Vec3d),
                 ("_com_vel", _Vec3d),
                 ]
@@ -2448,7 +3590,7 @@ class reb_simulation_integrator_mercurius(Structure):
         elif func == "C5":
             self._L = cast(clibrebound.reb_integrator_mercurius_L_C5,MERCURIUSLF)
         elif func == "infinity":
-            self._L = cast(clibrebound.reb_integrator_mercurius_L_minfinity,MERCURIUSLF)
+            self._L = cast(clibrebound.reb_integrator_mercurius_L_infinity,MERCURIUSLF)
         else:
             self._Lfp = MERCURIUSLF(func)
             self._L = self._Lfp
@@ -2484,6 +3626,8 @@ ODE._fields_ = [
                 ("_post_timestep", CFUNCTYPE(None,POINTER(ODE), POINTER(c_double))),
                 ("r", POINTER(Simulation)),
                 ("ref", c_void_p),
+                ("batch_N", c_uint),
+                ("batch_length", c_uint),
             ]               
 
 class reb_simulation_integrator_bs(Structure):
@@ -2536,8 +3680,39 @@ class reb_simulation_integrator_tes(Structure):
     ("_radau", POINTER(c_double)),
     ("_mStar_last", c_double),
     ("warnings", c_uint32),
+    ("_pool", c_void_p),
+    ("_pool_size", c_size_t),
+    ("_pool_used", c_size_t),
     ]
 
+class reb_simulation_integrator_block(Structure):
+    """
+    This class is an abstraction of the C-struct reb_simulation_integrator_block.
+    It controls the behaviour of the hierarchical block timestep integrator.
+    
+    :ivar float eta:      
+        Accuracy parameter. Each particle uses the largest timestep dt/2**n 
+        which is smaller than eta*|a|/|jerk|. Default: 0.02.
+    
+    :ivar int max_level:      
+        The maximum level n. The shortest timestep is dt/2**max_level. Default: 10.
+    
+    :ivar int particle_steps:      
+        Counter how many individual particle steps have been done.
+    """
+    def __repr__(self):
+        return '<{0}.{1} object at {2}, eta={3}, max_level={4}>'.format(self.__module__, type(self).__name__, hex(id(self)), self.eta, self.max_level)
+    _fields_ = [("eta", c_double),
+                ("max_level", c_uint),
+                ("particle_steps", c_ulonglong),
+                ("_allocatedN", c_int),
+                ("_level", POINTER(c_uint)),
+                ("_t_last", POINTER(c_ulonglong)),
+                ("_jerk", POINTER(_Vec3d)),
+                ("_p_pred", POINTER(Particle)),
+                ("_due", POINTER(c_int)),
+                ]
+
 class timeval(Structure):
     _fields_ = [("tv_sec",c_long),("tv_usec",c_long)]
 
@@ -2546,10 +3721,7 @@ class reb_display_data(Structure):
                 ("r_copy", POINTER(Simulation)),
                 ("particle_data", c_void_p),
                 ("orbit_data", c_void_p),
-                ("particles_copy", POINTER(Particle)),
-                ("p_jh_copy", POINTER(Particle)),
                 ("allocated_N", c_ulong),
-                ("allocated_N_whfast", c_ulong),
                 ("opengl_enabled", c_int),
                 ("scale", c_double),
                 ("mouse_x", c_double),
@@ -2572,6 +3744,7 @@ Particle._fields_ = [("x", c_double),
                 ("lastcollision", c_double),
                 ("c", c_void_p),
                 ("_hash", c_uint32),
+                ("_frozen", c_uint32),
                 ("ap", c_void_p),
                 ("_sim", POINTER(Simulation))]
 
@@ -2582,7 +3755,9 @@ class reb_simulation_integrator_whfast512(Structure):
                 ("gr_potential", c_uint),
                 ("recalculate_constants", c_uint),
                 ("_p_jh", POINTER(Particle)),
-                ("_p_jh0", Particle)]
+                ("_p_jh0", Particle),
+                ("_allocatedN_testparticles", c_uint),
+                ("_p_jh_tp", c_void_p)]
 
 # Setting up fields after class definition (because of self-reference)
 Simulation._fields_ = [
@@ -2608,9 +3783,31 @@ Simulation._fields_ = [
                 ("_particles", POINTER(Particle)),
                 ("gravity_cs", POINTER(_Vec3d)),
                 ("gravity_cs_allocatedN", c_int),
+                ("_particles_soa", POINTER(c_double)),
+                ("_particles_soa_allocatedN", c_int),
+                ("_gravity_gpu", POINTER(c_double)),
+                ("_gravity_gpu_allocatedN", c_int),
+                ("_gravity_tree_cost", POINTER(c_int)),
+                ("_gravity_tree_cost_N", c_int),
+                ("_additional_forces_soa_buffer", POINTER(c_double)),
+                ("_additional_forces_soa_allocatedN", c_int),
+                ("spatial_sort_interval", c_int),
+                ("use_soa", c_int),
                 ("_tree_root", c_void_p),
                 ("_tree_needs_update", c_int),
+                ("_tree_cells_chunks", c_void_p),
+                ("_tree_cells_chunks_N", c_int),
+                ("_tree_cells_N", c_int),
+                ("_tree_cells_free", c_void_p),
+                ("tree_rebuild", c_int),
+                ("tree_active_only", c_int),
+                ("tree_group_size", c_int),
+                ("_tree_keys", c_void_p),
+                ("_tree_keys_allocatedN", c_int),
                 ("opening_angle2", c_double),
+                ("gravity_fmm_order", c_int),
+                ("gravity_deterministic", c_int),
+                ("gravity_tree_far_field", c_int),
                 ("_status", c_int),
                 ("exact_finish_time", c_int),
                 ("force_is_velocity_dependent", c_uint),
@@ -2621,8 +3818,14 @@ Simulation._fields_ = [
                 ("messages", c_void_p),
                 ("exit_max_distance", c_double),
                 ("exit_min_distance", c_double),
+                ("exit_encounter_i", c_int),
+                ("exit_encounter_j", c_int),
                 ("usleep", c_double),
                 ("display_data", POINTER(reb_display_data)),
+                ("display_stride", c_int),
+                ("heartbeat_async", c_int),
+                ("heartbeat_async_skipped", c_long),
+                ("_heartbeat_async_worker", c_void_p),
                 ("track_energy_offset", c_int),
                 ("energy_offset", c_double),
                 ("walltime", c_double),
@@ -2639,6 +3842,9 @@ Simulation._fields_ = [
                 ("nghostx", c_int),
                 ("nghosty", c_int),
                 ("nghostz", c_int),
+                ("_ghostboxes", c_void_p),
+                ("_ghostboxes_allocatedN", c_int),
+                ("_ghostboxes_key", c_double*9),
                 ("collision_resolve_keep_sorted", c_int),
                 ("collisions", c_void_p),
                 ("collisions_allocatedN", c_int),
@@ -2646,6 +3852,52 @@ Simulation._fields_ = [
                 ("collisions_plog", c_double),
                 ("max_radius", c_double*2),
                 ("collisions_Nlog", c_long),
+                ("collision_skip_testparticle_pairs", c_int),
+                ("collision_grid_cellsize", c_double),
+                ("collision_resolve_parallel", c_int),
+                ("collision_skin", c_double),
+                ("collision_time_of_impact", c_int),
+                ("collision_line_hermite", c_int),
+                ("collision_line_ias15", c_int),
+                ("_collision_grid_bucket", c_void_p),
+                ("_collision_grid_bucket_allocatedN", c_int),
+                ("_collision_grid_particles", c_void_p),
+                ("_collision_grid_particles_allocatedN", c_int),
+                ("_collision_sap_particles", c_void_p),
+                ("_collision_sap_lower", c_void_p),
+                ("_collision_sap_upper", c_void_p),
+                ("_collision_sap_N", c_int),
+                ("_collision_sap_allocatedN", c_int),
+                ("_collision_sap_axis", c_int),
+                ("_collision_bvh_box", c_void_p),
+                ("_collision_bvh_child", c_void_p),
+                ("_collision_bvh_N", c_int),
+                ("_collision_bvh_allocatedN", c_int),
+                ("_collision_bvh_cost", c_double),
+                ("collision_bvh_builds", c_long),
+                ("_collision_line_soa", c_void_p),
+                ("_collision_line_soa_allocatedN", c_int),
+                ("_collision_line_xv0", c_void_p),
+                ("_collision_line_xv0_N", c_int),
+                ("_collision_line_xv0_allocatedN", c_int),
+                ("_collision_line_poly", c_void_p),
+                ("_collision_line_poly_allocatedN", c_int),
+                ("_collision_gpu", c_void_p),
+                ("_collision_gpu_allocatedN", c_int),
+                ("_collision_gpu_pairs", c_void_p),
+                ("_collision_gpu_pairs_allocatedN", c_int),
+                ("_collision_neighbours", c_void_p),
+                ("_collision_neighbours_N", c_int),
+                ("_collision_neighbours_allocatedN", c_int),
+                ("_collision_neighbours_x", c_void_p),
+                ("_collision_neighbours_x_allocatedN", c_int),
+                ("_collision_neighbours_gb", c_double*81),
+                ("_collision_neighbours_skin", c_double),
+                ("_collision_neighbours_built", c_int*3),
+                ("collision_neighbours_builds", c_long),
+                ("track_collision_statistics", c_int),
+                ("collision_statistics", reb_collision_statistics),
+                ("_collision_log_writer", c_void_p),
                 ("_calculate_megno", c_int),
                 ("_megno_Ys", c_double),
                 ("_megno_Yss", c_double),
@@ -2664,11 +3916,42 @@ Simulation._fields_ = [
                 ("simulationarchive_next", c_double),
                 ("simulationarchive_next_step", c_ulonglong),
                 ("_simulationarchive_filename", c_char_p),
+                ("simulationarchive_async", c_int),
+                ("simulationarchive_compress", c_int),
+                ("_simulationarchive_writer", c_void_p),
+                ("simulationarchive_full_every", c_uint),
+                ("_simulationarchive_full_counter", c_ulonglong),
+                ("_simulationarchive_full_t", c_double),
+                ("_output_quantized_writer", c_void_p),
                 ("_visualization", c_int),
                 ("_collision", c_int),
                 ("_integrator", c_int),
                 ("_boundary", c_int),
                 ("_gravity", c_int),
+                ("_gravity_autotune", reb_autotune),
+                ("_collision_autotune", reb_autotune),
+                ("profiling", c_int),
+                ("_profiling_threads", c_void_p),
+                ("_profiling_threads_N", c_int),
+                ("profiling_trace", c_int),
+                ("_memory_grown", CFUNCTYPE(None, POINTER(Simulation), POINTER(reb_memory_report))),
+                ("_memory_report_last", reb_memory_report),
+                ("_ephemeris", c_void_p),
+                ("N_frozen", c_int),
+                ("_frozen_hidden", c_int),
+                ("_frozen_swaps", POINTER(c_int)),
+                ("_frozen_swaps_N", c_int),
+                ("_frozen_swaps_allocatedN", c_int),
+                ("sleep_v", c_double),
+                ("sleep_a", c_double),
+                ("sleep_steps", c_int),
+                ("N_asleep", c_int),
+                ("compact", reb_compact_particles),
+                ("_injector", CFUNCTYPE(None, POINTER(Simulation), POINTER(Particle))),
+                ("inject_rate", c_double),
+                ("_inject_carry", c_double),
+                ("inject_pool", c_int),
+                ("N_injected", c_long),
                 ("ri_sei", reb_simulation_integrator_sei), 
                 ("ri_whfast", reb_simulation_integrator_whfast),
                 ("ri_whfast512", reb_simulation_integrator_whfast512),
@@ -2679,17 +3962,20 @@ Simulation._fields_ = [
                 ("ri_eos", reb_simulation_integrator_eos),
                 ("ri_bs", reb_simulation_integrator_bs),
                 ("ri_tes", reb_simulation_integrator_tes),
+                ("ri_block", reb_simulation_integrator_block),
                 ("_odes", POINTER(POINTER(ODE))),
                 ("_odes_N", c_int),
                 ("_odes_allocatedN", c_int),
                 ("_odes_warnings", c_int),
                 ("_additional_forces", CFUNCTYPE(None,POINTER(Simulation))),
+                ("_additional_forces_soa", CFUNCTYPE(None,POINTER(Simulation),c_int,POINTER(c_double),POINTER(c_double),POINTER(c_double))),
                 ("_pre_timestep_modifications", CFUNCTYPE(None,POINTER(Simulation))),
                 ("_post_timestep_modifications", CFUNCTYPE(None,POINTER(Simulation))),
                 ("_heartbeat", CFUNCTYPE(None,POINTER(Simulation))),
                 ("_display_heartbeat", CFUNCTYPE(None,POINTER(Simulation))),
                 ("_coefficient_of_restitution", CFUNCTYPE(c_double,POINTER(Simulation), c_double)),
                 ("_collision_resolve", CFUNCTYPE(c_int,POINTER(Simulation), reb_collision)),
+                ("_collision_resolve_batch", CFUNCTYPE(None,POINTER(Simulation), POINTER(reb_collision), c_int, POINTER(c_int))),
                 ("_free_particle_ap", CFUNCTYPE(None, POINTER(Particle))),
                 ("_extras_cleanup", CFUNCTYPE(None, POINTER(Simulation))),
                 ("extras", c_void_p),
@@ -2698,10 +3984,16 @@ Simulation._fields_ = [
 
 POINTER_REB_SIM = POINTER(Simulation) 
 AFF = CFUNCTYPE(None,POINTER_REB_SIM)
+AFSOAFF = CFUNCTYPE(None,POINTER_REB_SIM,c_int,POINTER(c_double),POINTER(c_double),POINTER(c_double))
 ODEDER = CFUNCTYPE(None,POINTER(ODE), POINTER(c_double), POINTER(c_double), c_double)
 ODESCALE = CFUNCTYPE(None,POINTER(ODE), POINTER(c_double), POINTER(c_double))
 CORFF = CFUNCTYPE(c_double,POINTER_REB_SIM, c_double)
 COLRFF = CFUNCTYPE(c_int, POINTER_REB_SIM, reb_collision)
+COLRBFF = CFUNCTYPE(None, POINTER_REB_SIM, POINTER(reb_collision), c_int, POINTER(c_int))
+MGFF = CFUNCTYPE(None, POINTER_REB_SIM, POINTER(reb_memory_report))
+INJFF = CFUNCTYPE(None, POINTER_REB_SIM, POINTER(Particle))
+ENSFF = CFUNCTYPE(None, POINTER_REB_SIM, c_int)
+ENSRFF = CFUNCTYPE(None, POINTER_REB_SIM, c_int, POINTER(c_double))
 MERCURIUSLF = CFUNCTYPE(c_double, POINTER_REB_SIM, c_double, c_double)
 FPA = CFUNCTYPE(None, POINTER(Particle))
 
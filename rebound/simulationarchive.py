@@ -1,5 +1,6 @@
-from ctypes import Structure, c_double, POINTER, c_float, c_int, c_uint, c_uint32, c_int64, c_uint64, c_long, c_ulong, c_ulonglong, c_void_p, c_char_p, CFUNCTYPE, byref, create_string_buffer, addressof, pointer, cast
+from ctypes import Structure, c_double, POINTER, c_float, c_int, c_uint, c_uint32, c_int64, c_uint64, c_long, c_ulong, c_ulonglong, c_void_p, c_size_t, c_char_p, CFUNCTYPE, byref, create_string_buffer, addressof, pointer, cast
 from .simulation import Simulation, BINARY_WARNINGS
+from .tools import hash as rebhash
 from . import clibrebound 
 import os
 import sys
@@ -8,6 +9,10 @@ import warnings
 
 POINTER_REB_SIM = POINTER(Simulation) 
 
+# Quantities which can be extracted with SimulationArchive.extract() (see enum REB_SA_FIELD)
+SA_FIELDS = {"x": 0, "y": 1, "z": 2, "vx": 3, "vy": 4, "vz": 5, "m": 6, "r": 7,
+             "a": 8, "e": 9, "inc": 10, "Omega": 11, "omega": 12, "f": 13, "M": 14, "P": 15}
+
 class SimulationArchive(Structure):
     """
     SimulationArchive Class.
@@ -55,7 +60,9 @@ class SimulationArchive(Structure):
                 ("auto_step", c_ulonglong), 
                 ("nblobs", c_long), 
                 ("offset64", POINTER(c_uint64)), 
-                ("t", POINTER(c_double)) 
+                ("t", POINTER(c_double)),
+                ("_mmap_data", c_void_p),
+                ("_mmap_size", c_size_t)
                 ]
     def __repr__(self):
         return '<{0}.{1} object at {2}, nblobs={3}>'.format(self.__module__, type(self).__name__, hex(id(self)), self.nblobs)
@@ -162,6 +169,102 @@ class SimulationArchive(Structure):
     def __len__(self):
         return self.nblobs  # number of SA snapshots (also counting binary at t=0)
 
+    def output_text(self, filename, orbits=False):
+        """
+        Converts all snapshots to ASCII and appends them to a file. 
+
+        Arguments
+        ---------
+        filename : str
+            Filename of the ASCII file.
+        orbits : bool, optional
+            If True, the format of Simulation.output_orbits() is used. By default, 
+            the format of Simulation.output_ascii() is used.
+        """
+        for sim in self:
+            if orbits:
+                sim.output_orbits(filename)
+            else:
+                sim.output_ascii(filename)
+
+    def extract(self, fields, particles=None, snapshots=None, N_threads=0):
+        """
+        Extracts time series of particle quantities from many snapshots at once.
+
+        The snapshots are decoded directly from the file in parallel threads
+        without creating a simulation for every snapshot. This is much faster 
+        than iterating over the Simulation Archive. The particles are used 
+        as they are stored in the file, the same as with sa[i].
+
+        Arguments
+        ---------
+        fields : str or list of str
+            Quantities to extract: "x", "y", "z", "vx", "vy", "vz", "m", "r", 
+            or the orbital elements "a", "e", "inc", "Omega", "omega", "f", "M", 
+            and "P". Orbital elements are calculated in Jacobi coordinates, the 
+            same as the default of Particle.orbit().
+        particles : list, optional
+            Hashes (integers or strings) of the particles. By default, all 
+            particles of the first requested snapshot are extracted by index.
+        snapshots : range or slice, optional
+            Snapshots to extract with a step of 1. Default: all snapshots.
+        N_threads : int, optional
+            Number of threads. By default, all cores are used.
+
+        Returns
+        -------
+        A numpy array with shape (N_snapshots, N_particles, N_fields). If 
+        fields is a single string, the last dimension is omitted. Values of 
+        particles which do not exist in a snapshot are NaN. The times of the
+        snapshots are stored in sa.t.
+
+        Examples
+        --------
+
+        >>> sa = rebound.SimulationArchive("archive.bin")
+        >>> e = sa.extract("e", particles=["earth", "jupiter"])
+        >>> print(e[-1,1]) # eccentricity of jupiter in the last snapshot
+
+        """
+        import numpy as np
+        single = isinstance(fields, str)
+        if single:
+            fields = [fields]
+        for f in fields:
+            if f not in SA_FIELDS:
+                raise ValueError("Unknown field: %s." % f)
+        if snapshots is None:
+            snapshots = slice(None)
+        if isinstance(snapshots, slice):
+            snapshots = range(len(self))[snapshots]
+        if not isinstance(snapshots, range) or (len(snapshots)>1 and snapshots.step!=1):
+            raise ValueError("Snapshots need to be a range or slice with a step of 1.")
+        N_snapshots = len(snapshots)
+        first = snapshots.start if N_snapshots else 0
+        if particles is None:
+            hashes = None
+            N_particles = 0
+            if N_snapshots:
+                sim = Simulation()
+                w = c_int(0)
+                clibrebound.reb_create_simulation_from_simulationarchive_with_messages(byref(sim), byref(self), c_long(first), byref(w))
+                N_particles = sim.N
+        else:
+            N_particles = len(particles)
+            hashes = (c_uint32*N_particles)(*[rebhash(h).value for h in particles])
+        N_fields = len(fields)
+        field_ids = (c_int*N_fields)(*[SA_FIELDS[f] for f in fields])
+        out = (c_double*(N_snapshots*N_particles*N_fields))()
+        failed = clibrebound.reb_simulationarchive_extract(byref(self), c_long(first), c_long(N_snapshots), hashes, c_int(N_particles), field_ids, c_int(N_fields), out, c_int(N_threads))
+        if failed<0:
+            raise RuntimeError("Cannot extract data from this Simulation Archive.")
+        if failed>0:
+            warnings.warn("%d snapshots could not be decoded. Their values are NaN." % failed, RuntimeWarning)
+        data = np.ndarray((N_snapshots, N_particles, N_fields), dtype=np.float64, buffer=out)
+        if single:
+            return data[:,:,0]
+        return data
+
     def _getSnapshotIndex(self, t):
         """
         Return the index for the snapshot just before t
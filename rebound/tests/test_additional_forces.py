@@ -1,6 +1,7 @@
 import rebound
 import unittest
 import rebound.data as data
+from ctypes import CFUNCTYPE, POINTER, c_int, c_double
 
 class TestAdditionalForces(unittest.TestCase):
     def test_af_ias15(self):
@@ -95,6 +96,43 @@ class TestAdditionalForces(unittest.TestCase):
         sim.integrate(10.)
         self.assertAlmostEqual(sim.particles[2].a,4.86583,delta=1e-4)
 
+    def test_af_soa_ias15(self):
+        sim = rebound.Simulation()
+        sim.integrator = "ias15"
+        sim.force_is_velocity_dependent = 1
+        sim.add(m=1)
+        sim.add(m=1e-6,a=1)
+        sim.add(m=1e-3,a=5)
+        sim.move_to_com()
+        def af(sim, pos, vel, acc):
+            fac = 0.01
+            acc[0,2] = -fac*vel[0,2]
+            acc[1,2] = -fac*vel[2,2]
+            acc[2,2] = -fac*vel[1,2]
+        sim.additional_forces_soa = af
+        sim.integrate(10.)
+        self.assertAlmostEqual(sim.particles[2].a,4.86583,delta=1e-5)
+
+    def test_af_soa_mercurius_cfunction(self):
+        sim = rebound.Simulation()
+        sim.integrator = "mercurius"
+        sim.dt = 0.005
+        sim.force_is_velocity_dependent = 1
+        sim.add(m=1)
+        sim.add(m=1e-6,a=1)
+        sim.add(m=1e-3,a=5)
+        sim.move_to_com()
+        AFSOAFF = CFUNCTYPE(None,POINTER(rebound.Simulation),c_int,POINTER(c_double),POINTER(c_double),POINTER(c_double))
+        @AFSOAFF
+        def af(sim, N, pos, vel, acc):
+            fac = 0.01
+            acc[2] = -fac*vel[2]
+            acc[N+2] = -fac*vel[2*N+2]
+            acc[2*N+2] = -fac*vel[N+2]
+        sim.additional_forces_soa = af
+        sim.integrate(10.)
+        self.assertAlmostEqual(sim.particles[2].a,4.86583,delta=1e-4)
+
 
 if __name__ == "__main__":
     unittest.main()
@@ -0,0 +1,79 @@
+import rebound
+import unittest
+import math
+
+def setup_testparticles():
+    sim = rebound.Simulation()
+    sim.add(m=1)
+    sim.add(m=1e-3,a=1,e=0.05)
+    sim.add(m=1e-3,a=1.6,e=0.05)
+    sim.N_active = sim.N
+    for i in range(50):
+        sim.add(a=0.5+i*0.04, e=0.1, f=i, omega=i*0.3, primary=sim.particles[0])
+    sim.move_to_com()
+    return sim
+
+class TestIntegratorBlock(unittest.TestCase):
+    def test_twobody_energy(self):
+        sim = rebound.Simulation()
+        sim.add(m=1)
+        sim.add(m=1e-3,a=1,e=0.5)
+        sim.move_to_com()
+        sim.integrator = "block"
+        sim.dt = 1.
+        e0 = sim.energy()
+        sim.integrate(100.*math.pi)
+        e1 = sim.energy()
+        self.assertLess(math.fabs((e0-e1)/e1),1e-6)
+
+    def test_testparticles(self):
+        sim = setup_testparticles()
+        sim2 = sim.copy()
+        sim.integrate(2.*math.pi)
+        sim2.integrator = "block"
+        sim2.dt = 0.25
+        sim2.ri_block.max_level = 16
+        sim2.integrate(2.*math.pi)
+        for i in range(sim.N):
+            d = sim.particles[i] - sim2.particles[i]
+            self.assertLess(math.sqrt(d.x*d.x+d.y*d.y+d.z*d.z),1e-5)
+        # Only few particles need short steps
+        self.assertLess(sim2.ri_block.particle_steps, sim.N*sim2.steps_done*2**6)
+
+    def test_convergence(self):
+        sim = setup_testparticles()
+        sim.integrate(2.*math.pi)
+        errors = []
+        for eta in [0.02,0.01]:
+            sim2 = setup_testparticles()
+            sim2.integrator = "block"
+            sim2.dt = 0.25
+            sim2.ri_block.eta = eta
+            sim2.ri_block.max_level = 16
+            sim2.integrate(2.*math.pi)
+            d = sim.particles[1] - sim2.particles[1]
+            errors.append(math.sqrt(d.x*d.x+d.y*d.y+d.z*d.z))
+        # Fourth order
+        self.assertGreater(errors[0]/errors[1], 8.)
+
+    def test_unsupported_gravity(self):
+        sim = rebound.Simulation()
+        sim.add(m=1)
+        sim.add(m=1e-3,a=1)
+        sim.integrator = "block"
+        sim.gravity = "tree"
+        sim.configure_box(10.)
+        with self.assertRaises(RuntimeError):
+            sim.integrate(1.)
+
+    def test_save(self):
+        sim = rebound.Simulation()
+        sim.integrator = "block"
+        sim.ri_block.eta = 0.01
+        sim.ri_block.max_level = 12
+        sim2 = sim.copy()
+        self.assertEqual(sim2.ri_block.eta, 0.01)
+        self.assertEqual(sim2.ri_block.max_level, 12)
+
+if __name__ == "__main__":
+    unittest.main()
@@ -17,6 +17,25 @@ class TestBoundary(unittest.TestCase):
         with self.assertRaises(rebound.NoParticles):
             sim.integrate(2.)
     
+    def test_open_energy_offset(self):
+        for testparticle_type in [0,1]:
+            sim = rebound.Simulation()
+            sim.integrator = "ias15"
+            sim.boundary = "open"
+            sim.configure_box(10.)
+            sim.track_energy_offset = 1
+            sim.testparticle_type = testparticle_type
+            sim.testparticle_hidewarnings = 1
+            sim.add(m=1.)
+            sim.add(m=1e-3,a=1.)
+            sim.add(m=1e-3,x=2., vx=8.0)
+            sim.add(m=1e-5,x=-1., vy=-7.0)
+            sim.N_active = 3
+            E0 = sim.energy()
+            sim.integrate(2.)
+            self.assertEqual(sim.N,2)
+            self.assertAlmostEqual((sim.energy()-E0)/E0,0.,delta=1e-14)
+    
     def test_periodic(self):
         sim = rebound.Simulation()
         sim.boundary = "periodic"
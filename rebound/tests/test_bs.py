@@ -88,8 +88,48 @@ class TestIntegratorBSHarmonic(unittest.TestCase):
         self.assertLess(math.fabs(ode_ho.y[0]-1.),2e-10)
         self.assertLess(math.fabs(ode_ho.y[1]),2e-9)
 
+    def test_bs_harmonic_batch(self):
+        # One batch of 5 oscillators gives the same result as 5 separate ODEs
+        ks = [1., 4., 10., 50., 100.]
+        def derivatives_batch(ode, yDot, y, t):
+            for i in range(ode.contents.batch_N):
+                yDot[2*i] = y[2*i+1]
+                yDot[2*i+1] = -ks[i]*y[2*i]
+        def make_derivatives(k):
+            def derivatives(ode, yDot, y, t):
+                yDot[0] = y[1]
+                yDot[1] = -k*y[0]
+            return derivatives
+
+        sim1 = rebound.Simulation()
+        sim1.integrator = "BS"
+        odes = []
+        for i, k in enumerate(ks):
+            ode = sim1.create_ode(length=2, needs_nbody=False)
+            ode.derivatives = make_derivatives(k)
+            ode.y[0] = 1.+0.1*i
+            ode.y[1] = 0.
+            odes.append(ode)
+
+        sim2 = rebound.Simulation()
+        sim2.integrator = "BS"
+        batch = sim2.create_ode_batch(length=2, N=len(ks), needs_nbody=False)
+        self.assertEqual(batch.batch_N, 5)
+        self.assertEqual(batch.batch_length, 2)
+        self.assertEqual(batch.length, 10)
+        batch.derivatives = derivatives_batch
+        for i in range(len(ks)):
+            batch.y[2*i] = 1.+0.1*i
+            batch.y[2*i+1] = 0.
+
+        sim1.integrate(10.)
+        sim2.integrate(10.)
+        self.assertEqual(sim1.t, sim2.t)
+        for i in range(len(ks)):
+            self.assertEqual(odes[i].y[0], batch.y[2*i])
+            self.assertEqual(odes[i].y[1], batch.y[2*i+1])
+
 
-    
 def af(simp):
     sim = simp.contents
     x = sim.particles[0].x
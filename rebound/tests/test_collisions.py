@@ -1,8 +1,80 @@
 import rebound
 import unittest
 import math
+import random
+import os
+import warnings
 import numpy as np
 
+def random_box(collision, periodic, seed=2, skin=0., polydisperse=False, N=200, N_large=0, t=0.1, **settings):
+    """
+    Integrates N particles with random positions and velocities in a unit square and hardsphere collisions.
+    With polydisperse=True, the radii span 2.5 orders of magnitude and a large particle sits in the center.
+    With N_large>0, the first N_large particles are large active particles, the N others are small test particles.
+    The remaining keyword arguments are set as attributes of the simulation after the particles have been added.
+    Returns the simulation.
+    """
+    random.seed(seed)
+    sim = rebound.Simulation()
+    sim.integrator = "leapfrog"
+    if periodic:
+        sim.configure_box(1)
+        sim.boundary   = "periodic"
+        sim.nghostx = 1
+        sim.nghosty = 1
+    sim.gravity = "none"
+    sim.collision  = collision
+    sim.collision_skin = skin
+    sim.collision_resolve = "hardsphere"
+    sim.rand_seed = 3
+    sim.dt = 1e-3
+    def add(**kwargs):
+        sim.add(x=random.uniform(-0.5,0.5), y=random.uniform(-0.5,0.5), vx=random.uniform(-1,1), vy=random.uniform(-1,1), **kwargs)
+    if polydisperse:
+        sim.add(r=0.2, m=1)
+    for i in range(N_large):
+        add(r=0.1, m=1)
+    if N_large:
+        sim.N_active = sim.N
+    for i in range(N):
+        if N_large:
+            add(r=0.002)
+        else:
+            add(r=10**random.uniform(-4,-1.5) if polydisperse else random.uniform(0.01,0.03), m=1)
+    for key, value in settings.items():
+        setattr(sim, key, value)
+    sim.integrate(t)
+    return sim
+
+def collision_outcome(sim):
+    """ Number of collisions and final x velocities, used to compare collision searches. """
+    return (sim.collisions_Nlog, [p.vx for p in sim.particles])
+
+def find_collision(test, collision, t, line=False, **settings):
+    """
+    Integrates two particles moving towards each other and checks that the collision is found at time t.
+    With line=True, the particles collide in the middle of a long timestep.
+    The remaining keyword arguments are set as attributes of the simulation. Returns the simulation.
+    """
+    sim = rebound.Simulation()
+    sim.integrator = "leapfrog"
+    sim.collision  = collision
+    if line:
+        sim.gravity = "none"
+        sim.dt = 10
+        sim.add(r=1,x=-20,vx=1)
+        sim.add(r=1,x=20,vx=-1)
+    else:
+        sim.dt = 1
+        sim.add(r=1,x=0)
+        sim.add(r=1,x=4.3,vx=-1)
+    for key, value in settings.items():
+        setattr(sim, key, value)
+    with test.assertRaises(rebound.Collision):
+        sim.integrate(100 if line else 10)
+    test.assertAlmostEqual(sim.t, t, delta=1e-12)
+    return sim
+
 class TestLineTreeCollisions(unittest.TestCase):
     
     def test_linetree_find(self):
@@ -108,6 +180,98 @@ class TestLineCollisions(unittest.TestCase):
         sim.add(r=1,x=0)
         sim.add(r=1,x=2.1,vx=1)
         sim.integrate(10)
+    
+    def run_plunging(self, hermite, dt, q=0.06, M=-0.55):
+        # Test particle on an eccentric orbit which dives into the star
+        sim = rebound.Simulation()
+        sim.integrator = "whfast"
+        sim.add(m=1., r=0.1)
+        sim.add(primary=sim.particles[0], a=1., e=1.-q, M=M)
+        sim.N_active = 1
+        sim.collision = "line"
+        sim.collision_line_hermite = hermite
+        sim.collision_time_of_impact = 1
+        times = []
+        def resolve(sim_pointer, c):
+            times.append(c.t)
+            return 0
+        sim.collision_resolve = resolve
+        sim.dt = dt
+        sim.integrate(1.)
+        return times
+
+    def test_line_hermite(self):
+        e = 1.-0.06
+        E = -math.acos(0.9/e) # Eccentric anomaly at r=0.1
+        t_impact = E-e*math.sin(E)+0.55
+        # Straight lines miss the curved trajectory near pericentre
+        self.assertEqual(self.run_plunging(0, 0.1), [])
+        times = self.run_plunging(1, 0.1)
+        self.assertGreater(len(times), 0)
+        self.assertAlmostEqual(times[0], t_impact, delta=1e-2)
+        times = self.run_plunging(1, 0.02)
+        self.assertAlmostEqual(times[0], t_impact, delta=1e-4)
+        # Small timestep: both agree on the time of impact
+        t_line = self.run_plunging(0, 0.001)[0]
+        t_hermite = self.run_plunging(1, 0.001)[0]
+        self.assertAlmostEqual(t_line, t_hermite, delta=1e-5)
+
+    def run_plunging_ias15(self, mode, dt):
+        sim = rebound.Simulation()
+        sim.integrator = "ias15"
+        sim.ri_ias15.epsilon = 0 # fixed timestep
+        sim.add(m=1., r=0.1)
+        sim.add(primary=sim.particles[0], a=1., e=0.94, M=-0.55)
+        sim.N_active = 1
+        sim.collision = "line"
+        sim.collision_line_hermite = mode=="hermite"
+        sim.collision_line_ias15 = mode=="ias15"
+        sim.collision_time_of_impact = 1
+        times = []
+        def resolve(sim_pointer, c):
+            times.append(c.t)
+            return 0
+        sim.collision_resolve = resolve
+        sim.dt = dt
+        sim.integrate(1.)
+        return times
+
+    def test_line_ias15(self):
+        e = 1.-0.06
+        E = -math.acos(0.9/e) # Eccentric anomaly at r=0.1
+        t_impact = E-e*math.sin(E)+0.55
+        self.assertEqual(self.run_plunging_ias15("line", 0.1), [])
+        times = self.run_plunging_ias15("ias15", 0.1)
+        self.assertEqual(len(times), 1)
+        self.assertAlmostEqual(times[0], t_impact, delta=1e-3)
+        # Much more accurate than the Hermite interpolation
+        t_hermite = self.run_plunging_ias15("hermite", 0.05)[0]
+        t_ias15 = self.run_plunging_ias15("ias15", 0.05)[0]
+        self.assertAlmostEqual(t_ias15, t_impact, delta=1e-5)
+        self.assertLess(abs(t_ias15-t_impact), abs(t_hermite-t_impact))
+
+    def test_line_ias15_testparticle_substeps(self):
+        # Substepped test particles fall back to the Hermite interpolation
+        sim = rebound.Simulation()
+        sim.add(m=1., r=0.005)
+        sim.add(m=1e-3, a=1., r=0.01)
+        p = sim.particles[1]
+        sim.add(x=p.x+0.3, y=p.y, vx=p.vx-1., vy=p.vy, r=0.)
+        sim.N_active = 2
+        sim.ri_ias15.testparticle_substeps = 1
+        sim.collision = "line"
+        sim.collision_line_ias15 = 1
+        sim.collision_resolve = "merge"
+        sim.integrate(1.)
+        self.assertEqual(sim.N, 2)
+
+    def test_line_hermite_copy(self):
+        sim = rebound.Simulation()
+        sim.collision_line_hermite = 1
+        sim.collision_line_ias15 = 1
+        sim2 = sim.copy()
+        self.assertEqual(sim2.collision_line_hermite, 1)
+        self.assertEqual(sim2.collision_line_ias15, 1)
 
 
 class TestCollisions(unittest.TestCase):
@@ -198,6 +362,594 @@ class TestCollisions(unittest.TestCase):
         sim.integrate(sim.dt)
         sim.integrate(2.*sim.dt)
         self.assertLess(sim.N,25)
+class TestCollisionRemoval(unittest.TestCase):
+
+    def setup_sim(self, keep_sorted):
+        sim = rebound.Simulation()
+        sim.integrator = "leapfrog"
+        sim.gravity    = "none"
+        sim.collision  = "direct"
+        sim.collision_skip_testparticle_pairs = 1
+        sim.collision_resolve_keep_sorted = keep_sorted
+        sim.dt = 1e-3
+        sim.add(m=1., r=1., hash="planet")
+        for i in range(60):
+            # Every third particle is outside the planet
+            x = 0.5 if i%3 else 5.
+            sim.add(r=0.01, x=x, y=i*0.01, hash="p%d"%i)
+        sim.N_active = 1
+        def remove_testparticle(r, c):
+            return 1 if c.p2 == 0 else 2
+        sim.collision_resolve = remove_testparticle
+        return sim
+
+    def test_remove_many_keep_sorted(self):
+        sim = self.setup_sim(1)
+        sim.integrate(sim.dt)
+        self.assertEqual(sim.N, 21)
+        self.assertEqual(sim.N_active, 1)
+        self.assertEqual(sim.particles[0].hash.value, rebound.hash("planet").value)
+        for k, i in enumerate(range(0,60,3)):
+            self.assertEqual(sim.particles[k+1].hash.value, rebound.hash("p%d"%i).value)
+            self.assertEqual(sim.particles["p%d"%i].y, i*0.01)
+        with self.assertRaises(rebound.ParticleNotFound):
+            sim.particles["p1"]
+
+    def test_remove_many_unsorted(self):
+        sim = self.setup_sim(0)
+        sim.particles["p0"] # creates lookup table
+        sim.integrate(sim.dt)
+        self.assertEqual(sim.N, 21)
+        self.assertEqual(sim.particles[0].hash.value, rebound.hash("planet").value)
+        hashes = set(p.hash.value for p in sim.particles[1:])
+        self.assertEqual(hashes, set(rebound.hash("p%d"%i).value for i in range(0,60,3)))
+        for i in range(0,60,3):
+            self.assertEqual(sim.particles["p%d"%i].y, i*0.01)
+
+class TestBatchCollisionResolve(unittest.TestCase):
+
+    def run_random(self, collision_resolve, batch, parallel=0):
+        if batch:
+            sim = random_box("direct", False, seed=4, collision_resolve_parallel=parallel, collision_resolve_batch=collision_resolve)
+        else:
+            sim = random_box("direct", False, seed=4, collision_resolve_parallel=parallel, collision_resolve=collision_resolve)
+        return (sim.N, [p.vx for p in sim.particles])
+
+    def test_batch_builtin(self):
+        for collision_resolve in ["merge", "hardsphere"]:
+            r1 = self.run_random(collision_resolve, False)
+            r2 = self.run_random(collision_resolve, True)
+            self.assertEqual(r1, r2)
+        self.assertLess(self.run_random("merge", True)[0], 200)
+
+    def test_parallel_hardsphere(self):
+        r1 = self.run_random("hardsphere", False)
+        r2 = self.run_random("hardsphere", False, parallel=1)
+        self.assertEqual(r1, r2)
+
+    def test_batch_python(self):
+        calls = []
+        def remove_larger_index(sim_pointer, collisions, collisions_N, outcomes):
+            calls.append(collisions_N)
+            for i in range(collisions_N):
+                outcomes[i] = 2 if collisions[i].p2 > collisions[i].p1 else 1
+        sim = rebound.Simulation()
+        sim.integrator = "leapfrog"
+        sim.gravity = "none"
+        sim.collision  = "direct"
+        sim.collision_resolve_batch = remove_larger_index
+        sim.dt = 1e-3
+        sim.add(r=1)
+        for i in range(10):
+            sim.add(r=0.01, x=0.5, y=0.01*i)
+        sim.integrate(sim.dt)
+        self.assertEqual(len(calls), 1)
+        self.assertGreater(calls[0], 10)
+        self.assertEqual(sim.N, 1)
+        sim.add(r=0.01, x=0.5)
+        sim.collision_resolve_batch = None
+        sim.collision_resolve = "halt"
+        with self.assertRaises(rebound.Collision):
+            sim.integrate(2*sim.dt)
+
+class TestGridCollisions(unittest.TestCase):
+    
+    def test_grid_find(self):
+        find_collision(self, "grid", 3.)
+    
+    def test_grid_miss(self):
+        sim = rebound.Simulation()
+        sim.integrator = "leapfrog"
+        sim.collision  = "grid"
+        sim.dt = 1
+        sim.add(r=1,x=0)
+        sim.add(r=1,x=2.1,vx=1)
+        sim.integrate(10)
+    
+    def test_grid_small_cellsize(self):
+        find_collision(self, "grid", 3., collision_grid_cellsize=0.1)
+    
+    def test_grid_periodic(self):
+        sim = rebound.Simulation()
+        sim.integrator = "leapfrog"
+        sim.configure_box(10)
+        sim.boundary   = "periodic"
+        sim.nghostx = 1
+        sim.collision  = "grid"
+        sim.dt = 1
+        sim.add(r=1,x=-4.5)
+        sim.add(r=1,x=3.8,vx=0.5)
+        with self.assertRaises(rebound.Collision):
+            sim.integrate(10)
+        self.assertAlmostEqual(sim.t, 1., delta=1e-12)
+
+    def test_grid_same_as_direct(self):
+        results = [collision_outcome(random_box(collision, True, seed=1)) for collision in ["direct", "grid"]]
+        self.assertGreater(results[0][0], 0)
+        self.assertEqual(results[0], results[1])
+
+    def test_direct_soa(self):
+        results = [collision_outcome(random_box("direct", True, seed=1, N=203, N_active=150, use_soa=use_soa)) for use_soa in [0, 1]]
+        self.assertGreater(results[0][0], 0)
+        self.assertEqual(results[0], results[1])
+
+class TestSweepAndPruneCollisions(unittest.TestCase):
+    
+    def test_sap_find(self):
+        find_collision(self, "sap", 3.)
+    
+    def test_linesap_find(self):
+        find_collision(self, "linesap", 20., line=True)
+
+    def test_sap_same_as_direct(self):
+        for periodic in [False, True]:
+            r1 = collision_outcome(random_box("direct", periodic))
+            r2 = collision_outcome(random_box("sap", periodic))
+            self.assertGreater(r1[0], 0)
+            self.assertEqual(r1, r2)
+    
+    def test_linesap_same_as_line(self):
+        for periodic in [False, True]:
+            r1 = collision_outcome(random_box("line", periodic))
+            r2 = collision_outcome(random_box("linesap", periodic))
+            self.assertGreater(r1[0], 0)
+            self.assertEqual(r1, r2)
+
+class TestBVHCollisions(unittest.TestCase):
+    
+    def test_bvh_find(self):
+        find_collision(self, "bvh", 3.)
+    
+    def test_linebvh_find(self):
+        find_collision(self, "linebvh", 20., line=True)
+
+    def test_bvh_same_as_direct(self):
+        for periodic in [False, True]:
+            for polydisperse in [False, True]:
+                r1 = collision_outcome(random_box("direct", periodic, polydisperse=polydisperse))
+                sim = random_box("bvh", periodic, polydisperse=polydisperse)
+                self.assertGreater(r1[0], 0)
+                self.assertEqual(r1, collision_outcome(sim))
+                # Boxes are refitted, not rebuilt every timestep
+                self.assertGreater(sim.collision_bvh_builds, 0)
+                self.assertLess(sim.collision_bvh_builds, 50)
+    
+    def test_linebvh_same_as_line(self):
+        for periodic in [False, True]:
+            r1 = collision_outcome(random_box("line", periodic))
+            r2 = collision_outcome(random_box("linebvh", periodic))
+            self.assertGreater(r1[0], 0)
+            self.assertEqual(r1, r2)
+
+    def test_bvh_remove(self):
+        # The hierarchy is rebuilt when particles are removed
+        sim = rebound.Simulation()
+        sim.integrator = "leapfrog"
+        sim.gravity = "none"
+        sim.collision = "bvh"
+        sim.collision_resolve = "merge"
+        sim.dt = 0.1
+        for i in range(10):
+            sim.add(m=1., r=0.1, x=0.15*i, vx=-0.1*i)
+        sim.integrate(5.)
+        self.assertEqual(sim.N, 1)
+        self.assertGreater(sim.collision_bvh_builds, 1)
+
+class TestNeighbourListCollisions(unittest.TestCase):
+    
+    def test_neighbourlist_same_as_direct(self):
+        for periodic in [False, True]:
+            for skin in [0., 0.005, 0.1]:
+                r1 = collision_outcome(random_box("direct", periodic))
+                sim = random_box("neighbourlist", periodic, skin=skin)
+                self.assertGreater(r1[0], 0)
+                self.assertEqual(r1, collision_outcome(sim))
+                self.assertGreater(sim.collision_neighbours_builds, 0)
+                self.assertLess(sim.collision_neighbours_builds, 100)
+
+    def test_neighbourlist_rebuild(self):
+        sim = find_collision(self, "neighbourlist", 2.4, collision_skin=0.5, dt=0.1)
+        self.assertGreater(sim.collision_neighbours_builds, 1)
+        self.assertLess(sim.collision_neighbours_builds, 10)
+
+class TestActiveListCollisions(unittest.TestCase):
+    
+    def run_random(self, collision, periodic, skin=0.):
+        return random_box(collision, periodic, seed=4, skin=skin, N=300, N_large=3, t=0.2, collision_skip_testparticle_pairs=1)
+
+    def test_activelist_same_as_direct(self):
+        for periodic in [False, True]:
+            r1 = collision_outcome(self.run_random("direct", periodic))
+            for skin in [0., 0.01]:
+                sim = self.run_random("activelist", periodic, skin)
+                self.assertGreater(r1[0], 0)
+                self.assertEqual(r1, collision_outcome(sim))
+                self.assertGreater(sim.collision_neighbours_builds, 0)
+                self.assertLess(sim.collision_neighbours_builds, 200)
+
+class TestTreeRebuild(unittest.TestCase):
+    
+    def create(self, tree_rebuild):
+        sim = rebound.Simulation()
+        sim.configure_box(10., 2, 2, 1)
+        sim.configure_ghostboxes(1, 1, 0)
+        sim.boundary = "periodic"
+        sim.gravity = "tree"
+        sim.collision = "tree"
+        sim.collision_resolve = "hardsphere"
+        sim.integrator = "leapfrog"
+        sim.tree_rebuild = tree_rebuild
+        sim.rand_seed = 1
+        sim.G = 1e-3
+        sim.dt = 1e-8
+        rng = random.Random(1)
+        for i in range(500):
+            sim.add(m=1e-3, r=0.05,
+                    x=rng.uniform(-10.,10.), y=rng.uniform(-10.,10.), z=rng.uniform(-5.,5.),
+                    vx=rng.gauss(0.,1.), vy=rng.gauss(0.,1.), vz=rng.gauss(0.,1.))
+        return sim
+
+    def test_same_tree(self):
+        # The rebuilt tree is identical to the one built by adding particles
+        sim0 = self.create(0)
+        sim1 = self.create(1)
+        sim0.step()
+        sim1.step()
+        for p0, p1 in zip(sim0.particles, sim1.particles):
+            self.assertEqual(p0.vx, p1.vx)
+            self.assertEqual(p0.vy, p1.vy)
+            self.assertEqual(p0.vz, p1.vz)
+
+    def test_long_run(self):
+        sim0 = self.create(0)
+        sim1 = self.create(1)
+        sim0.dt = sim1.dt = 1e-2
+        sim0.integrate(1.)
+        sim1.integrate(1.)
+        self.assertEqual(sim0.N, sim1.N)
+        self.assertEqual(sim0.collisions_Nlog, sim1.collisions_Nlog)
+        self.assertAlmostEqual(sim0.energy(), sim1.energy(), delta=1e-10*abs(sim0.energy()))
+
+    def test_remove(self):
+        sim = self.create(1)
+        sim.step()
+        sim.remove(0, keepSorted=False)
+        sim.step()
+        self.assertEqual(sim.N, 499)
+
+class TestTimeOfImpact(unittest.TestCase):
+    
+    def create(self, collision, toi):
+        sim = rebound.Simulation()
+        sim.configure_box(20.)
+        sim.gravity = "none"
+        sim.integrator = "leapfrog"
+        sim.collision = collision
+        sim.collision_time_of_impact = toi
+        sim.dt = 1.2
+        sim.add(m=1, r=0.1, x=-1, vx=1)
+        sim.add(m=1, r=0.1, x=1, vx=-1)
+        return sim
+
+    def test_hardsphere_at_time_of_impact(self):
+        for collision in ["line", "linetree", "linesap"]:
+            sim = self.create(collision, 1)
+            sim.collision_resolve = "hardsphere"
+            sim.step()
+            self.assertEqual(sim.collisions_Nlog, 1)
+            x = sorted([p.x for p in sim.particles])
+            self.assertAlmostEqual(x[0], -0.4, delta=1e-14)
+            self.assertAlmostEqual(x[1], 0.4, delta=1e-14)
+            # Without the time of impact, the particles have already passed each other
+            sim = self.create(collision, 0)
+            sim.collision_resolve = "hardsphere"
+            sim.step()
+            self.assertEqual(sim.collisions_Nlog, 0)
+
+    def test_time_order(self):
+        for collision in ["line", "linetree", "linesap"]:
+            sim = self.create(collision, 1)
+            sim.add(m=1, r=0.1, x=-1, y=5, vx=2)
+            sim.add(m=1, r=0.1, x=1, y=5, vx=-2)
+            times = []
+            def resolve(sim_pointer, collision):
+                times.append(collision.t)
+                return 0
+            sim.collision_resolve = resolve
+            sim.step()
+            # The tree search reports every pair once for each particle
+            self.assertIn(len(times), [2, 4])
+            self.assertAlmostEqual(times[0], 0.45, delta=1e-14)
+            self.assertAlmostEqual(times[-1], 0.9, delta=1e-14)
+            self.assertEqual(times, sorted(times))
+
+    def test_direct_current_time(self):
+        sim = self.create("direct", 1)
+        sim.dt = 0.95
+        times = []
+        def resolve(sim_pointer, collision):
+            times.append(collision.t)
+            return 0
+        sim.collision_resolve = resolve
+        sim.step()
+        self.assertEqual(times, [0.95, 0.95])
+
+class TestCollisionStatistics(unittest.TestCase):
+    
+    def create(self, collision, track):
+        sim = rebound.Simulation()
+        sim.configure_box(10.)
+        sim.boundary = "periodic"
+        sim.gravity = "none"
+        sim.collision = collision
+        sim.collision_resolve = "merge"
+        sim.track_collision_statistics = track
+        sim.dt = 0.5
+        for i in range(100):
+            sim.add(m=1, r=0.3, x=(i%10)-4.5, y=(i//10)-4.5, vx=0.5*(-1)**i)
+        return sim
+
+    def test_statistics_disabled(self):
+        sim = self.create("direct", 0)
+        sim.step()
+        s = sim.collision_statistics
+        self.assertEqual(s.pairs+s.nodes+s.ghostboxes+s.hits+s.resolved+s.removed, 0)
+
+    def test_statistics_direct(self):
+        sim = self.create("direct", 1)
+        sim.step()
+        s = sim.collision_statistics
+        self.assertEqual(s.pairs, 100*99)
+        self.assertEqual(s.nodes, 0)
+        self.assertEqual(s.ghostboxes, 1)
+        self.assertEqual(s.hits, 100) # Every pair is found twice
+        self.assertEqual(s.resolved, 50)
+        self.assertEqual(s.removed, 50)
+        self.assertEqual(sim.N, 50)
+
+    def test_statistics_tree(self):
+        sim = self.create("tree", 1)
+        sim.step()
+        s = sim.collision_statistics
+        self.assertGreater(s.nodes, 100)
+        self.assertGreater(s.pairs, 50)
+        self.assertLess(s.pairs, 100*99)
+        self.assertEqual(s.ghostboxes, 100)
+        self.assertEqual(s.hits, 100)
+        self.assertEqual(s.removed, 50)
+
+    def test_statistics_line(self):
+        sim = self.create("line", 1)
+        sim.step()
+        s = sim.collision_statistics
+        self.assertEqual(s.pairs, 100*99//2)
+        self.assertEqual(s.hits, 50)
+
+class TestTestparticleCollisions(unittest.TestCase):
+    
+    def setup_sim(self, collision, skip, x=14.3):
+        sim = rebound.Simulation()
+        sim.integrator = "leapfrog"
+        sim.gravity    = "none"
+        sim.collision  = collision
+        sim.configure_box(100)
+        sim.dt = 1
+        sim.add(m=1., r=1, x=-20)
+        sim.add(r=1,x=10)
+        sim.add(r=1,x=x,vx=-1)
+        sim.N_active = 1
+        sim.collision_skip_testparticle_pairs = skip
+        return sim
+
+    def test_skip_testparticle_pairs(self):
+        for collision in ["direct", "line", "tree", "linetree", "grid", "sap", "linesap", "neighbourlist", "auto", "lineauto", "bvh", "linebvh"]:
+            sim = self.setup_sim(collision, 1)
+            sim.integrate(8)
+            sim = self.setup_sim(collision, 0)
+            with self.assertRaises(rebound.Collision):
+                sim.integrate(8)
+    
+    def test_skip_testparticle_pairs_active(self):
+        for collision in ["direct", "line", "tree", "linetree", "grid", "sap", "linesap", "neighbourlist", "auto", "lineauto", "activelist", "bvh", "linebvh"]:
+            sim = self.setup_sim(collision, 1, x=-15.3)
+            with self.assertRaises(rebound.Collision):
+                sim.integrate(8)
+    
+    def test_tree_large_testparticle(self):
+        # Only the small active particle searches the tree, so the
+        # radius of the large test particle needs to be taken into account.
+        for collision in ["tree", "linetree"]:
+            sim = rebound.Simulation()
+            sim.integrator = "leapfrog"
+            sim.gravity    = "none"
+            sim.configure_box(10)
+            sim.collision  = collision
+            sim.dt = 1e-3
+            sim.add(m=1., r=0.01)
+            sim.add(r=0.01, x=-4.)
+            sim.add(r=1.5, x=1.45)
+            for i in range(20):
+                sim.add(r=0.001, x=1.45+0.01*i, y=0.3)
+            sim.N_active = 1
+            sim.collision_skip_testparticle_pairs = 1
+            with self.assertRaises(rebound.Collision):
+                sim.integrate(sim.dt)
+
+    def test_skip_testparticle_pairs_binary(self):
+        sim = self.setup_sim("direct", 1)
+        sim2 = sim.copy()
+        self.assertEqual(sim2.collision_skip_testparticle_pairs, 1)
+
+class TestCollisionLog(unittest.TestCase):
+    def merging_sim(self):
+        sim = rebound.Simulation()
+        sim.rand_seed = 1
+        sim.integrator = "leapfrog"
+        sim.dt = 0.01
+        sim.collision = "direct"
+        sim.collision_resolve = "merge"
+        for i in range(10):
+            sim.add(m=1., r=0.1, x=0.15*i, vx=-0.1*i, hash=i+1)
+        return sim
+
+    def test_collision_log(self):
+        if os.path.isfile("collisions.bin"):
+            os.remove("collisions.bin")
+        sim = self.merging_sim()
+        sim.collision_log_open("collisions.bin")
+        sim.integrate(2.)
+        sim.collision_log_flush()
+        self.assertGreater(10-sim.N, 0)
+        # Header and one entry of 72 bytes per resolved collision
+        size = os.path.getsize("collisions.bin")
+        self.assertEqual((size-16)%72, 0)
+        self.assertGreaterEqual((size-16)//72, 10-sim.N)
+        sim.collision_log_close()
+        log = rebound.read_collision_log("collisions.bin")
+        os.remove("collisions.bin")
+        # Particles which already merged in the same timestep are not merged again (outcome 0)
+        self.assertEqual(np.count_nonzero(log["outcome"]), 10-sim.N)
+        self.assertTrue(np.all(log["t"] <= sim.t))
+        # Particles were touching when they collided
+        self.assertTrue(np.all(np.sqrt(log["x"]**2+log["y"]**2+log["z"]**2) <= 0.2))
+
+    def test_collision_log_batch(self):
+        # Same log with the batched resolve function
+        logs = []
+        for batch in [None, "merge"]:
+            if os.path.isfile("collisions.bin"):
+                os.remove("collisions.bin")
+            sim = self.merging_sim()
+            sim.collision_resolve_batch = batch
+            sim.collision_log_open("collisions.bin")
+            sim.integrate(2.)
+            sim.collision_log_close()
+            logs.append(rebound.read_collision_log("collisions.bin"))
+            os.remove("collisions.bin")
+        self.assertEqual(len(logs[0]), len(logs[1]))
+        mergers = [log[log["outcome"] != 0] for log in logs]
+        self.assertTrue(np.array_equal(mergers[0], mergers[1]))
+
+    def test_collision_log_halt(self):
+        if os.path.isfile("collisions.bin"):
+            os.remove("collisions.bin")
+        sim = self.merging_sim()
+        sim.collision_resolve = "halt"
+        sim.collision_log_open("collisions.bin")
+        with self.assertRaises(rebound.Collision):
+            sim.integrate(2.)
+        sim.collision_log_close()
+        self.assertGreater(os.path.getsize("collisions.bin"), 16)
+        os.remove("collisions.bin")
+
+class TestSleeping(unittest.TestCase):
+    def cradle(self, collision):
+        sim = rebound.Simulation()
+        sim.integrator = "leapfrog"
+        sim.gravity = "none"
+        sim.collision = collision
+        sim.collision_resolve = "hardsphere"
+        sim.dt = 0.01
+        sim.sleep_v = 1e-3
+        sim.sleep_steps = 5
+        if collision == "tree":
+            sim.configure_box(20.)
+        for i in range(10):
+            sim.add(m=1., r=0.1, x=i*0.5)
+        sim.add(m=1., r=0.1, x=-1., vx=1.)
+        return sim
+
+    def test_cradle(self):
+        for collision in ["direct", "tree"]:
+            sim = self.cradle(collision)
+            for i in range(6):
+                sim.step()
+            self.assertEqual(sim.N_asleep, 10)
+            self.assertFalse(sim.particles[10].asleep)
+            # The projectile wakes up the first particle, which wakes up the next one, ...
+            sim.integrate(6.)
+            self.assertEqual(sim.N_asleep, 10)
+            p = [p for p in sim.particles if not p.asleep]
+            self.assertEqual(len(p), 1)
+            self.assertAlmostEqual(p[0].vx, 1., delta=1e-12)
+            self.assertGreater(p[0].x, 4.5)
+
+    def test_wake_up(self):
+        sim = self.cradle("direct")
+        for i in range(6):
+            sim.step()
+        self.assertTrue(sim.particles[5].asleep)
+        sim.particles[5].vy = 1.
+        sim.step()
+        self.assertFalse(sim.particles[5].asleep)
+        self.assertNotEqual(sim.particles[5].y, 0.)
+        sim.sleep_v = 0.
+        sim.step()
+        self.assertEqual(sim.N_asleep, 0)
+
+    def test_remove_freeze(self):
+        sim = self.cradle("direct")
+        for i in range(6):
+            sim.step()
+        self.assertEqual(sim.N_asleep, 10)
+        sim.remove(0)
+        self.assertEqual(sim.N_asleep, 9)
+        self.assertEqual(sim.N_frozen, 0)
+        sim.remove(8, keepSorted=False)
+        self.assertEqual(sim.N_asleep, 8)
+        sim.N_active = 1
+        sim.freeze(4)
+        self.assertEqual(sim.N_asleep, 7)
+        self.assertEqual(sim.N_frozen, 1)
+        sim.remove(4)
+        self.assertEqual(sim.N_asleep, 7)
+        self.assertEqual(sim.N_frozen, 0)
+
+    def test_save_load(self):
+        sim = self.cradle("direct")
+        sim.integrate(0.5)
+        if os.path.isfile("sleep.bin"):
+            os.remove("sleep.bin")
+        sim.save("sleep.bin")
+        with warnings.catch_warnings(record=True):
+            sim2 = rebound.Simulation("sleep.bin")
+        os.remove("sleep.bin")
+        sim2.collision_resolve = "hardsphere"
+        self.assertEqual(sim2.N_asleep, sim.N_asleep)
+        self.assertEqual(sim2.sleep_steps, 5)
+        sim.integrate(3.)
+        sim2.integrate(3.)
+        for p1, p2 in zip(sim.particles, sim2.particles):
+            self.assertEqual(p1.x, p2.x)
+            self.assertEqual(p1.asleep, p2.asleep)
+
+    def test_integrator(self):
+        sim = self.cradle("direct")
+        sim.integrator = "ias15"
+        with self.assertRaises(RuntimeError):
+            sim.step()
+        self.assertEqual(sim.sleep_v, 0.)
+
 
 if __name__ == "__main__":
     unittest.main()
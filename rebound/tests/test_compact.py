@@ -0,0 +1,125 @@
+import rebound
+import unittest
+import os
+
+def planets(compact=None):
+    sim = rebound.Simulation()
+    sim.integrator = "leapfrog"
+    sim.dt = 0.01
+    sim.add(m=1.)
+    sim.add(m=1e-3, a=1., e=0.05)
+    sim.N_active = 2
+    sim.testparticle_type = 0
+    if compact:
+        sim.compact_precision = compact
+    return sim
+
+class TestCompact(unittest.TestCase):
+    def test_float32(self):
+        for precision in ["float32", "chunked"]:
+            ref = planets()
+            sim = planets(precision)
+            for i in range(600):
+                ref.add(a=1.5+0.001*i, e=0.01, f=0.01*i, hash=i)
+                sim.compact_add(ref.particles[-1])
+            self.assertEqual(sim.N_compact, 600)
+            self.assertEqual(sim.compact_precision, precision)
+            ref.integrate(10.)
+            sim.integrate(10.)
+            self.assertEqual(sim.particles[1].x, ref.particles[1].x)
+            for i in range(600):
+                p = sim.compact_particle(i)
+                q = ref.particles[2+i]
+                self.assertEqual(p.hash.value, i)
+                self.assertAlmostEqual(p.x, q.x, delta=1e-4)
+                self.assertAlmostEqual(p.vy, q.vy, delta=1e-4)
+
+    def test_chunked_precision(self):
+        # Particles released from the same source are stored more accurately
+        # relative to a chunk origin.
+        errors = {}
+        for precision in ["float32", "chunked"]:
+            sim = planets(precision)
+            for i in range(256):
+                sim.compact_add(x=10.+1e-6*i, vy=0.3)
+            errors[precision] = max(abs(sim.compact_particle(i).x-(10.+1e-6*i)) for i in range(256))
+        self.assertLess(errors["chunked"], 1e-10)
+        self.assertGreater(errors["float32"], 1e-7)
+
+    def test_memory(self):
+        sim = planets()
+        for i in range(1024):
+            sim.compact_add(a=2.+0.001*i)
+        bytes_compact = sim.memory_usage()["particles"]
+        ref = planets()
+        for i in range(1024):
+            ref.add(a=2.+0.001*i)
+        self.assertLess(4*(bytes_compact-128*ref.N_active), ref.memory_usage()["particles"])
+
+    def test_removal(self):
+        sim = planets()
+        sim.collision = "direct"
+        sim.particles[1].r = 0.05
+        sim.configure_box(10.)
+        sim.boundary = "open"
+        p1 = sim.particles[1]
+        sim.compact_add(x=p1.x+0.04, y=p1.y, vy=p1.vy, hash=1)
+        sim.compact_add(a=2., hash=2)
+        sim.compact_add(x=4.9, vx=1., hash=3)
+        sim.compact_add(a=3., hash=4)
+        sim.integrate(0.5)
+        self.assertEqual(sim.N_compact, 2)
+        self.assertEqual(sim.compact.N_removed, 2)
+        self.assertEqual(sim.compact_particle(0).hash.value, 2)
+        self.assertEqual(sim.compact_particle(1).hash.value, 4)
+
+    def test_save_load_copy(self):
+        sim = planets("chunked")
+        for i in range(300):
+            sim.compact_add(a=2.+0.001*i, f=0.1*i, r=0.001, hash=i)
+        sim.integrate(1.)
+        sim.save("compact.bin")
+        sim2 = rebound.Simulation("compact.bin")
+        os.remove("compact.bin")
+        sim3 = sim.copy()
+        for s in [sim2, sim3]:
+            self.assertEqual(s.N_compact, 300)
+            self.assertEqual(s.compact_precision, "chunked")
+        sim.integrate(2.)
+        sim2.integrate(2.)
+        sim3.integrate(2.)
+        for i in [0, 255, 256, 299]:
+            p = sim.compact_particle(i)
+            for s in [sim2, sim3]:
+                q = s.compact_particle(i)
+                self.assertEqual(p.x, q.x)
+                self.assertEqual(p.vz, q.vz)
+                self.assertEqual(q.hash.value, i)
+        sim2.compact_add(a=5.)
+        self.assertEqual(sim2.N_compact, 301)
+
+    def test_errors(self):
+        sim = planets()
+        sim.compact_add(a=2.)
+        with self.assertRaises(RuntimeError):
+            sim.compact_precision = "chunked"
+        with self.assertRaises(IndexError):
+            sim.compact_particle(1)
+        sim.integrator = "ias15"
+        with self.assertRaises(RuntimeError):
+            sim.integrate(1.)
+
+    def test_ephemeris(self):
+        ref = planets()
+        eph = rebound.Ephemeris(ref, tmax=5., segment=0.1)
+        tp = rebound.Simulation()
+        tp.integrator = "leapfrog"
+        tp.dt = 0.01
+        tp.ephemeris = eph
+        tp.add(a=2., f=1.)
+        tp.compact_add(tp.particles[-1])
+        tp.integrate(5.)
+        self.assertAlmostEqual(tp.compact_particle(0).x, tp.particles[-1].x, delta=1e-5)
+
+if __name__ == "__main__":
+    unittest.main()
@@ -49,6 +49,32 @@ class TestCopy(unittest.TestCase):
             self.assertNotEqual(sim.particles[i].vy,sim_copy.particles[i].vy)
             self.assertNotEqual(sim.particles[i].vz,sim_copy.particles[i].vz)
 
+    def test_copy_integrators(self):
+        for integrator in ["ias15", "whfast", "mercurius", "janus", "saba", "bs", "block"]:
+            sim = rebound.Simulation()
+            sim.add(m=1)
+            sim.add(m=1e-3,a=1,e=0.1,hash="planet")
+            sim.add(m=1e-3,a=2,e=0.1,inc=0.1)
+            sim.add(a=3,f=1)
+            sim.integrator = integrator
+            sim.dt = 0.01
+            if integrator == "ias15":
+                sim.add_variation()
+            sim.integrate(1.3)
+            sim_copy = sim.copy()
+            self.assertEqual(sim_copy.particles["planet"].x, sim.particles["planet"].x)
+            sim.integrate(3.)
+            sim_copy.integrate(3.)
+            self.assertEqual(sim.t,sim_copy.t)
+            for i in range(sim.N):
+                self.assertEqual(sim.particles[i].x,sim_copy.particles[i].x)
+                self.assertEqual(sim.particles[i].vz,sim_copy.particles[i].vz)
+            # Original and copy do not share memory
+            sim_copy.particles[1].x += 1.
+            self.assertNotEqual(sim.particles[1].x,sim_copy.particles[1].x)
+            sim = None
+            sim_copy.integrate(4.)
+
 class TestMultiply(unittest.TestCase):
     def test_multiply_with_minus_one(self):
         sim1 = rebound.Simulation()
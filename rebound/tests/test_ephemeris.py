@@ -0,0 +1,102 @@
+import rebound
+import unittest
+import os
+
+def planets():
+    sim = rebound.Simulation()
+    sim.add(m=1.)
+    sim.add(m=1e-3, a=1., e=0.05)
+    sim.add(m=3e-4, a=1.6, e=0.02, inc=0.02)
+    sim.N_active = 3
+    sim.testparticle_type = 0
+    sim.move_to_com()
+    return sim
+
+class TestEphemeris(unittest.TestCase):
+    def test_interpolation(self):
+        sim = planets()
+        eph = rebound.Ephemeris(sim, tmax=10., segment=0.1, order=12)
+        self.assertEqual(eph.N, 3)
+        self.assertAlmostEqual(eph.t_end, 10., delta=1e-12)
+        ref = planets()
+        ref.integrate(5.55)
+        ps = eph.evaluate(5.55)
+        for i in range(3):
+            self.assertAlmostEqual(ps[i].x, ref.particles[i].x, delta=1e-12)
+            self.assertAlmostEqual(ps[i].vy, ref.particles[i].vy, delta=1e-11)
+            self.assertEqual(ps[i].m, ref.particles[i].m)
+            # Accelerations are the derivatives of the velocities
+            ax = 0.
+            for j in range(3):
+                if i!=j:
+                    dx = ps[j]-ps[i]
+                    ax += ps[j].m*dx.x/(dx.x**2+dx.y**2+dx.z**2)**1.5
+            self.assertAlmostEqual(ps[i].ax, ax, delta=1e-9)
+
+    def test_testparticles(self):
+        sim = planets()
+        eph = rebound.Ephemeris(sim, tmax=20., segment=0.1)
+        ref = planets()
+        for i in range(10):
+            ref.add(a=2.2+0.1*i, f=i)
+        tp = rebound.Simulation()
+        tp.ephemeris = eph
+        self.assertEqual(tp.N_active, 3)
+        for p in ref.particles[3:]:
+            tp.add(x=p.x, y=p.y, z=p.z, vx=p.vx, vy=p.vy, vz=p.vz)
+        ref.integrate(20.)
+        tp.integrate(20.)
+        for i in range(ref.N):
+            self.assertAlmostEqual(tp.particles[i].x, ref.particles[i].x, delta=1e-9)
+            self.assertAlmostEqual(tp.particles[i].vz, ref.particles[i].vz, delta=1e-9)
+
+    def test_save_load(self):
+        sim = planets()
+        eph = rebound.Ephemeris(sim, tmax=2., segment=0.25, order=8)
+        eph.save("ephemeris.bin")
+        eph2 = rebound.Ephemeris("ephemeris.bin")
+        os.remove("ephemeris.bin")
+        self.assertEqual(eph2.segments_N, eph.segments_N)
+        for p1, p2 in zip(eph.evaluate(1.3), eph2.evaluate(1.3)):
+            self.assertEqual(p1.x, p2.x)
+            self.assertEqual(p1.vz, p2.vz)
+        with self.assertRaises(RuntimeError):
+            rebound.Ephemeris("does_not_exist.bin")
+        with self.assertRaises(RuntimeError):
+            eph.save("does_not_exist/ephemeris.bin")
+
+    def test_errors(self):
+        sim = planets()
+        eph = rebound.Ephemeris(sim, tmax=1., segment=0.1)
+        tp = rebound.Simulation()
+        tp.add(m=1.)
+        with self.assertRaises(RuntimeError):
+            tp.ephemeris = eph
+        tp = rebound.Simulation()
+        tp.ephemeris = eph
+        tp.add(a=2.)
+        with self.assertRaises(RuntimeError):
+            tp.integrate(2.)
+        tp = rebound.Simulation()
+        tp.integrator = "whfast"
+        tp.ephemeris = eph
+        with self.assertRaises(RuntimeError):
+            tp.integrate(0.5)
+
+    def test_ensemble(self):
+        sim = planets()
+        eph = rebound.Ephemeris(sim, tmax=5., segment=0.1)
+        sims = []
+        for i in range(4):
+            tp = rebound.Simulation()
+            tp.ephemeris = eph
+            tp.add(primary=tp.particles[0], a=2.+0.2*i)
+            sims.append(tp)
+        status = rebound.integrate_ensemble(sims, 5.)
+        ps = eph.evaluate(5.)
+        for tp in sims:
+            self.assertEqual(tp.t, 5.)
+            self.assertEqual(tp.particles[1].x, ps[1].x)
+
+if __name__ == "__main__":
+    unittest.main()
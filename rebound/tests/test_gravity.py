@@ -1,6 +1,7 @@
 import rebound
 import unittest
 import math
+import ctypes
 import numpy as np
 import warnings
 
@@ -100,6 +101,322 @@ class TestGravity(unittest.TestCase):
         x1ias = sim.particles[1].x
         self.assertAlmostEqual(x1ias, x1,delta=1e-9)
 
+    def create_tree(self, gravity, tree_active_only):
+        sim = rebound.Simulation()
+        sim.configure_box(10.)
+        sim.boundary = "open"
+        sim.gravity = gravity
+        sim.tree_active_only = tree_active_only
+        sim.opening_angle2 = 1e-8
+        sim.integrator = "leapfrog"
+        sim.dt = 1e-3
+        for i in range(20):
+            sim.add(m=1e-3, x=2.*math.cos(i), y=2.*math.sin(i), z=0.1*math.sin(3*i), hash=i)
+        sim.N_active = sim.N
+        for i in range(200):
+            sim.add(x=3.*math.cos(0.37*i), y=3.*math.sin(0.37*i), z=0.1*math.cos(5*i), vy=0.1, hash=i+100)
+        return sim
+
+    def test_tree_active_only(self):
+        sim0 = self.create_tree("basic", 0)
+        sim1 = self.create_tree("tree", 1)
+        sim0.steps(10)
+        sim1.steps(10)
+        self.assertEqual(sim1.N_active, 20)
+        self.assertEqual(sim1.N, 220)
+        for p0, p1 in zip(sim0.particles, sim1.particles):
+            self.assertEqual(p0.hash.value, p1.hash.value)
+            self.assertAlmostEqual(p0.ax, p1.ax, delta=1e-12)
+            self.assertAlmostEqual(p0.ay, p1.ay, delta=1e-12)
+
+    def test_tree_active_only_remove(self):
+        sim = self.create_tree("tree", 1)
+        sim.step()
+        sim.remove(5, keepSorted=False)
+        sim.particles[150].x = 100. # removed by open boundary
+        sim.step()
+        self.assertEqual(sim.N_active, 19)
+        self.assertEqual(sim.N, 218)
+        # Order is preserved
+        self.assertEqual(sim.particles[5].hash.value, 6)
+        self.assertEqual(sim.particles[148].hash.value, 100+129)
+        self.assertEqual(sim.particles[149].hash.value, 100+131)
+
+    def test_tree_group_size(self):
+        def create(gravity, tree_group_size):
+            sim = rebound.Simulation()
+            sim.configure_box(10.)
+            sim.boundary = "open"
+            sim.gravity = gravity
+            sim.tree_group_size = tree_group_size
+            sim.opening_angle2 = 0.25
+            sim.integrator = "leapfrog"
+            sim.dt = 1e-3
+            for i in range(500):
+                sim.add(m=1e-3, x=2.*math.cos(i)*math.sin(0.3*i), y=2.*math.sin(i), z=0.5*math.sin(3*i))
+            sim.step()
+            return sim
+        sim0 = create("basic", 0)
+        sim1 = create("tree", 0)
+        sim2 = create("tree", 16)
+        err1, err2 = 0., 0.
+        for p0, p1, p2 in zip(sim0.particles, sim1.particles, sim2.particles):
+            a0 = math.sqrt(p0.ax**2 + p0.ay**2 + p0.az**2)
+            err1 = max(err1, math.sqrt((p1.ax-p0.ax)**2 + (p1.ay-p0.ay)**2 + (p1.az-p0.az)**2)/a0)
+            err2 = max(err2, math.sqrt((p2.ax-p0.ax)**2 + (p2.ay-p0.ay)**2 + (p2.az-p0.az)**2)/a0)
+        self.assertLess(err2, 0.1)
+        self.assertLessEqual(err2, err1)
+
+    def test_tree_far_field(self):
+        def create(boundary, far, order, tree_group_size):
+            sim = rebound.Simulation()
+            sim.configure_box(10., 8, 8, 1)
+            sim.boundary = boundary
+            sim.nghostx = 2
+            sim.nghosty = 2
+            sim.gravity = "tree"
+            sim.gravity_tree_far_field = far
+            sim.gravity_fmm_order = order
+            sim.tree_group_size = tree_group_size
+            sim.opening_angle2 = 0.25
+            if boundary == "shear":
+                sim.integrator = "sei"
+                sim.ri_sei.OMEGA = 1.
+                sim.t = 0.3 # non-zero shear offset of the ghost boxes
+            else:
+                sim.integrator = "leapfrog"
+            sim.dt = 1e-6
+            for i in range(1000):
+                sim.add(m=1e-3, x=4.99*math.sin(0.7*i*i), y=4.99*math.cos(1.3*i), z=0.05*math.sin(3*i))
+            sim.step()
+            return sim
+        for boundary in ["periodic", "shear"]:
+            for tree_group_size in [0, 16]:
+                sim0 = create(boundary, 0, 4, tree_group_size)
+                errs = []
+                for order in [2, 4]:
+                    sim1 = create(boundary, 1, order, tree_group_size)
+                    err = 0.
+                    for p0, p1 in zip(sim0.particles, sim1.particles):
+                        a0 = math.sqrt(p0.ax**2 + p0.ay**2 + p0.az**2)
+                        err = max(err, math.sqrt((p1.ax-p0.ax)**2 + (p1.ay-p0.ay)**2 + (p1.az-p0.az)**2)/a0)
+                    errs.append(err)
+                self.assertLess(errs[0], 1e-3)
+                self.assertLess(errs[1], 1e-4)
+                self.assertLess(errs[1], errs[0])
+
+    def test_basic_many_particles(self):
+        # Large enough to use the AVX512 version of the basic gravity routine if it is available
+        def create(gravity, testparticle_type):
+            sim = rebound.Simulation()
+            sim.gravity = gravity
+            sim.testparticle_type = testparticle_type
+            sim.integrator = "leapfrog"
+            sim.dt = 1e-6
+            for i in range(67):
+                sim.add(m=1e-3*(1.+math.sin(i)), x=math.cos(7*i), y=math.sin(3*i), z=0.2*math.sin(i))
+            sim.N_active = 50
+            sim.step()
+            return sim
+        for testparticle_type in [0, 1]:
+            sim0 = create("compensated", testparticle_type)
+            sim1 = create("basic", testparticle_type)
+            for p0, p1 in zip(sim0.particles, sim1.particles):
+                self.assertAlmostEqual(p0.ax, p1.ax, delta=1e-12*abs(p0.ax)+1e-16)
+                self.assertAlmostEqual(p0.ay, p1.ay, delta=1e-12*abs(p0.ay)+1e-16)
+                self.assertAlmostEqual(p0.az, p1.az, delta=1e-12*abs(p0.az)+1e-16)
+
+    def test_basic_testparticles_ghostboxes(self):
+        # Test particles of type 0 use a separate kernel; massless active particles must feel the same forces
+        def create(N_active):
+            sim = rebound.Simulation()
+            sim.configure_box(10.)
+            sim.boundary = "periodic"
+            sim.nghostx = 1
+            sim.nghosty = 1
+            sim.integrator = "leapfrog"
+            sim.dt = 1e-6
+            for i in range(100):
+                sim.add(m=1e-3*(1.+math.sin(i)) if i<3 else 0., x=4.*math.cos(7*i), y=4.*math.sin(3*i), z=0.2*math.sin(i))
+            sim.N_active = N_active
+            sim.step()
+            return sim
+        sim0 = create(-1)
+        sim1 = create(3)
+        for p0, p1 in zip(sim0.particles, sim1.particles):
+            self.assertAlmostEqual(p0.ax, p1.ax, delta=1e-12*abs(p0.ax)+1e-16)
+            self.assertAlmostEqual(p0.ay, p1.ay, delta=1e-12*abs(p0.ay)+1e-16)
+            self.assertAlmostEqual(p0.az, p1.az, delta=1e-12*abs(p0.az)+1e-16)
+
+    def test_auto(self):
+        def create(integrator):
+            sim = rebound.Simulation()
+            sim.configure_box(10.)
+            sim.boundary = "open"
+            sim.gravity = "auto"
+            sim.integrator = integrator
+            sim.dt = 1e-3
+            for i in range(200):
+                sim.add(m=1e-3, x=4.*math.cos(i)*math.sin(0.3*i), y=4.*math.sin(i), z=0.5*math.sin(3*i))
+            return sim
+        sim = create("leapfrog")
+        sim.steps(20)
+        self.assertIn(sim.gravity, ["basic", "tree", "fmm"])
+        self.assertEqual(sim._gravity_autotune.candidates_N, 3)
+        self.assertEqual(sim._gravity_autotune.current, 3)
+        # The mode is stored in binary files
+        sim2 = sim.copy()
+        self.assertEqual(sim2.gravity, "auto")
+        self.assertEqual(sim2._gravity_autotune.candidates_N, 0)
+        sim2.step()
+        self.assertEqual(sim2.gravity, "basic")
+        # Candidates are timed again after many particles have been removed.
+        # The tree might have been selected. It removes particles during the next step.
+        sim.remove_many(list(range(100)), keepSorted=False)
+        sim.steps(2)
+        self.assertEqual(sim._gravity_autotune.current, 0)
+        self.assertEqual(sim._gravity_autotune.N, 100)
+        # Setting the gravity routine turns the automatic selection off
+        sim.gravity = "compensated"
+        sim.steps(20)
+        self.assertEqual(sim.gravity, "compensated")
+        # IAS15 calculates the forces several times per timestep, only the direct summation is used
+        sim = create("ias15")
+        sim.step()
+        self.assertEqual(sim.gravity, "basic")
+        self.assertEqual(sim._gravity_autotune.candidates_N, 1)
+
+    def test_auto_collision_copy(self):
+        # Without a tree, simulations are copied directly instead of through a binary file
+        sim = rebound.Simulation()
+        sim.gravity = "none"
+        sim.collision = "auto"
+        sim.integrator = "leapfrog"
+        sim.dt = 1e-3
+        for i in range(100):
+            sim.add(m=1e-3, r=1e-3, x=4.*math.cos(i)*math.sin(0.3*i), y=4.*math.sin(i), z=0.5*math.sin(3*i))
+        for i in range(100):
+            sim.step()
+            if sim._collision_autotune.current==sim._collision_autotune.candidates_N:
+                break
+        self.assertEqual(sim._collision_autotune.current, sim._collision_autotune.candidates_N)
+        self.assertNotEqual(sim.collision, "auto")
+        sim2 = sim.copy()
+        self.assertEqual(sim2.collision, "auto")
+        self.assertEqual(sim2._collision_autotune.mode, 0)
+        self.assertEqual(sim2._collision_autotune.candidates_N, 0)
+        sim2.step()
+        self.assertNotEqual(sim2._collision_autotune.mode, 0)
+        self.assertEqual(sim2.collision, "direct")
+
+    def test_fmm(self):
+        def create(gravity, boundary, order=4):
+            sim = rebound.Simulation()
+            sim.configure_box(10.)
+            sim.boundary = boundary
+            if boundary != "open":
+                sim.nghostx = 1
+                sim.nghosty = 1
+            if boundary == "shear":
+                sim.ri_sei.OMEGA = 1.
+                sim.t = 0.3
+            sim.gravity = gravity
+            sim.gravity_fmm_order = order
+            sim.opening_angle2 = 0.25
+            sim.integrator = "leapfrog"
+            sim.dt = 1e-6
+            for i in range(500):
+                sim.add(m=1e-3, x=4.*math.cos(i)*math.sin(0.3*i), y=4.*math.sin(i), z=0.5*math.sin(3*i))
+            sim.step()
+            return sim
+        for boundary in ["open", "periodic", "shear"]:
+            sim0 = create("basic", boundary)
+            errs = []
+            for order in [2, 4, 6]:
+                sim1 = create("fmm", boundary, order)
+                err = 0.
+                for p0, p1 in zip(sim0.particles, sim1.particles):
+                    a0 = math.sqrt(p0.ax**2 + p0.ay**2 + p0.az**2)
+                    err += math.sqrt((p1.ax-p0.ax)**2 + (p1.ay-p0.ay)**2 + (p1.az-p0.az)**2)/a0
+                errs.append(err/sim0.N)
+            self.assertLess(errs[1], 1e-3)
+            self.assertLess(errs[2], errs[1])
+            self.assertLess(errs[1], errs[0])
+
+    def test_ewald(self):
+        def create(gravity, ngh, shift=False):
+            sim = rebound.Simulation()
+            sim.configure_box(1., 2 if shift else 1, 1, 1)
+            sim.boundary = "periodic"
+            sim.nghostx = sim.nghosty = sim.nghostz = ngh
+            sim.gravity = gravity
+            for i in range(10):
+                sim.add(m=1.+0.1*math.sin(i), x=0.45*math.cos(i), y=0.45*math.sin(2*i), z=0.45*math.sin(3*i))
+            if shift:
+                # Same lattice as a shearing sheet with a shift of half a box
+                for i in range(10):
+                    p = sim.particles[i].copy()
+                    sim.particles[i].x -= 0.5
+                    p.x += 0.5
+                    p.y += 0.5 if p.y < 0. else -0.5
+                    sim.add(p)
+            sim.integrator = "leapfrog"
+            sim.dt = 1e-8
+            sim.step()
+            return sim
+        # Direct summation over a cube of ghost boxes converges to the Ewald sum 
+        # plus the field of a uniform cube with the mean density
+        sim0 = create("ewald", 0)
+        errs = []
+        for ngh in [4, 16]:
+            sim1 = create("basic", ngh)
+            err = 0.
+            for p0, p1 in zip(sim0.particles, sim1.particles):
+                for k in "xyz":
+                    bg = 4.*math.pi/3.*sum(p.m*(getattr(p1, k)-getattr(p, k)) for p in sim1.particles)
+                    err = max(err, abs(getattr(p1, "a"+k) + bg - getattr(p0, "a"+k)))
+            errs.append(err)
+        self.assertLess(errs[1], 1e-2)
+        self.assertLess(errs[1], errs[0]/8.)
+        # Shearing sheet
+        sim = rebound.Simulation()
+        sim.configure_box(1.)
+        sim.boundary = "shear"
+        sim.integrator = "sei"
+        sim.ri_sei.OMEGA = 1.
+        sim.t = 1./3.  # shift of half a box
+        sim.gravity = "ewald"
+        sim1 = create("ewald", 0, shift=True)
+        for i in range(10):
+            p = sim1.particles[i].copy()
+            p.x += 0.5
+            sim.add(p)
+        rebound.clibrebound.reb_update_acceleration(ctypes.byref(sim))
+        for p0, p1 in zip(sim.particles, sim1.particles):
+            self.assertAlmostEqual(p0.ax, p1.ax, delta=1e-10)
+            self.assertAlmostEqual(p0.ay, p1.ay, delta=1e-10)
+            self.assertAlmostEqual(p0.az, p1.az, delta=1e-10)
+
+    def test_deterministic(self):
+        def create(gravity, deterministic):
+            sim = rebound.Simulation()
+            sim.configure_box(1.)
+            sim.boundary = "periodic"
+            sim.gravity = gravity
+            sim.gravity_deterministic = deterministic
+            for i in range(300):
+                sim.add(m=1e-3*(1.+0.1*math.sin(i)), x=0.45*math.cos(i), y=0.45*math.sin(2*i), z=0.45*math.sin(3*i))
+            rebound.clibrebound.reb_update_acceleration(ctypes.byref(sim))
+            return sim
+        for gravity in ["basic", "ewald"]:
+            sim0 = create(gravity, 0)
+            sim1 = create(gravity, 1)
+            for p0, p1 in zip(sim0.particles, sim1.particles):
+                self.assertAlmostEqual(p0.ax, p1.ax, delta=1e-12*abs(p0.ax)+1e-14)
+                self.assertAlmostEqual(p0.ay, p1.ay, delta=1e-12*abs(p0.ay)+1e-14)
+                self.assertAlmostEqual(p0.az, p1.az, delta=1e-12*abs(p0.az)+1e-14)
+        self.assertEqual(sim1.copy().gravity_deterministic, 1)
+
 
 if __name__ == "__main__":
     unittest.main()
@@ -99,6 +99,29 @@ class TestZeroHash(unittest.TestCase):
         self.assertAlmostEqual(self.sim.particles["jupiter"].m, 3., delta=1e-15)
         self.assertEqual(self.sim.N_lookup, 3)
 
+class TestIncrementalLookup(unittest.TestCase):
+    def test_add_remove(self):
+        sim = rebound.Simulation()
+        for i in range(1,200):
+            sim.add(m=i, x=i, hash=i)
+        self.assertEqual(sim.particles[c_uint32(5)].m, 5.)  # builds table
+        self.assertEqual(sim.N_lookup, 199)
+        sim.add(m=500., hash=500)
+        self.assertEqual(sim.N_lookup, 200)
+        sim.remove(hash=3)
+        sim.remove(hash=100, keepSorted=False)
+        self.assertEqual(sim.N_lookup, 198)
+        for i in range(1,200):
+            if i in [3, 100]:
+                with self.assertRaises(rebound.ParticleNotFound):
+                    sim.particles[c_uint32(i)]
+            else:
+                self.assertEqual(sim.particles[c_uint32(i)].m, float(i))
+        self.assertEqual(sim.particles[c_uint32(500)].m, 500.)
+        # Hashes changed directly are found as well
+        sim.particles[10].hash = 1000
+        self.assertEqual(sim.particles[c_uint32(1000)].x, sim.particles[10].x)
+
 class TestSort(unittest.TestCase):
     def setUp(self):
         self.sim = rebound.Simulation()
@@ -3,6 +3,7 @@ import unittest
 import math
 import rebound.data
 import warnings
+import os
 
 class TestIntegratorWHFastHyper(unittest.TestCase):
     def test_whfast_veryhyperbolic(self):
@@ -112,6 +113,45 @@ class TestIntegrator(unittest.TestCase):
         #e1 = self.sim.energy()
         #self.assertLess(math.fabs((e0-e1)/e1),10**13.5)
     
+    def test_ias15_testparticle_substeps(self):
+        self.sim.integrator = "ias15"
+        self.sim.N_active = self.sim.N
+        jup = self.sim.particles[1]
+        self.sim.add(x=jup.x+0.01, y=jup.y, z=jup.z, vx=jup.vx, vy=jup.vy+0.5, vz=jup.vz) # close encounter with Jupiter
+        sim2 = self.sim.copy()
+        sim2.ri_ias15.testparticle_substeps = 1
+        jupyr = 11.86*2.*math.pi
+        self.sim.integrate(jupyr)
+        sim2.integrate(jupyr)
+        self.assertLess(sim2.steps_done, self.sim.steps_done)
+        for i in range(self.sim.N):
+            p1, p2 = self.sim.particles[i], sim2.particles[i]
+            self.assertLess(math.sqrt((p1.x-p2.x)**2+(p1.y-p2.y)**2+(p1.z-p2.z)**2), 1e-10)
+    
+    def test_ias15_testparticle_compensated(self):
+        self.sim.integrator = "ias15"
+        self.sim.N_active = self.sim.N
+        for i in range(10):
+            self.sim.add(a=40.+i, e=0.1, f=i)
+        self.sim.dt = 1.
+        self.sim.ri_ias15.epsilon = 0. # fixed timestep
+        sim2 = self.sim.copy()
+        sim2.ri_ias15.testparticle_compensated = 0
+        sim2.save("test.bin")
+        sim3 = rebound.Simulation("test.bin")
+        os.remove("test.bin")
+        self.assertEqual(sim3.ri_ias15.testparticle_compensated, 0)
+        self.sim.steps(1000)
+        sim2.steps(1000)
+        for i in range(self.sim.N):
+            p1, p2 = self.sim.particles[i], sim2.particles[i]
+            if i<self.sim.N_active:
+                # The massive particles are not affected
+                self.assertEqual(p1.x, p2.x)
+                self.assertEqual(p1.vy, p2.vy)
+            else:
+                self.assertLess(math.sqrt((p1.x-p2.x)**2+(p1.y-p2.y)**2+(p1.z-p2.z)**2), 1e-10)
+    
     def test_ias15_compensated(self):
         self.sim.integrator = "ias15"
         self.sim.gravity = "compensated"
@@ -30,6 +30,53 @@ class TestMercurius(unittest.TestCase):
         self.assertEqual(sim.particles[0].x,sim2.particles[0].x)
         self.assertEqual(sim.particles[0].vx,sim2.particles[0].vx)
 
+    def test_testparticle_substeps(self):
+        sim = rebound.Simulation()
+        sim.add(m=1)
+        sim.add(m=1e-3,a=1)
+        sim.add(m=1e-3,a=1.5)
+        sim.move_to_com()
+        sim.N_active=3
+        p = sim.particles[1].copy()
+        p.x += 0.01
+        p.vy += 0.2
+        p.m = 0
+        sim.add(p)
+        sim.integrator = "mercurius"
+        sim.dt = 0.05
+        sim2 = sim.copy()
+        sim2.ri_ias15.testparticle_substeps = 1
+        sim.integrate(5.)
+        sim2.integrate(5.)
+        for i in range(sim.N):
+            d = sim.particles[i] - sim2.particles[i]
+            self.assertLess((d.x*d.x+d.y*d.y+d.z*d.z)**0.5, 1e-10)
+
+    def test_split_tponly_encounters(self):
+        def get_sim(N_tp):
+            sim = rebound.Simulation()
+            sim.add(m=1)
+            sim.add(m=1e-3, a=1)
+            sim.add(m=1e-3, a=1.7, f=2.)
+            sim.N_active = sim.N
+            for i in range(N_tp):
+                sim.add(a=0.9+0.002*i, f=0.1+0.01*i, e=0.05)
+            sim.move_to_com()
+            sim.integrator = "mercurius"
+            sim.dt = 0.01
+            return sim
+        # A single test particle is integrated exactly as before.
+        for N_tp, delta in [(1,0.), (20,1e-10)]:
+            sim = get_sim(N_tp)
+            sim2 = get_sim(N_tp)
+            sim2.ri_mercurius.split_tponly_encounters = 1
+            sim.integrate(3.)
+            sim2.integrate(3.)
+            for i in range(sim.N):
+                self.assertAlmostEqual(sim.particles[i].x, sim2.particles[i].x, delta=delta)
+                self.assertAlmostEqual(sim.particles[i].vy, sim2.particles[i].vy, delta=delta)
+        self.assertEqual(sim2.copy().ri_mercurius.split_tponly_encounters, 1)
+
     def test_outer_solar(self):
         sim = rebound.Simulation()
         rebound.data.add_outer_solar_system(sim)
@@ -192,6 +239,25 @@ class TestMercurius(unittest.TestCase):
         self.assertLess(dE,3e-9)
         self.assertEqual(N0-1,sim.N)
 
+    def test_testparticle_pair_collision(self):
+        # Pairs of test particles are not part of the encounter prediction
+        for skip in [0,1]:
+            sim = rebound.Simulation()
+            sim.add(m=1.)
+            sim.add(m=1e-3,r=1e-4,a=1.)
+            sim.N_active = 2
+            p = sim.particles[1]
+            sim.add(m=1e-10,r=1e-4,x=p.x+0.05,y=p.y,z=p.z,vx=p.vx,vy=p.vy+0.01,vz=p.vz)
+            sim.add(m=1e-10,r=1e-4,x=p.x+0.0505,y=p.y,z=p.z,vx=p.vx-0.01,vy=p.vy+0.01,vz=p.vz)
+            sim.integrator = "mercurius"
+            sim.testparticle_type = 1
+            sim.collision_skip_testparticle_pairs = skip
+            sim.dt = 0.01
+            sim.collision = "direct"
+            sim.collision_resolve = "merge"
+            sim.integrate(0.2)
+            self.assertEqual(sim.N, 4 if skip else 3)
+
     def test_massive_ejection(self):
         sim = rebound.Simulation()
         sim.add(m=1.)
@@ -272,6 +338,85 @@ class TestMercurius(unittest.TestCase):
         # bad energy conservation due to democratic heliocentric!
         self.assertLess(dE,3e-2)
     
+    def test_encounter_prediction_flyby(self):
+        # Test particles cross the orbit during the timestep.
+        # Only the first one passes close to the planet.
+        sim = rebound.Simulation()
+        sim.add(m=1)
+        sim.add(m=1e-3, a=1)
+        sim.N_active = 2
+        sim.add(x=1., y=-0.5, vy=10.)
+        sim.add(x=-1., y=-0.5, vy=10.)
+        for i in range(100):
+            sim.add(a=2.+0.01*i, f=0.1*i)
+        sim.integrator = "mercurius"
+        sim.dt = 0.1
+        sim.step()
+        self.assertEqual(sim.ri_mercurius._encounterN, 3)
+
+    def test_switching_functions(self):
+        # Built-in switching functions are inlined in the gravity routine.
+        # They need to agree with the same functions called through a pointer.
+        import math
+        def L_poly(d, dcrit, poly):
+            y = (d-0.1*dcrit)/(0.9*dcrit)
+            if y<0.:
+                return 0.
+            if y>1.:
+                return 1.
+            return poly(y)
+        def f(x):
+            return 0. if x<=0. else math.exp(-1./x)
+        funcs = {
+            "mercury": lambda y: 10.*(y*y*y) - 15.*(y*y*y*y) + 6.*(y*y*y*y*y),
+            "C4": lambda y: (70.*y*y*y*y -315.*y*y*y +540.*y*y -420.*y +126.)*y*y*y*y*y,
+            "C5": lambda y: (-252.*y*y*y*y*y +1386.*y*y*y*y -3080.*y*y*y +3465.*y*y -1980.*y +462.)*y*y*y*y*y*y,
+            "infinity": lambda y: f(y)/(f(y)+f(1.-y)),
+            }
+        def get_sim():
+            sim = rebound.Simulation()
+            sim.add(m=1)
+            sim.add(m=1e-3, a=1.)
+            sim.add(m=1e-3, a=1.3, f=0.3)
+            sim.N_active = 3
+            for i in range(5):
+                sim.add(a=1.1+0.02*i, f=0.05*i)
+            sim.integrator = "mercurius"
+            sim.dt = 0.05
+            return sim
+        for name, poly in funcs.items():
+            sim = get_sim()
+            sim.ri_mercurius.L = name
+            sim2 = get_sim()
+            sim2.ri_mercurius.L = lambda r, d, dcrit, poly=poly: L_poly(d, dcrit, poly)
+            sim.integrate(0.5)
+            sim2.integrate(0.5)
+            for p, p2 in zip(sim.particles, sim2.particles):
+                self.assertAlmostEqual(p.x, p2.x, delta=1e-14)
+                self.assertAlmostEqual(p.vy, p2.vy, delta=1e-14)
+
+    def test_dcrit_new_particles(self):
+        sim = rebound.Simulation()
+        sim.add(m=1)
+        sim.add(m=1e-3, a=1.)
+        sim.add(m=1e-3, a=2.)
+        sim.integrator = "mercurius"
+        sim.dt = 0.01
+        sim.step()
+        dcrit = [sim.ri_mercurius._dcrit[i] for i in range(3)]
+        sim.particles[1].m = 2e-3 # dcrit is only recalculated if requested
+        sim.add(m=1e-4, a=3.)
+        sim.step()
+        for i in range(3):
+            self.assertEqual(sim.ri_mercurius._dcrit[i], dcrit[i])
+        self.assertGreater(sim.ri_mercurius._dcrit[3], 0.)
+        sim.ri_mercurius.recalculate_dcrit_this_timestep = 1
+        sim.step()
+        self.assertGreater(sim.ri_mercurius._dcrit[1], dcrit[1])
+        self.assertAlmostEqual(sim.ri_mercurius._dcrit[2], dcrit[2], delta=1e-6)
+        # Hill radius criterion
+        self.assertAlmostEqual(sim.ri_mercurius._dcrit[3], 3.*3.*(1e-4/3.)**(1./3.), delta=1e-2)
+
     def test_many_encounters(self):
         def get_sim():
             sim = rebound.Simulation()
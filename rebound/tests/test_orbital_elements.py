@@ -359,5 +359,76 @@ class TestOrbitalElements(unittest.TestCase):
         test_p(x=0.98, y=0.023, z=0.01, vx=-0.0151, vy=0.9981, vz=-0.01)
         test_p(x=0.198, y=0.023, z=1.01, vx=-0.01, vy=0.09981, vz=-0.01)
 
+    def test_calculate_orbits_array(self):
+        sim = rebound.Simulation()
+        sim.add(m=1.)
+        np.random.seed(1)
+        for i in range(50):
+            sim.add(m=1e-4*np.random.random(), a=np.random.uniform(1.,3.), e=0.9*np.random.random(), inc=np.random.random(), Omega=np.random.random(), omega=np.random.random(), f=np.random.random())
+        for primary in [None, sim.particles[0]]:
+            orbits = sim.calculate_orbits(primary=primary)
+            arrays = sim.calculate_orbits_array(primary=primary)
+            self.assertEqual(len(arrays["a"]), sim.N-1)
+            for key in ["a", "e", "inc", "Omega", "omega", "f", "l", "P", "T"]:
+                self.assertEqual(list(arrays[key]), [getattr(o, key) for o in orbits])
+
+    def test_orbits_to_cartesian(self):
+        sim = rebound.Simulation()
+        sim.add(m=1., x=0.1, vy=0.2)
+        a = np.linspace(1., 2., 20)
+        xyzvxvyvz = rebound.orbits_to_cartesian(sim.G, sim.particles[0], a, e=0.1, inc=0.2, f=a)
+        self.assertEqual(xyzvxvyvz.shape, (20,6))
+        for i in range(20):
+            p = rebound.Particle(simulation=sim, primary=sim.particles[0], a=a[i], e=0.1, inc=0.2, f=a[i])
+            self.assertEqual(list(xyzvxvyvz[i]), [p.x, p.y, p.z, p.vx, p.vy, p.vz])
+        with self.assertRaises(ValueError):
+            rebound.orbits_to_cartesian(sim.G, sim.particles[0], a, e=1.)
+
+    def test_M_to_f_array(self):
+        e = np.concatenate([np.linspace(0., 0.999999, 101), np.linspace(1.01, 5., 11)])
+        for M in [0., 1e-10, 0.3, 3., np.pi, 5., -2., 20.]:
+            E = rebound.M_to_E_array(e, M)
+            f = rebound.M_to_f_array(e, M)
+            for i in range(len(e)):
+                if e[i] < 1.:
+                    self.assertAlmostEqual(E[i]-e[i]*np.sin(E[i]), rebound.mod2pi(M), delta=1e-14)
+                self.assertAlmostEqual(np.cos(f[i]), np.cos(rebound.M_to_f(e[i], M)), delta=1e-7)
+
+    def test_orbits_to_cartesian_M(self):
+        sim = rebound.Simulation()
+        sim.add(m=1.)
+        M = np.linspace(0., 6., 20)
+        xyzvxvyvz = rebound.orbits_to_cartesian(sim.G, sim.particles[0], 1., e=0.3, M=M)
+        for i in range(20):
+            p = rebound.Particle(simulation=sim, primary=sim.particles[0], a=1., e=0.3, M=M[i])
+            self.assertAlmostEqual(xyzvxvyvz[i,0], p.x, delta=1e-14)
+            self.assertAlmostEqual(xyzvxvyvz[i,4], p.vy, delta=1e-14)
+        with self.assertRaises(ValueError):
+            rebound.orbits_to_cartesian(sim.G, sim.particles[0], 1., f=0., M=0.)
+
+    def test_add_many(self):
+        sim = rebound.Simulation()
+        sim.add(m=1., x=0.1, vy=0.2)
+        sim.add(m=1e-3, a=1.)
+        a = np.linspace(2., 3., 20)
+        sim.add_many(a=a, e=0.1, inc=0.2, f=a, r=0.01)
+        self.assertEqual(sim.N, 22)
+        ref = rebound.Simulation()
+        ref.add(m=1., x=0.1, vy=0.2)
+        ref.add(m=1e-3, a=1.)
+        com = ref.com()
+        for i in range(20):
+            ref.add(primary=com, a=a[i], e=0.1, inc=0.2, f=a[i], r=0.01)
+        for i in range(22):
+            self.assertEqual(sim.particles[i].x, ref.particles[i].x)
+            self.assertEqual(sim.particles[i].vz, ref.particles[i].vz)
+            self.assertEqual(sim.particles[i].r, ref.particles[i].r)
+        sim.add_many(a=a, m=1e-6, primary=0)
+        self.assertEqual(sim.N, 42)
+        self.assertEqual(sim.particles[41].m, 1e-6)
+        with self.assertRaises(ValueError):
+            sim.add_many(a=a, e=1.)
+        self.assertEqual(sim.N, 42)
+
 if __name__ == "__main__":
     unittest.main()
@@ -331,6 +331,67 @@ class TestParticleCopy(unittest.TestCase):
         self.assertEqual(sim.particles[2].m,3.)
         
 
+class TestSpatialSort(unittest.TestCase):
+    def create(self, integrator):
+        sim = rebound.Simulation()
+        sim.integrator = integrator
+        sim.add(m=1.)
+        sim.add(m=1e-3, a=1., e=0.05)
+        sim.N_active = 2
+        for i in range(100):
+            sim.add(a=1.5+0.01*i, e=0.05, f=0.7*i, omega=1.3*i, hash=i+10)
+        sim.dt = 0.05
+        return sim
+
+    def test_same_trajectories(self):
+        for integrator in ["ias15", "whfast", "leapfrog"]:
+            sim0 = self.create(integrator)
+            sim1 = self.create(integrator)
+            sim0.integrate(3.)
+            sim1.integrate(3.)
+            sim1.sort_particles_spatially()
+            self.assertEqual(sim1.particles[1].hash.value, sim0.particles[1].hash.value)
+            self.assertNotEqual([p.hash.value for p in sim1.particles], [p.hash.value for p in sim0.particles])
+            sim0.integrate(20.)
+            sim1.integrate(20.)
+            for i in range(100):
+                p0 = sim0.particles[i+2]
+                p1 = sim1.particles[rebound.hash(i+10)]
+                self.assertEqual(p0.x, p1.x)
+                self.assertEqual(p0.vy, p1.vy)
+
+    def test_interval(self):
+        sim = self.create("leapfrog")
+        sim.spatial_sort_interval = 10
+        sim.steps(9)
+        self.assertEqual(sim.particles[2].hash.value, 10)
+        sim.step()
+        self.assertNotEqual(sim.particles[2].hash.value, 10)
+
+    def test_tree(self):
+        sim = rebound.Simulation()
+        sim.configure_box(10.)
+        sim.boundary = "periodic"
+        sim.gravity = "tree"
+        sim.collision = "tree"
+        sim.integrator = "leapfrog"
+        sim.dt = 0.01
+        for i in range(100):
+            sim.add(m=1e-3, r=0.01, x=-4.9+0.098*i, y=4.*math.sin(i), z=4.*math.cos(3*i), vx=math.sin(2*i))
+        sim.spatial_sort_interval = 3
+        e0 = sim.energy()
+        sim.integrate(1.)
+        self.assertEqual(sim.N, 100)
+        self.assertAlmostEqual(sim.energy(), e0, delta=1e-3*abs(e0))
+
+    def test_unsupported(self):
+        sim = self.create("mercurius")
+        with warnings.catch_warnings(record=True) as w:
+            warnings.simplefilter("always")
+            sim.sort_particles_spatially()
+            self.assertEqual(1, len(w))
+        self.assertEqual(sim.particles[2].hash.value, 10)
+
 class TestParticleNotInSimulation(unittest.TestCase):
     def test_create(self):
         p1 = rebound.Particle()
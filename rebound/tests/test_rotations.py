@@ -92,6 +92,23 @@ class TestRotations(unittest.TestCase):
         self.assertAlmostEqual(res1[1]-res2[1], 0, delta=1e-15)
         self.assertAlmostEqual(res1[2]-res2[2], 0, delta=1e-15)
     
+    def test_simulation_rotate(self):
+        sim = rebound.Simulation()
+        sim.add(m=1)
+        for i in range(2000): # Enough particles to use OpenMP
+            sim.add(a=1.+0.001*i, e=0.1, inc=0.2, Omega=0.01*i, f=0.3*i, primary=sim.particles[0])
+        r = rebound.Rotation(angle=0.7, axis=[0.1,0.2,0.3])
+        ps = [p.copy() for p in sim.particles]
+        sim.rotate(r)
+        for p, q in zip(ps, sim.particles):
+            p.rotate(r)
+            self.assertAlmostEqual(p.x, q.x, delta=1e-14)
+            self.assertAlmostEqual(p.y, q.y, delta=1e-14)
+            self.assertAlmostEqual(p.z, q.z, delta=1e-14)
+            self.assertAlmostEqual(p.vx, q.vx, delta=1e-14)
+            self.assertAlmostEqual(p.vy, q.vy, delta=1e-14)
+            self.assertAlmostEqual(p.vz, q.vz, delta=1e-14)
+    
     def test_to_from_spherical(self):
         mag, theta, phi = 3, math.pi/3, -math.pi/4
         vec = rebound.spherical_to_xyz(mag, theta, phi)
@@ -35,6 +35,31 @@ class TestSerialize(unittest.TestCase):
         with self.assertRaises(AttributeError):
             self.sim.serialize_particle_data(xyz=c)
 
-    
+    def test_particle_view(self):
+        x = self.sim.particle_view("x")
+        self.assertEqual(x.shape, (2,))
+        self.assertEqual(x[1], 1)
+        x[1] = 2.
+        self.assertEqual(self.sim.particles[1].x, 2)
+
+        self.sim.particles[1].vy = 3.
+        xyzvxvyvz = self.sim.particle_view("xyzvxvyvz")
+        self.assertEqual(xyzvxvyvz.shape, (2,6))
+        self.assertEqual(xyzvxvyvz[1][0], 2)
+        self.assertEqual(xyzvxvyvz[1][4], 3)
+
+        vxvyvz = self.sim.particle_view("vxvyvz")
+        vxvyvz[0] = [1.,2.,3.]
+        self.assertEqual(self.sim.particles[0].vz, 3)
+
+        self.sim.particles[1].hash = "planet"
+        h = self.sim.particle_view("hash")
+        self.assertEqual(h.dtype, np.uint32)
+        self.assertEqual(h[1], self.sim.particles[1].hash.value)
+
+        with self.assertRaises(AttributeError):
+            self.sim.particle_view("c")
+
+
 if __name__ == "__main__":
     unittest.main()
@@ -4,7 +4,8 @@ import unittest
 import os
 import math
 import sys
-from ctypes import c_uint32
+import time
+from ctypes import c_uint32, c_uint64, c_int, c_double, byref, sizeof
 
 class TestSimulation(unittest.TestCase):
     def setUp(self):
@@ -31,6 +32,27 @@ class TestSimulation(unittest.TestCase):
         self.sim.exit_min_distance = 1.
         with self.assertRaises(rebound.Encounter):
             self.sim.integrate(1.)
+        self.assertEqual(self.sim.exit_encounter_i, 0)
+        self.assertEqual(self.sim.exit_encounter_j, 1)
+
+    def test_encounter_pair(self):
+        sim = rebound.Simulation()
+        sim.add(m=1.)
+        for i in range(200):
+            sim.add(a=1.+0.01*i, f=0.1*i)
+        sim.add(a=1.+0.01*21, f=0.1*21+0.001)
+        sim.exit_min_distance = 0.01
+        with self.assertRaises(rebound.Encounter):
+            sim.integrate(0.)
+        self.assertEqual(sim.exit_encounter_i, 22)
+        self.assertEqual(sim.exit_encounter_j, 201)
+        
+        # Test particles of type 0 do not interact with each other
+        sim.N_active = 1
+        sim.integrate(0.)
+        sim.testparticle_type = 1
+        with self.assertRaises(rebound.Encounter):
+            sim.integrate(0.)
     
     def test_removeall(self):
         del self.sim.particles
@@ -58,6 +80,283 @@ class TestSimulation(unittest.TestCase):
         self.sim.remove(1,keepSorted=0)
         self.assertEqual(self.sim.N,1)
     
+    def test_remove_many(self):
+        for keepSorted in [0, 1]:
+            sim = rebound.Simulation()
+            sim2 = rebound.Simulation()
+            for i in range(20):
+                sim.add(m=1e-3, x=i, hash=i)
+                sim2.add(m=1e-3, x=i, hash=i)
+            sim.N_active = 10
+            sim2.N_active = 10
+            indices = [3, 17, 0, 9, 12]
+            sim.remove_many(indices, keepSorted=keepSorted)
+            for index in indices:
+                sim2.remove(hash=index, keepSorted=keepSorted)
+            self.assertEqual(sim.N, 15)
+            self.assertEqual(sim.N_active, sim2.N_active)
+            for p, p2 in zip(sim.particles, sim2.particles):
+                self.assertEqual(p.x, p2.x)
+            # Lookup table is still valid
+            self.assertEqual(sim.particles[rebound.hash(5)].x, 5.)
+            sim.remove_many(hashes=[5, 19], keepSorted=keepSorted)
+            self.assertEqual(sim.N, 13)
+            with self.assertRaises(rebound.ParticleNotFound):
+                sim.particles[rebound.hash(5)]
+            with self.assertRaises(RuntimeError):
+                sim.remove_many([1, 1])
+            with self.assertRaises(RuntimeError):
+                sim.remove_many([1, 100])
+            with self.assertRaises(RuntimeError):
+                sim.remove_many(hashes=[6, 5])
+            self.assertEqual(sim.N, 13)
+
+    def test_output_columns(self):
+        sim = rebound.Simulation()
+        sim.add(m=1)
+        sim.add(m=1e-3, a=1, e=0.1)
+        for i in range(20):
+            sim.add(a=1.5+0.1*i, e=0.01*i, f=i, hash=i+100)
+        if os.path.isfile("columns.bin"):
+            os.remove("columns.bin")
+        for t in [0., 1., 2.]:
+            sim.integrate(t)
+            sim.output_columns("columns.bin", ["hash", "x", "a", "e"])
+        outputs = rebound.read_columns("columns.bin", ["hash", "e"])
+        self.assertEqual(len(outputs), 3)
+        self.assertEqual(outputs[-1]["t"], sim.t)
+        self.assertNotIn("x", outputs[-1])
+        self.assertTrue(math.isnan(outputs[-1]["e"][0]))
+        orbits = sim.calculate_orbits()
+        for i in range(1, sim.N):
+            self.assertEqual(outputs[-1]["hash"][i], sim.particles[i].hash.value)
+            self.assertAlmostEqual(outputs[-1]["e"][i], orbits[i-1].e, delta=1e-15)
+        outputs = rebound.read_columns("columns.bin")
+        self.assertEqual(outputs[-1]["x"][5], sim.particles[5].x)
+        with self.assertRaises(ValueError):
+            sim.output_columns("columns.bin", ["ecc"])
+        os.remove("columns.bin")
+
+    def test_output_positions_quantized(self):
+        sim = rebound.Simulation()
+        sim.add(m=1)
+        for i in range(100):
+            sim.add(a=1.+0.01*i, f=i, inc=0.1, hash=i+1)
+        for fmt in ["uint16", "float32"]:
+            if os.path.isfile("positions.bin"):
+                os.remove("positions.bin")
+            for t in [0., 1., 2.]:
+                sim.integrate(t)
+                sim.output_positions_quantized("positions.bin", format=fmt, stride=3, hashes=True)
+            sim.output_positions_quantized_close()
+            frames = rebound.read_positions_quantized("positions.bin")
+            # Frames might be dropped if the writer is busy, but the last one is always written
+            self.assertGreaterEqual(len(frames), 1)
+            frame = frames[-1]
+            self.assertEqual(frame["t"], sim.t)
+            self.assertEqual(len(frame["x"]), 34)
+            for j, i in enumerate(range(0, sim.N, 3)):
+                self.assertEqual(frame["hash"][j], sim.particles[i].hash.value)
+                self.assertAlmostEqual(frame["x"][j], sim.particles[i].x, delta=1e-4)
+                self.assertAlmostEqual(frame["z"][j], sim.particles[i].z, delta=1e-4)
+        with self.assertRaises(ValueError):
+            sim.output_positions_quantized("positions.bin", format="int8")
+        os.remove("positions.bin")
+
+    def test_output_orbits(self):
+        sim = rebound.Simulation()
+        sim.add(m=1)
+        for i in range(5000): # more than one chunk
+            sim.add(m=1e-9, a=1.+0.001*i, e=0.01, f=i)
+        if os.path.isfile("orbits.txt"):
+            os.remove("orbits.txt")
+        sim.output_orbits("orbits.txt")
+        with open("orbits.txt") as f:
+            lines = f.readlines()
+        self.assertEqual(len(lines), sim.N-1)
+        orbits = sim.calculate_orbits()
+        for i in [0, 4095, 4096, 4998]:
+            values = [float(v) for v in lines[i].split()]
+            self.assertEqual(len(values), 9)
+            self.assertAlmostEqual(values[1], orbits[i].a, delta=1e-6*orbits[i].a)
+            self.assertAlmostEqual(values[2], orbits[i].e, delta=1e-6)
+        os.remove("orbits.txt")
+        sim.output_ascii("orbits.txt")
+        with open("orbits.txt") as f:
+            lines = f.readlines()
+        self.assertEqual(len(lines), sim.N)
+        self.assertAlmostEqual(float(lines[4097].split()[0]), sim.particles[4097].x, delta=1e-6)
+        os.remove("orbits.txt")
+
+    def test_add_many(self):
+        sim = rebound.Simulation()
+        sim2 = rebound.Simulation()
+        sim.add(m=1)
+        sim2.add(m=1)
+        ps = [rebound.Particle(simulation=sim, primary=sim.particles[0], m=1e-3, a=1.+0.1*i, f=i, hash=i) for i in range(300)]
+        sim.reserve(1000)
+        sim.add(ps)
+        for p in ps:
+            sim2.add(p)
+        self.assertEqual(sim.N, 301)
+        for p, p2 in zip(sim.particles, sim2.particles):
+            self.assertEqual(p.x, p2.x)
+            self.assertEqual(p.vy, p2.vy)
+            self.assertEqual(p.hash.value, p2.hash.value)
+        self.assertEqual(sim.particles[rebound.hash(7)].x, ps[7].x)
+        arr = (rebound.Particle*3)()
+        for i in range(3):
+            arr[i].m = 1e-5
+            arr[i].x = 5.+i
+        sim.add(arr)
+        self.assertEqual(sim.N, 304)
+        self.assertEqual(sim.particles[-1].x, 7.)
+
+    def test_freeze(self):
+        def setup(integrator):
+            sim = rebound.Simulation()
+            sim.integrator = integrator
+            sim.dt = 0.01
+            sim.add(m=1.)
+            sim.add(m=1e-3, a=1.)
+            sim.N_active = 2
+            for i in range(8):
+                sim.add(a=1.5+0.1*i, f=i, hash=i)
+            return sim
+        for integrator in ["ias15", "whfast", "leapfrog"]:
+            sim = setup(integrator)
+            ref = setup(integrator)
+            frozen = [3, 6, 7]
+            for i in frozen:
+                sim.freeze(i)
+            self.assertEqual(sim.N_frozen, 3)
+            ref.remove_many(frozen)
+            x = [sim.particles[i].x for i in frozen]
+            sim.integrate(5.)
+            ref.integrate(5.)
+            self.assertEqual(sim.N, 10)
+            for i in range(sim.N):
+                p = sim.particles[i]
+                if i in frozen:
+                    self.assertTrue(p.frozen)
+                    self.assertEqual(p.x, x[frozen.index(i)])
+                else:
+                    self.assertFalse(p.frozen)
+                    q = ref.particles[p.hash] if i>=2 else ref.particles[i]
+                    self.assertAlmostEqual(p.x, q.x, delta=1e-12)
+                    self.assertAlmostEqual(p.vy, q.vy, delta=1e-12)
+            sim.unfreeze(7)
+            self.assertEqual(sim.N_frozen, 2)
+            sim.integrate(5.5)
+            self.assertNotEqual(sim.particles[7].x, x[2])
+            self.assertEqual(sim.particles[6].x, x[1])
+            self.assertEqual(sim.remove_frozen(), 2)
+            self.assertEqual(sim.N, 8)
+            self.assertEqual(sim.N_frozen, 0)
+            self.assertEqual(sim.particles[rebound.hash(5)].index, 5)
+
+    def test_freeze_copy_save(self):
+        sim = rebound.Simulation()
+        sim.add(m=1.)
+        sim.N_active = 1
+        sim.add(a=1.)
+        sim.add(a=2., hash="frozen")
+        sim.freeze(hash="frozen")
+        sim2 = sim.copy()
+        self.assertTrue(sim2.particles[2].frozen)
+        self.assertEqual(sim2.N_frozen, 1)
+        sim.save("test_frozen.bin")
+        sim3 = rebound.Simulation("test_frozen.bin")
+        os.remove("test_frozen.bin")
+        self.assertEqual(sim3.N_frozen, 1)
+        self.assertTrue(sim3.particles["frozen"].frozen)
+        sim3.integrate(1.)
+        self.assertEqual(sim3.particles[2].x, sim.particles[2].x)
+
+    def test_freeze_errors(self):
+        sim = rebound.Simulation()
+        sim.add(m=1.)
+        sim.add(a=1.)
+        with self.assertRaises(RuntimeError):
+            sim.freeze(1) # N_active not set
+        sim.N_active = 1
+        with self.assertRaises(RuntimeError):
+            sim.freeze(0) # massive particle
+        with self.assertRaises(RuntimeError):
+            sim.freeze(5)
+        sim.integrator = "mercurius"
+        with self.assertRaises(RuntimeError):
+            sim.freeze(1)
+
+    def test_sink_inject(self):
+        sim = rebound.Simulation()
+        sim.integrator = "whfast"
+        sim.dt = 0.01
+        sim.add(m=1.)
+        sim.add(m=1e-3, a=1.)
+        sim.N_active = 2
+        for i in range(5):
+            sim.add(a=1.5+0.1*i, hash=i)
+        self.assertTrue(sim.sink(hash=rebound.hash(1)))
+        self.assertTrue(sim.sink(4))
+        self.assertEqual(sim.N, 7)
+        self.assertEqual(sim.N_frozen, 2)
+        self.assertTrue(sim.particles[3].frozen)
+        self.assertEqual(sim.particles[rebound.hash(3)].index, 5)
+        with self.assertRaises(rebound.ParticleNotFound):
+            sim.particles[rebound.hash(1)]
+        sim.integrate(1.)
+        self.assertEqual(sim.inject(a=3., hash="new"), 3)
+        self.assertEqual(sim.inject(a=3.1), 4)
+        self.assertEqual(sim.inject(a=3.2), 7)
+        self.assertEqual(sim.N_frozen, 0)
+        self.assertEqual(sim.N_injected, 3)
+        self.assertEqual(sim.particles["new"].index, 3)
+        sim.integrate(2.)
+        self.assertAlmostEqual(sim.particles["new"].a, 3., delta=1e-3)
+        # Without frozen particle support the particle is removed
+        self.assertEqual(sim.N, 8)
+        sim.integrator = "mercurius"
+        self.assertTrue(sim.sink(3))
+        self.assertEqual(sim.N, 7)
+
+    def test_injector(self):
+        sim = rebound.Simulation()
+        sim.integrator = "leapfrog"
+        sim.dt = 0.01
+        sim.add(m=1.)
+        sim.add(m=1e-3, a=1., r=0.05)
+        sim.N_active = 2
+        sim.collision = "direct"
+        def remove_testparticle(simp, c):
+            return 1 if c.p1>c.p2 else 2
+        sim.collision_resolve = remove_testparticle
+        sim.inject_rate = 250.
+        sim.inject_pool = 64
+        def injector(simp, pp):
+            sim = simp.contents
+            p1 = sim.particles[1]
+            # Every second particle hits the planet
+            if sim.N_injected%2:
+                pp[0] = rebound.Particle(x=p1.x+0.02, y=p1.y, vx=p1.vx, vy=p1.vy)
+            else:
+                pp[0] = rebound.Particle(simulation=sim, primary=sim.particles[0], a=2., f=0.01*sim.N_injected)
+        sim.injector = injector
+        for i in range(10):
+            sim.step()
+        self.assertEqual(sim.N_injected, 25)
+        self.assertGreaterEqual(sim.allocated_N, sim.N+64-3)
+        self.assertEqual(sim.N-sim.N_frozen, 2+13)
+        for i in range(100):
+            sim.step()
+        self.assertEqual(sim.N_injected, 275)
+        self.assertEqual(sim.N-sim.N_frozen, 2+138)
+        self.assertLessEqual(sim.N, 2+139)
+        for p in sim.particles[2:]:
+            if not p.frozen:
+                self.assertAlmostEqual(p.a, 2., delta=1e-2)
+
+
     def test_removehash(self):
         self.sim.add(m=1e-3, a=1., e=0.01, omega=0.02, M=0.04, inc=0.1)
         self.sim.particles[-1].hash = 99
@@ -69,7 +368,47 @@ class TestSimulation(unittest.TestCase):
             self.sim.remove(hash=99)
         with self.assertRaises(RuntimeError):
             self.sim.remove(hash=-99334)
-    
+
+    def test_diff(self):
+        sim = rebound.Simulation()
+        sim.add(m=1.)
+        for i in range(100):
+            sim.add(m=1e-6, a=1.+0.01*i, f=i, hash=i+1)
+        sim2 = sim.copy()
+        self.assertTrue(sim == sim2)
+        sim2.particles[50].x += 1e-15
+        self.assertFalse(sim == sim2)
+        sim2 = sim.copy()
+        sim2.remove(hash=20)
+        self.assertFalse(sim == sim2)
+        sim2 = sim.copy()
+        sim2.remove(index=1, keepSorted=False)
+        self.assertFalse(sim == sim2)
+        sim2 = sim.copy()
+        sim2.G = 2.
+        self.assertFalse(sim == sim2)
+
+    def test_load_skip(self):
+        sim = rebound.Simulation()
+        sim.add(m=1.)
+        sim.add(m=1e-3, a=1., e=0.1)
+        sim.add(m=1e-3, a=2., e=0.1)
+        sim.integrator = "ias15"
+        sim.ri_ias15.epsilon = 1e-8
+        sim.integrate(10.)
+        sim.save("test.bin")
+        sim2 = rebound.Simulation("test.bin", skip=["ias15"])
+        self.assertEqual(sim2.ri_ias15._allocatedN, 0)
+        self.assertEqual(sim2.ri_ias15.epsilon, 1e-8)
+        self.assertEqual(sim2.N, 3)
+        self.assertEqual(sim2.t, sim.t)
+        self.assertEqual(sim2.particles[2].x, sim.particles[2].x)
+        sim.integrate(20.)
+        sim2.integrate(20.)
+        self.assertAlmostEqual(sim2.particles[2].x, sim.particles[2].x, delta=1e-8)
+        with self.assertRaises(ValueError):
+            rebound.Simulation("test.bin", skip=["whfast"])
+        
     def test_ascii(self):
         a = self.sim.particles_ascii()
         sim = rebound.Simulation()
@@ -86,6 +425,17 @@ class TestSimulation(unittest.TestCase):
         self.sim.step()
         self.assertNotEqual(self.sim.t, 1.246)
 
+    def test_steps_fast(self):
+        self.sim.integrator = "whfast"
+        self.sim.dt = 0.01
+        sim2 = self.sim.copy()
+        self.sim.steps(100)
+        sim2.steps_fast(100)
+        self.assertEqual(self.sim.steps_done, sim2.steps_done)
+        self.assertEqual(self.sim.t, sim2.t)
+        self.assertEqual(self.sim.particles[1].x, sim2.particles[1].x)
+        self.assertEqual(self.sim.particles[1].vx, sim2.particles[1].vx)
+
     def test_configure_box(self):
         self.assertEqual(self.sim.root_size,-1.)
         self.sim.configure_box(100.,1,1,1)
@@ -206,16 +556,16 @@ class TestSimulation(unittest.TestCase):
     def test_gravity(self):
         self.sim.gravity = "tree"
         self.assertEqual(self.sim.gravity, "tree")
-        self.sim.gravity = 8
-        self.assertEqual(self.sim.gravity, 8)
+        self.sim.gravity = 42
+        self.assertEqual(self.sim.gravity, 42)
         with self.assertRaises(ValueError):
             self.sim.gravity = "bogusgravity"
     
     def test_collision(self):
         self.sim.collision = "tree"
         self.assertEqual(self.sim.collision, "tree")
-        self.sim.collision = 8
-        self.assertEqual(self.sim.collision, 8)
+        self.sim.collision = 42
+        self.assertEqual(self.sim.collision, 42)
         with self.assertRaises(ValueError):
             self.sim.collision = "boguscollision"
 
@@ -247,7 +597,245 @@ class TestSimulation(unittest.TestCase):
         self.assertEqual(self.sim.N, sim2.N)
         self.assertEqual(self.sim.integrator, sim2.integrator)
         os.remove("bintest.bin")
-    
+
+    def test_integrate_ensemble(self):
+        sims = []
+        for i in range(8):
+            sim = self.sim.copy()
+            sim.particles[1].x += 1e-3*i
+            sims.append(sim)
+        sims[3].exit_max_distance = 0.1
+        status = rebound.integrate_ensemble(sims, 10., N_threads=3)
+        self.assertEqual(status[3], 4) # REB_EXIT_ESCAPE
+        for i in range(8):
+            if i==3:
+                continue
+            self.assertEqual(status[i], 0)
+            sim = self.sim.copy()
+            sim.particles[1].x += 1e-3*i
+            sim.integrate(10.)
+            self.assertEqual(sim.t, sims[i].t)
+            self.assertEqual(sim.particles[1].x, sims[i].particles[1].x)
+            self.assertEqual(sim.particles[1].vy, sims[i].particles[1].vy)
+
+    def test_integrate_ensemble_fork(self):
+        def setup(sim, member):
+            sim.particles[1].x += 1e-3*member
+            if member==3:
+                sim.exit_max_distance = 0.1
+        def result(sim, member):
+            return [sim.t, sim.particles[1].x, sim.particles[1].vy]
+        t0, x0 = self.sim.t, self.sim.particles[1].x
+        for i in range(8):
+            for f in ["fork%02d.bin"%i, "fork%02d.bin.index"%i]:
+                if os.path.isfile(f):
+                    os.remove(f)
+        status, results = rebound.integrate_ensemble_fork(self.sim, 8, 10., setup, result, N_columns=3, N_procs=3, filename="fork{:02d}.bin")
+        self.assertEqual(self.sim.t, t0)
+        self.assertEqual(self.sim.particles[1].x, x0)
+        self.assertEqual(status[3], 4) # REB_EXIT_ESCAPE
+        for i in range(8):
+            sa = rebound.SimulationArchive("fork%02d.bin"%i)
+            os.remove("fork%02d.bin"%i)
+            os.remove("fork%02d.bin.index"%i)
+            if i==3:
+                continue
+            self.assertEqual(status[i], 0)
+            sim = self.sim.copy()
+            sim.particles[1].x += 1e-3*i
+            sim.integrate(10.)
+            self.assertEqual(results[i], [sim.t, sim.particles[1].x, sim.particles[1].vy])
+            self.assertEqual(len(sa), 2)
+            self.assertEqual(sa[1].particles[1].x, sim.particles[1].x)
+        status, results = rebound.integrate_ensemble_fork(self.sim, 4, 1., result=lambda sim, member: sim.t)
+        self.assertEqual(status, [0]*4)
+        self.assertEqual(results, [1.]*4)
+
+    def test_energy_tree(self):
+        sim = rebound.Simulation()
+        sim.configure_box(10.)
+        sim.gravity = "tree"
+        sim.opening_angle2 = 0.25
+        sim.add(m=1.)
+        for i in range(200):
+            sim.add(m=1e-3, a=1.+0.01*i, e=0.1, f=0.3*i, inc=0.01*(i%7))
+        sim.step()
+        e = sim.energy()
+        self.assertAlmostEqual(sim.energy_tree(), e, delta=1e-2*abs(e))
+        sim.opening_angle2 = 0.
+        self.assertAlmostEqual(sim.energy_tree(), e, delta=1e-13*abs(e))
+
+    def test_random_arrays(self):
+        sim = rebound.Simulation()
+        sim.rand_seed = 7
+        v0 = (c_double*100)()
+        v1 = (c_double*50)()
+        rebound.clibrebound.reb_random_normal_array(byref(sim), c_uint32(1), c_uint64(0), c_int(100), c_double(2.), v0)
+        rebound.clibrebound.reb_random_normal_array(byref(sim), c_uint32(1), c_uint64(50), c_int(50), c_double(2.), v1)
+        self.assertEqual(list(v0[50:]), list(v1))
+        self.assertEqual(sim.rand_seed, 7)
+        rebound.clibrebound.reb_random_uniform_array(byref(sim), c_uint32(2), c_uint64(50), c_int(50), c_double(1.), c_double(2.), v1)
+        self.assertNotEqual(list(v0[50:]), list(v1))
+        self.assertTrue(all(1. <= v < 2. for v in v1))
+
+    def test_init_plummer(self):
+        sims = []
+        for i in range(2):
+            sim = rebound.Simulation()
+            sim.rand_seed = 3
+            rebound.clibrebound.reb_tools_init_plummer(byref(sim), c_int(100), c_double(1.), c_double(1.))
+            sims.append(sim)
+        self.assertEqual(sims[0].N, 100)
+        self.assertEqual(sims[0].particles[99].x, sims[1].particles[99].x)
+        self.assertAlmostEqual(sum(p.m for p in sims[0].particles), 1., delta=1e-14)
+
+    def test_display_snapshot(self):
+        sim = rebound.Simulation()
+        for i in range(10):
+            sim.add(m=1e-3, x=float(i))
+        sim.display_stride = 3
+        rebound.clibrebound.reb_display_init_data(byref(sim))
+        rebound.clibrebound.reb_display_copy_data(byref(sim))
+        r_copy = sim.display_data.contents.r_copy.contents
+        self.assertEqual(r_copy.N, 4)
+        self.assertEqual([r_copy.particles[i].x for i in range(4)], [0., 3., 6., 9.])
+        # Every call without a simulation thread takes a new snapshot
+        sim.particles[9].x = 10.
+        sim.display_stride = 1
+        rebound.clibrebound.reb_display_copy_data(byref(sim))
+        r_copy = sim.display_data.contents.r_copy.contents
+        self.assertEqual(r_copy.N, 10)
+        self.assertEqual(r_copy.particles[9].x, 10.)
+        self.assertEqual(sim.copy().display_stride, 1)
+
+    def test_heartbeat_async(self):
+        def setup(safe_mode):
+            sim = rebound.Simulation()
+            sim.add(m=1.)
+            sim.add(m=1e-3, a=1., e=0.1)
+            sim.add(m=1e-3, a=2.)
+            sim.integrator = "whfast"
+            sim.ri_whfast.safe_mode = safe_mode
+            sim.dt = 0.01
+            return sim
+        # Reference with synchronous heartbeat
+        sim = setup(1)
+        ref = []
+        def heartbeat_ref(simp):
+            sim = simp.contents
+            ref.append((sim.t, sim.particles[1].x))
+        sim.heartbeat = heartbeat_ref
+        sim.integrate(1.)
+        # The copy is synchronized even if the simulation is not
+        sim = setup(0)
+        res = []
+        def heartbeat(simp):
+            sim = simp.contents
+            res.append((sim.t, sim.particles[1].x))
+        sim.heartbeat = heartbeat
+        sim.heartbeat_async = 2
+        sim.integrate(1.)
+        self.assertEqual(sim.heartbeat_async_skipped, 0)
+        self.assertEqual(len(res), len(ref))
+        for (t, x), (t_ref, x_ref) in zip(res, ref):
+            self.assertEqual(t, t_ref)
+            self.assertAlmostEqual(x, x_ref, delta=1e-12)
+        # Skipped heartbeats are counted
+        sim = setup(1)
+        res = []
+        def heartbeat_slow(simp):
+            res.append(simp.contents.t)
+            time.sleep(0.001)
+        sim.heartbeat = heartbeat_slow
+        sim.heartbeat_async = 1
+        sim.integrate(1.)
+        self.assertEqual(len(res)+sim.heartbeat_async_skipped, 101)
+        self.assertEqual(res, sorted(res))
+        # Stopping from the copy stops the simulation
+        sim = setup(1)
+        def heartbeat_stop(simp):
+            if simp.contents.t>0.5:
+                simp.contents.stop()
+        sim.heartbeat = heartbeat_stop
+        sim.heartbeat_async = 2
+        sim.integrate(10.)
+        self.assertGreater(sim.t, 0.5)
+        self.assertLess(sim.t, 1.)
+        self.assertEqual(sim._status, 5) # REB_EXIT_USER
+
+    def test_profiling(self):
+        sim = rebound.Simulation()
+        sim.add(m=1.)
+        sim.add(m=1e-3, a=1.)
+        sim.add(m=1e-3, a=2.)
+        sim.integrator = "whfast"
+        sim.dt = 0.01
+        sim.integrate(1.)
+        self.assertEqual(sim.profiling_report(), {})
+        sim.profiling = 1
+        sim.integrate(2.)
+        report = sim.profiling_report()
+        steps = report["step"]["calls"]
+        self.assertGreaterEqual(steps, 100)
+        self.assertEqual(report["gravity"]["calls"], steps)
+        self.assertEqual(report["heartbeat"]["calls"], steps+1)
+        self.assertNotIn("io", report)
+        # Nested scopes are part of the enclosing scope
+        self.assertGreaterEqual(report["step"]["time"], report["gravity"]["time"]+report["integrator part1"]["time"])
+        self.assertLessEqual(report["integrator part1"]["self"], report["integrator part1"]["time"])
+        self.assertIn("kepler", report)
+        sim.reset_profiling()
+        self.assertEqual(sim.profiling_report(), {})
+
+    def test_profiling_trace(self):
+        import json
+        import os
+        sim = rebound.Simulation()
+        sim.add(m=1.)
+        sim.add(m=1e-3, a=1.)
+        sim.integrator = "whfast"
+        sim.dt = 0.01
+        sim.profiling = 1
+        sim.profiling_trace = 50
+        sim.integrate(2.)
+        sim.write_profiling_trace("trace.json")
+        with open("trace.json") as f:
+            trace = json.load(f)
+        os.remove("trace.json")
+        events = [e for e in trace["traceEvents"] if e["ph"]=="X"]
+        # Only the most recent events are kept
+        self.assertEqual(len(events), 50)
+        for e in events:
+            self.assertIn(e["name"], rebound.simulation.PROFILING_SCOPES)
+            self.assertGreaterEqual(e["dur"], 0.)
+        steps = [e for e in events if e["name"]=="step"]
+        self.assertGreater(len(steps), 0)
+        # Nested scopes lie within the enclosing step
+        step = steps[-1]
+        for e in events:
+            if e["name"]=="gravity" and e["ts"]>=step["ts"] and e["ts"]<=step["ts"]+step["dur"]:
+                self.assertLessEqual(e["ts"]+e["dur"], step["ts"]+step["dur"]+1e-3)
+
+    def test_memory_usage(self):
+        sim = rebound.Simulation()
+        sim.add(m=1.)
+        for i in range(10):
+            sim.add(m=1e-6, a=1.+0.1*i)
+        usage = sim.memory_usage()
+        self.assertGreaterEqual(usage["particles"], 11*sizeof(rebound.Particle))
+        self.assertEqual(usage["integrator"], 0)
+        grown = []
+        def memory_grown(simp, report):
+            grown.append(report.contents.bytes[rebound.simulation.MEMORY_SUBSYSTEMS["integrator"]])
+        sim.memory_grown = memory_grown
+        sim.integrator = "ias15"
+        sim.integrate(1.)
+        usage = sim.memory_usage()
+        self.assertGreater(usage["integrator"], 0)
+        self.assertEqual(usage["total"], sum(v for k, v in usage.items() if k!="total"))
+        # Only called once, when the IAS15 arrays are allocated
+        self.assertEqual(grown, [usage["integrator"]])
+
 class TestSimulationCollisions(unittest.TestCase):
     def setUp(self):
         self.sim = rebound.Simulation()
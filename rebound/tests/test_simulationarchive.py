@@ -32,6 +32,207 @@ class TestSimulationArchive(unittest.TestCase):
         x0 = sim.particles[1].x
 
         self.assertEqual(x0,x1)
+    def test_sa_async(self):
+        for async_mode in [0, 1]:
+            sim = rebound.Simulation()
+            sim.add(m=1)
+            sim.add(m=1e-3,a=1,e=0.1,omega=0.1,M=0.1,inc=0.1,Omega=0.1)
+            sim.add(m=1e-3,a=2,e=0.1,omega=0.1,M=0.1,inc=0.1,Omega=0.1)
+            sim.integrator = "whfast"
+            sim.dt = 0.1313
+            sim.simulationarchive_async = async_mode
+            sim.automateSimulationArchive("test%d.bin"%async_mode, step=3, deletefile=True)
+            sim.integrate(40.,exact_finish_time=0)
+            sim.simulationarchive_snapshot("test%d.bin"%async_mode)
+            sim = None # flushes pending snapshots
+        with open("test0.bin", "rb") as f0, open("test1.bin", "rb") as f1:
+            b0, b1 = f0.read(), f1.read()
+        # Files only differ in the simulationarchive_async field and walltimes
+        sa0 = rebound.SimulationArchive("test0.bin")
+        sa1 = rebound.SimulationArchive("test1.bin")
+        self.assertEqual(len(sa0), len(sa1))
+        self.assertEqual(len(b0), len(b1))
+        for i in range(len(sa0)):
+            self.assertEqual(sa0[i].t, sa1[i].t)
+            self.assertEqual(sa0[i].particles[1].x, sa1[i].particles[1].x)
+        self.assertEqual(sa1[-1].simulationarchive_async, 1)
+
+    def test_sa_async_flush(self):
+        sim = rebound.Simulation()
+        sim.add(m=1)
+        sim.add(m=1e-3,a=1)
+        sim.simulationarchive_async = 1
+        sim.automateSimulationArchive("test.bin", interval=0.5, deletefile=True)
+        sim.integrate(10.)
+        sim.simulationarchive_flush()
+        sa = rebound.SimulationArchive("test.bin")
+        self.assertEqual(len(sa), 21)
+        self.assertAlmostEqual(sa[-1].t, 10., delta=0.1)
+
+    def test_sa_compress(self):
+        for compress in [0, 1]:
+            sim = rebound.Simulation()
+            sim.add(m=1)
+            sim.add(m=1e-3,a=1,e=0.1,omega=0.1,M=0.1,inc=0.1,Omega=0.1)
+            for i in range(50):
+                sim.add(a=1.5+0.1*i,e=0.05,f=i)
+            sim.N_active = 2
+            sim.integrator = "whfast"
+            sim.dt = 0.1313
+            sim.simulationarchive_compress = compress
+            sim.automateSimulationArchive("test%d.bin"%compress, interval=1., deletefile=True)
+            sim.integrate(20.,exact_finish_time=0)
+            sim = None
+        sa0 = rebound.SimulationArchive("test0.bin")
+        sa1 = rebound.SimulationArchive("test1.bin")
+        self.assertEqual(len(sa0), len(sa1))
+        for i in range(len(sa0)):
+            sim0, sim1 = sa0[i], sa1[i]
+            self.assertEqual(sim0.t, sim1.t)
+            for j in range(sim0.N):
+                self.assertEqual(sim0.particles[j].x, sim1.particles[j].x)
+                self.assertEqual(sim0.particles[j].vz, sim1.particles[j].vz)
+                self.assertEqual(sim0.particles[j].m, sim1.particles[j].m)
+        self.assertEqual(sa1[-1].simulationarchive_compress, 1)
+        self.assertLess(os.path.getsize("test1.bin"), os.path.getsize("test0.bin"))
+
+    def test_sa_full_every(self):
+        for integrator in ["whfast", "ias15"]:
+            for full_every in [1, 5]:
+                sim = rebound.Simulation()
+                sim.add(m=1)
+                sim.add(m=1e-3,a=1,e=0.1,omega=0.1,M=0.1,inc=0.1,Omega=0.1)
+                for i in range(200):
+                    sim.add(a=1.5+0.01*i,e=0.05,f=i)
+                sim.N_active = 2
+                sim.integrator = integrator
+                sim.dt = 0.1313
+                sim.simulationarchive_full_every = full_every
+                sim.automateSimulationArchive("test%d.bin"%full_every, interval=1., deletefile=True)
+                sim.integrate(12.,exact_finish_time=0)
+                sim = None
+            sa1 = rebound.SimulationArchive("test1.bin")
+            sa5 = rebound.SimulationArchive("test5.bin")
+            self.assertEqual(len(sa1), len(sa5))
+            for i in range(len(sa5)):
+                sim1, sim5 = sa1[i], sa5[i]
+                self.assertEqual(sim1.t, sim5.t)
+                self.assertEqual(sim1.N, sim5.N)
+                # Massive bodies are stored in every snapshot
+                self.assertEqual(sim1.particles[1].x, sim5.particles[1].x)
+                # Test particles come from the last full snapshot
+                full = sa1[i-i%5]
+                for j in [2, 100, 201]:
+                    self.assertEqual(full.particles[j].x, sim5.particles[j].x)
+                    self.assertEqual(full.particles[j].vy, sim5.particles[j].vy)
+            self.assertLess(3*os.path.getsize("test5.bin"), os.path.getsize("test1.bin"))
+            # Restarting from a partial snapshot keeps the schedule
+            sim = rebound.Simulation("test5.bin")
+            with warnings.catch_warnings():
+                warnings.simplefilter("ignore") # File exists
+                sim.automateSimulationArchive("test5.bin", interval=1.)
+            sim.integrate(17.,exact_finish_time=0)
+            sim = None
+            sa5 = rebound.SimulationArchive("test5.bin")
+            self.assertEqual(len(sa5), 18)
+            self.assertEqual(sa5[15].t, sa5[-1]._simulationarchive_full_t)
+            self.assertEqual(sa5[17].particles[150].x, sa5[15].particles[150].x)
+
+    def test_sa_extract(self):
+        sim = rebound.Simulation()
+        sim.add(m=1, hash="star")
+        sim.add(m=1e-3,a=1,e=0.1,omega=0.1,M=0.1,inc=0.1,Omega=0.1, hash="planet1")
+        sim.add(m=1e-3,a=2,e=0.2,omega=0.2,M=0.2,inc=0.2,Omega=0.2, hash="planet2")
+        for i in range(20):
+            sim.add(a=3.+0.1*i,e=0.05,f=i, hash=100+i)
+        sim.N_active = 3
+        sim.integrator = "whfast"
+        sim.dt = 0.1313
+        sim.simulationarchive_compress = 1
+        sim.simulationarchive_full_every = 3
+        sim.automateSimulationArchive("test.bin", interval=1., deletefile=True)
+        sim.integrate(20.,exact_finish_time=0)
+        sim = None
+        sa = rebound.SimulationArchive("test.bin")
+        fields = ["x", "vz", "m", "r", "a", "e", "inc", "Omega", "omega", "f", "M", "P"]
+        particles = ["planet2", 110, "star", "missing"]
+        data = sa.extract(fields, particles=particles, N_threads=2)
+        self.assertEqual(data.shape, (len(sa), 4, len(fields)))
+        for k in range(len(sa)):
+            sim = sa[k]
+            for j in range(2):
+                p = sim.particles[rebound.hash(particles[j])]
+                for l, f in enumerate(fields):
+                    self.assertEqual(data[k,j,l], getattr(p, f))
+            # No orbital elements for the star, no values for missing particles
+            self.assertEqual(data[k,2,0], sim.particles[0].x)
+            self.assertNotEqual(data[k,2,5], data[k,2,5]) 
+            self.assertNotEqual(data[k,3,0], data[k,3,0])
+        # By index, for a range of snapshots
+        e = sa.extract("e", snapshots=slice(4,9))
+        self.assertEqual(e.shape, (5, 23))
+        self.assertEqual(e[2,1], sa[6].particles[1].e)
+        self.assertEqual(e[3,20], sa[7].particles[20].e)
+        with self.assertRaises(ValueError):
+            sa.extract("energy")
+
+    def test_sa_index(self):
+        for async_mode in [0, 1]:
+            sim = rebound.Simulation()
+            sim.add(m=1)
+            sim.add(m=1e-3,a=1,e=0.1)
+            sim.simulationarchive_async = async_mode
+            sim.automateSimulationArchive("test.bin", interval=0.5, deletefile=True)
+            sim.integrate(10.)
+            sim = None
+            self.assertTrue(os.path.isfile("test.bin.index"))
+            sa = rebound.SimulationArchive("test.bin")
+            offsets = [sa.offset64[i] for i in range(len(sa))]
+            times = [sa.t[i] for i in range(len(sa))]
+            sa = None
+            # Without a valid index, the archive is scanned
+            with open("test.bin.index", "r+b") as f:
+                f.write(b"corrupt")
+            sa = rebound.SimulationArchive("test.bin")
+            self.assertEqual(len(sa), 21)
+            self.assertEqual(offsets, [sa.offset64[i] for i in range(len(sa))])
+            self.assertEqual(times, [sa.t[i] for i in range(len(sa))])
+            sa = None
+            # Appending to an archive rebuilds the index
+            sim = rebound.Simulation("test.bin")
+            sim.simulationarchive_snapshot("test.bin")
+            sim = None
+            sa = rebound.SimulationArchive("test.bin")
+            self.assertEqual(len(sa), 22)
+            self.assertEqual(offsets, [sa.offset64[i] for i in range(len(sa)-1)])
+            os.remove("test.bin.index")
+            sa = rebound.SimulationArchive("test.bin")
+            self.assertEqual(len(sa), 22)
+
+    def test_sa_output_text(self):
+        sim = rebound.Simulation()
+        sim.add(m=1)
+        sim.add(m=1e-3,a=1,e=0.1)
+        sim.add(a=2,e=0.2)
+        sim.automateSimulationArchive("test.bin", interval=1., deletefile=True)
+        sim.integrate(3.)
+        sim = None
+        sa = rebound.SimulationArchive("test.bin")
+        for orbits in [False, True]:
+            if os.path.isfile("test.txt"):
+                os.remove("test.txt")
+            sa.output_text("test.txt", orbits=orbits)
+            with open("test.txt") as f:
+                lines = f.readlines()
+            self.assertEqual(len(lines), len(sa)*(2 if orbits else 3))
+            values = [float(v) for v in lines[-1].split()]
+            if orbits:
+                self.assertEqual(values[0], sa[-1].t)
+                self.assertAlmostEqual(values[2], sa[-1].particles[2].e, delta=1e-6)
+            else:
+                self.assertAlmostEqual(values[0], sa[-1].particles[2].x, delta=1e-6)
+        os.remove("test.txt")
+
     def test_sa_fromarchive(self):
         sim = rebound.Simulation()
         sim.add(m=1)
@@ -257,6 +257,32 @@ class TestVariationalTestParticle(unittest.TestCase):
     
     
     
+    def test_1st_order_many_testparticles(self):
+        # Test particles only feel the active particles, even if they have a mass
+        def create(Delta):
+            sim = rebound.Simulation()
+            sim.testparticle_type = 0
+            sim.add(m=1.)
+            sim.add(a=1.76, m=1e-3)
+            sim.N_active = 2
+            for i in range(10):
+                sim.add(a=1.+0.1*i, e=0.1, f=0.7*i, m=1e-4)
+            sim.particles[2].x += Delta
+            var = [sim.add_variation(testparticle=2+i) for i in range(10)]
+            var[0].particles[0].x = 1.
+            return sim, var
+        Delta = 1e-8
+        simvp, var = create(0.)
+        simvp.integrate(1.4)
+        simsp, _ = create(Delta)
+        simsp.integrate(1.4)
+        dp = (simsp.particles[2]-simvp.particles[2])/Delta - var[0].particles[0]
+        prec = 1e-5
+        self.assertLess(abs(dp.x ),prec)
+        self.assertLess(abs(dp.y ),prec)
+        self.assertLess(abs(dp.vx),prec)
+        self.assertLess(abs(dp.vy),prec)
+    
     def test_all_2nd_order_full(self):
         self.run_2nd_order_full(com=False)
     def test_all_2nd_order_full_com(self):
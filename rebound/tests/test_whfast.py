@@ -3,6 +3,7 @@ import unittest
 import math
 import rebound.data
 import warnings
+import os
     
     
 class TestIntegratorWHFast(unittest.TestCase):
@@ -86,6 +87,115 @@ class TestIntegratorWHFast(unittest.TestCase):
         e1 = sim.energy()
         self.assertLess(math.fabs((e0-e1)/e1),3e-8)
     
+    def test_kepler_warmstart(self):
+        def setup(integrator, warmstart):
+            sim = rebound.Simulation()
+            sim.add(m=1.)
+            sim.add(m=1e-3, a=1., e=0.1)
+            sim.add(m=1e-3, a=1.7, e=0.3, inc=0.1)
+            for i in range(5):
+                sim.add(a=2.2+0.1*i, e=0.05*i, f=i)
+            sim.N_active = 3
+            sim.integrator = integrator
+            sim.dt = 0.0123
+            sim.ri_whfast.corrector = 11 if integrator=="whfast" else 0
+            sim.ri_whfast.kepler_warmstart = warmstart
+            sim.ri_mercurius.kepler_warmstart = warmstart
+            return sim
+        for integrator in ["whfast", "saba", "mercurius"]:
+            sim0 = setup(integrator, 0)
+            sim1 = setup(integrator, 1)
+            sim0.integrate(50.)
+            sim1.integrate(50.)
+            for p0, p1 in zip(sim0.particles, sim1.particles):
+                self.assertAlmostEqual(p0.x, p1.x, delta=1e-11)
+                self.assertAlmostEqual(p0.vy, p1.vy, delta=1e-11)
+            # Corrections are copied and saved
+            sim1.save("test_warmstart.bin")
+            sim2 = rebound.Simulation("test_warmstart.bin")
+            os.remove("test_warmstart.bin")
+            sim3 = sim1.copy()
+            for sim in [sim1, sim2, sim3]:
+                sim.integrate(60.)
+            for p1, p2, p3 in zip(sim1.particles, sim2.particles, sim3.particles):
+                self.assertEqual(p1.x, p2.x)
+                self.assertEqual(p1.x, p3.x)
+
+    def test_kepler_warmstart_keep_unsynchronized(self):
+        sims = []
+        for i in range(2):
+            sim = rebound.Simulation()
+            sim.add(m=1.)
+            sim.add(m=1e-3, a=1., e=0.1)
+            sim.add(m=1e-3, a=1.7, e=0.3)
+            sim.integrator = "whfast"
+            sim.dt = 0.0123
+            sim.ri_whfast.safe_mode = 0
+            sim.ri_whfast.keep_unsynchronized = 1
+            sim.ri_whfast.kepler_warmstart = 1
+            sims.append(sim)
+        for t in range(1,20):
+            sims[0].integrate(t, exact_finish_time=0)
+            sims[0].integrator_synchronize()
+        sims[1].integrate(19., exact_finish_time=0)
+        sims[1].integrator_synchronize()
+        self.assertEqual(sims[0].particles[2].x, sims[1].particles[2].x)
+
+    def test_synchronized_particles(self):
+        for coordinates, corrector in [("jacobi", 11), ("democraticheliocentric", 0)]:
+            sims = []
+            for i in range(2):
+                sim = rebound.Simulation()
+                sim.add(m=1.)
+                sim.add(m=1e-3, a=1., e=0.1)
+                sim.add(m=1e-3, a=1.7, e=0.1, inc=0.1)
+                sim.N_active = 3
+                for j in range(20):
+                    sim.add(a=2.+0.1*j, e=0.01*j, f=j, hash="tp%d"%j)
+                sim.integrator = "whfast"
+                sim.ri_whfast.coordinates = coordinates
+                sim.ri_whfast.corrector = corrector
+                sim.ri_whfast.safe_mode = 0
+                sim.dt = 0.0123
+                sim.steps(800)
+                sims.append(sim)
+            ref = sims[0].copy()
+            ref.integrator_synchronize()
+            self.assertNotEqual(ref.particles[7].x, sims[0].particles[7].x)
+            ps = sims[0].synchronized_particles([1, 7, 15, 2])
+            for p, i in zip(ps, [1, 7, 15, 2]):
+                self.assertEqual(p.x, ref.particles[i].x)
+                self.assertEqual(p.vz, ref.particles[i].vz)
+            ps = sims[0].synchronized_particles(hash=["tp10", "tp0"])
+            self.assertEqual(ps[0].y, ref.particles[13].y)
+            self.assertEqual(ps[1].vx, ref.particles[3].vx)
+            ps = sims[0].synchronized_particles(slice(-2, None))
+            self.assertEqual(ps[1].x, ref.particles[22].x)
+            # The integration is not affected
+            for sim in sims:
+                sim.steps(800)
+                sim.integrator_synchronize()
+            self.assertEqual(sims[0].particles[20].x, sims[1].particles[20].x)
+            self.assertEqual(sims[0].particles[1].vy, sims[1].particles[1].vy)
+        with self.assertRaises(IndexError):
+            sims[0].synchronized_particles([23])
+
+    def test_synchronized_particles_copy(self):
+        sim = rebound.Simulation()
+        sim.add(m=1.)
+        sim.add(m=1e-3, a=1., e=0.1)
+        sim.add(m=1e-3, a=1.7, e=0.1)
+        sim.integrator = "mercurius"
+        sim.dt = 0.0123
+        sim.ri_mercurius.safe_mode = 0
+        sim.steps(800)
+        ref = sim.copy()
+        ref.integrator_synchronize()
+        ps = sim.synchronized_particles()
+        self.assertEqual(len(ps), 3)
+        self.assertEqual(ps[2].x, ref.particles[2].x)
+        self.assertNotEqual(ps[2].x, sim.particles[2].x)
+
     # Democratic Heliocentric
     def test_order_doesnt_matter_tp0(self):
         sim = rebound.Simulation()
@@ -0,0 +1,64 @@
+import rebound
+import unittest
+import math
+
+def setup_sim(N_testparticles=0):
+    sim = rebound.Simulation()
+    sim.add(m=1)
+    for i in range(8):
+        sim.add(m=1e-5*(i+1), a=1+0.8*i, e=0.02*i, inc=0.01*i, f=i)
+    sim.N_active = sim.N
+    for i in range(N_testparticles):
+        sim.add(a=1.3+0.2*i, e=0.05, f=0.3*i, primary=sim.particles[0])
+    sim.move_to_com()
+    sim.dt = 0.02
+    return sim
+
+class TestIntegratorWHFast512(unittest.TestCase):
+    def setUp(self):
+        # WHFast512 requires AVX512 or AVX2 instructions
+        sim = setup_sim()
+        sim.integrator = "whfast512"
+        try:
+            sim.integrate(sim.dt, exact_finish_time=0)
+        except RuntimeError:
+            self.skipTest("WHFast512 is not available on this machine.")
+
+    def compare_whfast(self, N_testparticles):
+        sim = setup_sim(N_testparticles)
+        sim2 = sim.copy()
+        sim.integrator = "whfast"
+        sim.ri_whfast.coordinates = "democraticheliocentric"
+        sim.ri_whfast.safe_mode = 0
+        sim2.integrator = "whfast512"
+        sim.integrate(10., exact_finish_time=0)
+        sim2.integrate(10., exact_finish_time=0)
+        for i in range(sim.N):
+            d = sim.particles[i] - sim2.particles[i]
+            self.assertLess(math.sqrt(d.x*d.x+d.y*d.y+d.z*d.z), 1e-12)
+
+    def test_whfast(self):
+        self.compare_whfast(0)
+
+    def test_whfast_testparticles(self):
+        self.compare_whfast(21)
+
+    def test_restart(self):
+        sim = setup_sim(11)
+        sim.integrator = "whfast512"
+        sim.ri_whfast512.gr_potential = 1
+        sim.ri_whfast512.keep_unsynchronized = 1
+        sim2 = sim.copy()
+        sim.integrate(5., exact_finish_time=0)
+        sim3 = sim.copy()
+        sim.integrate(10., exact_finish_time=0)
+        sim2.integrate(10., exact_finish_time=0)
+        sim3.integrate(10., exact_finish_time=0)
+        for i in range(sim.N):
+            self.assertEqual(sim.particles[i].x, sim2.particles[i].x)
+            self.assertEqual(sim.particles[i].vx, sim2.particles[i].vx)
+            self.assertEqual(sim.particles[i].x, sim3.particles[i].x)
+            self.assertEqual(sim.particles[i].vx, sim3.particles[i].vx)
+
+if __name__ == "__main__":
+    unittest.main()
@@ -6,7 +6,20 @@ import warnings
 
 coordinatelist = ["democraticheliocentric","whds","jacobi"]
 class TestIntegratorWHFastTestParticle(unittest.TestCase):
-    pass
+    def test_whfast_testparticle_partitions_jacobi(self):
+        sim = rebound.Simulation()
+        sim.integrator = "whfast"
+        sim.dt=1e-2
+        sim.add(m=1)
+        sim.add(m=1e-3,P=0.4)
+        sim.add(m=0,P=1)
+        sim.N_active = 2
+        sim.ri_whfast.testparticle_partitions = 2
+        with warnings.catch_warnings(record=True) as w:
+            warnings.simplefilter("always")
+            sim.integrate(1)
+            self.assertEqual(1,len(w))
+        self.assertEqual(sim.ri_whfast.testparticle_partitions, 0)
 
 def create_whfast_testparticle(coordinates, N, N_active):
     def do_test(self):
@@ -150,6 +163,52 @@ def create_whfast_massivetestparticle(coordinates, N):
     return do_test
 
 
+def create_whfast_testparticle_batch(coordinates):
+    def do_test(self):
+        # More test particles than fit in one batch of the Kepler solver, 
+        # including eccentric and hyperbolic orbits.
+        sim = rebound.Simulation()
+        sim.ri_whfast.coordinates = coordinates
+        sim.integrator = "whfast"
+        sim.dt=1e-2
+        sim.add(m=1)
+        for i in range(17):
+            sim.add(m=0,P=1,e=0.05*i,f=i)
+        for i in range(3):
+            sim.add(m=0,a=-1-i,e=1.2+i,f=0.1*i)
+        e0 = [sim.particles[i].e for i in range(1,sim.N)]
+        a0 = [sim.particles[i].a for i in range(1,sim.N)]
+        sim.integrate(1)
+        for i in range(1,sim.N):
+            self.assertLess(abs((sim.particles[i].a-a0[i-1])/a0[i-1]),1e-12)
+            self.assertLess(abs(sim.particles[i].e-e0[i-1]),1e-12)
+    return do_test
+
+def create_whfast_testparticle_partitions(coordinates, safe_mode):
+    def do_test(self):
+        sim = rebound.Simulation()
+        sim.integrator = "whfast"
+        sim.ri_whfast.coordinates = coordinates
+        sim.ri_whfast.safe_mode = safe_mode
+        sim.dt=1e-2
+        sim.add(m=1)
+        sim.add(m=1e-3,P=0.4)
+        sim.add(m=1e-3,P=0.7,e=0.1)
+        sim.N_active = 3
+        for i in range(29):
+            sim.add(m=0,P=1+0.05*i,e=0.01*i,f=i)
+        sim2 = sim.copy()
+        sim2.ri_whfast.testparticle_partitions = 3
+        sim.integrate(3)
+        sim2.integrate(3)
+        sim.integrator_synchronize()
+        sim2.integrator_synchronize()
+        self.assertEqual(sim2.ri_whfast.testparticle_partitions, 3)
+        for i in range(sim.N):
+            self.assertEqual(sim.particles[i].x, sim2.particles[i].x)
+            self.assertEqual(sim.particles[i].vy, sim2.particles[i].vy)
+    return do_test
+
 for N in [1,2]: 
     for coordinates in coordinatelist:
         for N_active in [-1]+list(range(1,N+2)):
@@ -165,7 +224,16 @@ for N in [1,2]:
         test_method.__name__ = "test_whfast_massivetestparticle_N%d_"%(N)+coordinates
         setattr(TestIntegratorWHFastTestParticle, test_method.__name__, test_method)
 
+for coordinates in ["democraticheliocentric","whds"]:
+    for safe_mode in [0,1]:
+        test_method = create_whfast_testparticle_partitions(coordinates, safe_mode)
+        test_method.__name__ = "test_whfast_testparticle_partitions_safemode%d_"%(safe_mode)+coordinates
+        setattr(TestIntegratorWHFastTestParticle, test_method.__name__, test_method)
+
 for coordinates in coordinatelist:
+    test_method = create_whfast_testparticle_batch(coordinates)
+    test_method.__name__ = "test_whfast_testparticle_batch_"+coordinates
+    setattr(TestIntegratorWHFastTestParticle, test_method.__name__, test_method)
     for N_active in [-1,1]:
         test_method = create_whfast_testparticletype1(coordinates, N_active)
         test_method.__name__ = "test_whfast_testparticletype1_Nactive%d_"%(N_active)+coordinates
@@ -1,4 +1,5 @@
-from ctypes import c_uint32, c_uint, c_ulong, c_char_p, c_double, byref
+from ctypes import c_uint32, c_uint, c_int, c_int32, c_ulong, c_uint64, c_char_p, c_double, byref, Structure, sizeof
+from array import array
 from . import clibrebound
 import sys
 import rebound
@@ -58,6 +59,30 @@ def M_to_E(e, M):
     clibrebound.reb_tools_M_to_E.restype = c_double
     return clibrebound.reb_tools_M_to_E(c_double(e), c_double(M))
 
+def _kepler_batch(func, e, M):
+    import numpy as np
+    from ctypes import POINTER
+    e, M = [np.ascontiguousarray(x, dtype=np.float64) for x in np.broadcast_arrays(e, M)]
+    out = np.empty(M.shape)
+    ptr = lambda x: x.ctypes.data_as(POINTER(c_double))
+    func(c_int(M.size), ptr(e), ptr(M), ptr(out))
+    return out
+
+def M_to_E_array(e, M):
+    """
+    Calculates the eccentric anomalies for numpy arrays of eccentricities and mean anomalies. 
+    The arrays are broadcast against each other. All equations are solved with one
+    call to the C library, which is much faster than calling M_to_E() repeatedly.
+    """
+    return _kepler_batch(clibrebound.reb_tools_M_to_E_batch, e, M)
+
+def M_to_f_array(e, M):
+    """
+    Calculates the true anomalies for numpy arrays of eccentricities and mean anomalies. 
+    See M_to_E_array().
+    """
+    return _kepler_batch(clibrebound.reb_tools_M_to_f_batch, e, M)
+
 def spherical_to_xyz(magnitude=1., theta=0., phi=0.):
     """Initialize Cartesian vector from its magnitude and two spherical angles theta (polar angle measured from z) and phi (azimuthal angle measured from x)
 
@@ -96,3 +121,178 @@ def xyz_to_spherical(vector):
     clibrebound.reb_tools_xyz_to_spherical(rebound.Vec3d(vector)._vec3d, byref(magnitude), byref(theta), byref(phi))
     return magnitude.value, theta.value, phi.value
 
+
+# Columns of reb_output_columns() in the order of enum REB_OUTPUT_COLUMN
+OUTPUT_COLUMNS = ["hash", "x", "y", "z", "vx", "vy", "vz", "m", "r", "a", "e", "inc", "Omega", "omega", "l", "f"]
+OUTPUT_COLUMNS_MAGIC = 0x4C4F4352
+
+class OutputColumnsHeader(Structure):
+    _fields_ = [("magic", c_uint32),
+                ("columns", c_uint32),
+                ("N", c_uint64),
+                ("t", c_double)]
+
+def output_columns_mask(columns):
+    """
+    Converts a list of column names (see OUTPUT_COLUMNS) to the bitmask used by reb_output_columns().
+    """
+    mask = 0
+    for c in columns:
+        if c not in OUTPUT_COLUMNS:
+            raise ValueError("Unknown column '%s'. Available columns: %s" % (c, ", ".join(OUTPUT_COLUMNS)))
+        mask |= 1<<OUTPUT_COLUMNS.index(c)
+    return mask
+
+def read_columns(filename, columns=None):
+    """
+    Reads a file written by Simulation.output_columns().
+
+    Arguments
+    ---------
+    filename : str
+        Filename of the binary file.
+    columns : list of str, optional
+        Names of the columns to read. By default all columns in the file are read.
+        Columns which are not needed are skipped without reading them from disk.
+
+    Returns
+    -------
+    A list with one dictionary per output. Each dictionary contains the time "t" and
+    one array (from the array module) per column.
+
+    Examples
+    --------
+    >>> sim.output_columns("columns.bin", ["hash", "a", "e"])
+    >>> outputs = rebound.read_columns("columns.bin", ["e"])
+    >>> print(outputs[-1]["t"], max(outputs[-1]["e"]))
+    """
+    if columns is not None:
+        output_columns_mask(columns) # validate names
+    outputs = []
+    with open(filename, "rb") as f:
+        while True:
+            buf = f.read(sizeof(OutputColumnsHeader))
+            if len(buf) < sizeof(OutputColumnsHeader):
+                break
+            header = OutputColumnsHeader.from_buffer_copy(buf)
+            if header.magic != OUTPUT_COLUMNS_MAGIC:
+                raise ValueError("File '%s' is corrupt or not written by output_columns()." % filename)
+            output = {"t": header.t}
+            for i, name in enumerate(OUTPUT_COLUMNS):
+                if not header.columns & (1<<i):
+                    continue
+                values = array("I" if name == "hash" else "d")
+                size = header.N*values.itemsize
+                if columns is None or name in columns:
+                    values.frombytes(f.read(size))
+                    if len(values) != header.N:
+                        raise ValueError("File '%s' is truncated." % filename)
+                    output[name] = values
+                else:
+                    f.seek(size, 1)
+            outputs.append(output)
+    return outputs
+
+
+COLLISION_LOG_MAGIC = 0x474C4352
+
+class CollisionLogHeader(Structure):
+    _fields_ = [("magic", c_uint32),
+                ("size", c_uint32),
+                ("reserved", c_uint64)]
+
+class CollisionEvent(Structure):
+    _fields_ = [("t", c_double),
+                ("hash1", c_uint32),
+                ("hash2", c_uint32),
+                ("x", c_double),
+                ("y", c_double),
+                ("z", c_double),
+                ("vx", c_double),
+                ("vy", c_double),
+                ("vz", c_double),
+                ("outcome", c_int32),
+                ("reserved", c_uint32)]
+
+def read_collision_log(filename):
+    """
+    Reads a file written by Simulation.collision_log_open().
+
+    Returns
+    -------
+    A NumPy structured array with one entry per collision and the fields "t", 
+    "hash1", "hash2", "x", "y", "z", "vx", "vy", "vz" (position and velocity of 
+    the second particle relative to the first one before the collision was 
+    resolved), and "outcome" (return value of the resolve function).
+
+    Examples
+    --------
+    >>> sim.collision_resolve = "merge"
+    >>> sim.collision_log_open("collisions.bin")
+    >>> sim.integrate(100.)
+    >>> sim.collision_log_close()
+    >>> log = rebound.read_collision_log("collisions.bin")
+    >>> print(len(log), log["t"][-1])
+    """
+    import numpy as np
+    with open(filename, "rb") as f:
+        buf = f.read(sizeof(CollisionLogHeader))
+        if len(buf) < sizeof(CollisionLogHeader):
+            raise ValueError("File '%s' is truncated." % filename)
+        header = CollisionLogHeader.from_buffer_copy(buf)
+        if header.magic != COLLISION_LOG_MAGIC or header.size != sizeof(CollisionEvent):
+            raise ValueError("File '%s' is corrupt or not written by collision_log_open()." % filename)
+        return np.fromfile(f, dtype=np.dtype(CollisionEvent))
+
+
+# Formats of reb_output_positions_quantized() in the order of enum REB_OUTPUT_QUANTIZED
+OUTPUT_QUANTIZED_FORMATS = ["float32", "uint16"]
+OUTPUT_QUANTIZED_MAGIC = 0x5A514252
+
+class OutputQuantizedHeader(Structure):
+    _fields_ = [("magic", c_uint32),
+                ("format", c_uint32),
+                ("N", c_uint64),
+                ("hashes", c_uint32),
+                ("stride", c_uint32),
+                ("t", c_double),
+                ("min", c_double*3),
+                ("max", c_double*3)]
+
+def read_positions_quantized(filename):
+    """
+    Reads a file written by Simulation.output_positions_quantized().
+
+    Returns
+    -------
+    A list with one dictionary per frame. Each dictionary contains the time "t", 
+    the "stride", and arrays (from the array module) "x", "y", "z" with the 
+    positions converted back to double precision. If hashes were written, the 
+    dictionary also contains the array "hash".
+    """
+    frames = []
+    with open(filename, "rb") as f:
+        while True:
+            buf = f.read(sizeof(OutputQuantizedHeader))
+            if len(buf) < sizeof(OutputQuantizedHeader):
+                break
+            header = OutputQuantizedHeader.from_buffer_copy(buf)
+            if header.magic != OUTPUT_QUANTIZED_MAGIC or header.format >= len(OUTPUT_QUANTIZED_FORMATS):
+                raise ValueError("File '%s' is corrupt or not written by output_positions_quantized()." % filename)
+            frame = {"t": header.t, "stride": header.stride}
+            if header.hashes:
+                hashes = array("I")
+                hashes.frombytes(f.read(hashes.itemsize*header.N))
+                frame["hash"] = hashes
+            values = array("H" if OUTPUT_QUANTIZED_FORMATS[header.format] == "uint16" else "f")
+            values.frombytes(f.read(values.itemsize*3*header.N))
+            if len(values) != 3*header.N:
+                raise ValueError("File '%s' is truncated." % filename)
+            for k, name in enumerate(["x", "y", "z"]):
+                if OUTPUT_QUANTIZED_FORMATS[header.format] == "uint16":
+                    scale = (header.max[k]-header.min[k])/65535.
+                    frame[name] = array("d", [header.min[k]+q*scale for q in values[k::3]])
+                else:
+                    frame[name] = array("d", values[k::3])
+            frames.append(frame)
+    return frames
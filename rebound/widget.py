@@ -539,10 +539,11 @@ class Widget(DOMWidget):
         sim = simp.contents
         size_changed = clibrebound.reb_display_copy_data(simp)
         clibrebound.reb_display_prepare_data(simp,c_int(self.orbits))
-        if sim.N>0:
-            self.particle_data = (c_char * (4*7*sim.N)).from_address(sim.display_data.contents.particle_data).raw
+        N_shown = sim.display_data.contents.r_copy.contents.N # Fewer than N if display_stride>1
+        if N_shown>0:
+            self.particle_data = (c_char * (4*7*N_shown)).from_address(sim.display_data.contents.particle_data).raw
             if self.orbits:
-                self.orbit_data = (c_char * (4*9*(sim.N-1))).from_address(sim.display_data.contents.orbit_data).raw
+                self.orbit_data = (c_char * (4*9*(N_shown-1))).from_address(sim.display_data.contents.orbit_data).raw
         if size_changed:
             #TODO: Implement better GPU size change
             pass
@@ -552,7 +553,7 @@ class Widget(DOMWidget):
             self.overlay = ""
         else:
             self.overlay = self.useroverlay + ", N=%d, t=%g"%(sim.N,sim.t)
-        self.N = sim.N
+        self.N = N_shown
         self.t = sim.t
         self.count += 1
 
@@ -25,6 +25,8 @@ if sys.platform == 'darwin':
     vars = sysconfig.get_config_vars()
     vars['LDSHARED'] = vars['LDSHARED'].replace('-bundle', '-shared')
     extra_link_args=['-Wl,-install_name,@rpath/librebound'+suffix]
+if sys.platform.startswith('linux'):
+    extra_link_args=['-pthread'] # asynchronous SimulationArchive writer
     
 libreboundmodule = Extension('librebound',
                     sources = [ 'src/rebound.c',
@@ -39,8 +41,14 @@ libreboundmodule = Extension('librebound',
                                 'src/integrator_janus.c',
                                 'src/integrator_sei.c',
                                 'src/integrator_tes.c',
+                                'src/integrator_block.c',
                                 'src/integrator.c',
                                 'src/gravity.c',
+                                'src/autotune.c',
+                                'src/profiling.c',
+                                'src/memory.c',
+                                'src/ephemeris.c',
+                                'src/compact.c',
                                 'src/boundary.c',
                                 'src/display.c',
                                 'src/collision.c',
@@ -58,9 +66,9 @@ libreboundmodule = Extension('librebound',
                     include_dirs = ['src'],
                     define_macros=[ ('LIBREBOUND', None) ],
                     # Uncomment the following line for the non-AVX512 version of REBOUND
-                    extra_compile_args=['-fstrict-aliasing', '-O3','-std=c99','-Wno-unknown-pragmas', ghash_arg, '-DLIBREBOUND', '-D_GNU_SOURCE', '-fPIC'],
+                    extra_compile_args=['-fstrict-aliasing', '-O3','-std=c99','-Wno-unknown-pragmas', ghash_arg, '-DLIBREBOUND', '-D_GNU_SOURCE', '-fPIC', '-fopenmp-simd'],
                     # Uncomment the following line to enable AVX512 
-                    # extra_compile_args=['-fstrict-aliasing', '-O3','-std=c99','-Wno-unknown-pragmas', ghash_arg, '-DLIBREBOUND', '-D_GNU_SOURCE', '-fPIC', '-march=native', '-DAVX512'],
+                    # extra_compile_args=['-fstrict-aliasing', '-O3','-std=c99','-Wno-unknown-pragmas', ghash_arg, '-DLIBREBOUND', '-D_GNU_SOURCE', '-fPIC', '-fopenmp-simd', '-march=native', '-DAVX512'],
                     extra_link_args=extra_link_args,
                     )
 
@@ -0,0 +1,240 @@
+/**
+ * @file 	autotune.c
+ * @brief 	Automatic selection of the gravity and collision routines.
+ * @author 	Hanno Rein <hanno@hanno-rein.de>
+ *
+ * @details 	If the gravity routine is set to REB_GRAVITY_AUTO or the
+ * collision routine to REB_COLLISION_AUTO or REB_COLLISION_LINEAUTO, every
+ * routine which gives the same physics for the current simulation setup is
+ * used for a few timesteps. The walltime of these timesteps is measured and
+ * the routine with the shortest walltime is used afterwards. The gravity
+ * routine is selected first, then the collision routine. The selection is
+ * repeated when the number of particles or the number of threads changes.
+ *
+ * @section LICENSE
+ * Copyright (c) 2023 Hanno Rein
+ *
+ * This file is part of rebound.
+ *
+ * rebound is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rebound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rebound.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "rebound.h"
+#include "autotune.h"
+#include "tree.h"
+#include "boundary.h"
+#ifdef OPENMP
+#include <omp.h>
+#endif // OPENMP
+
+#define REB_AUTOTUNE_STEPS 4        ///< Number of timed steps for every candidate. One more step is done before to set up the tree and buffers.
+#define REB_AUTOTUNE_N_CHANGE 0.25  ///< Relative change in the number of particles after which the candidates are timed again.
+
+/**
+ * @brief Finds the gravity routines which can be used for the current setup.
+ * @details Tree-based routines need a box. The multipole moments of the tree are only
+ * updated once per timestep, so they are only considered for integrators which
+ * calculate the forces once per timestep. REB_GRAVITY_COMPENSATED is never faster
+ * than REB_GRAVITY_BASIC and therefore not considered.
+ * @return Number of candidates
+ */
+static int reb_autotune_gravity_candidates(const struct reb_simulation* const r, int* const candidates){
+    int N = 0;
+#ifdef MPI
+    // Particles are distributed with the tree.
+    candidates[N++] = REB_GRAVITY_TREE;
+#else // MPI
+    candidates[N++] = REB_GRAVITY_BASIC;
+    if (r->root_size!=-1 && r->boundary!=REB_BOUNDARY_NONE && r->N_var==0 && (r->integrator==REB_INTEGRATOR_LEAPFROG || r->integrator==REB_INTEGRATOR_SEI)){
+        candidates[N++] = REB_GRAVITY_TREE;
+        candidates[N++] = REB_GRAVITY_FMM;
+    }
+#endif // MPI
+    return N;
+}
+
+/**
+ * @brief Finds the collision routines which can be used for the current setup.
+ * @details REB_COLLISION_AUTO only considers routines which check for instantaneous
+ * overlaps, REB_COLLISION_LINEAUTO only routines which assume a linear path over the
+ * last timestep. Tree-based routines need a box. MERCURIUS only works with REB_COLLISION_DIRECT.
+ * @return Number of candidates
+ */
+static int reb_autotune_collision_candidates(const struct reb_simulation* const r, const int mode, int* const candidates){
+    const int line = mode==REB_COLLISION_LINEAUTO;
+    int N = 0;
+#ifdef MPI
+    // Particles are distributed with the tree.
+    candidates[N++] = line?REB_COLLISION_LINETREE:REB_COLLISION_TREE;
+#else // MPI
+    if (r->integrator==REB_INTEGRATOR_MERCURIUS){
+        candidates[N++] = REB_COLLISION_DIRECT;
+        return N;
+    }
+    candidates[N++] = line?REB_COLLISION_LINE:REB_COLLISION_DIRECT;
+    candidates[N++] = line?REB_COLLISION_LINESAP:REB_COLLISION_SAP;
+    candidates[N++] = line?REB_COLLISION_LINEBVH:REB_COLLISION_BVH;
+    if (!line){
+        candidates[N++] = REB_COLLISION_GRID;
+        candidates[N++] = REB_COLLISION_NEIGHBOURLIST;
+    }
+    if (r->root_size!=-1 && r->boundary!=REB_BOUNDARY_NONE){
+        candidates[N++] = line?REB_COLLISION_LINETREE:REB_COLLISION_TREE;
+    }
+#endif // MPI
+    return N;
+}
+
+static int reb_autotune_threads(){
+#ifdef OPENMP
+    return omp_get_max_threads();
+#else // OPENMP
+    return 1;
+#endif // OPENMP
+}
+
+static void reb_autotune_start(struct reb_simulation* const r, struct reb_autotune* const at, const int candidates_N){
+    at->candidates_N = candidates_N;
+    at->current = candidates_N>1?0:candidates_N; // Nothing to time if there is only one candidate.
+    at->steps = 0;
+    for (int k=0;k<candidates_N;k++){
+        at->time[k] = 0.;
+    }
+    at->selected = at->candidates[0];
+    at->N = r->N;
+    at->threads = reb_autotune_threads();
+}
+
+static int reb_autotune_needs_restart(const struct reb_simulation* const r, const struct reb_autotune* const at){
+    return at->N<0 || fabs((double)(r->N - at->N)) > REB_AUTOTUNE_N_CHANGE*at->N || at->threads!=reb_autotune_threads();
+}
+
+static int reb_autotune_uses_tree(const struct reb_simulation* const r){
+    return r->gravity==REB_GRAVITY_TREE || r->gravity==REB_GRAVITY_FMM || r->collision==REB_COLLISION_TREE || r->collision==REB_COLLISION_LINETREE;
+}
+
+/**
+ * @brief Sets the gravity and collision routines to the ones selected automatically.
+ * @details If a tree exists or is needed, it is built from scratch because
+ * which particles are in the tree depends on the routines (see reb_tree_active_only()).
+ * The routines are converted to int once because the fields of reb_autotune are int
+ * while the enums of r->gravity and r->collision are unsigned.
+ */
+static void reb_autotune_set(struct reb_simulation* const r){
+    const int gravity_old = r->gravity;
+    const int collision_old = r->collision;
+    const int gravity = r->gravity_autotune.mode?r->gravity_autotune.selected:gravity_old;
+    const int collision = r->collision_autotune.mode?r->collision_autotune.selected:collision_old;
+    if (gravity==gravity_old && collision==collision_old){
+        return;
+    }
+    r->gravity = gravity;
+    r->collision = collision;
+    if (r->tree_root==NULL && !reb_autotune_uses_tree(r)){
+        return;
+    }
+    reb_tree_delete(r);
+    for (int i=0;i<r->N;i++){
+        r->particles[i].c = NULL;
+    }
+    if (reb_autotune_uses_tree(r) && !reb_tree_active_only(r)){
+        reb_boundary_check(r); // Only particles in the box can be added.
+        for (int i=0;i<r->N;i++){
+            reb_tree_add_particle_to_tree(r, i);
+        }
+    }
+}
+
+// Turns the automatic selection off if the routine was changed by the user or by an integrator.
+static void reb_autotune_check_override(struct reb_simulation* const r){
+    const int gravity = r->gravity;
+    const int collision = r->collision;
+    if (r->gravity_autotune.mode && gravity!=r->gravity_autotune.selected){
+        r->gravity_autotune.mode = 0;
+    }
+    if (r->collision_autotune.mode && collision!=r->collision_autotune.selected){
+        r->collision_autotune.mode = 0;
+    }
+}
+
+void reb_autotune_select(struct reb_simulation* const r){
+    struct reb_autotune* const ag = &r->gravity_autotune;
+    struct reb_autotune* const ac = &r->collision_autotune;
+    if (r->gravity==REB_GRAVITY_AUTO){
+        ag->mode = REB_GRAVITY_AUTO;
+        ag->selected = REB_GRAVITY_AUTO;
+        ag->N = -1;
+    }
+    if (r->collision==REB_COLLISION_AUTO || r->collision==REB_COLLISION_LINEAUTO){
+        ac->mode = r->collision;
+        ac->selected = r->collision;
+        ac->N = -1;
+    }
+    reb_autotune_check_override(r);
+    if (!ag->mode && !ac->mode){
+        return;
+    }
+    if (ag->mode && reb_autotune_needs_restart(r, ag)){
+        reb_autotune_start(r, ag, reb_autotune_gravity_candidates(r, ag->candidates));
+    }
+    if (ac->mode && reb_autotune_needs_restart(r, ac)){
+        reb_autotune_start(r, ac, reb_autotune_collision_candidates(r, ac->mode, ac->candidates));
+    }
+    reb_autotune_set(r);
+}
+
+// Adds the walltime of a step to the current candidate and moves on to the next candidate if needed.
+static void reb_autotune_record(struct reb_autotune* const at, const double walltime){
+    at->steps++;
+    if (at->steps==1){
+        return; // First step with a new candidate is not timed.
+    }
+    at->time[at->current] += walltime;
+    if (at->steps<=REB_AUTOTUNE_STEPS){
+        return;
+    }
+    at->steps = 0;
+    at->current++;
+    if (at->current<at->candidates_N){
+        at->selected = at->candidates[at->current];
+        return;
+    }
+    int best = 0;
+    for (int k=1;k<at->candidates_N;k++){
+        if (at->time[k]<at->time[best]){
+            best = k;
+        }
+    }
+    at->selected = at->candidates[best];
+}
+
+void reb_autotune_update(struct reb_simulation* const r, const double walltime){
+    struct reb_autotune* const ag = &r->gravity_autotune;
+    struct reb_autotune* const ac = &r->collision_autotune;
+    reb_autotune_check_override(r);
+    if (!ag->mode && !ac->mode){
+        return;
+    }
+    // Collision routines are only timed once the gravity routine has been selected.
+    if (ag->mode && ag->current<ag->candidates_N){
+        reb_autotune_record(ag, walltime);
+    }else if (ac->mode && ac->current<ac->candidates_N){
+        reb_autotune_record(ac, walltime);
+    }
+    reb_autotune_set(r);
+}
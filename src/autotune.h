@@ -0,0 +1,46 @@
+/**
+ * @file 	autotune.h
+ * @brief 	Automatic selection of the gravity and collision routines.
+ * @author 	Hanno Rein <hanno@hanno-rein.de>
+ *
+ * @section LICENSE
+ * Copyright (c) 2023 Hanno Rein
+ *
+ * This file is part of rebound.
+ *
+ * rebound is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rebound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rebound.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef _AUTOTUNE_H
+#define _AUTOTUNE_H
+
+/**
+ * @brief Sets the gravity and collision routines for the next timestep.
+ * @details Starts timing the candidates if REB_GRAVITY_AUTO, REB_COLLISION_AUTO or
+ * REB_COLLISION_LINEAUTO has been set, or if the number of particles or threads
+ * changed substantially since the last selection. Called at the beginning of every timestep.
+ * @param r REBOUND Simulation to consider
+ */
+void reb_autotune_select(struct reb_simulation* const r);
+
+/**
+ * @brief Records the walltime of the last timestep for the candidate currently being timed.
+ * @details Moves on to the next candidate after a few timesteps. Once all candidates
+ * have been timed, the fastest one is used. Called at the end of every timestep.
+ * @param r REBOUND Simulation to consider
+ * @param walltime Walltime in seconds of the last timestep
+ */
+void reb_autotune_update(struct reb_simulation* const r, const double walltime);
+
+#endif
@@ -28,6 +28,7 @@
 #include <math.h>
 #include <time.h>
 #include <string.h>
+#include <stdint.h>
 #include <sys/time.h>
 #include "particle.h"
 #include "rebound.h"
@@ -51,15 +52,243 @@ static inline int reb_binary_diff_particle(struct reb_particle p1, struct reb_pa
     differ = differ || (p1.r != p2.r);
     differ = differ || (p1.lastcollision != p2.lastcollision);
     differ = differ || (p1.hash != p2.hash);
+    differ = differ || (p1.frozen != p2.frozen);
     return differ;
 }
 
+// Size of the header in a REB_BINARY_FIELD_TYPE_PARTICLES_XOR field. It stores the decoded size.
+#define REB_BINARY_XOR_HEADER sizeof(uint64_t)
+
+size_t reb_binary_xor_encode(const char* base, const char* data, size_t size, char** out){
+    if (size==0 || size%8) return 0;
+    const size_t words = size/8;
+    // XOR against base and group bytes by their position within each 8 byte word.
+    // Bytes in the same plane (sign/exponent, high mantissa, ...) are likely to be zero together.
+    unsigned char* planes = malloc(size);
+    for (size_t w=0; w<words; w++){
+        for (int b=0; b<8; b++){
+            planes[b*words+w] = base[8*w+b] ^ data[8*w+b];
+        }
+    }
+    // Worst case: one token per 128 literal bytes.
+    size_t allocated = REB_BINARY_XOR_HEADER + size + size/128 + 1;
+    unsigned char* enc = malloc(allocated);
+    uint64_t size64 = size;
+    memcpy(enc, &size64, REB_BINARY_XOR_HEADER);
+    size_t n = REB_BINARY_XOR_HEADER;
+    size_t i = 0;
+    while (i<size){
+        size_t j = i;
+        while (j<size && j-i<128 && planes[j]==0) j++;
+        if (j-i>=2){
+            // Zero run: high bit set, lower bits store length-1.
+            enc[n++] = 0x80 | (unsigned char)(j-i-1);
+            i = j;
+            continue;
+        }
+        // Literal run up to the next run of at least two zeros.
+        j = i;
+        while (j<size && j-i<128 && !(planes[j]==0 && j+1<size && planes[j+1]==0)) j++;
+        enc[n++] = (unsigned char)(j-i-1);
+        memcpy(enc+n, planes+i, j-i);
+        n += j-i;
+        i = j;
+    }
+    free(planes);
+    if (n>=size){
+        // Not worth it.
+        free(enc);
+        return 0;
+    }
+    *out = (char*)enc;
+    return n;
+}
+
+int reb_binary_xor_decode(const char* in, size_t insize, char* data, size_t size){
+    if (insize<REB_BINARY_XOR_HEADER) return 0;
+    uint64_t size64;
+    memcpy(&size64, in, REB_BINARY_XOR_HEADER);
+    if (size64!=size || size%8) return 0;
+    const size_t words = size/8;
+    unsigned char* planes = malloc(size);
+    size_t n = REB_BINARY_XOR_HEADER;
+    size_t i = 0;
+    while (i<size && n<insize){
+        unsigned char tag = in[n++];
+        size_t len = (tag&0x7f)+1;
+        if (i+len>size) break;
+        if (tag&0x80){
+            memset(planes+i, 0, len);
+        }else{
+            if (n+len>insize) break;
+            memcpy(planes+i, in+n, len);
+            n += len;
+        }
+        i += len;
+    }
+    if (i!=size || n!=insize){
+        free(planes);
+        return 0;
+    }
+    for (size_t w=0; w<words; w++){
+        for (int b=0; b<8; b++){
+            data[8*w+b] ^= planes[b*words+w];
+        }
+    }
+    free(planes);
+    return 1;
+}
+
 // Wrapper for backwards compatibility
 void reb_binary_diff(char* buf1, size_t size1, char* buf2, size_t size2, char** bufp, size_t* sizep){
     // Ignores return value
     reb_binary_diff_with_options(buf1, size1, buf2, size2, bufp, sizep, 0);
 }
 
+// Location of one field in a binary buffer.
+struct reb_binary_field_index {
+    uint32_t type;
+    uint64_t size;
+    size_t pos;     // Position of the data (just past the field header).
+};
+
+static int reb_binary_field_index_compare(const void* a, const void* b){
+    const struct reb_binary_field_index* fa = a;
+    const struct reb_binary_field_index* fb = b;
+    if (fa->type != fb->type) return fa->type < fb->type ? -1 : 1;
+    // Keep first occurrence first if a type appears more than once.
+    if (fa->pos != fb->pos) return fa->pos < fb->pos ? -1 : 1;
+    return 0;
+}
+
+// Walks the buffer once and lists all fields in the order they appear. 
+// A copy sorted by type is returned in *sorted for fast lookups.
+static size_t reb_binary_field_index_create(const char* buf, size_t size, const char* name, struct reb_binary_field_index** index, struct reb_binary_field_index** sorted){
+    size_t N = 0;
+    size_t allocatedN = 0;
+    *index = NULL;
+    size_t pos = 64;
+    while(pos+sizeof(struct reb_binary_field)<=size){
+        struct reb_binary_field field;
+        memcpy(&field, buf+pos, sizeof(struct reb_binary_field));
+        pos += sizeof(struct reb_binary_field);
+        if (field.type==REB_BINARY_FIELD_TYPE_END){
+            break;
+        }
+        if (field.size>size-pos){
+            printf("Corrupt binary file %s.\n", name);
+            break;
+        }
+        if (N>=allocatedN){
+            allocatedN = allocatedN ? allocatedN*2 : 128;
+            *index = realloc(*index, sizeof(struct reb_binary_field_index)*allocatedN);
+        }
+        (*index)[N].type = field.type;
+        (*index)[N].size = field.size;
+        (*index)[N].pos = pos;
+        N++;
+        pos += field.size;
+    }
+    *sorted = malloc(sizeof(struct reb_binary_field_index)*(N?N:1));
+    if (N){
+        memcpy(*sorted, *index, sizeof(struct reb_binary_field_index)*N);
+        qsort(*sorted, N, sizeof(struct reb_binary_field_index), reb_binary_field_index_compare);
+    }
+    return N;
+}
+
+// Returns the first field of the given type or NULL.
+static const struct reb_binary_field_index* reb_binary_field_index_find(const struct reb_binary_field_index* sorted, size_t N, uint32_t type){
+    size_t lo = 0;
+    size_t hi = N;
+    while (lo<hi){
+        size_t mid = lo+(hi-lo)/2;
+        if (sorted[mid].type<type){
+            lo = mid+1;
+        }else{
+            hi = mid;
+        }
+    }
+    if (lo<N && sorted[lo].type==type){
+        return &sorted[lo];
+    }
+    return NULL;
+}
+
+// Particle identified by hash. Particles without hashes are matched by index.
+struct reb_binary_diff_key {
+    uint32_t hash;
+    size_t i;
+};
+
+static int reb_binary_diff_key_compare(const void* a, const void* b){
+    const struct reb_binary_diff_key* ka = a;
+    const struct reb_binary_diff_key* kb = b;
+    if (ka->hash != kb->hash) return ka->hash < kb->hash ? -1 : 1;
+    if (ka->i != kb->i) return ka->i < kb->i ? -1 : 1;
+    return 0;
+}
+
+static struct reb_binary_diff_key* reb_binary_diff_keys(const struct reb_particle* p, size_t N){
+    struct reb_binary_diff_key* keys = malloc(sizeof(struct reb_binary_diff_key)*(N?N:1));
+    for (size_t i=0;i<N;i++){
+        keys[i].hash = p[i].hash;
+        keys[i].i = i;
+    }
+    qsort(keys, N, sizeof(struct reb_binary_diff_key), reb_binary_diff_key_compare);
+    return keys;
+}
+
+// Compares two particle arrays. If the particles are not identical, they
+// are matched by hash so that reordered, added, and removed particles can 
+// be reported. Returns 1 if the arrays differ.
+static int reb_binary_diff_particles(const char* buf1, uint64_t size1, const char* buf2, uint64_t size2, int output_option){
+    if (size1==size2 && memcmp(buf1, buf2, size1)==0){
+        return 0; // Fast path: bitwise identical.
+    }
+    const struct reb_particle* p1 = (const struct reb_particle*)buf1;
+    const struct reb_particle* p2 = (const struct reb_particle*)buf2;
+    const size_t N1 = size1/sizeof(struct reb_particle);
+    const size_t N2 = size2/sizeof(struct reb_particle);
+    if (size1==size2){
+        // Might only differ in padding.
+        int differ = 0;
+        for (size_t i=0;i<N1 && !differ;i++){
+            differ |= reb_binary_diff_particle(p1[i],p2[i]);
+        }
+        if (!differ){
+            return 0;
+        }
+    }
+    if (output_option!=1){
+        return 1;
+    }
+    struct reb_binary_diff_key* k1 = reb_binary_diff_keys(p1, N1);
+    struct reb_binary_diff_key* k2 = reb_binary_diff_keys(p2, N2);
+    size_t i1 = 0;
+    size_t i2 = 0;
+    size_t N_differ = 0;
+    size_t N_only1 = 0;
+    size_t N_only2 = 0;
+    while (i1<N1 || i2<N2){
+        if (i2>=N2 || (i1<N1 && k1[i1].hash<k2[i2].hash)){
+            N_only1++;
+            i1++;
+        }else if (i1>=N1 || k2[i2].hash<k1[i1].hash){
+            N_only2++;
+            i2++;
+        }else{
+            N_differ += reb_binary_diff_particle(p1[k1[i1].i],p2[k2[i2].i]);
+            i1++;
+            i2++;
+        }
+    }
+    printf("Particles: %zu differ, %zu not in simulation 2, %zu not in simulation 1.\n", N_differ, N_only1, N_only2);
+    free(k1);
+    free(k2);
+    return 1;
+}
+
 int reb_binary_diff_with_options(char* buf1, size_t size1, char* buf2, size_t size2, char** bufp, size_t* sizep, int output_option){
     if (!buf1 || !buf2 || size1<64 || size2<64){
         printf("Cannot read input buffers.\n");
@@ -68,7 +297,7 @@ int reb_binary_diff_with_options(char* buf1, size_t size1, char* buf2, size_t si
 
     int are_different = 0;
     
-    if (output_option==0){
+    if (output_option==0 || output_option==3){
         *bufp = NULL;
         *sizep = 0;
     }
@@ -79,170 +308,102 @@ int reb_binary_diff_with_options(char* buf1, size_t size1, char* buf2, size_t si
         printf("Header in binary files are different.\n");
     }
 
-    size_t pos1 = 64;
-    size_t pos2 = 64;
+    // Fields might not be in the same order. Index both buffers once 
+    // instead of searching for every field.
+    struct reb_binary_field_index* index1;
+    struct reb_binary_field_index* index2;
+    struct reb_binary_field_index* sorted1;
+    struct reb_binary_field_index* sorted2;
+    const size_t N1 = reb_binary_field_index_create(buf1, size1, "buf1", &index1, &sorted1);
+    const size_t N2 = reb_binary_field_index_create(buf2, size2, "buf2", &index2, &sorted2);
     
-    while(1){
-        if (pos1+sizeof(struct reb_binary_field)>size1) break;
-        struct reb_binary_field field1 = *(struct reb_binary_field*)(buf1+pos1);
-        pos1 += sizeof(struct reb_binary_field);
-        if (field1.type==REB_BINARY_FIELD_TYPE_END){
-            break;
+    for (size_t i=0;i<N1;i++){
+        const struct reb_binary_field_index* f1 = &index1[i];
+        if (i>0 && reb_binary_field_index_find(sorted1, N1, f1->type)->pos!=f1->pos){
+            continue; // Only the first occurrence of a type is compared.
         }
-        if (pos2+sizeof(struct reb_binary_field)>size2) pos2 = 64;
-        struct reb_binary_field field2 = *(struct reb_binary_field*)(buf2+pos2);
-        pos2 += sizeof(struct reb_binary_field);
-        
-        // Fields might not be in the same order.
-        if (field1.type!=field2.type){
-            // Will search for element in buf2, starting at beginning just past header
+        const struct reb_binary_field_index* f2 = reb_binary_field_index_find(sorted2, N2, f1->type);
+        if (f2==NULL){
+            // Output field with size 0
             // Note that we ignore all ADDITIONAL fields in buf2 that were not present in buf1 
-            pos2 = 64;
-            int notfound = 0; 
-            while(1) {
-                if (pos2+sizeof(struct reb_binary_field)>size2){
-                    notfound = 1;
-                    break;
-                }
-                field2 = *(struct reb_binary_field*)(buf2+pos2);
-                pos2 += sizeof(struct reb_binary_field);
-                if(field2.type==REB_BINARY_FIELD_TYPE_END){
-                    notfound = 1;
+            struct reb_binary_field field1 = {.type = f1->type, .size = 0};
+            are_different = 1.;
+            switch(output_option){
+                case 0:
+                case 3:
+                    reb_output_stream_write(bufp, &allocatedsize, sizep, &field1,sizeof(struct reb_binary_field));
                     break;
-                }
-                if (field2.type==field1.type){
-                    break; // found!!
-                }else{
-                    pos2 += field2.size; //skip
-                }
-            };
-            if (notfound == 1){
-                // Output field with size 0
-                pos1 += field1.size; // For next search
-                pos2 = 64; // For next search
-                field1.size = 0;
-                are_different = 1.;
-                switch(output_option){
-                    case 0:
-                        reb_output_stream_write(bufp, &allocatedsize, sizep, &field1,sizeof(struct reb_binary_field));
-                        break;
-                    case 1:
-                        printf("Field %d not in simulation 2.\n",field1.type);
-                        break;
-                    default:
-                        break;
-                }
-                continue;
-            }
-        }
-        // Can assume field1.type == field2.type from here on
-        if (pos1+field1.size>size1) printf("Corrupt binary file buf1.\n");
-        if (pos2+field2.size>size2) printf("Corrupt binary file buf2.\n");
-        int fields_differ = 0;
-        if (field1.size==field2.size){
-            switch (field1.type){
-                case REB_BINARY_FIELD_TYPE_PARTICLES:
-                    {
-                        struct reb_particle* pb1 = (struct reb_particle*)(buf1+pos1);
-                        struct reb_particle* pb2 = (struct reb_particle*)(buf2+pos2);
-                        for (unsigned int i=0;i<field1.size/sizeof(struct reb_particle);i++){
-                            fields_differ |= reb_binary_diff_particle(pb1[i],pb2[i]);
-                        }
-                    }
+                case 1:
+                    printf("Field %d not in simulation 2.\n",f1->type);
                     break;
                 default:
-                    if (memcmp(buf1+pos1,buf2+pos2,field1.size)!=0){
-                        fields_differ = 1;
-                    }
                     break;
             }
-        }else{
+            continue;
+        }
+        int fields_differ = 0;
+        if (f1->type==REB_BINARY_FIELD_TYPE_PARTICLES){
+            fields_differ = reb_binary_diff_particles(buf1+f1->pos, f1->size, buf2+f2->pos, f2->size, output_option);
+        }else if (f1->size!=f2->size || memcmp(buf1+f1->pos,buf2+f2->pos,f1->size)!=0){
             fields_differ = 1;
         }
         if(fields_differ){
-            if (field1.type!=REB_BINARY_FIELD_TYPE_WALLTIME){
+            if (f1->type!=REB_BINARY_FIELD_TYPE_WALLTIME){
                 // Ignore the walltime field for the return value.
                 // Typically we do not care about this field when comparing simulations.
                 are_different = 1.;
             }
+            struct reb_binary_field field2 = {.type = f2->type, .size = f2->size};
             switch(output_option){
+                case 3:
+                    if (f1->type==REB_BINARY_FIELD_TYPE_PARTICLES && f1->size==f2->size){
+                        char* enc = NULL;
+                        size_t encsize = reb_binary_xor_encode(buf1+f1->pos, buf2+f2->pos, f2->size, &enc);
+                        if (encsize){
+                            struct reb_binary_field fieldxor = {.type = REB_BINARY_FIELD_TYPE_PARTICLES_XOR, .size = encsize};
+                            reb_output_stream_write(bufp, &allocatedsize, sizep, &fieldxor,sizeof(struct reb_binary_field));
+                            reb_output_stream_write(bufp, &allocatedsize, sizep, enc, encsize);
+                            free(enc);
+                            break;
+                        }
+                    }
+                    // fall through
                 case 0:
                     reb_output_stream_write(bufp, &allocatedsize, sizep, &field2,sizeof(struct reb_binary_field));
-                    reb_output_stream_write(bufp, &allocatedsize, sizep, buf2+pos2,field2.size);
+                    reb_output_stream_write(bufp, &allocatedsize, sizep, buf2+f2->pos,f2->size);
                     break;
                 case 1:
-                    printf("Field %d differs.\n",field1.type);
+                    printf("Field %d differs.\n",f1->type);
                     break;
                 default:
                     break;
             }
         }
-        pos1 += field1.size;
-        pos2 += field2.size;
     }
     // Search for fields which are present in buf2 but not in buf1
-    pos1 = 64;
-    pos2 = 64;
-    while(1){
-        if (pos2+sizeof(struct reb_binary_field)>size2) break;
-        struct reb_binary_field field2 = *(struct reb_binary_field*)(buf2+pos2);
-        pos2 += sizeof(struct reb_binary_field);
-        if (field2.type==REB_BINARY_FIELD_TYPE_END){
-            break;
+    for (size_t i=0;i<N2;i++){
+        const struct reb_binary_field_index* f2 = &index2[i];
+        if (reb_binary_field_index_find(sorted1, N1, f2->type)){
+            continue; // Not a new field. Skip.
         }
-        if (pos1+sizeof(struct reb_binary_field)>size1) pos1 = 64;
-        struct reb_binary_field field1 = *(struct reb_binary_field*)(buf1+pos1);
-        pos1 += sizeof(struct reb_binary_field);
-        
-        if (field1.type==field2.type){
-            // Not a new field. Skip.
-            pos1 += field1.size;
-            pos2 += field2.size;
-            continue;
-        }
-        // Fields might not be in the same order.
-        // Will search for element in buf1, starting at beginning just past header
-        pos1 = 64;
-        int notfound = 0; 
-        while(1) {
-            if (pos1+sizeof(struct reb_binary_field)>size1){
-                notfound = 1;
-                break;
-            }
-            field1 = *(struct reb_binary_field*)(buf1+pos1);
-            pos1 += sizeof(struct reb_binary_field);
-            if(field1.type==REB_BINARY_FIELD_TYPE_END){
-                notfound = 1;
-                break;
-            }
-            if (field2.type==field1.type){
-                break; // found it, not new
-            }else{
-                // not found, try next
-                pos1 += field1.size;
-            }
-        };
-        if (notfound == 0){
-            // Not a new field. Skip.
-            pos1 = 64;
-            pos2 += field2.size;
-            continue;
-        }
-
         are_different = 1.;
+        struct reb_binary_field field2 = {.type = f2->type, .size = f2->size};
         switch(output_option){
             case 0:
+            case 3:
                 reb_output_stream_write(bufp, &allocatedsize, sizep, &field2,sizeof(struct reb_binary_field));
-                reb_output_stream_write(bufp, &allocatedsize, sizep, buf2+pos2,field2.size);
+                reb_output_stream_write(bufp, &allocatedsize, sizep, buf2+f2->pos,f2->size);
                 break;
             case 1:
-                printf("Field %d not in simulation 1.\n",field2.type);
+                printf("Field %d not in simulation 1.\n",f2->type);
                 break;
             default:
                 break;
         }
-        pos1 = 64;
-        pos2 += field2.size;
     }
+    free(index1);
+    free(index2);
+    free(sorted1);
+    free(sorted2);
     return are_different;
 }
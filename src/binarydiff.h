@@ -24,6 +24,13 @@
  */
 #ifndef _BINARYDIFF_H
 #define _BINARYDIFF_H
+#include <stddef.h>
+
+// Encodes data XOR base (both size bytes) as byte planes with runs of zeros collapsed.
+// Returns the encoded size and sets *out (to be freed by the caller), or 0 if this does not save space.
+size_t reb_binary_xor_encode(const char* base, const char* data, size_t size, char** out);
+// Decodes in and XORs the result into data, which holds base on input. Returns 1 on success.
+int reb_binary_xor_decode(const char* in, size_t insize, char* data, size_t size);
 
 
 #endif // _BINARYDIFF_H
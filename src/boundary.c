@@ -43,107 +43,79 @@ void reb_boundary_check(struct reb_simulation* const r){
 	const struct reb_vec3d boxsize = r->boxsize;
 	switch(r->boundary){
 		case REB_BOUNDARY_OPEN:
-			for (int i=0;i<N;i++){ // run through loop backwards so we don't have to recheck same index after removing
-				int removep = 0;
-				if(particles[i].x>boxsize.x/2.){
-					removep = 1;
-				}
-				if(particles[i].x<-boxsize.x/2.){
-					removep = 1;
-				}
-				if(particles[i].y>boxsize.y/2.){
-					removep = 1;
-				}
-				if(particles[i].y<-boxsize.y/2.){
-					removep = 1;
-				}
-				if(particles[i].z>boxsize.z/2.){
-					removep = 1;
-				}
-				if(particles[i].z<-boxsize.z/2.){
-					removep = 1;
-				}
-				if (removep==1){
-                    if(r->track_energy_offset){
-                        double Ei = reb_tools_energy(r);
-                        reb_remove(r, i,1);
-                        r->energy_offset += Ei - reb_tools_energy(r);
-                    } else {
-                    reb_remove(r, i,0); // keepSorted=0 by default in C version
-                    }
-                    if (r->tree_root==NULL){
-                        i--; // need to recheck the particle that replaced the removed one
-                        N--; // This is the local N
-                    }else{
-                        // particle just marked, will be removed later
-                        r->tree_needs_update= 1;
-                    }
-				}
-			}
-			break;
-		case REB_BOUNDARY_SHEAR:
 		{
-			// The offset of ghostcell is time dependent.
-			const double OMEGA = r->ri_sei.OMEGA;
-			const double offsetp1 = -fmod(-1.5*OMEGA*boxsize.x*r->t+boxsize.y/2.,boxsize.y)-boxsize.y/2.; 
-			const double offsetm1 = -fmod( 1.5*OMEGA*boxsize.x*r->t-boxsize.y/2.,boxsize.y)+boxsize.y/2.; 
-			struct reb_particle* const particles = r->particles;
-#pragma omp parallel for schedule(guided)
+			// Mark particles outside the box in parallel, then remove them 
+			// all at once so the particle array is only compacted once. 
+			char* const outside = malloc(sizeof(char)*N);
+			int N_outside = 0;
+#pragma omp parallel for schedule(static) reduction(+:N_outside)
 			for (int i=0;i<N;i++){
-				// Radial
-				while(particles[i].x>boxsize.x/2.){
-					particles[i].x -= boxsize.x;
-					particles[i].y += offsetp1;
-					particles[i].vy += 3./2.*OMEGA*boxsize.x;
-				}
-				while(particles[i].x<-boxsize.x/2.){
-					particles[i].x += boxsize.x;
-					particles[i].y += offsetm1;
-					particles[i].vy -= 3./2.*OMEGA*boxsize.x;
-				}
-				// Azimuthal
-				while(particles[i].y>boxsize.y/2.){
-					particles[i].y -= boxsize.y;
-				}
-				while(particles[i].y<-boxsize.y/2.){
-					particles[i].y += boxsize.y;
-				}
-				// Vertical (there should be no boundary, but periodic makes life easier)
-				while(particles[i].z>boxsize.z/2.){
-					particles[i].z -= boxsize.z;
-				}
-				while(particles[i].z<-boxsize.z/2.){
-					particles[i].z += boxsize.z;
-				}
+				const struct reb_particle p = particles[i];
+				outside[i] = p.x>boxsize.x/2. || p.x<-boxsize.x/2. || p.y>boxsize.y/2. || p.y<-boxsize.y/2. || p.z>boxsize.z/2. || p.z<-boxsize.z/2.;
+				N_outside += outside[i];
 			}
+			if (N_outside){
+				int* const indices = malloc(sizeof(int)*N_outside);
+				int k = 0;
+				for (int i=0;i<N;i++){
+					if (outside[i]){
+						indices[k++] = i;
+					}
+				}
+				if(r->track_energy_offset){
+					r->energy_offset += reb_tools_energy_particles(r, indices, N_outside);
+					reb_remove_many(r, indices, N_outside, r->tree_root==NULL); // Keep active particles in front of test particles
+				} else {
+					reb_remove_many(r, indices, N_outside, 0); // keepSorted=0 by default in C version
+				}
+				if (r->tree_root){
+					// particles just marked, will be removed later
+					r->tree_needs_update= 1;
+				}
+				free(indices);
+			}
+			free(outside);
 		}
 		break;
+		case REB_BOUNDARY_SHEAR:
 		case REB_BOUNDARY_PERIODIC:
+		{
+			const struct reb_boundary_wrap w = reb_boundary_wrap_init(r, r->t);
 #pragma omp parallel for schedule(guided)
 			for (int i=0;i<N;i++){
-				while(particles[i].x>boxsize.x/2.){
-					particles[i].x -= boxsize.x;
-				}
-				while(particles[i].x<-boxsize.x/2.){
-					particles[i].x += boxsize.x;
-				}
-				while(particles[i].y>boxsize.y/2.){
-					particles[i].y -= boxsize.y;
-				}
-				while(particles[i].y<-boxsize.y/2.){
-					particles[i].y += boxsize.y;
-				}
-				while(particles[i].z>boxsize.z/2.){
-					particles[i].z -= boxsize.z;
-				}
-				while(particles[i].z<-boxsize.z/2.){
-					particles[i].z += boxsize.z;
-				}
+				reb_boundary_wrap_particle(&w, &particles[i]);
 			}
+		}
 		break;
 		default:
 		break;
 	}
+	// Time only advances between boundary checks, so this is the only place 
+	// where the ghost box table typically needs to be recalculated.
+	if (r->boundary!=REB_BOUNDARY_NONE){
+		reb_boundary_ghostboxes(r);
+	}
+}
+
+int reb_boundary_can_wrap(const struct reb_simulation* const r){
+	return r->boundary==REB_BOUNDARY_PERIODIC || r->boundary==REB_BOUNDARY_SHEAR;
+}
+
+struct reb_boundary_wrap reb_boundary_wrap_init(const struct reb_simulation* const r, const double t){
+	const struct reb_vec3d boxsize = r->boxsize;
+	struct reb_boundary_wrap w = {
+		.shear = r->boundary==REB_BOUNDARY_SHEAR,
+		.boxsize = boxsize,
+		.half = {.x = boxsize.x/2., .y = boxsize.y/2., .z = boxsize.z/2.},
+	};
+	if (w.shear){
+		// The offset of ghostcell is time dependent.
+		const double OMEGA = r->ri_sei.OMEGA;
+		w.offsetp1 = -fmod(-1.5*OMEGA*boxsize.x*t+boxsize.y/2.,boxsize.y)-boxsize.y/2.; 
+		w.offsetm1 = -fmod( 1.5*OMEGA*boxsize.x*t-boxsize.y/2.,boxsize.y)+boxsize.y/2.; 
+		w.dvy = 3./2.*OMEGA*boxsize.x;
+	}
+	return w;
 }
 
 const static struct reb_ghostbox nan_ghostbox = {.shiftx = 0, .shifty = 0, .shiftz = 0, .shiftvx = 0, .shiftvy = 0, .shiftvz = 0};
@@ -201,6 +173,42 @@ struct reb_ghostbox reb_boundary_get_ghostbox(struct reb_simulation* const r, in
 	}
 }
 
+const struct reb_ghostbox* reb_boundary_ghostboxes(struct reb_simulation* const r){
+	// The shifts only change with time for shear boundary conditions, but the 
+	// box and the number of ghost boxes can be changed by the user at any time.
+	const double key[9] = {
+		r->boundary==REB_BOUNDARY_SHEAR?r->t:0., 
+		(double)r->boundary, 
+		r->boxsize.x, r->boxsize.y, r->boxsize.z, 
+		(double)r->nghostx, (double)r->nghosty, (double)r->nghostz, 
+		r->boundary==REB_BOUNDARY_SHEAR?r->ri_sei.OMEGA:0.,
+	};
+	int valid = r->ghostboxes!=NULL;
+	for (int q=0; q<9 && valid; q++){
+		valid = key[q]==r->ghostboxes_key[q];
+	}
+	if (valid){
+		return r->ghostboxes;
+	}
+	const int N_gb = (2*r->nghostx+1)*(2*r->nghosty+1)*(2*r->nghostz+1);
+	if (N_gb>r->ghostboxes_allocatedN){
+		r->ghostboxes = realloc(r->ghostboxes, sizeof(struct reb_ghostbox)*N_gb);
+		r->ghostboxes_allocatedN = N_gb;
+	}
+	int g = 0;
+	for (int gbx=-r->nghostx; gbx<=r->nghostx; gbx++){
+	for (int gby=-r->nghosty; gby<=r->nghosty; gby++){
+	for (int gbz=-r->nghostz; gbz<=r->nghostz; gbz++){
+		r->ghostboxes[g++] = reb_boundary_get_ghostbox(r, gbx, gby, gbz);
+	}
+	}
+	}
+	for (int q=0; q<9; q++){
+		r->ghostboxes_key[q] = key[q];
+	}
+	return r->ghostboxes;
+}
+
 int reb_boundary_particle_is_in_box(const struct reb_simulation* const r, struct reb_particle p){
 	switch(r->boundary){
 		case REB_BOUNDARY_OPEN:
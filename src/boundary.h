@@ -33,6 +33,75 @@
  */
 void reb_boundary_check(struct reb_simulation* r);
 
+/**
+ * @brief Quantities needed to shift single particles back into the box.
+ * @details Only used for periodic and shear boundary conditions, which 
+ * never remove particles. Integrators can use this to apply the boundary 
+ * conditions in the same loop as their drift step.
+ */
+struct reb_boundary_wrap {
+    int shear;              ///< 1 for shear, 0 for periodic boundary conditions
+    struct reb_vec3d boxsize;
+    struct reb_vec3d half;  ///< Half of the box size
+    double offsetp1;        ///< Azimuthal offset when crossing the +x boundary (shear only)
+    double offsetm1;        ///< Azimuthal offset when crossing the -x boundary (shear only)
+    double dvy;             ///< Azimuthal velocity jump when crossing an x boundary (shear only)
+};
+
+/**
+ * @brief Returns 1 if the boundary conditions can be applied particle by particle with reb_boundary_wrap_particle().
+ * @param r REBOUND Simulation to consider
+ */
+int reb_boundary_can_wrap(const struct reb_simulation* const r);
+
+/**
+ * @brief Precomputes the quantities needed by reb_boundary_wrap_particle().
+ * @param r REBOUND Simulation to consider
+ * @param t Time at which the boundary conditions are applied.
+ */
+struct reb_boundary_wrap reb_boundary_wrap_init(const struct reb_simulation* const r, const double t);
+
+/**
+ * @brief Shifts a particle back into the box. 
+ * @details Gives bitwise the same result as reb_boundary_check().
+ */
+static inline void reb_boundary_wrap_particle(const struct reb_boundary_wrap* const w, struct reb_particle* const p){
+    if (w->shear){
+        // Radial
+        while(p->x>w->half.x){
+            p->x -= w->boxsize.x;
+            p->y += w->offsetp1;
+            p->vy += w->dvy;
+        }
+        while(p->x<-w->half.x){
+            p->x += w->boxsize.x;
+            p->y += w->offsetm1;
+            p->vy -= w->dvy;
+        }
+    }else{
+        while(p->x>w->half.x){
+            p->x -= w->boxsize.x;
+        }
+        while(p->x<-w->half.x){
+            p->x += w->boxsize.x;
+        }
+    }
+    // Azimuthal
+    while(p->y>w->half.y){
+        p->y -= w->boxsize.y;
+    }
+    while(p->y<-w->half.y){
+        p->y += w->boxsize.y;
+    }
+    // Vertical (for shear there should be no boundary, but periodic makes life easier)
+    while(p->z>w->half.z){
+        p->z -= w->boxsize.z;
+    }
+    while(p->z<-w->half.z){
+        p->z += w->boxsize.z;
+    }
+}
+
 /**
  * @brief Creates a ghostbox.
  * @param r REBOUND Simulation to consider
@@ -42,6 +111,27 @@ void reb_boundary_check(struct reb_simulation* r);
  */
 struct reb_ghostbox reb_boundary_get_ghostbox(struct reb_simulation* const r, int i, int j, int k);
 
+/**
+ * @brief Returns the shifts of all ghost boxes.
+ * @details The table has (2*nghostx+1)*(2*nghosty+1)*(2*nghostz+1) entries, ordered 
+ * as in a loop over gbx, gby, gbz (innermost) from -nghost to nghost, see 
+ * reb_boundary_ghostbox_index(). It is calculated in reb_boundary_check() and 
+ * only recalculated if the time (shear only), the box, the boundary conditions 
+ * or the number of ghost boxes have changed since then. Every entry is 
+ * bitwise identical to the result of reb_boundary_get_ghostbox().
+ * The pointer is valid until the next call of this function.
+ * Not thread safe; call it before entering a parallel region.
+ * @param r REBOUND Simulation to consider
+ */
+const struct reb_ghostbox* reb_boundary_ghostboxes(struct reb_simulation* const r);
+
+/**
+ * @brief Index of the ghost box (i,j,k) in the table returned by reb_boundary_ghostboxes().
+ */
+static inline int reb_boundary_ghostbox_index(const struct reb_simulation* const r, int i, int j, int k){
+    return ((i+r->nghostx)*(2*r->nghosty+1) + (j+r->nghosty))*(2*r->nghostz+1) + (k+r->nghostz);
+}
+
 /**
  * @details Return 1 if a particle is in the box, 0 otherwise.
  * @param r REBOUND Simulation to consider
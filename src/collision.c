@@ -31,24 +31,2963 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <math.h>
 #include <time.h>
+#include <pthread.h>
 #include "particle.h"
 #include "collision.h"
 #include "rebound.h"
 #include "boundary.h"
 #include "tree.h"
+#include "autotune.h"
+#include "profiling.h"
+#include "tools.h"
 #ifdef MPI
 #include "communication_mpi.h"
 #endif // MPI
 #define MIN(a, b) ((a) > (b) ? (b) : (a))    ///< Returns the minimum of a and b
 #define MAX(a, b) ((a) > (b) ? (a) : (b))    ///< Returns the maximum of a and b
 
-static void reb_tree_get_nearest_neighbour_in_cell(struct reb_simulation* const r, int* collisions_N, struct reb_ghostbox gb, struct reb_ghostbox gbunmod, int ri, double p1_r,  double* nearest_r2, struct reb_collision* collision_nearest, struct reb_treecell* c);
-static void reb_tree_check_for_overlapping_trajectories_in_cell(struct reb_simulation* const r, int* collisions_N, struct reb_ghostbox gb, struct reb_ghostbox gbunmod, int ri, double p1_r, double p1_r_plus_dtv, struct reb_collision* collision_nearest, struct reb_treecell* c, double maxdrift);
+static void reb_tree_get_nearest_neighbour_in_cell(struct reb_simulation* const r, struct reb_collision** collisions, int* collisions_N, int* collisions_allocatedN, struct reb_ghostbox gb, struct reb_ghostbox gbunmod, int ri, double p1_r,  double* nearest_r2, struct reb_collision* collision_nearest, struct reb_treecell* c, struct reb_collision_statistics* stats);
+static void reb_tree_check_for_overlapping_trajectories_in_cell(struct reb_simulation* const r, struct reb_collision** collisions, int* collisions_N, int* collisions_allocatedN, struct reb_ghostbox gb, struct reb_ghostbox gbunmod, int ri, double p1_r, double p1_r_plus_dtv, struct reb_collision* collision_nearest, struct reb_treecell* c, struct reb_collision_statistics* stats);
+static int reb_collision_hardsphere(struct reb_simulation* const r, struct reb_collision c, double* const plog);
+static void reb_collision_search_and_resolve(struct reb_simulation* const r);
+
+/**
+ * @brief Appends a collision to a collision array, growing the array if needed.
+ * @param collisions Pointer to the collision array (may be reallocated).
+ * @param collisions_N Pointer to the number of collisions in the array.
+ * @param collisions_allocatedN Pointer to the allocated size of the array.
+ * @param c Collision to be added.
+ */
+static inline void reb_collision_append(struct reb_collision** collisions, int* collisions_N, int* collisions_allocatedN, struct reb_collision c){
+    if ((*collisions_allocatedN)<=(*collisions_N)){
+        // Allocate memory if there is no space in array.
+        // Init to 32 if no space has been allocated yet, otherwise double it.
+        *collisions_allocatedN = (*collisions_allocatedN) ? (*collisions_allocatedN) * 2 : 32;
+        *collisions = realloc(*collisions,sizeof(struct reb_collision)*(*collisions_allocatedN));
+    }
+    (*collisions)[(*collisions_N)] = c;
+    (*collisions_N)++;
+}
+
+#ifdef OPENMP
+/**
+ * @brief Copies a thread-local collision array into r->collisions and frees it.
+ * @details Needs to be called from within a parallel region by every thread.
+ * The order in which the threads append their collisions is not deterministic.
+ * Use reb_collision_sort() afterwards if a reproducible order is needed.
+ */
+static void reb_collision_merge_local(struct reb_simulation* const r, int* collisions_N, struct reb_collision* collisions_local, int collisions_local_N){
+    if (collisions_local_N){
+#pragma omp critical
+        {
+            if (r->collisions_allocatedN<(*collisions_N)+collisions_local_N){
+                while (r->collisions_allocatedN<(*collisions_N)+collisions_local_N){
+                    r->collisions_allocatedN = r->collisions_allocatedN ? r->collisions_allocatedN * 2 : 32;
+                }
+                r->collisions = realloc(r->collisions,sizeof(struct reb_collision)*r->collisions_allocatedN);
+            }
+            memcpy(r->collisions+(*collisions_N), collisions_local, sizeof(struct reb_collision)*collisions_local_N);
+            (*collisions_N) += collisions_local_N;
+        }
+    }
+    free(collisions_local);
+}
+#endif // OPENMP
+
+/**
+ * @brief Checks if two particles overlap and approach each other.
+ * @param gb Ghostbox shift plus position and velocity of the first particle.
+ * @param p1_r Radius of the first particle.
+ * @param p2 Second particle.
+ * @return 1 if the particles are colliding, 0 otherwise.
+ */
+static inline int reb_collision_check_overlap(const struct reb_ghostbox* const gb, const double p1_r, const struct reb_particle* const p2){
+    double dx = gb->shiftx - p2->x; 
+    double dy = gb->shifty - p2->y; 
+    double dz = gb->shiftz - p2->z; 
+    double sr = p1_r + p2->r; 
+    double r2 = dx*dx+dy*dy+dz*dz;
+    // Check if particles are overlapping 
+    if (r2>sr*sr) return 0;    
+    double dvx = gb->shiftvx - p2->vx; 
+    double dvy = gb->shiftvy - p2->vy; 
+    double dvz = gb->shiftvz - p2->vz; 
+    // Check if particles are approaching each other
+    if (dvx*dx + dvy*dy + dvz*dz >0) return 0; 
+    return 1;
+}
+
+/**
+ * @brief Checks if the trajectories of two particles overlapped during the last timestep.
+ * @details Particles are assumed to move along straight lines. 
+ * @param gb Ghostbox shift plus position and velocity of the first particle (at the end of the timestep).
+ * @param p1_r Radius of the first particle.
+ * @param p2 Second particle.
+ * @param dt_last_done Length of the last timestep.
+ * @return 1 if the particles are colliding, 0 otherwise.
+ */
+static inline int reb_collision_check_line(const struct reb_ghostbox* const gb, const double p1_r, const struct reb_particle* const p2, const double dt_last_done){
+    const double dx1 = gb->shiftx - p2->x; // distance at end
+    const double dy1 = gb->shifty - p2->y;
+    const double dz1 = gb->shiftz - p2->z;
+    const double r1 = (dx1*dx1 + dy1*dy1 + dz1*dz1);
+    const double dvx1 = gb->shiftvx - p2->vx; 
+    const double dvy1 = gb->shiftvy - p2->vy;
+    const double dvz1 = gb->shiftvz - p2->vz;
+    const double dx2 = dx1 -dt_last_done*dvx1; // distance at beginning
+    const double dy2 = dy1 -dt_last_done*dvy1;
+    const double dz2 = dz1 -dt_last_done*dvz1;
+    const double r2 = (dx2*dx2 + dy2*dy2 + dz2*dz2);
+    const double t_closest = (dx1*dvx1 + dy1*dvy1 + dz1*dvz1)/(dvx1*dvx1 + dvy1*dvy1 + dvz1*dvz1);
+
+    double rmin2_ab = MIN(r1,r2);
+    if (t_closest/dt_last_done>=0. && t_closest/dt_last_done<=1.){
+        const double dx3 = dx1-t_closest*dvx1; // closest approach
+        const double dy3 = dy1-t_closest*dvy1;
+        const double dz3 = dz1-t_closest*dvz1;
+        const double r3 = (dx3*dx3 + dy3*dy3 + dz3*dz3);
+        rmin2_ab = MIN(rmin2_ab, r3);
+    }
+    double rsum = p1_r + p2->r;
+    if (rmin2_ab>rsum*rsum) return 0;
+    return 1;
+}
+
+/**
+ * @brief Squared distance of two particles and its derivative at the beginning and end of the timestep.
+ * @details The squared distance is interpolated with a cubic Hermite polynomial in 
+ * the normalized time tau=0...1, as in the encounter prediction of MERCURIUS.
+ * The ghostbox shift is applied to the first particle.
+ * @param gb Ghostbox shift (without particle position) at the end of the timestep.
+ * @param xv1 Position and velocity of the first particle at the beginning of the timestep.
+ * @param xv2 Position and velocity of the second particle at the beginning of the timestep.
+ * @param h Filled with the squared distances at both ends and their derivatives times dt.
+ */
+static inline void reb_collision_hermite_init(const struct reb_ghostbox* const gb, const struct reb_particle* const p1, const struct reb_particle* const p2, const double* const xv1, const double* const xv2, const double dt, double* const h){
+    const double d1[6] = {
+        gb->shiftx + p1->x - p2->x, gb->shifty + p1->y - p2->y, gb->shiftz + p1->z - p2->z,
+        gb->shiftvx + p1->vx - p2->vx, gb->shiftvy + p1->vy - p2->vy, gb->shiftvz + p1->vz - p2->vz};
+    const double d0[6] = {
+        gb->shiftx - dt*gb->shiftvx + xv1[0] - xv2[0], 
+        gb->shifty - dt*gb->shiftvy + xv1[1] - xv2[1], 
+        gb->shiftz - dt*gb->shiftvz + xv1[2] - xv2[2], 
+        gb->shiftvx + xv1[3] - xv2[3], gb->shiftvy + xv1[4] - xv2[4], gb->shiftvz + xv1[5] - xv2[5]};
+    h[0] = d0[0]*d0[0] + d0[1]*d0[1] + d0[2]*d0[2];
+    h[1] = d1[0]*d1[0] + d1[1]*d1[1] + d1[2]*d1[2];
+    h[2] = 2.*dt*(d0[0]*d0[3] + d0[1]*d0[4] + d0[2]*d0[5]);
+    h[3] = 2.*dt*(d1[0]*d1[3] + d1[1]*d1[4] + d1[2]*d1[5]);
+}
+
+static inline double reb_collision_hermite_eval(const double* const h, const double tau){
+    return (1.-tau)*(1.-tau)*(1.+2.*tau)*h[0]
+        + tau*tau*(3.-2.*tau)*h[1]
+        + tau*(1.-tau)*(1.-tau)*h[2]
+        - tau*tau*(1.-tau)*h[3];
+}
+
+/**
+ * @brief Returns the earliest time tau in [0,1] at which the interpolated squared distance is at most rs2, or -1.
+ * @details Only the ends and the local minima need to be checked. The crossing before 
+ * the earliest of these points which is below rs2 is found by bisection.
+ * @param exact If 0, the first point below rs2 is returned without locating the crossing.
+ */
+static double reb_collision_hermite_first_contact(const double* const h, const double rs2, const int exact){
+    if (h[0]<=rs2){
+        return 0.;
+    }
+    // Roots of the derivative a*tau^2 + b*tau + c
+    const double a = 6.*(h[0]-h[1]) + 3.*(h[2]+h[3]);
+    const double b = 6.*(h[1]-h[0]) - 2.*(2.*h[2]+h[3]);
+    const double c = h[2];
+    double tau[3] = {2., 2., 1.};
+    if (a!=0.){
+        const double s = b*b - 4.*a*c;
+        if (s>=0.){
+            const double sr = sqrt(s);
+            tau[0] = (-b - sr)/(2.*a);
+            tau[1] = (-b + sr)/(2.*a);
+            if (tau[0]>tau[1]){
+                const double t = tau[0]; tau[0] = tau[1]; tau[1] = t;
+            }
+        }
+    }else if (b!=0.){
+        tau[0] = -c/b;
+    }
+    for (int k=0;k<3;k++){
+        if (!(tau[k]>0. && tau[k]<=1.)) continue;
+        if (reb_collision_hermite_eval(h, tau[k])>rs2) continue;
+        if (!exact){
+            return tau[k];
+        }
+        double lo = 0.;
+        double hi = tau[k];
+        for (int i=0;i<60;i++){
+            const double mid = 0.5*(lo+hi);
+            if (reb_collision_hermite_eval(h, mid)>rs2){
+                lo = mid;
+            }else{
+                hi = mid;
+            }
+        }
+        return hi;
+    }
+    return -1.;
+}
+
+/**
+ * @brief Same as reb_collision_check_line(), but uses the positions and velocities at the beginning of the timestep.
+ * @details The squared distance is interpolated with a cubic Hermite polynomial. This is 
+ * exact for particles moving on straight lines and much more accurate than 
+ * reb_collision_check_line() for particles on curved orbits.
+ */
+static inline int reb_collision_check_hermite(const struct reb_ghostbox* const gb, const struct reb_particle* const p1, const struct reb_particle* const p2, const double* const xv1, const double* const xv2, const double dt_last_done){
+    double h[4];
+    reb_collision_hermite_init(gb, p1, p2, xv1, xv2, dt_last_done, h);
+    const double rs = p1->r + p2->r;
+    return reb_collision_hermite_first_contact(h, rs*rs, 0)>=0.;
+}
+
+/**
+ * @brief Returns the positions and velocities at the beginning of the timestep if the Hermite test can be used, NULL otherwise.
+ * @details Particles crossing a periodic boundary jump, so the Hermite test is only
+ * used with open boundaries or no boundaries. If particles have been added or removed 
+ * since the beginning of the timestep, the line test is used instead.
+ */
+static const double* reb_collision_line_xv0(const struct reb_simulation* const r, const int N){
+    if ((!r->collision_line_hermite && !r->collision_line_ias15) || r->collision_line_xv0_N!=N){
+        return NULL;
+    }
+    if (r->boundary!=REB_BOUNDARY_NONE && r->boundary!=REB_BOUNDARY_OPEN){
+        return NULL;
+    }
+    return r->collision_line_xv0;
+}
+
+/**
+ * @brief Normalized time of impact (0...1) of a collision found by reb_collision_check_hermite().
+ */
+static double reb_collision_time_of_impact_hermite(const struct reb_simulation* const r, const struct reb_collision c, const double* const xv0){
+    const double dt_last_done = r->dt_last_done;
+    const struct reb_particle* const p1 = &r->particles[c.p1];
+    const struct reb_particle* const p2 = &r->particles[c.p2];
+    const double* const xv1 = xv0+6*c.p1;
+    const double* const xv2 = xv0+6*c.p2;
+    const struct reb_ghostbox* const gb = &c.gb;
+    double h[4];
+    reb_collision_hermite_init(gb, p1, p2, xv1, xv2, dt_last_done, h);
+    const double rs = p1->r + p2->r;
+    return MAX(reb_collision_hermite_first_contact(h, rs*rs, 1), 0.);
+}
+
+void reb_collision_line_store(struct reb_simulation* const r){
+    const int N = r->N - r->N_var;
+    if (r->collision_line_xv0_allocatedN<N){
+        r->collision_line_xv0 = realloc(r->collision_line_xv0, sizeof(double)*6*N);
+        r->collision_line_xv0_allocatedN = N;
+    }
+    const struct reb_particle* const particles = r->particles;
+    double* const xv0 = r->collision_line_xv0;
+#pragma omp parallel for schedule(static) if(N>1000)
+    for (int i=0;i<N;i++){
+        xv0[6*i]   = particles[i].x;
+        xv0[6*i+1] = particles[i].y;
+        xv0[6*i+2] = particles[i].z;
+        xv0[6*i+3] = particles[i].vx;
+        xv0[6*i+4] = particles[i].vy;
+        xv0[6*i+5] = particles[i].vz;
+    }
+    r->collision_line_xv0_N = N;
+}
+
+/**
+ * @brief Returns 1 if the IAS15 trajectories of the last timestep can be used by REB_COLLISION_LINE.
+ * @details The trajectories are only available for particles integrated by a standalone IAS15 
+ * step. The positions and velocities at the beginning of the timestep need to be available too.
+ */
+static int reb_collision_line_ias15_available(const struct reb_simulation* const r, const int N){
+    if (!r->collision_line_ias15 || r->integrator!=REB_INTEGRATOR_IAS15 || r->ephemeris){
+        return 0;
+    }
+    if (r->collision_line_xv0_N!=N || r->ri_ias15.allocatedN<3*N || r->dt_last_done==0.){
+        return 0;
+    }
+    return r->boundary==REB_BOUNDARY_NONE || r->boundary==REB_BOUNDARY_OPEN;
+}
+
+/**
+ * @brief Fills r->collision_line_poly with the IAS15 trajectories of the last timestep.
+ * @details Each coordinate is a polynomial of degree 9 in the normalized time tau=0...1,
+ * given by the positions and velocities at the beginning of the timestep, the accelerations 
+ * a0 and the b coefficients of the accepted step. The last entry is the radius of a sphere 
+ * around the initial position which contains the whole trajectory. It is set to -1 if the 
+ * polynomial does not end at the current position, for example because a test particle was 
+ * substepped or the particle was modified after the step. Such particles use the Hermite test.
+ * @return r->collision_line_poly, or NULL if the trajectories are not available.
+ */
+static const double* reb_collision_line_poly_update(struct reb_simulation* const r, const int N){
+    if (!reb_collision_line_ias15_available(r, N)){
+        return NULL;
+    }
+    if (r->collision_line_poly_allocatedN<N){
+        r->collision_line_poly = realloc(r->collision_line_poly, sizeof(double)*31*N);
+        r->collision_line_poly_allocatedN = N;
+    }
+    const struct reb_particle* const particles = r->particles;
+    const double* const xv0 = r->collision_line_xv0;
+    const double* const a0 = r->ri_ias15.a0;
+    const struct reb_dp7 br = r->ri_ias15.br;
+    const double dt = r->dt_last_done;
+    double* const poly = r->collision_line_poly;
+#pragma omp parallel for schedule(static) if(N>1000)
+    for (int i=0;i<N;i++){
+        double* const P = poly+31*i;
+        double D = 0.;
+        int valid = 1;
+        for (int a=0;a<3;a++){
+            const int k = 3*i+a;
+            double* const c = P+10*a;
+            c[0] = xv0[6*i+a];
+            c[1] = xv0[6*i+3+a]*dt;
+            c[2] = a0[k]*dt*dt/2.;
+            c[3] = br.p0[k]*dt*dt/6.;
+            c[4] = br.p1[k]*dt*dt/12.;
+            c[5] = br.p2[k]*dt*dt/20.;
+            c[6] = br.p3[k]*dt*dt/30.;
+            c[7] = br.p4[k]*dt*dt/42.;
+            c[8] = br.p5[k]*dt*dt/56.;
+            c[9] = br.p6[k]*dt*dt/72.;
+            double x1 = 0.;
+            double Da = 0.;
+            for (int n=9;n>=1;n--){
+                x1 += c[n];
+                Da += fabs(c[n]);
+            }
+            const double x = a==0?particles[i].x:(a==1?particles[i].y:particles[i].z);
+            if (fabs(c[0]+x1-x)>1e-8*(fabs(x)+Da+particles[i].r)){
+                valid = 0;
+            }
+            D += Da*Da;
+        }
+        P[30] = valid?sqrt(D):-1.;
+    }
+    return poly;
+}
+
+/**
+ * @brief Squared distance of two particles on their IAS15 trajectories at the normalized time tau.
+ * @param d Coefficients of the difference of the trajectories (x, y, z, 10 each).
+ */
+static inline double reb_collision_poly_eval(const double* const d, const double tau){
+    double s = 0.;
+    for (int a=0;a<3;a++){
+        const double* const c = d+10*a;
+        double x = c[9];
+        for (int n=8;n>=0;n--){
+            x = x*tau + c[n];
+        }
+        s += x*x;
+    }
+    return s;
+}
+
+#define REB_COLLISION_POLY_SAMPLES 16   ///< Number of intervals in which the squared distance of two IAS15 trajectories is sampled
+
+/**
+ * @brief Returns the earliest time tau in [0,1] at which two IAS15 trajectories are at most rs apart, or -1.
+ * @details Trajectories whose bounding spheres do not overlap are rejected first. Otherwise the 
+ * squared distance is sampled and every sampled local minimum is refined with a golden section 
+ * search. The crossing before the earliest minimum which is below rs^2 is found by bisection.
+ * @param gb Ghostbox shift (without particle position) at the end of the timestep, applied to the first particle.
+ * @param P1 Trajectory of the first particle, see reb_collision_line_poly_update().
+ * @param P2 Trajectory of the second particle.
+ * @param exact If 0, the first point below rs^2 is returned without locating the crossing.
+ */
+static double reb_collision_poly_first_contact(const struct reb_ghostbox* const gb, const double* const P1, const double* const P2, const double dt, const double rs, const int exact){
+    const double shift[3] = {gb->shiftx, gb->shifty, gb->shiftz};
+    const double shiftv[3] = {gb->shiftvx*dt, gb->shiftvy*dt, gb->shiftvz*dt};
+    double d[30];
+    double d0 = 0.;
+    double sv = 0.;
+    for (int a=0;a<3;a++){
+        for (int n=0;n<10;n++){
+            d[10*a+n] = P1[10*a+n] - P2[10*a+n];
+        }
+        d[10*a] += shift[a] - shiftv[a];
+        d[10*a+1] += shiftv[a];
+        d0 += d[10*a]*d[10*a];
+        sv += shiftv[a]*shiftv[a];
+    }
+    const double reach = P1[30] + P2[30] + sqrt(sv) + rs;
+    if (d0>reach*reach){
+        return -1.;
+    }
+    const double rs2 = rs*rs;
+    double f[REB_COLLISION_POLY_SAMPLES+1];
+    for (int k=0;k<=REB_COLLISION_POLY_SAMPLES;k++){
+        const double tau = (double)k/REB_COLLISION_POLY_SAMPLES;
+        f[k] = reb_collision_poly_eval(d, tau);
+        if (f[k]<=rs2){
+            if (!exact || k==0){
+                return tau;
+            }
+            double lo = (double)(k-1)/REB_COLLISION_POLY_SAMPLES;
+            double hi = tau;
+            for (int i=0;i<60;i++){
+                const double mid = 0.5*(lo+hi);
+                if (reb_collision_poly_eval(d, mid)>rs2){
+                    lo = mid;
+                }else{
+                    hi = mid;
+                }
+            }
+            return hi;
+        }
+    }
+    // No sample is below rs^2. Refine the local minima.
+    const double g = 0.5*(sqrt(5.)-1.);
+    for (int k=0;k<=REB_COLLISION_POLY_SAMPLES;k++){
+        if (k>0 && f[k]>f[k-1]) continue;
+        if (k<REB_COLLISION_POLY_SAMPLES && f[k]>f[k+1]) continue;
+        double lo = (double)MAX(k-1,0)/REB_COLLISION_POLY_SAMPLES;
+        double hi = (double)MIN(k+1,REB_COLLISION_POLY_SAMPLES)/REB_COLLISION_POLY_SAMPLES;
+        const double left = lo;
+        double t1 = hi - g*(hi-lo);
+        double t2 = lo + g*(hi-lo);
+        double f1 = reb_collision_poly_eval(d, t1);
+        double f2 = reb_collision_poly_eval(d, t2);
+        for (int i=0;i<40 && f1>rs2 && f2>rs2;i++){
+            if (f1<f2){
+                hi = t2; t2 = t1; f2 = f1;
+                t1 = hi - g*(hi-lo);
+                f1 = reb_collision_poly_eval(d, t1);
+            }else{
+                lo = t1; t1 = t2; f1 = f2;
+                t2 = lo + g*(hi-lo);
+                f2 = reb_collision_poly_eval(d, t2);
+            }
+        }
+        if (f1>rs2 && f2>rs2) continue;
+        double tmin = f1<=rs2?t1:t2;
+        if (!exact){
+            return tmin;
+        }
+        lo = left;
+        for (int i=0;i<60;i++){
+            const double mid = 0.5*(lo+tmin);
+            if (reb_collision_poly_eval(d, mid)>rs2){
+                lo = mid;
+            }else{
+                tmin = mid;
+            }
+        }
+        return tmin;
+    }
+    return -1.;
+}
+
+/**
+ * @brief Same as reb_collision_check_hermite(), but uses the IAS15 trajectories if both particles have one.
+ */
+static inline int reb_collision_check_ias15(const struct reb_ghostbox* const gb, const struct reb_particle* const p1, const struct reb_particle* const p2, const double* const xv1, const double* const xv2, const double* const P1, const double* const P2, const double dt_last_done){
+    if (P1[30]<0. || P2[30]<0.){
+        return reb_collision_check_hermite(gb, p1, p2, xv1, xv2, dt_last_done);
+    }
+    return reb_collision_poly_first_contact(gb, P1, P2, dt_last_done, p1->r + p2->r, 0)>=0.;
+}
+
+/**
+ * @brief Time at which two particles found by reb_collision_check_line() first touched.
+ * @details Particles are assumed to move along straight lines during the last timestep. 
+ * If the particles already overlapped at the beginning of the timestep, the time at the beginning is returned.
+ * @param c Collision, the ghostbox shift is applied to the first particle.
+ * @return Time of impact.
+ */
+static double reb_collision_time_of_impact(const struct reb_simulation* const r, const struct reb_collision c){
+    const struct reb_particle* const p1 = &r->particles[c.p1];
+    const struct reb_particle* const p2 = &r->particles[c.p2];
+    const double dt_last_done = r->dt_last_done;
+    const double* const xv0 = reb_collision_line_xv0(r, r->N - r->N_var);
+    if (xv0 && r->collision==REB_COLLISION_LINE){
+        double tau;
+        const double* const poly = r->collision_line_poly;
+        if (reb_collision_line_ias15_available(r, r->N - r->N_var) && poly[31*c.p1+30]>=0. && poly[31*c.p2+30]>=0.){
+            tau = MAX(reb_collision_poly_first_contact(&c.gb, poly+31*c.p1, poly+31*c.p2, dt_last_done, p1->r + p2->r, 1), 0.);
+        }else{
+            tau = reb_collision_time_of_impact_hermite(r, c, xv0);
+        }
+        return r->t - (1.-tau)*dt_last_done;
+    }
+    const double dx = p1->x + c.gb.shiftx - p2->x; // distance at end
+    const double dy = p1->y + c.gb.shifty - p2->y;
+    const double dz = p1->z + c.gb.shiftz - p2->z;
+    const double dvx = p1->vx + c.gb.shiftvx - p2->vx; 
+    const double dvy = p1->vy + c.gb.shiftvy - p2->vy;
+    const double dvz = p1->vz + c.gb.shiftvz - p2->vz;
+    const double rsum = p1->r + p2->r;
+    // The distance a time s before the end of the timestep is |d - s*dv|.
+    // Solve |d - s*dv|^2 = rsum^2 for the larger s (the earlier time).
+    const double a = dvx*dvx + dvy*dvy + dvz*dvz;
+    const double b = dx*dvx + dy*dvy + dz*dvz;
+    const double c0 = dx*dx + dy*dy + dz*dz - rsum*rsum;
+    double s = dt_last_done;
+    if (a>0.){
+        const double disc = b*b - a*c0;
+        s = (b + sqrt(MAX(disc,0.)))/a;
+        s = MIN(MAX(s,0.),dt_last_done);
+    }
+    return r->t - s;
+}
+
+#define REB_COLLISION_LINE_BLOCK 8      ///< Number of particles tested at once by reb_collision_check_line_block()
+
+/**
+ * @brief Copies positions, velocities and radii into the packed array r->collision_line_soa.
+ * @details The array contains seven consecutive blocks of N doubles: x, y, z, vx, vy, vz and r.
+ * @return Pointer to the packed array.
+ */
+static const double* reb_collision_line_soa_update(struct reb_simulation* const r, const int N){
+    if (r->collision_line_soa_allocatedN<N){
+        r->collision_line_soa = realloc(r->collision_line_soa, sizeof(double)*7*N);
+        r->collision_line_soa_allocatedN = N;
+    }
+    double* const soa = r->collision_line_soa;
+    const struct reb_particle* const particles = r->particles;
+    for (int i=0;i<N;i++){
+        soa[i]     = particles[i].x;
+        soa[N+i]   = particles[i].y;
+        soa[2*N+i] = particles[i].z;
+        soa[3*N+i] = particles[i].vx;
+        soa[4*N+i] = particles[i].vy;
+        soa[5*N+i] = particles[i].vz;
+        soa[6*N+i] = particles[i].r;
+    }
+    return soa;
+}
+
+/**
+ * @brief Line collision test of one particle against REB_COLLISION_LINE_BLOCK consecutive particles.
+ * @details Performs exactly the same floating point operations as reb_collision_check_line(),
+ * but reads particles j0...j0+REB_COLLISION_LINE_BLOCK-1 from the packed array created by
+ * reb_collision_line_soa_update(). With AVX512 all particles are tested at once, 
+ * otherwise the branch free loop can be vectorized by the compiler.
+ * @return Bit k is set if particle j0+k might have collided.
+ */
+static inline unsigned int reb_collision_check_line_block(const struct reb_ghostbox* const gb, const double p1_r, const double* const soa, const int N, const int j0, const double dt_last_done){
+    const double* const x  = soa + j0;
+    const double* const y  = soa + N + j0;
+    const double* const z  = soa + 2*N + j0;
+    const double* const vx = soa + 3*N + j0;
+    const double* const vy = soa + 4*N + j0;
+    const double* const vz = soa + 5*N + j0;
+    const double* const pr = soa + 6*N + j0;
+#ifdef AVX512
+    const __m512d dt = _mm512_set1_pd(dt_last_done);
+    const __m512d dx1 = _mm512_sub_pd(_mm512_set1_pd(gb->shiftx), _mm512_loadu_pd(x)); // distance at end
+    const __m512d dy1 = _mm512_sub_pd(_mm512_set1_pd(gb->shifty), _mm512_loadu_pd(y));
+    const __m512d dz1 = _mm512_sub_pd(_mm512_set1_pd(gb->shiftz), _mm512_loadu_pd(z));
+    const __m512d r1 = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(dx1,dx1), _mm512_mul_pd(dy1,dy1)), _mm512_mul_pd(dz1,dz1));
+    const __m512d dvx1 = _mm512_sub_pd(_mm512_set1_pd(gb->shiftvx), _mm512_loadu_pd(vx));
+    const __m512d dvy1 = _mm512_sub_pd(_mm512_set1_pd(gb->shiftvy), _mm512_loadu_pd(vy));
+    const __m512d dvz1 = _mm512_sub_pd(_mm512_set1_pd(gb->shiftvz), _mm512_loadu_pd(vz));
+    const __m512d dx2 = _mm512_sub_pd(dx1, _mm512_mul_pd(dt, dvx1)); // distance at beginning
+    const __m512d dy2 = _mm512_sub_pd(dy1, _mm512_mul_pd(dt, dvy1));
+    const __m512d dz2 = _mm512_sub_pd(dz1, _mm512_mul_pd(dt, dvz1));
+    const __m512d r2 = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(dx2,dx2), _mm512_mul_pd(dy2,dy2)), _mm512_mul_pd(dz2,dz2));
+    const __m512d t_closest = _mm512_div_pd(
+            _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(dx1,dvx1), _mm512_mul_pd(dy1,dvy1)), _mm512_mul_pd(dz1,dvz1)),
+            _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(dvx1,dvx1), _mm512_mul_pd(dvy1,dvy1)), _mm512_mul_pd(dvz1,dvz1)));
+    const __m512d f = _mm512_div_pd(t_closest, dt);
+    const __mmask8 inside = _mm512_cmp_pd_mask(f, _mm512_setzero_pd(), _CMP_GE_OQ) & _mm512_cmp_pd_mask(f, _mm512_set1_pd(1.), _CMP_LE_OQ);
+    const __m512d dx3 = _mm512_sub_pd(dx1, _mm512_mul_pd(t_closest, dvx1)); // closest approach
+    const __m512d dy3 = _mm512_sub_pd(dy1, _mm512_mul_pd(t_closest, dvy1));
+    const __m512d dz3 = _mm512_sub_pd(dz1, _mm512_mul_pd(t_closest, dvz1));
+    const __m512d r3 = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(dx3,dx3), _mm512_mul_pd(dy3,dy3)), _mm512_mul_pd(dz3,dz3));
+    // _mm512_min_pd(b,a) has the same semantics as MIN(a,b)
+    __m512d rmin2_ab = _mm512_min_pd(r2, r1);
+    rmin2_ab = _mm512_mask_blend_pd(inside, rmin2_ab, _mm512_min_pd(r3, rmin2_ab));
+    const __m512d rsum = _mm512_add_pd(_mm512_set1_pd(p1_r), _mm512_loadu_pd(pr));
+    return _mm512_cmp_pd_mask(rmin2_ab, _mm512_mul_pd(rsum,rsum), _CMP_NGT_UQ);
+#else // AVX512
+    unsigned int hits = 0;
+    for (int k=0;k<REB_COLLISION_LINE_BLOCK;k++){
+        const double dx1 = gb->shiftx - x[k]; // distance at end
+        const double dy1 = gb->shifty - y[k];
+        const double dz1 = gb->shiftz - z[k];
+        const double r1 = (dx1*dx1 + dy1*dy1 + dz1*dz1);
+        const double dvx1 = gb->shiftvx - vx[k]; 
+        const double dvy1 = gb->shiftvy - vy[k];
+        const double dvz1 = gb->shiftvz - vz[k];
+        const double dx2 = dx1 -dt_last_done*dvx1; // distance at beginning
+        const double dy2 = dy1 -dt_last_done*dvy1;
+        const double dz2 = dz1 -dt_last_done*dvz1;
+        const double r2 = (dx2*dx2 + dy2*dy2 + dz2*dz2);
+        const double t_closest = (dx1*dvx1 + dy1*dvy1 + dz1*dvz1)/(dvx1*dvx1 + dvy1*dvy1 + dvz1*dvz1);
+        const double dx3 = dx1-t_closest*dvx1; // closest approach
+        const double dy3 = dy1-t_closest*dvy1;
+        const double dz3 = dz1-t_closest*dvz1;
+        const double r3 = (dx3*dx3 + dy3*dy3 + dz3*dz3);
+        const double rmin2_end = MIN(r1,r2);
+        const int inside = (t_closest/dt_last_done>=0.) & (t_closest/dt_last_done<=1.);
+        const double rmin2_ab = inside ? MIN(rmin2_end, r3) : rmin2_end;
+        const double rsum = p1_r + pr[k];
+        hits |= (unsigned int)(!(rmin2_ab>rsum*rsum))<<k;
+    }
+    return hits;
+#endif // AVX512
+}
+
+/**
+ * @brief Overlap test of one particle against 8 consecutive particles.
+ * @details Performs exactly the same floating point operations as the first test in 
+ * reb_collision_check_overlap(), but reads particles j0...j0+7 from r->particles_soa 
+ * (see reb_particles_soa_update()). The branch free loop can be vectorized by the compiler.
+ * Whether the particles are approaching each other is not tested.
+ * @return Bit k is set if particle j0+k is overlapping.
+ */
+static inline unsigned int reb_collision_check_overlap_block(const struct reb_ghostbox* const gb, const double p1_r, const double* const soa, const int Np, const int j0){
+    const double* const x  = soa + j0;
+    const double* const y  = soa + Np + j0;
+    const double* const z  = soa + 2*Np + j0;
+    const double* const pr = soa + 4*Np + j0;
+    unsigned int hits = 0;
+    for (int k=0;k<8;k++){
+        const double dx = gb->shiftx - x[k]; 
+        const double dy = gb->shifty - y[k]; 
+        const double dz = gb->shiftz - z[k]; 
+        const double sr = p1_r + pr[k]; 
+        const double r2 = dx*dx+dy*dy+dz*dz;
+        hits |= (unsigned int)(!(r2>sr*sr))<<k;
+    }
+    return hits;
+}
+
+/**
+ * @brief Returns the component of a vector along the sweep axis (0=x, 1=y, 2=z).
+ */
+static inline double reb_collision_sap_component(const double x, const double y, const double z, const int axis){
+    return axis==0?x:(axis==1?y:z);
+}
+
+/**
+ * @brief Entry used to sort particles from scratch in reb_collision_sap_update().
+ */
+struct reb_collision_sap_entry {
+    double lower;
+    double upper;
+    int index;
+};
+
+static int reb_collision_sap_compare(const void* a, const void* b){
+    const struct reb_collision_sap_entry* ea = (const struct reb_collision_sap_entry*)a;
+    const struct reb_collision_sap_entry* eb = (const struct reb_collision_sap_entry*)b;
+    if (ea->lower != eb->lower) return (ea->lower > eb->lower) - (ea->lower < eb->lower);
+    return (ea->index > eb->index) - (ea->index < eb->index);
+}
+
+/**
+ * @brief Calculates the interval of a particle along the sweep axis.
+ * @details Intervals are padded slightly so that roundoff errors cannot 
+ * separate particles which are exactly touching.
+ * @param line If 1, the interval also contains the trajectory during the last timestep.
+ */
+static inline void reb_collision_sap_interval(const struct reb_particle* const p, const int axis, const int line, const double dt_last_done, double* lower, double* upper){
+    const double q = reb_collision_sap_component(p->x, p->y, p->z, axis);
+    double qmin = q;
+    double qmax = q;
+    if (line){
+        const double q0 = q - dt_last_done*reb_collision_sap_component(p->vx, p->vy, p->vz, axis); // position at beginning of timestep
+        qmin = MIN(q, q0);
+        qmax = MAX(q, q0);
+    }
+    const double w = p->r + 1e-12*(fabs(qmin) + fabs(qmax) + p->r);
+    *lower = qmin - w;
+    *upper = qmax + w;
+}
+
+/**
+ * @brief Updates the intervals of all particles along the sweep axis and sorts them by their lower bound.
+ * @details If the number of particles has not changed since the last call, 
+ * the order from the last timestep is reused and repaired with an insertion
+ * sort. This is O(N) if particles barely move relative to each other.
+ * Otherwise, particles are sorted from scratch along the axis on which 
+ * the particle distribution has the largest extent.
+ * @param r REBOUND simulation to work on.
+ * @param N Number of particles to be sorted.
+ * @param mercurius_map If not NULL, index i refers to particle mercurius_map[i].
+ * @param line If 1, intervals contain the trajectories during the last timestep.
+ * @return The largest width of all intervals.
+ */
+static double reb_collision_sap_update(struct reb_simulation* const r, const int N, const int* const mercurius_map, const int line){
+    const struct reb_particle* const particles = r->particles;
+    const double dt_last_done = r->dt_last_done;
+    if (r->collision_sap_allocatedN<N){
+        r->collision_sap_particles = realloc(r->collision_sap_particles,sizeof(int)*N);
+        r->collision_sap_lower = realloc(r->collision_sap_lower,sizeof(double)*N);
+        r->collision_sap_upper = realloc(r->collision_sap_upper,sizeof(double)*N);
+        r->collision_sap_allocatedN = N;
+    }
+    int* const sap_particles = r->collision_sap_particles;
+    double* const lower = r->collision_sap_lower;
+    double* const upper = r->collision_sap_upper;
+    double wmax = 0.;
+    if (r->collision_sap_N != N){
+        // Sort from scratch along the axis with the largest extent
+        double qmin[3] = {INFINITY, INFINITY, INFINITY};
+        double qmax[3] = {-INFINITY, -INFINITY, -INFINITY};
+        for (int i=0;i<N;i++){
+            const int ip = mercurius_map?mercurius_map[i]:i;
+            const struct reb_particle* const p = &particles[ip];
+            qmin[0] = MIN(qmin[0], p->x); qmax[0] = MAX(qmax[0], p->x);
+            qmin[1] = MIN(qmin[1], p->y); qmax[1] = MAX(qmax[1], p->y);
+            qmin[2] = MIN(qmin[2], p->z); qmax[2] = MAX(qmax[2], p->z);
+        }
+        int axis = 0;
+        for (int a=1;a<3;a++){
+            if (qmax[a]-qmin[a] > qmax[axis]-qmin[axis]){
+                axis = a;
+            }
+        }
+        r->collision_sap_axis = axis;
+        struct reb_collision_sap_entry* entries = malloc(sizeof(struct reb_collision_sap_entry)*N);
+        for (int i=0;i<N;i++){
+            const int ip = mercurius_map?mercurius_map[i]:i;
+            entries[i].index = i;
+            reb_collision_sap_interval(&particles[ip], axis, line, dt_last_done, &entries[i].lower, &entries[i].upper);
+        }
+        qsort(entries, N, sizeof(struct reb_collision_sap_entry), reb_collision_sap_compare);
+        for (int k=0;k<N;k++){
+            sap_particles[k] = entries[k].index;
+            lower[k] = entries[k].lower;
+            upper[k] = entries[k].upper;
+            wmax = MAX(wmax, upper[k]-lower[k]);
+        }
+        free(entries);
+        r->collision_sap_N = N;
+        return wmax;
+    }
+    // Reuse order from last timestep
+    const int axis = r->collision_sap_axis;
+    for (int k=0;k<N;k++){
+        const int i = sap_particles[k];
+        const int ip = mercurius_map?mercurius_map[i]:i;
+        reb_collision_sap_interval(&particles[ip], axis, line, dt_last_done, &lower[k], &upper[k]);
+        wmax = MAX(wmax, upper[k]-lower[k]);
+    }
+    // Insertion sort
+    for (int k=1;k<N;k++){
+        const double lk = lower[k];
+        if (lower[k-1]<=lk) continue;
+        const double uk = upper[k];
+        const int ik = sap_particles[k];
+        int l = k;
+        while (l>0 && lower[l-1]>lk){
+            lower[l] = lower[l-1];
+            upper[l] = upper[l-1];
+            sap_particles[l] = sap_particles[l-1];
+            l--;
+        }
+        lower[l] = lk;
+        upper[l] = uk;
+        sap_particles[l] = ik;
+    }
+    return wmax;
+}
+
+#define REB_COLLISION_BVH_REBUILD 1.5   ///< The hierarchy is rebuilt if the total surface area of its boxes grew by more than this factor
+
+/**
+ * @brief Bounding box (xmin, ymin, zmin, xmax, ymax, zmax) of a particle, see reb_collision_sap_interval().
+ */
+static inline void reb_collision_bvh_leaf_box(const struct reb_particle* const p, const int line, const double dt_last_done, double* const b){
+    for (int a=0;a<3;a++){
+        reb_collision_sap_interval(p, a, line, dt_last_done, &b[a], &b[a+3]);
+    }
+}
+
+/**
+ * @brief Half of the surface area of a box, used to measure the quality of the hierarchy.
+ */
+static inline double reb_collision_bvh_area(const double* const b){
+    const double dx = b[3]-b[0];
+    const double dy = b[4]-b[1];
+    const double dz = b[5]-b[2];
+    return dx*dy + dy*dz + dz*dx;
+}
+
+static inline void reb_collision_bvh_union(const double* const b1, const double* const b2, double* const b){
+    for (int a=0;a<3;a++){
+        b[a] = MIN(b1[a], b2[a]);
+        b[a+3] = MAX(b1[a+3], b2[a+3]);
+    }
+}
+
+/**
+ * @brief Builds the subtree of node from the particles leaves[start...end-1].
+ * @details The particles are split at the median of the box centres along the axis 
+ * on which the centres have the largest extent. Children always have a larger index
+ * than their parent, so the boxes can be refitted in one backwards pass.
+ * @param lb Boxes of all particles.
+ * @param next Index of the next unused node.
+ */
+static void reb_collision_bvh_build_node(double* const box, int* const child, int* const leaves, const double* const lb, const int node, const int start, const int end, int* const next){
+    double* const b = box+6*node;
+    if (end-start==1){
+        const int i = leaves[start];
+        for (int a=0;a<6;a++){
+            b[a] = lb[6*i+a];
+        }
+        child[2*node] = -1-i;
+        child[2*node+1] = -1-i;
+        return;
+    }
+    double cmin[3] = {INFINITY, INFINITY, INFINITY};
+    double cmax[3] = {-INFINITY, -INFINITY, -INFINITY};
+    for (int k=start;k<end;k++){
+        const double* const bk = lb+6*leaves[k];
+        for (int a=0;a<3;a++){
+            const double c = bk[a]+bk[a+3];
+            cmin[a] = MIN(cmin[a], c);
+            cmax[a] = MAX(cmax[a], c);
+        }
+    }
+    int axis = 0;
+    for (int a=1;a<3;a++){
+        if (cmax[a]-cmin[a] > cmax[axis]-cmin[axis]){
+            axis = a;
+        }
+    }
+    // Quickselect the median along axis
+    const int mid = start + (end-start)/2;
+    int lo = start;
+    int hi = end-1;
+    while (lo<hi){
+        const double pivot = lb[6*leaves[(lo+hi)/2]+axis] + lb[6*leaves[(lo+hi)/2]+axis+3];
+        int i = lo;
+        int j = hi;
+        while (i<=j){
+            while (lb[6*leaves[i]+axis]+lb[6*leaves[i]+axis+3] < pivot) i++;
+            while (lb[6*leaves[j]+axis]+lb[6*leaves[j]+axis+3] > pivot) j--;
+            if (i<=j){
+                const int t = leaves[i]; leaves[i] = leaves[j]; leaves[j] = t;
+                i++;
+                j--;
+            }
+        }
+        if (mid<=j){
+            hi = j;
+        }else if (mid>=i){
+            lo = i;
+        }else{
+            break;
+        }
+    }
+    const int left = (*next)++;
+    const int right = (*next)++;
+    child[2*node] = left;
+    child[2*node+1] = right;
+    reb_collision_bvh_build_node(box, child, leaves, lb, left, start, mid, next);
+    reb_collision_bvh_build_node(box, child, leaves, lb, right, mid, end, next);
+    reb_collision_bvh_union(box+6*left, box+6*right, b);
+}
+
+/**
+ * @brief Updates the bounding volume hierarchy of all particles.
+ * @details The boxes of all nodes are refitted to the current particle positions. 
+ * The hierarchy is only rebuilt from scratch if the number of particles changed 
+ * or if the total surface area of all boxes grew by more than REB_COLLISION_BVH_REBUILD
+ * since the last build. Every particle has its own box, so a few large particles 
+ * do not affect how well the small particles are separated.
+ * @param r REBOUND simulation to work on.
+ * @param N Number of particles.
+ * @param mercurius_map If not NULL, index i refers to particle mercurius_map[i].
+ * @param line If 1, boxes contain the trajectories during the last timestep.
+ */
+static void reb_collision_bvh_update(struct reb_simulation* const r, const int N, const int* const mercurius_map, const int line){
+    const struct reb_particle* const particles = r->particles;
+    const double dt_last_done = r->dt_last_done;
+    const int nodes_N = 2*N-1;
+    if (r->collision_bvh_allocatedN<N){
+        r->collision_bvh_box = realloc(r->collision_bvh_box, sizeof(double)*6*(2*N-1));
+        r->collision_bvh_child = realloc(r->collision_bvh_child, sizeof(int)*2*(2*N-1));
+        r->collision_bvh_allocatedN = N;
+    }
+    double* const box = r->collision_bvh_box;
+    int* const child = r->collision_bvh_child;
+    if (r->collision_bvh_N==N){
+        // Refit
+        double cost = 0.;
+        for (int k=nodes_N-1;k>=0;k--){
+            double* const b = box+6*k;
+            if (child[2*k]<0){
+                const int i = -1-child[2*k];
+                const int ip = mercurius_map?mercurius_map[i]:i;
+                reb_collision_bvh_leaf_box(&particles[ip], line, dt_last_done, b);
+            }else{
+                reb_collision_bvh_union(box+6*child[2*k], box+6*child[2*k+1], b);
+                cost += reb_collision_bvh_area(b);
+            }
+        }
+        if (cost<=REB_COLLISION_BVH_REBUILD*r->collision_bvh_cost){
+            return;
+        }
+    }
+    // Build from scratch
+    double* lb = malloc(sizeof(double)*6*N);
+    int* leaves = malloc(sizeof(int)*N);
+#pragma omp parallel for schedule(static) if(N>1000)
+    for (int i=0;i<N;i++){
+        const int ip = mercurius_map?mercurius_map[i]:i;
+        reb_collision_bvh_leaf_box(&particles[ip], line, dt_last_done, lb+6*i);
+        leaves[i] = i;
+    }
+    int next = 1;
+    reb_collision_bvh_build_node(box, child, leaves, lb, 0, 0, N, &next);
+    double cost = 0.;
+    for (int k=0;k<nodes_N;k++){
+        if (child[2*k]>=0){
+            cost += reb_collision_bvh_area(box+6*k);
+        }
+    }
+    free(lb);
+    free(leaves);
+    r->collision_bvh_cost = cost;
+    r->collision_bvh_N = N;
+    r->collision_bvh_builds++;
+}
+
+static int reb_collision_compare(const void* a, const void* b){
+    const struct reb_collision* ca = (const struct reb_collision*)a;
+    const struct reb_collision* cb = (const struct reb_collision*)b;
+    if (ca->p1 != cb->p1) return (ca->p1 > cb->p1) - (ca->p1 < cb->p1);
+    if (ca->p2 != cb->p2) return (ca->p2 > cb->p2) - (ca->p2 < cb->p2);
+    // Same pair found in different root or ghost boxes.
+    if (ca->ri != cb->ri) return (ca->ri > cb->ri) - (ca->ri < cb->ri);
+    if (ca->gb.shiftx != cb->gb.shiftx) return (ca->gb.shiftx > cb->gb.shiftx) - (ca->gb.shiftx < cb->gb.shiftx);
+    if (ca->gb.shifty != cb->gb.shifty) return (ca->gb.shifty > cb->gb.shifty) - (ca->gb.shifty < cb->gb.shifty);
+    return (ca->gb.shiftz > cb->gb.shiftz) - (ca->gb.shiftz < cb->gb.shiftz);
+}
+
+/**
+ * @brief Sorts collisions by (p1, p2), then by root box and ghostbox.
+ * @details For the direct and line searches, sorting the collisions found in
+ * one ghostbox recovers the order of the serial search. For the tree searches,
+ * it gives an order that does not depend on thread scheduling. The random 
+ * shuffle before resolving collisions is therefore reproducible for a given 
+ * rand_seed, independent of the number of threads.
+ */
+static void reb_collision_sort(struct reb_collision* collisions, int collisions_N){
+    if (collisions_N>1){
+        qsort(collisions, collisions_N, sizeof(struct reb_collision), reb_collision_compare);
+    }
+}
+
+/**
+ * @brief Compares two collisions by their time of impact (see reb_collision_compare() for ties).
+ */
+static int reb_collision_compare_time(const void* a, const void* b){
+    const struct reb_collision* ca = (const struct reb_collision*)a;
+    const struct reb_collision* cb = (const struct reb_collision*)b;
+    if (ca->t != cb->t) return (ca->t > cb->t) - (ca->t < cb->t);
+    return reb_collision_compare(a, b);
+}
+
+/**
+ * @brief Returns the hash bucket of the grid cell with integer coordinates (ix, iy, iz).
+ * @param mask Number of buckets minus one (the number of buckets is a power of two).
+ */
+static inline unsigned int reb_collision_grid_hash(long ix, long iy, long iz, unsigned int mask){
+    return (unsigned int)(((unsigned long)ix*73856093UL) ^ ((unsigned long)iy*19349663UL) ^ ((unsigned long)iz*83492791UL)) & mask;
+}
+
+/**
+ * @brief Sorts the particles with index j<Ninner into the buckets of a hashed uniform grid.
+ * @details A counting sort is used, so that the particles of one bucket are 
+ * stored contiguously and ordered by index in r->collision_grid_particles.
+ * The particles of bucket b are stored between the offsets 
+ * r->collision_grid_bucket[b] and r->collision_grid_bucket[b+1].
+ * @param r REBOUND simulation to work on.
+ * @param Ninner Number of particles to be sorted into the grid.
+ * @param mercurius_map If not NULL, index j refers to particle mercurius_map[j].
+ * @param hinv Inverse cell size.
+ * @return Number of buckets minus one, to be used as a mask for reb_collision_grid_hash().
+ */
+static unsigned int reb_collision_grid_update(struct reb_simulation* const r, const int Ninner, const int* const mercurius_map, const double hinv){
+    const struct reb_particle* const particles = r->particles;
+    int Nbucket = 16;
+    while (Nbucket<2*Ninner){
+        Nbucket *= 2;
+    }
+    if (r->collision_grid_bucket_allocatedN<Nbucket+1){
+        r->collision_grid_bucket = realloc(r->collision_grid_bucket,sizeof(int)*(Nbucket+1));
+        r->collision_grid_bucket_allocatedN = Nbucket+1;
+    }
+    if (r->collision_grid_particles_allocatedN<Ninner){
+        r->collision_grid_particles = realloc(r->collision_grid_particles,sizeof(int)*Ninner);
+        r->collision_grid_particles_allocatedN = Ninner;
+    }
+    int* const bucket = r->collision_grid_bucket;
+    int* const grid_particles = r->collision_grid_particles;
+    const unsigned int mask = Nbucket-1;
+    memset(bucket, 0, sizeof(int)*(Nbucket+1));
+    // Count particles in every bucket
+    for (int j=0;j<Ninner;j++){
+        const int jp = mercurius_map?mercurius_map[j]:j;
+        const struct reb_particle p = particles[jp];
+        const unsigned int b = reb_collision_grid_hash((long)floor(p.x*hinv), (long)floor(p.y*hinv), (long)floor(p.z*hinv), mask);
+        bucket[b+1]++;
+    }
+    // Offset of every bucket
+    for (int b=0;b<Nbucket;b++){
+        bucket[b+1] += bucket[b];
+    }
+    // Fill buckets. This shifts every offset by one bucket.
+    for (int j=0;j<Ninner;j++){
+        const int jp = mercurius_map?mercurius_map[j]:j;
+        const struct reb_particle p = particles[jp];
+        const unsigned int b = reb_collision_grid_hash((long)floor(p.x*hinv), (long)floor(p.y*hinv), (long)floor(p.z*hinv), mask);
+        grid_particles[bucket[b]] = j;
+        bucket[b]++;
+    }
+    for (int b=Nbucket;b>0;b--){
+        bucket[b] = bucket[b-1];
+    }
+    bucket[0] = 0;
+    return mask;
+}
+
+/**
+ * @brief Returns the ghost boxes of the inner most ring in the order used by all collision searches.
+ * @param gbs Array of at least 27 ghost boxes which is filled.
+ * @return Number of ghost boxes.
+ */
+static int reb_collision_get_inner_ghostboxes(struct reb_simulation* const r, struct reb_ghostbox* const gbs){
+    int nghostxcol = (r->nghostx>1?1:r->nghostx);
+    int nghostycol = (r->nghosty>1?1:r->nghosty);
+    int nghostzcol = (r->nghostz>1?1:r->nghostz);
+    const struct reb_ghostbox* const ghostboxes = reb_boundary_ghostboxes(r);
+    int gbs_N = 0;
+    for (int gbx=-nghostxcol; gbx<=nghostxcol; gbx++){
+    for (int gby=-nghostycol; gby<=nghostycol; gby++){
+    for (int gbz=-nghostzcol; gbz<=nghostzcol; gbz++){
+        gbs[gbs_N] = ghostboxes[reb_boundary_ghostbox_index(r, gbx,gby,gbz)];
+        gbs_N++;
+    }
+    }
+    }
+    return gbs_N;
+}
+
+/**
+ * @brief Checks if the neighbour list needs to be rebuilt.
+ * @details Two particles which were further apart than the sum of their radii 
+ * plus the skin width when the list was built can only overlap if their 
+ * displacements, the growth of their radii, and the change of the ghost box 
+ * shifts add up to more than the skin width. Particles crossing a periodic
+ * boundary have a large displacement and therefore trigger a rebuild.
+ * @return 1 if the neighbour list needs to be rebuilt.
+ */
+static int reb_collision_neighbours_check(struct reb_simulation* const r, const int N, const int Ninner, const int Nactive, const int* const mercurius_map, const double skin, const struct reb_ghostbox* const gbs, const int gbs_N){
+    if (mercurius_map){
+        return 1; // Encounter map changes every timestep
+    }
+    if (r->collision_neighbours_built[0]!=N || r->collision_neighbours_built[1]!=Ninner || r->collision_neighbours_built[2]!=Nactive || r->collision_neighbours_skin!=skin){
+        return 1;
+    }
+    const struct reb_particle* const particles = r->particles;
+    const double* const xb = r->collision_neighbours_x;
+    // Two largest displacements
+    double d1 = 0.;
+    double d2 = 0.;
+    for (int i=0;i<N;i++){
+        const double dx = particles[i].x - xb[4*i];
+        const double dy = particles[i].y - xb[4*i+1];
+        const double dz = particles[i].z - xb[4*i+2];
+        const double d = sqrt(dx*dx + dy*dy + dz*dz) + fabs(particles[i].r - xb[4*i+3]);
+        if (d>d1){
+            d2 = d1;
+            d1 = d;
+        }else if (d>d2){
+            d2 = d;
+        }
+    }
+    double dgb = 0.;
+    for (int g=0;g<gbs_N;g++){
+        const double dx = gbs[g].shiftx - r->collision_neighbours_gb[3*g];
+        const double dy = gbs[g].shifty - r->collision_neighbours_gb[3*g+1];
+        const double dz = gbs[g].shiftz - r->collision_neighbours_gb[3*g+2];
+        dgb = MAX(dgb, sqrt(dx*dx + dy*dy + dz*dz));
+    }
+    return (d1 + d2 + dgb > skin);
+}
+
+/**
+ * @brief Records the positions, radii and ghost box shifts used by reb_collision_neighbours_check().
+ * @details Called every time the neighbour list is rebuilt. The list itself is emptied.
+ */
+static void reb_collision_neighbours_store(struct reb_simulation* const r, const int N, const int Ninner, const int Nactive, const double skin, const struct reb_ghostbox* const gbs, const int gbs_N){
+    const struct reb_particle* const particles = r->particles;
+    r->collision_neighbours_builds++;
+    r->collision_neighbours_built[0] = N;
+    r->collision_neighbours_built[1] = Ninner;
+    r->collision_neighbours_built[2] = Nactive;
+    r->collision_neighbours_skin = skin;
+    if (r->collision_neighbours_x_allocatedN<N){
+        r->collision_neighbours_x = realloc(r->collision_neighbours_x, sizeof(double)*4*N);
+        r->collision_neighbours_x_allocatedN = N;
+    }
+    for (int i=0;i<N;i++){
+        r->collision_neighbours_x[4*i]   = particles[i].x;
+        r->collision_neighbours_x[4*i+1] = particles[i].y;
+        r->collision_neighbours_x[4*i+2] = particles[i].z;
+        r->collision_neighbours_x[4*i+3] = particles[i].r;
+    }
+    for (int g=0;g<gbs_N;g++){
+        r->collision_neighbours_gb[3*g]   = gbs[g].shiftx;
+        r->collision_neighbours_gb[3*g+1] = gbs[g].shifty;
+        r->collision_neighbours_gb[3*g+2] = gbs[g].shiftz;
+    }
+    r->collision_neighbours_N = 0;
+}
+
+/**
+ * @brief Sorts the candidate pairs of ghost box g and appends them to the neighbour list.
+ */
+static void reb_collision_neighbours_append(struct reb_simulation* const r, struct reb_collision* const pairs, const int pairs_N, const int g){
+    reb_collision_sort(pairs, pairs_N);
+    if (r->collision_neighbours_allocatedN < r->collision_neighbours_N+pairs_N){
+        r->collision_neighbours_allocatedN = MAX(2*r->collision_neighbours_allocatedN, r->collision_neighbours_N+pairs_N);
+        r->collision_neighbours = realloc(r->collision_neighbours, sizeof(int)*3*r->collision_neighbours_allocatedN);
+    }
+    int* const nb = r->collision_neighbours + 3*r->collision_neighbours_N;
+    for (int k=0;k<pairs_N;k++){
+        nb[3*k]   = pairs[k].p1;
+        nb[3*k+1] = pairs[k].p2;
+        nb[3*k+2] = g;
+    }
+    r->collision_neighbours_N += pairs_N;
+}
+
+/**
+ * @brief Builds the list of all pairs which are closer than the sum of their radii plus the skin width.
+ * @details Uses the hashed uniform grid of REB_COLLISION_GRID. Pairs are 
+ * stored in the same order in which REB_COLLISION_DIRECT finds collisions.
+ */
+static void reb_collision_neighbours_build(struct reb_simulation* const r, const int N, const int Ninner, const int Nactive, const int* const mercurius_map, const double skin, const struct reb_ghostbox* const gbs, const int gbs_N){
+    const struct reb_particle* const particles = r->particles;
+    reb_collision_neighbours_store(r, N, Ninner, Nactive, skin, gbs, gbs_N);
+    double rmax = 0.;
+    for (int j=0;j<Ninner;j++){
+        const int jp = mercurius_map?mercurius_map[j]:j;
+        rmax = MAX(rmax, particles[jp].r);
+    }
+    double h = 2.*rmax + skin;
+    if (h<=0.){
+        h = 1.;
+    }
+    const double hinv = 1./h;
+    const unsigned int mask = reb_collision_grid_update(r, Ninner, mercurius_map, hinv);
+    const int* const bucket = r->collision_grid_bucket;
+    const int* const grid_particles = r->collision_grid_particles;
+    // Pairs of one ghost box, sorted before they are added to the list.
+    struct reb_collision* pairs = NULL;
+    int pairs_N = 0;
+    int pairs_allocatedN = 0;
+    for (int g=0;g<gbs_N;g++){
+        pairs_N = 0;
+        for (int i=0;i<N;i++){
+            const int ip = mercurius_map?mercurius_map[i]:i;
+            const struct reb_particle p1 = particles[ip];
+            const double gbx = gbs[g].shiftx + p1.x;
+            const double gby = gbs[g].shifty + p1.y;
+            const double gbz = gbs[g].shiftz + p1.z;
+            const int nc = (int)ceil((p1.r+rmax+skin)*hinv);
+            const double ncells = (2.*nc+1.)*(2.*nc+1.)*(2.*nc+1.);
+            const int brute_force = ncells>Ninner;
+            const long cx = (long)floor(gbx*hinv);
+            const long cy = (long)floor(gby*hinv);
+            const long cz = (long)floor(gbz*hinv);
+            const int ncx = brute_force?0:nc;
+            for (long ix=cx-ncx; ix<=cx+ncx; ix++){
+            for (long iy=cy-ncx; iy<=cy+ncx; iy++){
+            for (long iz=cz-ncx; iz<=cz+ncx; iz++){
+                int kstart = 0;
+                int kend = Ninner;
+                if (!brute_force){
+                    const unsigned int b = reb_collision_grid_hash(ix, iy, iz, mask);
+                    kstart = bucket[b];
+                    kend = bucket[b+1];
+                }
+                for (int k=kstart;k<kend;k++){
+                    const int j = brute_force?k:grid_particles[k];
+                    if (i==j) continue;
+                    if (i>=Nactive && j>=Nactive) continue;
+                    const int jp = mercurius_map?mercurius_map[j]:j;
+                    const struct reb_particle* const p2 = &particles[jp];
+                    if (!brute_force){
+                        // Different cells can share the same bucket
+                        if ((long)floor(p2->x*hinv)!=ix || (long)floor(p2->y*hinv)!=iy || (long)floor(p2->z*hinv)!=iz) continue;
+                    }
+                    const double dx = gbx - p2->x;
+                    const double dy = gby - p2->y;
+                    const double dz = gbz - p2->z;
+                    const double rs = p1.r + p2->r + skin;
+                    if (dx*dx + dy*dy + dz*dz > rs*rs) continue;
+                    struct reb_collision c = {.p1 = ip, .p2 = jp, .gb = gbs[g]};
+                    reb_collision_append(&pairs, &pairs_N, &pairs_allocatedN, c);
+                }
+            }
+            }
+            }
+        }
+        reb_collision_neighbours_append(r, pairs, pairs_N, g);
+    }
+    free(pairs);
+}
+
+/**
+ * @brief Returns the first position in the sorted array q[0...N-1] with q[k] >= qmin.
+ */
+static int reb_collision_lower_bound(const double* const q, const int N, const double qmin){
+    int lo = 0;
+    int hi = N;
+    while (lo<hi){
+        const int mid = lo + (hi-lo)/2;
+        if (q[mid]<qmin){
+            lo = mid+1;
+        }else{
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * @brief Builds the same neighbour list as reb_collision_neighbours_build() from the active particles.
+ * @details Only used if test particle pairs are skipped (Nactive<N). Particles are 
+ * kept sorted along one axis with reb_collision_sap_update(), which is O(N) if the
+ * order barely changed since the last build. For every active particle, the 
+ * candidates are then found in a slab of width 2*(r_i + 2*rmax + skin) around it.
+ * A single large active particle therefore does not increase the work done for
+ * the test particles far away from it.
+ */
+static void reb_collision_neighbours_build_active(struct reb_simulation* const r, const int N, const int Ninner, const int Nactive, const int* const mercurius_map, const double skin, const struct reb_ghostbox* const gbs, const int gbs_N){
+    const struct reb_particle* const particles = r->particles;
+    reb_collision_neighbours_store(r, N, Ninner, Nactive, skin, gbs, gbs_N);
+    // Reuses the order of the sweep and prune search. Lower bounds are q-r (plus padding).
+    const double wmax = reb_collision_sap_update(r, N, mercurius_map, 0);
+    const int axis = r->collision_sap_axis;
+    const int* const sap_particles = r->collision_sap_particles;
+    const double* const q = r->collision_sap_lower;
+    // Pairs of one ghost box, sorted before they are added to the list.
+    struct reb_collision* pairs = NULL;
+    int pairs_N = 0;
+    int pairs_allocatedN = 0;
+    for (int g=0;g<gbs_N;g++){
+        pairs_N = 0;
+        const double shift = reb_collision_sap_component(gbs[g].shiftx, gbs[g].shifty, gbs[g].shiftz, axis);
+        // Active particle i as p1, all particles j<Ninner as p2.
+        for (int i=0;i<Nactive;i++){
+            const int ip = mercurius_map?mercurius_map[i]:i;
+            const struct reb_particle p1 = particles[ip];
+            const double gbx = gbs[g].shiftx + p1.x;
+            const double gby = gbs[g].shifty + p1.y;
+            const double gbz = gbs[g].shiftz + p1.z;
+            const double center = reb_collision_sap_component(gbx, gby, gbz, axis);
+            // Padded so that roundoff errors cannot remove a candidate from the slab.
+            double w = p1.r + wmax + skin;
+            w += 1e-12*(fabs(center) + w);
+            for (int k=reb_collision_lower_bound(q, N, center-w); k<N && q[k]<=center+w; k++){
+                const int j = sap_particles[k];
+                if (i==j || j>=Ninner) continue;
+                const int jp = mercurius_map?mercurius_map[j]:j;
+                const struct reb_particle* const p2 = &particles[jp];
+                const double dx = gbx - p2->x;
+                const double dy = gby - p2->y;
+                const double dz = gbz - p2->z;
+                const double rs = p1.r + p2->r + skin;
+                if (dx*dx + dy*dy + dz*dz > rs*rs) continue;
+                struct reb_collision c = {.p1 = ip, .p2 = jp, .gb = gbs[g]};
+                reb_collision_append(&pairs, &pairs_N, &pairs_allocatedN, c);
+            }
+        }
+        // Test particle i as p1, active particles j as p2.
+        for (int j=0;j<MIN(Ninner,Nactive);j++){
+            const int jp = mercurius_map?mercurius_map[j]:j;
+            const struct reb_particle* const p2 = &particles[jp];
+            const double center = reb_collision_sap_component(p2->x, p2->y, p2->z, axis) - shift;
+            double w = p2->r + wmax + skin;
+            w += 1e-12*(fabs(center) + fabs(shift) + w);
+            for (int k=reb_collision_lower_bound(q, N, center-w); k<N && q[k]<=center+w; k++){
+                const int i = sap_particles[k];
+                if (i<Nactive) continue;
+                const int ip = mercurius_map?mercurius_map[i]:i;
+                const struct reb_particle* const p1 = &particles[ip];
+                const double dx = gbs[g].shiftx + p1->x - p2->x;
+                const double dy = gbs[g].shifty + p1->y - p2->y;
+                const double dz = gbs[g].shiftz + p1->z - p2->z;
+                const double rs = p1->r + p2->r + skin;
+                if (dx*dx + dy*dy + dz*dz > rs*rs) continue;
+                struct reb_collision c = {.p1 = ip, .p2 = jp, .gb = gbs[g]};
+                reb_collision_append(&pairs, &pairs_N, &pairs_allocatedN, c);
+            }
+        }
+        reb_collision_neighbours_append(r, pairs, pairs_N, g);
+    }
+    free(pairs);
+}
+
+#ifndef MPI
+/**
+ * @brief Resolves hard-sphere collisions in batches of independent collisions.
+ * @details Every collision is assigned to the batch after the last batch 
+ * containing one of its particles. The collisions within one batch do not 
+ * share any particles and are resolved in parallel. Because the collisions of
+ * every particle are resolved in the same order as in the serial loop, the
+ * results are identical to resolving collisions one after another.
+ */
+static void reb_collision_resolve_hardsphere_parallel(struct reb_simulation* const r, const struct reb_collision* const collisions, const int collisions_N){
+    const int N = r->N;
+    int* batch = malloc(sizeof(int)*collisions_N);
+    int* last_batch = calloc(N, sizeof(int)); // Last batch + 1 of every particle
+    int batches_N = 0;
+    for (int k=0;k<collisions_N;k++){
+        const int p1 = collisions[k].p1;
+        const int p2 = collisions[k].p2;
+        const int b = MAX(last_batch[p1], last_batch[p2]);
+        batch[k] = b;
+        last_batch[p1] = b+1;
+        last_batch[p2] = b+1;
+        batches_N = MAX(batches_N, b+1);
+    }
+    free(last_batch);
+    // Counting sort by batch 
+    int* batch_start = calloc(batches_N+1, sizeof(int));
+    for (int k=0;k<collisions_N;k++){
+        batch_start[batch[k]+1]++;
+    }
+    for (int b=0;b<batches_N;b++){
+        batch_start[b+1] += batch_start[b];
+    }
+    int* order = malloc(sizeof(int)*collisions_N);
+    {
+        int* fill = malloc(sizeof(int)*batches_N);
+        memcpy(fill, batch_start, sizeof(int)*batches_N);
+        for (int k=0;k<collisions_N;k++){
+            order[fill[batch[k]]++] = k;
+        }
+        free(fill);
+    }
+    free(batch);
+    double* plog = malloc(sizeof(double)*collisions_N);
+    int* resolved = malloc(sizeof(int)*collisions_N);
+    for (int b=0;b<batches_N;b++){
+        const int start = batch_start[b];
+        const int end = batch_start[b+1];
+#pragma omp parallel for schedule(guided) if(end-start>64)
+        for (int o=start;o<end;o++){
+            const int k = order[o];
+            resolved[k] = reb_collision_hardsphere(r, collisions[k], &plog[k]);
+        }
+    }
+    // Sum up in the original order
+    for (int k=0;k<collisions_N;k++){
+        if (resolved[k]){
+            r->collisions_plog += plog[k];
+            r->collisions_Nlog ++;
+        }
+    }
+    free(plog);
+    free(resolved);
+    free(order);
+    free(batch_start);
+}
+#endif // MPI
+
+/**
+ * @brief Returns the ghost box shifted by the position and velocity of particle p.
+ * @details The result is the first argument of reb_collision_check_overlap() and reb_collision_check_line().
+ */
+static inline struct reb_ghostbox reb_collision_ghostbox_shift(struct reb_ghostbox gb, const struct reb_particle* const p){
+    gb.shiftx += p->x;
+    gb.shifty += p->y;
+    gb.shiftz += p->z;
+    gb.shiftvx += p->vx;
+    gb.shiftvy += p->vy;
+    gb.shiftvz += p->vz;
+    return gb;
+}
+
+/**
+ * @brief State of the collision search of one timestep, shared by all particles.
+ */
+struct reb_collision_search_state {
+    const int* mercurius_map;   // Particle indices of the MERCURIUS encounter. NULL if all particles are searched.
+    int N;                      // Number of particles searched.
+    int Ninner;                 // Only the first Ninner particles are considered as p2.
+    int Nactive;                // Particles with index >= Nactive are test particles.
+    int sleeping;               // Set if sleeping particles are skipped as p1.
+    int line;                   // Set for the searches along the trajectories of the last timestep.
+    double dt_last_done;        // Length of the last timestep.
+    long pairs;                 // Work counters, see reb_collision_statistics.
+    long nodes;
+    long ghostboxes;
+    const double* soa;          // Packed particles of the line search or of the direct search with use_soa.
+    int soa_N;                  // Padded number of particles in soa (use_soa only).
+    const double* xv0;          // Line search: positions and velocities at the beginning of the timestep, or NULL.
+    const double* poly;         // Line search: IAS15 trajectories of the last timestep, or NULL.
+    double rmax;                // Grid: largest radius.
+    double hinv;                // Grid: inverse cell size.
+    unsigned int mask;          // Grid: number of buckets minus one.
+    double wmax;                // Sweep and prune: largest interval width.
+    int axis;                   // Sweep and prune: sweep axis.
+};
+
+/**
+ * @brief Calls search() for the loop indices 0...Nloop-1 and collects the collisions in r->collisions.
+ * @details Loops over the ghost boxes of the inner most ring. If ghostboxes_inside is 0, the ghost boxes 
+ * are the outer loop and search() gets one ghost box at a time. Otherwise, search() gets all ghost boxes.
+ * search() appends the collisions it finds with reb_collision_append() to the array it is passed and 
+ * adds its work to stats, which is zero initialized for every call.
+ * With OpenMP, every thread collects collisions in its own array and the collisions of every 
+ * pass are sorted afterwards (see reb_collision_sort()). Without OpenMP, they are only sorted if sort is set.
+ * @return Number of collisions found or -1 if the search was interrupted.
+ */
+static int reb_collision_search_particles(struct reb_simulation* const r, struct reb_collision_search_state* const s, const int Nloop, const int ghostboxes_inside, const int sort, void (*search) (struct reb_simulation* const r, const struct reb_collision_search_state* const s, const int i, const struct reb_ghostbox* const gbs, const int gbs_N, struct reb_collision** collisions, int* collisions_N, int* collisions_allocatedN, struct reb_collision_statistics* const stats)){
+    struct reb_ghostbox gbs[27];
+    const int gbs_N = reb_collision_get_inner_ghostboxes(r, gbs);
+    const int passes_N = ghostboxes_inside?1:gbs_N;
+    int collisions_N = 0;
+    long pairs = 0;
+    long nodes = 0;
+    long ghostboxes = 0;
+    for (int g=0;g<passes_N;g++){
+        const struct reb_ghostbox* const gbs_pass = ghostboxes_inside?gbs:gbs+g;
+        const int gbs_pass_N = ghostboxes_inside?gbs_N:1;
+        if (!ghostboxes_inside){
+            ghostboxes++;
+        }
+        const int collisions_N_start = collisions_N;
+#ifdef OPENMP
+#pragma omp parallel
+        {
+        // Every thread collects collisions in its own array.
+        struct reb_collision* collisions_local = NULL;
+        int collisions_local_N = 0;
+        int collisions_local_allocatedN = 0;
+        struct reb_collision** const collisions_buf = &collisions_local;
+        int* const collisions_buf_N = &collisions_local_N;
+        int* const collisions_buf_allocatedN = &collisions_local_allocatedN;
+#pragma omp for schedule(guided) reduction(+:pairs,nodes,ghostboxes)
+#else // OPENMP
+        struct reb_collision** const collisions_buf = &r->collisions;
+        int* const collisions_buf_N = &collisions_N;
+        int* const collisions_buf_allocatedN = &r->collisions_allocatedN;
+#endif // OPENMP
+        for (int i=0;i<Nloop;i++){
+#ifndef OPENMP
+            if (reb_sigint) return -1;
+#endif // OPENMP
+            struct reb_collision_statistics stats = {0};
+            search(r, s, i, gbs_pass, gbs_pass_N, collisions_buf, collisions_buf_N, collisions_buf_allocatedN, &stats);
+            pairs += stats.pairs;
+            nodes += stats.nodes;
+            ghostboxes += stats.ghostboxes;
+        }
+#ifdef OPENMP
+        reb_collision_merge_local(r, &collisions_N, collisions_local, collisions_local_N);
+        }
+        reb_collision_sort(r->collisions+collisions_N_start, collisions_N-collisions_N_start);
+#else // OPENMP
+        if (sort){
+            reb_collision_sort(r->collisions+collisions_N_start, collisions_N-collisions_N_start);
+        }
+#endif // OPENMP
+    }
+    s->pairs += pairs;
+    s->nodes += nodes;
+    s->ghostboxes += ghostboxes;
+    return collisions_N;
+}
+
+/**
+ * @brief Adds the pair (ip, jp) to the collision array if the particles overlap.
+ */
+static inline void reb_collision_check_pair(struct reb_simulation* const r, int* collisions_N, const struct reb_ghostbox gborig, const int ip, const int jp){
+    const struct reb_particle* const particles = r->particles;
+    const struct reb_ghostbox gb = reb_collision_ghostbox_shift(gborig, &particles[ip]);
+    if (!reb_collision_check_overlap(&gb, particles[ip].r, &particles[jp])) return;
+    struct reb_collision c = {.p1 = ip, .p2 = jp, .gb = gborig};
+    reb_collision_append(&r->collisions, collisions_N, &r->collisions_allocatedN, c);
+}
+
+/**
+ * @brief Direct collision search during a MERCURIUS encounter step.
+ * @details Instead of all pairs in the encounter, only the pairs predicted to
+ * have a close encounter are checked, together with all pairs involving the
+ * star and (unless collision_skip_testparticle_pairs is set) pairs of two test
+ * particles. The collisions are found in the same order as in the loop over
+ * all pairs.
+ * @return Number of collisions found.
+ */
+static int reb_collision_search_mercurius_pairs(struct reb_simulation* const r, struct reb_collision_search_state* const s){
+    const struct reb_simulation_integrator_mercurius* const rim = &(r->ri_mercurius);
+    const int* const map = rim->encounter_map;
+    const int* const pairs = rim->encounter_pairs;
+    const int encounterN = rim->encounterN;
+    const int testparticle_pairs = r->N_active!=-1 && !r->collision_skip_testparticle_pairs;
+    int collisions_N = 0;
+    struct reb_ghostbox gbs[27];
+    const int gbs_N = reb_collision_get_inner_ghostboxes(r, gbs);
+    for (int g=0;g<gbs_N;g++){
+        const struct reb_ghostbox gborig = gbs[g];
+        const int collisions_N_start = collisions_N;
+        s->ghostboxes++;
+        s->pairs += 2*(encounterN-1) + 2*rim->encounter_pairs_N;
+        if (testparticle_pairs){
+            const long Ntest = encounterN-rim->encounterNactive;
+            s->pairs += Ntest*(Ntest-1);
+        }
+        // Star (always the first particle in the encounter)
+        for (int k=1;k<encounterN;k++){
+            reb_collision_check_pair(r, &collisions_N, gborig, 0, map[k]);
+            reb_collision_check_pair(r, &collisions_N, gborig, map[k], 0);
+        }
+        // Pairs predicted by the encounter prediction
+        for (unsigned int k=0;k<rim->encounter_pairs_N;k++){
+            reb_collision_check_pair(r, &collisions_N, gborig, pairs[2*k], pairs[2*k+1]);
+            reb_collision_check_pair(r, &collisions_N, gborig, pairs[2*k+1], pairs[2*k]);
+        }
+        // Test particles are not included in the prediction
+        if (testparticle_pairs){
+            for (int i=rim->encounterNactive;i<encounterN;i++){
+                for (int j=rim->encounterNactive;j<encounterN;j++){
+                    if (i==j) continue;
+                    reb_collision_check_pair(r, &collisions_N, gborig, map[i], map[j]);
+                }
+            }
+        }
+        reb_collision_sort(r->collisions+collisions_N_start, collisions_N-collisions_N_start);
+    }
+    return collisions_N;
+}
+
+/**
+ * @brief Direct collision search for particle i on r->particles_soa, see reb_collision_search_particles().
+ * @details Used if use_soa is set. The same collisions are found in the same order as by reb_collision_search_direct_particle().
+ */
+static void reb_collision_search_direct_soa_particle(struct reb_simulation* const r, const struct reb_collision_search_state* const s, const int i, const struct reb_ghostbox* const gbs, const int gbs_N, struct reb_collision** collisions, int* collisions_N, int* collisions_allocatedN, struct reb_collision_statistics* const stats){
+    const struct reb_particle* const particles = r->particles;
+    for (int g=0;g<gbs_N;g++){
+        const double p1_r = particles[i].r;
+        // Precalculate shifted position 
+        const struct reb_ghostbox gb = reb_collision_ghostbox_shift(gbs[g], &particles[i]);
+        // Loop over all particles again (only active ones if p1 is a test particle), 8 at a time
+        const int jmax = (i<s->Nactive)?s->Ninner:MIN(s->Ninner,s->Nactive);
+        stats->pairs += jmax - (i<jmax);
+        for (int j0=0;j0<jmax;j0+=8){
+            unsigned int hits = reb_collision_check_overlap_block(&gb, p1_r, s->soa, s->soa_N, j0);
+            if (jmax-j0<8){
+                hits &= (1u<<(jmax-j0))-1u; // Padding
+            }
+            if (i>=j0 && i<j0+8){
+                hits &= ~(1u<<(i-j0)); // Do not collide particle with itself.
+            }
+            if (!hits) continue;
+            for (int k=0;k<8;k++){
+                if (!(hits & (1u<<k))) continue;
+                if (!reb_collision_check_overlap(&gb, p1_r, &particles[j0+k])) continue;
+                // Add particles to collision array.
+                struct reb_collision c = {.p1 = i, .p2 = j0+k, .gb = gbs[g]};
+                reb_collision_append(collisions, collisions_N, collisions_allocatedN, c);
+            }
+        }
+    }
+}
+
+#ifdef GPU
+#define REB_COLLISION_GPU_MIN_N 4096   ///< Smaller numbers of particles are searched on the host.
+
+void reb_collision_gpu_free(struct reb_simulation* const r){
+    if (r->collision_gpu){
+        double* const buffer = r->collision_gpu;
+        const int N_buffer = 7*r->collision_gpu_allocatedN;
+#pragma omp target exit data map(delete: buffer[0:N_buffer])
+        free(buffer);
+    }
+    if (r->collision_gpu_pairs){
+        int* const pairs = r->collision_gpu_pairs;
+        const int N_pairs = 2*r->collision_gpu_pairs_allocatedN;
+#pragma omp target exit data map(delete: pairs[0:N_pairs])
+        free(pairs);
+    }
+    r->collision_gpu = NULL;
+    r->collision_gpu_allocatedN = 0;
+    r->collision_gpu_pairs = NULL;
+    r->collision_gpu_pairs_allocatedN = 0;
+}
+
+/**
+ * @brief Direct (line=0) or line (line=1) collision search on the GPU using OpenMP target offloading.
+ * @details Positions, velocities and radii are copied into r->collision_gpu, which is mirrored 
+ * on the device. The device tests the same pairs with the same arithmetic as the
+ * REB_COLLISION_DIRECT and REB_COLLISION_LINE searches on the host. Colliding pairs are 
+ * appended to r->collision_gpu_pairs with an atomic counter and only this compacted list 
+ * is copied back. If the list does not fit, it is enlarged and the ghost box is searched again.
+ * The collisions of every ghost box are sorted to recover the order of the serial search.
+ * @return Number of collisions found.
+ */
+static int reb_collision_search_gpu(struct reb_simulation* const r, struct reb_collision_search_state* const s){
+    const struct reb_particle* const particles = r->particles;
+    const int N = s->N;
+    const int Ninner = s->Ninner;
+    const int Nactive = s->Nactive;
+    const int line = s->line;
+    if (r->collision_gpu_allocatedN<N){
+        if (r->collision_gpu){
+            double* const buffer = r->collision_gpu;
+            const int N_buffer = 7*r->collision_gpu_allocatedN;
+#pragma omp target exit data map(delete: buffer[0:N_buffer])
+            free(buffer);
+        }
+        const int N_alloc = N*2;
+        const int N_buffer = 7*N_alloc;
+        double* const buffer = malloc(sizeof(double)*N_buffer);
+#pragma omp target enter data map(alloc: buffer[0:N_buffer])
+        r->collision_gpu = buffer;
+        r->collision_gpu_allocatedN = N_alloc;
+    }
+    // Layout: x, y, z, vx, vy, vz, r, each with collision_gpu_allocatedN entries
+    const int stride = r->collision_gpu_allocatedN;
+    double* const x  = r->collision_gpu;
+    double* const y  = r->collision_gpu + stride;
+    double* const z  = r->collision_gpu + 2*stride;
+    double* const vx = r->collision_gpu + 3*stride;
+    double* const vy = r->collision_gpu + 4*stride;
+    double* const vz = r->collision_gpu + 5*stride;
+    double* const pr = r->collision_gpu + 6*stride;
+#pragma omp parallel for
+    for (int i=0; i<N; i++){
+        x[i] = particles[i].x;
+        y[i] = particles[i].y;
+        z[i] = particles[i].z;
+        vx[i] = particles[i].vx;
+        vy[i] = particles[i].vy;
+        vz[i] = particles[i].vz;
+        pr[i] = particles[i].r;
+    }
+#pragma omp target update to(x[0:N], y[0:N], z[0:N], vx[0:N], vy[0:N], vz[0:N], pr[0:N])
+
+    const double dt_last_done = r->dt_last_done;
+    // REB_COLLISION_LINE only needs j>i, so test particles only need to be considered as p2.
+    const int Ni = line?Nactive:N;
+    long pairs_tested = 0;
+    for (int i=0;i<Ni;i++){
+        if (line){
+            pairs_tested += N-i-1;
+        }else{
+            const int jmax = (i<Nactive)?Ninner:MIN(Ninner,Nactive);
+            pairs_tested += jmax - (i<jmax);
+        }
+    }
+    int collisions_N = 0;
+    struct reb_ghostbox gbs[27];
+    const int gbs_N = reb_collision_get_inner_ghostboxes(r, gbs);
+    for (int g=0;g<gbs_N;g++){
+        const struct reb_ghostbox gborig = gbs[g];
+        const double sx = gborig.shiftx;
+        const double sy = gborig.shifty;
+        const double sz = gborig.shiftz;
+        const double svx = gborig.shiftvx;
+        const double svy = gborig.shiftvy;
+        const double svz = gborig.shiftvz;
+        s->ghostboxes++;
+        s->pairs += pairs_tested;
+        int pairs_N;
+        while (1){
+            int* const pairs = r->collision_gpu_pairs;
+            const int pairs_allocatedN = r->collision_gpu_pairs_allocatedN;
+            int count = 0;
+#pragma omp target teams distribute parallel for map(tofrom: count)
+            for (int i=0;i<Ni;i++){
+                const double xi = sx + x[i];
+                const double yi = sy + y[i];
+                const double zi = sz + z[i];
+                const double vxi = svx + vx[i];
+                const double vyi = svy + vy[i];
+                const double vzi = svz + vz[i];
+                const double ri = pr[i];
+                const int jmin = line?i+1:0;
+                const int jmax = line?N:((i<Nactive)?Ninner:MIN(Ninner,Nactive));
+                for (int j=jmin;j<jmax;j++){
+                    // Do not collide particle with itself.
+                    if (i==j) continue;
+                    const double dx = xi - x[j];
+                    const double dy = yi - y[j];
+                    const double dz = zi - z[j];
+                    const double dvx = vxi - vx[j];
+                    const double dvy = vyi - vy[j];
+                    const double dvz = vzi - vz[j];
+                    const double sr = ri + pr[j];
+                    const double r1 = dx*dx + dy*dy + dz*dz;
+                    if (line){
+                        // Same as reb_collision_check_line()
+                        const double dx2 = dx - dt_last_done*dvx;
+                        const double dy2 = dy - dt_last_done*dvy;
+                        const double dz2 = dz - dt_last_done*dvz;
+                        const double r2 = dx2*dx2 + dy2*dy2 + dz2*dz2;
+                        const double t_closest = (dx*dvx + dy*dvy + dz*dvz)/(dvx*dvx + dvy*dvy + dvz*dvz);
+                        double rmin2 = MIN(r1,r2);
+                        if (t_closest/dt_last_done>=0. && t_closest/dt_last_done<=1.){
+                            const double dx3 = dx - t_closest*dvx;
+                            const double dy3 = dy - t_closest*dvy;
+                            const double dz3 = dz - t_closest*dvz;
+                            const double r3 = dx3*dx3 + dy3*dy3 + dz3*dz3;
+                            rmin2 = MIN(rmin2, r3);
+                        }
+                        if (rmin2>sr*sr) continue;
+                    }else{
+                        // Same as reb_collision_check_overlap()
+                        if (r1>sr*sr) continue;
+                        if (dvx*dx + dvy*dy + dvz*dz >0) continue;
+                    }
+                    int k;
+#pragma omp atomic capture
+                    k = count++;
+                    if (k<pairs_allocatedN){
+                        pairs[2*k] = i;
+                        pairs[2*k+1] = j;
+                    }
+                }
+            }
+            pairs_N = count;
+            if (pairs_N<=pairs_allocatedN){
+                break;
+            }
+            // Not enough space. Enlarge the list and search this ghost box again.
+            if (pairs){
+                const int N_pairs = 2*pairs_allocatedN;
+#pragma omp target exit data map(delete: pairs[0:N_pairs])
+                free(pairs);
+            }
+            const int N_alloc = MAX(2*pairs_N, 1024);
+            const int N_pairs = 2*N_alloc;
+            int* const pairs_new = malloc(sizeof(int)*N_pairs);
+#pragma omp target enter data map(alloc: pairs_new[0:N_pairs])
+            r->collision_gpu_pairs = pairs_new;
+            r->collision_gpu_pairs_allocatedN = N_alloc;
+        }
+        if (pairs_N==0) continue;
+        int* const pairs = r->collision_gpu_pairs;
+#pragma omp target update from(pairs[0:2*pairs_N])
+        const int collisions_N_start = collisions_N;
+        for (int k=0;k<pairs_N;k++){
+            struct reb_collision c = {.p1 = pairs[2*k], .p2 = pairs[2*k+1], .gb = gborig};
+            reb_collision_append(&r->collisions, &collisions_N, &r->collisions_allocatedN, c);
+        }
+        reb_collision_sort(r->collisions+collisions_N_start, collisions_N-collisions_N_start);
+    }
+    return collisions_N;
+}
+#endif // GPU
+
+/**
+ * @brief Shuffles the collision array with the random number generator of the simulation.
+ */
+static void reb_collision_shuffle(struct reb_simulation* const r, struct reb_collision* const collisions, const int collisions_N){
+    for (int i=0;i<collisions_N;i++){
+        int new = rand_r(&(r->rand_seed))%collisions_N;
+        struct reb_collision c1 = collisions[i];
+        collisions[i] = collisions[new];
+        collisions[new] = c1;
+    }
+}
+
+#ifdef MPI
+/**
+ * @brief Appends a copy of a particle of another node to the end of the particle array.
+ * @details The copy is only used to resolve collisions and removed at the end of reb_collision_search().
+ * @return Index of the copy.
+ */
+static int reb_collision_append_temporary(struct reb_simulation* const r, struct reb_particle p){
+    if (r->allocatedN<=r->N){
+        int allocatedN = r->allocatedN;
+        while (allocatedN<=r->N){
+            allocatedN = allocatedN ? allocatedN * 2 : 128;
+        }
+        r->particles = reb_tools_realloc_aligned(r->particles, sizeof(struct reb_particle), r->N, allocatedN);
+        r->allocatedN = allocatedN;
+    }
+    p.c = NULL;
+    p.ap = NULL;
+    p.sim = r;
+    r->particles[r->N] = p;
+    return r->N++;
+}
+
+/**
+ * @brief Shares collisions between test particles and active particles with all nodes.
+ * @details Used with the test particle decomposition. Every node has a copy of the active 
+ * particles but only its own test particles. A collision between a test particle and an active 
+ * particle can change the active particle, so all nodes resolve all such collisions in the 
+ * same order. The test particles of other nodes are temporarily appended to the particle array.
+ * The collision array is reordered: collisions between active particles (found on every node) 
+ * come first, then the collisions of all nodes with test particles ordered by node, and 
+ * finally collisions between two local test particles.
+ * @param collisions_N Pointer to the number of collisions. Updated.
+ * @return Number of particles appended to the particle array.
+ */
+static int reb_collision_gather_testparticle_decomposition(struct reb_simulation* const r, int* const collisions_N){
+    const int N_active = r->N_active;
+    const int N = *collisions_N;
+    struct reb_collision* const active = malloc(sizeof(struct reb_collision)*(N+1));
+    struct reb_collision* const testparticles = malloc(sizeof(struct reb_collision)*(N+1));
+    struct reb_communication_mpi_collision* const send = malloc(sizeof(struct reb_communication_mpi_collision)*(N+1));
+    int active_N = 0;
+    int testparticles_N = 0;
+    int send_N = 0;
+    for (int i=0;i<N;i++){
+        const struct reb_collision c = r->collisions[i];
+        if (c.p1 == -1 || c.p2 == -1){
+            continue;
+        }
+        if (c.p1<N_active && c.p2<N_active){
+            active[active_N++] = c;
+        }else if (c.p1>=N_active && c.p2>=N_active){
+            testparticles[testparticles_N++] = c;
+        }else{
+            send[send_N].c = c;
+            send[send_N].p = r->particles[c.p1<N_active?c.p2:c.p1];
+            send_N++;
+        }
+    }
+    int recv_N = 0;
+    int recv_offset = 0;
+    struct reb_communication_mpi_collision* const recv = reb_communication_mpi_gather_collisions(r, send, send_N, &recv_N, &recv_offset);
+
+    const int collisions_N_new = active_N + recv_N + testparticles_N;
+    if (r->collisions_allocatedN<collisions_N_new){
+        r->collisions_allocatedN = collisions_N_new;
+        r->collisions = realloc(r->collisions, sizeof(struct reb_collision)*collisions_N_new);
+    }
+    memcpy(r->collisions, active, sizeof(struct reb_collision)*active_N);
+    int temporary_N = 0;
+    for (int k=0;k<recv_N;k++){
+        struct reb_collision c = recv[k].c;
+        if (k<recv_offset || k>=recv_offset+send_N){
+            // Test particle of another node
+            const int index = reb_collision_append_temporary(r, recv[k].p);
+            if (c.p1<N_active){
+                c.p2 = index;
+            }else{
+                c.p1 = index;
+            }
+            temporary_N++;
+        }
+        r->collisions[active_N+k] = c;
+    }
+    memcpy(r->collisions+active_N+recv_N, testparticles, sizeof(struct reb_collision)*testparticles_N);
+    *collisions_N = collisions_N_new;
+    free(active);
+    free(testparticles);
+    free(send);
+    free(recv);
+    return temporary_N;
+}
+
+/**
+ * @brief A collision between a local particle and a particle of another node.
+ * @details Used with the root box decomposition. c.p1 is the index of the local particle,
+ * c.p2 the index of the other particle on node proc. The ghostbox is that of the local particle.
+ */
+struct reb_collision_remote {
+    struct reb_collision c;
+    int proc;
+};
+
+/**
+ * @brief A copy of a particle sent to another node to resolve a collision.
+ */
+struct reb_collision_remote_particle {
+    int index;                  // Index of the particle on the node which owns it.
+    int removed;                // Only used when the copy is sent back. 1 if the particle has been removed.
+    struct reb_particle p;
+};
+
+/**
+ * @brief Collisions with particles of other nodes and the copies of remote particles in the particle array.
+ */
+struct reb_collision_remote_state {
+    struct reb_collision_remote* collisions;    // Sorted by node, local index, and remote index.
+    int collisions_N;
+    int* origin_proc;                           // Node which owns the k-th copy.
+    int* origin_index;                          // Index of the k-th copy on that node.
+    int temporary_N;                            // Number of copies at the end of the particle array.
+};
+
+/**
+ * @brief Compares two collisions with remote particles by node, local index, and remote index.
+ */
+static int reb_collision_remote_compare(const void* a, const void* b){
+    const struct reb_collision_remote* const ca = a;
+    const struct reb_collision_remote* const cb = b;
+    if (ca->proc != cb->proc) return ca->proc > cb->proc ? 1 : -1;
+    if (ca->c.p1 != cb->c.p1) return ca->c.p1 > cb->c.p1 ? 1 : -1;
+    if (ca->c.p2 != cb->c.p2) return ca->c.p2 > cb->c.p2 ? 1 : -1;
+    return 0;
+}
+
+/**
+ * @brief Moves collisions with particles of other nodes out of the collision array.
+ * @details Used with the root box decomposition. A collision between particles of two 
+ * nodes is not necessarily found by both of them. Every node therefore sends the collisions 
+ * it found to the other node, so that both nodes know all collisions of their particles. 
+ * Needs to be called by all nodes.
+ * @param collisions_N Pointer to the number of collisions. Updated to the number of local collisions.
+ * @param state Set to all collisions with particles of other nodes, each included once.
+ */
+static void reb_collision_remote_gather(struct reb_simulation* const r, int* const collisions_N, struct reb_collision_remote_state* const state){
+    const int mpi_num = r->mpi_num;
+    const int N = *collisions_N;
+    struct reb_collision_remote* const found = malloc(sizeof(struct reb_collision_remote)*(N+1));
+    int found_N = 0;
+    int local_N = 0;
+    int* const send_N = calloc(mpi_num, sizeof(int));
+    for (int i=0;i<N;i++){
+        struct reb_collision c = r->collisions[i];
+        if (c.p1 == -1 || c.p2 == -1){
+            continue;
+        }
+        if (reb_communication_mpi_rootbox_is_local(r, c.ri)){
+            r->collisions[local_N++] = c;
+        }else{
+            const int proc = reb_communication_mpi_rootbox_owner(r, c.ri);
+            // Index in particles_recv to index on the other node
+            c.p2 = r->particles_recv_index[proc][c.p2];
+            found[found_N].c = c;
+            found[found_N].proc = proc;
+            found_N++;
+            send_N[proc]++;
+        }
+    }
+    *collisions_N = local_N;
+    if (found_N>1){
+        qsort(found, found_N, sizeof(struct reb_collision_remote), reb_collision_remote_compare);
+    }
+
+    // Send every collision to the other node, as seen from there.
+    struct reb_collision* const send = malloc(sizeof(struct reb_collision)*(found_N+1));
+    for (int k=0;k<found_N;k++){
+        struct reb_collision c = found[k].c;
+        c.p1 = found[k].c.p2;
+        c.p2 = found[k].c.p1;
+        c.gb.shiftx  = -c.gb.shiftx;
+        c.gb.shifty  = -c.gb.shifty;
+        c.gb.shiftz  = -c.gb.shiftz;
+        c.gb.shiftvx = -c.gb.shiftvx;
+        c.gb.shiftvy = -c.gb.shiftvy;
+        c.gb.shiftvz = -c.gb.shiftvz;
+        send[k] = c;
+    }
+    int* const recv_N = malloc(sizeof(int)*mpi_num);
+    struct reb_collision* const recv = reb_communication_mpi_exchange(r, send, send_N, sizeof(struct reb_collision), recv_N);
+    int recv_total = 0;
+    for (int proc=0;proc<mpi_num;proc++){
+        recv_total += recv_N[proc];
+    }
+
+    struct reb_collision_remote* const collisions = malloc(sizeof(struct reb_collision_remote)*(found_N+recv_total+1));
+    memcpy(collisions, found, sizeof(struct reb_collision_remote)*found_N);
+    int collisions_N_all = found_N;
+    int k = 0;
+    for (int proc=0;proc<mpi_num;proc++){
+        for (int j=0;j<recv_N[proc];j++){
+            collisions[collisions_N_all].c = recv[k++];
+            collisions[collisions_N_all].proc = proc;
+            collisions_N_all++;
+        }
+    }
+    // Collisions found by both nodes are only included once.
+    if (collisions_N_all>1){
+        qsort(collisions, collisions_N_all, sizeof(struct reb_collision_remote), reb_collision_remote_compare);
+    }
+    int unique_N = 0;
+    for (int j=0;j<collisions_N_all;j++){
+        if (unique_N && reb_collision_remote_compare(&collisions[unique_N-1], &collisions[j])==0){
+            continue;
+        }
+        collisions[unique_N++] = collisions[j];
+    }
+    state->collisions = collisions;
+    state->collisions_N = unique_N;
+    state->origin_proc = NULL;
+    state->origin_index = NULL;
+    state->temporary_N = 0;
+    free(found);
+    free(send_N);
+    free(send);
+    free(recv_N);
+    free(recv);
+}
+
+/**
+ * @brief Appends copies of remote particles to the particle array and prepares the collisions this node resolves.
+ * @details Called after all local collisions have been resolved. A collision between particles of 
+ * two nodes is resolved by the node with the lower id. The other node sends a copy of its particle 
+ * in the current state, so that a merger in a local collision is taken into account. Particles which 
+ * have been removed by a local collision are not sent and their collisions are skipped. 
+ * Needs to be called by all nodes.
+ * @param removed Particles removed by local collisions. Can be NULL.
+ * @param collisions_N Set to the number of collisions this node resolves. They are stored in r->collisions.
+ */
+static void reb_collision_remote_prepare(struct reb_simulation* const r, struct reb_collision_remote_state* const state, const unsigned char* const removed, int* const collisions_N){
+    const int mpi_num = r->mpi_num;
+    const int mpi_id = r->mpi_id;
+    struct reb_collision_remote_particle* const send = malloc(sizeof(struct reb_collision_remote_particle)*(state->collisions_N+1));
+    int* const send_N = calloc(mpi_num, sizeof(int));
+    int N_send = 0;
+    int last_proc = -1;
+    for (int k=0;k<state->collisions_N;k++){
+        const struct reb_collision_remote cr = state->collisions[k];
+        if (cr.proc>mpi_id){
+            // Resolved on this node
+            continue;
+        }
+        if (removed && removed[cr.c.p1]){
+            continue;
+        }
+        if (last_proc==cr.proc && send[N_send-1].index==cr.c.p1){
+            // Already sent to this node
+            continue;
+        }
+        last_proc = cr.proc;
+        send[N_send].index = cr.c.p1;
+        send[N_send].removed = 0;
+        send[N_send].p = r->particles[cr.c.p1];
+        N_send++;
+        send_N[cr.proc]++;
+    }
+    int* const recv_N = malloc(sizeof(int)*mpi_num);
+    struct reb_collision_remote_particle* const recv = reb_communication_mpi_exchange(r, send, send_N, sizeof(struct reb_collision_remote_particle), recv_N);
+
+    // Copies are appended ordered by node and index.
+    int* const recv_offset = malloc(sizeof(int)*mpi_num);
+    int recv_total = 0;
+    for (int proc=0;proc<mpi_num;proc++){
+        recv_offset[proc] = recv_total;
+        recv_total += recv_N[proc];
+    }
+    const int N_local = r->N;
+    state->origin_proc = malloc(sizeof(int)*(recv_total+1));
+    state->origin_index = malloc(sizeof(int)*(recv_total+1));
+    for (int proc=0;proc<mpi_num;proc++){
+        for (int j=recv_offset[proc];j<recv_offset[proc]+recv_N[proc];j++){
+            reb_collision_append_temporary(r, recv[j].p);
+            state->origin_proc[j] = proc;
+            state->origin_index[j] = recv[j].index;
+        }
+    }
+    state->temporary_N = recv_total;
+
+    // Any local root box will do, the remote particle is now a local copy.
+    int ri_local = 0;
+    for (int ri=0;ri<r->root_n;ri++){
+        if (reb_communication_mpi_rootbox_is_local(r, ri)){
+            ri_local = ri;
+            break;
+        }
+    }
+    if (r->collisions_allocatedN<state->collisions_N){
+        r->collisions_allocatedN = state->collisions_N;
+        r->collisions = realloc(r->collisions, sizeof(struct reb_collision)*r->collisions_allocatedN);
+    }
+    int N = 0;
+    for (int k=0;k<state->collisions_N;k++){
+        const struct reb_collision_remote cr = state->collisions[k];
+        if (cr.proc<mpi_id){
+            // Resolved on the other node
+            continue;
+        }
+        if (removed && removed[cr.c.p1]){
+            continue;
+        }
+        // Binary search for the copy. Not found if the particle has been removed on the other node.
+        int lo = recv_offset[cr.proc];
+        int hi = recv_offset[cr.proc]+recv_N[cr.proc]-1;
+        int copy = -1;
+        while (lo<=hi){
+            const int mid = (lo+hi)/2;
+            if (recv[mid].index==cr.c.p2){
+                copy = mid;
+                break;
+            }else if (recv[mid].index<cr.c.p2){
+                lo = mid+1;
+            }else{
+                hi = mid-1;
+            }
+        }
+        if (copy==-1){
+            continue;
+        }
+        struct reb_collision c = cr.c;
+        c.p2 = N_local+copy;
+        c.ri = ri_local;
+        c.t = r->t;
+        r->collisions[N++] = c;
+    }
+    if (!r->collision_time_of_impact){
+        reb_collision_shuffle(r, r->collisions, N);
+    }
+    *collisions_N = N;
+    free(send);
+    free(send_N);
+    free(recv_N);
+    free(recv);
+    free(recv_offset);
+}
+
+/**
+ * @brief Sends the copies of remote particles back to the nodes which own them and applies the results to local particles.
+ * @details Physical properties are copied. A removal takes precedence. Results for particles which have 
+ * already been removed on this node are ignored. Frees the state. Needs to be called by all nodes.
+ * @param removed Removed particles, including the copies at the end of the particle array. Can be NULL.
+ * @param remove Set to the indices of local particles which have been removed on other nodes. Needs to be freed by the caller.
+ * @return Number of local particles which have been removed on other nodes.
+ */
+static int reb_collision_remote_scatter(struct reb_simulation* const r, struct reb_collision_remote_state* const state, const unsigned char* const removed, int** const remove){
+    const int mpi_num = r->mpi_num;
+    const int temporary_N = state->temporary_N;
+    const int N_local = r->N-temporary_N;
+    struct reb_collision_remote_particle* const send = malloc(sizeof(struct reb_collision_remote_particle)*(temporary_N+1));
+    int* const send_N = calloc(mpi_num, sizeof(int));
+    for (int k=0;k<temporary_N;k++){
+        send[k].index = state->origin_index[k];
+        send[k].removed = removed && removed[N_local+k];
+        send[k].p = r->particles[N_local+k];
+        send_N[state->origin_proc[k]]++;
+    }
+    int* const recv_N = malloc(sizeof(int)*mpi_num);
+    struct reb_collision_remote_particle* const recv = reb_communication_mpi_exchange(r, send, send_N, sizeof(struct reb_collision_remote_particle), recv_N);
+    int recv_total = 0;
+    for (int proc=0;proc<mpi_num;proc++){
+        recv_total += recv_N[proc];
+    }
+    int remove_N = 0;
+    *remove = malloc(sizeof(int)*(recv_total+1));
+    for (int k=0;k<recv_total;k++){
+        const int index = recv[k].index;
+        if (removed && removed[index]){
+            continue;
+        }
+        if (recv[k].removed){
+            (*remove)[remove_N++] = index;
+            continue;
+        }
+        struct reb_particle* const p = &r->particles[index];
+        const struct reb_particle q = recv[k].p;
+        p->x = q.x;
+        p->y = q.y;
+        p->z = q.z;
+        p->vx = q.vx;
+        p->vy = q.vy;
+        p->vz = q.vz;
+        p->m = q.m;
+        p->r = q.r;
+        p->lastcollision = q.lastcollision;
+    }
+    free(send);
+    free(send_N);
+    free(recv_N);
+    free(recv);
+    free(state->collisions);
+    free(state->origin_proc);
+    free(state->origin_index);
+    return remove_N;
+}
+#endif // MPI
+
+int reb_collision_find_close_pair(struct reb_simulation* const r, const double dmin, int* const pi, int* const pj){
+    const struct reb_particle* const particles = r->particles;
+    const int N = r->N - r->N_var;
+    // Test particles of type 0 do not interact with each other.
+    const int Nactive = (r->N_active==-1 || r->testparticle_type==1)?N:r->N_active;
+    if (N<2 || dmin<=0.){
+        return 0;
+    }
+    // Particles closer than dmin are at most one cell apart.
+    const double hinv = 1./dmin;
+    const unsigned int mask = reb_collision_grid_update(r, N, NULL, hinv);
+    const int* const bucket = r->collision_grid_bucket;
+    const int* const grid_particles = r->collision_grid_particles;
+    const int brute_force = 27>N;
+    const int nc = brute_force?0:1;
+    const double dmin2 = dmin*dmin;
+    // The pair reported is the one with the smallest i, then the smallest j<i, 
+    // independent of the number of threads. Particles with a larger index 
+    // than a pair already found are skipped.
+    int found_i = N;
+    int found_j = N;
+#pragma omp parallel for schedule(guided)
+    for (int i=1;i<N;i++){
+        int current_i;
+#pragma omp atomic read
+        current_i = found_i;
+        if (i>current_i) continue;
+        const struct reb_particle p1 = particles[i];
+        const long cx = (long)floor(p1.x*hinv);
+        const long cy = (long)floor(p1.y*hinv);
+        const long cz = (long)floor(p1.z*hinv);
+        int jmin = N;
+        for (long ix=cx-nc; ix<=cx+nc; ix++){
+        for (long iy=cy-nc; iy<=cy+nc; iy++){
+        for (long iz=cz-nc; iz<=cz+nc; iz++){
+            int kstart = 0;
+            int kend = N;
+            if (!brute_force){
+                const unsigned int b = reb_collision_grid_hash(ix, iy, iz, mask);
+                kstart = bucket[b];
+                kend = bucket[b+1];
+            }
+            for (int k=kstart;k<kend;k++){
+                const int j = brute_force?k:grid_particles[k];
+                if (j>=i || j>=jmin) continue;
+                if (i>=Nactive && j>=Nactive) continue;
+                const struct reb_particle* const p2 = &particles[j];
+                const double dx = p1.x - p2->x;
+                const double dy = p1.y - p2->y;
+                const double dz = p1.z - p2->z;
+                if (dx*dx + dy*dy + dz*dz < dmin2){
+                    jmin = j;
+                }
+            }
+        }
+        }
+        }
+        if (jmin<N){
+#pragma omp critical
+            {
+                if (i<found_i){
+                    found_j = jmin;
+#pragma omp atomic write
+                    found_i = i;
+                }
+            }
+        }
+    }
+    if (found_i==N){
+        return 0;
+    }
+    *pi = found_j;
+    *pj = found_i;
+    return 1;
+}
 
 void reb_collision_search(struct reb_simulation* const r){
+    reb_profiling_start(r, REB_PROFILING_COLLISION_SEARCH);
+    reb_collision_search_and_resolve(r);
+    r->collision_line_xv0_N = -1; // Only valid for one timestep
+    reb_profiling_stop(r, REB_PROFILING_COLLISION_SEARCH);
+}
+
+#define REB_COLLISION_LOG_CHUNK 4096    ///< Number of events collected before they are handed to the background thread
+
+/**
+ * @brief Events collected by the simulation, written in one piece by the background thread.
+ */
+struct reb_collision_log_chunk {
+    struct reb_collision_log_chunk* next;
+    int N;
+    struct reb_collision_event events[REB_COLLISION_LOG_CHUNK];
+};
+
+// State of the background thread of reb_collision_log_open(). 
+// Unlike reb_output_positions_quantized(), no events are ever dropped.
+struct reb_collision_log_writer {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;                        // Signals new chunks, written chunks and shutdown
+    char* filename;
+    struct reb_collision_log_chunk* current;    // Chunk which is filled by the simulation, or NULL
+    struct reb_collision_log_chunk* queue;      // Chunks which have not been written yet, oldest first
+    struct reb_collision_log_chunk* queue_last;
+    int writing;                                // Set while a chunk is written
+    int shutdown;
+    int error;                                  // Set if the file could not be opened or written
+};
+
+static void* reb_collision_log_writer_thread(void* args){
+    struct reb_collision_log_writer* const w = args;
+    FILE* of = fopen(w->filename, "ab");
+    if (of && fseek(of, 0, SEEK_END)==0 && ftell(of)==0){
+        struct reb_collision_log_header header = {
+            .magic = REB_COLLISION_LOG_MAGIC,
+            .size = sizeof(struct reb_collision_event),
+        };
+        if (fwrite(&header, sizeof(header), 1, of)!=1){
+            fclose(of);
+            of = NULL;
+        }
+    }
+    pthread_mutex_lock(&w->mutex);
+    while (1){
+        while (w->queue==NULL && !w->shutdown){
+            pthread_cond_wait(&w->cond, &w->mutex);
+        }
+        if (w->queue==NULL){ // Shutdown and all chunks written
+            break;
+        }
+        struct reb_collision_log_chunk* const chunk = w->queue;
+        w->queue = chunk->next;
+        if (w->queue==NULL){
+            w->queue_last = NULL;
+        }
+        w->writing = 1;
+        pthread_mutex_unlock(&w->mutex);
+        int error = 0;
+        if (of==NULL || fwrite(chunk->events, sizeof(struct reb_collision_event), chunk->N, of)!=(size_t)chunk->N || fflush(of)){
+            error = 1;
+        }
+        free(chunk);
+        pthread_mutex_lock(&w->mutex);
+        w->writing = 0;
+        w->error |= error;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->mutex);
+    if (of){
+        fclose(of);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Hands the chunk which is currently filled to the background thread.
+ */
+static void reb_collision_log_push(struct reb_collision_log_writer* const w){
+    struct reb_collision_log_chunk* const chunk = w->current;
+    if (chunk==NULL || chunk->N==0){
+        return;
+    }
+    w->current = NULL;
+    pthread_mutex_lock(&w->mutex);
+    if (w->queue_last){
+        w->queue_last->next = chunk;
+    }else{
+        w->queue = chunk;
+    }
+    w->queue_last = chunk;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+}
+
+static void reb_collision_log_append(struct reb_collision_log_writer* const w, const struct reb_collision_event e){
+    if (w->current==NULL){
+        w->current = malloc(sizeof(struct reb_collision_log_chunk));
+        w->current->next = NULL;
+        w->current->N = 0;
+    }
+    w->current->events[w->current->N++] = e;
+    if (w->current->N==REB_COLLISION_LOG_CHUNK){
+        reb_collision_log_push(w);
+    }
+}
+
+/**
+ * @brief Relative position and velocity of a colliding pair. The ghostbox shift is applied to the first particle.
+ */
+static struct reb_collision_event reb_collision_event_get(const struct reb_simulation* const r, const struct reb_collision c){
+    const struct reb_particle* const p1 = &r->particles[c.p1];
+    const struct reb_particle* const p2 = &r->particles[c.p2];
+    const struct reb_collision_event e = {
+        .t = c.t,
+        .hash1 = p1->hash,
+        .hash2 = p2->hash,
+        .x = p2->x - p1->x - c.gb.shiftx,
+        .y = p2->y - p1->y - c.gb.shifty,
+        .z = p2->z - p1->z - c.gb.shiftz,
+        .vx = p2->vx - p1->vx - c.gb.shiftvx,
+        .vy = p2->vy - p1->vy - c.gb.shiftvy,
+        .vz = p2->vz - p1->vz - c.gb.shiftvz,
+    };
+    return e;
+}
+
+void reb_collision_log_flush(struct reb_simulation* r){
+    struct reb_collision_log_writer* const w = r->collision_log_writer;
+    if (w==NULL){
+        return;
+    }
+    reb_collision_log_push(w);
+    pthread_mutex_lock(&w->mutex);
+    while (w->queue || w->writing){
+        pthread_cond_wait(&w->cond, &w->mutex);
+    }
+    const int error = w->error;
+    pthread_mutex_unlock(&w->mutex);
+    if (error){
+        reb_warning(r, "Error while writing the collision log.");
+    }
+}
+
+void reb_collision_log_close(struct reb_simulation* r){
+    struct reb_collision_log_writer* const w = r->collision_log_writer;
+    if (w==NULL){
+        return;
+    }
+    reb_collision_log_push(w);
+    pthread_mutex_lock(&w->mutex);
+    w->shutdown = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+    pthread_join(w->thread, NULL);
+    if (w->error){
+        reb_warning(r, "Error while writing the collision log.");
+    }
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->mutex);
+    free(w->filename);
+    free(w);
+    r->collision_log_writer = NULL;
+}
+
+void reb_collision_log_open(struct reb_simulation* r, const char* filename){
+#ifdef MPI
+    char filename_mpi[1024];
+    sprintf(filename_mpi,"%s_%d",filename,r->mpi_id);
+    filename = filename_mpi;
+#endif // MPI
+    struct reb_collision_log_writer* w = r->collision_log_writer;
+    if (w && strcmp(w->filename, filename)==0){
+        return;
+    }
+    reb_collision_log_close(r);
+    w = calloc(1, sizeof(struct reb_collision_log_writer));
+    w->filename = malloc((strlen(filename)+1)*sizeof(char));
+    strcpy(w->filename, filename);
+    pthread_mutex_init(&w->mutex, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    if (pthread_create(&w->thread, NULL, reb_collision_log_writer_thread, w)){
+        pthread_cond_destroy(&w->cond);
+        pthread_mutex_destroy(&w->mutex);
+        free(w->filename);
+        free(w);
+        reb_error(r, "Cannot create thread for the collision log.");
+        return;
+    }
+    r->collision_log_writer = w;
+}
+
+/**
+ * @brief Direct collision search for particle i, see reb_collision_search_particles().
+ */
+static void reb_collision_search_direct_particle(struct reb_simulation* const r, const struct reb_collision_search_state* const s, const int i, const struct reb_ghostbox* const gbs, const int gbs_N, struct reb_collision** collisions, int* collisions_N, int* collisions_allocatedN, struct reb_collision_statistics* const stats){
+    const struct reb_particle* const particles = r->particles;
+    const int* const mercurius_map = s->mercurius_map;
+    const int ip = mercurius_map?mercurius_map[i]:i;
+    const struct reb_particle* const p1 = &particles[ip];
+    // Awake particles find their collisions with sleeping particles.
+    if (s->sleeping && (p1->frozen & REB_PARTICLE_ASLEEP)) return;
+    for (int g=0;g<gbs_N;g++){
+        // Precalculate shifted position 
+        const struct reb_ghostbox gb = reb_collision_ghostbox_shift(gbs[g], p1);
+        // Loop over all particles again (only active ones if p1 is a test particle)
+        const int jmax = (i<s->Nactive)?s->Ninner:MIN(s->Ninner,s->Nactive);
+        stats->pairs += jmax - (i<jmax);
+        for (int j=0;j<jmax;j++){
+            // Do not collide particle with itself.
+            if (i==j) continue;
+            const int jp = mercurius_map?mercurius_map[j]:j;
+            if (!reb_collision_check_overlap(&gb, p1->r, &particles[jp])) continue;
+            // Add particles to collision array.
+            struct reb_collision c = {.p1 = ip, .p2 = jp, .gb = gbs[g]};
+            reb_collision_append(collisions, collisions_N, collisions_allocatedN, c);
+        }
+    }
+}
+
+/**
+ * @brief REB_COLLISION_DIRECT. Checks all pairs of particles.
+ * @return Number of collisions found or -1 if the search was interrupted.
+ */
+static int reb_collision_search_direct(struct reb_simulation* const r, struct reb_collision_search_state* const s){
+    if (s->mercurius_map && r->ri_mercurius.encounter_pairs){
+        // Only check pairs found by the MERCURIUS encounter prediction.
+        return reb_collision_search_mercurius_pairs(r, s);
+    }
+#ifdef GPU
+    if (!s->mercurius_map && r->N_asleep==0 && s->N>=REB_COLLISION_GPU_MIN_N){
+        return reb_collision_search_gpu(r, s);
+    }
+#endif // GPU
+    if (r->use_soa && !s->mercurius_map){
+        s->soa_N = reb_particles_soa_update(r, s->N, 1);
+        s->soa = r->particles_soa;
+        return reb_collision_search_particles(r, s, s->N, 0, 0, reb_collision_search_direct_soa_particle);
+    }
+    s->sleeping = r->N_asleep>0;
+    return reb_collision_search_particles(r, s, s->N, 0, 0, reb_collision_search_direct_particle);
+}
+
+/**
+ * @brief Line collision search for particle i, see reb_collision_search_particles().
+ * @details Only pairs with j>i are checked, so test particles only need to be considered as p2.
+ */
+static void reb_collision_search_line_particle(struct reb_simulation* const r, const struct reb_collision_search_state* const s, const int i, const struct reb_ghostbox* const gbs, const int gbs_N, struct reb_collision** collisions, int* collisions_N, int* collisions_allocatedN, struct reb_collision_statistics* const stats){
+    const struct reb_particle* const particles = r->particles;
+    const int N = s->N;
+    const double dt_last_done = s->dt_last_done;
+    const double* const soa = s->soa;
+    const double* const xv0 = s->xv0;
+    const double* const poly = s->poly;
+    const double p1_r = particles[i].r;
+    for (int g=0;g<gbs_N;g++){
+        // Precalculate shifted position 
+        const struct reb_ghostbox gb = reb_collision_ghostbox_shift(gbs[g], &particles[i]);
+        stats->pairs += N-i-1;
+        // Loop over all particles again, REB_COLLISION_LINE_BLOCK at a time
+        int j=i+1;
+        for (;!xv0 && j<=N-REB_COLLISION_LINE_BLOCK;j+=REB_COLLISION_LINE_BLOCK){
+            const unsigned int hits = reb_collision_check_line_block(&gb, p1_r, soa, N, j, dt_last_done);
+            if (!hits) continue;
+            for (int k=0;k<REB_COLLISION_LINE_BLOCK;k++){
+                if (!(hits & (1u<<k))) continue;
+                // Add particles to collision array.
+                struct reb_collision c = {.p1 = i, .p2 = j+k, .gb = gbs[g]};
+                reb_collision_append(collisions, collisions_N, collisions_allocatedN, c);
+            }
+        }
+        // Remaining particles
+        for (;j<N;j++){
+            if (poly){
+                if (!reb_collision_check_ias15(&gbs[g], &particles[i], &particles[j], xv0+6*i, xv0+6*j, poly+31*i, poly+31*j, dt_last_done)) continue;
+            }else if (xv0){
+                if (!reb_collision_check_hermite(&gbs[g], &particles[i], &particles[j], xv0+6*i, xv0+6*j, dt_last_done)) continue;
+            }else{
+                if (!reb_collision_check_line(&gb, p1_r, &particles[j], dt_last_done)) continue;
+            }
+            // Add particles to collision array.
+            struct reb_collision c = {.p1 = i, .p2 = j, .gb = gbs[g]};
+            reb_collision_append(collisions, collisions_N, collisions_allocatedN, c);
+        }
+    }
+}
+
+/**
+ * @brief REB_COLLISION_LINE. Checks all pairs of particles along their trajectories during the last timestep.
+ * @return Number of collisions found or -1 if the search was interrupted.
+ */
+static int reb_collision_search_line(struct reb_simulation* const r, struct reb_collision_search_state* const s){
+    s->line = 1;
+#ifdef GPU
+    // Only the straight line test is done on the GPU. Hermite and IAS15 trajectories need xv0.
+    if (!reb_collision_line_xv0(r, s->N) && s->N>=REB_COLLISION_GPU_MIN_N){
+        return reb_collision_search_gpu(r, s);
+    }
+#endif // GPU
+    // Packed copy of all particles, shared by all ghost boxes.
+    s->soa = reb_collision_line_soa_update(r, s->N);
+    // Positions and velocities at the beginning of the timestep (NULL if not available).
+    s->xv0 = reb_collision_line_xv0(r, s->N);
+    // IAS15 trajectories of the last timestep (NULL if not available).
+    s->poly = reb_collision_line_poly_update(r, s->N);
+    // Triangular loop, guided scheduling balances the work.
+    return reb_collision_search_particles(r, s, s->Nactive, 0, 0, reb_collision_search_line_particle);
+}
+
+/**
+ * @brief Tree collision search for particle i in all ghost boxes, see reb_collision_search_particles().
+ */
+static void reb_collision_search_tree_particle(struct reb_simulation* const r, const struct reb_collision_search_state* const s, const int i, const struct reb_ghostbox* const gbs, const int gbs_N, struct reb_collision** collisions, int* collisions_N, int* collisions_allocatedN, struct reb_collision_statistics* const stats){
+    const struct reb_particle* const p1 = &r->particles[i];
+    if (s->sleeping && (p1->frozen & REB_PARTICLE_ASLEEP)) return;
+    struct reb_collision collision_nearest;
+    collision_nearest.p1 = i;
+    collision_nearest.p2 = -1;
+    double nearest_r2 = r->boxsize_max*r->boxsize_max/4.;
+    // Cells visited and pairs tested are only counted if needed.
+    struct reb_collision_statistics* const stats_tree = r->track_collision_statistics?stats:NULL;
+    for (int g=0;g<gbs_N;g++){
+        stats->ghostboxes++;
+        // Calculated shifted position (for speedup). 
+        const struct reb_ghostbox gb = reb_collision_ghostbox_shift(gbs[g], p1);
+        // Loop over all root boxes.
+        for (int ri=0;ri<r->root_n;ri++){
+            struct reb_treecell* rootcell = r->tree_root[ri];
+            if (rootcell!=NULL){
+                reb_tree_get_nearest_neighbour_in_cell(r, collisions, collisions_N, collisions_allocatedN, gb, gbs[g], ri, p1->r, &nearest_r2, &collision_nearest, rootcell, stats_tree);
+            }
+        }
+    }
+}
+
+/**
+ * @brief REB_COLLISION_TREE. Uses the tree to find overlapping particles.
+ * @return Number of collisions found or -1 if the search was interrupted.
+ */
+static int reb_collision_search_tree(struct reb_simulation* const r, struct reb_collision_search_state* const s){
+    // Update and simplify tree. 
+    // Prepare particles for distribution to other nodes. 
+    reb_tree_update(r);          
+
+#ifdef MPI
+    // Distribute particles and add newly received particles to tree.
+    reb_communication_mpi_distribute_particles(r);
+#endif // MPI
+    
+    // Largest radius in every cell
+    reb_tree_update_collision_data(r);
+
+#ifdef MPI
+    // Prepare essential tree (and particles close to the boundary needed for collisions) for distribution to other nodes.
+    reb_tree_prepare_essential_tree_for_collisions(r);
+
+    // Transfer essential tree and particles needed for collisions.
+    reb_communication_mpi_distribute_essential_tree_for_collisions(r);
+#endif // MPI
+
+    const int N = r->N - r->N_var;
+    // If test particle pairs are skipped, only search for neighbours of active particles.
+    const int Nsearch = r->collision_skip_testparticle_pairs?MIN(s->Nactive,N):N;
+    // Sleeping particles are found by the awake particles (unless those are skipped test particles).
+    s->sleeping = r->N_asleep>0 && Nsearch==N;
+    return reb_collision_search_particles(r, s, Nsearch, 1, 0, reb_collision_search_tree_particle);
+}
+
+/**
+ * @brief Tree line collision search for particle i in all ghost boxes, see reb_collision_search_particles().
+ */
+static void reb_collision_search_linetree_particle(struct reb_simulation* const r, const struct reb_collision_search_state* const s, const int i, const struct reb_ghostbox* const gbs, const int gbs_N, struct reb_collision** collisions, int* collisions_N, int* collisions_allocatedN, struct reb_collision_statistics* const stats){
+    const struct reb_particle* const p1 = &r->particles[i];
+    struct reb_collision collision_nearest;
+    collision_nearest.p1 = i;
+    collision_nearest.p2 = -1;
+    const double p1_r = p1->r;
+    // Add drift during last timestep
+    const double p1_r_plus_dtv = p1_r + s->dt_last_done*sqrt(p1->vx*p1->vx + p1->vy*p1->vy + p1->vz*p1->vz);
+    // Cells visited and pairs tested are only counted if needed.
+    struct reb_collision_statistics* const stats_tree = r->track_collision_statistics?stats:NULL;
+    for (int g=0;g<gbs_N;g++){
+        stats->ghostboxes++;
+        // Calculated shifted position (for speedup). 
+        const struct reb_ghostbox gb = reb_collision_ghostbox_shift(gbs[g], p1);
+        // Loop over all root boxes.
+        for (int ri=0;ri<r->root_n;ri++){
+            struct reb_treecell* rootcell = r->tree_root[ri];
+            if (rootcell!=NULL){
+                reb_tree_check_for_overlapping_trajectories_in_cell(r, collisions, collisions_N, collisions_allocatedN, gb, gbs[g], ri, p1_r, p1_r_plus_dtv, &collision_nearest, rootcell, stats_tree);
+            }
+        }
+    }
+}
+
+/**
+ * @brief REB_COLLISION_LINETREE. Uses the tree to find particles whose trajectories overlapped during the last timestep.
+ * @return Number of collisions found or -1 if the search was interrupted.
+ */
+static int reb_collision_search_linetree(struct reb_simulation* const r, struct reb_collision_search_state* const s){
+    // Update and simplify tree. 
+    // Prepare particles for distribution to other nodes. 
+    reb_tree_update(r);          
+    // Largest radius and speed in every cell
+    reb_tree_update_collision_data(r);
+
+    const int N = r->N - r->N_var;
+    // If test particle pairs are skipped, only search for neighbours of active particles.
+    const int Nsearch = r->collision_skip_testparticle_pairs?MIN(s->Nactive,N):N;
+    return reb_collision_search_particles(r, s, Nsearch, 1, 0, reb_collision_search_linetree_particle);
+}
+
+/**
+ * @brief Grid collision search for particle i, see reb_collision_search_particles().
+ */
+static void reb_collision_search_grid_particle(struct reb_simulation* const r, const struct reb_collision_search_state* const s, const int i, const struct reb_ghostbox* const gbs, const int gbs_N, struct reb_collision** collisions, int* collisions_N, int* collisions_allocatedN, struct reb_collision_statistics* const stats){
+    const struct reb_particle* const particles = r->particles;
+    const int* const mercurius_map = s->mercurius_map;
+    const int* const bucket = r->collision_grid_bucket;
+    const int* const grid_particles = r->collision_grid_particles;
+    const int Ninner = s->Ninner;
+    const int Nactive = s->Nactive;
+    const double hinv = s->hinv;
+    const int ip = mercurius_map?mercurius_map[i]:i;
+    const struct reb_particle* const p1 = &particles[ip];
+    // Number of neighbouring cells which might contain overlapping particles
+    const int nc = (int)ceil((p1->r+s->rmax)*hinv);
+    const double ncells = (2.*nc+1.)*(2.*nc+1.)*(2.*nc+1.);
+    // Check all particles directly if the grid does not help (e.g. for a very large particle)
+    const int brute_force = ncells>Ninner;
+    const int ncx = brute_force?0:nc;
+    for (int g=0;g<gbs_N;g++){
+        // Precalculate shifted position 
+        const struct reb_ghostbox gb = reb_collision_ghostbox_shift(gbs[g], p1);
+        const long cx = (long)floor(gb.shiftx*hinv);
+        const long cy = (long)floor(gb.shifty*hinv);
+        const long cz = (long)floor(gb.shiftz*hinv);
+        for (long ix=cx-ncx; ix<=cx+ncx; ix++){
+        for (long iy=cy-ncx; iy<=cy+ncx; iy++){
+        for (long iz=cz-ncx; iz<=cz+ncx; iz++){
+            int kstart = 0;
+            int kend = Ninner;
+            if (!brute_force){
+                const unsigned int b = reb_collision_grid_hash(ix, iy, iz, s->mask);
+                kstart = bucket[b];
+                kend = bucket[b+1];
+            }
+            stats->pairs += kend-kstart;
+            for (int k=kstart;k<kend;k++){
+                const int j = brute_force?k:grid_particles[k];
+                // Do not collide particle with itself.
+                if (i==j) continue;
+                if (i>=Nactive && j>=Nactive) continue;
+                const int jp = mercurius_map?mercurius_map[j]:j;
+                const struct reb_particle* const p2 = &particles[jp];
+                if (!brute_force){
+                    // Different cells can share the same bucket
+                    if ((long)floor(p2->x*hinv)!=ix || (long)floor(p2->y*hinv)!=iy || (long)floor(p2->z*hinv)!=iz) continue;
+                }
+                if (!reb_collision_check_overlap(&gb, p1->r, p2)) continue;
+                // Add particles to collision array.
+                struct reb_collision c = {.p1 = ip, .p2 = jp, .gb = gbs[g]};
+                reb_collision_append(collisions, collisions_N, collisions_allocatedN, c);
+            }
+        }
+        }
+        }
+    }
+}
+
+/**
+ * @brief REB_COLLISION_GRID. Sorts the particles into a hashed grid and only checks neighbouring cells.
+ * @details The collisions are sorted to get the same order as in the direct collision search.
+ * @return Number of collisions found or -1 if the search was interrupted.
+ */
+static int reb_collision_search_grid(struct reb_simulation* const r, struct reb_collision_search_state* const s){
+    const struct reb_particle* const particles = r->particles;
+    // Cell size. By default, overlapping particles are at most one cell apart.
+    double rmax = 0.;
+    for (int j=0;j<s->Ninner;j++){
+        const int jp = s->mercurius_map?s->mercurius_map[j]:j;
+        rmax = MAX(rmax, particles[jp].r);
+    }
+    double h = r->collision_grid_cellsize;
+    if (h<=0.){
+        h = 2.*rmax;
+    }
+    if (h<=0.){
+        h = 1.; // All particles have zero radius. Only exactly overlapping particles collide.
+    }
+    s->rmax = rmax;
+    s->hinv = 1./h;
+    s->mask = reb_collision_grid_update(r, s->Ninner, s->mercurius_map, s->hinv);
+    return reb_collision_search_particles(r, s, s->N, 0, 1, reb_collision_search_grid_particle);
+}
+
+/**
+ * @brief Sweep and prune collision search for the interval with index ka, see reb_collision_search_particles().
+ */
+static void reb_collision_search_sap_particle(struct reb_simulation* const r, const struct reb_collision_search_state* const s, const int ka, const struct reb_ghostbox* const gbs, const int gbs_N, struct reb_collision** collisions, int* collisions_N, int* collisions_allocatedN, struct reb_collision_statistics* const stats){
+    const struct reb_particle* const particles = r->particles;
+    const int* const mercurius_map = s->mercurius_map;
+    const int* const sap_particles = r->collision_sap_particles;
+    const double* const lower = r->collision_sap_lower;
+    const double* const upper = r->collision_sap_upper;
+    const int N = s->N;
+    const int line = s->line;
+    const int i = sap_particles[ka];
+    // Line search only checks j>i, so test particles only need to be considered as p2.
+    if (line && i>=s->Nactive) return;
+    const int ip = mercurius_map?mercurius_map[i]:i;
+    const struct reb_particle* const p1 = &particles[ip];
+    for (int g=0;g<gbs_N;g++){
+        // All intervals in this ghostbox are shifted by the same amount.
+        const double shift = reb_collision_sap_component(gbs[g].shiftx, gbs[g].shifty, gbs[g].shiftz, s->axis);
+        const double shiftv = reb_collision_sap_component(gbs[g].shiftvx, gbs[g].shiftvy, gbs[g].shiftvz, s->axis);
+        const double padding = (line?fabs(s->dt_last_done*shiftv):0.) + 1e-12*fabs(shift);
+        const double lo = lower[ka] + shift - padding;
+        const double hi = upper[ka] + shift + padding;
+        // Binary search for the first interval which might overlap.
+        int kb = 0;
+        int kb_end = N;
+        while (kb<kb_end){
+            const int mid = kb + (kb_end-kb)/2;
+            if (lower[mid] < lo-s->wmax){
+                kb = mid+1;
+            }else{
+                kb_end = mid;
+            }
+        }
+        // Precalculate shifted position 
+        const struct reb_ghostbox gb = reb_collision_ghostbox_shift(gbs[g], p1);
+        const int kb_start = kb;
+        for (;kb<N && lower[kb]<=hi;kb++){
+            if (upper[kb]<lo) continue;
+            const int j = sap_particles[kb];
+            if (line){
+                if (j<=i) continue;
+            }else{
+                // Do not collide particle with itself.
+                if (i==j || j>=s->Ninner) continue;
+                if (i>=s->Nactive && j>=s->Nactive) continue;
+            }
+            const int jp = mercurius_map?mercurius_map[j]:j;
+            if (line){
+                if (!reb_collision_check_line(&gb, p1->r, &particles[jp], s->dt_last_done)) continue;
+            }else{
+                if (!reb_collision_check_overlap(&gb, p1->r, &particles[jp])) continue;
+            }
+            // Add particles to collision array.
+            struct reb_collision c = {.p1 = ip, .p2 = jp, .gb = gbs[g]};
+            reb_collision_append(collisions, collisions_N, collisions_allocatedN, c);
+        }
+        stats->pairs += kb-kb_start;
+    }
+}
+
+/**
+ * @brief REB_COLLISION_SAP and REB_COLLISION_LINESAP. Sweeps over the sorted intervals of the particles along one axis.
+ * @details The collisions are sorted to get the same order as in the direct and line collision searches.
+ * @return Number of collisions found or -1 if the search was interrupted.
+ */
+static int reb_collision_search_sap(struct reb_simulation* const r, struct reb_collision_search_state* const s){
+    s->line = (r->collision==REB_COLLISION_LINESAP);
+    s->wmax = reb_collision_sap_update(r, s->N, s->mercurius_map, s->line);
+    s->axis = r->collision_sap_axis;
+    return reb_collision_search_particles(r, s, s->N, 0, 1, reb_collision_search_sap_particle);
+}
+
+/**
+ * @brief Bounding volume hierarchy collision search for particle i, see reb_collision_search_particles().
+ */
+static void reb_collision_search_bvh_particle(struct reb_simulation* const r, const struct reb_collision_search_state* const s, const int i, const struct reb_ghostbox* const gbs, const int gbs_N, struct reb_collision** collisions, int* collisions_N, int* collisions_allocatedN, struct reb_collision_statistics* const stats){
+    const struct reb_particle* const particles = r->particles;
+    const int* const mercurius_map = s->mercurius_map;
+    const double* const box = r->collision_bvh_box;
+    const int* const child = r->collision_bvh_child;
+    const int line = s->line;
+    const double dt_last_done = s->dt_last_done;
+    // Line search only checks j>i, so test particles only need to be considered as p2.
+    if (line && i>=s->Nactive) return;
+    const int ip = mercurius_map?mercurius_map[i]:i;
+    const struct reb_particle* const p1 = &particles[ip];
+    for (int g=0;g<gbs_N;g++){
+        // All boxes in this ghostbox are shifted by the same amount.
+        const double shift[3] = {gbs[g].shiftx, gbs[g].shifty, gbs[g].shiftz};
+        const double shiftv[3] = {gbs[g].shiftvx, gbs[g].shiftvy, gbs[g].shiftvz};
+        double q[6];
+        reb_collision_bvh_leaf_box(p1, line, dt_last_done, q);
+        for (int a=0;a<3;a++){
+            const double padding = (line?fabs(dt_last_done*shiftv[a]):0.) + 1e-12*fabs(shift[a]);
+            q[a] += shift[a] - padding;
+            q[a+3] += shift[a] + padding;
+        }
+        // Precalculate shifted position 
+        const struct reb_ghostbox gb = reb_collision_ghostbox_shift(gbs[g], p1);
+        // Depth first traversal. The hierarchy is balanced, so the stack is never deeper than 2*log2(N).
+        int stack[128];
+        int stack_N = 0;
+        stack[stack_N++] = 0;
+        while (stack_N){
+            const int k = stack[--stack_N];
+            const double* const b = box+6*k;
+            stats->nodes++;
+            if (b[0]>q[3] || b[3]<q[0] || b[1]>q[4] || b[4]<q[1] || b[2]>q[5] || b[5]<q[2]) continue;
+            if (child[2*k]>=0){
+                stack[stack_N++] = child[2*k+1];
+                stack[stack_N++] = child[2*k];
+                continue;
+            }
+            const int j = -1-child[2*k];
+            if (line){
+                if (j<=i) continue;
+            }else{
+                // Do not collide particle with itself.
+                if (i==j || j>=s->Ninner) continue;
+                if (i>=s->Nactive && j>=s->Nactive) continue;
+            }
+            stats->pairs++;
+            const int jp = mercurius_map?mercurius_map[j]:j;
+            if (line){
+                if (!reb_collision_check_line(&gb, p1->r, &particles[jp], dt_last_done)) continue;
+            }else{
+                if (!reb_collision_check_overlap(&gb, p1->r, &particles[jp])) continue;
+            }
+            // Add particles to collision array.
+            struct reb_collision c = {.p1 = ip, .p2 = jp, .gb = gbs[g]};
+            reb_collision_append(collisions, collisions_N, collisions_allocatedN, c);
+        }
+    }
+}
+
+/**
+ * @brief REB_COLLISION_BVH and REB_COLLISION_LINEBVH. Traverses a bounding volume hierarchy of the particles.
+ * @details The collisions are sorted to get the same order as in the direct and line collision searches.
+ * @return Number of collisions found or -1 if the search was interrupted.
+ */
+static int reb_collision_search_bvh(struct reb_simulation* const r, struct reb_collision_search_state* const s){
+    if (s->N==0) return 0;
+    s->line = (r->collision==REB_COLLISION_LINEBVH);
+    reb_collision_bvh_update(r, s->N, s->mercurius_map, s->line);
+    return reb_collision_search_particles(r, s, s->N, 0, 1, reb_collision_search_bvh_particle);
+}
+
+/**
+ * @brief REB_COLLISION_NEIGHBOURLIST and REB_COLLISION_ACTIVELIST. Checks the pairs in the neighbour list.
+ * @details The list is only rebuilt if a pair which is not in the list might overlap. 
+ * Collisions are added in the order of the list.
+ * @return Number of collisions found.
+ */
+static int reb_collision_search_neighbours(struct reb_simulation* const r, struct reb_collision_search_state* const s){
+    const struct reb_particle* const particles = r->particles;
+    const int N = s->N;
+    const int Ninner = s->Ninner;
+    const int Nactive = s->Nactive;
+    const int* const mercurius_map = s->mercurius_map;
+    struct reb_ghostbox gbs[27];
+    const int gbs_N = reb_collision_get_inner_ghostboxes(r, gbs);
+    double skin = r->collision_skin;
+    if (skin<=0.){
+        skin = 0.;
+        for (int j=0;j<Ninner;j++){
+            const int jp = mercurius_map?mercurius_map[j]:j;
+            skin = MAX(skin, particles[jp].r);
+        }
+    }
+    if (reb_collision_neighbours_check(r, N, Ninner, Nactive, mercurius_map, skin, gbs, gbs_N)){
+        if (r->collision==REB_COLLISION_ACTIVELIST && Nactive<N){
+            reb_collision_neighbours_build_active(r, N, Ninner, Nactive, mercurius_map, skin, gbs, gbs_N);
+        }else{
+            reb_collision_neighbours_build(r, N, Ninner, Nactive, mercurius_map, skin, gbs, gbs_N);
+        }
+    }
+    const int* const nb = r->collision_neighbours;
+    const int nb_N = r->collision_neighbours_N;
+    s->pairs = nb_N;
+    s->ghostboxes = gbs_N;
+    // Check all candidate pairs.
+    unsigned char* hits = malloc(sizeof(unsigned char)*nb_N);
+#pragma omp parallel for schedule(static)
+    for (int k=0;k<nb_N;k++){
+        const struct reb_particle* const p1 = &particles[nb[3*k]];
+        const struct reb_ghostbox gb = reb_collision_ghostbox_shift(gbs[nb[3*k+2]], p1);
+        hits[k] = reb_collision_check_overlap(&gb, p1->r, &particles[nb[3*k+1]]);
+    }
+    int collisions_N = 0;
+    for (int k=0;k<nb_N;k++){
+        if (!hits[k]) continue;
+        struct reb_collision c = {.p1 = nb[3*k], .p2 = nb[3*k+1], .gb = gbs[nb[3*k+2]]};
+        reb_collision_append(&r->collisions, &collisions_N, &r->collisions_allocatedN, c);
+    }
+    free(hits);
+    return collisions_N;
+}
+
+static void reb_collision_search_and_resolve(struct reb_simulation* const r){
+    if (r->collision==REB_COLLISION_AUTO || r->collision==REB_COLLISION_LINEAUTO){
+        // Usually done at the beginning of reb_step().
+        reb_autotune_select(r);
+    }
     int N = r->N - r->N_var;
     int Ninner = N;
     int* mercurius_map = NULL;
@@ -63,396 +3002,356 @@ void reb_collision_search(struct reb_simulation* const r){
             mercurius_map = r->ri_mercurius.encounter_map;
         }
     }
+    // Particles with index >= Nactive are test particles. Pairs of two
+    // test particles are only skipped if collision_skip_testparticle_pairs is set.
+    int Nactive = N;
+    if ((r->collision_skip_testparticle_pairs || r->collision==REB_COLLISION_ACTIVELIST) && r->N_active!=-1){
+        if (mercurius_map){
+            Nactive = r->ri_mercurius.encounterNactive;
+        }else{
+            Nactive = MIN(r->N_active, N);
+        }
+    }
+    struct reb_collision_search_state s = {
+        .mercurius_map = mercurius_map,
+        .N = N,
+        .Ninner = Ninner,
+        .Nactive = Nactive,
+        .dt_last_done = r->dt_last_done,
+    };
     int collisions_N = 0;
-    const struct reb_particle* const particles = r->particles;
     switch (r->collision){
         case REB_COLLISION_NONE:
         break;
         case REB_COLLISION_DIRECT:
-        {
-            // Loop over ghost boxes, but only the inner most ring.
-            int nghostxcol = (r->nghostx>1?1:r->nghostx);
-            int nghostycol = (r->nghosty>1?1:r->nghosty);
-            int nghostzcol = (r->nghostz>1?1:r->nghostz);
-            for (int gbx=-nghostxcol; gbx<=nghostxcol; gbx++){
-            for (int gby=-nghostycol; gby<=nghostycol; gby++){
-            for (int gbz=-nghostzcol; gbz<=nghostzcol; gbz++){
-                // Loop over all particles
-                for (int i=0;i<N;i++){
-#ifndef OPENMP
-                    if (reb_sigint) return;
-#endif // OPENMP
-                    int ip = i;
-                    if (mercurius_map){
-                        ip = mercurius_map[i];
-                    }
-                    struct reb_particle p1 = particles[ip];
-                    struct reb_ghostbox gborig = reb_boundary_get_ghostbox(r, gbx,gby,gbz);
-                    struct reb_ghostbox gb = gborig;
-                    // Precalculate shifted position 
-                    gb.shiftx += p1.x;
-                    gb.shifty += p1.y;
-                    gb.shiftz += p1.z;
-                    gb.shiftvx += p1.vx;
-                    gb.shiftvy += p1.vy;
-                    gb.shiftvz += p1.vz;
-                    // Loop over all particles again
-                    for (int j=0;j<Ninner;j++){
-                        // Do not collide particle with itself.
-                        if (i==j) continue;
-                        int jp = j;
-                        if (mercurius_map){
-                            jp = mercurius_map[j];
-                        }
-                        struct reb_particle p2 = particles[jp];
-                        double dx = gb.shiftx - p2.x; 
-                        double dy = gb.shifty - p2.y; 
-                        double dz = gb.shiftz - p2.z; 
-                        double sr = p1.r + p2.r; 
-                        double r2 = dx*dx+dy*dy+dz*dz;
-                        // Check if particles are overlapping 
-                        if (r2>sr*sr) continue;    
-                        double dvx = gb.shiftvx - p2.vx; 
-                        double dvy = gb.shiftvy - p2.vy; 
-                        double dvz = gb.shiftvz - p2.vz; 
-                        // Check if particles are approaching each other
-                        if (dvx*dx + dvy*dy + dvz*dz >0) continue; 
-                        // Add particles to collision array.
-                        if (r->collisions_allocatedN<=collisions_N){
-                            // Allocate memory if there is no space in array.
-                            // Init to 32 if no space has been allocated yet, otherwise double it.
-                            r->collisions_allocatedN = r->collisions_allocatedN ? r->collisions_allocatedN * 2 : 32;
-                            r->collisions = realloc(r->collisions,sizeof(struct reb_collision)*r->collisions_allocatedN);
-                        }
-                        r->collisions[collisions_N].p1 = ip;
-                        r->collisions[collisions_N].p2 = jp;
-                        r->collisions[collisions_N].gb = gborig;
-                        collisions_N++;
-                    }
-                }
-            }
-            }
-            }
-        }
+            collisions_N = reb_collision_search_direct(r, &s);
         break;
         case REB_COLLISION_LINE:
-        {
-            double dt_last_done = r->dt_last_done;
-            // Loop over ghost boxes, but only the inner most ring.
-            int nghostxcol = (r->nghostx>1?1:r->nghostx);
-            int nghostycol = (r->nghosty>1?1:r->nghosty);
-            int nghostzcol = (r->nghostz>1?1:r->nghostz);
-            for (int gbx=-nghostxcol; gbx<=nghostxcol; gbx++){
-            for (int gby=-nghostycol; gby<=nghostycol; gby++){
-            for (int gbz=-nghostzcol; gbz<=nghostzcol; gbz++){
-                // Loop over all particles
-                for (int i=0;i<N;i++){
-#ifndef OPENMP
-                    if (reb_sigint) return;
-#endif // OPENMP
-                    struct reb_particle p1 = particles[i];
-                    struct reb_ghostbox gborig = reb_boundary_get_ghostbox(r, gbx,gby,gbz);
-                    struct reb_ghostbox gb = gborig;
-                    // Precalculate shifted position 
-                    gb.shiftx += p1.x;
-                    gb.shifty += p1.y;
-                    gb.shiftz += p1.z;
-                    gb.shiftvx += p1.vx;
-                    gb.shiftvy += p1.vy;
-                    gb.shiftvz += p1.vz;
-                    // Loop over all particles again
-                    for (int j=i+1;j<N;j++){
-                        struct reb_particle p2 = particles[j];
-                        const double dx1 = gb.shiftx - p2.x; // distance at end
-                        const double dy1 = gb.shifty - p2.y;
-                        const double dz1 = gb.shiftz - p2.z;
-                        const double r1 = (dx1*dx1 + dy1*dy1 + dz1*dz1);
-                        const double dvx1 = gb.shiftvx - p2.vx; 
-                        const double dvy1 = gb.shiftvy - p2.vy;
-                        const double dvz1 = gb.shiftvz - p2.vz;
-                        const double dx2 = dx1 -dt_last_done*dvx1; // distance at beginning
-                        const double dy2 = dy1 -dt_last_done*dvy1;
-                        const double dz2 = dz1 -dt_last_done*dvz1;
-                        const double r2 = (dx2*dx2 + dy2*dy2 + dz2*dz2);
-                        const double t_closest = (dx1*dvx1 + dy1*dvy1 + dz1*dvz1)/(dvx1*dvx1 + dvy1*dvy1 + dvz1*dvz1);
-
-                        double rmin2_ab = MIN(r1,r2);
-                        if (t_closest/dt_last_done>=0. && t_closest/dt_last_done<=1.){
-                            const double dx3 = dx1-t_closest*dvx1; // closest approach
-                            const double dy3 = dy1-t_closest*dvy1;
-                            const double dz3 = dz1-t_closest*dvz1;
-                            const double r3 = (dx3*dx3 + dy3*dy3 + dz3*dz3);
-                            rmin2_ab = MIN(rmin2_ab, r3);
-                        }
-                        double rsum = p1.r + p2.r;
-                        if (rmin2_ab>rsum*rsum) continue;
-
-                        // Add particles to collision array.
-                        if (r->collisions_allocatedN<=collisions_N){
-                            // Allocate memory if there is no space in array.
-                            // Init to 32 if no space has been allocated yet, otherwise double it.
-                            r->collisions_allocatedN = r->collisions_allocatedN ? r->collisions_allocatedN * 2 : 32;
-                            r->collisions = realloc(r->collisions,sizeof(struct reb_collision)*r->collisions_allocatedN);
-                        }
-                        r->collisions[collisions_N].p1 = i;
-                        r->collisions[collisions_N].p2 = j;
-                        r->collisions[collisions_N].gb = gborig;
-                        collisions_N++;
-                    }
-                }
-            }
-            }
-            }
-        }
+            collisions_N = reb_collision_search_line(r, &s);
         break;
         case REB_COLLISION_TREE:
-        {
-            // Update and simplify tree. 
-            // Prepare particles for distribution to other nodes. 
-            reb_tree_update(r);          
-
-#ifdef MPI
-            // Distribute particles and add newly received particles to tree.
-            reb_communication_mpi_distribute_particles(r);
-            
-            // Prepare essential tree (and particles close to the boundary needed for collisions) for distribution to other nodes.
-            reb_tree_prepare_essential_tree_for_collisions(r);
-
-            // Transfer essential tree and particles needed for collisions.
-            reb_communication_mpi_distribute_essential_tree_for_collisions(r);
-#endif // MPI
-
-            // Loop over ghost boxes, but only the inner most ring.
-            int nghostxcol = (r->nghostx>1?1:r->nghostx);
-            int nghostycol = (r->nghosty>1?1:r->nghosty);
-            int nghostzcol = (r->nghostz>1?1:r->nghostz);
-            const struct reb_particle* const particles = r->particles;
-            const int N = r->N - r->N_var;
-            // Loop over all particles
-#pragma omp parallel for schedule(guided)
-            for (int i=0;i<N;i++){
-#ifndef OPENMP
-                if (reb_sigint) return;
-#endif // OPENMP
-                struct reb_particle p1 = particles[i];
-                struct reb_collision collision_nearest;
-                collision_nearest.p1 = i;
-                collision_nearest.p2 = -1;
-                double p1_r = p1.r;
-                double nearest_r2 = r->boxsize_max*r->boxsize_max/4.;
-                // Loop over ghost boxes.
-                for (int gbx=-nghostxcol; gbx<=nghostxcol; gbx++){
-                for (int gby=-nghostycol; gby<=nghostycol; gby++){
-                for (int gbz=-nghostzcol; gbz<=nghostzcol; gbz++){
-                    // Calculated shifted position (for speedup). 
-                    struct reb_ghostbox gb = reb_boundary_get_ghostbox(r, gbx,gby,gbz);
-                    struct reb_ghostbox gbunmod = gb;
-                    gb.shiftx += p1.x; 
-                    gb.shifty += p1.y; 
-                    gb.shiftz += p1.z; 
-                    gb.shiftvx += p1.vx; 
-                    gb.shiftvy += p1.vy; 
-                    gb.shiftvz += p1.vz; 
-                    // Loop over all root boxes.
-                    for (int ri=0;ri<r->root_n;ri++){
-                        struct reb_treecell* rootcell = r->tree_root[ri];
-                        if (rootcell!=NULL){
-                            reb_tree_get_nearest_neighbour_in_cell(r, &collisions_N, gb, gbunmod,ri,p1_r,&nearest_r2,&collision_nearest,rootcell);
-                        }
-                    }
-                }
-                }
-                }
-                // Continue if no collision was found
-                if (collision_nearest.p2==-1) continue;
-            }
-        }
+            collisions_N = reb_collision_search_tree(r, &s);
         break;
         case REB_COLLISION_LINETREE:
-        {
-            // Calculate max drift (can also be stored in tree for further speedup)
-            double vmax2 = 0.;
-            for (int i=0;i<N;i++){
-                struct reb_particle p1 = particles[i];
-                vmax2 = MAX(vmax2, p1.vx*p1.vx + p1.vy*p1.vy + p1.vz*p1.vz);
-            }
-            double maxdrift = r->dt_last_done*sqrt(vmax2);
-            // Update and simplify tree. 
-            // Prepare particles for distribution to other nodes. 
-            reb_tree_update(r);          
-
-            // Loop over ghost boxes, but only the inner most ring.
-            int nghostxcol = (r->nghostx>1?1:r->nghostx);
-            int nghostycol = (r->nghosty>1?1:r->nghosty);
-            int nghostzcol = (r->nghostz>1?1:r->nghostz);
-            const struct reb_particle* const particles = r->particles;
-            const int N = r->N - r->N_var;
-            // Loop over all particles
-#pragma omp parallel for schedule(guided)
-            for (int i=0;i<N;i++){
-#ifndef OPENMP
-                if (reb_sigint) return;
-#endif // OPENMP
-                struct reb_particle p1 = particles[i];
-                struct reb_collision collision_nearest;
-                collision_nearest.p1 = i;
-                collision_nearest.p2 = -1;
-                double p1_r = p1.r;
-                // Add drift during last timestep
-                double p1_r_plus_dtv = p1_r + r->dt_last_done*sqrt(p1.vx*p1.vx + p1.vy*p1.vy + p1.vz*p1.vz);
-                // Loop over ghost boxes.
-                for (int gbx=-nghostxcol; gbx<=nghostxcol; gbx++){
-                for (int gby=-nghostycol; gby<=nghostycol; gby++){
-                for (int gbz=-nghostzcol; gbz<=nghostzcol; gbz++){
-                    // Calculated shifted position (for speedup). 
-                    struct reb_ghostbox gb = reb_boundary_get_ghostbox(r, gbx,gby,gbz);
-                    struct reb_ghostbox gbunmod = gb;
-                    gb.shiftx += p1.x; 
-                    gb.shifty += p1.y; 
-                    gb.shiftz += p1.z; 
-                    gb.shiftvx += p1.vx; 
-                    gb.shiftvy += p1.vy; 
-                    gb.shiftvz += p1.vz; 
-                    // Loop over all root boxes.
-                    for (int ri=0;ri<r->root_n;ri++){
-                        struct reb_treecell* rootcell = r->tree_root[ri];
-                        if (rootcell!=NULL){
-                            reb_tree_check_for_overlapping_trajectories_in_cell(r, &collisions_N, gb, gbunmod,ri,p1_r,p1_r_plus_dtv,&collision_nearest,rootcell,maxdrift);
-                        }
-                    }
-                }
-                }
-                }
-                // Continue if no collision was found
-                if (collision_nearest.p2==-1) continue;
-            }
-        }
+            collisions_N = reb_collision_search_linetree(r, &s);
+        break;
+        case REB_COLLISION_GRID:
+            collisions_N = reb_collision_search_grid(r, &s);
+        break;
+        case REB_COLLISION_SAP:
+        case REB_COLLISION_LINESAP:
+            collisions_N = reb_collision_search_sap(r, &s);
+        break;
+        case REB_COLLISION_BVH:
+        case REB_COLLISION_LINEBVH:
+            collisions_N = reb_collision_search_bvh(r, &s);
+        break;
+        case REB_COLLISION_NEIGHBOURLIST:
+        case REB_COLLISION_ACTIVELIST:
+            collisions_N = reb_collision_search_neighbours(r, &s);
         break;
         default:
             reb_exit("Collision routine not implemented.");
     }
+    if (collisions_N<0){
+        return; // Interrupted
+    }
+    const struct reb_particle* const particles = r->particles;
+    if (r->N_frozen || r->N_asleep){
+        // Frozen particles do not collide. Neither do two sleeping particles.
+        int k = 0;
+        for (int i=0;i<collisions_N;i++){
+            const struct reb_collision c = r->collisions[i];
+            const uint32_t s1 = particles[c.p1].frozen;
+            const uint32_t s2 = particles[c.p2].frozen;
+            if (!((s1|s2) & REB_PARTICLE_FROZEN) && !(s1 & s2 & REB_PARTICLE_ASLEEP)){
+                r->collisions[k++] = c;
+            }
+        }
+        collisions_N = k;
+    }
+    if (r->track_collision_statistics){
+        struct reb_collision_statistics* const stats = &r->collision_statistics;
+        stats->pairs = s.pairs;
+        stats->nodes = s.nodes;
+        stats->ghostboxes = s.ghostboxes;
+        stats->hits = collisions_N;
+        stats->resolved = 0;
+        stats->removed = 0;
+    }
+
+    int testparticle_decomposition = 0;
+#ifdef MPI
+    testparticle_decomposition = r->mpi_decomposition==REB_MPI_DECOMPOSITION_TESTPARTICLES;
+#endif // MPI
+
+    // Resolution is measured as a scope nested within the search.
+    reb_profiling_start(r, REB_PROFILING_COLLISION_RESOLVE);
+
+    // Number of passes over the collision array. With the root box decomposition, 
+    // collisions with particles of other nodes are resolved in a second pass.
+    int passes_N = 1;
+#ifdef MPI
+    struct reb_collision_remote_state remote = {0};
+    const int rootbox_decomposition = !testparticle_decomposition && r->mpi_num>1 && r->collision==REB_COLLISION_TREE;
+    if (rootbox_decomposition){
+        reb_collision_remote_gather(r, &collisions_N, &remote);
+        passes_N = 2;
+    }
+#endif // MPI
 
-    // randomize
+    // Time of impact
+    const int line = r->collision==REB_COLLISION_LINE || r->collision==REB_COLLISION_LINETREE || r->collision==REB_COLLISION_LINESAP || r->collision==REB_COLLISION_LINEBVH;
     for (int i=0;i<collisions_N;i++){
-        int new = rand_r(&(r->rand_seed))%collisions_N;
-        struct reb_collision c1 = r->collisions[i];
-        r->collisions[i] = r->collisions[new];
-        r->collisions[new] = c1;
+        r->collisions[i].t = (line && r->collision_time_of_impact)?reb_collision_time_of_impact(r, r->collisions[i]):r->t;
+    }
+
+    if (r->collision_time_of_impact){
+        // Resolve collisions in the order in which they happened
+        if (collisions_N>1){
+            qsort(r->collisions, collisions_N, sizeof(struct reb_collision), reb_collision_compare_time);
+        }
+    }else if (!testparticle_decomposition){
+        // randomize
+        // Not done with the test particle decomposition where all nodes need to resolve 
+        // collisions involving active particles in the same order.
+        reb_collision_shuffle(r, r->collisions, collisions_N);
+    }
+    int temporary_N = 0;
+#ifdef MPI
+    if (testparticle_decomposition && !(r->integrator==REB_INTEGRATOR_MERCURIUS && r->ri_mercurius.mode==1)){
+        temporary_N = reb_collision_gather_testparticle_decomposition(r, &collisions_N);
     }
+#endif // MPI
     // Loop over all collisions previously found in reb_collision_search().
     
+#ifndef MPI
+    if (r->collision_resolve_parallel && r->collision_resolve_batch==NULL && r->collision_resolve==reb_collision_resolve_hardsphere){
+        // Hard-sphere collisions never remove particles
+        if (r->collision_log_writer){
+            // Logged with the state before any collision of this timestep has been resolved
+            for (int i=0;i<collisions_N;i++){
+                const struct reb_collision c = r->collisions[i];
+                if (c.p1 == -1 || c.p2 == -1) continue;
+                reb_collision_log_append(r->collision_log_writer, reb_collision_event_get(r, c));
+            }
+        }
+        reb_collision_resolve_hardsphere_parallel(r, r->collisions, collisions_N);
+        if (r->track_collision_statistics){
+            r->collision_statistics.resolved = collisions_N;
+        }
+        reb_profiling_stop(r, REB_PROFILING_COLLISION_RESOLVE);
+        return;
+    }
+#endif // MPI
+    struct reb_collision_log_writer* const log = r->collision_log_writer;
     int (*resolve) (struct reb_simulation* const r, struct reb_collision c) = r->collision_resolve;
     if (resolve==NULL){
         // Default is to throw an exception
         resolve = reb_collision_resolve_halt;
     }
     unsigned int collision_resolve_keep_sorted = r->collision_resolve_keep_sorted;
-    if (r->integrator == REB_INTEGRATOR_MERCURIUS){
-        collision_resolve_keep_sorted = 1; // Force keep_sorted for hybrid integrator
+    if (r->integrator == REB_INTEGRATOR_MERCURIUS || testparticle_decomposition){
+        collision_resolve_keep_sorted = 1; // Force keep_sorted for hybrid integrator and to keep active particles first
+    }
+
+    // Particles are only flagged during the loop and removed at the end, 
+    // so indices in the collision array remain valid.
+    int N_removable = r->N;
+    unsigned char* removed = NULL;
+    int* removed_indices = NULL;
+    int removed_N = 0;
+    long resolved_N = 0;
+    long removals_N = 0;
+    int* outcomes = NULL;
+    struct reb_collision_event* events = NULL;
+
+    for (int pass=0;pass<passes_N;pass++){
+#ifdef MPI
+    if (pass==1){
+        // All local collisions have been resolved. Now the collisions with particles of other nodes.
+        reb_collision_remote_prepare(r, &remote, removed, &collisions_N);
+        temporary_N = remote.temporary_N;
+        if (removed && r->N>N_removable){
+            removed = realloc(removed, sizeof(unsigned char)*r->N);
+            memset(removed+N_removable, 0, sizeof(unsigned char)*(r->N-N_removable));
+            removed_indices = realloc(removed_indices, sizeof(int)*r->N);
+        }
+        N_removable = r->N;
+    }
+#endif // MPI
+    if (r->collision_resolve_batch){
+        outcomes = realloc(outcomes, sizeof(int)*(collisions_N+1));
+        if (log){
+            // The batch function changes the particles, record the state before.
+            events = realloc(events, sizeof(struct reb_collision_event)*(collisions_N+1));
+            for (int i=0;i<collisions_N;i++){
+                const struct reb_collision c = r->collisions[i];
+                if (c.p1 == -1 || c.p2 == -1) continue;
+                events[i] = reb_collision_event_get(r, c);
+            }
+        }
+        r->collision_resolve_batch(r, r->collisions, collisions_N, outcomes);
     }
 
     for (int i=0;i<collisions_N;i++){
         
         struct reb_collision c = r->collisions[i];
-        if (c.p1 != -1 && c.p2 != -1){
+        if (c.p1 == -1 || c.p2 == -1){
+            continue;
+        }
+        int outcome;
+        struct reb_collision_event event = {0};
+        const int involves_removed = removed && ((c.p1<N_removable && removed[c.p1]) || (c.p2<N_removable && removed[c.p2]));
+        if (outcomes){
+            // Already resolved
+            outcome = outcomes[i];
+            if (events){
+                event = events[i];
+            }
+        }else{
+            if (involves_removed){
+                // Skip collisions which involve a removed particle
+                continue;
+            }
+            if (log){
+                event = reb_collision_event_get(r, c);
+            }
             // Resolve collision
-            int outcome = resolve(r, c);
-            
-            // Remove particles
-            if (outcome & 1){
-                // Remove p1
-                int removedp1 = reb_remove(r,c.p1,collision_resolve_keep_sorted);
-                if (removedp1){
-                    if (r->tree_root){ // In a tree, particles get removed later. 
-                        for (int j=i+1;j<collisions_N;j++){ // Update other collisions
-                            struct reb_collision* cp = &(r->collisions[j]);
-                            // Skip collisions which involved the removed particle
-                            if (cp->p1==c.p1 || cp->p2==c.p1){
-                                cp->p1 = -1;
-                                cp->p2 = -1;
-                            }
-                        }
-                    }else{ // Not in a tree, particles get removed immediately 
-                        // Update p2 of current collision
-                        if (collision_resolve_keep_sorted){
-                            if (c.p2 > c.p1){
-                                c.p2--;
-                            }
-                        }else{
-                            if (c.p2 == r->N-r->N_var){
-                                c.p2 = c.p1;
-                            }
-                        }
-                        for (int j=i+1;j<collisions_N;j++){ // Update other collisions
-                            struct reb_collision* cp = &(r->collisions[j]);
-                            // Skip collisions which involve the removed particle
-                            if (cp->p1==c.p1 || cp->p2==c.p1){
-                                cp->p1 = -1;
-                                cp->p2 = -1;
-                            }
-                            // Adjust collisions
-                            if (collision_resolve_keep_sorted){
-                                if (cp->p1 > c.p1){
-                                    cp->p1--;
-                                }
-                                if (cp->p2 > c.p1){
-                                    cp->p2--;
-                                }
-                            }else{
-                                if (cp->p1 == r->N-r->N_var){
-                                    cp->p1 = c.p1;
-                                }
-                                if (cp->p2 == r->N-r->N_var){
-                                    cp->p2 = c.p1;
-                                }
-                            }
-                        }
-                    }
+            outcome = resolve(r, c);
+        }
+        resolved_N++;
+        if (log && !involves_removed){ // Same entries with and without a batch function
+            event.outcome = outcome;
+            reb_collision_log_append(log, event);
+        }
+        
+        // Remove particles
+        for (int k=0;k<2;k++){
+            if (!(outcome & (1<<k))) continue;
+            const int index = k==0?c.p1:c.p2;
+            if (index>=N_removable){
+                char warning[1024];
+                sprintf(warning, "Index %d passed to particles_remove was out of range (N=%d).  Did not remove particle.", index, r->N);
+                reb_error(r, warning);
+                continue;
+            }
+            if (removed && removed[index]){
+                // Removed by a previous collision in the same batch
+                continue;
+            }
+            if (removed==NULL){
+                removed = calloc(N_removable, sizeof(unsigned char));
+                removed_indices = malloc(sizeof(int)*N_removable);
+            }
+            if (index>=N_removable-temporary_N){
+                // Copy of a particle of another node. Removed below.
+                removed[index] = 1;
+                continue;
+            }
+            if (r->tree_root){ // In a tree, particles are flagged and removed later. 
+                if (!reb_remove(r, index, collision_resolve_keep_sorted)){
+                    continue;
                 }
+            }else{
+                removed_indices[removed_N] = index;
+                removed_N++;
             }
-            if (outcome & 2){
-                // Remove p1
-                int removedp2 = reb_remove(r,c.p2,collision_resolve_keep_sorted);
-                if (removedp2){ // Update other collisions
-                    if (r->tree_root){ // In a tree, particles get removed later. 
-                        for (int j=i+1;j<collisions_N;j++){ // Update other collisions
-                            struct reb_collision* cp = &(r->collisions[j]);
-                            // Skip collisions which involved the removed particle
-                            if (cp->p1==c.p2 || cp->p2==c.p2){
-                                cp->p1 = -1;
-                                cp->p2 = -1;
-                            }
-                        }
-                    }else{ // Not in a tree, particles get removed immediately 
-                        for (int j=i+1;j<collisions_N;j++){
-                            struct reb_collision* cp = &(r->collisions[j]);
-                            // Skip collisions which involve the removed particle
-                            if (cp->p1==c.p2 || cp->p2==c.p2){
-                                cp->p1 = -1;
-                                cp->p2 = -1;
-                            }
-                            // Adjust collisions
-                            if (collision_resolve_keep_sorted){
-                                if (cp->p1 > c.p2){
-                                    cp->p1--;
-                                }
-                                if (cp->p2 > c.p2){
-                                    cp->p2--;
-                                }
-                            }else{
-                                if (cp->p1 == r->N-r->N_var){
-                                    cp->p1 = c.p2;
-                                }
-                                if (cp->p2 == r->N-r->N_var){
-                                    cp->p2 = c.p2;
-                                }
-                            }
-                        }
+            removed[index] = 1;
+            removals_N++;
+        }
+    }
+    }
+#ifdef MPI
+    if (rootbox_decomposition){
+        // Results for particles of this node which have been resolved on other nodes.
+        int* remove = NULL;
+        const int remove_N = reb_collision_remote_scatter(r, &remote, removed, &remove);
+        for (int k=0;k<remove_N;k++){
+            const int index = remove[k];
+            if (removed==NULL){
+                removed = calloc(N_removable, sizeof(unsigned char));
+                removed_indices = malloc(sizeof(int)*N_removable);
+            }
+            if (removed[index]){
+                continue;
+            }
+            if (r->tree_root){
+                if (!reb_remove(r, index, collision_resolve_keep_sorted)){
+                    continue;
+                }
+            }else{
+                removed_indices[removed_N] = index;
+                removed_N++;
+            }
+            removed[index] = 1;
+            removals_N++;
+        }
+        free(remove);
+    }
+#endif // MPI
+    if (r->track_collision_statistics){
+        r->collision_statistics.resolved = resolved_N;
+        r->collision_statistics.removed = removals_N;
+    }
+    // Copies of particles of other nodes are at the end of the particle array.
+    r->N -= temporary_N;
+    if (removed){
+        if (!r->tree_root){
+            if (r->inject_pool>0){
+                // Removed test particles become free slots for injected particles.
+                int kept_N = 0;
+                for (int k=0;k<removed_N;k++){
+                    if (!reb_sink_slot(r, removed_indices[k])){
+                        removed_indices[kept_N++] = removed_indices[k];
                     }
                 }
+                removed_N = kept_N;
             }
+            reb_remove_multiple(r, removed_indices, removed_N, collision_resolve_keep_sorted);
+        }
+        free(removed);
+        free(removed_indices);
+    }
+    free(outcomes);
+    free(events);
+    reb_profiling_stop(r, REB_PROFILING_COLLISION_RESOLVE);
+}
+
+/**
+ * @brief Resolves all collisions one after another, just like reb_collision_search() does without a batch function.
+ * @details Collisions which involve a particle that has been removed 
+ * by a previous collision are skipped and have an outcome of 0.
+ */
+static void reb_collision_resolve_batch_sequential(struct reb_simulation* const r, struct reb_collision* const collisions, const int collisions_N, int* const outcomes, int (*resolve) (struct reb_simulation* const r, struct reb_collision c)){
+    const int N = r->N;
+    unsigned char* removed = calloc(N, sizeof(unsigned char));
+    for (int i=0;i<collisions_N;i++){
+        const struct reb_collision c = collisions[i];
+        outcomes[i] = 0;
+        if (c.p1 == -1 || c.p2 == -1){
+            continue;
+        }
+        if ((c.p1<N && removed[c.p1]) || (c.p2<N && removed[c.p2])){
+            continue;
+        }
+        outcomes[i] = resolve(r, c);
+        if ((outcomes[i] & 1) && c.p1<N){
+            removed[c.p1] = 1;
+        }
+        if ((outcomes[i] & 2) && c.p2<N){
+            removed[c.p2] = 1;
         }
     }
+    free(removed);
+}
+
+void reb_collision_resolve_hardsphere_batch(struct reb_simulation* const r, struct reb_collision* const collisions, const int collisions_N, int* const outcomes){
+    reb_collision_resolve_batch_sequential(r, collisions, collisions_N, outcomes, reb_collision_resolve_hardsphere);
+}
+
+void reb_collision_resolve_merge_batch(struct reb_simulation* const r, struct reb_collision* const collisions, const int collisions_N, int* const outcomes){
+    reb_collision_resolve_batch_sequential(r, collisions, collisions_N, outcomes, reb_collision_resolve_merge);
 }
 
 /**
@@ -462,6 +3361,13 @@ void reb_set_collision_resolve(struct reb_simulation* r, int (*resolve) (struct
     r->collision_resolve = resolve;
 }
 
+/**
+ * @brief Workaround for python setters.
+ **/
+void reb_set_collision_resolve_batch(struct reb_simulation* r, void (*resolve_batch) (struct reb_simulation* const r, struct reb_collision* const collisions, const int collisions_N, int* const outcomes)){
+    r->collision_resolve_batch = resolve_batch;
+}
+
 /**
  * @brief Find the nearest neighbour in a cell or its daughters.
  * @details The function only returns a positive result if the particles
@@ -474,11 +3380,15 @@ void reb_set_collision_resolve(struct reb_simulation* r, int (*resolve) (struct
  * @param nearest_r2 Pointer to the nearest neighbour found so far.
  * @param collision_nearest Pointer to the nearest collision found so far.
  * @param c Pointer to the cell currently being searched in.
+ * @param collisions Pointer to the collision array new collisions are appended to
  * @param collisions_N Pointer to current number of collisions
+ * @param collisions_allocatedN Pointer to the allocated size of the collision array
  * @param gbunmod Ghostbox unmodified
+ * @param stats If not NULL, visited cells and tested pairs are counted here.
  */
-static void reb_tree_get_nearest_neighbour_in_cell(struct reb_simulation* const r, int* collisions_N, struct reb_ghostbox gb, struct reb_ghostbox gbunmod, int ri, double p1_r, double* nearest_r2, struct reb_collision* collision_nearest, struct reb_treecell* c){
+static void reb_tree_get_nearest_neighbour_in_cell(struct reb_simulation* const r, struct reb_collision** collisions, int* collisions_N, int* collisions_allocatedN, struct reb_ghostbox gb, struct reb_ghostbox gbunmod, int ri, double p1_r, double* nearest_r2, struct reb_collision* collision_nearest, struct reb_treecell* c, struct reb_collision_statistics* stats){
     const struct reb_particle* const particles = r->particles;
+    if (stats) stats->nodes++;
     if (c->pt>=0){     
         // c is a leaf node
         int condition     = 1;
@@ -498,6 +3408,7 @@ static void reb_tree_get_nearest_neighbour_in_cell(struct reb_simulation* const
         }
 #endif // MPI
         if (condition){
+            if (stats) stats->pairs++;
             struct reb_particle p2;
 #ifdef MPI
             if (isloc==1){
@@ -505,8 +3416,7 @@ static void reb_tree_get_nearest_neighbour_in_cell(struct reb_simulation* const
                 p2 = particles[c->pt];
 #ifdef MPI
             }else{
-                int root_n_per_node = r->root_n/r->mpi_num;
-                int proc_id = ri/root_n_per_node;
+                int proc_id = reb_communication_mpi_rootbox_owner(r, ri);
                 p2 = r->particles_recv[proc_id][c->pt];
             }
 #endif // MPI
@@ -530,17 +3440,8 @@ static void reb_tree_get_nearest_neighbour_in_cell(struct reb_simulation* const
             collision_nearest->ri = ri;
             collision_nearest->p2 = c->pt;
             collision_nearest->gb = gbunmod;
-            // Save collision in collisions array.
-#pragma omp critical
-            {
-                if (r->collisions_allocatedN<=(*collisions_N)){
-                    // Init to 32 if no space has been allocated yet, otherwise double it.
-                    r->collisions_allocatedN = r->collisions_allocatedN ? r->collisions_allocatedN * 2 : 32;
-                    r->collisions = realloc(r->collisions,sizeof(struct reb_collision)*r->collisions_allocatedN);
-                }
-                r->collisions[(*collisions_N)] = *collision_nearest;
-                (*collisions_N)++;
-            }
+            // Save collision in collisions array (thread-local if OPENMP is used).
+            reb_collision_append(collisions, collisions_N, collisions_allocatedN, *collision_nearest);
         }
     }else{        
         // c is not a leaf node
@@ -548,13 +3449,14 @@ static void reb_tree_get_nearest_neighbour_in_cell(struct reb_simulation* const
         double dy = gb.shifty - c->y;
         double dz = gb.shiftz - c->z;
         double r2 = dx*dx + dy*dy + dz*dz;
-        double rp  = p1_r + r->max_radius[1] + 0.86602540378443*c->w;
+        // Particles in c are at most 0.5*sqrt(3)*w away from its center and have a radius of at most c->rmax.
+        double rp  = p1_r + c->rmax + 0.86602540378443*c->w;
         // Check if we need to decent into daughter cells
         if (r2 < rp*rp ){
             for (int o=0;o<8;o++){
                 struct reb_treecell* d = c->oct[o];
                 if (d!=NULL){
-                    reb_tree_get_nearest_neighbour_in_cell(r, collisions_N, gb,gbunmod,ri,p1_r,nearest_r2,collision_nearest,d);
+                    reb_tree_get_nearest_neighbour_in_cell(r, collisions, collisions_N, collisions_allocatedN, gb,gbunmod,ri,p1_r,nearest_r2,collision_nearest,d,stats);
                 }
             }
         }
@@ -562,11 +3464,13 @@ static void reb_tree_get_nearest_neighbour_in_cell(struct reb_simulation* const
 }
 
 
-static void reb_tree_check_for_overlapping_trajectories_in_cell(struct reb_simulation* const r, int* collisions_N, struct reb_ghostbox gb, struct reb_ghostbox gbunmod, int ri, double p1_r, double p1_r_plus_dtv, struct reb_collision* collision_nearest, struct reb_treecell* c, double maxdrift){
+static void reb_tree_check_for_overlapping_trajectories_in_cell(struct reb_simulation* const r, struct reb_collision** collisions, int* collisions_N, int* collisions_allocatedN, struct reb_ghostbox gb, struct reb_ghostbox gbunmod, int ri, double p1_r, double p1_r_plus_dtv, struct reb_collision* collision_nearest, struct reb_treecell* c, struct reb_collision_statistics* stats){
     const struct reb_particle* const particles = r->particles;
+    if (stats) stats->nodes++;
     if (c->pt>=0){     
         // c is a leaf node
         if (c->pt != collision_nearest->p1){
+            if (stats) stats->pairs++;
             struct reb_particle p2 = particles[c->pt];
             double dt_done_last = r->dt_last_done;
             const double dx1 = gb.shiftx - p2.x; // distance at beginning
@@ -595,17 +3499,8 @@ static void reb_tree_check_for_overlapping_trajectories_in_cell(struct reb_simul
             collision_nearest->ri = ri;
             collision_nearest->p2 = c->pt;
             collision_nearest->gb = gbunmod;
-            // Save collision in collisions array.
-#pragma omp critical
-            {
-                if (r->collisions_allocatedN<=(*collisions_N)){
-                    // Init to 32 if no space has been allocated yet, otherwise double it.
-                    r->collisions_allocatedN = r->collisions_allocatedN ? r->collisions_allocatedN * 2 : 32;
-                    r->collisions = realloc(r->collisions,sizeof(struct reb_collision)*r->collisions_allocatedN);
-                }
-                r->collisions[(*collisions_N)] = *collision_nearest;
-                (*collisions_N)++;
-            }
+            // Save collision in collisions array (thread-local if OPENMP is used).
+            reb_collision_append(collisions, collisions_N, collisions_allocatedN, *collision_nearest);
         }
     }else{        
         // c is not a leaf node
@@ -613,13 +3508,14 @@ static void reb_tree_check_for_overlapping_trajectories_in_cell(struct reb_simul
         double dy = gb.shifty - c->y;
         double dz = gb.shiftz - c->z;
         double r2 = dx*dx + dy*dy + dz*dz;
-        double rp  = p1_r_plus_dtv + maxdrift + 0.86602540378443*c->w;
+        // Particles in c are at most 0.5*sqrt(3)*w away from its center, have a radius of at most c->rmax and moved at most c->vmax*dt.
+        double rp  = p1_r_plus_dtv + c->rmax + r->dt_last_done*c->vmax + 0.86602540378443*c->w;
         // Check if we need to decent into daughter cells
         if (r2 < rp*rp ){
             for (int o=0;o<8;o++){
                 struct reb_treecell* d = c->oct[o];
                 if (d!=NULL){
-                    reb_tree_check_for_overlapping_trajectories_in_cell(r, collisions_N, gb,gbunmod,ri,p1_r,p1_r_plus_dtv,collision_nearest,d,maxdrift);
+                    reb_tree_check_for_overlapping_trajectories_in_cell(r, collisions, collisions_N, collisions_allocatedN, gb,gbunmod,ri,p1_r,p1_r_plus_dtv,collision_nearest,d,stats);
                 }
             }
         }
@@ -629,7 +3525,14 @@ static void reb_tree_check_for_overlapping_trajectories_in_cell(struct reb_simul
 
 
 
-int reb_collision_resolve_hardsphere(struct reb_simulation* const r, struct reb_collision c){
+/**
+ * @brief Hard-sphere collision model (see reb_collision_resolve_hardsphere()).
+ * @details Does not modify any global variables of the simulation, 
+ * so independent collisions can be resolved in parallel.
+ * @param plog Set to the y-momentum change if the collision has been resolved.
+ * @return 1 if the collision has been resolved, 0 if the particles are not overlapping or not approaching.
+ */
+static int reb_collision_hardsphere(struct reb_simulation* const r, struct reb_collision c, double* const plog){
     struct reb_particle* const particles = r->particles;
     struct reb_particle p1 = particles[c.p1];
     struct reb_particle p2;
@@ -640,12 +3543,21 @@ int reb_collision_resolve_hardsphere(struct reb_simulation* const r, struct reb_
         p2 = particles[c.p2];
 #ifdef MPI
     }else{
-        int root_n_per_node = r->root_n/r->mpi_num;
-        int proc_id = c.ri/root_n_per_node;
+        int proc_id = reb_communication_mpi_rootbox_owner(r, c.ri);
         p2 = r->particles_recv[proc_id][c.p2];
     }
 #endif // MPI
 //    if (p1.lastcollision==t || p2.lastcollision==t) return;
+    // If the time of impact is known, the collision is resolved at that time.
+    const double dt_impact = r->collision_time_of_impact?r->t-c.t:0.;
+    if (dt_impact>0.){
+        p1.x -= dt_impact*p1.vx;
+        p1.y -= dt_impact*p1.vy;
+        p1.z -= dt_impact*p1.vz;
+        p2.x -= dt_impact*p2.vx;
+        p2.y -= dt_impact*p2.vy;
+        p2.z -= dt_impact*p2.vz;
+    }
     struct reb_ghostbox gb = c.gb;
     double x21  = p1.x + gb.shiftx  - p2.x; 
     double y21  = p1.y + gb.shifty  - p2.y; 
@@ -657,7 +3569,8 @@ int reb_collision_resolve_hardsphere(struct reb_simulation* const r, struct reb_
     }else{
         oldvyouter = p2.vy;
     }
-    if (rp*rp < x21*x21 + y21*y21 + z21*z21) return 0;
+    // At the time of impact the particles just touch, so this check would be affected by round-off.
+    if (dt_impact<=0. && rp*rp < x21*x21 + y21*y21 + z21*z21) return 0;
     double vx21 = p1.vx + gb.shiftvx - p2.vx; 
     double vy21 = p1.vy + gb.shiftvy - p2.vy; 
     double vz21 = p1.vz + gb.shiftvz - p2.vz; 
@@ -705,6 +3618,12 @@ int reb_collision_resolve_hardsphere(struct reb_simulation* const r, struct reb_
     particles[c.p2].vy -=    p2pf*dvy2nn;
     particles[c.p2].vz -=    p2pf*dvz2nn;
     particles[c.p2].lastcollision = r->t;
+    if (dt_impact>0.){
+        // Move along the new trajectory from the time of impact to the current time
+        particles[c.p2].x -=    dt_impact*p2pf*dvx2n;
+        particles[c.p2].y -=    dt_impact*p2pf*dvy2nn;
+        particles[c.p2].z -=    dt_impact*p2pf*dvz2nn;
+    }
 #ifdef MPI
     }
 #endif // MPI
@@ -713,13 +3632,25 @@ int reb_collision_resolve_hardsphere(struct reb_simulation* const r, struct reb_
     particles[c.p1].vy +=    p1pf*dvy2nn; 
     particles[c.p1].vz +=    p1pf*dvz2nn; 
     particles[c.p1].lastcollision = r->t;
+    if (dt_impact>0.){
+        particles[c.p1].x +=    dt_impact*p1pf*dvx2n;
+        particles[c.p1].y +=    dt_impact*p1pf*dvy2nn;
+        particles[c.p1].z +=    dt_impact*p1pf*dvz2nn;
+    }
         
     // Return y-momentum change
     if (x21>0){
-        r->collisions_plog += -fabs(x21)*(oldvyouter-particles[c.p1].vy) * p1.m;
-        r->collisions_Nlog ++;
+        *plog = -fabs(x21)*(oldvyouter-particles[c.p1].vy) * p1.m;
     }else{
-        r->collisions_plog += -fabs(x21)*(oldvyouter-particles[c.p2].vy) * p2.m;
+        *plog = -fabs(x21)*(oldvyouter-particles[c.p2].vy) * p2.m;
+    }
+    return 1;
+}
+
+int reb_collision_resolve_hardsphere(struct reb_simulation* const r, struct reb_collision c){
+    double plog;
+    if (reb_collision_hardsphere(r, c, &plog)){
+        r->collisions_plog += plog;
         r->collisions_Nlog ++;
     }
     return 0;
@@ -752,44 +3683,13 @@ int reb_collision_resolve_merge(struct reb_simulation* const r, struct reb_colli
                 
     double invmass = 1.0/(pi->m + pj->m);
     
-    //Scale out energy from collision - initial energy
-    double Ei=0, Ef=0;
+    // Scale out energy from collision - initial energy
+    // Kinetic energy is calculated in the simulation frame. Because momentum 
+    // is conserved, the change is the same as in the inertial frame.
+    double Ei=0;
+    const int ij[2] = {i, j};
     if(r->track_energy_offset){
-        {
-            double vx = pi->vx;
-            double vy = pi->vy;
-            double vz = pi->vz;
-            // Calculate energy difference in inertial frame
-            if (r->integrator == REB_INTEGRATOR_MERCURIUS && r->ri_mercurius.mode==1){
-                vx += r->ri_mercurius.com_vel.x;
-                vy += r->ri_mercurius.com_vel.y;
-                vz += r->ri_mercurius.com_vel.z;
-            }
-
-            Ei += 0.5*pi->m*(vx*vx + vy*vy + vz*vz);
-        }
-        {
-            double vx = pj->vx;
-            double vy = pj->vy;
-            double vz = pj->vz;
-            if (r->integrator == REB_INTEGRATOR_MERCURIUS && r->ri_mercurius.mode==1){
-                vx += r->ri_mercurius.com_vel.x;
-                vy += r->ri_mercurius.com_vel.y;
-                vz += r->ri_mercurius.com_vel.z;
-            }
-
-            Ei += 0.5*pj->m*(vx*vx + vy*vy + vz*vz);
-        }
-        const int N_active = ((r->N_active==-1)?r->N-r->N_var:r->N_active);
-        // No potential energy between test particles
-        if (i<N_active || j<N_active){
-            double x = pi->x - pj->x;
-            double y = pi->y - pj->y;
-            double z = pi->z - pj->z;
-            double _r = sqrt(x*x + y*y + z*z);
-
-            Ei += - r->G*pi->m*pj->m/_r;
-        }
+        Ei = reb_tools_energy_particles(r, ij, 2);
     }
     
     // Merge by conserving mass, volume and momentum
@@ -805,20 +3705,9 @@ int reb_collision_resolve_merge(struct reb_simulation* const r, struct reb_colli
     
 
     // Keeping track of energy offst
+    // Particle j is still in the simulation but will be removed.
     if(r->track_energy_offset){
-        {
-            double vx = pi->vx;
-            double vy = pi->vy;
-            double vz = pi->vz;
-            if (r->integrator == REB_INTEGRATOR_MERCURIUS && r->ri_mercurius.mode==1){
-                vx += r->ri_mercurius.com_vel.x;
-                vy += r->ri_mercurius.com_vel.y;
-                vz += r->ri_mercurius.com_vel.z;
-            }
-
-            Ef += 0.5*pi->m*(vx*vx + vy*vy + vz*vz);
-        }
-        r->energy_offset += Ei - Ef;
+        r->energy_offset += Ei - reb_tools_energy_particles_ignore(r, &i, 1, j);
     }
     
     return swap?1:2; // Remove particle p2 from simulation
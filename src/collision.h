@@ -29,4 +29,29 @@
  */
 void reb_collision_search(struct reb_simulation* const r);
 
+/**
+ * @brief Stores the positions and velocities at the beginning of the timestep.
+ * @details Called by reb_step() if collision_line_hermite is set. Used by REB_COLLISION_LINE
+ * to interpolate trajectories with cubic Hermite polynomials.
+ */
+void reb_collision_line_store(struct reb_simulation* const r);
+
+/**
+ * @brief Searches for a pair of particles closer than dmin. Used for exit_min_distance.
+ * @details Uses the hashed uniform grid of REB_COLLISION_GRID with a cell size of dmin. 
+ * Pairs of test particles are ignored if testparticle_type is 0. Ghost boxes are not searched.
+ * If there are several such pairs, the same pair is found independent of the number of threads.
+ * @param pi Index of the first particle of the pair (set only if a pair is found).
+ * @param pj Index of the second particle of the pair, pj>pi (set only if a pair is found).
+ * @return 1 if a pair was found, 0 otherwise.
+ */
+int reb_collision_find_close_pair(struct reb_simulation* const r, const double dmin, int* const pi, int* const pj);
+
+#ifdef GPU
+/**
+ * @brief Frees the buffers used by the GPU version of the collision search on the host and on the device.
+ */
+void reb_collision_gpu_free(struct reb_simulation* const r);
+#endif // GPU
+
 #endif // _COLLISIONS_H
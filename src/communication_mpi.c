@@ -40,14 +40,81 @@
 #include <math.h>
 #include <time.h>
 #include <sys/time.h>
+#include <stddef.h>
 #include "particle.h"
 #include "rebound.h"
 #include "tree.h"
 #include "boundary.h"
 #include "communication_mpi.h"
+#include "profiling.h"
+
+// Creates a datatype for the given fields of a struct. The extent of the datatype is 
+// that of the struct, so arrays of structs can be sent directly. Only the listed fields 
+// are transferred. All other fields, in particular pointers, are left untouched on the receiver.
+static MPI_Datatype reb_communication_mpi_create_struct_type(const int count, const MPI_Aint* displacements, const MPI_Datatype* types, const MPI_Aint extent){
+	int blocklengths[count];
+	for (int i=0;i<count;i++){
+		blocklengths[i] = 1;
+	}
+	MPI_Datatype tmp, type;
+	MPI_Type_create_struct(count, blocklengths, displacements, types, &tmp);
+	MPI_Type_create_resized(tmp, 0, extent, &type);
+	MPI_Type_commit(&type);
+	MPI_Type_free(&tmp);
+	return type;
+}
+
+static void reb_communication_mpi_create_types(struct reb_simulation* const r){
+	{
+		const MPI_Aint d[] = {
+			offsetof(struct reb_particle, x), offsetof(struct reb_particle, y), offsetof(struct reb_particle, z), 
+			offsetof(struct reb_particle, vx), offsetof(struct reb_particle, vy), offsetof(struct reb_particle, vz), 
+			offsetof(struct reb_particle, ax), offsetof(struct reb_particle, ay), offsetof(struct reb_particle, az), 
+			offsetof(struct reb_particle, m), offsetof(struct reb_particle, r), offsetof(struct reb_particle, lastcollision), 
+			offsetof(struct reb_particle, hash)};
+		const MPI_Datatype t[] = {MPI_DOUBLE, MPI_DOUBLE, MPI_DOUBLE, MPI_DOUBLE, MPI_DOUBLE, MPI_DOUBLE, MPI_DOUBLE, MPI_DOUBLE, MPI_DOUBLE, MPI_DOUBLE, MPI_DOUBLE, MPI_DOUBLE, MPI_UINT32_T};
+		r->mpi_particle_type = reb_communication_mpi_create_struct_type(13, d, t, sizeof(struct reb_particle));
+	}
+	{
+		const MPI_Aint d[] = {
+			offsetof(struct reb_particle, x), offsetof(struct reb_particle, y), offsetof(struct reb_particle, z), 
+			offsetof(struct reb_particle, vx), offsetof(struct reb_particle, vy), offsetof(struct reb_particle, vz), 
+			offsetof(struct reb_particle, m), offsetof(struct reb_particle, r), offsetof(struct reb_particle, lastcollision), 
+			offsetof(struct reb_particle, hash)};
+		const MPI_Datatype t[] = {MPI_DOUBLE, MPI_DOUBLE, MPI_DOUBLE, MPI_DOUBLE, MPI_DOUBLE, MPI_DOUBLE, MPI_DOUBLE, MPI_DOUBLE, MPI_DOUBLE, MPI_UINT32_T};
+		r->mpi_particle_collision_type = reb_communication_mpi_create_struct_type(10, d, t, sizeof(struct reb_particle));
+	}
+	{
+		const MPI_Aint d[] = {
+			offsetof(struct reb_treecell, x), offsetof(struct reb_treecell, y), offsetof(struct reb_treecell, z), offsetof(struct reb_treecell, w),
+			offsetof(struct reb_treecell, m), offsetof(struct reb_treecell, mx), offsetof(struct reb_treecell, my), offsetof(struct reb_treecell, mz),
+#ifdef QUADRUPOLE
+			offsetof(struct reb_treecell, mxx), offsetof(struct reb_treecell, mxy), offsetof(struct reb_treecell, mxz),
+			offsetof(struct reb_treecell, myy), offsetof(struct reb_treecell, myz), offsetof(struct reb_treecell, mzz),
+#endif // QUADRUPOLE
+			offsetof(struct reb_treecell, pt)};
+		const MPI_Datatype t[] = {MPI_DOUBLE, MPI_DOUBLE, MPI_DOUBLE, MPI_DOUBLE, MPI_DOUBLE, MPI_DOUBLE, MPI_DOUBLE, MPI_DOUBLE,
+#ifdef QUADRUPOLE
+			MPI_DOUBLE, MPI_DOUBLE, MPI_DOUBLE, MPI_DOUBLE, MPI_DOUBLE, MPI_DOUBLE,
+#endif // QUADRUPOLE
+			MPI_INT};
+		r->mpi_cell_gravity_type = reb_communication_mpi_create_struct_type(sizeof(d)/sizeof(d[0]), d, t, sizeof(struct reb_treecell));
+	}
+	{
+		const MPI_Aint d[] = {
+			offsetof(struct reb_treecell, x), offsetof(struct reb_treecell, y), offsetof(struct reb_treecell, z), offsetof(struct reb_treecell, w),
+			offsetof(struct reb_treecell, rmax), offsetof(struct reb_treecell, vmax), offsetof(struct reb_treecell, pt)};
+		const MPI_Datatype t[] = {MPI_DOUBLE, MPI_DOUBLE, MPI_DOUBLE, MPI_DOUBLE, MPI_DOUBLE, MPI_DOUBLE, MPI_INT};
+		r->mpi_cell_collision_type = reb_communication_mpi_create_struct_type(7, d, t, sizeof(struct reb_treecell));
+	}
+}
 
 void reb_communication_mpi_init(struct reb_simulation* const r, int argc, char** argv){
-	MPI_Init(&argc,&argv);
+	int initialized = 0;
+	MPI_Initialized(&initialized);
+	if (!initialized){
+		MPI_Init(&argc,&argv);
+	}
 	MPI_Comm_size(MPI_COMM_WORLD,&(r->mpi_num));
 	MPI_Comm_rank(MPI_COMM_WORLD,&(r->mpi_id));
 	
@@ -58,6 +125,8 @@ void reb_communication_mpi_init(struct reb_simulation* const r, int argc, char**
 	r->particles_recv   	= calloc(r->mpi_num,sizeof(struct reb_particle*));
 	r->particles_recv_N 	= calloc(r->mpi_num,sizeof(int));
 	r->particles_recv_Nmax 	= calloc(r->mpi_num,sizeof(int));
+	r->particles_send_index	= calloc(r->mpi_num,sizeof(int*));
+	r->particles_recv_index	= calloc(r->mpi_num,sizeof(int*));
 
 	// Prepare send/recv buffers for essential tree
 	r->tree_essential_send   	= calloc(r->mpi_num,sizeof(struct reb_treecell*));
@@ -66,11 +135,156 @@ void reb_communication_mpi_init(struct reb_simulation* const r, int argc, char**
 	r->tree_essential_recv   	= calloc(r->mpi_num,sizeof(struct reb_treecell*));
 	r->tree_essential_recv_N 	= calloc(r->mpi_num,sizeof(int));
 	r->tree_essential_recv_Nmax = calloc(r->mpi_num,sizeof(int));
+	r->tree_essential_requests  = malloc(2*r->mpi_num*sizeof(MPI_Request));
+	for (int i=0;i<2*r->mpi_num;i++){
+		r->tree_essential_requests[i] = MPI_REQUEST_NULL;
+	}
+
+	// Datatypes which only contain the fields the receiver needs.
+	reb_communication_mpi_create_types(r);
+
+	// Root boxes are initially assigned to nodes in contiguous blocks.
+	// With the test particle decomposition, every node owns all root boxes.
+	r->mpi_rootbox_owner = malloc(r->root_n*sizeof(int));
+	r->mpi_rootbox_cost  = calloc(r->root_n,sizeof(double));
+	for (int i=0;i<r->root_n;i++){
+		if (r->mpi_decomposition==REB_MPI_DECOMPOSITION_TESTPARTICLES){
+			r->mpi_rootbox_owner[i] = r->mpi_id;
+		}else{
+			r->mpi_rootbox_owner[i] = i/(r->root_n/r->mpi_num);
+		}
+	}
+}
+
+int reb_communication_mpi_rootbox_owner(const struct reb_simulation* const r, int i){
+	return r->mpi_rootbox_owner[i];
+}
+
+void reb_communication_mpi_update_rootbox_cost(struct reb_simulation* const r){
+	if (r->tree_root==NULL) return;
+	for (int i=0;i<r->root_n;i++){
+		const struct reb_treecell* node = r->tree_root[i];
+		if (node!=NULL && r->mpi_rootbox_owner[i]==r->mpi_id){
+			r->mpi_rootbox_cost[i] += node->pt>=0 ? 1 : -node->pt;
+		}
+	}
+}
+
+// Interleaves the bits of the root box coordinates.
+static uint64_t reb_communication_mpi_rootbox_morton_key(const struct reb_simulation* const r, int i){
+	const uint64_t c[3] = {i%r->root_nx, (i/r->root_nx)%r->root_ny, i/(r->root_nx*r->root_ny)};
+	uint64_t key = 0;
+	for (int b=0;b<21;b++){
+		for (int d=0;d<3;d++){
+			key |= ((c[d]>>b)&1) << (3*b+d);
+		}
+	}
+	return key;
+}
+
+struct reb_communication_mpi_rootbox_key {
+	uint64_t key;
+	int index;
+};
+
+static int reb_communication_mpi_compare_rootbox_key(const void* a, const void* b){
+	const uint64_t ka = ((const struct reb_communication_mpi_rootbox_key*)a)->key;
+	const uint64_t kb = ((const struct reb_communication_mpi_rootbox_key*)b)->key;
+	return (ka>kb) - (ka<kb);
+}
+
+void reb_communication_mpi_rebalance(struct reb_simulation* const r){
+	const int root_n = r->root_n;
+	// Every root box has exactly one owner, so summing gives the cost of all root boxes on every node.
+	double* cost = malloc(root_n*sizeof(double));
+	MPI_Allreduce(r->mpi_rootbox_cost, cost, root_n, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+	for (int i=0;i<root_n;i++){
+		r->mpi_rootbox_cost[i] = 0;
+	}
+	double total = 0;
+	for (int i=0;i<root_n;i++){
+		total += cost[i];
+	}
+	if (total==0){
+		free(cost);
+		return;
+	}
+
+	// Order root boxes along a space filling curve so that every node gets a compact region.
+	struct reb_communication_mpi_rootbox_key* keys = malloc(root_n*sizeof(struct reb_communication_mpi_rootbox_key));
+	for (int i=0;i<root_n;i++){
+		keys[i].key = reb_communication_mpi_rootbox_morton_key(r, i);
+		keys[i].index = i;
+	}
+	qsort(keys, root_n, sizeof(struct reb_communication_mpi_rootbox_key), reb_communication_mpi_compare_rootbox_key);
+
+	// Cut the curve where the cumulative cost crosses multiples of total/mpi_num.
+	// All nodes do this with the same input and therefore agree on the result.
+	int changed = 0;
+	int proc = 0;
+	int proc_n = 0;
+	double prefix = 0;
+	for (int j=0;j<root_n;j++){
+		const int i = keys[j].index;
+		if (proc_n>0 && proc<r->mpi_num-1){
+			const int boxes_left = root_n-j;
+			const int procs_left = r->mpi_num-1-proc;
+			if (prefix+cost[i]/2. > total*(proc+1)/r->mpi_num || boxes_left<=procs_left){
+				proc++;
+				proc_n = 0;
+			}
+		}
+		if (r->mpi_rootbox_owner[i]!=proc){
+			r->mpi_rootbox_owner[i] = proc;
+			changed = 1;
+		}
+		proc_n++;
+		prefix += cost[i];
+	}
+	free(keys);
+	free(cost);
+	if (!changed) return;
+
+	// Particles already in the send queue were routed with the old owners.
+	// Take them out of the queue and add them again once the tree is rebuilt.
+	int queued_N = 0;
+	for (int k=0;k<r->mpi_num;k++){
+		queued_N += r->particles_send_N[k];
+	}
+	struct reb_particle* queued = malloc(queued_N*sizeof(struct reb_particle)+1);
+	queued_N = 0;
+	for (int k=0;k<r->mpi_num;k++){
+		for (int j=0;j<r->particles_send_N[k];j++){
+			queued[queued_N++] = r->particles_send[k][j];
+		}
+		r->particles_send_N[k] = 0;
+	}
+
+	// Send particles which are no longer local to their new owner.
+	// They are sent with the next call to reb_communication_mpi_distribute_particles().
+	for (int i=0;i<r->N;i++){
+		const struct reb_particle p = r->particles[i];
+		const int owner = r->mpi_rootbox_owner[reb_get_rootbox_for_particle(r, p)];
+		if (owner!=r->mpi_id){
+			reb_communication_mpi_add_particle_to_send_queue(r, p, owner);
+			(r->N)--;
+			r->particles[i] = r->particles[r->N];
+			i--;
+		}
+	}
+	// Particle indices have changed. Rebuild the local tree.
+	reb_tree_clear(r);
+	for (int i=0;i<r->N;i++){
+		reb_tree_add_particle_to_tree(r, i);
+	}
+	for (int j=0;j<queued_N;j++){
+		reb_add(r, queued[j]);
+	}
+	free(queued);
 }
 
 int reb_communication_mpi_rootbox_is_local(struct reb_simulation* const r, int i){
-	int root_n_per_node = r->root_n/r->mpi_num;
-	int proc_id = i/root_n_per_node;
+	int proc_id = reb_communication_mpi_rootbox_owner(r, i);
 	if (proc_id != r->mpi_id){
 		return 0;
 	}else{
@@ -80,43 +294,43 @@ int reb_communication_mpi_rootbox_is_local(struct reb_simulation* const r, int i
 
 
 void reb_communication_mpi_distribute_particles(struct reb_simulation* const r){
+	reb_profiling_start(r, REB_PROFILING_MPI);
 	// Distribute the number of particles to be transferred.
-	for (int i=0;i<r->mpi_num;i++){
-		MPI_Scatter(r->particles_send_N, 1, MPI_INT, &(r->particles_recv_N[i]), 1, MPI_INT, i, MPI_COMM_WORLD);
-	}
+	MPI_Alltoall(r->particles_send_N, 1, MPI_INT, r->particles_recv_N, 1, MPI_INT, MPI_COMM_WORLD);
 	// Allocate memory for incoming particles
 	for (int i=0;i<r->mpi_num;i++){
 		if  (i==r->mpi_id) continue;
 		while (r->particles_recv_Nmax[i]<r->particles_recv_N[i]){
 			r->particles_recv_Nmax[i] += 32;
 			r->particles_recv[i] = realloc(r->particles_recv[i],sizeof(struct reb_particle)*r->particles_recv_Nmax[i]);
+			r->particles_recv_index[i] = realloc(r->particles_recv_index[i],sizeof(int)*r->particles_recv_Nmax[i]);
 		}
 	}
 
 	// Exchange particles via MPI.
-	// Using non-blocking receive call.
-	MPI_Request request[r->mpi_num];
+	// Using non-blocking receive and send calls.
+	MPI_Request request[2*r->mpi_num];
+	for (int i=0;i<2*r->mpi_num;i++){
+		request[i] = MPI_REQUEST_NULL;
+	}
 	for (int i=0;i<r->mpi_num;i++){
 		if (i==r->mpi_id) continue;
 		if (r->particles_recv_N[i]==0) continue;
-		MPI_Irecv(r->particles_recv[i], sizeof(struct reb_particle)*r->particles_recv_N[i], MPI_CHAR, i, i*r->mpi_num+r->mpi_id, MPI_COMM_WORLD, &(request[i]));
+		MPI_Irecv(r->particles_recv[i], r->particles_recv_N[i], r->mpi_particle_type, i, i*r->mpi_num+r->mpi_id, MPI_COMM_WORLD, &(request[i]));
 	}
-	// Using blocking send call.
 	for (int i=0;i<r->mpi_num;i++){
 		if (i==r->mpi_id) continue;
 		if (r->particles_send_N[i]==0) continue;
-		MPI_Send(r->particles_send[i], sizeof(struct reb_particle)* r->particles_send_N[i], MPI_CHAR, i, r->mpi_id*r->mpi_num+i, MPI_COMM_WORLD);
-	}
-	// Wait for all particles to be received.
-	for (int i=0;i<r->mpi_num;i++){
-		if (i==r->mpi_id) continue;
-		if (r->particles_recv_N[i]==0) continue;
-		MPI_Status status;
-		MPI_Wait(&(request[i]), &status);
+		MPI_Isend(r->particles_send[i], r->particles_send_N[i], r->mpi_particle_type, i, r->mpi_id*r->mpi_num+i, MPI_COMM_WORLD, &(request[r->mpi_num+i]));
 	}
+	// Wait for all particles to be received and sent.
+	MPI_Waitall(2*r->mpi_num, request, MPI_STATUSES_IGNORE);
 	// Add particles to local tree
 	for (int i=0;i<r->mpi_num;i++){
 		for (int j=0;j<r->particles_recv_N[i];j++){
+			// Pointers are not transferred.
+			r->particles_recv[i][j].c = NULL;
+			r->particles_recv[i][j].ap = NULL;
 			reb_add(r,r->particles_recv[i][j]);
 		}
 	}
@@ -126,6 +340,7 @@ void reb_communication_mpi_distribute_particles(struct reb_simulation* const r){
 		r->particles_send_N[i] = 0;
 		r->particles_recv_N[i] = 0;
 	}
+	reb_profiling_stop(r, REB_PROFILING_MPI);
 }
 
 void reb_communication_mpi_add_particle_to_send_queue(struct reb_simulation* const r, struct reb_particle pt, int proc_id){
@@ -133,6 +348,7 @@ void reb_communication_mpi_add_particle_to_send_queue(struct reb_simulation* con
 	while (r->particles_send_Nmax[proc_id] <= send_N){
 		r->particles_send_Nmax[proc_id] += 128;
 		r->particles_send[proc_id] = realloc(r->particles_send[proc_id],sizeof(struct reb_particle)*r->particles_send_Nmax[proc_id]);
+		r->particles_send_index[proc_id] = realloc(r->particles_send_index[proc_id],sizeof(int)*r->particles_send_Nmax[proc_id]);
 	}
 	r->particles_send[proc_id][send_N] = pt;
 	r->particles_send_N[proc_id]++;
@@ -166,11 +382,14 @@ struct reb_aabb communication_boundingbox_for_root(struct reb_simulation* const
 }
 
 struct reb_aabb reb_communication_boundingbox_for_proc(struct reb_simulation* const r, int proc_id){
-	int root_n_per_node = r->root_n/r->mpi_num;
-	int root_start = proc_id*root_n_per_node;
-	int root_stop  = (proc_id+1)*root_n_per_node;
+	// Every node owns at least one root box (see reb_communication_mpi_rebalance()).
+	int root_start = 0;
+	while (r->mpi_rootbox_owner[root_start]!=proc_id){
+		root_start++;
+	}
 	struct reb_aabb boundingbox = communication_boundingbox_for_root(r, root_start);
-	for (int i=root_start+1;i<root_stop;i++){
+	for (int i=root_start+1;i<r->root_n;i++){
+		if (r->mpi_rootbox_owner[i]!=proc_id) continue;
 		struct reb_aabb boundingbox2 = communication_boundingbox_for_root(r,i);
 		if (boundingbox.xmin > boundingbox2.xmin) boundingbox.xmin = boundingbox2.xmin;
 		if (boundingbox.ymin > boundingbox2.ymin) boundingbox.ymin = boundingbox2.ymin;
@@ -198,10 +417,11 @@ double reb_communication_distance2_of_proc_to_node(struct reb_simulation* const
 	int nghostzcol = (r->nghostz>0?1:0);
 	double distance2 = r->root_size*(double)r->root_n; // A conservative estimate for the minimum distance.
 	distance2 *= distance2;
+	const struct reb_ghostbox* const ghostboxes = reb_boundary_ghostboxes(r);
 	for (int gbx=-nghostxcol; gbx<=nghostxcol; gbx++){
 	for (int gby=-nghostycol; gby<=nghostycol; gby++){
 	for (int gbz=-nghostzcol; gbz<=nghostzcol; gbz++){
-		struct reb_ghostbox gb = reb_boundary_get_ghostbox(r, gbx,gby,gbz);
+		struct reb_ghostbox gb = ghostboxes[reb_boundary_ghostbox_index(r, gbx,gby,gbz)];
 		struct reb_aabb boundingbox = reb_communication_boundingbox_for_proc(r, proc_id);
 		boundingbox.xmin+=gb.shiftx;
 		boundingbox.xmax+=gb.shiftx;
@@ -232,9 +452,12 @@ void reb_communication_mpi_prepare_essential_cell_for_collisions_for_proc(struct
 		if (r->particles_send_N[proc]>=r->particles_send_Nmax[proc]){
 			r->particles_send_Nmax[proc] += 32;
 			r->particles_send[proc] = realloc(r->particles_send[proc],sizeof(struct reb_treecell)*r->particles_send_Nmax[proc]);
+			r->particles_send_index[proc] = realloc(r->particles_send_index[proc],sizeof(int)*r->particles_send_Nmax[proc]);
 		}
 		// Copy particle to send buffer
 		r->particles_send[proc][r->particles_send_N[proc]] = r->particles[node->pt];
+		// Remember where the particle came from so that collisions can be resolved across nodes
+		r->particles_send_index[proc][r->particles_send_N[proc]] = node->pt;
 		// Update reference from cell to particle
 		r->tree_essential_send[proc][r->tree_essential_send_N[proc]-1].pt = r->particles_send_N[proc];
 		r->particles_send_N[proc]++;
@@ -293,14 +516,18 @@ void reb_communication_mpi_prepare_essential_tree_for_gravity(struct reb_simulat
 }
 
 void reb_communication_mpi_distribute_essential_tree_for_gravity(struct reb_simulation* const r){
+	reb_communication_mpi_distribute_essential_tree_for_gravity_start(r);
+	while (reb_communication_mpi_distribute_essential_tree_for_gravity_next(r)>=0){ }
+}
+
+void reb_communication_mpi_distribute_essential_tree_for_gravity_start(struct reb_simulation* const r){
+	reb_profiling_start(r, REB_PROFILING_MPI);
 	///////////////////////////////////////////////////////////////
-	// Distribute essential tree needed for gravity and collisions
+	// Distribute essential tree needed for gravity
 	///////////////////////////////////////////////////////////////
 	
 	// Distribute the number of cells to be transferred.
-	for (int i=0;i<r->mpi_num;i++){
-		MPI_Scatter(r->tree_essential_send_N, 1, MPI_INT, &(r->tree_essential_recv_N[i]), 1, MPI_INT, i, MPI_COMM_WORLD);
-	}
+	MPI_Alltoall(r->tree_essential_send_N, 1, MPI_INT, r->tree_essential_recv_N, 1, MPI_INT, MPI_COMM_WORLD);
 	// Allocate memory for incoming tree_essential
 	for (int i=0;i<r->mpi_num;i++){
 		if  (i==r->mpi_id) continue;
@@ -311,50 +538,61 @@ void reb_communication_mpi_distribute_essential_tree_for_gravity(struct reb_simu
 	}
 	
 	// Exchange tree_essential via MPI.
-	// Using non-blocking receive call.
-	MPI_Request request[r->mpi_num];
-	for (int i=0;i<r->mpi_num;i++){
-		if (i==r->mpi_id) continue;
-		if (r->tree_essential_recv_N[i]==0) continue;
-		MPI_Irecv(r->tree_essential_recv[i], sizeof(struct reb_treecell)* r->tree_essential_recv_N[i], MPI_CHAR, i, i*r->mpi_num+r->mpi_id, MPI_COMM_WORLD, &(request[i]));
-	}
-	// Using blocking send call.
+	// Both receive and send calls are non-blocking. Nothing is waited 
+	// for here, so the caller can do local work in the meantime.
+	MPI_Request* request = r->tree_essential_requests;
 	for (int i=0;i<r->mpi_num;i++){
-		if (i==r->mpi_id) continue;
-		if (r->tree_essential_send_N[i]==0) continue;
-		MPI_Send(r->tree_essential_send[i],  sizeof(struct reb_treecell)*r->tree_essential_send_N[i], MPI_CHAR, i, r->mpi_id*r->mpi_num+i, MPI_COMM_WORLD);
+		request[i] = MPI_REQUEST_NULL;
+		request[r->mpi_num+i] = MPI_REQUEST_NULL;
 	}
-	// Wait for all tree_essential to be received.
 	for (int i=0;i<r->mpi_num;i++){
 		if (i==r->mpi_id) continue;
 		if (r->tree_essential_recv_N[i]==0) continue;
-		MPI_Status status;
-		MPI_Wait(&(request[i]), &status);
+		MPI_Irecv(r->tree_essential_recv[i], r->tree_essential_recv_N[i], r->mpi_cell_gravity_type, i, i*r->mpi_num+r->mpi_id, MPI_COMM_WORLD, &(request[i]));
 	}
-	// Add tree_essential to local tree
 	for (int i=0;i<r->mpi_num;i++){
 		if (i==r->mpi_id) continue;
+		if (r->tree_essential_send_N[i]==0) continue;
+		MPI_Isend(r->tree_essential_send[i],  r->tree_essential_send_N[i], r->mpi_cell_gravity_type, i, r->mpi_id*r->mpi_num+i, MPI_COMM_WORLD, &(request[r->mpi_num+i]));
+	}
+	r->tree_essential_pending = 1;
+	reb_profiling_stop(r, REB_PROFILING_MPI);
+}
+
+int reb_communication_mpi_distribute_essential_tree_for_gravity_next(struct reb_simulation* const r){
+	if (!r->tree_essential_pending) return -1;
+	reb_profiling_start(r, REB_PROFILING_MPI);
+	MPI_Request* request = r->tree_essential_requests;
+	int i;
+	MPI_Waitany(r->mpi_num, request, &i, MPI_STATUS_IGNORE);
+	if (i!=MPI_UNDEFINED){
+		// Add tree_essential of node i to local tree
 		for (int j=0;j<r->tree_essential_recv_N[i];j++){
 			reb_tree_add_essential_node(r, &(r->tree_essential_recv[i][j]));
 		}
+		reb_profiling_stop(r, REB_PROFILING_MPI);
+		return i;
 	}
-	// Bring everybody into sync, clean up. 
-	MPI_Barrier(MPI_COMM_WORLD);
+	// All cells received. The send buffers can be reused once the sends are done.
+	// No barrier is needed: the next exchange starts with a collective call.
+	MPI_Waitall(r->mpi_num, request+r->mpi_num, MPI_STATUSES_IGNORE);
 	for (int i=0;i<r->mpi_num;i++){
 		r->tree_essential_send_N[i] = 0;
 		r->tree_essential_recv_N[i] = 0;
 	}
+	r->tree_essential_pending = 0;
+	reb_profiling_stop(r, REB_PROFILING_MPI);
+	return -1;
 }
 
 void reb_communication_mpi_distribute_essential_tree_for_collisions(struct reb_simulation* const r){
+	reb_profiling_start(r, REB_PROFILING_MPI);
 	///////////////////////////////////////////////////////////////
 	// Distribute essential tree needed for gravity and collisions
 	///////////////////////////////////////////////////////////////
 	
 	// Distribute the number of cells to be transferred.
-	for (int i=0;i<r->mpi_num;i++){
-		MPI_Scatter(r->tree_essential_send_N, 1, MPI_INT, &(r->tree_essential_recv_N[i]), 1, MPI_INT, i, MPI_COMM_WORLD);
-	}
+	MPI_Alltoall(r->tree_essential_send_N, 1, MPI_INT, r->tree_essential_recv_N, 1, MPI_INT, MPI_COMM_WORLD);
 	// Allocate memory for incoming tree_essential
 	for (int i=0;i<r->mpi_num;i++){
 		if  (i==r->mpi_id) continue;
@@ -365,26 +603,23 @@ void reb_communication_mpi_distribute_essential_tree_for_collisions(struct reb_s
 	}
 
 	// Exchange tree_essential via MPI.
-	// Using non-blocking receive call.
-	MPI_Request request[r->mpi_num];
+	// Using non-blocking receive and send calls.
+	MPI_Request request[2*r->mpi_num];
+	for (int i=0;i<2*r->mpi_num;i++){
+		request[i] = MPI_REQUEST_NULL;
+	}
 	for (int i=0;i<r->mpi_num;i++){
 		if (i==r->mpi_id) continue;
 		if (r->tree_essential_recv_N[i]==0) continue;
-		MPI_Irecv(r->tree_essential_recv[i],  sizeof(struct reb_treecell)*r->tree_essential_recv_N[i], MPI_CHAR, i, i*r->mpi_num+r->mpi_id, MPI_COMM_WORLD, &(request[i]));
+		MPI_Irecv(r->tree_essential_recv[i],  r->tree_essential_recv_N[i], r->mpi_cell_collision_type, i, i*r->mpi_num+r->mpi_id, MPI_COMM_WORLD, &(request[i]));
 	}
-	// Using blocking send call.
 	for (int i=0;i<r->mpi_num;i++){
 		if (i==r->mpi_id) continue;
 		if (r->tree_essential_send_N[i]==0) continue;
-		MPI_Send(r->tree_essential_send[i],  sizeof(struct reb_treecell)*r->tree_essential_send_N[i], MPI_CHAR, i, r->mpi_id*r->mpi_num+i, MPI_COMM_WORLD);
-	}
-	// Wait for all tree_essential to be received.
-	for (int i=0;i<r->mpi_num;i++){
-		if (i==r->mpi_id) continue;
-		if (r->tree_essential_recv_N[i]==0) continue;
-		MPI_Status status;
-		MPI_Wait(&(request[i]), &status);
+		MPI_Isend(r->tree_essential_send[i],  r->tree_essential_send_N[i], r->mpi_cell_collision_type, i, r->mpi_id*r->mpi_num+i, MPI_COMM_WORLD, &(request[r->mpi_num+i]));
 	}
+	// Wait for all tree_essential to be received and sent.
+	MPI_Waitall(2*r->mpi_num, request, MPI_STATUSES_IGNORE);
 	// Add tree_essential to local tree
 	for (int i=0;i<r->mpi_num;i++){
 		for (int j=0;j<r->tree_essential_recv_N[i];j++){
@@ -403,38 +638,51 @@ void reb_communication_mpi_distribute_essential_tree_for_collisions(struct reb_s
 	//////////////////////////////////////////////////////
 	
 	// Distribute the number of particles to be transferred.
-	for (int i=0;i<r->mpi_num;i++){
-		MPI_Scatter(r->particles_send_N, 1, MPI_INT, &(r->particles_recv_N[i]), 1, MPI_INT, i, MPI_COMM_WORLD);
-	}
+	MPI_Alltoall(r->particles_send_N, 1, MPI_INT, r->particles_recv_N, 1, MPI_INT, MPI_COMM_WORLD);
 	// Allocate memory for incoming particles
 	for (int i=0;i<r->mpi_num;i++){
 		if  (i==r->mpi_id) continue;
 		while (r->particles_recv_Nmax[i]<r->particles_recv_N[i]){
 			r->particles_recv_Nmax[i] += 32;
 			r->particles_recv[i] = realloc(r->particles_recv[i],sizeof(struct reb_particle)*r->particles_recv_Nmax[i]);
+			r->particles_recv_index[i] = realloc(r->particles_recv_index[i],sizeof(int)*r->particles_recv_Nmax[i]);
 		}
 	}
 	
 	// Exchange particles via MPI.
-	// Using non-blocking receive call.
+	// Using non-blocking receive and send calls.
+	for (int i=0;i<2*r->mpi_num;i++){
+		request[i] = MPI_REQUEST_NULL;
+	}
 	for (int i=0;i<r->mpi_num;i++){
 		if (i==r->mpi_id) continue;
 		if (r->particles_recv_N[i]==0) continue;
-		MPI_Irecv(r->particles_recv[i], sizeof(struct reb_particle)* r->particles_recv_N[i], MPI_CHAR, i, i*r->mpi_num+r->mpi_id, MPI_COMM_WORLD, &(request[i]));
+		MPI_Irecv(r->particles_recv[i], r->particles_recv_N[i], r->mpi_particle_collision_type, i, i*r->mpi_num+r->mpi_id, MPI_COMM_WORLD, &(request[i]));
 	}
-	// Using blocking send call.
 	for (int i=0;i<r->mpi_num;i++){
 		if (i==r->mpi_id) continue;
 		if (r->particles_send_N[i]==0) continue;
-		MPI_Send(r->particles_send[i], sizeof(struct reb_particle)* r->particles_send_N[i], MPI_CHAR, i, r->mpi_id*r->mpi_num+i, MPI_COMM_WORLD);
+		MPI_Isend(r->particles_send[i], r->particles_send_N[i], r->mpi_particle_collision_type, i, r->mpi_id*r->mpi_num+i, MPI_COMM_WORLD, &(request[r->mpi_num+i]));
+	}
+	// Wait for all particles to be received and sent.
+	MPI_Waitall(2*r->mpi_num, request, MPI_STATUSES_IGNORE);
+
+	// Exchange the indices of the particles on the sending node. 
+	// Needed to resolve collisions with remote particles.
+	for (int i=0;i<2*r->mpi_num;i++){
+		request[i] = MPI_REQUEST_NULL;
 	}
-	// Wait for all particles to be received.
 	for (int i=0;i<r->mpi_num;i++){
 		if (i==r->mpi_id) continue;
 		if (r->particles_recv_N[i]==0) continue;
-		MPI_Status status;
-		MPI_Wait(&(request[i]), &status);
+		MPI_Irecv(r->particles_recv_index[i], r->particles_recv_N[i], MPI_INT, i, i*r->mpi_num+r->mpi_id, MPI_COMM_WORLD, &(request[i]));
+	}
+	for (int i=0;i<r->mpi_num;i++){
+		if (i==r->mpi_id) continue;
+		if (r->particles_send_N[i]==0) continue;
+		MPI_Isend(r->particles_send_index[i], r->particles_send_N[i], MPI_INT, i, r->mpi_id*r->mpi_num+i, MPI_COMM_WORLD, &(request[r->mpi_num+i]));
 	}
+	MPI_Waitall(2*r->mpi_num, request, MPI_STATUSES_IGNORE);
 	// No need to add particles to tree as reference already set.
 	// Bring everybody into sync, clean up. 
 	MPI_Barrier(MPI_COMM_WORLD);
@@ -442,7 +690,100 @@ void reb_communication_mpi_distribute_essential_tree_for_collisions(struct reb_s
 		r->particles_send_N[i] = 0;
 		r->particles_recv_N[i] = 0;
 	}
+	reb_profiling_stop(r, REB_PROFILING_MPI);
 }
 
+int reb_communication_mpi_testparticle_decomposition_supported(struct reb_simulation* const r){
+	const char* error = NULL;
+	if (r->N_active==-1){
+		error = "The test particle decomposition requires N_active to be set.";
+	}else if (r->N_var){
+		error = "The test particle decomposition does not support variational particles.";
+	}else if (r->integrator!=REB_INTEGRATOR_IAS15 && r->integrator!=REB_INTEGRATOR_WHFAST && r->integrator!=REB_INTEGRATOR_MERCURIUS){
+		error = "The test particle decomposition only supports the IAS15, WHFast, and MERCURIUS integrators.";
+	}else if (r->integrator!=REB_INTEGRATOR_MERCURIUS && r->gravity!=REB_GRAVITY_BASIC){
+		error = "The test particle decomposition only supports REB_GRAVITY_BASIC.";
+	}else if (r->integrator!=REB_INTEGRATOR_IAS15 && r->testparticle_type==1){
+		// The coordinate transformations of WHFast and MERCURIUS include test particles of type 1.
+		error = "The test particle decomposition only supports testparticle_type=1 with IAS15.";
+	}else if (r->collision!=REB_COLLISION_NONE && r->collision!=REB_COLLISION_DIRECT){
+		error = "The test particle decomposition only supports REB_COLLISION_DIRECT.";
+	}
+	if (error){
+		reb_error(r, error);
+		r->status = REB_EXIT_ERROR;
+		return 0;
+	}
+	return 1;
+}
+
+void reb_communication_mpi_reduce_active_accelerations(struct reb_simulation* const r, const int N_active){
+	reb_profiling_start(r, REB_PROFILING_MPI);
+	struct reb_particle* const particles = r->particles;
+	double* const a = malloc(sizeof(double)*3*N_active);
+	for (int i=0;i<N_active;i++){
+		a[3*i+0] = particles[i].ax;
+		a[3*i+1] = particles[i].ay;
+		a[3*i+2] = particles[i].az;
+	}
+	MPI_Allreduce(MPI_IN_PLACE, a, 3*N_active, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+	for (int i=0;i<N_active;i++){
+		particles[i].ax = a[3*i+0];
+		particles[i].ay = a[3*i+1];
+		particles[i].az = a[3*i+2];
+	}
+	free(a);
+	reb_profiling_stop(r, REB_PROFILING_MPI);
+}
+
+struct reb_communication_mpi_collision* reb_communication_mpi_gather_collisions(struct reb_simulation* const r, const struct reb_communication_mpi_collision* const send, const int send_N, int* const recv_N, int* const recv_offset){
+	int* const counts = malloc(sizeof(int)*r->mpi_num);
+	int* const displs = malloc(sizeof(int)*r->mpi_num);
+	MPI_Allgather(&send_N, 1, MPI_INT, counts, 1, MPI_INT, MPI_COMM_WORLD);
+	int N = 0;
+	for (int i=0;i<r->mpi_num;i++){
+		if (i==r->mpi_id){
+			*recv_offset = N;
+		}
+		// Counts and displacements are in bytes.
+		displs[i] = N*sizeof(struct reb_communication_mpi_collision);
+		N += counts[i];
+		counts[i] *= sizeof(struct reb_communication_mpi_collision);
+	}
+	struct reb_communication_mpi_collision* const recv = malloc(sizeof(struct reb_communication_mpi_collision)*(N+1));
+	MPI_Allgatherv(send, send_N*sizeof(struct reb_communication_mpi_collision), MPI_CHAR, recv, counts, displs, MPI_CHAR, MPI_COMM_WORLD);
+	free(counts);
+	free(displs);
+	*recv_N = N;
+	return recv;
+}
+
+void* reb_communication_mpi_exchange(struct reb_simulation* const r, const void* const send, const int* const send_N, const size_t size, int* const recv_N){
+	reb_profiling_start(r, REB_PROFILING_MPI);
+	MPI_Alltoall((void*)send_N, 1, MPI_INT, recv_N, 1, MPI_INT, MPI_COMM_WORLD);
+	int* const send_counts = malloc(sizeof(int)*r->mpi_num);
+	int* const send_displs = malloc(sizeof(int)*r->mpi_num);
+	int* const recv_counts = malloc(sizeof(int)*r->mpi_num);
+	int* const recv_displs = malloc(sizeof(int)*r->mpi_num);
+	int N_send = 0;
+	int N_recv = 0;
+	for (int i=0;i<r->mpi_num;i++){
+		// Counts and displacements are in bytes.
+		send_displs[i] = N_send*size;
+		send_counts[i] = send_N[i]*size;
+		N_send += send_N[i];
+		recv_displs[i] = N_recv*size;
+		recv_counts[i] = recv_N[i]*size;
+		N_recv += recv_N[i];
+	}
+	char* const recv = malloc(size*(N_recv+1));
+	MPI_Alltoallv((void*)send, send_counts, send_displs, MPI_CHAR, recv, recv_counts, recv_displs, MPI_CHAR, MPI_COMM_WORLD);
+	free(send_counts);
+	free(send_displs);
+	free(recv_counts);
+	free(recv_displs);
+	reb_profiling_stop(r, REB_PROFILING_MPI);
+	return recv;
+}
 
 #endif // MPI
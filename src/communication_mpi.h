@@ -80,6 +80,26 @@ void reb_communication_mpi_add_particle_to_send_queue(struct reb_simulation* con
  */ 
 int  reb_communication_mpi_rootbox_is_local(struct reb_simulation* const r, int i);
 
+/**
+ * Returns the id of the node that owns a root box.
+ * @param i Id of root box.
+ */ 
+int  reb_communication_mpi_rootbox_owner(const struct reb_simulation* const r, int i);
+
+/**
+ * Adds the current number of particles in each local root box to mpi_rootbox_cost.
+ */
+void reb_communication_mpi_update_rootbox_cost(struct reb_simulation* const r);
+
+/**
+ * Reassigns root boxes to nodes so that every node gets a similar cost.
+ * Root boxes are ordered along a Morton curve and the curve is cut into
+ * mpi_num contiguous pieces. Every node gets at least one root box.
+ * Particles in root boxes that changed owner are placed in the send queue
+ * and the local tree is rebuilt. Needs to be called by all nodes.
+ */
+void reb_communication_mpi_rebalance(struct reb_simulation* const r);
+
 /**
  * Send cells in buffer tree_essential_send to corresponding node. 
  * Receives cells from all nodes in buffer tree_essential_recv and adds them
@@ -87,6 +107,22 @@ int  reb_communication_mpi_rootbox_is_local(struct reb_simulation* const r, int
  */
 void reb_communication_mpi_distribute_essential_tree_for_gravity(struct reb_simulation* const r);
 
+/**
+ * Starts the exchange of the essential tree without waiting for it to finish.
+ * Both receives and sends are non-blocking. Call 
+ * reb_communication_mpi_distribute_essential_tree_for_gravity_next() until it 
+ * returns -1 to complete the exchange.
+ */
+void reb_communication_mpi_distribute_essential_tree_for_gravity_start(struct reb_simulation* const r);
+
+/**
+ * Waits for the essential tree of any one node and adds its cells to the 
+ * non-local root boxes.
+ * @return Id of the node whose cells were added, or -1 once all cells have
+ * been received and all sends have completed.
+ */
+int  reb_communication_mpi_distribute_essential_tree_for_gravity_next(struct reb_simulation* const r);
+
 /**
  * Prepares the essential tree of a root box for communication with other nodes.
  * @param root The root cell under investigation.
@@ -107,6 +143,51 @@ void reb_communication_mpi_distribute_essential_tree_for_collisions(struct reb_s
  */
 void reb_communication_mpi_prepare_essential_tree_for_collisions(struct reb_simulation* const r, struct reb_treecell* root);
 
+/**
+ * Checks that the simulation can be run with the test particle decomposition.
+ * Sets an error message and the status to REB_EXIT_ERROR otherwise.
+ * @return 1 if the setup is supported, 0 otherwise.
+ */
+int  reb_communication_mpi_testparticle_decomposition_supported(struct reb_simulation* const r);
+
+/**
+ * Sums up the accelerations of the active particles over all nodes.
+ * Used with the test particle decomposition if test particles have mass 
+ * (testparticle_type=1). Needs to be called by all nodes.
+ * @param N_active Number of active particles.
+ */
+void reb_communication_mpi_reduce_active_accelerations(struct reb_simulation* const r, const int N_active);
+
+/**
+ * A collision between a local test particle and an active particle. 
+ * The test particle is sent along so other nodes can resolve the collision.
+ */
+struct reb_communication_mpi_collision {
+	struct reb_collision c;
+	struct reb_particle p;
+};
+
+/**
+ * Collects the collisions of all nodes, ordered by node id. 
+ * Needs to be called by all nodes.
+ * @param send Local collisions.
+ * @param send_N Number of local collisions.
+ * @param recv_N Will be set to the total number of collisions.
+ * @param recv_offset Will be set to the index of the first local collision in the returned array.
+ * @return Array of all collisions. Needs to be freed by the caller.
+ */
+struct reb_communication_mpi_collision* reb_communication_mpi_gather_collisions(struct reb_simulation* const r, const struct reb_communication_mpi_collision* const send, const int send_N, int* const recv_N, int* const recv_offset);
+
+/**
+ * Sends a different number of elements to every node and receives the elements all other 
+ * nodes sent to this node. Needs to be called by all nodes.
+ * @param send Elements to send, ordered by the id of the receiving node.
+ * @param send_N Number of elements for every node (mpi_num values).
+ * @param size Size of one element in bytes.
+ * @param recv_N Will be set to the number of elements received from every node (mpi_num values).
+ * @return Received elements, ordered by the id of the sending node. Needs to be freed by the caller.
+ */
+void* reb_communication_mpi_exchange(struct reb_simulation* const r, const void* const send, const int* const send_N, const size_t size, int* const recv_N);
 
 #endif // MPI
 #endif // _COMMUNICATION_MPI_H
@@ -0,0 +1,341 @@
+/**
+ * @file 	compact.c
+ * @brief 	Massless test particles stored in single precision.
+ * @author 	Hanno Rein <hanno@hanno-rein.de>
+ *
+ * @details 	Simulations of dust or debris often contain a very large number
+ * of massless test particles. A reb_particle uses 128 bytes, most of which
+ * are not needed for such particles (mass, accelerations, pointers, tree
+ * and sleep state). Compact test particles only store their positions,
+ * velocities and radii as float together with a hash (32 bytes). Memory
+ * usage and memory bandwidth per particle drop by a factor of four.
+ *
+ * With REB_COMPACT_CHUNKED, every chunk of REB_COMPACT_CHUNK particles has
+ * a position and velocity origin in double precision. Only the offsets from
+ * this origin are stored as float. The origins are moved to the center of
+ * the chunk after every step. This improves the precision if the particles
+ * within a chunk are close to each other in phase space, for example if they
+ * have been released from the same source.
+ *
+ * The particles are decoded one chunk at a time into a double precision buffer,
+ * integrated with the same kick-drift-kick scheme as LEAPFROG and encoded
+ * again. They feel the gravity of the active particles (using the softening
+ * of the simulation) but no additional forces.
+ *
+ * @section LICENSE
+ * Copyright (c) 2023 Hanno Rein
+ *
+ * This file is part of rebound.
+ *
+ * rebound is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rebound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rebound.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "rebound.h"
+#include "compact.h"
+#include "tools.h"
+
+// Position, GM and radius of an active particle.
+struct reb_compact_source {
+    double x, y, z;
+    double Gm;
+    double r;
+};
+
+static int reb_compact_chunks(const int N){
+    return (N+REB_COMPACT_CHUNK-1)/REB_COMPACT_CHUNK;
+}
+
+// Decodes the n particles of chunk c into b (x, y, z, vx, vy, vz per particle).
+static void reb_compact_load(const struct reb_compact_particles* const cp, const int c, const int n, double* const b){
+    const float* const xyz = cp->xyz + 3*c*REB_COMPACT_CHUNK;
+    const float* const vxyz = cp->vxyz + 3*c*REB_COMPACT_CHUNK;
+    double o[6] = {0};
+    if (cp->precision==REB_COMPACT_CHUNKED){
+        memcpy(o, cp->origin + 6*c, sizeof(double)*6);
+    }
+    for (int k=0;k<n;k++){
+        b[6*k+0] = o[0] + xyz[3*k+0];
+        b[6*k+1] = o[1] + xyz[3*k+1];
+        b[6*k+2] = o[2] + xyz[3*k+2];
+        b[6*k+3] = o[3] + vxyz[3*k+0];
+        b[6*k+4] = o[4] + vxyz[3*k+1];
+        b[6*k+5] = o[5] + vxyz[3*k+2];
+    }
+}
+
+// Encodes the n particles in b into chunk c. Moves the chunk origin to the
+// center of the particles which have not been removed.
+static void reb_compact_store(struct reb_compact_particles* const cp, const int c, const int n, const double* const b, const char* const removed){
+    float* const xyz = cp->xyz + 3*c*REB_COMPACT_CHUNK;
+    float* const vxyz = cp->vxyz + 3*c*REB_COMPACT_CHUNK;
+    double o[6] = {0};
+    if (cp->precision==REB_COMPACT_CHUNKED){
+        int n_kept = 0;
+        for (int k=0;k<n;k++){
+            if (removed && removed[k]) continue;
+            for (int d=0;d<6;d++){
+                o[d] += b[6*k+d];
+            }
+            n_kept++;
+        }
+        if (n_kept){
+            for (int d=0;d<6;d++){
+                o[d] /= n_kept;
+            }
+            memcpy(cp->origin + 6*c, o, sizeof(double)*6);
+        }else{
+            memcpy(o, cp->origin + 6*c, sizeof(double)*6);
+        }
+    }
+    for (int k=0;k<n;k++){
+        xyz[3*k+0]  = (float)(b[6*k+0]-o[0]);
+        xyz[3*k+1]  = (float)(b[6*k+1]-o[1]);
+        xyz[3*k+2]  = (float)(b[6*k+2]-o[2]);
+        vxyz[3*k+0] = (float)(b[6*k+3]-o[3]);
+        vxyz[3*k+1] = (float)(b[6*k+4]-o[4]);
+        vxyz[3*k+2] = (float)(b[6*k+5]-o[5]);
+    }
+}
+
+// Removes particles with a negative radius while keeping the order of the others.
+static void reb_compact_remove_flagged(struct reb_compact_particles* const cp){
+    const int chunked = cp->precision==REB_COMPACT_CHUNKED;
+    int j = 0;
+    for (int i=0;i<cp->N;i++){
+        if (cp->r[i]<0.f) continue;
+        if (i!=j){
+            const int ci = i/REB_COMPACT_CHUNK;
+            const int cj = j/REB_COMPACT_CHUNK;
+            if (chunked && ci!=cj){
+                for (int d=0;d<3;d++){
+                    cp->xyz[3*j+d]  = (float)(cp->origin[6*ci+d]   + cp->xyz[3*i+d]  - cp->origin[6*cj+d]);
+                    cp->vxyz[3*j+d] = (float)(cp->origin[6*ci+3+d] + cp->vxyz[3*i+d] - cp->origin[6*cj+3+d]);
+                }
+            }else{
+                memcpy(cp->xyz+3*j, cp->xyz+3*i, sizeof(float)*3);
+                memcpy(cp->vxyz+3*j, cp->vxyz+3*i, sizeof(float)*3);
+            }
+            cp->r[j] = cp->r[i];
+            cp->hash[j] = cp->hash[i];
+        }
+        j++;
+    }
+    cp->N_removed += cp->N-j;
+    cp->N = j;
+}
+
+void reb_compact_add(struct reb_simulation* const r, struct reb_particle pt){
+    struct reb_compact_particles* const cp = &r->compact;
+    if (pt.m!=0.){
+        reb_warning(r, "Compact test particles are massless. The mass has been ignored.");
+    }
+    const int grow = cp->N>=cp->allocatedN;
+    if (grow){
+        cp->allocatedN = cp->allocatedN ? 2*cp->allocatedN : REB_COMPACT_CHUNK;
+        cp->xyz = realloc(cp->xyz, sizeof(float)*3*cp->allocatedN);
+        cp->vxyz = realloc(cp->vxyz, sizeof(float)*3*cp->allocatedN);
+        cp->r = realloc(cp->r, sizeof(float)*cp->allocatedN);
+        cp->hash = realloc(cp->hash, sizeof(uint32_t)*cp->allocatedN);
+    }
+    if (cp->precision==REB_COMPACT_CHUNKED && (grow || cp->origin==NULL)){
+        cp->origin = realloc(cp->origin, sizeof(double)*6*reb_compact_chunks(cp->allocatedN));
+    }
+    const int i = cp->N;
+    const int c = i/REB_COMPACT_CHUNK;
+    double o[6] = {0};
+    if (cp->precision==REB_COMPACT_CHUNKED){
+        if (i%REB_COMPACT_CHUNK==0){
+            // First particle of a new chunk
+            cp->origin[6*c+0] = pt.x;  cp->origin[6*c+1] = pt.y;  cp->origin[6*c+2] = pt.z;
+            cp->origin[6*c+3] = pt.vx; cp->origin[6*c+4] = pt.vy; cp->origin[6*c+5] = pt.vz;
+        }
+        memcpy(o, cp->origin + 6*c, sizeof(double)*6);
+    }
+    cp->xyz[3*i+0]  = (float)(pt.x-o[0]);
+    cp->xyz[3*i+1]  = (float)(pt.y-o[1]);
+    cp->xyz[3*i+2]  = (float)(pt.z-o[2]);
+    cp->vxyz[3*i+0] = (float)(pt.vx-o[3]);
+    cp->vxyz[3*i+1] = (float)(pt.vy-o[4]);
+    cp->vxyz[3*i+2] = (float)(pt.vz-o[5]);
+    cp->r[i] = (float)pt.r;
+    cp->hash[i] = pt.hash;
+    cp->N++;
+}
+
+struct reb_particle reb_compact_get(const struct reb_simulation* const r, const int index){
+    const struct reb_compact_particles* const cp = &r->compact;
+    if (index<0 || index>=cp->N){
+        return reb_particle_nan();
+    }
+    double o[6] = {0};
+    if (cp->precision==REB_COMPACT_CHUNKED){
+        memcpy(o, cp->origin + 6*(index/REB_COMPACT_CHUNK), sizeof(double)*6);
+    }
+    struct reb_particle p = {0};
+    p.x  = o[0] + cp->xyz[3*index+0];
+    p.y  = o[1] + cp->xyz[3*index+1];
+    p.z  = o[2] + cp->xyz[3*index+2];
+    p.vx = o[3] + cp->vxyz[3*index+0];
+    p.vy = o[4] + cp->vxyz[3*index+1];
+    p.vz = o[5] + cp->vxyz[3*index+2];
+    p.r = cp->r[index];
+    p.hash = cp->hash[index];
+    return p;
+}
+
+void reb_compact_drift(struct reb_simulation* const r){
+    struct reb_compact_particles* const cp = &r->compact;
+#ifdef MPI
+    reb_error(r, "Compact test particles are not supported with MPI.");
+    r->status = REB_EXIT_ERROR;
+    return;
+#endif // MPI
+    if (r->integrator!=REB_INTEGRATOR_LEAPFROG){
+        reb_error(r, "Compact test particles are only supported with the LEAPFROG integrator.");
+        r->status = REB_EXIT_ERROR;
+        return;
+    }
+    if (r->boundary!=REB_BOUNDARY_NONE && r->boundary!=REB_BOUNDARY_OPEN){
+        reb_error(r, "Compact test particles only support open boundary conditions.");
+        r->status = REB_EXIT_ERROR;
+        return;
+    }
+    const double dt2 = 0.5*r->dt;
+    const int chunks = reb_compact_chunks(cp->N);
+#pragma omp parallel for schedule(guided)
+    for (int c=0;c<chunks;c++){
+        const int n = c<chunks-1 ? REB_COMPACT_CHUNK : cp->N-c*REB_COMPACT_CHUNK;
+        double b[6*REB_COMPACT_CHUNK];
+        reb_compact_load(cp, c, n, b);
+        for (int k=0;k<n;k++){
+            b[6*k+0] += dt2*b[6*k+3];
+            b[6*k+1] += dt2*b[6*k+4];
+            b[6*k+2] += dt2*b[6*k+5];
+        }
+        reb_compact_store(cp, c, n, b, NULL);
+    }
+}
+
+void reb_compact_kick_drift(struct reb_simulation* const r){
+    if (r->status==REB_EXIT_ERROR) return;
+    struct reb_compact_particles* const cp = &r->compact;
+    const int N_active = (r->N_active==-1)?r->N-r->N_var:r->N_active;
+    struct reb_compact_source* const sources = malloc(sizeof(struct reb_compact_source)*(N_active>0?N_active:1));
+    for (int j=0;j<N_active;j++){
+        const struct reb_particle p = r->particles[j];
+        sources[j] = (struct reb_compact_source){.x=p.x, .y=p.y, .z=p.z, .Gm=r->G*p.m, .r=p.r};
+    }
+    const int gravity = r->gravity!=REB_GRAVITY_NONE;
+    const int collisions = r->collision!=REB_COLLISION_NONE;
+    const int open = r->boundary==REB_BOUNDARY_OPEN;
+    const struct reb_vec3d half = {.x=r->boxsize.x/2., .y=r->boxsize.y/2., .z=r->boxsize.z/2.};
+    const double softening2 = r->softening*r->softening;
+    const double dt = r->dt;
+    const int chunks = reb_compact_chunks(cp->N);
+    int N_removed = 0;
+#pragma omp parallel for schedule(guided) reduction(+:N_removed)
+    for (int c=0;c<chunks;c++){
+        const int n = c<chunks-1 ? REB_COMPACT_CHUNK : cp->N-c*REB_COMPACT_CHUNK;
+        double b[6*REB_COMPACT_CHUNK];
+        char removed[REB_COMPACT_CHUNK];
+        int removed_chunk = 0;
+        reb_compact_load(cp, c, n, b);
+        for (int k=0;k<n;k++){
+            double* const p = b+6*k;
+            const double pr = cp->r[c*REB_COMPACT_CHUNK+k];
+            double ax = 0., ay = 0., az = 0.;
+            int hit = 0;
+            for (int j=0;j<N_active;j++){
+                const double dx = sources[j].x - p[0];
+                const double dy = sources[j].y - p[1];
+                const double dz = sources[j].z - p[2];
+                const double r2 = dx*dx + dy*dy + dz*dz;
+                if (collisions){
+                    const double rr = sources[j].r + pr;
+                    hit |= r2<rr*rr;
+                }
+                if (gravity){
+                    const double _r2 = r2 + softening2;
+                    const double prefact = sources[j].Gm/(_r2*sqrt(_r2));
+                    ax += prefact*dx;
+                    ay += prefact*dy;
+                    az += prefact*dz;
+                }
+            }
+            p[3] += dt*ax;
+            p[4] += dt*ay;
+            p[5] += dt*az;
+            p[0] += 0.5*dt*p[3];
+            p[1] += 0.5*dt*p[4];
+            p[2] += 0.5*dt*p[5];
+            if (open && (fabs(p[0])>half.x || fabs(p[1])>half.y || fabs(p[2])>half.z)){
+                hit = 1;
+            }
+            removed[k] = hit;
+            removed_chunk += hit;
+        }
+        reb_compact_store(cp, c, n, b, removed_chunk?removed:NULL);
+        if (removed_chunk){
+            for (int k=0;k<n;k++){
+                if (removed[k]){
+                    cp->r[c*REB_COMPACT_CHUNK+k] = -1.f;
+                }
+            }
+            N_removed += removed_chunk;
+        }
+    }
+    free(sources);
+    if (N_removed){
+        reb_compact_remove_flagged(cp);
+    }
+}
+
+size_t reb_compact_memory(const struct reb_compact_particles* const cp){
+    size_t bytes = (sizeof(float)*7+sizeof(uint32_t))*cp->allocatedN;
+    if (cp->origin){
+        bytes += sizeof(double)*6*reb_compact_chunks(cp->allocatedN);
+    }
+    return bytes;
+}
+
+void reb_compact_copy(struct reb_compact_particles* const dest, const struct reb_compact_particles* const src){
+    const int N = src->N;
+    dest->N = N;
+    dest->allocatedN = N;
+    dest->xyz = reb_tools_copy_aligned(src->xyz, sizeof(float), 3*N);
+    dest->vxyz = reb_tools_copy_aligned(src->vxyz, sizeof(float), 3*N);
+    dest->r = reb_tools_copy_aligned(src->r, sizeof(float), N);
+    dest->hash = reb_tools_copy_aligned(src->hash, sizeof(uint32_t), N);
+    dest->origin = reb_tools_copy_aligned(src->origin, sizeof(double), 6*reb_compact_chunks(N));
+}
+
+void reb_compact_free(struct reb_compact_particles* const cp){
+    free(cp->origin);
+    free(cp->xyz);
+    free(cp->vxyz);
+    free(cp->r);
+    free(cp->hash);
+    cp->origin = NULL;
+    cp->xyz = NULL;
+    cp->vxyz = NULL;
+    cp->r = NULL;
+    cp->hash = NULL;
+    cp->N = 0;
+    cp->allocatedN = 0;
+}
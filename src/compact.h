@@ -0,0 +1,60 @@
+/**
+ * @file 	compact.h
+ * @brief 	Massless test particles stored in single precision.
+ * @author 	Hanno Rein <hanno@hanno-rein.de>
+ *
+ * @section LICENSE
+ * Copyright (c) 2023 Hanno Rein
+ *
+ * This file is part of rebound.
+ *
+ * rebound is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rebound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rebound.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef _COMPACT_H
+#define _COMPACT_H
+#include "rebound.h"
+
+/**
+ * @brief First drift of the compact test particles (half a timestep).
+ * @details Called after the first part of the LEAPFROG integrator. Sets r->status
+ * to REB_EXIT_ERROR if the compact test particles cannot be integrated.
+ */
+void reb_compact_drift(struct reb_simulation* const r);
+
+/**
+ * @brief Kick and second drift of the compact test particles.
+ * @details Called after the accelerations of the active particles have been calculated,
+ * before the second part of the LEAPFROG integrator. Removes particles which hit an
+ * active particle or left an open box.
+ */
+void reb_compact_kick_drift(struct reb_simulation* const r);
+
+/**
+ * @brief Returns the number of bytes allocated for the compact test particles.
+ */
+size_t reb_compact_memory(const struct reb_compact_particles* const cp);
+
+/**
+ * @brief Duplicates the buffers of the compact test particles.
+ * @details Used when a simulation is copied. The struct itself has already been copied.
+ */
+void reb_compact_copy(struct reb_compact_particles* const dest, const struct reb_compact_particles* const src);
+
+/**
+ * @brief Frees the buffers of the compact test particles.
+ */
+void reb_compact_free(struct reb_compact_particles* const cp);
+
+#endif // _COMPACT_H
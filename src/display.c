@@ -42,15 +42,32 @@
 #include "output.h"
 #include "integrator.h"
 #define MAX(a, b) ((a) < (b) ? (b) : (a))       ///< Returns the maximum of a and b
+#define MIN(a, b) ((a) > (b) ? (b) : (a))       ///< Returns the minimum of a and b
+
+// Level of detail for orbit wires. The number of vertices per orbit is reduced
+// for large N so that the total stays roughly within the budget.
+#define REB_DISPLAY_ORBIT_VERTICES_MAX 500
+#define REB_DISPLAY_ORBIT_VERTICES_MIN 32
+#define REB_DISPLAY_ORBIT_VERTICES_BUDGET 2000000
+// Relative change in energy, angular momentum and eccentricity vector 
+// above which orbital elements are recalculated rather than reused.
+#define REB_DISPLAY_ORBIT_TOLERANCE 1e-3
 
 #ifdef OPENGL
 #include "simplefont.h"
+
 #define GLFW_INCLUDE_NONE
 #include "glad.h"
 #include <GLFW/glfw3.h>
 
 static void reb_display(GLFWwindow* window);
 static void reb_display_set_default_scale(struct reb_simulation* const r);
+
+static int reb_display_orbit_vertex_count(int N){
+    if (N<2) return REB_DISPLAY_ORBIT_VERTICES_MAX;
+    const int count = REB_DISPLAY_ORBIT_VERTICES_BUDGET/(N-1);
+    return MAX(REB_DISPLAY_ORBIT_VERTICES_MIN, MIN(REB_DISPLAY_ORBIT_VERTICES_MAX, count));
+}
                 
 static const char* onscreenhelp[] = { 
                 "REBOUND OPENGL mouse and keyboard commands",
@@ -357,11 +374,11 @@ static void reb_display_keyboard(GLFWwindow* window, int key, int scancode, int
             case 'X': 
                 if (mods!=GLFW_MOD_SHIFT){
                     data->reference++;
-                    if (data->reference>data->r->N) data->reference = -1;
+                    if (data->reference>=data->r_copy->N) data->reference = -1;
                     printf("Reference particle: %d.\n",data->reference);
                 }else{
                     data->reference--;
-                    if (data->reference<-1) data->reference = data->r->N-1;
+                    if (data->reference<-1) data->reference = data->r_copy->N-1;
                     printf("Reference particle: %d.\n",data->reference);
                 }
                 break;
@@ -399,7 +416,7 @@ static void reb_display(GLFWwindow* window){
     float tmp2[16];
     float tmp3[16];
     if (data->reference>=0){
-        struct reb_particle p = data->particles_copy[data->reference];
+        struct reb_particle p = data->r_copy->particles[data->reference];
         mattranslate(tmp2,-p.x,-p.y,-p.z);
         rotation2mat(data->view,tmp1);
         matmult(tmp1,tmp2,view);
@@ -440,6 +457,7 @@ static void reb_display(GLFWwindow* window){
                 glUseProgram(data->orbit_shader_program);
                 glBindVertexArray(data->orbit_shader_particle_vao);
                 glUniformMatrix4fv(data->orbit_shader_mvp_location, 1, GL_TRUE, (GLfloat*) tmp2);
+                glUniform1i(data->orbit_shader_vertex_count_location, data->orbit_shader_vertex_count);
                 glDrawArraysInstanced(GL_LINE_STRIP, 0, data->orbit_shader_vertex_count, data->r_copy->N-1);
                 glBindVertexArray(0);
             }
@@ -596,8 +614,6 @@ void reb_display_init(struct reb_simulation * const r){
     data->ghostboxes    = 0; 
     data->reference     = -1;
     data->view.r        = 1.;
-    data->p_jh_copy      = NULL;
-    data->allocated_N_whfast = 0;
 
     glfwSetKeyCallback(window,reb_display_keyboard);
     glfwGetInputMode(window, GLFW_STICKY_MOUSE_BUTTONS);
@@ -753,15 +769,15 @@ void reb_display_init(struct reb_simulation * const r){
             "in vec3 focus;\n"
             "in vec3 aef;\n"
             "in vec3 omegaOmegainc;\n"
-            "in float lintwopi;\n"
             "out float lin;\n"
             "uniform mat4 mvp;\n"
+            "uniform int vertex_count;\n"
             "const float M_PI = 3.14159265359;\n"
             "void main() {\n"
             "   float a = aef.x;\n"
             "   float e = aef.y;\n"
-            "   float f = aef.z+lintwopi;\n"
-            "   lin = lintwopi/(M_PI*2.);\n"
+            "   lin = float(gl_VertexID)/float(vertex_count-1);\n"
+            "   float f = aef.z+lin*M_PI*2.;\n"
             "   if (e>1.){\n"
             "       float theta_max = acos(-1./e);\n"
             "       f = 0.0001-theta_max+1.9998*lin*theta_max;\n"
@@ -792,6 +808,7 @@ void reb_display_init(struct reb_simulation * const r){
 
         data->orbit_shader_program = loadShader(vertex_shader, fragment_shader);
         data->orbit_shader_mvp_location = glGetUniformLocation(data->orbit_shader_program, "mvp");
+        data->orbit_shader_vertex_count_location = glGetUniformLocation(data->orbit_shader_program, "vertex_count");
     }
     
     // Create simplefont mesh
@@ -947,8 +964,6 @@ void reb_display_init(struct reb_simulation * const r){
     glUseProgram(data->orbit_shader_program);
     glGenVertexArrays(1, &data->orbit_shader_particle_vao);
     glBindVertexArray(data->orbit_shader_particle_vao);
-    GLuint olintwopip = glGetAttribLocation(data->orbit_shader_program,"lintwopi");
-    glEnableVertexAttribArray(olintwopip);
     GLuint ofocusp = glGetAttribLocation(data->orbit_shader_program,"focus");
     glEnableVertexAttribArray(ofocusp);
     GLuint oaefp = glGetAttribLocation(data->orbit_shader_program,"aef");
@@ -956,18 +971,8 @@ void reb_display_init(struct reb_simulation * const r){
     GLuint oomegaOmegaincp = glGetAttribLocation(data->orbit_shader_program,"omegaOmegainc");
     glEnableVertexAttribArray(oomegaOmegaincp);
    
-    data->orbit_shader_vertex_count = 500;
-    float* lin_data = malloc(sizeof(float)*data->orbit_shader_vertex_count);
-    for(int i=0;i<data->orbit_shader_vertex_count;i++){
-        lin_data[i] = (float)i/(float)(data->orbit_shader_vertex_count-1)*2.*M_PI;
-    }
-    GLuint orbit_vertex_buffer;
-    glGenBuffers(1, &orbit_vertex_buffer);
-    glBindBuffer(GL_ARRAY_BUFFER, orbit_vertex_buffer);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(float)*data->orbit_shader_vertex_count, lin_data, GL_STATIC_DRAW);
-    free(lin_data);
-    glVertexAttribPointer(olintwopip, 1, GL_FLOAT, GL_FALSE, 0, NULL);
-
+    // The position along the orbit is derived from gl_VertexID, no per-vertex buffer is needed.
+    data->orbit_shader_vertex_count = REB_DISPLAY_ORBIT_VERTICES_MAX;
 
     GLuint orbit_buffer;
     glGenBuffers(1, &orbit_buffer);
@@ -976,7 +981,6 @@ void reb_display_init(struct reb_simulation * const r){
     glVertexAttribPointer(oaefp, 3, GL_FLOAT, GL_FALSE, sizeof(float)*9, (void*)(sizeof(float)*3));
     glVertexAttribPointer(oomegaOmegaincp, 3, GL_FLOAT, GL_FALSE, sizeof(float)*9, (void*)(sizeof(float)*6));
 
-    glVertexAttribDivisor(olintwopip, 0); 
     glVertexAttribDivisor(data->orbit_shader_mvp_location, 0); 
     glVertexAttribDivisor(ofocusp, 1);
     glVertexAttribDivisor(oaefp, 1);
@@ -988,25 +992,27 @@ void reb_display_init(struct reb_simulation * const r){
 
     // Main display loop
     while(!glfwWindowShouldClose(window) && r->status<0){
-        // lock mutex for update
-        pthread_mutex_lock(&(data->mutex));    
+        // Pick up the latest snapshot published by the simulation thread. Never waits.
         int size_changed = reb_display_copy_data(r);
-        pthread_mutex_unlock(&(data->mutex));  
-
-        // prepare data (incl orbit calculation)
-        reb_display_prepare_data(r, data->wire);
-
-        // Copy data to GPU
         if (size_changed){ // reallocated GPU memory
             glBindBuffer(GL_ARRAY_BUFFER, particle_buffer);
             glBufferData(GL_ARRAY_BUFFER, data->allocated_N*sizeof(struct reb_particle_opengl), NULL, GL_STATIC_DRAW);
             glBindBuffer(GL_ARRAY_BUFFER, orbit_buffer);
             glBufferData(GL_ARRAY_BUFFER, data->allocated_N*sizeof(struct reb_orbit_opengl), NULL, GL_STATIC_DRAW);
         }
-        glBindBuffer(GL_ARRAY_BUFFER, particle_buffer);
-        glBufferSubData(GL_ARRAY_BUFFER, 0, data->r_copy->N*sizeof(struct reb_particle_opengl), data->particle_data);
-        glBindBuffer(GL_ARRAY_BUFFER, orbit_buffer);
-        glBufferSubData(GL_ARRAY_BUFFER, 0, (data->r_copy->N-1)*sizeof(struct reb_orbit_opengl), data->orbit_data);
+
+        // Prepare data (incl orbit calculation) on this thread and copy it to the GPU,
+        // but only if there is a new snapshot or the orbits have been turned on.
+        if (data->r_copy->N>0 && (!data->prepared || (data->wire && !data->prepared_orbits))){
+            reb_display_prepare_data(r, data->wire);
+            glBindBuffer(GL_ARRAY_BUFFER, particle_buffer);
+            glBufferSubData(GL_ARRAY_BUFFER, 0, data->r_copy->N*sizeof(struct reb_particle_opengl), data->particle_data);
+            if (data->wire){
+                data->orbit_shader_vertex_count = reb_display_orbit_vertex_count(data->r_copy->N);
+                glBindBuffer(GL_ARRAY_BUFFER, orbit_buffer);
+                glBufferSubData(GL_ARRAY_BUFFER, 0, (data->r_copy->N-1)*sizeof(struct reb_orbit_opengl), data->orbit_data);
+            }
+        }
 
         // Do actual drawing
         reb_display(window);
@@ -1043,79 +1049,188 @@ void reb_display_init_data(struct reb_simulation* const r){
     if (r->display_data==NULL){
         r->display_data = calloc(sizeof(struct reb_display_data),1);
         r->display_data->r = r;
-        if (pthread_mutex_init(&(r->display_data->mutex), NULL)){
-            reb_error(r,"Mutex creation failed.");
-        }
+        // Slots 0, 1 and 2 are initially owned by the simulation thread, the display thread, and neither.
+        r->display_data->snapshot_write = 0;
+        r->display_data->snapshot_read = 1;
+        r->display_data->snapshot_ready = 2;
         reb_display_set_default_scale(r);
     }
 }
 
+void reb_display_snapshot_take(struct reb_simulation* const r, struct reb_display_snapshot* const s, int stride){
+    const int N = r->N;
+    const int whfast_unsynchronized = r->integrator==REB_INTEGRATOR_WHFAST && r->ri_whfast.is_synchronized==0;
+    // The Jacobi coordinates can only be converted back if all particles are copied.
+    if (whfast_unsynchronized || stride<1){
+        stride = 1;
+    }
+    const int N_copy = (N+stride-1)/stride;
+    if ((unsigned long)N_copy>s->allocated_N){
+        s->allocated_N = N_copy;
+        s->particles = realloc(s->particles, s->allocated_N*sizeof(struct reb_particle));
+    }
+    memcpy(&s->r, r, sizeof(struct reb_simulation));
+    if (stride==1){
+        memcpy(s->particles, r->particles, sizeof(struct reb_particle)*N);
+    }else{
+        for (int i=0;i<N_copy;i++){
+            s->particles[i] = r->particles[i*stride];
+        }
+        s->r.N_active = -1;
+        s->r.N_var = 0;
+    }
+    s->r.N = N_copy;
+    s->r.particles = s->particles;
+    if (whfast_unsynchronized){
+        if (r->ri_whfast.allocated_N > s->allocated_N_whfast){
+            s->allocated_N_whfast = r->ri_whfast.allocated_N;
+            s->p_jh = realloc(s->p_jh, s->allocated_N_whfast*sizeof(struct reb_particle));
+        }
+        memcpy(s->p_jh, r->ri_whfast.p_jh, r->ri_whfast.allocated_N*sizeof(struct reb_particle));
+    }
+    s->r.ri_whfast.p_jh = s->p_jh;
+    // The display thread must not write into the Kepler solver corrections of the simulation.
+    s->r.ri_whfast.kepler_guess = NULL;
+    s->r.ri_whfast.kepler_warmstart = 0;
+}
+
+#define REB_DISPLAY_SNAPSHOT_INDEX 3
+#define REB_DISPLAY_SNAPSHOT_FRESH 4
+
+void reb_display_publish(struct reb_simulation* const r){
+    struct reb_display_data* data = r->display_data;
+    if (__atomic_load_n(&data->snapshot_ready, __ATOMIC_ACQUIRE) & REB_DISPLAY_SNAPSHOT_FRESH){
+        // The display thread has not picked up the last snapshot yet. 
+        // Nothing to do, so there is at most one copy per frame.
+        return;
+    }
+    reb_display_snapshot_take(r, &data->snapshots[data->snapshot_write], r->display_stride);
+    data->snapshot_write = __atomic_exchange_n(&data->snapshot_ready, data->snapshot_write | REB_DISPLAY_SNAPSHOT_FRESH, __ATOMIC_ACQ_REL) & REB_DISPLAY_SNAPSHOT_INDEX;
+}
+
 int reb_display_copy_data(struct reb_simulation* const r){
-    if (r->N==0) return 0;
     struct reb_display_data* data = r->display_data;
+    if (!(__atomic_load_n(&data->snapshot_ready, __ATOMIC_ACQUIRE) & REB_DISPLAY_SNAPSHOT_FRESH)){
+        if (data->opengl_enabled){
+            // Keep showing the current snapshot. 
+            return 0;
+        }
+        // No simulation thread is running (Jupyter widget). Take the snapshot here.
+        reb_display_publish(r);
+    }
+    data->snapshot_read = __atomic_exchange_n(&data->snapshot_ready, data->snapshot_read, __ATOMIC_ACQ_REL) & REB_DISPLAY_SNAPSHOT_INDEX;
+    data->r_copy = &data->snapshots[data->snapshot_read].r;
+    data->prepared = 0;
+    data->prepared_orbits = 0;
     int size_changed = 0;
-    if (r->N>data->allocated_N){
+    if ((unsigned long)data->r_copy->N>data->allocated_N){
         size_changed = 1;
-        data->allocated_N = r->N;
-        data->r_copy = realloc(data->r_copy,sizeof(struct reb_simulation));
-        data->particles_copy = realloc(data->particles_copy,r->N*sizeof(struct reb_particle));
+        data->allocated_N = data->r_copy->N;
         data->particle_data = realloc(data->particle_data, data->allocated_N*sizeof(struct reb_particle_opengl));
         data->orbit_data = realloc(data->orbit_data, data->allocated_N*sizeof(struct reb_orbit_opengl));
     }
-    memcpy(data->r_copy, r, sizeof(struct reb_simulation));
-    memcpy(data->particles_copy, r->particles, sizeof(struct reb_particle)*r->N);
-    data->r_copy->particles = data->particles_copy;
-    if (
-            (r->integrator==REB_INTEGRATOR_WHFAST && r->ri_whfast.is_synchronized==0)
-       )
-       {
-        if (r->ri_whfast.allocated_N > data->allocated_N_whfast){
-            size_changed = 1;
-            data->allocated_N_whfast = r->ri_whfast.allocated_N;
-            data->p_jh_copy = realloc(data->p_jh_copy,data->allocated_N_whfast*sizeof(struct reb_particle));
-        }
-        memcpy(data->p_jh_copy, r->ri_whfast.p_jh, data->allocated_N_whfast*sizeof(struct reb_particle));
-    }
-    data->r_copy->ri_whfast.p_jh= data->p_jh_copy;
-    
     return size_changed;
 }
 
 void reb_display_prepare_data(struct reb_simulation* const r, int orbits){
-    if (r->N==0) return;
     struct reb_display_data* data = r->display_data;
     struct reb_simulation* const r_copy = data->r_copy;
+    if (r_copy==NULL || r_copy->N==0) return;
 
-    // this only does something for WHFAST
-    reb_integrator_synchronize(r_copy);
-       
-    // Update data on GPU 
-    for (int i=0;i<r_copy->N;i++){
-        struct reb_particle p = r_copy->particles[i];
-        data->particle_data[i].x  = p.x;
-        data->particle_data[i].y  = p.y;
-        data->particle_data[i].z  = p.z;
-        data->particle_data[i].vx = p.vx;
-        data->particle_data[i].vy = p.vy;
-        data->particle_data[i].vz = p.vz;
-        data->particle_data[i].r  = p.r;
+    if (!data->prepared){
+        // This only does something for WHFast. Other integrators would 
+        // need internal arrays which are not part of the snapshot.
+        if (r_copy->integrator==REB_INTEGRATOR_WHFAST){
+            reb_integrator_synchronize(r_copy);
+        }
+        const struct reb_particle* const particles = r_copy->particles;
+#pragma omp parallel for schedule(static)
+        for (int i=0;i<r_copy->N;i++){
+            const struct reb_particle p = particles[i];
+            data->particle_data[i].x  = p.x;
+            data->particle_data[i].y  = p.y;
+            data->particle_data[i].z  = p.z;
+            data->particle_data[i].vx = p.vx;
+            data->particle_data[i].vy = p.vy;
+            data->particle_data[i].vz = p.vz;
+            data->particle_data[i].r  = p.r;
+        }
+        data->prepared = 1;
     }
-    if (orbits){
-        struct reb_particle com = r_copy->particles[0];
-        for (int i=1;i<r_copy->N;i++){
-            struct reb_particle p = r_copy->particles[i];
-            data->orbit_data[i-1].x  = com.x;
-            data->orbit_data[i-1].y  = com.y;
-            data->orbit_data[i-1].z  = com.z;
-            struct reb_orbit o = reb_tools_particle_to_orbit(r_copy->G, p,com);
-            data->orbit_data[i-1].a = o.a;
-            data->orbit_data[i-1].e = o.e;
-            data->orbit_data[i-1].f = o.f;
-            data->orbit_data[i-1].omega = o.omega;
-            data->orbit_data[i-1].Omega = o.Omega;
-            data->orbit_data[i-1].inc = o.inc;
-            com = reb_get_com_of_pair(p,com);
+    if (orbits && !data->prepared_orbits){
+        const int N = r_copy->N;
+        if ((unsigned long)N>data->allocated_N_orbit_invariants){
+            data->allocated_N_orbit_invariants = N;
+            data->orbit_invariants = realloc(data->orbit_invariants, N*sizeof(struct reb_orbit_invariants));
+        }
+        // Jacobi primaries. Sequential, but cheap. 
+        struct reb_particle* const primaries = malloc(sizeof(struct reb_particle)*N);
+        for (int i=1;i<N;i++){
+            primaries[i] = i==1?r_copy->particles[0]:reb_get_com_of_pair(r_copy->particles[i-1],primaries[i-1]);
+        }
+        const int N_valid = data->N_orbit_invariants;
+        const double G = r_copy->G;
+        const double tol2 = REB_DISPLAY_ORBIT_TOLERANCE*REB_DISPLAY_ORBIT_TOLERANCE;
+#pragma omp parallel for schedule(static)
+        for (int i=1;i<N;i++){
+            const struct reb_particle p = r_copy->particles[i];
+            const struct reb_particle primary = primaries[i];
+            struct reb_orbit_opengl* const od = &data->orbit_data[i-1];
+            struct reb_orbit_invariants* const oi = &data->orbit_invariants[i];
+            od->x = primary.x;
+            od->y = primary.y;
+            od->z = primary.z;
+            // Energy, angular momentum and eccentricity vector are cheap to calculate.
+            // Only if one of them has changed is the full conversion needed. 
+            // Otherwise only the true anomaly is updated.
+            const double mu = G*(p.m+primary.m);
+            const double dx = p.x-primary.x;
+            const double dy = p.y-primary.y;
+            const double dz = p.z-primary.z;
+            const double dvx = p.vx-primary.vx;
+            const double dvy = p.vy-primary.vy;
+            const double dvz = p.vz-primary.vz;
+            const double d = sqrt(dx*dx+dy*dy+dz*dz);
+            const double hx = dy*dvz-dz*dvy;
+            const double hy = dz*dvx-dx*dvz;
+            const double hz = dx*dvy-dy*dvx;
+            const double E = 0.5*(dvx*dvx+dvy*dvy+dvz*dvz) - mu/d;
+            const double ex = (dvy*hz-dvz*hy)/mu - dx/d;
+            const double ey = (dvz*hx-dvx*hz)/mu - dy/d;
+            const double ez = (dvx*hy-dvy*hx)/mu - dz/d;
+            if (i<N_valid && mu>0.
+                    && (hx-oi->hx)*(hx-oi->hx)+(hy-oi->hy)*(hy-oi->hy)+(hz-oi->hz)*(hz-oi->hz) <= tol2*(oi->hx*oi->hx+oi->hy*oi->hy+oi->hz*oi->hz)
+                    && (ex-oi->ex)*(ex-oi->ex)+(ey-oi->ey)*(ey-oi->ey)+(ez-oi->ez)*(ez-oi->ez) <= tol2
+                    && fabs(E-oi->E) <= REB_DISPLAY_ORBIT_TOLERANCE*fabs(oi->E)){
+                od->f = atan2(dx*oi->Qx+dy*oi->Qy+dz*oi->Qz, dx*oi->Px+dy*oi->Py+dz*oi->Pz);
+                continue;
+            }
+            int err;
+            const struct reb_orbit o = reb_tools_particle_to_orbit_err(G, p, primary, &err);
+            od->a = o.a;
+            od->e = o.e;
+            od->f = o.f;
+            od->omega = o.omega;
+            od->Omega = o.Omega;
+            od->inc = o.inc;
+            oi->hx = hx; oi->hy = hy; oi->hz = hz;
+            oi->ex = ex; oi->ey = ey; oi->ez = ez;
+            oi->E = E;
+            // Unit vectors towards pericenter and in the direction of motion at pericenter,
+            // same as in the orbit shader.
+            const double cO = cos(o.Omega), sO = sin(o.Omega);
+            const double co = cos(o.omega), so = sin(o.omega);
+            const double ci = cos(o.inc), si = sin(o.inc);
+            oi->Px = cO*co - sO*so*ci;
+            oi->Py = sO*co + cO*so*ci;
+            oi->Pz = so*si;
+            oi->Qx = -cO*so - sO*co*ci;
+            oi->Qy = -sO*so + cO*co*ci;
+            oi->Qz = co*si;
         }
+        free(primaries);
+        data->N_orbit_invariants = N;
+        data->prepared_orbits = 1;
     }
 }
 
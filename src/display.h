@@ -26,6 +26,7 @@
 #define _DISPLAY_H
 
 struct reb_simulation;
+struct reb_display_snapshot;
 
 /**
  * @brief Internal function to check if display update is needed.
@@ -39,7 +40,34 @@ void reb_check_for_display_heartbeat(struct reb_simulation* const r);
 void reb_display_init(struct reb_simulation* const r);
 
 void reb_display_init_data(struct reb_simulation* const r);
+
+/**
+ * @brief Copies the simulation into a snapshot. Called by the simulation thread.
+ * @details Only every stride-th particle is copied (all particles if WHFast is not synchronized).
+ * The copy is not synchronized. Its particles and Jacobi coordinates are owned by the snapshot, 
+ * all other pointers are shared with the simulation. The buffers of the snapshot are reused.
+ */
+void reb_display_snapshot_take(struct reb_simulation* const r, struct reb_display_snapshot* const s, int stride);
+
+/**
+ * @brief Publishes a snapshot of the simulation for the visualization. 
+ * @details Called by the simulation thread. Never waits for the display thread. 
+ * If the last snapshot has not been picked up yet, nothing is copied. 
+ * Only every display_stride-th particle is copied (all particles if WHFast is not synchronized).
+ */
+void reb_display_publish(struct reb_simulation* const r);
+
+/**
+ * @brief Makes the latest published snapshot the one shown (r_copy). 
+ * @details Called by the display thread. Never waits for the simulation thread. 
+ * If no simulation thread is running, a snapshot is taken first.
+ * @return 1 if particle_data and orbit_data have been reallocated.
+ */
 int reb_display_copy_data(struct reb_simulation* const r);
+
+/**
+ * @brief Fills particle_data and orbit_data (if orbits is 1) from the snapshot shown.
+ */
 void reb_display_prepare_data(struct reb_simulation* const r, int orbits);
 
 #endif
@@ -0,0 +1,341 @@
+/**
+ * @file 	ephemeris.c
+ * @brief 	Precomputed trajectories of massive bodies for test particle integrations.
+ * @author 	Hanno Rein <hanno@hanno-rein.de>
+ *
+ * @details 	If the test particles do not affect the massive bodies
+ * (testparticle_type=0), every test particle integration repeats the same
+ * integration of the massive bodies. An ephemeris stores the trajectories
+ * of the massive bodies once as piecewise Chebyshev polynomials. Simulations
+ * with an ephemeris attached only integrate the test particles. The
+ * positions, velocities and accelerations of the massive bodies are
+ * interpolated whenever the forces are calculated. Many simulations can
+ * share the same ephemeris, for example when they are integrated in parallel
+ * with reb_ensemble_integrate().
+ *
+ * Every segment of length `segment` uses `order` Chebyshev coefficients
+ * for every coordinate. Positions and velocities are fitted separately at
+ * the Chebyshev nodes. The accelerations are the derivatives of the
+ * velocity polynomials.
+ *
+ * @section LICENSE
+ * Copyright (c) 2023 Hanno Rein
+ *
+ * This file is part of rebound.
+ *
+ * rebound is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rebound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rebound.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "rebound.h"
+#include "ephemeris.h"
+
+#define REB_EPHEMERIS_MAX_ORDER 32
+#define REB_EPHEMERIS_VERSION 1
+static const char reb_ephemeris_magic[16] = "REBOUNDEphemeri";
+
+// Index of the first coefficient of coordinate d (x,y,z,vx,vy,vz) of body i in segment s.
+static inline size_t reb_ephemeris_index(const struct reb_ephemeris* const e, const long s, const int i, const int d){
+    return (((size_t)s*e->N + i)*6 + d)*e->order;
+}
+
+void reb_free_ephemeris_pointers(struct reb_ephemeris* const e){
+    free(e->m);
+    free(e->radius);
+    free(e->hash);
+    free(e->coefficients);
+    e->m = NULL;
+    e->radius = NULL;
+    e->hash = NULL;
+    e->coefficients = NULL;
+    e->N = 0;
+    e->segments_N = 0;
+}
+
+void reb_free_ephemeris(struct reb_ephemeris* const e){
+    if (e==NULL) return;
+    reb_free_ephemeris_pointers(e);
+    free(e);
+}
+
+static void reb_ephemeris_allocate(struct reb_ephemeris* const e){
+    e->m = malloc(sizeof(double)*e->N);
+    e->radius = malloc(sizeof(double)*e->N);
+    e->hash = malloc(sizeof(uint32_t)*e->N);
+    e->coefficients = calloc((size_t)e->segments_N*e->N*6*e->order, sizeof(double));
+}
+
+int reb_ephemeris_compute(struct reb_ephemeris* const e, struct reb_simulation* const r, const double tmax, const double segment, const int order){
+    memset(e, 0, sizeof(struct reb_ephemeris));
+    if (r->ephemeris){
+        reb_error(r, "Cannot compute an ephemeris from a simulation which uses an ephemeris itself.");
+        return 1;
+    }
+    if (order<2 || order>REB_EPHEMERIS_MAX_ORDER){
+        reb_error(r, "The order of the ephemeris needs to be between 2 and 32.");
+        return 1;
+    }
+    if (segment<=0. || tmax<=r->t){
+        reb_error(r, "The ephemeris can only be computed forward in time with a positive segment length.");
+        return 1;
+    }
+    const int N = r->N_active==-1?r->N-r->N_var:r->N_active;
+    if (N<=0){
+        reb_error(r, "The simulation has no massive bodies.");
+        return 1;
+    }
+    e->N = N;
+    e->order = order;
+    e->t_start = r->t;
+    e->segment = segment;
+    e->segments_N = (long)ceil((tmax-r->t)/segment);
+    if (e->segments_N<1) e->segments_N = 1;
+    e->G = r->G;
+    reb_ephemeris_allocate(e);
+    for (int i=0;i<N;i++){
+        e->m[i] = r->particles[i].m;
+        e->radius[i] = r->particles[i].r;
+        e->hash[i] = r->particles[i].hash;
+    }
+
+    // The nodes x_k = cos(pi*(k+1/2)/order) decrease with k. Integrate to them in reverse order.
+    double* const values = malloc(sizeof(double)*N*6*order);
+    const int exact_finish_time = r->exact_finish_time;
+    r->exact_finish_time = 1;
+    int error = 0;
+    for (long s=0; s<e->segments_N && !error; s++){
+        const double t0 = e->t_start + s*segment;
+        for (int k=order-1; k>=0; k--){
+            const double tau = cos(M_PI*(k+0.5)/order);
+            enum REB_STATUS status = reb_integrate(r, t0 + 0.5*segment*(tau+1.));
+            if (status!=REB_EXIT_SUCCESS || r->N-r->N_var<N){
+                reb_error(r, "The integration of the massive bodies did not finish successfully. Cannot compute the ephemeris.");
+                error = 1;
+                break;
+            }
+            for (int i=0;i<N;i++){
+                const struct reb_particle p = r->particles[i];
+                double* const v = values + (i*6)*order + k;
+                v[0*order] = p.x;
+                v[1*order] = p.y;
+                v[2*order] = p.z;
+                v[3*order] = p.vx;
+                v[4*order] = p.vy;
+                v[5*order] = p.vz;
+            }
+        }
+        if (error) break;
+        // Discrete cosine transform of the values at the nodes.
+        for (int i=0;i<N;i++){
+            for (int d=0;d<6;d++){
+                const double* const v = values + (i*6+d)*order;
+                double* const c = e->coefficients + reb_ephemeris_index(e, s, i, d);
+                for (int j=0;j<order;j++){
+                    double sum = 0.;
+                    for (int k=0;k<order;k++){
+                        sum += v[k]*cos(M_PI*j*(k+0.5)/order);
+                    }
+                    c[j] = 2.*sum/order;
+                }
+                c[0] *= 0.5;
+            }
+        }
+    }
+    free(values);
+    r->exact_finish_time = exact_finish_time;
+    if (error){
+        reb_free_ephemeris_pointers(e);
+        return 1;
+    }
+    return 0;
+}
+
+struct reb_ephemeris* reb_create_ephemeris(struct reb_simulation* const r, const double tmax, const double segment, const int order){
+    struct reb_ephemeris* e = malloc(sizeof(struct reb_ephemeris));
+    if (reb_ephemeris_compute(e, r, tmax, segment, order)){
+        free(e);
+        return NULL;
+    }
+    return e;
+}
+
+void reb_ephemeris_evaluate(const struct reb_ephemeris* const e, const double t, struct reb_particle* const particles){
+    long s = (long)floor((t-e->t_start)/e->segment);
+    if (s<0) s = 0;
+    if (s>=e->segments_N) s = e->segments_N-1;
+    const int order = e->order;
+    const double tau = 2.*(t-e->t_start-s*e->segment)/e->segment - 1.;
+    // Chebyshev polynomials T_j and their derivatives T'_j = j*U_{j-1}.
+    double T[REB_EPHEMERIS_MAX_ORDER];
+    double U[REB_EPHEMERIS_MAX_ORDER];
+    double dT[REB_EPHEMERIS_MAX_ORDER];
+    T[0] = 1.;
+    T[1] = tau;
+    U[0] = 1.;
+    U[1] = 2.*tau;
+    dT[0] = 0.;
+    dT[1] = 1.;
+    for (int j=2;j<order;j++){
+        T[j] = 2.*tau*T[j-1] - T[j-2];
+        U[j] = 2.*tau*U[j-1] - U[j-2];
+        dT[j] = j*U[j-1];
+    }
+    const double dtau_dt = 2./e->segment;
+    for (int i=0;i<e->N;i++){
+        double q[6] = {0.};
+        double a[3] = {0.};
+        for (int d=0;d<6;d++){
+            const double* const c = e->coefficients + reb_ephemeris_index(e, s, i, d);
+            for (int j=0;j<order;j++){
+                q[d] += c[j]*T[j];
+            }
+            if (d>=3){
+                for (int j=1;j<order;j++){
+                    a[d-3] += c[j]*dT[j];
+                }
+            }
+        }
+        particles[i].x = q[0];
+        particles[i].y = q[1];
+        particles[i].z = q[2];
+        particles[i].vx = q[3];
+        particles[i].vy = q[4];
+        particles[i].vz = q[5];
+        particles[i].ax = a[0]*dtau_dt;
+        particles[i].ay = a[1]*dtau_dt;
+        particles[i].az = a[2]*dtau_dt;
+    }
+}
+
+int reb_ephemeris_write(const struct reb_ephemeris* const e, const char* const filename){
+    FILE* of = fopen(filename, "wb");
+    if (of==NULL){
+        return 1;
+    }
+    const int version = REB_EPHEMERIS_VERSION;
+    const size_t N_coefficients = (size_t)e->segments_N*e->N*6*e->order;
+    int success = fwrite(reb_ephemeris_magic, sizeof(char), 16, of)==16
+        && fwrite(&version, sizeof(int), 1, of)==1
+        && fwrite(&e->N, sizeof(int), 1, of)==1
+        && fwrite(&e->order, sizeof(int), 1, of)==1
+        && fwrite(&e->segments_N, sizeof(long), 1, of)==1
+        && fwrite(&e->t_start, sizeof(double), 1, of)==1
+        && fwrite(&e->segment, sizeof(double), 1, of)==1
+        && fwrite(&e->G, sizeof(double), 1, of)==1
+        && fwrite(e->m, sizeof(double), e->N, of)==(size_t)e->N
+        && fwrite(e->radius, sizeof(double), e->N, of)==(size_t)e->N
+        && fwrite(e->hash, sizeof(uint32_t), e->N, of)==(size_t)e->N
+        && fwrite(e->coefficients, sizeof(double), N_coefficients, of)==N_coefficients;
+    success = fclose(of)==0 && success;
+    return !success;
+}
+
+int reb_ephemeris_read(struct reb_ephemeris* const e, const char* const filename){
+    memset(e, 0, sizeof(struct reb_ephemeris));
+    FILE* inf = fopen(filename, "rb");
+    if (inf==NULL){
+        return 1;
+    }
+    char magic[16];
+    int version = 0;
+    int success = fread(magic, sizeof(char), 16, inf)==16
+        && memcmp(magic, reb_ephemeris_magic, 16)==0
+        && fread(&version, sizeof(int), 1, inf)==1
+        && version==REB_EPHEMERIS_VERSION
+        && fread(&e->N, sizeof(int), 1, inf)==1
+        && fread(&e->order, sizeof(int), 1, inf)==1
+        && fread(&e->segments_N, sizeof(long), 1, inf)==1
+        && fread(&e->t_start, sizeof(double), 1, inf)==1
+        && fread(&e->segment, sizeof(double), 1, inf)==1
+        && fread(&e->G, sizeof(double), 1, inf)==1
+        && e->N>0 && e->order>=2 && e->order<=REB_EPHEMERIS_MAX_ORDER && e->segments_N>0;
+    if (success){
+        reb_ephemeris_allocate(e);
+        const size_t coefficients_N = (size_t)e->segments_N*e->N*6*e->order;
+        success = fread(e->m, sizeof(double), e->N, inf)==(size_t)e->N
+            && fread(e->radius, sizeof(double), e->N, inf)==(size_t)e->N
+            && fread(e->hash, sizeof(uint32_t), e->N, inf)==(size_t)e->N
+            && fread(e->coefficients, sizeof(double), coefficients_N, inf)==coefficients_N;
+    }
+    fclose(inf);
+    if (!success){
+        reb_free_ephemeris_pointers(e);
+        return 1;
+    }
+    return 0;
+}
+
+struct reb_ephemeris* reb_open_ephemeris(const char* const filename){
+    struct reb_ephemeris* e = malloc(sizeof(struct reb_ephemeris));
+    if (reb_ephemeris_read(e, filename)){
+        free(e);
+        return NULL;
+    }
+    return e;
+}
+
+void reb_attach_ephemeris(struct reb_simulation* const r, const struct reb_ephemeris* const e){
+    if (r->N){
+        reb_error(r, "An ephemeris needs to be attached before any particles are added.");
+        return;
+    }
+    if (r->t<e->t_start || r->t>e->t_start+e->segments_N*e->segment){
+        reb_error(r, "The simulation time is outside of the time range covered by the ephemeris.");
+        return;
+    }
+    struct reb_particle* const particles = calloc(e->N, sizeof(struct reb_particle));
+    reb_ephemeris_evaluate(e, r->t, particles);
+    for (int i=0;i<e->N;i++){
+        particles[i].m = e->m[i];
+        particles[i].r = e->radius[i];
+        particles[i].hash = e->hash[i];
+        reb_add(r, particles[i]);
+    }
+    free(particles);
+    r->G = e->G;
+    r->N_active = e->N;
+    r->testparticle_type = 0;
+    r->ephemeris = e;
+}
+
+// Returns 1 if the ephemeris can be used at the current time.
+static int reb_ephemeris_check(struct reb_simulation* const r){
+    const struct reb_ephemeris* const e = r->ephemeris;
+    if (r->integrator!=REB_INTEGRATOR_IAS15 && r->integrator!=REB_INTEGRATOR_LEAPFROG){
+        reb_error(r, "An ephemeris can only be used with the IAS15 and LEAPFROG integrators.");
+    }else if (r->N_active!=e->N || r->testparticle_type!=0){
+        reb_error(r, "An ephemeris requires N_active to be equal to the number of bodies in the ephemeris and testparticle_type=0.");
+    }else if (r->t<e->t_start || r->t>e->t_start+e->segments_N*e->segment){
+        reb_error(r, "The simulation time is outside of the time range covered by the ephemeris.");
+    }else{
+        return 1;
+    }
+    r->status = REB_EXIT_ERROR;
+    return 0;
+}
+
+void reb_ephemeris_update_particles(struct reb_simulation* const r){
+    if (!reb_ephemeris_check(r)) return;
+    reb_ephemeris_evaluate(r->ephemeris, r->t, r->particles);
+}
+
+void reb_ephemeris_update_accelerations(struct reb_simulation* const r){
+    if (r->status==REB_EXIT_ERROR) return;
+    // Positions and velocities are the same as those set by reb_ephemeris_update_particles().
+    reb_ephemeris_evaluate(r->ephemeris, r->t, r->particles);
+}
@@ -0,0 +1,42 @@
+/**
+ * @file 	ephemeris.h
+ * @brief 	Precomputed trajectories of massive bodies for test particle integrations.
+ * @author 	Hanno Rein <hanno@hanno-rein.de>
+ *
+ * @section LICENSE
+ * Copyright (c) 2023 Hanno Rein
+ *
+ * This file is part of rebound.
+ *
+ * rebound is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rebound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rebound.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef _EPHEMERIS_H
+#define _EPHEMERIS_H
+#include "rebound.h"
+
+/**
+ * @brief Sets the positions and velocities of the active particles to the ephemeris at r->t.
+ * @details Called before the forces are calculated if r->ephemeris is set. Sets r->status
+ * to REB_EXIT_ERROR if the ephemeris cannot be used.
+ */
+void reb_ephemeris_update_particles(struct reb_simulation* const r);
+
+/**
+ * @brief Sets the accelerations of the active particles to those of the ephemeris at r->t.
+ * @details Called after all forces have been calculated if r->ephemeris is set.
+ */
+void reb_ephemeris_update_accelerations(struct reb_simulation* const r);
+
+#endif // _EPHEMERIS_H
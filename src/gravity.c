@@ -31,6 +31,7 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <math.h>
 #include <time.h>
@@ -39,25 +40,211 @@
 #include "tree.h"
 #include "boundary.h"
 #include "integrator_mercurius.h"
+#include "autotune.h"
+#include "tools.h"
+#ifdef OPENMP
+#include <omp.h>
+#endif // OPENMP
 #define MAX(a, b) ((a) > (b) ? (a) : (b))    ///< Returns the maximum of a and b
+#define MIN(a, b) ((a) < (b) ? (a) : (b))    ///< Returns the minimum of a and b
 
 #ifdef MPI
 #include "communication_mpi.h"
 #endif
 
+// The kernels of REB_GRAVITY_BASIC below take an argument plain. They are inlined and called with 
+// plain set to the constant 1 if there is no softening and only one box, so that the compiler can 
+// remove the shifts and the softening from the inner loops. The results are the same in both cases.
+#ifndef OPENMP
+/**
+  * @brief Calculates the forces between all pairs of active particles (i, j) with starti<=i<N_active and startj<=j<i.
+  * @details The acceleration of particle i is summed up in registers. Returns early if reb_sigint is set.
+  * @param plain If 1, the ghost box shift and the softening are zero.
+  */
+static inline void reb_calculate_acceleration_basic_pairs(struct reb_particle* const particles, const double G, const double softening2, const struct reb_ghostbox gb, const int starti, const int startj, const int N_active, const int plain);
+#else // OPENMP
+#define REB_GRAVITY_BASIC_BLOCK 128   ///< Number of particles per tile in the parallel version of REB_GRAVITY_BASIC.
+/**
+  * @brief Calculates the forces between all pairs in a tile of active particles and adds them to a thread's accumulator.
+  * @details Pairs (i, j) with i0<=i<i1 and j0<=j<MIN(j1,i) are considered. Newton's third law is used, 
+  * so every pair is only calculated once.
+  * @param acc Accumulator of the thread, 3 values per particle.
+  * @param plain If 1, the ghost box shift and the softening are zero.
+  */
+static inline void reb_calculate_acceleration_basic_tile(const struct reb_particle* const particles, const double G, const double softening2, const struct reb_ghostbox gb, const int i0, const int i1, const int j0, const int j1, double* const acc, const int plain);
+static inline void reb_calculate_acceleration_basic_tile_pair(const struct reb_particle* const particles, const double G, const double softening2, const struct reb_ghostbox gb, const int p, const int starti, const int startj, const int N_active, double* const acc, const int plain);
+#endif // OPENMP
+
+#define REB_GRAVITY_DETERMINISTIC_SLOTS 64   ///< Number of partial sums used if gravity_deterministic is set. Independent of the number of threads.
+#if defined(OPENMP) || !defined(MPI)
+/**
+  * @brief Sums up N_slots consecutive arrays of length n. The result is stored in the first array.
+  * @details Every value is summed up pairwise in a fixed order (slot 0+1, 2+3, ..., then 0+2, ...), 
+  * so the result only depends on N_slots and not on the number of threads.
+  */
+static void reb_gravity_deterministic_reduce(double* const slots, const int N_slots, const long n);
+#endif // OPENMP || !MPI
+
+/**
+  * @brief Calculates the accelerations of test particles which do not interact with the active particles (testparticle_type 0).
+  * @details The positions and masses of the active particles j0<=j<N_active are copied into a packed array once. 
+  * Then the forces on every test particle i0<=i<r->N-r->N_var from all ghost boxes are summed up in registers. 
+  * Test particles are independent of each other and distributed over threads if OpenMP is turned on.
+  * @param r REBOUND simulation to consider
+  */
+static void reb_calculate_acceleration_basic_testparticles(struct reb_simulation* const r, const int i0, const int j0, const int N_active);
+
+/**
+  * @brief Calculates the accelerations of the test particles i0<=i<i1 from the active particles for REB_GRAVITY_COMPENSATED.
+  * @details Every test particle is independent, the sums and compensation terms are kept in registers. 
+  * The result is the same as that of the loops in reb_calculate_acceleration(). The back reaction on 
+  * active particles for testparticle_type 1 is not included.
+  * @param r REBOUND simulation to consider
+  */
+static void reb_calculate_acceleration_compensated_testparticles(struct reb_simulation* const r, const int i0, const int i1, const int N_active);
+
+#ifdef GPU
+#define REB_GRAVITY_GPU_MIN_N 4096   ///< Smaller numbers of test particles are not offloaded to the GPU.
+/**
+  * @brief Calculates the accelerations of test particles of type 0 on the GPU using OpenMP target offloading.
+  * @details The positions of the test particles i0<=i<r->N-r->N_var are copied into r->gravity_gpu, which 
+  * stays allocated on the device between calls. Only positions and accelerations are transferred. 
+  * @param r REBOUND simulation to consider
+  * @param compensated If 1, the forces are summed up with compensated summation as in REB_GRAVITY_COMPENSATED.
+  */
+static void reb_calculate_acceleration_testparticles_gpu(struct reb_simulation* const r, const int i0, const int j0, const int N_active, const int compensated);
+#endif // GPU
+
+#ifdef AVX512
+#define REB_GRAVITY_BASIC_AVX512_MIN_N 32   ///< Smaller simulations use the scalar version of REB_GRAVITY_BASIC.
+/**
+  * @brief Calculates the accelerations for REB_GRAVITY_BASIC with AVX512 instructions.
+  * @details Positions and masses are packed into r->particles_soa once per call. The 
+  * accelerations of every particle are then summed up over 8 other particles at a time.
+  * @param r REBOUND simulation to consider
+  */
+static void reb_calculate_acceleration_basic_avx512(struct reb_simulation* const r);
+/**
+  * @brief Calculates the accelerations for REB_GRAVITY_COMPENSATED with AVX512 instructions.
+  * @details The accelerations of 8 particles are summed up at a time, every lane with its own compensation 
+  * term. The sources are added in the same order and with the same operations as in the scalar version, 
+  * so the results are identical.
+  * @param r REBOUND simulation to consider
+  * @param N_targets Only the accelerations of particles with indices below N_targets are calculated.
+  */
+static void reb_calculate_acceleration_compensated_avx512(struct reb_simulation* const r, const int N_targets);
+#endif // AVX512
+
 /**
   * @brief The function loops over all trees to call calculate_forces_for_particle_from_cell() tree to calculate forces for each particle.
   * @param r REBOUND simulation to consider
   * @param pt Index of the particle the force is calculated for.
   * @param gb Ghostbox plus position of the particle (precalculated). 
+  * @param root_proc Only root boxes owned by this MPI node are included. All root boxes are included if negative.
+  * @param far If not NULL, root boxes S with far[S]==1 are skipped because they are included in a local expansion.
+  * @return Number of cells and particles the force has been calculated from.
+  */
+static int reb_calculate_acceleration_for_particle(const struct reb_simulation* const r, const int pt, const struct reb_ghostbox gb, const int root_proc, const char* const far);
+
+struct reb_fmm_tables;
+/**
+ * @brief Local expansions of the gravity of distant root boxes for REB_GRAVITY_TREE (gravity_tree_far_field=1).
+ * @details A root box S is distant from a root box T (in a given ghost box) if the tree walk would not open
+ * S for any point in T. All these interactions are summed up in one local expansion about the center of T
+ * and evaluated once for every particle in T, instead of every particle walking the tree of S.
+ */
+struct reb_gravity_tree_far {
+    struct reb_fmm_tables* t;
+    int* rootbox;       ///< Root box of every particle
+    int* targets;       ///< Index of the local expansion of every root box, -1 if it contains no particles
+    double* L;          ///< Local expansions, t->N values per root box with particles
+    char* far;          ///< far[T*root_n+S] is 1 if root box S is included in the local expansion of T for the current ghost box
+};
+
+/**
+  * @brief Calculates the acceleration of all particles in the tree using one interaction list per group of particles.
+  * @details Used instead of reb_calculate_acceleration_for_particle() if tree_group_size is larger than 0.
+  * @param r REBOUND simulation to consider
+  * @param gb Ghostbox (not including the position of any particle).
+  * @param root_proc Only root boxes owned by this MPI node are included. All root boxes are included if negative.
+  * @param ff If ff->far is not NULL, root boxes included in the local expansions are skipped.
+  */
+static void reb_calculate_acceleration_for_groups(struct reb_simulation* const r, const struct reb_ghostbox gb, const int root_proc, const struct reb_gravity_tree_far* const ff);
+
+/**
+  * @brief Finds the root box of every particle and allocates the local expansions of all root boxes containing particles.
+  */
+static void reb_gravity_tree_far_init(struct reb_simulation* const r, struct reb_gravity_tree_far* const ff);
+
+/**
+  * @brief Determines the distant root boxes for the ghost box gb and adds their gravity to the local expansions.
+  * @param root_proc Only root boxes owned by this MPI node are included. All root boxes are included if negative.
+  */
+static void reb_gravity_tree_far_ghostbox(const struct reb_simulation* const r, struct reb_gravity_tree_far* const ff, const struct reb_ghostbox gb, const int root_proc);
+
+/**
+  * @brief Evaluates the local expansions at all particles and adds the result to their accelerations.
+  */
+static void reb_gravity_tree_far_apply(struct reb_simulation* const r, const struct reb_gravity_tree_far* const ff);
+
+/**
+  * @brief Frees the local expansions and tables.
+  */
+static void reb_gravity_tree_far_free(struct reb_gravity_tree_far* const ff);
+
+/**
+  * @brief Adds the tree gravity from the root boxes owned by one MPI node (or all root boxes) to all particles.
+  * @param r REBOUND simulation to consider
+  * @param N_groups Particles with indices below N_groups are treated in groups, all others individually.
+  * @param root_proc Only root boxes owned by this MPI node are included. All root boxes are included if negative.
+  * @param chunks Particles are distributed to the OpenMP threads in chunks starting at these indices, see reb_gravity_tree_chunks(). NULL without OpenMP.
+  * @param chunks_N Number of chunks.
+  */
+static void reb_calculate_acceleration_tree(struct reb_simulation* const r, const int N_groups, const int root_proc, const int* const chunks, const int chunks_N);
+
+#ifdef OPENMP
+/**
+  * @brief Splits the particles which walk the tree individually into chunks with a similar amount of work.
+  * @details The work of a particle is its number of interactions in the previous tree gravity calculation, 
+  * stored in gravity_tree_cost. Particles in dense clumps need many more interactions than isolated ones.
+  * If no costs are available, for example because particles have been added or removed, all particles 
+  * count the same. Chunks are contiguous in index order, so neighbouring particles (see spatial_sort_interval) 
+  * are handled by the same thread. The costs are reset to be counted again in this calculation.
+  * @param r REBOUND simulation to consider
+  * @param N_groups First particle which walks the tree individually.
+  * @param chunks_N Set to the number of chunks.
+  * @return First index of every chunk, followed by N. Needs to be freed by the caller.
+  */
+static int* reb_gravity_tree_chunks(struct reb_simulation* const r, const int N_groups, int* const chunks_N);
+#endif // OPENMP
+
+/**
+  * @brief Calculates the acceleration of all particles with the fast multipole method.
+  * @details The accelerations need to be set to zero before calling this function.
+  * @param r REBOUND simulation to consider
+  */
+#ifndef MPI
+static void reb_calculate_acceleration_fmm(struct reb_simulation* const r);
+#endif // MPI
+
+/**
+  * @brief Calculates the acceleration of all particles with Ewald summation for periodic and shearing sheet boundaries.
+  * @details Sets the accelerations of all real particles.
+  * @param r REBOUND simulation to consider
   */
-static void reb_calculate_acceleration_for_particle(const struct reb_simulation* const r, const int pt, const struct reb_ghostbox gb);
+#ifndef MPI
+static void reb_calculate_acceleration_ewald(struct reb_simulation* const r);
+#endif // MPI
 
 
 /**
  * Main Gravity Routine
  */
 void reb_calculate_acceleration(struct reb_simulation* r){
+    if (r->gravity == REB_GRAVITY_AUTO){
+        // Usually done at the beginning of reb_step().
+        reb_autotune_select(r);
+    }
     if (r->integrator != REB_INTEGRATOR_MERCURIUS && r->gravity == REB_GRAVITY_MERCURIUS){
         reb_warning(r,"You are using the Mercurius gravity routine with a non-Mercurius integrator. This will probably lead to unexpected behaviour. REBOUND is now setting the gravity routine back to rEB_GRAVITY_BASIC. To avoid this warning message, consider manually setting the gravity routine after changing integrators.");
         r->gravity = REB_GRAVITY_BASIC;
@@ -140,29 +327,101 @@ void reb_calculate_acceleration(struct reb_simulation* r){
         break;
         case REB_GRAVITY_BASIC:
         {
+#ifdef MPI
+            // With the test particle decomposition and testparticle_type=1, the active particles feel 
+            // the test particles of all nodes. Only node 0 calculates the forces between active particles,
+            // the other nodes only contribute the forces from their test particles. These are then summed up.
+            const int reduce_active = r->mpi_decomposition==REB_MPI_DECOMPOSITION_TESTPARTICLES && _testparticle_type;
+            // The active particles of a simulation with an ephemeris do not need to interact with each other either.
+            const int skip_active_pairs = (reduce_active && r->mpi_id!=0) || r->ephemeris;
+#else // MPI
+            const int reduce_active = 0;
+            // The accelerations of active particles are taken from the ephemeris. Only test particles need forces.
+            const int skip_active_pairs = r->ephemeris!=NULL;
+#endif // MPI
+            // WHFast calculates the forces on partitioned test particles itself in the same pass as their kick.
+            const int testparticles_deferred = r->integrator==REB_INTEGRATOR_WHFAST && r->ri_whfast.testparticles_deferred;
+#ifdef AVX512
+            if (_N_real>=REB_GRAVITY_BASIC_AVX512_MIN_N && !reduce_active && !skip_active_pairs && !testparticles_deferred){
+                reb_calculate_acceleration_basic_avx512(r);
+                break;
+            }
+#endif // AVX512
             const int nghostx = r->nghostx;
             const int nghosty = r->nghosty;
             const int nghostz = r->nghostz;
-#ifndef OPENMP // OPENMP off
             const int starti = (_gravity_ignore_terms==0)?1:2;
             const int startj = (_gravity_ignore_terms==2)?1:0;
-#endif // OPENMP
+            // Test particles of type 0 are handled by a separate kernel which sets their accelerations.
+            const int testparticles_separate = !_testparticle_type && _N_active<_N_real;
+            const int startitestp = MAX(_N_active, starti);
+            const int N_zero = testparticles_separate?startitestp:N;
+            // Choose the specialized kernels once if there is no softening and only one box.
+            const int plain = softening2==0. && nghostx==0 && nghosty==0 && nghostz==0;
 #pragma omp parallel for 
-            for (int i=0; i<N; i++){
+            for (int i=0; i<N_zero; i++){
+                particles[i].ax = 0; 
+                particles[i].ay = 0; 
+                particles[i].az = 0; 
+            }
+            for (int i=_N_real; i<N; i++){
                 particles[i].ax = 0; 
                 particles[i].ay = 0; 
                 particles[i].az = 0; 
             }
+#ifdef OPENMP
+            // Every thread accumulates the forces between active particles in its own array. 
+            // Tiles of pairs are distributed statically, so the result does not depend on timing.
+            // If gravity_deterministic is set, there is a fixed number of arrays (slots) instead. 
+            // Every slot sums up every N_slots-th tile in order, so the result does not depend on the number of threads either.
+            const int N_tiles = (_N_active+REB_GRAVITY_BASIC_BLOCK-1)/REB_GRAVITY_BASIC_BLOCK;
+            const int N_tile_pairs = skip_active_pairs?0:N_tiles*(N_tiles+1)/2;
+            const int deterministic = r->gravity_deterministic;
+            const int N_threads = deterministic?MAX(1,MIN(REB_GRAVITY_DETERMINISTIC_SLOTS, N_tile_pairs)):omp_get_max_threads();
+            double* const acc_threads = calloc((size_t)N_threads*3*_N_active+1, sizeof(double));
+#endif // OPENMP
             // Summing over all Ghost Boxes
+            const struct reb_ghostbox* const ghostboxes = reb_boundary_ghostboxes(r);
             for (int gbx=-nghostx; gbx<=nghostx; gbx++){
             for (int gby=-nghosty; gby<=nghosty; gby++){
             for (int gbz=-nghostz; gbz<=nghostz; gbz++){
-                struct reb_ghostbox gb = reb_boundary_get_ghostbox(r, gbx,gby,gbz);
+                struct reb_ghostbox gb = ghostboxes[reb_boundary_ghostbox_index(r, gbx,gby,gbz)];
                 // All active particle pairs
 #ifndef OPENMP // OPENMP off, do O(1/2*N^2)
-                for (int i=starti; i<_N_active; i++){
+                if (skip_active_pairs){
+                    // Calculated on node 0
+                }else if (plain){
+                    reb_calculate_acceleration_basic_pairs(particles, G, 0., gb, starti, startj, _N_active, 1);
+                }else{
+                    reb_calculate_acceleration_basic_pairs(particles, G, softening2, gb, starti, startj, _N_active, 0);
+                }
                 if (reb_sigint) return;
-                for (int j=startj; j<i; j++){
+#else // OPENMP on, do O(1/2*N^2) in tiles
+                if (deterministic){
+#pragma omp parallel for schedule(dynamic,1)
+                    for (int t=0; t<N_threads; t++){
+                        double* const acc = acc_threads + (size_t)3*_N_active*t;
+                        for (int p=t; p<N_tile_pairs; p+=N_threads){
+                            reb_calculate_acceleration_basic_tile_pair(particles, G, softening2, gb, p, starti, startj, _N_active, acc, plain);
+                        }
+                    }
+                }else{
+#pragma omp parallel
+                {
+                double* const acc = acc_threads + (size_t)3*_N_active*omp_get_thread_num();
+#pragma omp for schedule(static)
+                for (int p=0; p<N_tile_pairs; p++){
+                    reb_calculate_acceleration_basic_tile_pair(particles, G, softening2, gb, p, starti, startj, _N_active, acc, plain);
+                }
+                }
+                }
+#endif // OPENMP
+                // Interactions of test particles with active particles
+                if (!_testparticle_type) continue;
+#ifndef OPENMP // OPENMP off
+                for (int i=startitestp; i<_N_real; i++){
+                if (reb_sigint) return;
+                for (int j=startj; j<_N_active; j++){
                     const double dx = (gb.shiftx+particles[i].x) - particles[j].x;
                     const double dy = (gb.shifty+particles[i].y) - particles[j].y;
                     const double dz = (gb.shiftz+particles[i].z) - particles[j].z;
@@ -179,13 +438,10 @@ void reb_calculate_acceleration(struct reb_simulation* r){
                     particles[j].az    += prefacti*dz;
                 }
                 }
-#else // OPENMP on, do O(N^2)
+#else // OPENMP on
 #pragma omp parallel for
-                for (int i=0; i<_N_real; i++){
-                for (int j=0; j<_N_active; j++){
-                    if (_gravity_ignore_terms==1 && ((j==1 && i==0) || (i==1 && j==0) )) continue;
-                    if (_gravity_ignore_terms==2 && ((j==0 || i==0) )) continue;
-                    if (i==j) continue;
+                for (int i=startitestp; i<_N_real; i++){
+                for (int j=startj; j<_N_active; j++){
                     const double dx = (gb.shiftx+particles[i].x) - particles[j].x;
                     const double dy = (gb.shifty+particles[i].y) - particles[j].y;
                     const double dz = (gb.shiftz+particles[i].z) - particles[j].z;
@@ -197,33 +453,6 @@ void reb_calculate_acceleration(struct reb_simulation* r){
                     particles[i].az    += prefact*dz;
                 }
                 }
-#endif // OPENMP
-                // Interactions of test particles with active particles
-#ifndef OPENMP // OPENMP off
-                const int startitestp = MAX(_N_active, starti);
-                for (int i=startitestp; i<_N_real; i++){
-                if (reb_sigint) return;
-                for (int j=startj; j<_N_active; j++){
-                    const double dx = (gb.shiftx+particles[i].x) - particles[j].x;
-                    const double dy = (gb.shifty+particles[i].y) - particles[j].y;
-                    const double dz = (gb.shiftz+particles[i].z) - particles[j].z;
-                    const double _r = sqrt(dx*dx + dy*dy + dz*dz + softening2);
-                    const double prefact = G/(_r*_r*_r);
-                    const double prefactj = -prefact*particles[j].m;
-                    
-                    particles[i].ax    += prefactj*dx;
-                    particles[i].ay    += prefactj*dy;
-                    particles[i].az    += prefactj*dz;
-                    if (_testparticle_type){
-                        const double prefacti = prefact*particles[i].m;
-                        particles[j].ax    += prefacti*dx;
-                        particles[j].ay    += prefacti*dy;
-                        particles[j].az    += prefacti*dz;
-                    }
-                }
-                }
-#else // OPENMP on
-                if (_testparticle_type){
 #pragma omp parallel for
 				for (int i=0; i<_N_active; i++){
 				for (int j=_N_active; j<_N_real; j++){
@@ -240,22 +469,60 @@ void reb_calculate_acceleration(struct reb_simulation* r){
 					particles[i].az    += prefact*dz;
 				}
 				}
-                }
 #endif // OPENMP
             }
             }
             }
+#ifdef OPENMP
+            if (deterministic){
+                reb_gravity_deterministic_reduce(acc_threads, N_threads, 3L*_N_active);
+            }
+            // Sum up the accumulators of all threads
+#pragma omp parallel for
+            for (int i=0; i<_N_active; i++){
+                for (int t=0; t<(deterministic?1:N_threads); t++){
+                    const double* const acc = acc_threads + (size_t)3*_N_active*t;
+                    particles[i].ax += acc[3*i+0];
+                    particles[i].ay += acc[3*i+1];
+                    particles[i].az += acc[3*i+2];
+                }
+            }
+            free(acc_threads);
+#endif // OPENMP
+            if (testparticles_separate && !testparticles_deferred){
+                reb_calculate_acceleration_basic_testparticles(r, startitestp, startj, _N_active);
+            }
+            if (reduce_active){
+#ifdef MPI
+                reb_communication_mpi_reduce_active_accelerations(r, _N_active);
+#endif // MPI
+            }
         }
         break;
         case REB_GRAVITY_COMPENSATED:
         {
             if (r->gravity_cs_allocatedN<N){
-                r->gravity_cs = realloc(r->gravity_cs,N*sizeof(struct reb_vec3d));
+                r->gravity_cs = reb_tools_realloc_aligned(r->gravity_cs, sizeof(struct reb_vec3d), r->gravity_cs_allocatedN, N);
                 r->gravity_cs_allocatedN = N;
             }
             struct reb_vec3d* restrict const cs = r->gravity_cs;
+            // Test particles i>=_N_real_cpu are handled on the GPU.
+            int _N_real_cpu = _N_real;
+#ifdef GPU
+            const int starti_gpu = MAX(_N_active, (_gravity_ignore_terms==0)?1:2);
+            if (!_testparticle_type && _N_real-starti_gpu>=REB_GRAVITY_GPU_MIN_N){
+                _N_real_cpu = starti_gpu;
+                reb_calculate_acceleration_testparticles_gpu(r, _N_real_cpu, (_gravity_ignore_terms==2)?1:0, _N_active, 1);
+            }
+#endif // GPU
+#ifdef AVX512
+            if (_N_real>=REB_GRAVITY_BASIC_AVX512_MIN_N){
+                reb_calculate_acceleration_compensated_avx512(r, _N_real_cpu);
+                break;
+            }
+#endif // AVX512
 #pragma omp parallel for schedule(guided)
-            for (int i=0; i<_N_real; i++){
+            for (int i=0; i<_N_real_cpu; i++){
                 particles[i].ax = 0.; 
                 particles[i].ay = 0.; 
                 particles[i].az = 0.; 
@@ -265,8 +532,12 @@ void reb_calculate_acceleration(struct reb_simulation* r){
             }
             // Summing over all massive particle pairs
 #ifdef OPENMP
+            // The accelerations of particle i are summed up in registers.
 #pragma omp parallel for schedule(guided)
             for (int i=0; i<_N_active; i++){
+            double ax = 0., csx = 0.;
+            double ay = 0., csy = 0.;
+            double az = 0., csz = 0.;
             for (int j=0; j<_N_active; j++){
                 if (_gravity_ignore_terms==1 && ((j==1 && i==0) || (i==1 && j==0))) continue;
                 if (_gravity_ignore_terms==2 && ((j==0 || i==0))) continue;
@@ -281,61 +552,31 @@ void reb_calculate_acceleration(struct reb_simulation* r){
                 
                 {
                 double ix = prefactj*dx;
-                double yx = ix - cs[i].x;
-                double tx = particles[i].ax + yx;
-                cs[i].x = (tx - particles[i].ax) - yx;
-                particles[i].ax = tx;
+                double yx = ix - csx;
+                double tx = ax + yx;
+                csx = (tx - ax) - yx;
+                ax = tx;
 
                 double iy = prefactj*dy;
-                double yy = iy- cs[i].y;
-                double ty = particles[i].ay + yy;
-                cs[i].y = (ty - particles[i].ay) - yy;
-                particles[i].ay = ty;
+                double yy = iy- csy;
+                double ty = ay + yy;
+                csy = (ty - ay) - yy;
+                ay = ty;
                 
                 double iz = prefactj*dz;
-                double yz = iz - cs[i].z;
-                double tz = particles[i].az + yz;
-                cs[i].z = (tz - particles[i].az) - yz;
-                particles[i].az = tz;
+                double yz = iz - csz;
+                double tz = az + yz;
+                csz = (tz - az) - yz;
+                az = tz;
                 }
             }
+            particles[i].ax = ax; cs[i].x = csx;
+            particles[i].ay = ay; cs[i].y = csy;
+            particles[i].az = az; cs[i].z = csz;
             }
 
             // Testparticles
-#pragma omp parallel for schedule(guided)
-            for (int i=_N_active; i<_N_real; i++){
-            for (int j=0; j<_N_active; j++){
-                if (_gravity_ignore_terms==1 && ((j==1 && i==0) || (i==1 && j==0))) continue;
-                if (_gravity_ignore_terms==2 && ((j==0 || i==0))) continue;
-                const double dx = particles[i].x - particles[j].x;
-                const double dy = particles[i].y - particles[j].y;
-                const double dz = particles[i].z - particles[j].z;
-                const double r2 = dx*dx + dy*dy + dz*dz + softening2;
-                const double r = sqrt(r2);
-                const double prefact  = G/(r2*r);
-                const double prefactj = -prefact*particles[j].m;
-                
-                {
-                double ix = prefactj*dx;
-                double yx = ix - cs[i].x;
-                double tx = particles[i].ax + yx;
-                cs[i].x = (tx - particles[i].ax) - yx;
-                particles[i].ax = tx;
-
-                double iy = prefactj*dy;
-                double yy = iy- cs[i].y;
-                double ty = particles[i].ay + yy;
-                cs[i].y = (ty - particles[i].ay) - yy;
-                particles[i].ay = ty;
-                
-                double iz = prefactj*dz;
-                double yz = iz - cs[i].z;
-                double tz = particles[i].az + yz;
-                cs[i].z = (tz - particles[i].az) - yz;
-                particles[i].az = tz;
-                }
-            }
-            }
+            reb_calculate_acceleration_compensated_testparticles(r, _N_active, _N_real_cpu, _N_active);
             if (_testparticle_type){
 #pragma omp parallel for schedule(guided)
                 for (int j=0; j<_N_active; j++){
@@ -429,7 +670,10 @@ void reb_calculate_acceleration(struct reb_simulation* r){
             }
 
             // Testparticles
-            for (int i=_N_active; i<_N_real; i++){
+            if (!_testparticle_type){
+                reb_calculate_acceleration_compensated_testparticles(r, _N_active, _N_real_cpu, _N_active);
+            }else{
+            for (int i=_N_active; i<_N_real_cpu; i++){
             if (reb_sigint) return;
             for (int j=0; j<_N_active; j++){
                 if (_gravity_ignore_terms==1 && ((j==1 && i==0) || (i==1 && j==0))) continue;
@@ -485,6 +729,7 @@ void reb_calculate_acceleration(struct reb_simulation* r){
                 }
             }
             }
+            }
 #endif // OPENMP
         }
         break;
@@ -496,31 +741,73 @@ void reb_calculate_acceleration(struct reb_simulation* r){
                 particles[i].ay = 0; 
                 particles[i].az = 0; 
             }
-            // Summing over all Ghost Boxes
-            for (int gbx=-r->nghostx; gbx<=r->nghostx; gbx++){
-            for (int gby=-r->nghosty; gby<=r->nghosty; gby++){
-            for (int gbz=-r->nghostz; gbz<=r->nghostz; gbz++){
-                // Summing over all particle pairs
-#pragma omp parallel for schedule(guided)
-                for (int i=0; i<N; i++){
-#ifndef OPENMP
-                    if (reb_sigint) return;
+            // Particles which are not in the tree (see reb_tree_active_only()) always walk the tree by themselves.
+            const int N_groups = r->tree_group_size>0?(reb_tree_active_only(r)?_N_active:N):0; 
+            int chunks_N = 0;
+            int* chunks = NULL;
+#ifdef OPENMP
+            chunks = reb_gravity_tree_chunks(r, N_groups, &chunks_N);
 #endif // OPENMP
-                    struct reb_ghostbox gb = reb_boundary_get_ghostbox(r, gbx,gby,gbz);
-                    // Precalculated shifted position
-                    gb.shiftx += particles[i].x;
-                    gb.shifty += particles[i].y;
-                    gb.shiftz += particles[i].z;
-                    reb_calculate_acceleration_for_particle(r, i, gb);
+#ifdef MPI
+            if (r->tree_essential_pending){
+                // Forces from local root boxes first, while the essential 
+                // trees of the other nodes are still in flight. 
+                reb_calculate_acceleration_tree(r, N_groups, r->mpi_id, chunks, chunks_N);
+                // Then the remote root boxes in the order in which they arrive.
+                int proc;
+                while ((proc = reb_communication_mpi_distribute_essential_tree_for_gravity_next(r))>=0){
+                    reb_calculate_acceleration_tree(r, N_groups, proc, chunks, chunks_N);
                 }
+                free(chunks);
+                break;
+            }
+#endif // MPI
+            reb_calculate_acceleration_tree(r, N_groups, -1, chunks, chunks_N);
+            free(chunks);
+        }
+        break;
+        case REB_GRAVITY_FMM:
+        {
+#pragma omp parallel for schedule(guided)
+            for (int i=0; i<N; i++){
+                particles[i].ax = 0; 
+                particles[i].ay = 0; 
+                particles[i].az = 0; 
             }
+#ifdef MPI
+            reb_error(r, "REB_GRAVITY_FMM is not supported with MPI. Use REB_GRAVITY_TREE instead.");
+#else // MPI
+            reb_calculate_acceleration_fmm(r);
+#endif // MPI
+        }
+        break;
+        case REB_GRAVITY_EWALD:
+        {
+            for (int i=_N_real; i<N; i++){
+                particles[i].ax = 0; 
+                particles[i].ay = 0; 
+                particles[i].az = 0; 
             }
+#ifdef MPI
+            reb_error(r, "REB_GRAVITY_EWALD is not supported with MPI.");
+#else // MPI
+            if (r->boundary!=REB_BOUNDARY_PERIODIC && r->boundary!=REB_BOUNDARY_SHEAR){
+                reb_error(r, "REB_GRAVITY_EWALD requires periodic or shear boundary conditions.");
+                for (int i=0; i<_N_real; i++){
+                    particles[i].ax = 0; 
+                    particles[i].ay = 0; 
+                    particles[i].az = 0; 
+                }
+                break;
             }
+            reb_calculate_acceleration_ewald(r);
+#endif // MPI
         }
         break;
         case REB_GRAVITY_MERCURIUS:
         {
-            double (*_L) (const struct reb_simulation* const r, double d, double dcrit) = r->ri_mercurius.L;
+            // The built-in switching functions are inlined, others are called through the pointer.
+            const enum REB_MERCURIUS_L L_type = reb_integrator_mercurius_L_type(r);
             switch (r->ri_mercurius.mode){
                 case 0: // WHFAST part
                 {
@@ -539,7 +826,7 @@ void reb_calculate_acceleration(struct reb_simulation* r){
                             const double dz = particles[i].z - particles[j].z;
                             const double _r = sqrt(dx*dx + dy*dy + dz*dz + softening2);
                             const double dcritmax = MAX(dcrit[i],dcrit[j]);
-                            const double L = _L(r,_r,dcritmax);
+                            const double L = reb_integrator_mercurius_L_eval(r,L_type,_r,dcritmax);
                             const double prefact = G*L/(_r*_r*_r);
                             const double prefactj = -prefact*particles[j].m;
                             const double prefacti = prefact*particles[i].m;
@@ -560,7 +847,7 @@ void reb_calculate_acceleration(struct reb_simulation* r){
                             const double dz = particles[i].z - particles[j].z;
                             const double _r = sqrt(dx*dx + dy*dy + dz*dz + softening2);
                             const double dcritmax = MAX(dcrit[i],dcrit[j]);
-                            const double L = _L(r,_r,dcritmax);
+                            const double L = reb_integrator_mercurius_L_eval(r,L_type,_r,dcritmax);
                             const double prefact = G*L/(_r*_r*_r);
                             const double prefactj = -prefact*particles[j].m;
                             particles[i].ax    += prefactj*dx;
@@ -590,7 +877,7 @@ void reb_calculate_acceleration(struct reb_simulation* r){
                             const double dz = particles[i].z - particles[j].z;
                             const double _r = sqrt(dx*dx + dy*dy + dz*dz + softening2);
                             const double dcritmax = MAX(dcrit[i],dcrit[j]);
-                            const double L = _L(r,_r,dcritmax);
+                            const double L = reb_integrator_mercurius_L_eval(r,L_type,_r,dcritmax);
                             const double prefact = -G*particles[j].m*L/(_r*_r*_r);
                             particles[i].ax    += prefact*dx;
                             particles[i].ay    += prefact*dy;
@@ -605,7 +892,7 @@ void reb_calculate_acceleration(struct reb_simulation* r){
                             const double dz = particles[i].z - particles[j].z;
                             const double _r = sqrt(dx*dx + dy*dy + dz*dz + softening2);
                             const double dcritmax = MAX(dcrit[i],dcrit[j]);
-                            const double L = _L(r,_r,dcritmax);
+                            const double L = reb_integrator_mercurius_L_eval(r,L_type,_r,dcritmax);
                             const double prefact = -G*particles[j].m*L/(_r*_r*_r);
                             particles[i].ax    += prefact*dx;
                             particles[i].ay    += prefact*dy;
@@ -623,6 +910,11 @@ void reb_calculate_acceleration(struct reb_simulation* r){
                     const int encounterN = r->ri_mercurius.encounterN;
                     const int encounterNactive = r->ri_mercurius.encounterNactive;
                     int* map = r->ri_mercurius.encounter_map;
+                    // If only test particles have encounters, the massive bodies are restored to 
+                    // their state after the Kepler step at the end of the encounter step. They only
+                    // move on Kepler orbits around the star in between and the forces between
+                    // massive bodies are not needed.
+                    const int encounterNactive_pairs = r->ri_mercurius.tponly_encounter?0:encounterNactive;
 #ifndef OPENMP
                     particles[0].ax = 0; // map[0] is always 0 
                     particles[0].ay = 0; 
@@ -642,7 +934,7 @@ void reb_calculate_acceleration(struct reb_simulation* r){
                     // We're in a heliocentric coordinate system.
                     // The star feels no acceleration
                     // Interactions between active-active
-                    for (int i=2; i<encounterNactive; i++){
+                    for (int i=2; i<encounterNactive_pairs; i++){
                         int mi = map[i];
                         for (int j=1; j<i; j++){
                             int mj = map[j];
@@ -651,7 +943,7 @@ void reb_calculate_acceleration(struct reb_simulation* r){
                             const double dz = particles[mi].z - particles[mj].z;
                             const double _r = sqrt(dx*dx + dy*dy + dz*dz + softening2);
                             const double dcritmax = MAX(dcrit[mi],dcrit[mj]);
-                            const double L = _L(r,_r,dcritmax);
+                            const double L = reb_integrator_mercurius_L_eval(r,L_type,_r,dcritmax);
                             double prefact = G*(1.-L)/(_r*_r*_r);
                             double prefactj = -prefact*particles[mj].m;
                             double prefacti = prefact*particles[mi].m;
@@ -674,7 +966,7 @@ void reb_calculate_acceleration(struct reb_simulation* r){
                             const double dz = particles[mi].z - particles[mj].z;
                             const double _r = sqrt(dx*dx + dy*dy + dz*dz + softening2);
                             const double dcritmax = MAX(dcrit[mi],dcrit[mj]);
-                            const double L = _L(r,_r,dcritmax);
+                            const double L = reb_integrator_mercurius_L_eval(r,L_type,_r,dcritmax);
                             double prefact = G*(1.-L)/(_r*_r*_r);
                             double prefactj = -prefact*particles[mj].m;
                             particles[mi].ax    += prefactj*dx;
@@ -709,6 +1001,7 @@ void reb_calculate_acceleration(struct reb_simulation* r){
                         particles[mi].ax    += prefact*x;
                         particles[mi].ay    += prefact*y;
                         particles[mi].az    += prefact*z;
+                        if (i<encounterNactive && i>=encounterNactive_pairs) continue;
                         for (int j=1; j<encounterNactive; j++){
                             if (i==j) continue;
                             int mj = map[j];
@@ -717,7 +1010,7 @@ void reb_calculate_acceleration(struct reb_simulation* r){
                             const double dz = z - particles[mj].z;
                             const double _r = sqrt(dx*dx + dy*dy + dz*dz + softening2);
                             const double dcritmax = MAX(dcrit[mi],dcrit[mj]);
-                            const double L = _L(r,_r,dcritmax);
+                            const double L = reb_integrator_mercurius_L_eval(r,L_type,_r,dcritmax);
                             double prefact = -G*particles[mj].m*(1.-L)/(_r*_r*_r);
                             particles[mi].ax    += prefact*dx;
                             particles[mi].ay    += prefact*dy;
@@ -738,7 +1031,7 @@ void reb_calculate_acceleration(struct reb_simulation* r){
                             const double dz = z - particles[mj].z;
                             const double _r = sqrt(dx*dx + dy*dy + dz*dz + softening2);
                             const double dcritmax = MAX(dcrit[mi],dcrit[mj]);
-                            const double L = _L(r,_r,dcritmax);
+                            const double L = reb_integrator_mercurius_L_eval(r,L_type,_r,dcritmax);
                             double prefact = -G*particles[mj].m*(1.-L)/(_r*_r*_r);
                             particles[mi].ax    += prefact*dx;
                             particles[mi].ay    += prefact*dy;
@@ -784,6 +1077,16 @@ void reb_calculate_acceleration_var(struct reb_simulation* r){
             }
         }
         case REB_GRAVITY_BASIC:
+            if (_testparticle_type){
+                for (int v=0;v<r->var_config_N;v++){
+                    if (r->var_config[v].order==2){
+                        reb_error(r,"testparticletype=1 not implemented for second order variational equations.");
+                        break;
+                    }
+                }
+            }
+            // Every variational configuration only writes to its own particles.
+#pragma omp parallel for schedule(dynamic)
             for (int v=0;v<r->var_config_N;v++){
                 struct reb_variational_configuration const vc = r->var_config[v];
                 if (vc.order==1){
@@ -879,10 +1182,15 @@ void reb_calculate_acceleration_var(struct reb_simulation* r){
                         }
                     }else{ //testparticle
                         int i = vc.testparticle;
-                        particles_var1[0].ax = 0.; 
-                        particles_var1[0].ay = 0.; 
-                        particles_var1[0].az = 0.; 
-                        for (int j=0; j<_N_real; j++){
+                        const double ddx = particles_var1[0].x;
+                        const double ddy = particles_var1[0].y;
+                        const double ddz = particles_var1[0].z;
+                        double ax = 0.; 
+                        double ay = 0.; 
+                        double az = 0.; 
+                        // Same sources as in reb_calculate_acceleration(): test particles only feel active particles
+                        const int j1 = (_testparticle_type && i<_N_active)?_N_real:_N_active;
+                        for (int j=0; j<j1; j++){
                             if (i==j) continue;
                             if (_gravity_ignore_terms==1 && ((j==1 && i==0) || (i==1 && j==0))) continue;
                             if (_gravity_ignore_terms==2 && ((j==0 || i==0))) continue;
@@ -893,9 +1201,6 @@ void reb_calculate_acceleration_var(struct reb_simulation* r){
                             const double _r  = sqrt(r2);
                             const double r3inv = 1./(r2*_r);
                             const double r5inv = 3.*r3inv/r2;
-                            const double ddx = particles_var1[0].x;
-                            const double ddy = particles_var1[0].y;
-                            const double ddz = particles_var1[0].z;
                             const double Gmj = G * particles[j].m;
 
                             // Variational equations
@@ -911,16 +1216,16 @@ void reb_calculate_acceleration_var(struct reb_simulation* r){
 
                             // No variational mass contributions for test particles!
 
-                            particles_var1[0].ax += Gmj * dax;
-                            particles_var1[0].ay += Gmj * day;
-                            particles_var1[0].az += Gmj * daz;
+                            ax += Gmj * dax;
+                            ay += Gmj * day;
+                            az += Gmj * daz;
 
                         }
+                        particles_var1[0].ax = ax; 
+                        particles_var1[0].ay = ay; 
+                        particles_var1[0].az = az; 
                     }
                 }else if (vc.order==2){
-                    if (_testparticle_type){
-                        reb_error(r,"testparticletype=1 not implemented for second order variational equations.");
-                    }
                     //////////////////
                     /// 2nd order  ///
                     //////////////////
@@ -1024,10 +1329,22 @@ void reb_calculate_acceleration_var(struct reb_simulation* r){
                         }
                     }else{ //testparticle
                         int i = vc.testparticle;
-                        particles_var2[0].ax = 0.; 
-                        particles_var2[0].ay = 0.; 
-                        particles_var2[0].az = 0.; 
-                        for (int j=0; j<_N_real; j++){
+                        const double ddx = particles_var2[0].x;
+                        const double ddy = particles_var2[0].y;
+                        const double ddz = particles_var2[0].z;
+                        const double dk1dx = particles_var1a[0].x;
+                        const double dk1dy = particles_var1a[0].y;
+                        const double dk1dz = particles_var1a[0].z;
+                        const double dk2dx = particles_var1b[0].x;
+                        const double dk2dy = particles_var1b[0].y;
+                        const double dk2dz = particles_var1b[0].z;
+                        const double dk1dk2 =  dk1dx*dk2dx + dk1dy*dk2dy + dk1dz*dk2dz;
+                        double ax = 0.; 
+                        double ay = 0.; 
+                        double az = 0.; 
+                        // Same sources as in reb_calculate_acceleration(): test particles only feel active particles
+                        const int j1 = (_testparticle_type && i<_N_active)?_N_real:_N_active;
+                        for (int j=0; j<j1; j++){
                             if (i==j) continue;
                             // TODO: Need to implement WH skipping
                             //if (_gravity_ignore_terms==1 && ((j==1 && i==0) || (i==1 && j==0))) continue;
@@ -1040,9 +1357,6 @@ void reb_calculate_acceleration_var(struct reb_simulation* r){
                             const double r3inv = 1./(r2*r);
                             const double r5inv = r3inv/r2;
                             const double r7inv = r5inv/r2;
-                            const double ddx = particles_var2[0].x;
-                            const double ddy = particles_var2[0].y;
-                            const double ddz = particles_var2[0].z;
                             const double Gmj = G * particles[j].m;
                             
                             // Variational equations
@@ -1058,16 +1372,8 @@ void reb_calculate_acceleration_var(struct reb_simulation* r){
                                        + ddz * ( 3.*dz*dz*r5inv - r3inv );
                             
                             // delta^(1) delta^(1) terms
-                            const double dk1dx = particles_var1a[0].x;
-                            const double dk1dy = particles_var1a[0].y;
-                            const double dk1dz = particles_var1a[0].z;
-                            const double dk2dx = particles_var1b[0].x;
-                            const double dk2dy = particles_var1b[0].y;
-                            const double dk2dz = particles_var1b[0].z;
-
                             const double rdk1 =  dx*dk1dx + dy*dk1dy + dz*dk1dz;
                             const double rdk2 =  dx*dk2dx + dy*dk2dy + dz*dk2dz;
-                            const double dk1dk2 =  dk1dx*dk2dx + dk1dy*dk2dy + dk1dz*dk2dz;
                             dax     +=        3.* r5inv * dk2dx * rdk1
                                     + 3.* r5inv * dk1dx * rdk2
                                     + 3.* r5inv    * dx * dk1dk2  
@@ -1083,10 +1389,13 @@ void reb_calculate_acceleration_var(struct reb_simulation* r){
                             
                             // No variational mass contributions for test particles!
 
-                            particles_var2[0].ax += Gmj * dax; 
-                            particles_var2[0].ay += Gmj * day;
-                            particles_var2[0].az += Gmj * daz;
+                            ax += Gmj * dax; 
+                            ay += Gmj * day;
+                            az += Gmj * daz;
                         }
+                        particles_var2[0].ax = ax; 
+                        particles_var2[0].ay = ay; 
+                        particles_var2[0].az = az; 
                     }
                 }
             }
@@ -1193,34 +1502,155 @@ void reb_calculate_and_apply_jerk(struct reb_simulation* r, const double v){
   * @param pt Index of the particle the force is calculated for.
   * @param node Pointer to the cell the force is calculated from.
   * @param gb Ghostbox plus position of the particle (precalculated). 
+  * @return Number of cells and particles the force has been calculated from.
   */
-static void reb_calculate_acceleration_for_particle_from_cell(const struct reb_simulation* const r, const int pt, const struct reb_treecell *node, const struct reb_ghostbox gb);
+static int reb_calculate_acceleration_for_particle_from_cell(const struct reb_simulation* const r, const int pt, const struct reb_treecell *node, const struct reb_ghostbox gb);
 
-static void reb_calculate_acceleration_for_particle(const struct reb_simulation* const r, const int pt, const struct reb_ghostbox gb) {
-    for(int i=0;i<r->root_n;i++){
-        struct reb_treecell* node = r->tree_root[i];
-        if (node!=NULL){
-            reb_calculate_acceleration_for_particle_from_cell(r, pt, node, gb);
+// Returns 1 if root box i is owned by MPI node root_proc or if root_proc is negative.
+static int reb_gravity_tree_root_included(const struct reb_simulation* const r, const int i, const int root_proc){
+    if (root_proc<0) return 1;
+#ifdef MPI
+    return reb_communication_mpi_rootbox_owner(r, i)==root_proc;
+#else // MPI
+    return 1;
+#endif // MPI
+}
+
+#ifdef OPENMP
+// Chunks per thread. Costs change from one step to the next, the remaining imbalance is evened out by dynamic scheduling.
+#define REB_GRAVITY_TREE_CHUNKS_PER_THREAD 8
+
+static int* reb_gravity_tree_chunks(struct reb_simulation* const r, const int N_groups, int* const chunks_N){
+    const int N = r->N;
+    const int valid = r->gravity_tree_cost_N==N;
+    if (!valid){
+        r->gravity_tree_cost = realloc(r->gravity_tree_cost, sizeof(int)*N);
+        r->gravity_tree_cost_N = N;
+    }
+    int* const cost = r->gravity_tree_cost;
+    int K = REB_GRAVITY_TREE_CHUNKS_PER_THREAD*omp_get_max_threads();
+    if (K>N-N_groups){
+        K = N-N_groups>0?N-N_groups:1;
+    }
+    int* const chunks = malloc(sizeof(int)*(K+1));
+    double total = 0.;
+    if (valid){
+        for (int i=N_groups; i<N; i++){
+            total += cost[i];
+        }
+    }
+    if (total>0.){
+        // Cut where the cumulative cost crosses multiples of total/K.
+        double sum = 0.;
+        int k = 1;
+        chunks[0] = N_groups;
+        for (int i=N_groups; i<N && k<K; i++){
+            sum += cost[i];
+            while (k<K && sum>=total*k/K){
+                chunks[k++] = i+1;
+            }
+        }
+        while (k<K){
+            chunks[k++] = N;
+        }
+    }else{
+        for (int k=0; k<K; k++){
+            chunks[k] = N_groups+(int)((long)(N-N_groups)*k/K);
         }
     }
+    chunks[K] = N;
+    memset(cost, 0, sizeof(int)*N);
+    *chunks_N = K;
+    return chunks;
 }
+#endif // OPENMP
 
-static void reb_calculate_acceleration_for_particle_from_cell(const struct reb_simulation* r, const int pt, const struct reb_treecell *node, const struct reb_ghostbox gb) {
-    const double G = r->G;
-    const double softening2 = r->softening*r->softening;
+static void reb_calculate_acceleration_tree(struct reb_simulation* const r, const int N_groups, const int root_proc, const int* const chunks, const int chunks_N){
     struct reb_particle* const particles = r->particles;
-    const double dx = gb.shiftx - node->mx;
-    const double dy = gb.shifty - node->my;
-    const double dz = gb.shiftz - node->mz;
-    const double r2 = dx*dx + dy*dy + dz*dz;
-    if ( node->pt < 0 ) { // Not a leaf
-        if ( node->w*node->w > r->opening_angle2*r2 ){
-            for (int o=0; o<8; o++) {
-                if (node->oct[o] != NULL) {
-                    reb_calculate_acceleration_for_particle_from_cell(r, pt, node->oct[o], gb);
-                }
-            }
-        } else {
+    // Distant root boxes and their images in the ghost boxes interact through local expansions.
+    struct reb_gravity_tree_far ff = {0};
+    if (r->gravity_tree_far_field){
+        reb_gravity_tree_far_init(r, &ff);
+    }
+    // Summing over all Ghost Boxes
+    const struct reb_ghostbox* const ghostboxes = reb_boundary_ghostboxes(r);
+    for (int gbx=-r->nghostx; gbx<=r->nghostx; gbx++){
+    for (int gby=-r->nghosty; gby<=r->nghosty; gby++){
+    for (int gbz=-r->nghostz; gbz<=r->nghostz; gbz++){
+        const struct reb_ghostbox gborig = ghostboxes[reb_boundary_ghostbox_index(r, gbx,gby,gbz)];
+        if (ff.far){
+            reb_gravity_tree_far_ghostbox(r, &ff, gborig, root_proc);
+        }
+        if (N_groups){
+            reb_calculate_acceleration_for_groups(r, gborig, root_proc, &ff);
+        }
+        // Summing over all particle pairs
+#ifdef OPENMP
+        int* const cost = r->gravity_tree_cost;
+#pragma omp parallel for schedule(dynamic,1)
+        for (int c=0; c<chunks_N; c++){
+        for (int i=chunks[c]; i<chunks[c+1]; i++){
+            struct reb_ghostbox gb = gborig;
+            // Precalculated shifted position
+            gb.shiftx += particles[i].x;
+            gb.shifty += particles[i].y;
+            gb.shiftz += particles[i].z;
+            cost[i] += reb_calculate_acceleration_for_particle(r, i, gb, root_proc, ff.far?ff.far+(size_t)ff.rootbox[i]*r->root_n:NULL);
+        }
+        }
+#else // OPENMP
+        const int N = r->N;
+        for (int i=N_groups; i<N; i++){
+            if (reb_sigint){
+                reb_gravity_tree_far_free(&ff);
+                return;
+            }
+            struct reb_ghostbox gb = gborig;
+            // Precalculated shifted position
+            gb.shiftx += particles[i].x;
+            gb.shifty += particles[i].y;
+            gb.shiftz += particles[i].z;
+            reb_calculate_acceleration_for_particle(r, i, gb, root_proc, ff.far?ff.far+(size_t)ff.rootbox[i]*r->root_n:NULL);
+        }
+#endif // OPENMP
+    }
+    }
+    }
+    if (ff.far){
+        reb_gravity_tree_far_apply(r, &ff);
+        reb_gravity_tree_far_free(&ff);
+    }
+}
+
+static int reb_calculate_acceleration_for_particle(const struct reb_simulation* const r, const int pt, const struct reb_ghostbox gb, const int root_proc, const char* const far) {
+    int interactions = 0;
+    for(int i=0;i<r->root_n;i++){
+        struct reb_treecell* node = r->tree_root[i];
+        if (node!=NULL && reb_gravity_tree_root_included(r, i, root_proc) && !(far && far[i])){
+            interactions += reb_calculate_acceleration_for_particle_from_cell(r, pt, node, gb);
+        }
+    }
+    return interactions;
+}
+
+static int reb_calculate_acceleration_for_particle_from_cell(const struct reb_simulation* r, const int pt, const struct reb_treecell *node, const struct reb_ghostbox gb) {
+    const double G = r->G;
+    const double softening2 = r->softening*r->softening;
+    struct reb_particle* const particles = r->particles;
+    const double dx = gb.shiftx - node->mx;
+    const double dy = gb.shifty - node->my;
+    const double dz = gb.shiftz - node->mz;
+    const double r2 = dx*dx + dy*dy + dz*dz;
+    if ( node->pt < 0 ) { // Not a leaf
+        if ( node->w*node->w > r->opening_angle2*r2 ){
+            int interactions = 0;
+            for (int o=0; o<8; o++) {
+                if (node->oct[o] != NULL) {
+                    interactions += reb_calculate_acceleration_for_particle_from_cell(r, pt, node->oct[o], gb);
+                }
+            }
+            return interactions;
+        } else {
             double _r = sqrt(r2 + softening2);
             double prefact = -G/(_r*_r*_r)*node->m;
 #ifdef QUADRUPOLE
@@ -1241,12 +1671,1810 @@ static void reb_calculate_acceleration_for_particle_from_cell(const struct reb_s
 #endif
         }
     } else { // It's a leaf node
-        if (node->remote == 0 && node->pt == pt) return;
+        if (node->remote == 0 && node->pt == pt) return 0;
         double _r = sqrt(r2 + softening2);
         double prefact = -G/(_r*_r*_r)*node->m;
         particles[pt].ax += prefact*dx; 
         particles[pt].ay += prefact*dy; 
         particles[pt].az += prefact*dz; 
     }
+    return 1;
+}
+
+
+/**
+ * @brief List of point masses (and cells with quadrupole moments) shared by all particles in a group.
+ */
+struct reb_gravity_tree_list {
+    int N;              ///< Number of point masses
+    int allocatedN;
+    double* x;          ///< Positions and masses of point masses, 4 arrays of length allocatedN
+    double* y;
+    double* z;
+    double* m;
+#ifdef QUADRUPOLE
+    int Nq;             ///< Number of cells with quadrupole moments
+    int allocatedNq;
+    double* q;          ///< 10 values (x, y, z, m, mxx, mxy, mxz, myy, myz, mzz) per cell
+#endif // QUADRUPOLE
+};
+
+static void reb_gravity_tree_list_add(struct reb_gravity_tree_list* const l, const struct reb_treecell* const node){
+    if (l->N>=l->allocatedN){
+        l->allocatedN = l->allocatedN ? l->allocatedN*2 : 128;
+        l->x = realloc(l->x, sizeof(double)*l->allocatedN);
+        l->y = realloc(l->y, sizeof(double)*l->allocatedN);
+        l->z = realloc(l->z, sizeof(double)*l->allocatedN);
+        l->m = realloc(l->m, sizeof(double)*l->allocatedN);
+    }
+    l->x[l->N] = node->mx;
+    l->y[l->N] = node->my;
+    l->z[l->N] = node->mz;
+    l->m[l->N] = node->m;
+    l->N++;
+}
+
+/**
+ * @brief Walks the tree and adds all cells and particles which the particles in a group interact with to the list.
+ * @details A cell is opened if the opening criterion is not fulfilled for the point of the group's 
+ * bounding box which is closest to the cell's center of mass. The group itself is skipped.
+ */
+static void reb_gravity_tree_walk_for_group(const struct reb_simulation* const r, const struct reb_treecell* const node, const struct reb_treecell* const group, const double bmin[3], const double bmax[3], struct reb_gravity_tree_list* const l){
+    if (node==group || node->m==0){
+        return;
+    }
+    if (node->pt<0){ // Not a leaf
+        const double c[3] = {node->mx, node->my, node->mz};
+        double d2 = 0.;
+        for (int k=0;k<3;k++){
+            const double d = c[k]<bmin[k] ? bmin[k]-c[k] : (c[k]>bmax[k] ? c[k]-bmax[k] : 0.);
+            d2 += d*d;
+        }
+        if (node->w*node->w > r->opening_angle2*d2){
+            for (int o=0; o<8; o++){
+                if (node->oct[o] != NULL){
+                    reb_gravity_tree_walk_for_group(r, node->oct[o], group, bmin, bmax, l);
+                }
+            }
+            return;
+        }
+#ifdef QUADRUPOLE
+        if (l->Nq>=l->allocatedNq){
+            l->allocatedNq = l->allocatedNq ? l->allocatedNq*2 : 128;
+            l->q = realloc(l->q, sizeof(double)*10*l->allocatedNq);
+        }
+        double* const q = l->q+10*l->Nq;
+        q[0] = node->mx; q[1] = node->my; q[2] = node->mz; q[3] = node->m;
+        q[4] = node->mxx; q[5] = node->mxy; q[6] = node->mxz; q[7] = node->myy; q[8] = node->myz; q[9] = node->mzz;
+        l->Nq++;
+        return;
+#endif // QUADRUPOLE
+    }
+    reb_gravity_tree_list_add(l, node);
+}
+
+static void reb_gravity_tree_collect_groups(const struct reb_simulation* const r, struct reb_treecell* const node, struct reb_treecell*** groups, int* N_groups, int* allocatedN_groups){
+    const int N = node->pt>=0 ? 1 : -node->pt;
+    if (N<=r->tree_group_size){
+        if (*N_groups>=*allocatedN_groups){
+            *allocatedN_groups = *allocatedN_groups ? *allocatedN_groups*2 : 128;
+            *groups = realloc(*groups, sizeof(struct reb_treecell*)*(*allocatedN_groups));
+        }
+        (*groups)[*N_groups] = node;
+        (*N_groups)++;
+        return;
+    }
+    for (int o=0; o<8; o++){
+        if (node->oct[o] != NULL){
+            reb_gravity_tree_collect_groups(r, node->oct[o], groups, N_groups, allocatedN_groups);
+        }
+    }
+}
+
+static void reb_gravity_tree_collect_particles(const struct reb_treecell* const node, int* const indices, int* const N){
+    if (node->pt>=0){
+        indices[(*N)++] = node->pt;
+        return;
+    }
+    for (int o=0; o<8; o++){
+        if (node->oct[o] != NULL){
+            reb_gravity_tree_collect_particles(node->oct[o], indices, N);
+        }
+    }
+}
+
+static void reb_calculate_acceleration_for_groups(struct reb_simulation* const r, const struct reb_ghostbox gb, const int root_proc, const struct reb_gravity_tree_far* const ff){
+    struct reb_particle* const particles = r->particles;
+    const double G = r->G;
+    const double softening2 = r->softening*r->softening;
+    // Find groups
+    struct reb_treecell** groups = NULL;
+    int N_groups = 0;
+    int allocatedN_groups = 0;
+    for (int i=0;i<r->root_n;i++){
+#ifdef MPI
+        if (reb_communication_mpi_rootbox_is_local(r, i)==0) continue;
+#endif // MPI
+        if (r->tree_root[i]!=NULL){
+            reb_gravity_tree_collect_groups(r, r->tree_root[i], &groups, &N_groups, &allocatedN_groups);
+        }
+    }
+    int* offset = malloc(sizeof(int)*(N_groups+1));
+    offset[0] = 0;
+    for (int g=0; g<N_groups; g++){
+        offset[g+1] = offset[g] + (groups[g]->pt>=0 ? 1 : -groups[g]->pt);
+    }
+    int* indices = malloc(sizeof(int)*(offset[N_groups]+1));
+#ifdef MPI
+    const int group_self = root_proc<0 || root_proc==r->mpi_id;
+#else // MPI
+    const int group_self = 1;
+#endif // MPI
+#pragma omp parallel for schedule(guided)
+    for (int g=0; g<N_groups; g++){
+        int n = 0;
+        reb_gravity_tree_collect_particles(groups[g], indices+offset[g], &n);
+    }
+
+#pragma omp parallel
+    {
+    struct reb_gravity_tree_list l = {0};
+#pragma omp for schedule(guided)
+    for (int g=0; g<N_groups; g++){
+        const int* const gi = indices+offset[g];
+        const int gN = offset[g+1]-offset[g];
+        // All particles of a group are in the same root box T.
+        const int T = ff->far ? ff->rootbox[gi[0]] : 0;
+        const char* const far = ff->far ? ff->far+(size_t)T*r->root_n : NULL;
+        // If T is distant from its own image, the group is included in the local expansion.
+        const int gN_self = (group_self && !(far && far[T])) ? gN : 0;
+        // Bounding box of the group, shifted to the ghost box
+        double bmin[3] = {INFINITY, INFINITY, INFINITY};
+        double bmax[3] = {-INFINITY, -INFINITY, -INFINITY};
+        for (int k=0; k<gN; k++){
+            const struct reb_particle p = particles[gi[k]];
+            const double q[3] = {p.x+gb.shiftx, p.y+gb.shifty, p.z+gb.shiftz};
+            for (int d=0; d<3; d++){
+                if (q[d]<bmin[d]) bmin[d] = q[d];
+                if (q[d]>bmax[d]) bmax[d] = q[d];
+            }
+        }
+        l.N = 0;
+#ifdef QUADRUPOLE
+        l.Nq = 0;
+#endif // QUADRUPOLE
+        for (int i=0;i<r->root_n;i++){
+            struct reb_treecell* node = r->tree_root[i];
+            if (node!=NULL && reb_gravity_tree_root_included(r, i, root_proc) && !(far && far[i])){
+                reb_gravity_tree_walk_for_group(r, node, groups[g], bmin, bmax, &l);
+            }
+        }
+        const double* const lx = l.x;
+        const double* const ly = l.y;
+        const double* const lz = l.z;
+        const double* const lm = l.m;
+        const int lN = l.N;
+        for (int k=0; k<gN; k++){
+            const int i = gi[k];
+            const double px = particles[i].x + gb.shiftx;
+            const double py = particles[i].y + gb.shifty;
+            const double pz = particles[i].z + gb.shiftz;
+            double ax = 0.;
+            double ay = 0.;
+            double az = 0.;
+            // Cells and particles outside of the group
+            for (int j=0; j<lN; j++){
+                const double dx = px - lx[j];
+                const double dy = py - ly[j];
+                const double dz = pz - lz[j];
+                const double _r = sqrt(dx*dx + dy*dy + dz*dz + softening2);
+                const double prefact = -G/(_r*_r*_r)*lm[j];
+                ax += prefact*dx;
+                ay += prefact*dy;
+                az += prefact*dz;
+            }
+#ifdef QUADRUPOLE
+            for (int j=0; j<l.Nq; j++){
+                const double* const q = l.q+10*j;
+                const double dx = px - q[0];
+                const double dy = py - q[1];
+                const double dz = pz - q[2];
+                const double r2 = dx*dx + dy*dy + dz*dz;
+                const double _r = sqrt(r2 + softening2);
+                const double prefact = -G/(_r*_r*_r)*q[3];
+                double qprefact = G/(_r*_r*_r*_r*_r);
+                ax += qprefact*(dx*q[4] + dy*q[5] + dz*q[6]); 
+                ay += qprefact*(dx*q[5] + dy*q[7] + dz*q[8]); 
+                az += qprefact*(dx*q[6] + dy*q[8] + dz*q[9]); 
+                const double mrr = dx*dx*q[4] + dy*dy*q[7] + dz*dz*q[9]
+                        + 2.*dx*dy*q[5] + 2.*dx*dz*q[6] + 2.*dy*dz*q[8]; 
+                qprefact *= -5.0/(2.0*_r*_r)*mrr;
+                ax += (qprefact + prefact) * dx; 
+                ay += (qprefact + prefact) * dy; 
+                az += (qprefact + prefact) * dz; 
+            }
+#endif // QUADRUPOLE
+            // Other particles in the group (they are in a local root box)
+            for (int kj=0; kj<gN_self; kj++){
+                const int j = gi[kj];
+                if (j==i) continue;
+                const double dx = px - particles[j].x;
+                const double dy = py - particles[j].y;
+                const double dz = pz - particles[j].z;
+                const double _r = sqrt(dx*dx + dy*dy + dz*dz + softening2);
+                const double prefact = -G/(_r*_r*_r)*particles[j].m;
+                ax += prefact*dx;
+                ay += prefact*dy;
+                az += prefact*dz;
+            }
+            particles[i].ax += ax;
+            particles[i].ay += ay;
+            particles[i].az += az;
+        }
+    }
+    free(l.x);
+    free(l.y);
+    free(l.z);
+    free(l.m);
+#ifdef QUADRUPOLE
+    free(l.q);
+#endif // QUADRUPOLE
+    }
+    free(indices);
+    free(offset);
+    free(groups);
+}
+
+// Helper routines for REB_GRAVITY_FMM and the far field of REB_GRAVITY_TREE
+//
+// The multipole expansion of a cell with center c is M_n = sum_j m_j (c-x_j)^n / n! and 
+// the local expansion of a cell with center c is L_n with Phi(c+u) = sum_n L_n u^n / n!, 
+// for all multi-indices n=(nx,ny,nz) with |n|=nx+ny+nz<=gravity_fmm_order. Cells are 
+// expanded about their geometric centers. Cells with at most REB_GRAVITY_FMM_BUCKET_SIZE 
+// particles (buckets) interact directly with each other if they are not well separated. 
+// Leaves (single particles) and cells within buckets have no expansions.
+// REB_GRAVITY_FMM is not available with MPI, only the tables and the M2L and P2L kernels are.
+
+#define REB_GRAVITY_FMM_MAX_ORDER 12
+#define REB_GRAVITY_FMM_TARGET_DEPTH 2  ///< Depth of the target cells which are distributed among threads.
+#define REB_GRAVITY_FMM_BUCKET_SIZE 32
+
+/**
+ * @brief Multi-index tables for Cartesian expansions up to a given order.
+ * @details Coefficients are ordered by |n|. Missing multi-indices are marked with -1.
+ */
+struct reb_fmm_tables {
+    int order;
+    int N;              ///< Number of coefficients
+    int* n;             ///< Multi-index, 3 per coefficient
+    int* degree;        ///< |n|
+    int* prev;          ///< Index of n-e_d, where d is the first dimension with n_d>0
+    int* prev_dim;      ///< The dimension d
+    int* m1;            ///< Indices of n-e_i, 3 per coefficient
+    int* m2;            ///< Indices of n-2e_i, 3 per coefficient
+    int* p1;            ///< Indices of n+e_i, 3 per coefficient
+    int N_pairs;
+    int* pairs;         ///< (a, b, a-b) for all multi-indices b<=a
+    int N_m2l;
+    int* m2l;           ///< (k, l, k+l) for all multi-indices with |k|+|l|<=order
+};
+
+struct reb_fmm {
+    struct reb_particle* particles;
+    const struct reb_fmm_tables* t;
+    double G;
+    double softening2;
+    double opening_angle2;
+    struct reb_ghostbox gb;
+};
+
+static void reb_fmm_tables_init(struct reb_fmm_tables* const t, const int order){
+    const int p1 = order+1;
+    int* index = malloc(sizeof(int)*p1*p1*p1);
+    t->order = order;
+    t->N = (order+1)*(order+2)*(order+3)/6;
+    t->n = malloc(sizeof(int)*3*t->N);
+    t->degree = malloc(sizeof(int)*t->N);
+    int c = 0;
+    for (int s=0; s<=order; s++){
+        for (int nx=s; nx>=0; nx--){
+            for (int ny=s-nx; ny>=0; ny--){
+                const int nz = s-nx-ny;
+                t->n[3*c+0] = nx;
+                t->n[3*c+1] = ny;
+                t->n[3*c+2] = nz;
+                t->degree[c] = s;
+                index[(nx*p1+ny)*p1+nz] = c;
+                c++;
+            }
+        }
+    }
+    t->prev = malloc(sizeof(int)*t->N);
+    t->prev_dim = malloc(sizeof(int)*t->N);
+    t->m1 = malloc(sizeof(int)*3*t->N);
+    t->m2 = malloc(sizeof(int)*3*t->N);
+    t->p1 = malloc(sizeof(int)*3*t->N);
+    t->prev[0] = -1;
+    t->prev_dim[0] = -1;
+    for (c=0; c<t->N; c++){
+        const int* n = t->n+3*c;
+        for (int i=0; i<3; i++){
+            int m[3] = {n[0], n[1], n[2]};
+            m[i] -= 1;
+            t->m1[3*c+i] = m[i]>=0 ? index[(m[0]*p1+m[1])*p1+m[2]] : -1;
+            m[i] -= 1;
+            t->m2[3*c+i] = m[i]>=0 ? index[(m[0]*p1+m[1])*p1+m[2]] : -1;
+            m[i] += 3;
+            t->p1[3*c+i] = t->degree[c]<order ? index[(m[0]*p1+m[1])*p1+m[2]] : -1;
+        }
+        if (c>0){
+            const int d = n[0]>0 ? 0 : (n[1]>0 ? 1 : 2);
+            t->prev[c] = t->m1[3*c+d];
+            t->prev_dim[c] = d;
+        }
+    }
+    t->N_pairs = 0;
+    t->N_m2l = 0;
+    t->pairs = NULL;
+    t->m2l = NULL;
+    int allocatedN_pairs = 0;
+    int allocatedN_m2l = 0;
+    for (int a=0; a<t->N; a++){
+        const int* na = t->n+3*a;
+        for (int b=0; b<t->N; b++){
+            const int* nb = t->n+3*b;
+            if (nb[0]<=na[0] && nb[1]<=na[1] && nb[2]<=na[2]){
+                if (t->N_pairs>=allocatedN_pairs){
+                    allocatedN_pairs = allocatedN_pairs ? allocatedN_pairs*2 : 128;
+                    t->pairs = realloc(t->pairs, sizeof(int)*3*allocatedN_pairs);
+                }
+                t->pairs[3*t->N_pairs+0] = a;
+                t->pairs[3*t->N_pairs+1] = b;
+                t->pairs[3*t->N_pairs+2] = index[((na[0]-nb[0])*p1+na[1]-nb[1])*p1+na[2]-nb[2]];
+                t->N_pairs++;
+            }
+            if (t->degree[a]+t->degree[b]<=order){
+                if (t->N_m2l>=allocatedN_m2l){
+                    allocatedN_m2l = allocatedN_m2l ? allocatedN_m2l*2 : 128;
+                    t->m2l = realloc(t->m2l, sizeof(int)*3*allocatedN_m2l);
+                }
+                t->m2l[3*t->N_m2l+0] = a;
+                t->m2l[3*t->N_m2l+1] = b;
+                t->m2l[3*t->N_m2l+2] = index[((na[0]+nb[0])*p1+na[1]+nb[1])*p1+na[2]+nb[2]];
+                t->N_m2l++;
+            }
+        }
+    }
+    free(index);
+}
+
+static void reb_fmm_tables_free(struct reb_fmm_tables* const t){
+    free(t->n);
+    free(t->degree);
+    free(t->prev);
+    free(t->prev_dim);
+    free(t->m1);
+    free(t->m2);
+    free(t->p1);
+    free(t->pairs);
+    free(t->m2l);
+}
+
+/**
+ * @brief Calculates v^n/n! for all multi-indices n.
+ */
+static void reb_fmm_powers(const struct reb_fmm_tables* const t, const double v[3], double* const w){
+    w[0] = 1.;
+    for (int c=1; c<t->N; c++){
+        const int d = t->prev_dim[c];
+        w[c] = w[t->prev[c]]*v[d]/t->n[3*c+d];
+    }
+}
+
+/**
+ * @brief Calculates the derivatives D^n (1/|R|) for all multi-indices n.
+ * @details Uses the recurrence |n| R^2 T_n = -(2|n|-1) sum_i n_i R_i T_{n-e_i} - (|n|-1) sum_i n_i (n_i-1) T_{n-2e_i}.
+ */
+static void reb_fmm_derivatives(const struct reb_fmm_tables* const t, const double R[3], double* const T){
+    const double R2 = R[0]*R[0] + R[1]*R[1] + R[2]*R[2];
+    const double _R2 = 1./R2;
+    T[0] = sqrt(_R2);
+    for (int c=1; c<t->N; c++){
+        const int* n = t->n+3*c;
+        const int s = t->degree[c];
+        double s1 = 0.;
+        double s2 = 0.;
+        for (int i=0; i<3; i++){
+            if (n[i]>0){
+                s1 += n[i]*R[i]*T[t->m1[3*c+i]];
+                if (n[i]>1){
+                    s2 += n[i]*(n[i]-1)*T[t->m2[3*c+i]];
+                }
+            }
+        }
+        T[c] = -((2*s-1)*s1 + (s-1)*s2)*_R2/s;
+    }
+}
+
+#if !defined(MPI) || defined(QUADRUPOLE) // Used by REB_GRAVITY_FMM and the quadrupole far field of REB_GRAVITY_TREE
+static void reb_fmm_m2l(const struct reb_fmm* const f, const double R[3], const double* const M, double* const L){
+    const struct reb_fmm_tables* const t = f->t;
+    double T[t->N];
+    reb_fmm_derivatives(t, R, T);
+    const int* const m2l = t->m2l;
+    for (int i=0; i<t->N_m2l; i++){
+        L[m2l[3*i]] -= f->G*T[m2l[3*i+2]]*M[m2l[3*i+1]];
+    }
+}
+#endif // !MPI || QUADRUPOLE
+
+static void reb_fmm_p2l(const struct reb_fmm* const f, const double R[3], const double m, double* const L){
+    const struct reb_fmm_tables* const t = f->t;
+    double T[t->N];
+    reb_fmm_derivatives(t, R, T);
+    for (int k=0; k<t->N; k++){
+        L[k] -= f->G*m*T[k];
+    }
+}
+
+/**
+ * @brief Returns gravity_fmm_order, clamped to the supported range.
+ */
+static int reb_fmm_order(struct reb_simulation* const r){
+    int order = r->gravity_fmm_order;
+    if (order<1 || order>REB_GRAVITY_FMM_MAX_ORDER){
+        order = order<1 ? 1 : REB_GRAVITY_FMM_MAX_ORDER;
+        reb_warning(r, "gravity_fmm_order is out of range. Using the closest supported order instead.");
+        r->gravity_fmm_order = order;
+    }
+    return order;
+}
+
+/**
+ * @brief Geometric center of the root box with index i.
+ */
+static void reb_gravity_tree_root_center(const struct reb_simulation* const r, const int i, double c[3]){
+    const int ix = i%r->root_nx;
+    const int iy = (i/r->root_nx)%r->root_ny;
+    const int iz = i/(r->root_nx*r->root_ny);
+    c[0] = -r->boxsize.x/2.+r->root_size*(0.5+(double)ix);
+    c[1] = -r->boxsize.y/2.+r->root_size*(0.5+(double)iy);
+    c[2] = -r->boxsize.z/2.+r->root_size*(0.5+(double)iz);
+}
+
+static void reb_gravity_tree_far_init(struct reb_simulation* const r, struct reb_gravity_tree_far* const ff){
+    const int N = r->N;
+    const int root_n = r->root_n;
+    ff->t = malloc(sizeof(struct reb_fmm_tables));
+    reb_fmm_tables_init(ff->t, reb_fmm_order(r));
+    ff->rootbox = malloc(sizeof(int)*N);
+    ff->targets = malloc(sizeof(int)*root_n);
+    for (int i=0; i<root_n; i++){
+        ff->targets[i] = -1;
+    }
+    int N_targets = 0;
+    for (int i=0; i<N; i++){
+        const int T = reb_get_rootbox_for_particle(r, r->particles[i]);
+        ff->rootbox[i] = T;
+        if (ff->targets[T]<0){
+            ff->targets[T] = N_targets++;
+        }
+    }
+    ff->L = calloc((size_t)N_targets*ff->t->N, sizeof(double));
+    ff->far = malloc((size_t)root_n*root_n);
 }
 
+static void reb_gravity_tree_far_ghostbox(const struct reb_simulation* const r, struct reb_gravity_tree_far* const ff, const struct reb_ghostbox gb, const int root_proc){
+    const int root_n = r->root_n;
+    const struct reb_fmm f = {
+        .t = ff->t,
+        .G = r->G,
+    };
+    // Maximum distance of a particle from the center of its root box
+    const double h = 0.5*sqrt(3.)*r->root_size;
+    memset(ff->far, 0, (size_t)root_n*root_n);
+#pragma omp parallel for schedule(guided)
+    for (int T=0; T<root_n; T++){
+        if (ff->targets[T]<0) continue;
+        double* const L = ff->L+(size_t)ff->targets[T]*ff->t->N;
+        char* const far = ff->far+(size_t)T*root_n;
+        double c[3];
+        reb_gravity_tree_root_center(r, T, c);
+        c[0] += gb.shiftx;
+        c[1] += gb.shifty;
+        c[2] += gb.shiftz;
+        for (int S=0; S<root_n; S++){
+            const struct reb_treecell* const node = r->tree_root[S];
+            if (node==NULL || !reb_gravity_tree_root_included(r, S, root_proc)) continue;
+            const double R[3] = {c[0]-node->mx, c[1]-node->my, c[2]-node->mz};
+            const double d = sqrt(R[0]*R[0] + R[1]*R[1] + R[2]*R[2]) - h;
+            // The tree walk would not open S for any particle in T
+            if (d<=0. || node->w*node->w >= r->opening_angle2*d*d) continue;
+            far[S] = 1;
+            if (node->m==0.) continue;
+#ifdef QUADRUPOLE
+            if (node->pt<0 && ff->t->order>=2){
+                // Traceless quadrupole moments about the center of mass. The trace does not contribute.
+                double M[ff->t->N];
+                memset(M, 0, sizeof(double)*ff->t->N);
+                M[0] = node->m;
+                M[4] = node->mxx/6.;
+                M[5] = node->mxy/3.;
+                M[6] = node->mxz/3.;
+                M[7] = node->myy/6.;
+                M[8] = node->myz/3.;
+                M[9] = node->mzz/6.;
+                reb_fmm_m2l(&f, R, M, L);
+                continue;
+            }
+#endif // QUADRUPOLE
+            reb_fmm_p2l(&f, R, node->m, L);
+        }
+    }
+}
+
+static void reb_gravity_tree_far_apply(struct reb_simulation* const r, const struct reb_gravity_tree_far* const ff){
+    struct reb_particle* const particles = r->particles;
+    const struct reb_fmm_tables* const t = ff->t;
+    const int N = r->N;
+#pragma omp parallel for schedule(guided)
+    for (int i=0; i<N; i++){
+        const int T = ff->rootbox[i];
+        const double* const L = ff->L+(size_t)ff->targets[T]*t->N;
+        double c[3];
+        reb_gravity_tree_root_center(r, T, c);
+        const double u[3] = {particles[i].x-c[0], particles[i].y-c[1], particles[i].z-c[2]};
+        double w[t->N];
+        reb_fmm_powers(t, u, w);
+        double acc[3] = {0.};
+        for (int k=0; k<t->N && t->degree[k]<t->order; k++){
+            acc[0] -= L[t->p1[3*k+0]]*w[k];
+            acc[1] -= L[t->p1[3*k+1]]*w[k];
+            acc[2] -= L[t->p1[3*k+2]]*w[k];
+        }
+        particles[i].ax += acc[0];
+        particles[i].ay += acc[1];
+        particles[i].az += acc[2];
+    }
+}
+
+static void reb_gravity_tree_far_free(struct reb_gravity_tree_far* const ff){
+    if (ff->t){
+        reb_fmm_tables_free(ff->t);
+        free(ff->t);
+    }
+    free(ff->rootbox);
+    free(ff->targets);
+    free(ff->L);
+    free(ff->far);
+    ff->t = NULL;
+    ff->rootbox = NULL;
+    ff->targets = NULL;
+    ff->L = NULL;
+    ff->far = NULL;
+}
+
+#ifndef MPI
+
+static void reb_fmm_p2p(const struct reb_fmm* const f, const double x[3], const struct reb_particle pj, double acc[3]){
+    const double dx = x[0] - pj.x;
+    const double dy = x[1] - pj.y;
+    const double dz = x[2] - pj.z;
+    const double _r = sqrt(dx*dx + dy*dy + dz*dz + f->softening2);
+    const double prefact = -f->G/(_r*_r*_r)*pj.m;
+    acc[0] += prefact*dx;
+    acc[1] += prefact*dy;
+    acc[2] += prefact*dz;
+}
+
+static void reb_fmm_m2p(const struct reb_fmm* const f, const double R[3], const double* const M, double acc[3]){
+    const struct reb_fmm_tables* const t = f->t;
+    double T[t->N];
+    reb_fmm_derivatives(t, R, T);
+    for (int l=0; l<t->N && t->degree[l]<t->order; l++){
+        acc[0] += f->G*T[t->p1[3*l+0]]*M[l];
+        acc[1] += f->G*T[t->p1[3*l+1]]*M[l];
+        acc[2] += f->G*T[t->p1[3*l+2]]*M[l];
+    }
+}
+
+/**
+ * @brief Translates the expansion E1 by d and adds it to E2.
+ * @details With w_n = d^n/n!, calculates E2_a += sum_b E1_b w_{a-b} if upwards==1 (M2M)
+ * and E2_b += sum_a E1_a w_{a-b} if upwards==0 (L2L).
+ */
+static void reb_fmm_translate(const struct reb_fmm_tables* const t, const double d[3], const double* const E1, double* const E2, const int upwards){
+    double w[t->N];
+    reb_fmm_powers(t, d, w);
+    const int* const pairs = t->pairs;
+    if (upwards){
+        for (int i=0; i<t->N_pairs; i++){
+            E2[pairs[3*i]] += E1[pairs[3*i+1]]*w[pairs[3*i+2]];
+        }
+    }else{
+        for (int i=0; i<t->N_pairs; i++){
+            E2[pairs[3*i+1]] += E1[pairs[3*i]]*w[pairs[3*i+2]];
+        }
+    }
+}
+
+static int reb_fmm_is_bucket(const struct reb_treecell* const node){
+    return node->pt>=0 || -node->pt<=REB_GRAVITY_FMM_BUCKET_SIZE;
+}
+
+static int reb_fmm_count_cells(const struct reb_treecell* const node){
+    if (node->pt>=0){
+        return 0;
+    }
+    if (reb_fmm_is_bucket(node)){
+        return 1;
+    }
+    int N = 1;
+    for (int o=0; o<8; o++){
+        if (node->oct[o]!=NULL){
+            N += reb_fmm_count_cells(node->oct[o]);
+        }
+    }
+    return N;
+}
+
+/**
+ * @brief Adds the multipole expansions of all particles in the subtree c to the multipole expansion of node (P2M).
+ */
+static void reb_fmm_p2m(const struct reb_fmm* const f, struct reb_treecell* const node, const struct reb_treecell* const c){
+    const struct reb_fmm_tables* const t = f->t;
+    if (c->pt<0){
+        for (int o=0; o<8; o++){
+            if (c->oct[o]!=NULL){
+                reb_fmm_p2m(f, node, c->oct[o]);
+            }
+        }
+        return;
+    }
+    const struct reb_particle p = f->particles[c->pt];
+    if (p.m==0) return;
+    const double d[3] = {node->x-p.x, node->y-p.y, node->z-p.z};
+    double w[t->N];
+    reb_fmm_powers(t, d, w);
+    for (int k=0; k<t->N; k++){
+        node->fmm[k] += p.m*w[k];
+    }
+}
+
+/**
+ * @brief Evaluates the local expansion of node at all particles in the subtree c (L2P).
+ */
+static void reb_fmm_l2p(const struct reb_fmm* const f, const struct reb_treecell* const node, const struct reb_treecell* const c){
+    const struct reb_fmm_tables* const t = f->t;
+    if (c->pt<0){
+        for (int o=0; o<8; o++){
+            if (c->oct[o]!=NULL){
+                reb_fmm_l2p(f, node, c->oct[o]);
+            }
+        }
+        return;
+    }
+    const double* const L = node->fmm+t->N;
+    struct reb_particle* const p = &(f->particles[c->pt]);
+    const double u[3] = {p->x-node->x, p->y-node->y, p->z-node->z};
+    double w[t->N];
+    reb_fmm_powers(t, u, w);
+    for (int k=0; k<t->N && t->degree[k]<t->order; k++){
+        p->ax -= L[t->p1[3*k+0]]*w[k];
+        p->ay -= L[t->p1[3*k+1]]*w[k];
+        p->az -= L[t->p1[3*k+2]]*w[k];
+    }
+}
+
+/**
+ * @brief Assigns storage for the expansions and calculates the multipole expansions (P2M and M2M).
+ */
+static void reb_fmm_upward(const struct reb_fmm* const f, struct reb_treecell* const node, double** const buffer){
+    const struct reb_fmm_tables* const t = f->t;
+    node->fmm = *buffer;
+    *buffer += 2*t->N;
+    if (reb_fmm_is_bucket(node)){
+        reb_fmm_p2m(f, node, node);
+        return;
+    }
+    for (int o=0; o<8; o++){
+        struct reb_treecell* const c = node->oct[o];
+        if (c==NULL) continue;
+        if (c->pt>=0){
+            reb_fmm_p2m(f, node, c);
+        }else{
+            reb_fmm_upward(f, c, buffer);
+            const double d[3] = {node->x-c->x, node->y-c->y, node->z-c->z};
+            reb_fmm_translate(t, d, c->fmm, node->fmm, 1);
+        }
+    }
+}
+
+/**
+ * @brief Translates the local expansions to the children (L2L) and evaluates them at the particles (L2P).
+ */
+static void reb_fmm_downward(const struct reb_fmm* const f, struct reb_treecell* const node){
+    const struct reb_fmm_tables* const t = f->t;
+    const double* const L = node->fmm+t->N;
+    if (reb_fmm_is_bucket(node)){
+        reb_fmm_l2p(f, node, node);
+        return;
+    }
+    for (int o=0; o<8; o++){
+        struct reb_treecell* const c = node->oct[o];
+        if (c==NULL) continue;
+        if (c->pt>=0){
+            reb_fmm_l2p(f, node, c);
+        }else{
+            const double d[3] = {c->x-node->x, c->y-node->y, c->z-node->z};
+            reb_fmm_translate(t, d, L, c->fmm+t->N, 0);
+            reb_fmm_downward(f, c);
+        }
+    }
+}
+
+/**
+ * @brief Calculates the acceleration of particle i at position x from all particles in the subtree B by direct summation.
+ */
+static void reb_fmm_p2p_subtree(const struct reb_fmm* const f, const int i, const double x[3], const struct reb_treecell* const B, double acc[3]){
+    if (B->pt>=0){
+        if (B->pt!=i){
+            reb_fmm_p2p(f, x, f->particles[B->pt], acc);
+        }
+        return;
+    }
+    for (int o=0; o<8; o++){
+        if (B->oct[o]!=NULL){
+            reb_fmm_p2p_subtree(f, i, x, B->oct[o], acc);
+        }
+    }
+}
+
+/**
+ * @brief Calculates the acceleration of particle i at position x (including the ghostbox shift) from all particles in cell B.
+ */
+static void reb_fmm_interact_particle(const struct reb_fmm* const f, const int i, const double x[3], const struct reb_treecell* const B, double acc[3]){
+    if (B->pt>=0){
+        if (B->pt!=i){
+            reb_fmm_p2p(f, x, f->particles[B->pt], acc);
+        }
+        return;
+    }
+    if (B->fmm[0]==0.){
+        return;
+    }
+    const double R[3] = {x[0]-B->x, x[1]-B->y, x[2]-B->z};
+    const double R2 = R[0]*R[0] + R[1]*R[1] + R[2]*R[2];
+    if (B->w*B->w < f->opening_angle2*R2){
+        reb_fmm_m2p(f, R, B->fmm, acc);
+        return;
+    }
+    if (reb_fmm_is_bucket(B)){
+        reb_fmm_p2p_subtree(f, i, x, B, acc);
+        return;
+    }
+    for (int o=0; o<8; o++){
+        if (B->oct[o]!=NULL){
+            reb_fmm_interact_particle(f, i, x, B->oct[o], acc);
+        }
+    }
+}
+
+static void reb_fmm_interact_leaf(const struct reb_fmm* const f, const struct reb_treecell* const A, const struct reb_treecell* const B){
+    struct reb_particle* const p = &(f->particles[A->pt]);
+    const double x[3] = {p->x+f->gb.shiftx, p->y+f->gb.shifty, p->z+f->gb.shiftz};
+    double acc[3] = {0., 0., 0.};
+    reb_fmm_interact_particle(f, A->pt, x, B, acc);
+    p->ax += acc[0];
+    p->ay += acc[1];
+    p->az += acc[2];
+}
+
+static void reb_fmm_collect_particles(const struct reb_treecell* const node, int* const indices, int* const N){
+    if (node->pt>=0){
+        indices[(*N)++] = node->pt;
+        return;
+    }
+    for (int o=0; o<8; o++){
+        if (node->oct[o]!=NULL){
+            reb_fmm_collect_particles(node->oct[o], indices, N);
+        }
+    }
+}
+
+/**
+ * @brief Calculates the acceleration of all particles in the bucket A (shifted by the ghostbox) from all particles in the bucket B by direct summation.
+ */
+static void reb_fmm_interact_bucket(const struct reb_fmm* const f, const struct reb_treecell* const A, const struct reb_treecell* const B){
+    struct reb_particle* const particles = f->particles;
+    int iA[REB_GRAVITY_FMM_BUCKET_SIZE];
+    int iB[REB_GRAVITY_FMM_BUCKET_SIZE];
+    int NA = 0;
+    int NB = 0;
+    reb_fmm_collect_particles(A, iA, &NA);
+    reb_fmm_collect_particles(B, iB, &NB);
+    double xB[REB_GRAVITY_FMM_BUCKET_SIZE];
+    double yB[REB_GRAVITY_FMM_BUCKET_SIZE];
+    double zB[REB_GRAVITY_FMM_BUCKET_SIZE];
+    double mB[REB_GRAVITY_FMM_BUCKET_SIZE];
+    for (int k=0; k<NB; k++){
+        xB[k] = particles[iB[k]].x;
+        yB[k] = particles[iB[k]].y;
+        zB[k] = particles[iB[k]].z;
+        mB[k] = particles[iB[k]].m;
+    }
+    const double G = f->G;
+    const double softening2 = f->softening2;
+    for (int ka=0; ka<NA; ka++){
+        const int i = iA[ka];
+        const double x = particles[i].x+f->gb.shiftx;
+        const double y = particles[i].y+f->gb.shifty;
+        const double z = particles[i].z+f->gb.shiftz;
+        double ax = 0.;
+        double ay = 0.;
+        double az = 0.;
+        for (int kb=0; kb<NB; kb++){
+            const double dx = x - xB[kb];
+            const double dy = y - yB[kb];
+            const double dz = z - zB[kb];
+            const double _r = sqrt(dx*dx + dy*dy + dz*dz + softening2);
+            // The particle itself is skipped by setting its prefactor to zero.
+            const double prefact = iB[kb]==i ? 0. : -G/(_r*_r*_r)*mB[kb];
+            ax += prefact*dx;
+            ay += prefact*dy;
+            az += prefact*dz;
+        }
+        particles[i].ax += ax;
+        particles[i].ay += ay;
+        particles[i].az += az;
+    }
+}
+
+/**
+ * @brief Calculates the interactions of all particles in the non-leaf cell A (shifted by the ghostbox) with all particles in cell B.
+ * @details Cells are well separated if (w_A+w_B)^2 < opening_angle2*R^2, where R is the distance between their centers.
+ * Otherwise, the larger cell is split.
+ */
+static void reb_fmm_interact_cell(const struct reb_fmm* const f, const struct reb_treecell* const A, const struct reb_treecell* const B){
+    const double cA[3] = {A->x+f->gb.shiftx, A->y+f->gb.shifty, A->z+f->gb.shiftz};
+    if (B->pt>=0){
+        const struct reb_particle pj = f->particles[B->pt];
+        if (pj.m==0.){
+            return;
+        }
+        const double R[3] = {cA[0]-pj.x, cA[1]-pj.y, cA[2]-pj.z};
+        const double R2 = R[0]*R[0] + R[1]*R[1] + R[2]*R[2];
+        if (A->w*A->w < f->opening_angle2*R2){
+            reb_fmm_p2l(f, R, pj.m, A->fmm+f->t->N);
+            return;
+        }
+        if (reb_fmm_is_bucket(A)){
+            reb_fmm_interact_bucket(f, A, B);
+            return;
+        }
+    }else{
+        if (B->fmm[0]==0.){
+            return;
+        }
+        const double R[3] = {cA[0]-B->x, cA[1]-B->y, cA[2]-B->z};
+        const double R2 = R[0]*R[0] + R[1]*R[1] + R[2]*R[2];
+        if ((A->w+B->w)*(A->w+B->w) < f->opening_angle2*R2){
+            reb_fmm_m2l(f, R, B->fmm, A->fmm+f->t->N);
+            return;
+        }
+        if (reb_fmm_is_bucket(A) && reb_fmm_is_bucket(B)){
+            reb_fmm_interact_bucket(f, A, B);
+            return;
+        }
+        if (reb_fmm_is_bucket(A) || (!reb_fmm_is_bucket(B) && B->w > A->w)){
+            for (int o=0; o<8; o++){
+                if (B->oct[o]!=NULL){
+                    reb_fmm_interact_cell(f, A, B->oct[o]);
+                }
+            }
+            return;
+        }
+    }
+    for (int o=0; o<8; o++){
+        const struct reb_treecell* const a = A->oct[o];
+        if (a!=NULL){
+            if (a->pt>=0){
+                reb_fmm_interact_leaf(f, a, B);
+            }else{
+                reb_fmm_interact_cell(f, a, B);
+            }
+        }
+    }
+}
+
+static void reb_fmm_collect_targets(struct reb_treecell* const node, const int depth, struct reb_treecell*** targets, int* N, int* allocatedN){
+    if (reb_fmm_is_bucket(node) || depth==REB_GRAVITY_FMM_TARGET_DEPTH){
+        if (*N>=*allocatedN){
+            *allocatedN = *allocatedN ? *allocatedN*2 : 128;
+            *targets = realloc(*targets, sizeof(struct reb_treecell*)*(*allocatedN));
+        }
+        (*targets)[(*N)++] = node;
+        return;
+    }
+    for (int o=0; o<8; o++){
+        if (node->oct[o]!=NULL){
+            reb_fmm_collect_targets(node->oct[o], depth+1, targets, N, allocatedN);
+        }
+    }
+}
+
+static void reb_calculate_acceleration_fmm(struct reb_simulation* const r){
+    if (r->tree_root==NULL){
+        return;
+    }
+    struct reb_fmm_tables t;
+    reb_fmm_tables_init(&t, reb_fmm_order(r));
+    struct reb_fmm f = {
+        .particles = r->particles,
+        .t = &t,
+        .G = r->G,
+        .softening2 = r->softening*r->softening,
+        .opening_angle2 = r->opening_angle2,
+    };
+    // Storage for the expansions of all non-leaf cells
+    int* offset = malloc(sizeof(int)*(r->root_n+1));
+    offset[0] = 0;
+    for (int i=0; i<r->root_n; i++){
+        offset[i+1] = offset[i] + (r->tree_root[i]!=NULL ? reb_fmm_count_cells(r->tree_root[i]) : 0);
+    }
+    double* buffer = calloc((size_t)offset[r->root_n]*2*t.N+1, sizeof(double));
+    // Upward pass
+#pragma omp parallel for schedule(guided)
+    for (int i=0; i<r->root_n; i++){
+        if (r->tree_root[i]!=NULL && r->tree_root[i]->pt<0){
+            double* b = buffer+(size_t)offset[i]*2*t.N;
+            reb_fmm_upward(&f, r->tree_root[i], &b);
+        }
+    }
+    // Interactions
+    struct reb_treecell** targets = NULL;
+    int N_targets = 0;
+    int allocatedN_targets = 0;
+    for (int i=0; i<r->root_n; i++){
+        if (r->tree_root[i]!=NULL){
+            reb_fmm_collect_targets(r->tree_root[i], 0, &targets, &N_targets, &allocatedN_targets);
+        }
+    }
+    // Particles which are not in the tree (see reb_tree_active_only()) interact with the tree individually.
+    const int N_tree = reb_tree_active_only(r) ? r->N_active : r->N;
+    const struct reb_ghostbox* const ghostboxes = reb_boundary_ghostboxes(r);
+    for (int gbx=-r->nghostx; gbx<=r->nghostx; gbx++){
+    for (int gby=-r->nghosty; gby<=r->nghosty; gby++){
+    for (int gbz=-r->nghostz; gbz<=r->nghostz; gbz++){
+        f.gb = ghostboxes[reb_boundary_ghostbox_index(r, gbx,gby,gbz)];
+#pragma omp parallel for schedule(guided)
+        for (int k=0; k<N_targets; k++){
+            const struct reb_treecell* const A = targets[k];
+            for (int j=0; j<r->root_n; j++){
+                const struct reb_treecell* const B = r->tree_root[j];
+                if (B!=NULL){
+                    if (A->pt>=0){
+                        reb_fmm_interact_leaf(&f, A, B);
+                    }else{
+                        reb_fmm_interact_cell(&f, A, B);
+                    }
+                }
+            }
+        }
+#pragma omp parallel for schedule(guided)
+        for (int i=N_tree; i<r->N; i++){
+            struct reb_particle* const p = &(r->particles[i]);
+            const double x[3] = {p->x+f.gb.shiftx, p->y+f.gb.shifty, p->z+f.gb.shiftz};
+            double acc[3] = {0., 0., 0.};
+            for (int j=0; j<r->root_n; j++){
+                if (r->tree_root[j]!=NULL){
+                    reb_fmm_interact_particle(&f, i, x, r->tree_root[j], acc);
+                }
+            }
+            p->ax += acc[0];
+            p->ay += acc[1];
+            p->az += acc[2];
+        }
+    }
+    }
+    }
+    // Downward pass
+#pragma omp parallel for schedule(guided)
+    for (int i=0; i<r->root_n; i++){
+        if (r->tree_root[i]!=NULL && r->tree_root[i]->pt<0){
+            reb_fmm_downward(&f, r->tree_root[i]);
+        }
+    }
+    free(targets);
+    free(buffer);
+    free(offset);
+    reb_fmm_tables_free(&t);
+}
+#endif // MPI
+
+#ifndef MPI
+/**
+ * Ewald summation for periodic boundary conditions (REB_GRAVITY_EWALD)
+ */
+#define REB_GRAVITY_EWALD_CUTOFF 4.  ///< alpha times the real space cutoff and half the reciprocal space cutoff over alpha. Truncation errors are of order exp(-16).
+
+// Wave vector of the reciprocal lattice
+struct reb_ewald_k {
+    int n1, n2, n3;
+    double kx, ky, kz;
+    double coef;
+};
+
+// Fills e with exp(i*n*theta) for n=0..n_max using the angle addition formula.
+// The negative indices are the complex conjugates.
+static void reb_ewald_phases(const double theta, const int n_max, double* const c, double* const s){
+    const double c1 = cos(theta);
+    const double s1 = sin(theta);
+    c[0] = 1.;
+    s[0] = 0.;
+    for (int n=1; n<=n_max; n++){
+        c[n] = c[n-1]*c1 - s[n-1]*s1;
+        s[n] = s[n-1]*c1 + c[n-1]*s1;
+    }
+}
+
+// Phases of particle p for all wave vectors. 
+static void reb_ewald_particle_phases(const struct reb_particle p, const double Lx, const double Ly, const double Lz, const double s, const int n1_max, const int n2_max, const int n3_max, double* const buf){
+    double* const c1 = buf;
+    double* const s1 = c1 + n1_max+1;
+    double* const c2 = s1 + n1_max+1;
+    double* const s2 = c2 + n2_max+1;
+    double* const c3 = s2 + n2_max+1;
+    double* const s3 = c3 + n3_max+1;
+    reb_ewald_phases(2.*M_PI*p.x/Lx, n1_max, c1, s1);
+    reb_ewald_phases(2.*M_PI*(p.y/Ly - s*p.x/(Lx*Ly)), n2_max, c2, s2);
+    reb_ewald_phases(2.*M_PI*p.z/Lz, n3_max, c3, s3);
+}
+
+// Returns cos and sin of k.r from the phases calculated with reb_ewald_particle_phases().
+static inline void reb_ewald_phase(const double* const buf, const int n1_max, const int n2_max, const int n3_max, const struct reb_ewald_k k, double* const ck, double* const sk){
+    const double* const c1 = buf;
+    const double* const s1 = c1 + n1_max+1;
+    const double* const c2 = s1 + n1_max+1;
+    const double* const s2 = c2 + n2_max+1;
+    const double* const c3 = s2 + n2_max+1;
+    const double* const s3 = c3 + n3_max+1;
+    const double a_c = c1[abs(k.n1)];
+    const double a_s = k.n1<0?-s1[-k.n1]:s1[k.n1];
+    const double b_c = c2[abs(k.n2)];
+    const double b_s = k.n2<0?-s2[-k.n2]:s2[k.n2];
+    const double ab_c = a_c*b_c - a_s*b_s;
+    const double ab_s = a_s*b_c + a_c*b_s;
+    *ck = ab_c*c3[k.n3] - ab_s*s3[k.n3];
+    *sk = ab_s*c3[k.n3] + ab_c*s3[k.n3];
+}
+
+static void reb_calculate_acceleration_ewald(struct reb_simulation* const r){
+    struct reb_particle* const particles = r->particles;
+    const int N_real = r->N - r->N_var;
+    const int N_active = (r->N_active==-1)?N_real:r->N_active;
+    // Test particles of type 1 act on active particles but not on other test particles.
+    const int N_sources = r->testparticle_type?N_real:N_active;
+    const double G = r->G;
+    const double softening2 = r->softening*r->softening;
+    const double Lx = r->boxsize.x;
+    const double Ly = r->boxsize.y;
+    const double Lz = r->boxsize.z;
+    const double V = Lx*Ly*Lz;
+    // The lattice vectors are (Lx,s,0), (0,Ly,0), and (0,0,Lz). For shearing 
+    // sheet boundaries the offset s of the neighbouring boxes is time dependent.
+    double s = 0.;
+    if (r->boundary==REB_BOUNDARY_SHEAR){
+        s = reb_boundary_get_ghostbox(r, 1, 0, 0).shifty;
+        s -= Ly*round(s/Ly);
+    }
+    // All periodic images other than the nearest one are at least rc away.
+    const double rc = 0.5*MIN(Lx, MIN(Ly, Lz));
+    const double alpha = REB_GRAVITY_EWALD_CUTOFF/rc;
+    const double kc = 2.*alpha*REB_GRAVITY_EWALD_CUTOFF;
+
+    // Real space sum with the nearest image of every particle.
+#pragma omp parallel for schedule(guided)
+    for (int i=0; i<N_real; i++){
+        const int N_j = (i<N_active)?N_sources:N_active;
+        const struct reb_particle pi = particles[i];
+        double ax = 0.;
+        double ay = 0.;
+        double az = 0.;
+        for (int j=0; j<N_j; j++){
+            if (j==i) continue;
+            double dx = pi.x - particles[j].x;
+            double dy = pi.y - particles[j].y;
+            double dz = pi.z - particles[j].z;
+            const double ix = round(dx/Lx);
+            dx -= ix*Lx;
+            dy -= ix*s;
+            dy -= Ly*round(dy/Ly);
+            dz -= Lz*round(dz/Lz);
+            const double r2 = dx*dx + dy*dy + dz*dz;
+            if (r2>=rc*rc) continue;
+            const double _r = sqrt(r2 + softening2);
+            const double ar = alpha*_r;
+            const double prefact = -G*particles[j].m*(erfc(ar) + M_2_SQRTPI*ar*exp(-ar*ar))/(_r*_r*_r);
+            ax += prefact*dx;
+            ay += prefact*dy;
+            az += prefact*dz;
+        }
+        particles[i].ax = ax;
+        particles[i].ay = ay;
+        particles[i].az = az;
+    }
+
+    // Wave vectors in one half space. k and -k contribute equally.
+    const int n1_max = (int)ceil(kc*Lx/(2.*M_PI));
+    const int n2_max = (int)ceil(kc*Ly/(2.*M_PI));
+    const int n3_max = (int)ceil(kc*Lz/(2.*M_PI));
+    const int n1_shift = (int)ceil(n2_max*fabs(s)/Ly); // kx is centered on n2*s/Ly for sheared lattices
+    const int n1_range = n1_max+n1_shift;
+    struct reb_ewald_k* ks = malloc(sizeof(struct reb_ewald_k)*(2*n1_range+1)*(2*n2_max+1)*(n3_max+1));
+    int N_k = 0;
+    for (int n3=0; n3<=n3_max; n3++){
+    for (int n2=(n3==0?0:-n2_max); n2<=n2_max; n2++){
+    for (int n1=-n1_range; n1<=n1_range; n1++){
+        if (n3==0 && n2==0 && n1<=0) continue;
+        struct reb_ewald_k k = {.n1 = n1, .n2 = n2, .n3 = n3};
+        k.kx = 2.*M_PI*(n1/Lx - n2*s/(Lx*Ly));
+        k.ky = 2.*M_PI*n2/Ly;
+        k.kz = 2.*M_PI*n3/Lz;
+        const double k2 = k.kx*k.kx + k.ky*k.ky + k.kz*k.kz;
+        if (k2>kc*kc) continue;
+        k.coef = -2.*4.*M_PI*G/V*exp(-k2/(4.*alpha*alpha))/k2;
+        ks[N_k++] = k;
+    }
+    }
+    }
+
+    // Structure factors of the active particles (S_a) and test particles (S_t). 
+    // Every thread sums up a fixed range of particles, so the result does not depend on timing.
+    // If gravity_deterministic is set, the ranges are fixed (slots) and do not depend on the number of threads either.
+    const int N_S = (N_sources>N_active)?2:1;
+    const int N_buf = 2*(n1_range+n2_max+n3_max+3);
+    const int deterministic = r->gravity_deterministic;
+#ifdef OPENMP
+    const int N_threads = deterministic?MAX(1,MIN(REB_GRAVITY_DETERMINISTIC_SLOTS, N_sources)):omp_get_max_threads();
+#else // OPENMP
+    const int N_threads = deterministic?MAX(1,MIN(REB_GRAVITY_DETERMINISTIC_SLOTS, N_sources)):1;
+#endif // OPENMP
+    double* const S_threads = calloc((size_t)N_threads*N_S*2*N_k+1, sizeof(double));
+#pragma omp parallel
+    {
+        double* const buf = malloc(sizeof(double)*N_buf);
+#pragma omp for schedule(static,1)
+        for (int t=0; t<N_threads; t++){
+            double* const S = S_threads + (size_t)t*N_S*2*N_k;
+            const int j0 = (int)((long)N_sources*t/N_threads);
+            const int j1 = (int)((long)N_sources*(t+1)/N_threads);
+            for (int j=j0; j<j1; j++){
+                const double m = particles[j].m;
+                double* const Sj = S + (j<N_active?0:2*N_k);
+                reb_ewald_particle_phases(particles[j], Lx, Ly, Lz, s, n1_range, n2_max, n3_max, buf);
+                for (int q=0; q<N_k; q++){
+                    double ck, sk;
+                    reb_ewald_phase(buf, n1_range, n2_max, n3_max, ks[q], &ck, &sk);
+                    Sj[2*q+0] += m*ck;
+                    Sj[2*q+1] += m*sk;
+                }
+            }
+        }
+        free(buf);
+    }
+    if (deterministic){
+        reb_gravity_deterministic_reduce(S_threads, N_threads, (long)N_S*2*N_k);
+    }else{
+        for (int t=1; t<N_threads; t++){
+            for (int q=0; q<N_S*2*N_k; q++){
+                S_threads[q] += S_threads[(size_t)t*N_S*2*N_k+q];
+            }
+        }
+    }
+    const double* const S_a = S_threads;
+    const double* const S_t = S_threads+2*N_k;
+
+    // Reciprocal space sum
+#pragma omp parallel
+    {
+        double* const buf = malloc(sizeof(double)*N_buf);
+#pragma omp for schedule(static)
+        for (int i=0; i<N_real; i++){
+            const int all = (i<N_active) && N_S==2;
+            reb_ewald_particle_phases(particles[i], Lx, Ly, Lz, s, n1_range, n2_max, n3_max, buf);
+            double ax = 0.;
+            double ay = 0.;
+            double az = 0.;
+            for (int q=0; q<N_k; q++){
+                double ck, sk;
+                reb_ewald_phase(buf, n1_range, n2_max, n3_max, ks[q], &ck, &sk);
+                double C = S_a[2*q+0];
+                double Sn = S_a[2*q+1];
+                if (all){
+                    C += S_t[2*q+0];
+                    Sn += S_t[2*q+1];
+                }
+                // sum_j m_j sin(k.(r_i-r_j))
+                const double f = ks[q].coef*(sk*C - ck*Sn);
+                ax += f*ks[q].kx;
+                ay += f*ks[q].ky;
+                az += f*ks[q].kz;
+            }
+            particles[i].ax += ax;
+            particles[i].ay += ay;
+            particles[i].az += az;
+        }
+        free(buf);
+    }
+    free(S_threads);
+    free(ks);
+}
+#endif // MPI
+
+#ifdef AVX512
+// Helper routines for the AVX512 version of REB_GRAVITY_BASIC
+
+/**
+ * @brief Calculates the acceleration at position (x, y, z) from the particles with indices j0<=j<j1.
+ * @details The particles e1 and e2 are skipped (set to -1 if not used). 1/r is calculated with 
+ * the approximate reciprocal square root and two Newton-Raphson iterations, which gives full 
+ * double precision.
+ */
+static inline void reb_gravity_basic_avx512_kernel(const double* const soa, const int Np, const double x, const double y, const double z, const int j0, const int j1, const int e1, const int e2, const double G, const double softening2, double* const a){
+    const __m512d _x = _mm512_set1_pd(x);
+    const __m512d _y = _mm512_set1_pd(y);
+    const __m512d _z = _mm512_set1_pd(z);
+    const __m512d _softening2 = _mm512_set1_pd(softening2);
+    const __m512d one = _mm512_set1_pd(1.);
+    const __m512d half = _mm512_set1_pd(0.5);
+    const __m512d threehalves = _mm512_set1_pd(1.5);
+    const __m512i lanes = _mm512_set_epi64(7,6,5,4,3,2,1,0);
+    const __m512i _e1 = _mm512_set1_epi64(e1);
+    const __m512i _e2 = _mm512_set1_epi64(e2);
+    __m512d ax = _mm512_setzero_pd();
+    __m512d ay = _mm512_setzero_pd();
+    __m512d az = _mm512_setzero_pd();
+    for (int j=j0&~7; j<j1; j+=8){
+        const __m512i index = _mm512_add_epi64(_mm512_set1_epi64(j), lanes);
+        __mmask8 valid = _mm512_cmplt_epi64_mask(index, _mm512_set1_epi64(j1)) & _mm512_cmpge_epi64_mask(index, _mm512_set1_epi64(j0));
+        valid &= _mm512_cmpneq_epi64_mask(index, _e1) & _mm512_cmpneq_epi64_mask(index, _e2);
+        const __m512d dx = _mm512_sub_pd(_x, _mm512_load_pd(soa+j));
+        const __m512d dy = _mm512_sub_pd(_y, _mm512_load_pd(soa+Np+j));
+        const __m512d dz = _mm512_sub_pd(_z, _mm512_load_pd(soa+2*Np+j));
+        const __m512d m = _mm512_maskz_load_pd(valid, soa+3*Np+j);
+        __m512d r2 = _mm512_fmadd_pd(dx, dx, _mm512_fmadd_pd(dy, dy, _mm512_fmadd_pd(dz, dz, _softening2)));
+        r2 = _mm512_mask_blend_pd(valid, one, r2); // Avoids 1/0 for skipped particles and padding
+        __m512d _r = _mm512_rsqrt14_pd(r2);
+        const __m512d hr2 = _mm512_mul_pd(half, r2);
+        _r = _mm512_mul_pd(_r, _mm512_fnmadd_pd(hr2, _mm512_mul_pd(_r, _r), threehalves));
+        _r = _mm512_mul_pd(_r, _mm512_fnmadd_pd(hr2, _mm512_mul_pd(_r, _r), threehalves));
+        const __m512d prefact = _mm512_mul_pd(m, _mm512_mul_pd(_r, _mm512_mul_pd(_r, _r)));
+        ax = _mm512_fnmadd_pd(prefact, dx, ax);
+        ay = _mm512_fnmadd_pd(prefact, dy, ay);
+        az = _mm512_fnmadd_pd(prefact, dz, az);
+    }
+    a[0] += G*_mm512_reduce_add_pd(ax);
+    a[1] += G*_mm512_reduce_add_pd(ay);
+    a[2] += G*_mm512_reduce_add_pd(az);
+}
+
+static void reb_calculate_acceleration_basic_avx512(struct reb_simulation* const r){
+    struct reb_particle* const particles = r->particles;
+    const int N = r->N;
+    const int N_real = N - r->N_var;
+    const int N_active = (r->N_active==-1)?N_real:r->N_active;
+    const int gravity_ignore_terms = r->gravity_ignore_terms;
+    const int testparticle_type = r->testparticle_type;
+    const double G = r->G;
+    const double softening2 = r->softening*r->softening;
+    const int Np = reb_particles_soa_update(r, N_real, 0);
+    const double* const soa = r->particles_soa;
+#pragma omp parallel for
+    for (int i=0; i<N; i++){
+        particles[i].ax = 0; 
+        particles[i].ay = 0; 
+        particles[i].az = 0; 
+    }
+    // Summing over all Ghost Boxes
+    const struct reb_ghostbox* const ghostboxes = reb_boundary_ghostboxes(r);
+    for (int gbx=-r->nghostx; gbx<=r->nghostx; gbx++){
+    for (int gby=-r->nghosty; gby<=r->nghosty; gby++){
+    for (int gbz=-r->nghostz; gbz<=r->nghostz; gbz++){
+        const struct reb_ghostbox gb = ghostboxes[reb_boundary_ghostbox_index(r, gbx,gby,gbz)];
+#pragma omp parallel for
+        for (int i=0; i<N_real; i++){
+#ifndef OPENMP
+            if (reb_sigint) continue;
+#endif // OPENMP
+            // Terms which are ignored for WH integrators (see reb_calculate_acceleration())
+            if (gravity_ignore_terms==2 && i==0) continue;
+            const int e2 = (gravity_ignore_terms==1 && i<2) ? 1-i : (gravity_ignore_terms==2 ? 0 : -1);
+            const double x = gb.shiftx+particles[i].x;
+            const double y = gb.shifty+particles[i].y;
+            const double z = gb.shiftz+particles[i].z;
+            double a[3] = {0., 0., 0.};
+            // Active particles feel test particles if testparticle_type is 1. Test particles only 
+            // feel active particles. One pass over all sources gives the same result as if all 
+            // particles were active.
+            const int j1 = (testparticle_type && i<N_active) ? N_real : N_active;
+            reb_gravity_basic_avx512_kernel(soa, Np, x, y, z, 0, j1, i, e2, G, softening2, a);
+            particles[i].ax += a[0];
+            particles[i].ay += a[1];
+            particles[i].az += a[2];
+        }
+    }
+    }
+    }
+}
+
+/**
+ * @brief One step of compensated summation in every lane selected by mask.
+ */
+static inline void reb_gravity_compensated_avx512_add(const __mmask8 mask, const __m512d i, __m512d* const a, __m512d* const cs){
+    const __m512d y = _mm512_sub_pd(i, *cs);
+    const __m512d t = _mm512_add_pd(*a, y);
+    *cs = _mm512_mask_mov_pd(*cs, mask, _mm512_sub_pd(_mm512_sub_pd(t, *a), y));
+    *a = _mm512_mask_mov_pd(*a, mask, t);
+}
+
+static void reb_calculate_acceleration_compensated_avx512(struct reb_simulation* const r, const int N_targets){
+    struct reb_particle* const particles = r->particles;
+    struct reb_vec3d* restrict const cs = r->gravity_cs;
+    const int N_real = r->N - r->N_var;
+    const int N_active = (r->N_active==-1)?N_real:r->N_active;
+    const unsigned int gravity_ignore_terms = r->gravity_ignore_terms;
+    const int testparticle_type = r->testparticle_type;
+    const double softening2 = r->softening*r->softening;
+    const int Np = reb_particles_soa_update(r, N_real, 0);
+    const double* const soa = r->particles_soa;
+    const __m512d G = _mm512_set1_pd(r->G);
+    const __m512d _softening2 = _mm512_set1_pd(softening2);
+    const __m512i lanes = _mm512_set_epi64(7,6,5,4,3,2,1,0);
+    const int N_blocks = (N_targets+7)/8;
+#pragma omp parallel for schedule(guided)
+    for (int b=0; b<N_blocks; b++){
+        const int ib = 8*b;
+        const __m512i index = _mm512_add_epi64(_mm512_set1_epi64(ib), lanes);
+        const __mmask8 targets = _mm512_cmplt_epi64_mask(index, _mm512_set1_epi64(N_targets));
+        const __mmask8 targets_active = targets & _mm512_cmplt_epi64_mask(index, _mm512_set1_epi64(N_active));
+        const __m512d xi = _mm512_load_pd(soa+ib);
+        const __m512d yi = _mm512_load_pd(soa+Np+ib);
+        const __m512d zi = _mm512_load_pd(soa+2*Np+ib);
+        __m512d ax = _mm512_setzero_pd(), csx = _mm512_setzero_pd();
+        __m512d ay = _mm512_setzero_pd(), csy = _mm512_setzero_pd();
+        __m512d az = _mm512_setzero_pd(), csz = _mm512_setzero_pd();
+        // Active particles feel test particles if testparticle_type is 1. The sources are added 
+        // in the same order as in the scalar version.
+        const int j1 = (testparticle_type && targets_active) ? N_real : N_active;
+        for (int j=0; j<j1; j++){
+            const __m512i _j = _mm512_set1_epi64(j);
+            __mmask8 mask = (j<N_active ? targets : targets_active) & _mm512_cmpneq_epi64_mask(index, _j);
+            // Terms which are ignored for WH integrators (see reb_calculate_acceleration())
+            if (gravity_ignore_terms==1 && j<2){
+                mask &= _mm512_cmpneq_epi64_mask(index, _mm512_set1_epi64(1-j));
+            }
+            if (gravity_ignore_terms==2){
+                if (j==0) continue;
+                mask &= _mm512_cmpneq_epi64_mask(index, _mm512_setzero_si512());
+            }
+            if (!mask) continue;
+            const __m512d dx = _mm512_sub_pd(xi, _mm512_set1_pd(soa[j]));
+            const __m512d dy = _mm512_sub_pd(yi, _mm512_set1_pd(soa[Np+j]));
+            const __m512d dz = _mm512_sub_pd(zi, _mm512_set1_pd(soa[2*Np+j]));
+            // No fused multiply-adds, to reproduce the scalar version exactly
+            const __m512d r2 = _mm512_add_pd(_mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(dx, dx), _mm512_mul_pd(dy, dy)), _mm512_mul_pd(dz, dz)), _softening2);
+            const __m512d _r = _mm512_sqrt_pd(r2);
+            const __m512d prefact = _mm512_div_pd(G, _mm512_mul_pd(r2, _r));
+            const __m512d prefactj = _mm512_mul_pd(prefact, _mm512_set1_pd(-soa[3*Np+j]));
+            reb_gravity_compensated_avx512_add(mask, _mm512_mul_pd(prefactj, dx), &ax, &csx);
+            reb_gravity_compensated_avx512_add(mask, _mm512_mul_pd(prefactj, dy), &ay, &csy);
+            reb_gravity_compensated_avx512_add(mask, _mm512_mul_pd(prefactj, dz), &az, &csz);
+        }
+        double out[6][8] __attribute__((aligned(64)));
+        _mm512_store_pd(out[0], ax);
+        _mm512_store_pd(out[1], ay);
+        _mm512_store_pd(out[2], az);
+        _mm512_store_pd(out[3], csx);
+        _mm512_store_pd(out[4], csy);
+        _mm512_store_pd(out[5], csz);
+        for (int l=0; l<8 && ib+l<N_targets; l++){
+            particles[ib+l].ax = out[0][l];
+            particles[ib+l].ay = out[1][l];
+            particles[ib+l].az = out[2][l];
+            cs[ib+l].x = out[3][l];
+            cs[ib+l].y = out[4][l];
+            cs[ib+l].z = out[5][l];
+        }
+    }
+}
+#endif // AVX512
+
+#ifndef OPENMP
+static inline void reb_calculate_acceleration_basic_pairs(struct reb_particle* const particles, const double G, const double softening2, const struct reb_ghostbox gb, const int starti, const int startj, const int N_active, const int plain){
+    for (int i=starti; i<N_active; i++){
+        if (reb_sigint) return;
+        const double xi = plain?particles[i].x:(gb.shiftx+particles[i].x);
+        const double yi = plain?particles[i].y:(gb.shifty+particles[i].y);
+        const double zi = plain?particles[i].z:(gb.shiftz+particles[i].z);
+        const double mi = particles[i].m;
+        double ax = particles[i].ax;
+        double ay = particles[i].ay;
+        double az = particles[i].az;
+        for (int j=startj; j<i; j++){
+            const double dx = xi - particles[j].x;
+            const double dy = yi - particles[j].y;
+            const double dz = zi - particles[j].z;
+            const double r2 = dx*dx + dy*dy + dz*dz;
+            const double _r = sqrt(plain?r2:(r2 + softening2));
+            const double prefact = G/(_r*_r*_r);
+            const double prefactj = -prefact*particles[j].m;
+            const double prefacti = prefact*mi;
+            ax += prefactj*dx;
+            ay += prefactj*dy;
+            az += prefactj*dz;
+            particles[j].ax += prefacti*dx;
+            particles[j].ay += prefacti*dy;
+            particles[j].az += prefacti*dz;
+        }
+        particles[i].ax = ax;
+        particles[i].ay = ay;
+        particles[i].az = az;
+    }
+}
+#else // OPENMP
+static inline void reb_calculate_acceleration_basic_tile(const struct reb_particle* const particles, const double G, const double softening2, const struct reb_ghostbox gb, const int i0, const int i1, const int j0, const int j1, double* const acc, const int plain){
+    for (int i=i0; i<i1; i++){
+        const double xi = plain?particles[i].x:(gb.shiftx+particles[i].x);
+        const double yi = plain?particles[i].y:(gb.shifty+particles[i].y);
+        const double zi = plain?particles[i].z:(gb.shiftz+particles[i].z);
+        const double mi = particles[i].m;
+        double ax = 0.;
+        double ay = 0.;
+        double az = 0.;
+        const int je = MIN(j1, i);
+        for (int j=j0; j<je; j++){
+            const double dx = xi - particles[j].x;
+            const double dy = yi - particles[j].y;
+            const double dz = zi - particles[j].z;
+            const double r2 = dx*dx + dy*dy + dz*dz;
+            const double _r = sqrt(plain?r2:(r2 + softening2));
+            const double prefact = G/(_r*_r*_r);
+            const double prefactj = -prefact*particles[j].m;
+            const double prefacti = prefact*mi;
+            ax += prefactj*dx;
+            ay += prefactj*dy;
+            az += prefactj*dz;
+            acc[3*j+0] += prefacti*dx;
+            acc[3*j+1] += prefacti*dy;
+            acc[3*j+2] += prefacti*dz;
+        }
+        acc[3*i+0] += ax;
+        acc[3*i+1] += ay;
+        acc[3*i+2] += az;
+    }
+}
+
+/**
+  * @brief Calculates the forces in tile pair p = ti*(ti+1)/2 + tj (tj<=ti) and adds them to acc (see reb_calculate_acceleration_basic_tile()).
+  */
+static inline void reb_calculate_acceleration_basic_tile_pair(const struct reb_particle* const particles, const double G, const double softening2, const struct reb_ghostbox gb, const int p, const int starti, const int startj, const int N_active, double* const acc, const int plain){
+    int ti = (int)((sqrt(8.*p+1.)-1.)/2.);
+    while (ti*(ti+1)/2>p) ti--;
+    while ((ti+1)*(ti+2)/2<=p) ti++;
+    const int tj = p - ti*(ti+1)/2;
+    const int i0 = MAX(ti*REB_GRAVITY_BASIC_BLOCK, starti);
+    const int i1 = MIN((ti+1)*REB_GRAVITY_BASIC_BLOCK, N_active);
+    const int j0 = MAX(tj*REB_GRAVITY_BASIC_BLOCK, startj);
+    const int j1 = (tj+1)*REB_GRAVITY_BASIC_BLOCK;
+    if (plain){
+        reb_calculate_acceleration_basic_tile(particles, G, 0., gb, i0, i1, j0, j1, acc, 1);
+    }else{
+        reb_calculate_acceleration_basic_tile(particles, G, softening2, gb, i0, i1, j0, j1, acc, 0);
+    }
+}
+#endif // OPENMP
+
+#if defined(OPENMP) || !defined(MPI) // Used by the basic routine with OpenMP and by the Ewald summation
+static void reb_gravity_deterministic_reduce(double* const slots, const int N_slots, const long n){
+#pragma omp parallel for schedule(static)
+    for (long q=0; q<n; q++){
+        for (int w=1; w<N_slots; w*=2){
+            for (int t=0; t+w<N_slots; t+=2*w){
+                slots[t*n+q] += slots[(t+w)*n+q];
+            }
+        }
+    }
+}
+#endif // OPENMP || !MPI
+
+// Loop over the test particles for reb_calculate_acceleration_basic_testparticles(). See above for plain.
+static inline void reb_calculate_acceleration_basic_testparticles_loop(struct reb_simulation* const r, const double* const src, const int N_sources, const int i0, const int plain){
+    struct reb_particle* const particles = r->particles;
+    const int N_real = r->N - r->N_var;
+    const double G = r->G;
+    const double softening2 = r->softening*r->softening;
+    const int nghostx = r->nghostx;
+    const int nghosty = r->nghosty;
+    const int nghostz = r->nghostz;
+    const struct reb_ghostbox* const ghostboxes = reb_boundary_ghostboxes(r);
+#pragma omp parallel for schedule(static)
+    for (int i=i0; i<N_real; i++){
+        const double x = particles[i].x;
+        const double y = particles[i].y;
+        const double z = particles[i].z;
+        double ax = 0.;
+        double ay = 0.;
+        double az = 0.;
+        if (plain){
+            for (int j=0; j<N_sources; j++){
+                const double dx = x - src[4*j+0];
+                const double dy = y - src[4*j+1];
+                const double dz = z - src[4*j+2];
+                const double _r = sqrt(dx*dx + dy*dy + dz*dz);
+                const double prefact = G/(_r*_r*_r);
+                const double prefactj = -prefact*src[4*j+3];
+                ax += prefactj*dx;
+                ay += prefactj*dy;
+                az += prefactj*dz;
+            }
+        }else{
+            // Summing over all Ghost Boxes
+            for (int gbx=-nghostx; gbx<=nghostx; gbx++){
+            for (int gby=-nghosty; gby<=nghosty; gby++){
+            for (int gbz=-nghostz; gbz<=nghostz; gbz++){
+                const struct reb_ghostbox gb = ghostboxes[reb_boundary_ghostbox_index(r, gbx,gby,gbz)];
+                for (int j=0; j<N_sources; j++){
+                    const double dx = (gb.shiftx+x) - src[4*j+0];
+                    const double dy = (gb.shifty+y) - src[4*j+1];
+                    const double dz = (gb.shiftz+z) - src[4*j+2];
+                    const double _r = sqrt(dx*dx + dy*dy + dz*dz + softening2);
+                    const double prefact = G/(_r*_r*_r);
+                    const double prefactj = -prefact*src[4*j+3];
+                    ax += prefactj*dx;
+                    ay += prefactj*dy;
+                    az += prefactj*dz;
+                }
+            }
+            }
+            }
+        }
+        particles[i].ax = ax;
+        particles[i].ay = ay;
+        particles[i].az = az;
+    }
+}
+
+static void reb_calculate_acceleration_basic_testparticles(struct reb_simulation* const r, const int i0, const int j0, const int N_active){
+    struct reb_particle* const particles = r->particles;
+#ifdef GPU
+    if (r->N - r->N_var - i0>=REB_GRAVITY_GPU_MIN_N){
+        reb_calculate_acceleration_testparticles_gpu(r, i0, j0, N_active, 0);
+        return;
+    }
+#endif // GPU
+    const double softening2 = r->softening*r->softening;
+    const int nghostx = r->nghostx;
+    const int nghosty = r->nghosty;
+    const int nghostz = r->nghostz;
+    const int N_sources = N_active-j0;
+    // Packed positions and masses of the few active particles stay in the cache.
+    double* const src = malloc(sizeof(double)*4*N_sources);
+    for (int j=0; j<N_sources; j++){
+        src[4*j+0] = particles[j0+j].x;
+        src[4*j+1] = particles[j0+j].y;
+        src[4*j+2] = particles[j0+j].z;
+        src[4*j+3] = particles[j0+j].m;
+    }
+    if (softening2==0. && nghostx==0 && nghosty==0 && nghostz==0){
+        reb_calculate_acceleration_basic_testparticles_loop(r, src, N_sources, i0, 1);
+    }else{
+        reb_calculate_acceleration_basic_testparticles_loop(r, src, N_sources, i0, 0);
+    }
+    free(src);
+}
+
+static void reb_calculate_acceleration_compensated_testparticles(struct reb_simulation* const r, const int i0, const int i1, const int N_active){
+    struct reb_particle* const particles = r->particles;
+    struct reb_vec3d* restrict const cs = r->gravity_cs;
+    const unsigned int gravity_ignore_terms = r->gravity_ignore_terms;
+    const double G = r->G;
+    const double softening2 = r->softening*r->softening;
+#pragma omp parallel for schedule(guided)
+    for (int i=i0; i<i1; i++){
+        // Terms which are ignored for WH integrators (see reb_calculate_acceleration())
+        const int j0 = (gravity_ignore_terms==2 || (gravity_ignore_terms==1 && i==1))?1:0;
+        const double xi = particles[i].x;
+        const double yi = particles[i].y;
+        const double zi = particles[i].z;
+        double ax = 0., csx = 0.;
+        double ay = 0., csy = 0.;
+        double az = 0., csz = 0.;
+        for (int j=j0; j<N_active; j++){
+            const double dx = xi - particles[j].x;
+            const double dy = yi - particles[j].y;
+            const double dz = zi - particles[j].z;
+            const double r2 = dx*dx + dy*dy + dz*dz + softening2;
+            const double _r = sqrt(r2);
+            const double prefact  = G/(r2*_r);
+            const double prefactj = -prefact*particles[j].m;
+
+            const double ix = prefactj*dx;
+            const double yx = ix - csx;
+            const double tx = ax + yx;
+            csx = (tx - ax) - yx;
+            ax = tx;
+
+            const double iy = prefactj*dy;
+            const double yy = iy - csy;
+            const double ty = ay + yy;
+            csy = (ty - ay) - yy;
+            ay = ty;
+
+            const double iz = prefactj*dz;
+            const double yz = iz - csz;
+            const double tz = az + yz;
+            csz = (tz - az) - yz;
+            az = tz;
+        }
+        particles[i].ax = ax; cs[i].x = csx;
+        particles[i].ay = ay; cs[i].y = csy;
+        particles[i].az = az; cs[i].z = csz;
+    }
+}
+
+#ifdef GPU
+void reb_gravity_gpu_free(struct reb_simulation* const r){
+    if (r->gravity_gpu){
+        double* const buffer = r->gravity_gpu;
+        const int N_buffer = 9*r->gravity_gpu_allocatedN;
+#pragma omp target exit data map(delete: buffer[0:N_buffer])
+        free(buffer);
+    }
+    r->gravity_gpu = NULL;
+    r->gravity_gpu_allocatedN = 0;
+}
+
+static void reb_calculate_acceleration_testparticles_gpu(struct reb_simulation* const r, const int i0, const int j0, const int N_active, const int compensated){
+    struct reb_particle* const particles = r->particles;
+    const int N_real = r->N - r->N_var;
+    const int N_tp = N_real-i0;
+    const double G = r->G;
+    const double softening2 = r->softening*r->softening;
+    if (r->gravity_gpu_allocatedN<N_tp){
+        reb_gravity_gpu_free(r);
+        const int N_alloc = N_tp*2;
+        const int N_buffer = 9*N_alloc;
+        double* const buffer = malloc(sizeof(double)*N_buffer);
+#pragma omp target enter data map(alloc: buffer[0:N_buffer])
+        r->gravity_gpu = buffer;
+        r->gravity_gpu_allocatedN = N_alloc;
+    }
+    // Layout: x, y, z, ax, ay, az, csx, csy, csz, each with gravity_gpu_allocatedN entries
+    const int stride = r->gravity_gpu_allocatedN;
+    double* const x  = r->gravity_gpu;
+    double* const y  = r->gravity_gpu + stride;
+    double* const z  = r->gravity_gpu + 2*stride;
+    double* const ax = r->gravity_gpu + 3*stride;
+    double* const ay = r->gravity_gpu + 4*stride;
+    double* const az = r->gravity_gpu + 5*stride;
+    double* const csx = r->gravity_gpu + 6*stride;
+    double* const csy = r->gravity_gpu + 7*stride;
+    double* const csz = r->gravity_gpu + 8*stride;
+#pragma omp parallel for
+    for (int i=0; i<N_tp; i++){
+        x[i] = particles[i0+i].x;
+        y[i] = particles[i0+i].y;
+        z[i] = particles[i0+i].z;
+    }
+#pragma omp target update to(x[0:N_tp], y[0:N_tp], z[0:N_tp])
+
+    // The active particles and the ghost box shifts are few and copied with every call.
+    const int N_sources = N_active-j0;
+    const int N_src = 4*N_sources;
+    double* const src = malloc(sizeof(double)*(N_src+4));
+    for (int j=0; j<N_sources; j++){
+        src[4*j+0] = particles[j0+j].x;
+        src[4*j+1] = particles[j0+j].y;
+        src[4*j+2] = particles[j0+j].z;
+        src[4*j+3] = particles[j0+j].m;
+    }
+    // REB_GRAVITY_COMPENSATED does not use ghost boxes
+    const int N_gb = compensated?1:(2*r->nghostx+1)*(2*r->nghosty+1)*(2*r->nghostz+1);
+    const int N_shifts = 3*N_gb;
+    double* const shifts = calloc(N_shifts, sizeof(double));
+    if (!compensated){
+        const struct reb_ghostbox* const ghostboxes = reb_boundary_ghostboxes(r);
+        for (int g=0; g<N_gb; g++){
+            shifts[3*g+0] = ghostboxes[g].shiftx;
+            shifts[3*g+1] = ghostboxes[g].shifty;
+            shifts[3*g+2] = ghostboxes[g].shiftz;
+        }
+    }
+
+#pragma omp target teams distribute parallel for map(to: src[0:N_src], shifts[0:N_shifts])
+    for (int i=0; i<N_tp; i++){
+        const double xi = x[i];
+        const double yi = y[i];
+        const double zi = z[i];
+        double axi = 0.;
+        double ayi = 0.;
+        double azi = 0.;
+        if (compensated){
+            // Same order of operations as in REB_GRAVITY_COMPENSATED
+            double csxi = 0.;
+            double csyi = 0.;
+            double cszi = 0.;
+            for (int j=0; j<N_sources; j++){
+                const double dx = xi - src[4*j+0];
+                const double dy = yi - src[4*j+1];
+                const double dz = zi - src[4*j+2];
+                const double r2 = dx*dx + dy*dy + dz*dz + softening2;
+                const double _r = sqrt(r2);
+                const double prefact  = G/(r2*_r);
+                const double prefactj = -prefact*src[4*j+3];
+
+                const double ix = prefactj*dx;
+                const double yx = ix - csxi;
+                const double tx = axi + yx;
+                csxi = (tx - axi) - yx;
+                axi = tx;
+
+                const double iy = prefactj*dy;
+                const double yy = iy - csyi;
+                const double ty = ayi + yy;
+                csyi = (ty - ayi) - yy;
+                ayi = ty;
+
+                const double iz = prefactj*dz;
+                const double yz = iz - cszi;
+                const double tz = azi + yz;
+                cszi = (tz - azi) - yz;
+                azi = tz;
+            }
+            csx[i] = csxi;
+            csy[i] = csyi;
+            csz[i] = cszi;
+        }else{
+            // Same order of operations as in REB_GRAVITY_BASIC
+            for (int g=0; g<N_gb; g++){
+            for (int j=0; j<N_sources; j++){
+                const double dx = (shifts[3*g+0]+xi) - src[4*j+0];
+                const double dy = (shifts[3*g+1]+yi) - src[4*j+1];
+                const double dz = (shifts[3*g+2]+zi) - src[4*j+2];
+                const double _r = sqrt(dx*dx + dy*dy + dz*dz + softening2);
+                const double prefact = G/(_r*_r*_r);
+                const double prefactj = -prefact*src[4*j+3];
+                axi += prefactj*dx;
+                ayi += prefactj*dy;
+                azi += prefactj*dz;
+            }
+            }
+        }
+        ax[i] = axi;
+        ay[i] = ayi;
+        az[i] = azi;
+    }
+#pragma omp target update from(ax[0:N_tp], ay[0:N_tp], az[0:N_tp])
+
+#pragma omp parallel for
+    for (int i=0; i<N_tp; i++){
+        particles[i0+i].ax = ax[i];
+        particles[i0+i].ay = ay[i];
+        particles[i0+i].az = az[i];
+    }
+    if (compensated){
+        // The compensation terms are used by IAS15
+#pragma omp target update from(csx[0:N_tp], csy[0:N_tp], csz[0:N_tp])
+        struct reb_vec3d* const cs = r->gravity_cs;
+#pragma omp parallel for
+        for (int i=0; i<N_tp; i++){
+            cs[i0+i].x = csx[i];
+            cs[i0+i].y = csy[i];
+            cs[i0+i].z = csz[i];
+        }
+    }
+    free(shifts);
+    free(src);
+}
+#endif // GPU
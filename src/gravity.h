@@ -44,4 +44,11 @@ void reb_calculate_acceleration_var(struct reb_simulation* r);
   */
 void reb_calculate_and_apply_jerk(struct reb_simulation* r, const double v);
 
+#ifdef GPU
+/**
+  * Frees the buffers used by the GPU version of the gravity routines on the host and on the device.
+  */
+void reb_gravity_gpu_free(struct reb_simulation* const r);
+#endif // GPU
+
 #endif
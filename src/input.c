@@ -35,7 +35,9 @@
 #include "input.h"
 #include "tree.h"
 #include "simulationarchive.h"
+#include "binarydiff.h"
 #include "integrator_tes.h"
+#include "integrator_ias15.h"
 
 #ifdef MPI
 #include "communication_mpi.h"
@@ -54,22 +56,36 @@ static size_t reb_fread(void *restrict ptr, size_t size, size_t nitems, FILE *re
     return 0; 
 }
 
-// The reb_fseek function is currently not used, but provides functionality along the lines of reb_fread
-// static int reb_fseek(FILE *stream, long offset, int whence, char **restrict mem_stream){
-//     if (mem_stream!=NULL){
-//         // read from memory
-//         if (whence==SEEK_CUR){
-//             *mem_stream = (char*)(*mem_stream)+offset;
-//             return 0;
-//         }
-//         return -1;
-//     }else if(stream!=NULL){
-//         // read from file
-//         return fseek(stream,offset,whence);
-//     }
-//     return -1;
-// }
+static int reb_fseek(FILE *stream, long offset, int whence, char **restrict mem_stream){
+    if (mem_stream!=NULL){
+        // read from memory
+        if (whence==SEEK_CUR){
+            *mem_stream = (char*)(*mem_stream)+offset;
+            return 0;
+        }
+        return -1;
+    }else if(stream!=NULL){
+        // read from file
+        return fseek(stream,offset,whence);
+    }
+    return -1;
+}
 
+// Returns 1 if a field of this type belongs to one of the groups in skip.
+// Only integrator state is skipped. Settings are always read.
+static int reb_input_field_skipped(const uint32_t type, const unsigned int skip){
+    if (skip & REB_INPUT_SKIP_IAS15){
+        if (type>=REB_BINARY_FIELD_TYPE_IAS15_ALLOCATEDN && type<=REB_BINARY_FIELD_TYPE_IAS15_ER){
+            return 1;
+        }
+    }
+    if (skip & REB_INPUT_SKIP_TES){
+        if (type>=REB_BINARY_FIELD_TYPE_TES_ALLOCATED_N && type<=REB_BINARY_FIELD_TYPE_TES_DHEM_RECTI_PERIOD){
+            return 1;
+        }
+    }
+    return 0;
+}
 
 void reb_read_dp7(struct reb_dp7* dp7, const int N3, FILE* inf, char **restrict mem_stream){
     reb_fread(dp7->p0,sizeof(double),N3,inf,mem_stream);
@@ -97,13 +113,7 @@ void reb_read_dp7(struct reb_dp7* dp7, const int N3, FILE* inf, char **restrict
 
 #define CASE_MALLOC_DP7(typename, valueref) case REB_BINARY_FIELD_TYPE_##typename: \
     {\
-        valueref.p0 = malloc(field.size/7);\
-        valueref.p1 = malloc(field.size/7);\
-        valueref.p2 = malloc(field.size/7);\
-        valueref.p3 = malloc(field.size/7);\
-        valueref.p4 = malloc(field.size/7);\
-        valueref.p5 = malloc(field.size/7);\
-        valueref.p6 = malloc(field.size/7);\
+        reb_integrator_ias15_alloc_dp7(&(valueref), field.size/7/sizeof(double));\
         reb_fread(valueref.p0, field.size/7,1,inf,mem_stream);\
         reb_fread(valueref.p1, field.size/7,1,inf,mem_stream);\
         reb_fread(valueref.p2, field.size/7,1,inf,mem_stream);\
@@ -140,11 +150,23 @@ void reb_read_dp7(struct reb_dp7* dp7, const int N3, FILE* inf, char **restrict
     break;        
     
 int reb_input_field(struct reb_simulation* r, FILE* inf, enum reb_input_binary_messages* warnings, char **restrict mem_stream){
+    return reb_input_field_with_skip(r, inf, warnings, mem_stream, REB_INPUT_SKIP_NONE);
+}
+
+int reb_input_field_with_skip(struct reb_simulation* r, FILE* inf, enum reb_input_binary_messages* warnings, char **restrict mem_stream, unsigned int skip){
     struct reb_binary_field field;
     int numread = reb_fread(&field,sizeof(struct reb_binary_field),1,inf,mem_stream);
     if (numread<1){
         return 0; // End of file
     }
+    if (skip && reb_input_field_skipped(field.type, skip)){
+        // Jump over the payload without allocating or copying anything.
+        if (reb_fseek(inf, field.size, SEEK_CUR, mem_stream)){
+            *warnings |= REB_INPUT_BINARY_WARNING_CORRUPTFILE;
+            return 0;
+        }
+        return 1;
+    }
     switch (field.type){
         CASE(T,                  &r->t);
         CASE(G,                  &r->G);
@@ -159,6 +181,7 @@ int reb_input_field(struct reb_simulation* r, FILE* inf, enum reb_input_binary_m
         CASE(TESTPARTICLEHIDEWARNINGS,   &r->testparticle_hidewarnings);
         CASE(HASHCTR,            &r->hash_ctr);
         CASE(OPENINGANGLE2,      &r->opening_angle2);
+        CASE(GRAVITYFMMORDER,    &r->gravity_fmm_order);
         CASE(STATUS,             &r->status);
         CASE(EXACTFINISHTIME,    &r->exact_finish_time);
         CASE(FORCEISVELOCITYDEP, &r->force_is_velocity_dependent);
@@ -168,6 +191,7 @@ int reb_input_field(struct reb_simulation* r, FILE* inf, enum reb_input_binary_m
         CASE(EXITMAXDISTANCE,    &r->exit_max_distance);
         CASE(EXITMINDISTANCE,    &r->exit_min_distance);
         CASE(USLEEP,             &r->usleep);
+        CASE(DISPLAYSTRIDE,      &r->display_stride);
         CASE(TRACKENERGYOFFSET,  &r->track_energy_offset);
         CASE(ENERGYOFFSET,       &r->energy_offset);
         CASE(BOXSIZE,            &r->boxsize);
@@ -185,6 +209,35 @@ int reb_input_field(struct reb_simulation* r, FILE* inf, enum reb_input_binary_m
         CASE(COLLISIONSPLOG,     &r->collisions_plog);
         CASE(MAXRADIUS,          &r->max_radius);
         CASE(COLLISIONSNLOG,     &r->collisions_Nlog);
+        CASE(COLLISIONSKIPTESTPARTICLEPAIRS, &r->collision_skip_testparticle_pairs);
+        CASE(COLLISIONGRIDCELLSIZE, &r->collision_grid_cellsize);
+        CASE(COLLISIONRESOLVEPARALLEL, &r->collision_resolve_parallel);
+        CASE(COLLISIONSKIN,      &r->collision_skin);
+        CASE(TRACKCOLLISIONSTATISTICS, &r->track_collision_statistics);
+        CASE(COLLISIONTIMEOFIMPACT, &r->collision_time_of_impact);
+        CASE(COLLISIONLINEHERMITE, &r->collision_line_hermite);
+        CASE(COLLISIONLINEIAS15, &r->collision_line_ias15);
+        CASE(SLEEPV,             &r->sleep_v);
+        CASE(SLEEPA,             &r->sleep_a);
+        CASE(SLEEPSTEPS,         &r->sleep_steps);
+        CASE(COMPACTPRECISION,   &r->compact.precision);
+        CASE(COMPACTNREMOVED,    &r->compact.N_removed);
+        CASE(INJECTRATE,         &r->inject_rate);
+        CASE(INJECTCARRY,        &r->inject_carry);
+        CASE(INJECTPOOL,         &r->inject_pool);
+        CASE(NINJECTED,          &r->N_injected);
+        CASE(SAFULLEVERY,        &r->simulationarchive_full_every);
+        CASE(SAFULLCOUNTER,      &r->simulationarchive_full_counter);
+        CASE(SAFULLT,            &r->simulationarchive_full_t);
+        CASE(GRAVITYDETERMINISTIC, &r->gravity_deterministic);
+        CASE(GRAVITYTREEFARFIELD, &r->gravity_tree_far_field);
+        CASE(TREEREBUILD, &r->tree_rebuild);
+        CASE(SPATIALSORTINTERVAL, &r->spatial_sort_interval);
+        CASE(USESOA, &r->use_soa);
+        CASE(SAASYNC, &r->simulationarchive_async);
+        CASE(SACOMPRESS, &r->simulationarchive_compress);
+        CASE(TREEACTIVEONLY, &r->tree_active_only);
+        CASE(TREEGROUPSIZE, &r->tree_group_size);
         CASE(CALCULATEMEGNO,     &r->calculate_megno);
         CASE(MEGNOYS,            &r->megno_Ys);
         CASE(MEGNOYSS,           &r->megno_Yss);
@@ -216,6 +269,8 @@ int reb_input_field(struct reb_simulation* r, FILE* inf, enum reb_input_binary_m
         CASE(WHFAST_RECALCJAC,   &r->ri_whfast.recalculate_coordinates_this_timestep);
         CASE(WHFAST_SAFEMODE,    &r->ri_whfast.safe_mode);
         CASE(WHFAST_KEEPUNSYNC,  &r->ri_whfast.keep_unsynchronized);
+        CASE(WHFAST_TPPARTITIONS, &r->ri_whfast.testparticle_partitions);
+        CASE(WHFAST_KEPLERWARMSTART, &r->ri_whfast.kepler_warmstart);
         CASE(WHFAST_ISSYNCHRON,  &r->ri_whfast.is_synchronized);
         CASE(WHFAST_TIMESTEPWARN,&r->ri_whfast.timestep_warning);
         CASE(WHFAST_COORDINATES, &r->ri_whfast.coordinates);
@@ -224,6 +279,11 @@ int reb_input_field(struct reb_simulation* r, FILE* inf, enum reb_input_binary_m
         CASE(IAS15_EPSILONGLOBAL,&r->ri_ias15.epsilon_global);
         CASE(IAS15_ITERATIONSMAX,&r->ri_ias15.iterations_max_exceeded);
         CASE(IAS15_DTMODE,       &r->ri_ias15.dt_mode);
+        CASE(IAS15_TPSUBSTEPS,   &r->ri_ias15.testparticle_substeps);
+        CASE(IAS15_TPCOMPENSATED, &r->ri_ias15.testparticle_compensated);
+        CASE(BLOCK_ETA,          &r->ri_block.eta);
+        CASE(BLOCK_MAXLEVEL,     &r->ri_block.max_level);
+        CASE(BLOCK_PARTICLESTEPS,&r->ri_block.particle_steps);
         CASE(IAS15_ALLOCATEDN,   &r->ri_ias15.allocatedN);
         CASE(JANUS_SCALEPOS,     &r->ri_janus.scale_pos);
         CASE(JANUS_SCALEVEL,     &r->ri_janus.scale_vel);
@@ -232,6 +292,8 @@ int reb_input_field(struct reb_simulation* r, FILE* inf, enum reb_input_binary_m
         CASE(JANUS_RECALC,       &r->ri_janus.recalculate_integer_coordinates_this_timestep);
         CASE(MERCURIUS_HILLFAC,  &r->ri_mercurius.hillfac);
         CASE(MERCURIUS_SAFEMODE, &r->ri_mercurius.safe_mode);
+        CASE(MERCURIUS_SPLITTPONLY, &r->ri_mercurius.split_tponly_encounters);
+        CASE(MERCURIUS_KEPLERWARMSTART, &r->ri_mercurius.kepler_warmstart);
         CASE(MERCURIUS_ISSYNCHRON, &r->ri_mercurius.is_synchronized);
         CASE(MERCURIUS_RECALCULATE_COORD, &r->ri_mercurius.recalculate_coordinates_this_timestep);
         CASE(MERCURIUS_COMPOS,   &r->ri_mercurius.com_pos);
@@ -297,12 +359,68 @@ int reb_input_field(struct reb_simulation* r, FILE* inf, enum reb_input_binary_m
                 r->particles[l].ap = NULL;
                 r->particles[l].sim = r;
             }
-            if (r->gravity==REB_GRAVITY_TREE || r->collision==REB_COLLISION_TREE || r->collision==REB_COLLISION_LINETREE){
+            reb_frozen_recount(r);
+            if (((r->gravity==REB_GRAVITY_TREE || r->gravity==REB_GRAVITY_FMM) && !reb_tree_active_only(r)) || r->collision==REB_COLLISION_TREE || r->collision==REB_COLLISION_LINETREE){
                 for (int l=0;l<r->allocatedN;l++){
                     reb_tree_add_particle_to_tree(r, l);
                 }
             }
             break;
+        case REB_BINARY_FIELD_TYPE_PARTICLES_XOR:
+            {
+                // Particles encoded against the particles of the first snapshot, which are already loaded.
+                char* enc = malloc(field.size);
+                reb_fread(enc, field.size,1,inf,mem_stream);
+                const size_t size = r->allocatedN*sizeof(struct reb_particle);
+                if (!r->particles || !reb_binary_xor_decode(enc, field.size, (char*)r->particles, size)){
+                    if (warnings){
+                        *warnings |= REB_INPUT_BINARY_WARNING_CORRUPTFILE;
+                    }
+                    free(enc);
+                    break;
+                }
+                free(enc);
+                for (int l=0;l<r->allocatedN;l++){
+                    r->particles[l].c = NULL;
+                    r->particles[l].ap = NULL;
+                    r->particles[l].sim = r;
+                }
+                reb_frozen_recount(r);
+                if (((r->gravity==REB_GRAVITY_TREE || r->gravity==REB_GRAVITY_FMM) && !reb_tree_active_only(r)) || r->collision==REB_COLLISION_TREE || r->collision==REB_COLLISION_LINETREE){
+                    for (int l=0;l<r->allocatedN;l++){
+                        reb_tree_add_particle_to_tree(r, l);
+                    }
+                }
+            }
+            break;
+        case REB_BINARY_FIELD_TYPE_COMPACTORIGIN:
+            free(r->compact.origin);
+            r->compact.origin = malloc(field.size);
+            reb_fread(r->compact.origin, field.size,1,inf,mem_stream);
+            break;
+        case REB_BINARY_FIELD_TYPE_COMPACTXYZ:
+            // Determines the number of compact test particles.
+            free(r->compact.xyz);
+            r->compact.N = (int)(field.size/(3*sizeof(float)));
+            r->compact.allocatedN = r->compact.N;
+            r->compact.xyz = malloc(field.size);
+            reb_fread(r->compact.xyz, field.size,1,inf,mem_stream);
+            break;
+        case REB_BINARY_FIELD_TYPE_COMPACTVXYZ:
+            free(r->compact.vxyz);
+            r->compact.vxyz = malloc(field.size);
+            reb_fread(r->compact.vxyz, field.size,1,inf,mem_stream);
+            break;
+        case REB_BINARY_FIELD_TYPE_COMPACTR:
+            free(r->compact.r);
+            r->compact.r = malloc(field.size);
+            reb_fread(r->compact.r, field.size,1,inf,mem_stream);
+            break;
+        case REB_BINARY_FIELD_TYPE_COMPACTHASH:
+            free(r->compact.hash);
+            r->compact.hash = malloc(field.size);
+            reb_fread(r->compact.hash, field.size,1,inf,mem_stream);
+            break;
         case REB_BINARY_FIELD_TYPE_WHFAST_PJ:
             if(r->ri_whfast.p_jh){
                 free(r->ri_whfast.p_jh);
@@ -313,6 +431,15 @@ int reb_input_field(struct reb_simulation* r, FILE* inf, enum reb_input_binary_m
                 reb_fread(r->ri_whfast.p_jh, field.size,1,inf,mem_stream);
             }
             break;
+        case REB_BINARY_FIELD_TYPE_WHFAST_KEPLERGUESS:
+            // Same size as p_jh.
+            free(r->ri_whfast.kepler_guess);
+            r->ri_whfast.kepler_guess = NULL;
+            if (field.size){
+                r->ri_whfast.kepler_guess = malloc(field.size);
+                reb_fread(r->ri_whfast.kepler_guess, field.size,1,inf,mem_stream);
+            }
+            break;
         case REB_BINARY_FIELD_TYPE_JANUS_PINT:
             if(r->ri_janus.p_int){
                 free(r->ri_janus.p_int);
@@ -340,11 +467,22 @@ int reb_input_field(struct reb_simulation* r, FILE* inf, enum reb_input_binary_m
                 free(r->ri_mercurius.dcrit);
             }
             r->ri_mercurius.dcrit_allocatedN = (int)(field.size/sizeof(double));
+            // The file might contain particles which were added after the last timestep.
+            r->ri_mercurius.dcrit_pending = 1;
             if (field.size){
                 r->ri_mercurius.dcrit = malloc(field.size);
                 reb_fread(r->ri_mercurius.dcrit, field.size,1,inf,mem_stream);
             }
             break;
+        case REB_BINARY_FIELD_TYPE_MERCURIUS_KEPLERGUESS:
+            free(r->ri_mercurius.kepler_guess);
+            r->ri_mercurius.kepler_guess = NULL;
+            r->ri_mercurius.kepler_guess_allocatedN = (int)(field.size/sizeof(double));
+            if (field.size){
+                r->ri_mercurius.kepler_guess = malloc(field.size);
+                reb_fread(r->ri_mercurius.kepler_guess, field.size,1,inf,mem_stream);
+            }
+            break;
         CASE_MALLOC(IAS15_AT,     r->ri_ias15.at);
         CASE_MALLOC(IAS15_X0,     r->ri_ias15.x0);
         CASE_MALLOC(IAS15_V0,     r->ri_ias15.v0);
@@ -496,6 +634,14 @@ int reb_input_field(struct reb_simulation* r, FILE* inf, enum reb_input_binary_m
         CASE(WHFAST512_GRPOTENTIAL, &r->ri_whfast512.gr_potential);
         CASE(WHFAST512_PJH, r->ri_whfast512.p_jh);
         CASE(WHFAST512_PJH0, &r->ri_whfast512.p_jh0);
+        case REB_BINARY_FIELD_TYPE_WHFAST512_ALLOCATEDNTP:
+            reb_fread(&r->ri_whfast512.allocated_N_testparticles, field.size, 1, inf, mem_stream);
+            if(r->ri_whfast512.p_jh_tp){
+                free(r->ri_whfast512.p_jh_tp);
+            }
+            r->ri_whfast512.p_jh_tp = aligned_alloc(64,sizeof(struct reb_particle_avx512)*((r->ri_whfast512.allocated_N_testparticles+7)/8));
+            break;
+        CASE(WHFAST512_PJHTP, r->ri_whfast512.p_jh_tp);
     }
     return 1;
 } 
@@ -545,6 +691,10 @@ struct reb_simulation* reb_input_process_warnings(struct reb_simulation* r, enum
 }
 
 struct reb_simulation* reb_create_simulation_from_binary(char* filename){
+    return reb_create_simulation_from_binary_with_skip(filename, REB_INPUT_SKIP_NONE);
+}
+
+struct reb_simulation* reb_create_simulation_from_binary_with_skip(char* filename, unsigned int skip){
     enum reb_input_binary_messages warnings = REB_INPUT_BINARY_WARNING_NONE;
     struct reb_simulation* r = reb_create_simulation();
     
@@ -557,9 +707,77 @@ struct reb_simulation* reb_create_simulation_from_binary(char* filename){
     }else{
         reb_input_process_warnings(NULL, warnings);
     }
-    reb_create_simulation_from_simulationarchive_with_messages(r, sa, -1, &warnings);
+    reb_create_simulation_from_simulationarchive_with_skip(r, sa, -1, skip, &warnings);
     reb_close_simulationarchive(sa);
     r = reb_input_process_warnings(r, warnings);
     return r;
 }
 
+#ifdef MPI
+struct reb_simulation* reb_create_simulation_from_binary_mpi(char* filename){
+    enum reb_input_binary_messages warnings = REB_INPUT_BINARY_WARNING_NONE;
+    FILE* inf = fopen(filename,"rb");
+    if (inf==NULL){
+        return NULL;
+    }
+    struct reb_simulation* r = reb_create_simulation();
+    r->simulationarchive_version = 0;
+
+    // Every node reads all fields except for the particle data. 
+    long particles_offset = -1;
+    long N_tot = 0;
+    while(1){
+        struct reb_binary_field field;
+        if (fread(&field,sizeof(struct reb_binary_field),1,inf)!=1 || field.type==REB_BINARY_FIELD_TYPE_END){
+            break;
+        }
+        if (field.type==REB_BINARY_FIELD_TYPE_PARTICLES){
+            particles_offset = ftell(inf);
+            N_tot = field.size/sizeof(struct reb_particle);
+            fseek(inf, field.size, SEEK_CUR);
+        }else{
+            fseek(inf, -(long)sizeof(struct reb_binary_field), SEEK_CUR);
+            if (!reb_input_field(r, inf, &warnings, NULL)){
+                break;
+            }
+        }
+    }
+    fclose(inf);
+    if (particles_offset<0){
+        warnings |= REB_INPUT_BINARY_WARNING_PARTICLES;
+    }
+    r->N = 0;
+    // Domain decomposition uses the root boxes read from the file.
+    reb_mpi_init(r);
+
+    // Each node reads an equal share of the particles and sends them to 
+    // the node owning their root box.
+    const long start = N_tot*r->mpi_id/r->mpi_num;
+    const long end = N_tot*(r->mpi_id+1)/r->mpi_num;
+    const int N_local = end-start;
+    struct reb_particle* particles = malloc(sizeof(struct reb_particle)*(N_local?N_local:1));
+    MPI_File fh;
+    if (particles_offset<0){
+        // Nothing to read. Warning already set.
+    }else if (MPI_File_open(MPI_COMM_WORLD, filename, MPI_MODE_RDONLY, MPI_INFO_NULL, &fh)!=MPI_SUCCESS){
+        warnings |= REB_INPUT_BINARY_ERROR_FILENOTOPEN;
+    }else{
+        MPI_Datatype mpi_particle;
+        MPI_Type_contiguous(sizeof(struct reb_particle), MPI_CHAR, &mpi_particle);
+        MPI_Type_commit(&mpi_particle);
+        MPI_File_read_at_all(fh, particles_offset+sizeof(struct reb_particle)*start, particles, N_local, mpi_particle, MPI_STATUS_IGNORE);
+        MPI_Type_free(&mpi_particle);
+        MPI_File_close(&fh);
+        for (int l=0;l<N_local;l++){
+            particles[l].c = NULL;
+            particles[l].ap = NULL;
+            particles[l].sim = r;
+            reb_add(r, particles[l]);
+        }
+        reb_communication_mpi_distribute_particles(r);
+    }
+    free(particles);
+    r = reb_input_process_warnings(r, warnings);
+    return r;
+}
+#endif // MPI
@@ -26,6 +26,7 @@
 
 void reb_read_dp7(struct reb_dp7* dp7, const int N3, FILE* inf, char **restrict mem_stream); ///< Internal function to read dp7 structs from file.
 int reb_input_field(struct reb_simulation* r, FILE* inf, enum reb_input_binary_messages* warnings, char **restrict mem_stream); ///< Read one field from inf stream into r. 
+int reb_input_field_with_skip(struct reb_simulation* r, FILE* inf, enum reb_input_binary_messages* warnings, char **restrict mem_stream, unsigned int skip); ///< Same as reb_input_field but jumps over fields in the groups given by skip (see enum REB_INPUT_SKIP).
 
 struct reb_simulation* reb_input_process_warnings(struct reb_simulation* r, enum reb_input_binary_messages warnings); ///< Process warning messages and print them on screen.
 
@@ -37,6 +37,9 @@
 #include "gravity.h"
 #include "output.h"
 #include "integrator.h"
+#include "profiling.h"
+#include "tools.h"
+#include "ephemeris.h"
 #include "integrator_whfast.h"
 #include "integrator_whfast512.h"
 #include "integrator_saba.h"
@@ -48,6 +51,9 @@
 #include "integrator_eos.h"
 #include "integrator_bs.h"
 #include "integrator_tes.h"
+#include "integrator_block.h"
+#include "boundary.h"
+#include "particle.h"
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define MIN(a, b) ((a) > (b) ? (b) : (a))   ///< Returns the minimum of a and b
 
@@ -86,7 +92,59 @@ void reb_integrator_part1(struct reb_simulation* r){
 		case REB_INTEGRATOR_TES:
 			reb_integrator_tes_part1(r);
 			break;
+		case REB_INTEGRATOR_BLOCK:
+			reb_integrator_block_part1(r);
+			break;
+		default:
+			break;
+	}
+}
+
+int reb_integrator_drift_applies_boundary(const struct reb_simulation* const r){
+	if (!reb_boundary_can_wrap(r)){
+		return 0;
+	}
+	switch(r->integrator){
+		case REB_INTEGRATOR_LEAPFROG:
+		case REB_INTEGRATOR_SEI:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+void reb_integrator_part1_boundary(struct reb_simulation* r){
+	switch(r->integrator){
+		case REB_INTEGRATOR_LEAPFROG:
+			reb_integrator_leapfrog_part1_boundary(r);
+			break;
+		case REB_INTEGRATOR_SEI:
+			reb_integrator_sei_part1_boundary(r);
+			break;
+		default:
+			reb_integrator_part1(r);
+			reb_boundary_check(r);
+			break;
+	}
+}
+
+void reb_integrator_part2_boundary(struct reb_simulation* r){
+	if (r->odes_N){
+		// Other ODEs need to be integrated before particles are shifted.
+		reb_integrator_part2(r);
+		reb_boundary_check(r);
+		return;
+	}
+	switch(r->integrator){
+		case REB_INTEGRATOR_LEAPFROG:
+			reb_integrator_leapfrog_part2_boundary(r);
+			break;
+		case REB_INTEGRATOR_SEI:
+			reb_integrator_sei_part2_boundary(r);
+			break;
 		default:
+			reb_integrator_part2(r);
+			reb_boundary_check(r);
 			break;
 	}
 }
@@ -125,6 +183,9 @@ void reb_integrator_part2(struct reb_simulation* r){
 			break;
 		case REB_INTEGRATOR_TES:
 			reb_integrator_tes_part2(r);
+			break;
+		case REB_INTEGRATOR_BLOCK:
+			reb_integrator_block_part2(r);
 			break;			
         case REB_INTEGRATOR_NONE:
             r->t += r->dt;
@@ -168,6 +229,8 @@ void reb_integrator_part2(struct reb_simulation* r){
 }
 	
 void reb_integrator_synchronize(struct reb_simulation* r){
+    // The integrators' internal coordinates do not include frozen particles.
+    const int frozen_hidden = reb_frozen_hide(r);
 	switch(r->integrator){
 		case REB_INTEGRATOR_IAS15:
 			reb_integrator_ias15_synchronize(r);
@@ -201,10 +264,130 @@ void reb_integrator_synchronize(struct reb_simulation* r){
 			break;
 		case REB_INTEGRATOR_TES:
 			reb_integrator_tes_synchronize(r);
+			break;
+		case REB_INTEGRATOR_BLOCK:
+			reb_integrator_block_synchronize(r);
 			break;				
 		default:
 			break;
 	}
+    if (frozen_hidden){
+        reb_frozen_restore(r);
+    }
+}
+
+// Returns 1 if r->particles do not contain the synchronized state.
+static int reb_integrator_needs_synchronize(struct reb_simulation* const r){
+    switch(r->integrator){
+        case REB_INTEGRATOR_WHFAST:
+            return r->ri_whfast.is_synchronized==0;
+        case REB_INTEGRATOR_WHFAST512:
+            return r->ri_whfast512.is_synchronized==0;
+        case REB_INTEGRATOR_SABA:
+            return r->ri_saba.is_synchronized==0;
+        case REB_INTEGRATOR_MERCURIUS:
+            return r->ri_mercurius.is_synchronized==0;
+        case REB_INTEGRATOR_EOS:
+            return r->ri_eos.is_synchronized==0;
+        case REB_INTEGRATOR_JANUS:
+        case REB_INTEGRATOR_TES:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// WHFast with test particles of type 0: the massive bodies do not depend on the test particles
+// and every test particle only depends on the massive bodies. Only the massive bodies and the 
+// requested test particles need to be synchronized. This is done on a shallow copy of the 
+// simulation with its own particle and Jacobi arrays. 
+static int reb_integrator_whfast_synchronize_particles(struct reb_simulation* const r, const int* const indices, const int N_indices, struct reb_particle* const particles_out){
+    const int N_active = r->N_active;
+    const int N_sub = N_active + N_indices;
+    struct reb_simulation* const s = malloc(sizeof(struct reb_simulation));
+    memcpy(s, r, sizeof(struct reb_simulation));
+    s->particles = malloc(sizeof(struct reb_particle)*N_sub);
+    s->ri_whfast.p_jh = reb_tools_realloc_aligned(NULL, sizeof(struct reb_particle), 0, N_sub);
+    memcpy(s->particles, r->particles, sizeof(struct reb_particle)*N_active);
+    memcpy(s->ri_whfast.p_jh, r->ri_whfast.p_jh, sizeof(struct reb_particle)*N_active);
+    int N = N_active;
+    for (int k=0;k<N_indices;k++){
+        const int i = indices[k];
+        if (i>=N_active){
+            s->particles[N] = r->particles[i];
+            s->ri_whfast.p_jh[N] = r->ri_whfast.p_jh[i];
+            N++;
+        }
+    }
+    s->N = N;
+    s->allocatedN = N_sub;
+    s->ri_whfast.allocated_N = N;
+    s->ri_whfast.keep_unsynchronized = 0;
+    s->ri_whfast.testparticle_partitions = 0;
+    s->ri_whfast.kepler_warmstart = 0;
+    s->ri_whfast.kepler_guess = NULL;
+
+    reb_integrator_whfast_synchronize(s);
+
+    N = N_active;
+    for (int k=0;k<N_indices;k++){
+        const int i = indices[k];
+        particles_out[k] = s->particles[(i<N_active)?i:N++];
+        particles_out[k].sim = r;
+    }
+    // Scratch buffers might have been (re)allocated by the force calculation of the correctors. 
+    r->messages = s->messages;
+    r->gravity_cs = s->gravity_cs;
+    r->gravity_cs_allocatedN = s->gravity_cs_allocatedN;
+    r->particles_soa = s->particles_soa;
+    r->particles_soa_allocatedN = s->particles_soa_allocatedN;
+    r->gravity_gpu = s->gravity_gpu;
+    r->gravity_gpu_allocatedN = s->gravity_gpu_allocatedN;
+    r->ri_whfast.p_temp = s->ri_whfast.p_temp;
+    r->ri_whfast.allocated_Ntemp = s->ri_whfast.allocated_Ntemp;
+    free(s->particles);
+    free(s->ri_whfast.p_jh);
+    free(s);
+    return 0;
+}
+
+int reb_integrator_synchronize_particles(struct reb_simulation* const r, const int* const indices, const int N_indices, struct reb_particle* const particles_out){
+    for (int k=0;k<N_indices;k++){
+        if (indices[k]<0 || indices[k]>=r->N){
+            reb_error(r, "Particle index out of range in reb_integrator_synchronize_particles().");
+            return 1;
+        }
+    }
+    if (!reb_integrator_needs_synchronize(r)){
+        for (int k=0;k<N_indices;k++){
+            particles_out[k] = r->particles[indices[k]];
+        }
+        return 0;
+    }
+    if (r->integrator==REB_INTEGRATOR_WHFAST 
+            && r->N_active>0 && r->N_active<r->N && r->testparticle_type==0
+            && r->N_var==0 && r->N_frozen==0 && r->ri_whfast.allocated_N==(unsigned int)r->N
+            && r->additional_forces==NULL && r->additional_forces_soa==NULL && r->ephemeris==NULL
+            && (r->gravity==REB_GRAVITY_BASIC || r->gravity==REB_GRAVITY_COMPENSATED || r->gravity==REB_GRAVITY_JACOBI || r->gravity==REB_GRAVITY_NONE)){
+        return reb_integrator_whfast_synchronize_particles(r, indices, N_indices, particles_out);
+    }
+    // General case: synchronize a copy of the simulation.
+    struct reb_simulation* const c = reb_copy_simulation(r);
+    c->additional_forces = r->additional_forces;
+    c->additional_forces_soa = r->additional_forces_soa;
+    c->ri_mercurius.L = r->ri_mercurius.L;
+    c->extras = r->extras;
+    c->messages = r->messages;
+    reb_integrator_synchronize(c);
+    r->messages = c->messages;
+    for (int k=0;k<N_indices;k++){
+        particles_out[k] = c->particles[indices[k]];
+        particles_out[k].sim = r;
+    }
+    c->extras = NULL;
+    c->messages = NULL;
+    reb_free_simulation(c);
+    return 0;
 }
 
 void reb_integrator_init(struct reb_simulation* r){
@@ -231,17 +414,56 @@ void reb_integrator_reset(struct reb_simulation* r){
 	reb_integrator_eos_reset(r);
 	reb_integrator_bs_reset(r);
 	reb_integrator_tes_reset(r);
+	reb_integrator_block_reset(r);
+}
+
+void reb_calculate_additional_forces(struct reb_simulation* r){
+    if (r->additional_forces){
+        r->additional_forces(r);
+    }
+    if (r->additional_forces_soa){
+        const int N = r->N - r->N_var;
+        if (N<=0){
+            return;
+        }
+        if (N>r->additional_forces_soa_allocatedN){
+            r->additional_forces_soa_buffer = realloc(r->additional_forces_soa_buffer, sizeof(double)*9*N);
+            r->additional_forces_soa_allocatedN = N;
+        }
+        double* const pos = r->additional_forces_soa_buffer;
+        double* const vel = pos + 3*N;
+        double* const acc = pos + 6*N;
+        struct reb_particle* const particles = r->particles;
+        for (int i=0;i<N;i++){
+            pos[i]     = particles[i].x;
+            pos[N+i]   = particles[i].y;
+            pos[2*N+i] = particles[i].z;
+            vel[i]     = particles[i].vx;
+            vel[N+i]   = particles[i].vy;
+            vel[2*N+i] = particles[i].vz;
+        }
+        memset(acc, 0, sizeof(double)*3*N);
+        r->additional_forces_soa(r, N, pos, vel, acc);
+        for (int i=0;i<N;i++){
+            particles[i].ax += acc[i];
+            particles[i].ay += acc[N+i];
+            particles[i].az += acc[2*N+i];
+        }
+    }
 }
 
 void reb_update_acceleration(struct reb_simulation* r){
 	// This should probably go elsewhere
-	PROFILING_STOP(PROFILING_CAT_INTEGRATOR)
-	PROFILING_START()
+	if (r->ephemeris){
+		reb_ephemeris_update_particles(r);
+	}
+	reb_profiling_start(r, REB_PROFILING_GRAVITY);
 	reb_calculate_acceleration(r);
 	if (r->N_var){
 		reb_calculate_acceleration_var(r);
 	}
-	if (r->additional_forces  && (r->integrator != REB_INTEGRATOR_MERCURIUS || r->ri_mercurius.mode==0)){
+	reb_profiling_stop(r, REB_PROFILING_GRAVITY);
+	if ((r->additional_forces || r->additional_forces_soa) && (r->integrator != REB_INTEGRATOR_MERCURIUS || r->ri_mercurius.mode==0)){
         // For Mercurius:
         // Additional forces are only calculated in the kick step, not during close encounter
         if (r->integrator==REB_INTEGRATOR_MERCURIUS){
@@ -254,7 +476,9 @@ void reb_update_acceleration(struct reb_simulation* r){
             memcpy(r->ri_mercurius.particles_backup_additionalforces,r->particles,r->N*sizeof(struct reb_particle)); 
             reb_integrator_mercurius_dh_to_inertial(r);
         }
-        r->additional_forces(r);
+        reb_profiling_start(r, REB_PROFILING_ADDITIONAL_FORCES);
+        reb_calculate_additional_forces(r);
+        reb_profiling_stop(r, REB_PROFILING_ADDITIONAL_FORCES);
         if (r->integrator==REB_INTEGRATOR_MERCURIUS){
             struct reb_particle* restrict const particles = r->particles;
             struct reb_particle* restrict const backup = r->ri_mercurius.particles_backup_additionalforces;
@@ -268,7 +492,8 @@ void reb_update_acceleration(struct reb_simulation* r){
             }
         }
     }
-	PROFILING_STOP(PROFILING_CAT_GRAVITY)
-	PROFILING_START()
+	if (r->ephemeris){
+		reb_ephemeris_update_accelerations(r);
+	}
 }
 
@@ -43,6 +43,27 @@ void reb_integrator_part1(struct reb_simulation* r);
  */
 void reb_integrator_part2(struct reb_simulation* r);
 
+/**
+ * @brief Returns 1 if the integrator can apply the boundary conditions during its drift steps.
+ * @details This is the case for the leapfrog and SEI integrators with periodic
+ * or shear boundary conditions.
+ */
+int reb_integrator_drift_applies_boundary(const struct reb_simulation* const r);
+
+/**
+ * @brief Same as reb_integrator_part1() followed by reb_boundary_check().
+ * @details Integrators for which reb_integrator_drift_applies_boundary() 
+ * returns 1 shift particles back into the box in the same loop as the 
+ * drift, saving one pass over all particles.
+ */
+void reb_integrator_part1_boundary(struct reb_simulation* r);
+
+/**
+ * @brief Same as reb_integrator_part2() followed by reb_boundary_check().
+ * @details See reb_integrator_part1_boundary().
+ */
+void reb_integrator_part2_boundary(struct reb_simulation* r);
+
 /** 
  * @brief This function is used to initialize constants in some integrators. 
  * @details The function doesn't need to be called. Integrators will call it
@@ -51,4 +72,12 @@ void reb_integrator_part2(struct reb_simulation* r);
  * set before a binary file is outputted.
  */
 void reb_integrator_init(struct reb_simulation* r);
+
+/**
+ * @brief Calls the additional_forces and additional_forces_soa callbacks, if set.
+ * @details For additional_forces_soa, positions and velocities are copied
+ * into a staging buffer in structure of arrays layout and the 
+ * accelerations returned by the callback are added to the particles.
+ */
+void reb_calculate_additional_forces(struct reb_simulation* r);
 #endif
@@ -0,0 +1,268 @@
+/**
+ * @file    integrator_block.c
+ * @brief   Hierarchical block timestep integrator.
+ * @author  Hanno Rein <hanno@hanno-rein.de>
+ * @details This file implements a fourth order Hermite integrator with
+ * individual block timesteps. Every particle is assigned a level n and
+ * uses the timestep dt/2^n. The level is chosen with a criterion based
+ * on the acceleration and jerk of the particle. Within one timestep dt,
+ * only the particles which are due at a given substep are advanced.
+ * All other particles are predicted to the time of the substep using
+ * a Taylor series. At the end of every timestep dt all particles are
+ * synchronized. This is well suited for simulations in which only a
+ * small fraction of the particles requires short timesteps.
+ * Forces are calculated with direct summation.
+ *
+ * @section LICENSE
+ * Copyright (c) 2023 Hanno Rein
+ *
+ * This file is part of rebound.
+ *
+ * rebound is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rebound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rebound.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "rebound.h"
+#include "integrator_block.h"
+
+#define REB_INTEGRATOR_BLOCK_MAX_LEVEL 52 ///< Levels beyond this do not make sense in double precision
+
+// Calculates the acceleration and jerk of particle i using the predicted particles p as sources.
+// Only the first N_sources particles contribute to the force.
+static void reb_integrator_block_acceleration_jerk(const struct reb_simulation* const r, const struct reb_particle* const p, const int i, const int N_sources, struct reb_vec3d* const a, struct reb_vec3d* const jerk){
+    const double G = r->G;
+    const double softening2 = r->softening*r->softening;
+    *a = (struct reb_vec3d){0};
+    *jerk = (struct reb_vec3d){0};
+    if (r->gravity==REB_GRAVITY_NONE){
+        return;
+    }
+    for (int j=0; j<N_sources; j++){
+        if (i==j) continue;
+        const double dx = p[i].x - p[j].x;
+        const double dy = p[i].y - p[j].y;
+        const double dz = p[i].z - p[j].z;
+        const double dvx = p[i].vx - p[j].vx;
+        const double dvy = p[i].vy - p[j].vy;
+        const double dvz = p[i].vz - p[j].vz;
+        const double _r2 = dx*dx + dy*dy + dz*dz + softening2;
+        const double _r = sqrt(_r2);
+        const double prefact = -G/(_r2*_r)*p[j].m;
+        const double alpha = 3.*(dx*dvx + dy*dvy + dz*dvz)/_r2;
+        a->x += prefact*dx;
+        a->y += prefact*dy;
+        a->z += prefact*dz;
+        jerk->x += prefact*(dvx - alpha*dx);
+        jerk->y += prefact*(dvy - alpha*dy);
+        jerk->z += prefact*(dvz - alpha*dz);
+    }
+}
+
+// Returns the smallest level n for which dt/2^n is smaller than eta*|a|/|jerk|.
+static unsigned int reb_integrator_block_level(const struct reb_simulation* const r, const struct reb_vec3d a, const struct reb_vec3d jerk){
+    const double a2 = a.x*a.x + a.y*a.y + a.z*a.z;
+    const double j2 = jerk.x*jerk.x + jerk.y*jerk.y + jerk.z*jerk.z;
+    if (j2==0.){
+        return 0;
+    }
+    const double dt_particle = r->ri_block.eta*sqrt(a2/j2);
+    double dt_level = fabs(r->dt);
+    unsigned int level = 0;
+    while (dt_level>dt_particle && level<r->ri_block.max_level){
+        dt_level /= 2.;
+        level++;
+    }
+    return level;
+}
+
+// Predicts the position and velocity of particle i to the time T (in units of the smallest substep).
+static inline void reb_integrator_block_predict(struct reb_simulation* const r, const int i, const unsigned long long T, const double dt_tick){
+    const struct reb_particle* const p = &(r->particles[i]);
+    const struct reb_vec3d jerk = r->ri_block.jerk[i];
+    struct reb_particle* const pp = &(r->ri_block.p_pred[i]);
+    const double h = (double)(T - r->ri_block.t_last[i])*dt_tick;
+    *pp = *p;
+    pp->x  = p->x  + h*(p->vx + h*(p->ax/2. + h*jerk.x/6.));
+    pp->y  = p->y  + h*(p->vy + h*(p->ay/2. + h*jerk.y/6.));
+    pp->z  = p->z  + h*(p->vz + h*(p->az/2. + h*jerk.z/6.));
+    pp->vx = p->vx + h*(p->ax + h*jerk.x/2.);
+    pp->vy = p->vy + h*(p->ay + h*jerk.y/2.);
+    pp->vz = p->vz + h*(p->az + h*jerk.z/2.);
+}
+
+void reb_integrator_block_part1(struct reb_simulation* r){
+    r->gravity_ignore_terms = 0;
+}
+
+void reb_integrator_block_part2(struct reb_simulation* r){
+    struct reb_simulation_integrator_block* const ri_block = &(r->ri_block);
+    if (r->N_var){
+        reb_error(r, "BLOCK does not support variational particles.");
+        r->status = REB_EXIT_ERROR;
+        return;
+    }
+    if (r->gravity!=REB_GRAVITY_BASIC && r->gravity!=REB_GRAVITY_COMPENSATED && r->gravity!=REB_GRAVITY_NONE){
+        reb_error(r, "BLOCK calculates forces with direct summation and only supports the gravity routines BASIC, COMPENSATED, and NONE.");
+        r->status = REB_EXIT_ERROR;
+        return;
+    }
+    if (r->additional_forces || r->additional_forces_soa){
+        reb_error(r, "BLOCK does not support additional forces.");
+        r->status = REB_EXIT_ERROR;
+        return;
+    }
+    if (r->nghostx || r->nghosty || r->nghostz){
+        reb_error(r, "BLOCK does not support ghost boxes.");
+        r->status = REB_EXIT_ERROR;
+        return;
+    }
+    if (ri_block->max_level>REB_INTEGRATOR_BLOCK_MAX_LEVEL){
+        reb_error(r, "The maximum level of BLOCK cannot exceed 52.");
+        r->status = REB_EXIT_ERROR;
+        return;
+    }
+    const int N = r->N;
+    if (N>ri_block->allocatedN){
+        ri_block->level = realloc(ri_block->level, sizeof(unsigned int)*N);
+        ri_block->t_last = realloc(ri_block->t_last, sizeof(unsigned long long)*N);
+        ri_block->jerk = realloc(ri_block->jerk, sizeof(struct reb_vec3d)*N);
+        ri_block->p_pred = realloc(ri_block->p_pred, sizeof(struct reb_particle)*N);
+        ri_block->due = realloc(ri_block->due, sizeof(int)*N);
+        ri_block->allocatedN = N;
+    }
+    struct reb_particle* const particles = r->particles;
+    unsigned int* const level = ri_block->level;
+    unsigned long long* const t_last = ri_block->t_last;
+    struct reb_vec3d* const jerk = ri_block->jerk;
+    struct reb_particle* const p_pred = ri_block->p_pred;
+    int* const due = ri_block->due;
+    const unsigned int max_level = ri_block->max_level;
+    const unsigned long long T_end = 1ULL<<max_level;
+    const double dt = r->dt;
+    const double dt_tick = dt/(double)T_end;
+    const int N_active = (r->N_active==-1)?N:r->N_active;
+    // Test particles only contribute to the force if testparticle_type is 1.
+    const int N_sources = r->testparticle_type?N:N_active;
+
+    // All particles are synchronized at the beginning of the timestep.
+    // Calculate the acceleration and jerk, then assign levels.
+    memcpy(p_pred, particles, sizeof(struct reb_particle)*N);
+#pragma omp parallel for schedule(guided)
+    for (int i=0; i<N; i++){
+        struct reb_vec3d a;
+        reb_integrator_block_acceleration_jerk(r, p_pred, i, N_sources, &a, &jerk[i]);
+        particles[i].ax = a.x;
+        particles[i].ay = a.y;
+        particles[i].az = a.z;
+        level[i] = reb_integrator_block_level(r, a, jerk[i]);
+        t_last[i] = 0;
+    }
+
+    unsigned long long T = 0;
+    while (T<T_end){
+        // Find the next time at which any particle is due and collect all particles which are due.
+        unsigned long long T_next = T_end;
+        for (int i=0; i<N; i++){
+            const unsigned long long t_next = t_last[i] + (1ULL<<(max_level-level[i]));
+            if (t_next<T_next){
+                T_next = t_next;
+            }
+        }
+        int N_due = 0;
+        for (int i=0; i<N; i++){
+            if (t_last[i] + (1ULL<<(max_level-level[i])) == T_next){
+                due[N_due++] = i;
+            }
+        }
+
+        // Predict all particles which act as sources and all particles which are due.
+#pragma omp parallel for schedule(guided)
+        for (int i=0; i<N_sources; i++){
+            reb_integrator_block_predict(r, i, T_next, dt_tick);
+        }
+#pragma omp parallel for schedule(guided)
+        for (int d=0; d<N_due; d++){
+            const int i = due[d];
+            if (i>=N_sources){
+                reb_integrator_block_predict(r, i, T_next, dt_tick);
+            }
+        }
+
+        // Hermite corrector for all particles which are due.
+        // This only writes to the particle array. The predicted particles are not modified.
+#pragma omp parallel for schedule(guided)
+        for (int d=0; d<N_due; d++){
+            const int i = due[d];
+            struct reb_vec3d a1, j1;
+            reb_integrator_block_acceleration_jerk(r, p_pred, i, N_sources, &a1, &j1);
+            struct reb_particle* const p = &(particles[i]);
+            const struct reb_vec3d j0 = jerk[i];
+            const double h = (double)(T_next - t_last[i])*dt_tick;
+            const double vx1 = p->vx + h/2.*(p->ax + a1.x) + h*h/12.*(j0.x - j1.x);
+            const double vy1 = p->vy + h/2.*(p->ay + a1.y) + h*h/12.*(j0.y - j1.y);
+            const double vz1 = p->vz + h/2.*(p->az + a1.z) + h*h/12.*(j0.z - j1.z);
+            p->x += h/2.*(p->vx + vx1) + h*h/12.*(p->ax - a1.x);
+            p->y += h/2.*(p->vy + vy1) + h*h/12.*(p->ay - a1.y);
+            p->z += h/2.*(p->vz + vz1) + h*h/12.*(p->az - a1.z);
+            p->vx = vx1;
+            p->vy = vy1;
+            p->vz = vz1;
+            p->ax = a1.x;
+            p->ay = a1.y;
+            p->az = a1.z;
+            jerk[i] = j1;
+            t_last[i] = T_next;
+
+            // Particles can always move to a smaller timestep.
+            // They can only move to the next larger timestep if it is commensurate with the current time.
+            const unsigned int level_new = reb_integrator_block_level(r, a1, j1);
+            if (level_new>level[i]){
+                level[i] = level_new;
+            }else if (level_new<level[i] && T_next%(1ULL<<(max_level-level[i]+1))==0){
+                level[i]--;
+            }
+        }
+        ri_block->particle_steps += N_due;
+        T = T_next;
+    }
+
+    r->t += dt;
+    r->dt_last_done = dt;
+}
+
+void reb_integrator_block_synchronize(struct reb_simulation* r){
+    // Do nothing. All particles are synchronized at the end of every timestep.
+}
+
+void reb_integrator_block_reset(struct reb_simulation* r){
+    struct reb_simulation_integrator_block* const ri_block = &(r->ri_block);
+    ri_block->eta = 0.02;
+    ri_block->max_level = 10;
+    ri_block->particle_steps = 0;
+    ri_block->allocatedN = 0;
+    free(ri_block->level);
+    ri_block->level = NULL;
+    free(ri_block->t_last);
+    ri_block->t_last = NULL;
+    free(ri_block->jerk);
+    ri_block->jerk = NULL;
+    free(ri_block->p_pred);
+    ri_block->p_pred = NULL;
+    free(ri_block->due);
+    ri_block->due = NULL;
+}
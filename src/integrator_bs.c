@@ -81,6 +81,11 @@ static const double stabilityReduction = 0.5;
 static const int maxIter = 2; // maximal number of iterations for which checks are performed
 static const int maxChecks = 1; // maximal number of checks for each iteration
 
+// Loops over fewer than this number of components are not run in parallel with OpenMP.
+// All parallel loops are either elementwise or maximum reductions. The results therefore
+// do not depend on the number of threads.
+#define BS_PARALLEL_LENGTH 3000
+
 void reb_integrator_bs_update_particles(struct reb_simulation* r, const double* y){
     if (r==NULL){
         reb_error(r, "Update particles called without valid simulation pointer.");
@@ -90,7 +95,9 @@ void reb_integrator_bs_update_particles(struct reb_simulation* r, const double*
         reb_error(r, "Update particles called without valid y pointer.");
         return;
     }
-    for (int i=0; i<r->N; i++){
+    const int N = r->N;
+#pragma omp parallel for if(6*N>BS_PARALLEL_LENGTH)
+    for (int i=0; i<N; i++){
         struct reb_particle* const p = &(r->particles[i]);
         p->x  = y[i*6+0];
         p->y  = y[i*6+1];
@@ -207,9 +214,12 @@ static int tryStep(struct reb_simulation* r, const int Ns, const int k, const in
         double* y0 = odes[s]->y;
         double* y1 = odes[s]->y1;
         double* y0Dot = odes[s]->y0Dot;
+        double* yTmp = odes[s]->yTmp;
         const int length = odes[s]->length;
+#pragma omp parallel for if(length>BS_PARALLEL_LENGTH)
         for (int i = 0; i < length; ++i) {
             y1[i] = y0[i] + subStep * y0Dot[i];
+            yTmp[i] = y0[i];
         }
     }
 
@@ -220,14 +230,6 @@ static int tryStep(struct reb_simulation* r, const int Ns, const int k, const in
     for (int s=0; s < Ns; s++){
         odes[s]->derivatives(odes[s], odes[s]->yDot, odes[s]->y1, t);
     }
-    for (int s=0; s < Ns; s++){
-        double* y0 = odes[s]->y;
-        double* yTmp = odes[s]->yTmp;
-        const int length = odes[s]->length;
-        for (int i = 0; i < length; ++i) {
-            yTmp[i] = y0[i];
-        }
-    }
 
     for (int j = 1; j < n; ++j) {  // Note: iterating n substeps, not 2n substeps as in Eq. (9.13)
         t += subStep;
@@ -236,6 +238,7 @@ static int tryStep(struct reb_simulation* r, const int Ns, const int k, const in
             double* yDot = odes[s]->yDot;
             double* yTmp = odes[s]->yTmp;
             const int length = odes[s]->length;
+#pragma omp parallel for if(length>BS_PARALLEL_LENGTH)
             for (int i = 0; i < length; ++i) {
                 const double middle = y1[i];
                 y1[i]       = yTmp[i] + 2.* subStep * yDot[i];
@@ -251,6 +254,7 @@ static int tryStep(struct reb_simulation* r, const int Ns, const int k, const in
         }
 
         // stability check
+        // Note: this sum is not run in parallel to keep the result independent of the number of threads.
         if (j <= maxChecks && k < maxIter) {
             double initialNorm = 0.0;
             double deltaNorm = 0.0;
@@ -279,6 +283,7 @@ static int tryStep(struct reb_simulation* r, const int Ns, const int k, const in
         double* yTmp = odes[s]->yTmp;
         double* yDot = odes[s]->yDot;
         const int length = odes[s]->length;
+#pragma omp parallel for if(length>BS_PARALLEL_LENGTH)
         for (int i = 0; i < length; ++i) {
             y1[i] = 0.5 * (yTmp[i] + y1[i] + subStep * yDot[i]); // = 0.25*(y_(2n-1) + 2*y_n(2) + y_(2n+1))     Eq (9.13c)
         }
@@ -291,25 +296,28 @@ static void extrapolate(const struct reb_ode* ode, double * const coeff, const i
     double* const y1 = ode->y1;
     double* const C = ode->C;  // C and D values follow Numerical Recipes 
     double** const D =  ode->D;
-    double const length = ode->length;
+    const int length = ode->length;
+    double facC[sequence_length];
+    double facD[sequence_length];
     for (int j = 0; j < k; ++j) {
         double xi = coeff[k-j-1];
         double xim1 = coeff[k];
-        double facC = xi/(xi-xim1);
-        double facD = xim1/(xi-xim1);
-        for (int i = 0; i < length; ++i) {
-            double CD = C[i] - D[k - j -1][i];
-            C[i] = facC * CD; // Only need to keep one C value
-            D[k - j - 1][i] = facD * CD; // Keep all D values for recursion
-        }
+        facC[j] = xi/(xi-xim1);
+        facD[j] = xim1/(xi-xim1);
     }
+    // Every component is independent. The tableau is updated for one component at a time.
+#pragma omp parallel for if(length>BS_PARALLEL_LENGTH)
     for (int i = 0; i < length; ++i) {
-        y1[i] = D[0][i];
-    }
-    for (int j = 1; j <= k; ++j) {
-        for (int i = 0; i < length; ++i) {
-        y1[i] += D[j][i];
+        for (int j = 0; j < k; ++j) {
+            double CD = C[i] - D[k - j -1][i];
+            C[i] = facC[j] * CD; // Only need to keep one C value
+            D[k - j - 1][i] = facD[j] * CD; // Keep all D values for recursion
         }
+        double y = D[0][i];
+        for (int j = 1; j <= k; ++j) {
+            y += D[j][i];
+        }
+        y1[i] = y;
     }
 }
 
@@ -318,18 +326,24 @@ static void nbody_derivatives(struct reb_ode* ode, double* const yDot, const dou
     struct reb_simulation* const r = ode->r;
     if (r->t != t) { 
         // Not needed for first step. Accelerations already calculated. Just need to copy them
-        reb_integrator_bs_update_particles(r, y);
+        if (!r->ri_bs.user_ode_needs_nbody){
+            // If a user ODE needs the particles, tryStep() has already updated them.
+            reb_integrator_bs_update_particles(r, y);
+        }
         reb_update_acceleration(r);
     }
 
-    for (int i=0; i<r->N; i++){
-        const struct reb_particle p = r->particles[i];
-        yDot[i*6+0] = p.vx;
-        yDot[i*6+1] = p.vy;
-        yDot[i*6+2] = p.vz;
-        yDot[i*6+3] = p.ax;
-        yDot[i*6+4] = p.ay;
-        yDot[i*6+5] = p.az;
+    // Velocities are taken directly from the state vector.
+    const int N = r->N;
+    const struct reb_particle* const particles = r->particles;
+#pragma omp parallel for if(6*N>BS_PARALLEL_LENGTH)
+    for (int i=0; i<N; i++){
+        yDot[i*6+0] = y[i*6+3];
+        yDot[i*6+1] = y[i*6+4];
+        yDot[i*6+2] = y[i*6+5];
+        yDot[i*6+3] = particles[i].ax;
+        yDot[i*6+4] = particles[i].ay;
+        yDot[i*6+5] = particles[i].az;
     }
 }
 
@@ -341,9 +355,7 @@ void reb_integrator_bs_part1(struct reb_simulation* r){
         const int length = odes[s]->length;
         double* y0 = odes[s]->y;
         double* y1 = odes[s]->y1;
-        for (int i = 0; i < length; ++i) {
-            y1[i] = y0[i];
-        }
+        memcpy(y1, y0, sizeof(double)*length);
     }
 }
 
@@ -382,6 +394,7 @@ static void allocate_sequence_arrays(struct reb_simulation_integrator_bs* ri_bs)
 static void reb_integrator_bs_default_scale(struct reb_ode* ode, double* y1, double* y2, double relTol, double absTol){
     double* scale = ode->scale;
     int length = ode->length;
+#pragma omp parallel for if(length>BS_PARALLEL_LENGTH)
     for (int i = 0; i < length; i++) {
         scale[i] = absTol + relTol * MAX(fabs(y1[i]), fabs(y2[i]));
     }
@@ -465,11 +478,8 @@ int reb_integrator_bs_step(struct reb_simulation* r, double dt){
         } else {
             for (int s=0; s < Ns; s++){
                 const int length = odes[s]->length;
-                for (int i = 0; i < length; ++i) {
-                    double CD = odes[s]->y1[i];
-                    odes[s]->C[i] = CD;
-                    odes[s]->D[k][i] = CD;
-                }
+                memcpy(odes[s]->C, odes[s]->y1, sizeof(double)*length);
+                memcpy(odes[s]->D[k], odes[s]->y1, sizeof(double)*length);
             }
 
             // the substep was computed successfully
@@ -494,6 +504,7 @@ int reb_integrator_bs_step(struct reb_simulation* r, double dt){
                     //combined_length += length;
                     double * C = odes[s]->C;
                     double * scale = odes[s]->scale;
+#pragma omp parallel for reduction(max:error) if(length>BS_PARALLEL_LENGTH)
                     for (int j = 0; j < length; ++j) {
                         const double e = C[j] / scale[j];
                         error = MAX(error, e * e);
@@ -722,6 +733,8 @@ struct reb_ode* reb_create_ode(struct reb_simulation* r, unsigned int length){
 
     ode->r = r; // weak reference
     ode->length = length;
+    ode->batch_N = 1;
+    ode->batch_length = length;
     ode->needs_nbody = 1;
     ode->allocatedN = length;
     ode->getscale = NULL;
@@ -747,6 +760,17 @@ struct reb_ode* reb_create_ode(struct reb_simulation* r, unsigned int length){
     return ode;
 }
 
+struct reb_ode* reb_create_ode_batch(struct reb_simulation* r, unsigned int length, unsigned int N){
+    // The systems are integrated as one ODE. The step size control only uses elementwise
+    // scales, a maximum norm, and a sum for the stability check over all components. 
+    // The result is therefore the same as for N separate ODEs, but the loops and the 
+    // derivatives function are only called once per substep.
+    struct reb_ode* ode = reb_create_ode(r, length*N);
+    ode->batch_N = N;
+    ode->batch_length = length;
+    return ode;
+}
+
 void reb_integrator_bs_part2(struct reb_simulation* r){
     struct reb_simulation_integrator_bs* ri_bs = &(r->ri_bs);
     
@@ -772,6 +796,7 @@ void reb_integrator_bs_part2(struct reb_simulation* r){
     }
 
     double* const y = ri_bs->nbody_ode->y;
+#pragma omp parallel for if(nbody_length>BS_PARALLEL_LENGTH)
     for (int i=0; i<r->N; i++){
         const struct reb_particle p = r->particles[i];
         y[i*6+0] = p.x;
@@ -52,6 +52,15 @@ void integrator_generate_constants(void);
 #include "tools.h"
 #include "integrator.h"
 #include "integrator_ias15.h"
+#include "integrator_mercurius.h"
+
+#define MIN(a, b) ((a) > (b) ? (b) : (a))    ///< Returns the minimum of a and b
+#define MAX(a, b) ((a) > (b) ? (a) : (b))    ///< Returns the maximum of a and b
+
+// Loops over fewer than this number of components are not run in parallel with OpenMP.
+// All loops are either elementwise or maximum reductions. The results therefore
+// do not depend on the number of threads.
+#define IAS15_PARALLEL_N3 3000
 
 /**
  * @brief Struct containing pointers to intermediate values
@@ -68,7 +77,11 @@ struct reb_dpconst7 {
 
 // Helper functions for resetting the b and e coefficients
 static void copybuffers(const struct reb_dpconst7 _a, const struct reb_dpconst7 _b, int N3);
+static void reb_ias15_allreduce(const struct reb_simulation* const r, double* const values, const int N, const int max);
 static void predict_next_step(double ratio, int N3,  const struct reb_dpconst7 _e, const struct reb_dpconst7 _b, const struct reb_dpconst7 e, const struct reb_dpconst7 b);
+// Helper functions for test particles which are substepped individually
+static int testparticles_start(struct reb_simulation* const r, const int N);
+static void testparticles_step(struct reb_simulation* const r, const int N, const int N_massive, const int* const map, const double dt_done, const double* const at, double* const x0, double* const v0, const double* const a0, double* const csx, double* const csv, const struct reb_dpconst7 b);
 
 
 /////////////////////////
@@ -99,13 +112,7 @@ static double sqrt7(double a){
 }
 
 static void free_dp7(struct reb_dp7* dp7){
-    free(dp7->p0);
-    free(dp7->p1);
-    free(dp7->p2);
-    free(dp7->p3);
-    free(dp7->p4);
-    free(dp7->p5);
-    free(dp7->p6);
+    free(dp7->p0); // p1...p6 point into the same block (see reb_integrator_ias15_alloc_dp7())
     dp7->p0 = NULL;
     dp7->p1 = NULL;
     dp7->p2 = NULL;
@@ -115,6 +122,7 @@ static void free_dp7(struct reb_dp7* dp7){
     dp7->p6 = NULL;
 }
 static void clear_dp7(struct reb_dp7* const dp7, const int N3){
+#pragma omp simd
     for (int k=0;k<N3;k++){
         dp7->p0[k] = 0.;
         dp7->p1[k] = 0.;
@@ -125,15 +133,40 @@ static void clear_dp7(struct reb_dp7* const dp7, const int N3){
         dp7->p6[k] = 0.;
     }
 }
-static void realloc_dp7(struct reb_dp7* const dp7, const int N3){
-    dp7->p0 = realloc(dp7->p0,sizeof(double)*N3);
-    dp7->p1 = realloc(dp7->p1,sizeof(double)*N3);
-    dp7->p2 = realloc(dp7->p2,sizeof(double)*N3);
-    dp7->p3 = realloc(dp7->p3,sizeof(double)*N3);
-    dp7->p4 = realloc(dp7->p4,sizeof(double)*N3);
-    dp7->p5 = realloc(dp7->p5,sizeof(double)*N3);
-    dp7->p6 = realloc(dp7->p6,sizeof(double)*N3);
-    clear_dp7(dp7,N3);
+void reb_integrator_ias15_alloc_dp7(struct reb_dp7* const dp7, const int N3){
+    free_dp7(dp7);
+    if (N3<=0){
+        return;
+    }
+    // The seven arrays are stored one after another in a single block. Every 
+    // array starts on a new 64 byte cache line so that the loops below 
+    // can use aligned vector loads and stores.
+    const int stride = (N3+7)/8*8;
+    double* const block = reb_tools_realloc_aligned(NULL, sizeof(double), 0, 7*stride);
+    dp7->p0 = block;
+    dp7->p1 = block+1*stride;
+    dp7->p2 = block+2*stride;
+    dp7->p3 = block+3*stride;
+    dp7->p4 = block+4*stride;
+    dp7->p5 = block+5*stride;
+    dp7->p6 = block+6*stride;
+}
+
+void reb_integrator_ias15_copy_dp7(struct reb_dp7* const dp7, const struct reb_dp7* const dp7_src, const int N3){
+    free_dp7(dp7);
+    if (N3<=0 || dp7_src->p0==NULL){
+        return;
+    }
+    // Same layout as in reb_integrator_ias15_alloc_dp7(). The block is copied at once.
+    const int stride = (N3+7)/8*8;
+    double* const block = reb_tools_copy_aligned(dp7_src->p0, sizeof(double), 7*stride);
+    dp7->p0 = block;
+    dp7->p1 = block+1*stride;
+    dp7->p2 = block+2*stride;
+    dp7->p3 = block+3*stride;
+    dp7->p4 = block+4*stride;
+    dp7->p5 = block+5*stride;
+    dp7->p6 = block+6*stride;
 }
 
 static struct reb_dpconst7 dpcast(struct reb_dp7 dp){
@@ -156,6 +189,75 @@ static inline void add_cs(double* p, double* csp, double inp){
     *p = t;
 }
 
+// The following functions are used for test particles which do not use compensated 
+// summation (see testparticle_compensated). They never read or write the cs buffers.
+
+// Predicted change in position and velocity of component k at substep h.
+static inline double predict_x(const int k, const double h, const double dt, const struct reb_dpconst7 b, const double* const a0, const double* const v0){
+    return ((((((((b.p6[k]*7.*h/9. + b.p5[k])*3.*h/4. + b.p4[k])*5.*h/7. + b.p3[k])*2.*h/3. + b.p2[k])*3.*h/5. + b.p1[k])*h/2. + b.p0[k])*h/3. + a0[k])*dt*h/2. + v0[k])*dt*h;
+}
+static inline double predict_v(const int k, const double h, const double dt, const struct reb_dpconst7 b, const double* const a0){
+    return (((((((b.p6[k]*7.*h/8. + b.p5[k])*6.*h/7. + b.p4[k])*5.*h/6. + b.p3[k])*4.*h/5. + b.p2[k])*3.*h/4. + b.p1[k])*2.*h/3. + b.p0[k])*h/2. + a0[k])*dt*h;
+}
+
+// Updates g.p[n-1][k] and the b coefficients of component k at substep n (1...7) with
+// the acceleration gk (relative to the beginning of the step). Returns the change of g.p[n-1][k].
+static inline double update_gb_plain(const int n, const int k, const double gk, double* const* const gp, double* const* const bp){
+    const int s = n*(n-1)/2;
+    double gn = gk/rr[s];
+    for (int j=0;j<n-1;j++){
+        gn = (gn - gp[j][k])/rr[s+j+1];
+    }
+    const double tmp = gn - gp[n-1][k];
+    gp[n-1][k] = gn;
+    const int sc = (n-2)*(n-1)/2;
+    for (int j=0;j<n-1;j++){
+        bp[j][k] += tmp * c[sc+j];
+    }
+    bp[n-1][k] += tmp;
+    return tmp;
+}
+
+static inline void update_xv_plain(const int k, double* const x0, double* const v0, const struct reb_dpconst7 b, const double* const a0, const double dt_done){
+    x0[k] += b.p6[k]/72.*dt_done*dt_done;
+    x0[k] += b.p5[k]/56.*dt_done*dt_done;
+    x0[k] += b.p4[k]/42.*dt_done*dt_done;
+    x0[k] += b.p3[k]/30.*dt_done*dt_done;
+    x0[k] += b.p2[k]/20.*dt_done*dt_done;
+    x0[k] += b.p1[k]/12.*dt_done*dt_done;
+    x0[k] += b.p0[k]/6.*dt_done*dt_done;
+    x0[k] += a0[k]/2.*dt_done*dt_done;
+    x0[k] += v0[k]*dt_done;
+    v0[k] += b.p6[k]/8.*dt_done;
+    v0[k] += b.p5[k]/7.*dt_done;
+    v0[k] += b.p4[k]/6.*dt_done;
+    v0[k] += b.p3[k]/5.*dt_done;
+    v0[k] += b.p2[k]/4.*dt_done;
+    v0[k] += b.p1[k]/3.*dt_done;
+    v0[k] += b.p0[k]/2.*dt_done;
+    v0[k] += a0[k]*dt_done;
+}
+
+// Monitors the change tmp of the b.p6 coefficient of a component with acceleration ak 
+// to decide if the predictor corrector loop has converged.
+static inline void monitor_convergence(const unsigned int epsilon_global, const double ak, const double tmp, double* const maxak, double* const maxb6ktmp, double* const predictor_corrector_error){
+    if (epsilon_global){
+        const double fak  = fabs(ak);
+        if (isnormal(fak) && fak>*maxak){
+            *maxak = fak;
+        }
+        const double b6ktmp = fabs(tmp);  // change of b6ktmp coefficient
+        if (isnormal(b6ktmp) && b6ktmp>*maxb6ktmp){
+            *maxb6ktmp = b6ktmp;
+        }
+    }else{
+        const double errork = fabs(tmp/ak);
+        if (isnormal(errork) && errork>*predictor_corrector_error){
+            *predictor_corrector_error = errork;
+        }
+    }
+}
+
 void reb_integrator_ias15_alloc(struct reb_simulation* r){
     int N3;
     if (r->integrator==REB_INTEGRATOR_MERCURIUS){
@@ -164,19 +266,18 @@ void reb_integrator_ias15_alloc(struct reb_simulation* r){
         N3 = 3*r->N;
     }
     if (N3 > r->ri_ias15.allocatedN) {
-        realloc_dp7(&(r->ri_ias15.g),N3);
-        realloc_dp7(&(r->ri_ias15.b),N3);
-        realloc_dp7(&(r->ri_ias15.csb),N3);
-        realloc_dp7(&(r->ri_ias15.e),N3);
-        realloc_dp7(&(r->ri_ias15.br),N3);
-        realloc_dp7(&(r->ri_ias15.er),N3);
-        r->ri_ias15.at = realloc(r->ri_ias15.at,sizeof(double)*N3);
-        r->ri_ias15.x0 = realloc(r->ri_ias15.x0,sizeof(double)*N3);
-        r->ri_ias15.v0 = realloc(r->ri_ias15.v0,sizeof(double)*N3);
-        r->ri_ias15.a0 = realloc(r->ri_ias15.a0,sizeof(double)*N3);
-        r->ri_ias15.csx= realloc(r->ri_ias15.csx,sizeof(double)*N3);
-        r->ri_ias15.csv= realloc(r->ri_ias15.csv,sizeof(double)*N3);
-        r->ri_ias15.csa0 = realloc(r->ri_ias15.csa0,sizeof(double)*N3);
+        struct reb_dp7* const dp7s[6] = {&(r->ri_ias15.g), &(r->ri_ias15.b), &(r->ri_ias15.csb), &(r->ri_ias15.e), &(r->ri_ias15.br), &(r->ri_ias15.er)};
+        for (int l=0;l<6;l++){
+            reb_integrator_ias15_alloc_dp7(dp7s[l],N3);
+            clear_dp7(dp7s[l],N3);
+        }
+        r->ri_ias15.at = reb_tools_realloc_aligned(r->ri_ias15.at, sizeof(double), r->ri_ias15.allocatedN, N3);
+        r->ri_ias15.x0 = reb_tools_realloc_aligned(r->ri_ias15.x0, sizeof(double), r->ri_ias15.allocatedN, N3);
+        r->ri_ias15.v0 = reb_tools_realloc_aligned(r->ri_ias15.v0, sizeof(double), r->ri_ias15.allocatedN, N3);
+        r->ri_ias15.a0 = reb_tools_realloc_aligned(r->ri_ias15.a0, sizeof(double), r->ri_ias15.allocatedN, N3);
+        r->ri_ias15.csx = reb_tools_realloc_aligned(r->ri_ias15.csx, sizeof(double), r->ri_ias15.allocatedN, N3);
+        r->ri_ias15.csv = reb_tools_realloc_aligned(r->ri_ias15.csv, sizeof(double), r->ri_ias15.allocatedN, N3);
+        r->ri_ias15.csa0 = reb_tools_realloc_aligned(r->ri_ias15.csa0, sizeof(double), r->ri_ias15.allocatedN, N3);
         double* restrict const csx = r->ri_ias15.csx; 
         double* restrict const csv = r->ri_ias15.csv; 
         for (int i=0;i<N3;i++){
@@ -187,7 +288,7 @@ void reb_integrator_ias15_alloc(struct reb_simulation* r){
         r->ri_ias15.allocatedN = N3;
     }
     if (N3/3 > r->ri_ias15.map_allocated_N){
-        r->ri_ias15.map = realloc(r->ri_ias15.map,sizeof(int)*(N3/3));
+        r->ri_ias15.map = reb_tools_realloc_aligned(r->ri_ias15.map, sizeof(int), r->ri_ias15.map_allocated_N, N3/3);
         for (int i=0;i<N3/3;i++){
             r->ri_ias15.map[i] = i;
         }
@@ -196,6 +297,29 @@ void reb_integrator_ias15_alloc(struct reb_simulation* r){
 
 }
  
+// Advances the positions and velocities x0 and v0 of the components k with the b coefficients.
+static inline void update_xv(const int k, double* const x0, double* const csx, double* const v0, double* const csv, const struct reb_dpconst7 b, const double* const a0, const double dt_done){
+    // Note: dt_done*dt_done is not precalculated to avoid 
+    //       biased round-off errors when a fixed timestep is used.
+    add_cs(&(x0[k]), &(csx[k]), b.p6[k]/72.*dt_done*dt_done);
+    add_cs(&(x0[k]), &(csx[k]), b.p5[k]/56.*dt_done*dt_done);
+    add_cs(&(x0[k]), &(csx[k]), b.p4[k]/42.*dt_done*dt_done);
+    add_cs(&(x0[k]), &(csx[k]), b.p3[k]/30.*dt_done*dt_done);
+    add_cs(&(x0[k]), &(csx[k]), b.p2[k]/20.*dt_done*dt_done);
+    add_cs(&(x0[k]), &(csx[k]), b.p1[k]/12.*dt_done*dt_done);
+    add_cs(&(x0[k]), &(csx[k]), b.p0[k]/6.*dt_done*dt_done);
+    add_cs(&(x0[k]), &(csx[k]), a0[k]/2.*dt_done*dt_done);
+    add_cs(&(x0[k]), &(csx[k]), v0[k]*dt_done);
+    add_cs(&(v0[k]), &(csv[k]), b.p6[k]/8.*dt_done);
+    add_cs(&(v0[k]), &(csv[k]), b.p5[k]/7.*dt_done);
+    add_cs(&(v0[k]), &(csv[k]), b.p4[k]/6.*dt_done);
+    add_cs(&(v0[k]), &(csv[k]), b.p3[k]/5.*dt_done);
+    add_cs(&(v0[k]), &(csv[k]), b.p2[k]/4.*dt_done);
+    add_cs(&(v0[k]), &(csv[k]), b.p1[k]/3.*dt_done);
+    add_cs(&(v0[k]), &(csv[k]), b.p0[k]/2.*dt_done);
+    add_cs(&(v0[k]), &(csv[k]), a0[k]*dt_done);
+}
+
 // Does the actual timestep.
 static int reb_integrator_ias15_step(struct reb_simulation* r) {
     reb_integrator_ias15_alloc(r);
@@ -215,6 +339,19 @@ static int reb_integrator_ias15_step(struct reb_simulation* r) {
         map = r->ri_ias15.map; // identity map
     }
     const int N3 = 3*N;
+    // Particles with an index (in the map) of at least N_massive are test particles which
+    // are not included in the timestep criterion. N_massive is N if this is turned off.
+    const int N_massive = testparticles_start(r, N); 
+    const int N3_massive = 3*N_massive;
+    // Particles which follow an ephemeris are not integrated accurately and are not included in the timestep criterion.
+    const int N_ephemeris = r->ephemeris?r->ephemeris->N:0;
+    const int N3_ephemeris = 3*N_ephemeris;
+    // Particles with an index of at least N_cs are test particles which use plain instead of compensated summation. 
+    int N_cs = N;
+    if (!r->ri_ias15.testparticle_compensated && r->integrator==REB_INTEGRATOR_IAS15 && N_massive==N && r->N_var==0 && r->N_active>=0 && r->N_active<N){
+        N_cs = r->N_active;
+    }
+    const int N3_cs = 3*N_cs;
     
     // reb_update_acceleration(); // Not needed. Forces are already calculated in main routine.
     
@@ -232,6 +369,7 @@ static int reb_integrator_ias15_step(struct reb_simulation* r) {
     const struct reb_dpconst7 csb= dpcast(r->ri_ias15.csb);
     const struct reb_dpconst7 er = dpcast(r->ri_ias15.er);
     const struct reb_dpconst7 br = dpcast(r->ri_ias15.br);
+#pragma omp parallel for if(N3>IAS15_PARALLEL_N3)
     for(int k=0;k<N;k++) {
         int mk = map[k];
         x0[3*k]   = particles[mk].x;
@@ -245,7 +383,8 @@ static int reb_integrator_ias15_step(struct reb_simulation* r) {
         a0[3*k+2] = particles[mk].az;
     }
     if (r->gravity==REB_GRAVITY_COMPENSATED){
-        for(int k=0;k<N;k++) {
+#pragma omp parallel for if(N3>IAS15_PARALLEL_N3)
+        for(int k=0;k<N_cs;k++) {
             int mk = map[k];
             csa0[3*k]   = gravity_cs[mk].x;
             csa0[3*k+1] = gravity_cs[mk].y;  
@@ -253,12 +392,13 @@ static int reb_integrator_ias15_step(struct reb_simulation* r) {
         }
     }else{
         gravity_cs = (struct reb_vec3d*)csa0; // Always 0.
-        for(int k=0;k<N3;k++) {
+#pragma omp parallel for simd if(N3>IAS15_PARALLEL_N3)
+        for(int k=0;k<N3_cs;k++) {
             csa0[k]   = 0;
         }
     }
-    for (int k=0;k<N3;k++){
-        // Memset might be faster!
+#pragma omp parallel for simd if(N3>IAS15_PARALLEL_N3)
+    for (int k=0;k<N3_cs;k++){
         csb.p0[k] = 0.;
         csb.p1[k] = 0.;
         csb.p2[k] = 0.;
@@ -268,6 +408,7 @@ static int reb_integrator_ias15_step(struct reb_simulation* r) {
         csb.p6[k] = 0.;
     }
 
+#pragma omp parallel for simd if(N3>IAS15_PARALLEL_N3)
     for(int k=0;k<N3;k++) {
         g.p0[k] = b.p6[k]*d[15] + b.p5[k]*d[10] + b.p4[k]*d[6] + b.p3[k]*d[3]  + b.p2[k]*d[1]  + b.p1[k]*d[0]  + b.p0[k];
         g.p1[k] = b.p6[k]*d[16] + b.p5[k]*d[11] + b.p4[k]*d[7] + b.p3[k]*d[4]  + b.p2[k]*d[2]  + b.p1[k];
@@ -278,6 +419,9 @@ static int reb_integrator_ias15_step(struct reb_simulation* r) {
         g.p6[k] = b.p6[k];
     }
 
+    double* const gp[7] = {g.p0, g.p1, g.p2, g.p3, g.p4, g.p5, g.p6};
+    double* const bp[7] = {b.p0, b.p1, b.p2, b.p3, b.p4, b.p5, b.p6};
+
     double integrator_megno_thisdt = 0.;
     double integrator_megno_thisdt_init = 0.;
     if (r->calculate_megno){
@@ -318,7 +462,8 @@ static int reb_integrator_ias15_step(struct reb_simulation* r) {
             r->t = t_beginning + r->dt * h[n];
 
             // Prepare particles arrays for force calculation
-            for(int i=0;i<N;i++) {                      // Predict positions at interval n using b values
+#pragma omp parallel for if(N3>IAS15_PARALLEL_N3)
+            for(int i=0;i<N_cs;i++) {                   // Predict positions at interval n using b values
                 int mi = map[i];
                 const int k0 = 3*i+0;
                 const int k1 = 3*i+1;
@@ -334,8 +479,16 @@ static int reb_integrator_ias15_step(struct reb_simulation* r) {
                 particles[mi].y = xk1 + x0[k1];
                 particles[mi].z = xk2 + x0[k2];
             }
-            if (r->calculate_megno || (r->additional_forces && r->force_is_velocity_dependent)){
-                for(int i=0;i<N;i++) {                  // Predict velocities at interval n using b values
+#pragma omp parallel for if(N3>IAS15_PARALLEL_N3)
+            for(int i=N_cs;i<N;i++) {                   // Same for test particles without compensated summation
+                int mi = map[i];
+                particles[mi].x = predict_x(3*i+0, h[n], r->dt, b, a0, v0) + x0[3*i+0];
+                particles[mi].y = predict_x(3*i+1, h[n], r->dt, b, a0, v0) + x0[3*i+1];
+                particles[mi].z = predict_x(3*i+2, h[n], r->dt, b, a0, v0) + x0[3*i+2];
+            }
+            if (r->calculate_megno || ((r->additional_forces || r->additional_forces_soa) && r->force_is_velocity_dependent)){
+#pragma omp parallel for if(N3>IAS15_PARALLEL_N3)
+                for(int i=0;i<N_cs;i++) {               // Predict velocities at interval n using b values
                     int mi = map[i];
                     const int k0 = 3*i+0;
                     const int k1 = 3*i+1;
@@ -351,6 +504,13 @@ static int reb_integrator_ias15_step(struct reb_simulation* r) {
                     particles[mi].vy = vk1 + v0[k1];
                     particles[mi].vz = vk2 + v0[k2];
                 }
+#pragma omp parallel for if(N3>IAS15_PARALLEL_N3)
+                for(int i=N_cs;i<N;i++) {
+                    int mi = map[i];
+                    particles[mi].vx = predict_v(3*i+0, h[n], r->dt, b, a0) + v0[3*i+0];
+                    particles[mi].vy = predict_v(3*i+1, h[n], r->dt, b, a0) + v0[3*i+1];
+                    particles[mi].vz = predict_v(3*i+2, h[n], r->dt, b, a0) + v0[3*i+2];
+                }
             }
 
 
@@ -359,15 +519,29 @@ static int reb_integrator_ias15_step(struct reb_simulation* r) {
                 integrator_megno_thisdt += w[n] * r->t * reb_tools_megno_deltad_delta(r);
             }
 
+#pragma omp parallel for if(N3>IAS15_PARALLEL_N3)
             for(int k=0;k<N;++k) {
                 int mk = map[k];
                 at[3*k]   = particles[mk].ax;
                 at[3*k+1] = particles[mk].ay;  
                 at[3*k+2] = particles[mk].az;
             }
+            // Test particles without compensated summation. Convergence is only monitored in the last substep.
+            double tp_maxak = 0.0;
+            double tp_maxb6ktmp = 0.0;
+            if (N3_cs<N3){
+#pragma omp parallel for if(N3>IAS15_PARALLEL_N3) reduction(max:tp_maxak,tp_maxb6ktmp,predictor_corrector_error)
+                for(int k=N3_cs;k<N3;++k) {
+                    const double tmp = update_gb_plain(n, k, at[k]-a0[k], gp, bp);
+                    if (n==7 && k>=N3_ephemeris){
+                        monitor_convergence(r->ri_ias15.epsilon_global, at[k], tmp, &tp_maxak, &tp_maxb6ktmp, &predictor_corrector_error);
+                    }
+                }
+            }
             switch (n) {                            // Improve b and g values
                 case 1: 
-                    for(int k=0;k<N3;++k) {
+#pragma omp parallel for simd if(N3>IAS15_PARALLEL_N3)
+                    for(int k=0;k<N3_cs;++k) {
                         double tmp = g.p0[k];
                         double gk = at[k];
                         double gk_cs = ((double*)(gravity_cs))[k];
@@ -377,7 +551,8 @@ static int reb_integrator_ias15_step(struct reb_simulation* r) {
                         add_cs(&(b.p0[k]), &(csb.p0[k]), g.p0[k]-tmp);
                     } break;
                 case 2: 
-                    for(int k=0;k<N3;++k) {
+#pragma omp parallel for simd if(N3>IAS15_PARALLEL_N3)
+                    for(int k=0;k<N3_cs;++k) {
                         double tmp = g.p1[k];
                         double gk = at[k];
                         double gk_cs = ((double*)(gravity_cs))[k];
@@ -389,7 +564,8 @@ static int reb_integrator_ias15_step(struct reb_simulation* r) {
                         add_cs(&(b.p1[k]), &(csb.p1[k]), tmp);
                     } break;
                 case 3: 
-                    for(int k=0;k<N3;++k) {
+#pragma omp parallel for simd if(N3>IAS15_PARALLEL_N3)
+                    for(int k=0;k<N3_cs;++k) {
                         double tmp = g.p2[k];
                         double gk = at[k];
                         double gk_cs = ((double*)(gravity_cs))[k];
@@ -402,7 +578,8 @@ static int reb_integrator_ias15_step(struct reb_simulation* r) {
                         add_cs(&(b.p2[k]), &(csb.p2[k]), tmp);
                     } break;
                 case 4:
-                    for(int k=0;k<N3;++k) {
+#pragma omp parallel for simd if(N3>IAS15_PARALLEL_N3)
+                    for(int k=0;k<N3_cs;++k) {
                         double tmp = g.p3[k];
                         double gk = at[k];
                         double gk_cs = ((double*)(gravity_cs))[k];
@@ -416,7 +593,8 @@ static int reb_integrator_ias15_step(struct reb_simulation* r) {
                         add_cs(&(b.p3[k]), &(csb.p3[k]), tmp);
                     } break;
                 case 5:
-                    for(int k=0;k<N3;++k) {
+#pragma omp parallel for simd if(N3>IAS15_PARALLEL_N3)
+                    for(int k=0;k<N3_cs;++k) {
                         double tmp = g.p4[k];
                         double gk = at[k];
                         double gk_cs = ((double*)(gravity_cs))[k];
@@ -431,7 +609,8 @@ static int reb_integrator_ias15_step(struct reb_simulation* r) {
                         add_cs(&(b.p4[k]), &(csb.p4[k]), tmp);
                     } break;
                 case 6:
-                    for(int k=0;k<N3;++k) {
+#pragma omp parallel for simd if(N3>IAS15_PARALLEL_N3)
+                    for(int k=0;k<N3_cs;++k) {
                         double tmp = g.p5[k];
                         double gk = at[k];
                         double gk_cs = ((double*)(gravity_cs))[k];
@@ -448,9 +627,10 @@ static int reb_integrator_ias15_step(struct reb_simulation* r) {
                     } break;
                 case 7:
                 {
-                    double maxak = 0.0;
-                    double maxb6ktmp = 0.0;
-                    for(int k=0;k<N3;++k) {
+                    double maxak = tp_maxak;
+                    double maxb6ktmp = tp_maxb6ktmp;
+#pragma omp parallel for if(N3>IAS15_PARALLEL_N3) reduction(max:maxak,maxb6ktmp,predictor_corrector_error)
+                    for(int k=0;k<N3_cs;++k) {
                         double tmp = g.p6[k];
                         double gk = at[k];
                         double gk_cs = ((double*)(gravity_cs))[k];
@@ -466,6 +646,9 @@ static int reb_integrator_ias15_step(struct reb_simulation* r) {
                         add_cs(&(b.p5[k]), &(csb.p5[k]), tmp * c[20]);
                         add_cs(&(b.p6[k]), &(csb.p6[k]), tmp);
                         
+                        if (k>=N3_massive || k<N3_ephemeris){
+                            continue; // Test particles do not need to converge in the global step 
+                        }
                         // Monitor change in b.p6[k] relative to at[k]. The predictor corrector scheme is converged if it is close to 0.
                         if (r->ri_ias15.epsilon_global){
                             const double ak  = fabs(at[k]);
@@ -486,7 +669,11 @@ static int reb_integrator_ias15_step(struct reb_simulation* r) {
                         }
                     } 
                     if (r->ri_ias15.epsilon_global){
-                        predictor_corrector_error = maxb6ktmp/maxak;
+                        double maxs[2] = {maxak, maxb6ktmp};
+                        reb_ias15_allreduce(r, maxs, 2, 1);
+                        predictor_corrector_error = maxs[1]/maxs[0];
+                    }else{
+                        reb_ias15_allreduce(r, &predictor_corrector_error, 1, 1);
                     }
                     
                     break;
@@ -515,11 +702,12 @@ static int reb_integrator_ias15_step(struct reb_simulation* r) {
             //   Here, the fractional error is calculated for each particle individually and we use the maximum of the fractional error.
             //   This might fail in cases where a particle does not experience any (physical) acceleration besides roundoff errors. 
             double integrator_error = 0.0;
-            unsigned int Nreal = N - r->N_var;
+            unsigned int Nreal = MIN(N_massive, N - r->N_var);
             if (r->ri_ias15.epsilon_global){
                 double maxak = 0.0;
                 double maxb6k = 0.0;
-                for(int i=0;i<Nreal;i++){ // Looping over all particles and all 3 components of the acceleration. 
+#pragma omp parallel for if(N3>IAS15_PARALLEL_N3) reduction(max:maxak,maxb6k)
+                for(int i=N_ephemeris;i<Nreal;i++){ // Looping over all particles and all 3 components of the acceleration. 
                     // Note: Before December 2020, N-N_var, was simply N. This change should make timestep choices during
                     // close encounters more stable if variational particles are present.
                     int mi = map[i];
@@ -540,9 +728,12 @@ static int reb_integrator_ias15_step(struct reb_simulation* r) {
                         }
                     }
                 }
-                integrator_error = maxb6k/maxak;
+                double maxs[2] = {maxak, maxb6k};
+                reb_ias15_allreduce(r, maxs, 2, 1);
+                integrator_error = maxs[1]/maxs[0];
             }else{
-                for(int k=0;k<N3;k++) {
+#pragma omp parallel for if(N3>IAS15_PARALLEL_N3) reduction(max:integrator_error)
+                for(int k=N3_ephemeris;k<N3_massive;k++) {
                     const double ak  = at[k];
                     const double b6k = b.p6[k]; 
                     const double errork = fabs(b6k/ak);
@@ -550,6 +741,7 @@ static int reb_integrator_ias15_step(struct reb_simulation* r) {
                         integrator_error = errork;
                     }
                 }
+                reb_ias15_allreduce(r, &integrator_error, 1, 1);
             }
 
             if  (isnormal(integrator_error)){   
@@ -563,12 +755,13 @@ static int reb_integrator_ias15_step(struct reb_simulation* r) {
         }else{ 
             // Otherwise, use zeta * y''/y''' = dt timestep calculation method
             // Loop over all particles and choose the smallest dt
-            unsigned int Nreal = N - r->N_var;
+            unsigned int Nreal = MIN(N_massive, N - r->N_var);
             
             if (r->ri_ias15.epsilon_global){
                 double maxak = 0.;
                 double maxb0k = 0.;
-                for(int i=0;i<Nreal;i++){
+#pragma omp parallel for if(N3>IAS15_PARALLEL_N3) reduction(max:maxak,maxb0k)
+                for(int i=N_ephemeris;i<Nreal;i++){
                     for(int k=3*i;k<3*(i+1);k++) {
 
                         const double ak = fabs(at[k]);
@@ -582,7 +775,9 @@ static int reb_integrator_ias15_step(struct reb_simulation* r) {
                         }
                     }
                 }
-                dt_new = (maxak / maxb0k) * dt_done * dtmode_zeta;
+                double maxs[2] = {maxak, maxb0k};
+                reb_ias15_allreduce(r, maxs, 2, 1);
+                dt_new = (maxs[0] / maxs[1]) * dt_done * dtmode_zeta;
 
             }else{
                 // This individual component version gives unrealistic dt
@@ -600,16 +795,19 @@ static int reb_integrator_ias15_step(struct reb_simulation* r) {
 
                 // In this version, we find the minimum dt over all particles
                 // Where the dt is calculated from the length of vector, instead of individual components
-                dt_new = 0.; // Will update this value in the loop below
-                for(int i=0;i<Nreal;i++){
+                double dt_min = INFINITY;
+#pragma omp parallel for if(N3>IAS15_PARALLEL_N3) reduction(min:dt_min)
+                for(int i=N_ephemeris;i<Nreal;i++){
                     double y2tmp = at[3*i+0]*at[3*i+0] + at[3*i+1]*at[3*i+1] + at[3*i+2]*at[3*i+2];
                     double y3tmp = b.p0[3*i+0]*b.p0[3*i+0] + b.p0[3*i+1]*b.p0[3*i+1] + b.p0[3*i+2]*b.p0[3*i+2];
                     double dttmp = sqrt(y2tmp / y3tmp) * dt_done * dtmode_zeta;
 
-                    if (isnormal(dttmp) && (dt_new == 0. || fabs(dttmp) < fabs(dt_new))) {
-                        dt_new = dttmp;
+                    if (isnormal(dttmp) && fabs(dttmp) < dt_min) {
+                        dt_min = fabs(dttmp);
                     }
                 }
+                reb_ias15_allreduce(r, &dt_min, 1, 0);
+                dt_new = isinf(dt_min)?0.:copysign(dt_min,dt_done); // 0 if no particle gives a finite estimate
             }
 
             safety_factor = safety_factor_dtmode_1;
@@ -622,6 +820,7 @@ static int reb_integrator_ias15_step(struct reb_simulation* r) {
 
         if (fabs(dt_new/dt_done) < safety_factor) { // New timestep is significantly smaller.
                                                              // Reset particles
+#pragma omp parallel for if(N3>IAS15_PARALLEL_N3)
             for(int k=0;k<N;++k) {
                 int mk = map[k];
                 particles[mk].x = x0[3*k+0];    // Set inital position
@@ -650,27 +849,18 @@ static int reb_integrator_ias15_step(struct reb_simulation* r) {
         r->dt = dt_new;
     }
 
+    if (N_massive<N){
+        // Needs to be done before the massive particles are moved to the end of the step
+        testparticles_step(r, N, N_massive, map, dt_done, at, x0, v0, a0, csx, csv, b);
+    }
     // Find new position and velocity values at end of the sequence
-    for(int k=0;k<N3;++k) {
-        // Note: dt_done*dt_done is not precalculated to avoid 
-        //       biased round-off errors when a fixed timestep is used.
-        add_cs(&(x0[k]), &(csx[k]), b.p6[k]/72.*dt_done*dt_done);
-        add_cs(&(x0[k]), &(csx[k]), b.p5[k]/56.*dt_done*dt_done);
-        add_cs(&(x0[k]), &(csx[k]), b.p4[k]/42.*dt_done*dt_done);
-        add_cs(&(x0[k]), &(csx[k]), b.p3[k]/30.*dt_done*dt_done);
-        add_cs(&(x0[k]), &(csx[k]), b.p2[k]/20.*dt_done*dt_done);
-        add_cs(&(x0[k]), &(csx[k]), b.p1[k]/12.*dt_done*dt_done);
-        add_cs(&(x0[k]), &(csx[k]), b.p0[k]/6.*dt_done*dt_done);
-        add_cs(&(x0[k]), &(csx[k]), a0[k]/2.*dt_done*dt_done);
-        add_cs(&(x0[k]), &(csx[k]), v0[k]*dt_done);
-        add_cs(&(v0[k]), &(csv[k]), b.p6[k]/8.*dt_done);
-        add_cs(&(v0[k]), &(csv[k]), b.p5[k]/7.*dt_done);
-        add_cs(&(v0[k]), &(csv[k]), b.p4[k]/6.*dt_done);
-        add_cs(&(v0[k]), &(csv[k]), b.p3[k]/5.*dt_done);
-        add_cs(&(v0[k]), &(csv[k]), b.p2[k]/4.*dt_done);
-        add_cs(&(v0[k]), &(csv[k]), b.p1[k]/3.*dt_done);
-        add_cs(&(v0[k]), &(csv[k]), b.p0[k]/2.*dt_done);
-        add_cs(&(v0[k]), &(csv[k]), a0[k]*dt_done);
+#pragma omp parallel for simd if(N3>IAS15_PARALLEL_N3)
+    for(int k=0;k<MIN(N3_cs,N3_massive);++k) {
+        update_xv(k, x0, csx, v0, csv, b, a0, dt_done);
+    }
+#pragma omp parallel for simd if(N3>IAS15_PARALLEL_N3)
+    for(int k=N3_cs;k<N3_massive;++k) {
+        update_xv_plain(k, x0, v0, b, a0, dt_done);
     }
 
     r->t += dt_done;
@@ -682,6 +872,7 @@ static int reb_integrator_ias15_step(struct reb_simulation* r) {
     }
 
     // Swap particle buffers
+#pragma omp parallel for if(N3>IAS15_PARALLEL_N3)
     for(int k=0;k<N;++k) {
         int mk = map[k];
         particles[mk].x = x0[3*k+0]; // Set final position
@@ -702,6 +893,7 @@ static int reb_integrator_ias15_step(struct reb_simulation* r) {
 static void predict_next_step(double ratio, int N3,  const struct reb_dpconst7 _e, const struct reb_dpconst7 _b, const struct reb_dpconst7 e, const struct reb_dpconst7 b){
     if (ratio>20.){
         // Do not predict if stepsize increase is very large. 
+#pragma omp parallel for simd if(N3>IAS15_PARALLEL_N3)
         for(int k=0;k<N3;++k) {
             e.p0[k] = 0.; e.p1[k] = 0.; e.p2[k] = 0.; e.p3[k] = 0.; e.p4[k] = 0.; e.p5[k] = 0.; e.p6[k] = 0.;
             b.p0[k] = 0.; b.p1[k] = 0.; b.p2[k] = 0.; b.p3[k] = 0.; b.p4[k] = 0.; b.p5[k] = 0.; b.p6[k] = 0.;
@@ -719,6 +911,7 @@ static void predict_next_step(double ratio, int N3,  const struct reb_dpconst7 _
         const double q6 = q3 * q3;
         const double q7 = q3 * q4;
 
+#pragma omp parallel for simd if(N3>IAS15_PARALLEL_N3)
         for(int k=0;k<N3;++k) {
             double be0 = _b.p0[k] - _e.p0[k];
             double be1 = _b.p1[k] - _e.p1[k];
@@ -749,6 +942,7 @@ static void predict_next_step(double ratio, int N3,  const struct reb_dpconst7 _
 }
 
 static void copybuffers(const struct reb_dpconst7 _a, const struct reb_dpconst7 _b, int N3){
+#pragma omp parallel for simd if(N3>IAS15_PARALLEL_N3)
     for (int i=0;i<N3;i++){ 
         _b.p0[i] = _a.p0[i];
         _b.p1[i] = _a.p1[i];
@@ -764,6 +958,240 @@ static void copybuffers(const struct reb_dpconst7 _a, const struct reb_dpconst7
 //  }
 }
 
+// With the MPI test particle decomposition, every node has different test particles but all nodes
+// need to agree on when the predictor corrector loop has converged and on the next timestep.
+// Replaces the values with their maximum (max=1) or minimum (max=0) over all nodes.
+static void reb_ias15_allreduce(const struct reb_simulation* const r, double* const values, const int N, const int max){
+#ifdef MPI
+    if (r->mpi_decomposition==REB_MPI_DECOMPOSITION_TESTPARTICLES && r->integrator==REB_INTEGRATOR_IAS15){
+        MPI_Allreduce(MPI_IN_PLACE, values, N, MPI_DOUBLE, max?MPI_MAX:MPI_MIN, MPI_COMM_WORLD);
+    }
+#endif // MPI
+}
+
+// Returns the index of the first test particle which is substepped individually, or N if there are none.
+static int testparticles_start(struct reb_simulation* const r, const int N){
+    if (!r->ri_ias15.testparticle_substeps || r->ri_ias15.epsilon<=0. || r->ephemeris){
+        return N;
+    }
+    int N_massive;
+    int supported = r->testparticle_type==0 && r->N_var==0 && r->additional_forces==NULL && r->additional_forces_soa==NULL;
+    if (r->integrator==REB_INTEGRATOR_MERCURIUS){
+        N_massive = r->ri_mercurius.encounterNactive;
+    }else{
+        N_massive = r->N_active==-1?N:r->N_active;
+        supported = supported && (r->gravity==REB_GRAVITY_BASIC || r->gravity==REB_GRAVITY_COMPENSATED);
+        supported = supported && r->gravity_ignore_terms==0 && r->nghostx==0 && r->nghosty==0 && r->nghostz==0;
+    }
+    if (N_massive>=N){
+        return N;
+    }
+    if (!supported){
+        reb_warning(r, "IAS15 can only substep test particles if testparticle_type=0, there are no variational particles, no additional forces, and the gravity routine is BASIC or COMPENSATED without ghost boxes. Turning testparticle_substeps off.");
+        r->ri_ias15.testparticle_substeps = 0;
+        return N;
+    }
+    return N_massive;
+}
+
+// Calculates the acceleration of the test particle mi at the position x. The massive particles are 
+// placed at the fraction h of the timestep dt_done using the b coefficients of the current step.
+static void testparticle_acceleration(const struct reb_simulation* const r, const int mi, const double* const x, const double h, const double dt_done, const int N_massive, const int* const map, const double* const x0, const double* const v0, const double* const a0, const double* const csx, const struct reb_dpconst7 b, double* const a){
+    const struct reb_particle* const particles = r->particles;
+    const double G = r->G;
+    const double softening2 = r->softening*r->softening;
+    const int mercurius = r->integrator==REB_INTEGRATOR_MERCURIUS;
+    const enum REB_MERCURIUS_L L_type = mercurius?reb_integrator_mercurius_L_type(r):REB_MERCURIUS_L_CUSTOM;
+    a[0] = 0.;
+    a[1] = 0.;
+    a[2] = 0.;
+    int jstart = 0;
+    if (mercurius){
+        // Heliocentric coordinates. The star is at the origin and the force is not smoothed.
+        const double _r = sqrt(x[0]*x[0] + x[1]*x[1] + x[2]*x[2] + softening2);
+        const double prefact = -G/(_r*_r*_r)*particles[0].m;
+        a[0] += prefact*x[0];
+        a[1] += prefact*x[1];
+        a[2] += prefact*x[2];
+        jstart = 1;
+    }
+    for (int j=jstart;j<N_massive;j++){
+        const int mj = map[j];
+        double dx[3];
+        for (int l=0;l<3;l++){
+            const int k = 3*j+l;
+            const double xk = -csx[k] + ((((((((b.p6[k]*7.*h/9. + b.p5[k])*3.*h/4. + b.p4[k])*5.*h/7. + b.p3[k])*2.*h/3. + b.p2[k])*3.*h/5. + b.p1[k])*h/2. + b.p0[k])*h/3. + a0[k])*dt_done*h/2. + v0[k])*dt_done*h;
+            dx[l] = x[l] - (xk + x0[k]);
+        }
+        const double _r = sqrt(dx[0]*dx[0] + dx[1]*dx[1] + dx[2]*dx[2] + softening2);
+        double prefact = -G/(_r*_r*_r)*particles[mj].m;
+        if (mercurius){
+            const double* const dcrit = r->ri_mercurius.dcrit;
+            prefact *= 1.-reb_integrator_mercurius_L_eval(r, L_type, _r, MAX(dcrit[mi],dcrit[mj]));
+        }
+        a[0] += prefact*dx[0];
+        a[1] += prefact*dx[1];
+        a[2] += prefact*dx[2];
+    }
+}
+
+// Integrates the test particle i over the timestep dt_done with substeps, starting with the substep dt.
+// This uses the same scheme as reb_integrator_ias15_step() but only for one particle and 
+// with the massive particles moving along the trajectories of the current step.
+static void testparticle_substeps(const struct reb_simulation* const r, const int i, const int N_massive, const int* const map, double dt, const double dt_done, double* const x0, double* const v0, const double* const a0, double* const csx, double* const csv, const struct reb_dpconst7 b){
+    const int mi = map[i];
+    double xs[3], vs[3], csxs[3], csvs[3], as[3], at[3], x[3];
+    for (int l=0;l<3;l++){
+        xs[l] = x0[3*i+l];
+        vs[l] = v0[3*i+l];
+        csxs[l] = csx[3*i+l];
+        csvs[l] = csv[3*i+l];
+        as[l] = a0[3*i+l];
+    }
+    double sg[7][3] = {{0.}};
+    double sb[7][3] = {{0.}};
+    double scsb[7][3];
+    double se[7][3] = {{0.}};
+    double sbr[7][3];
+    double ser[7][3];
+    const struct reb_dpconst7 g = {sg[0], sg[1], sg[2], sg[3], sg[4], sg[5], sg[6]};
+    const struct reb_dpconst7 bs= {sb[0], sb[1], sb[2], sb[3], sb[4], sb[5], sb[6]};
+    const struct reb_dpconst7 e = {se[0], se[1], se[2], se[3], se[4], se[5], se[6]};
+    const struct reb_dpconst7 br= {sbr[0], sbr[1], sbr[2], sbr[3], sbr[4], sbr[5], sbr[6]};
+    const struct reb_dpconst7 er= {ser[0], ser[1], ser[2], ser[3], ser[4], ser[5], ser[6]};
+    double t = 0.; // Time since the beginning of the step
+    double dt_last_done = 0.;
+    while(t+dt!=t){ // Stops early only if the substep is too small to advance the time
+        const int last = fabs(dt)>=fabs(dt_done-t);
+        if (last){
+            dt = dt_done-t;
+        }
+        memset(scsb, 0, sizeof(scsb));
+        for(int k=0;k<3;k++) {
+            g.p0[k] = bs.p6[k]*d[15] + bs.p5[k]*d[10] + bs.p4[k]*d[6] + bs.p3[k]*d[3]  + bs.p2[k]*d[1]  + bs.p1[k]*d[0]  + bs.p0[k];
+            g.p1[k] = bs.p6[k]*d[16] + bs.p5[k]*d[11] + bs.p4[k]*d[7] + bs.p3[k]*d[4]  + bs.p2[k]*d[2]  + bs.p1[k];
+            g.p2[k] = bs.p6[k]*d[17] + bs.p5[k]*d[12] + bs.p4[k]*d[8] + bs.p3[k]*d[5]  + bs.p2[k];
+            g.p3[k] = bs.p6[k]*d[18] + bs.p5[k]*d[13] + bs.p4[k]*d[9] + bs.p3[k];
+            g.p4[k] = bs.p6[k]*d[19] + bs.p5[k]*d[14] + bs.p4[k];
+            g.p5[k] = bs.p6[k]*d[20] + bs.p5[k];
+            g.p6[k] = bs.p6[k];
+        }
+        // Predictor corrector loop with the same stopping conditions as in reb_integrator_ias15_step()
+        double predictor_corrector_error = 1e300;
+        double predictor_corrector_error_last = 2;
+        int iterations = 0;
+        while(predictor_corrector_error>=1e-16 && iterations<12 && (iterations<=2 || predictor_corrector_error_last>predictor_corrector_error)){
+            predictor_corrector_error_last = predictor_corrector_error;
+            iterations++;
+            for(int n=1;n<8;n++) {
+                for(int k=0;k<3;k++) {
+                    const double xk = -csxs[k] + ((((((((bs.p6[k]*7.*h[n]/9. + bs.p5[k])*3.*h[n]/4. + bs.p4[k])*5.*h[n]/7. + bs.p3[k])*2.*h[n]/3. + bs.p2[k])*3.*h[n]/5. + bs.p1[k])*h[n]/2. + bs.p0[k])*h[n]/3. + as[k])*dt*h[n]/2. + vs[k])*dt*h[n];
+                    x[k] = xk + xs[k];
+                }
+                testparticle_acceleration(r, mi, x, (t+dt*h[n])/dt_done, dt_done, N_massive, map, x0, v0, a0, csx, b, at);
+                // Same as the cases in reb_integrator_ias15_step(), written as loops over the coefficients
+                const int j = n-1;
+                double maxak = 0.0;
+                double maxb6ktmp = 0.0;
+                for(int k=0;k<3;k++) {
+                    double gk = (at[k] - as[k])/rr[j*(j+1)/2];
+                    for (int l=0;l<j;l++){
+                        gk = (gk - sg[l][k])/rr[j*(j+1)/2+l+1];
+                    }
+                    const double tmp = gk - sg[j][k];
+                    sg[j][k] = gk;
+                    for (int l=0;l<j;l++){
+                        add_cs(&(sb[l][k]), &(scsb[l][k]), tmp * c[(j-1)*j/2+l]);
+                    }
+                    add_cs(&(sb[j][k]), &(scsb[j][k]), tmp);
+                    if (isnormal(fabs(at[k])) && fabs(at[k])>maxak){
+                        maxak = fabs(at[k]);
+                    }
+                    if (isnormal(fabs(tmp)) && fabs(tmp)>maxb6ktmp){
+                        maxb6ktmp = fabs(tmp);
+                    }
+                }
+                if (n==7){
+                    predictor_corrector_error = maxb6ktmp/maxak;
+                }
+            }
+        }
+        // Timestep criterion as for epsilon_global=1 and dt_mode=0 
+        double maxak = 0.0;
+        double maxb6k = 0.0;
+        for(int k=0;k<3;k++) {
+            if (isnormal(fabs(at[k])) && fabs(at[k])>maxak){
+                maxak = fabs(at[k]);
+            }
+            if (isnormal(fabs(bs.p6[k])) && fabs(bs.p6[k])>maxb6k){
+                maxb6k = fabs(bs.p6[k]);
+            }
+        }
+        const double integrator_error = maxb6k/maxak;
+        double dt_new = isnormal(integrator_error) ? sqrt7(r->ri_ias15.epsilon/integrator_error)*dt : dt/safety_factor_dtmode_0;
+        if (fabs(dt_new)<r->ri_ias15.min_dt) dt_new = copysign(r->ri_ias15.min_dt,dt_new);
+        if (fabs(dt_new/dt) < safety_factor_dtmode_0) { // Substep rejected
+            if (dt_last_done!=0.){
+                predict_next_step(dt_new/dt_last_done, 3, er, br, e, bs);
+            }else{
+                memset(sb, 0, sizeof(sb));
+            }
+            dt = dt_new;
+            continue;
+        }
+        if (dt_new/dt > 1./safety_factor_dtmode_0) dt_new = dt/safety_factor_dtmode_0;
+        for(int k=0;k<3;k++) {
+            update_xv(k, xs, csxs, vs, csvs, bs, as, dt);
+        }
+        if (last){
+            break;
+        }
+        t += dt;
+        testparticle_acceleration(r, mi, xs, t/dt_done, dt_done, N_massive, map, x0, v0, a0, csx, b, as);
+        copybuffers(e,er,3);
+        copybuffers(bs,br,3);
+        predict_next_step(dt_new/dt, 3, e, bs, e, bs);
+        dt_last_done = dt;
+        dt = dt_new;
+    }
+    for (int l=0;l<3;l++){
+        x0[3*i+l] = xs[l];
+        v0[3*i+l] = vs[l];
+        csx[3*i+l] = csxs[l];
+        csv[3*i+l] = csvs[l];
+    }
+}
+
+// Advances all test particles to the end of the step. Test particles for which the step 
+// is too large according to their own error estimate are integrated with substeps.
+static void testparticles_step(struct reb_simulation* const r, const int N, const int N_massive, const int* const map, const double dt_done, const double* const at, double* const x0, double* const v0, const double* const a0, double* const csx, double* const csv, const struct reb_dpconst7 b){
+#pragma omp parallel for schedule(dynamic) if(3*(N-N_massive)>IAS15_PARALLEL_N3)
+    for (int i=N_massive;i<N;i++){
+        double maxak = 0.0;
+        double maxb6k = 0.0;
+        for(int k=3*i;k<3*(i+1);k++) { 
+            const double ak  = fabs(at[k]);
+            if (isnormal(ak) && ak>maxak){
+                maxak = ak;
+            }
+            const double b6k = fabs(b.p6[k]); 
+            if (isnormal(b6k) && b6k>maxb6k){
+                maxb6k = b6k;
+            }
+        }
+        const double error = maxb6k/maxak;
+        if (!(error<=r->ri_ias15.epsilon)){ // Also true if the error estimate is not finite
+            // Start with a small substep if there is no estimate
+            const double dt = isnormal(error) ? sqrt7(r->ri_ias15.epsilon/error)*dt_done : 1e-4*dt_done;
+            testparticle_substeps(r, i, N_massive, map, dt, dt_done, x0, v0, a0, csx, csv, b);
+        }else{
+            for(int k=3*i;k<3*(i+1);k++) { 
+                update_xv(k, x0, csx, v0, csv, b, a0, dt_done);
+            }
+        }
+    }
+}
+
 // Do nothing here. This is only used in a leapfrog-like DKD integrator. IAS15 performs one complete timestep.
 void reb_integrator_ias15_part1(struct reb_simulation* r){
     r->gravity_ignore_terms = 0;
@@ -28,4 +28,6 @@ void reb_integrator_ias15_part1(struct reb_simulation* r);         ///< Internal
 void reb_integrator_ias15_synchronize(struct reb_simulation* r);   ///< Internal function used to call a specific integrator
 void reb_integrator_ias15_clear(struct reb_simulation* r);         ///< Internal function used to call a specific integrator
 void reb_integrator_ias15_alloc(struct reb_simulation* r);         ///< Internal function, alloctes memory for IAS15 
+void reb_integrator_ias15_alloc_dp7(struct reb_dp7* const dp7, const int N3); ///< Internal function, allocates the seven arrays of a reb_dp7 in one aligned block
+void reb_integrator_ias15_copy_dp7(struct reb_dp7* const dp7, const struct reb_dp7* const dp7_src, const int N3); ///< Internal function, replaces dp7 with a copy of dp7_src
 #endif
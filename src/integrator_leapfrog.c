@@ -33,38 +33,73 @@
 #include <math.h>
 #include <time.h>
 #include "rebound.h"
+#include "boundary.h"
+#include "integrator_leapfrog.h"
 
 // Leapfrog integrator (Drift-Kick-Drift)
 // for non-rotating frame.
-void reb_integrator_leapfrog_part1(struct reb_simulation* r){
+// If wrap is set, periodic or shear boundary conditions are 
+// applied in the same loop as the drift. Sleeping particles 
+// are neither kicked nor drifted.
+static inline void reb_integrator_leapfrog_drift(struct reb_simulation* r, const int wrap){
     r->gravity_ignore_terms = 0;
 	const int N = r->N;
 	struct reb_particle* restrict const particles = r->particles;
 	const double dt = r->dt;
+	r->t+=dt/2.;
+	const struct reb_boundary_wrap w = wrap?reb_boundary_wrap_init(r, r->t):(struct reb_boundary_wrap){0};
+	const int sleeping = r->N_asleep>0;
 #pragma omp parallel for schedule(guided)
 	for (int i=0;i<N;i++){
+		if (sleeping && (particles[i].frozen & REB_PARTICLE_ASLEEP)){
+			continue;
+		}
 		particles[i].x  += 0.5* dt * particles[i].vx;
 		particles[i].y  += 0.5* dt * particles[i].vy;
 		particles[i].z  += 0.5* dt * particles[i].vz;
+		if (wrap){
+			reb_boundary_wrap_particle(&w, &particles[i]);
+		}
 	}
-	r->t+=dt/2.;
 }
-void reb_integrator_leapfrog_part2(struct reb_simulation* r){
+
+static inline void reb_integrator_leapfrog_kick_drift(struct reb_simulation* r, const int wrap){
 	const int N = r->N;
 	struct reb_particle* restrict const particles = r->particles;
 	const double dt = r->dt;
+	r->t+=dt/2.;
+	const struct reb_boundary_wrap w = wrap?reb_boundary_wrap_init(r, r->t):(struct reb_boundary_wrap){0};
+	const int sleeping = r->N_asleep>0;
 #pragma omp parallel for schedule(guided)
 	for (int i=0;i<N;i++){
+		if (sleeping && (particles[i].frozen & REB_PARTICLE_ASLEEP)){
+			continue;
+		}
 		particles[i].vx += dt * particles[i].ax;
 		particles[i].vy += dt * particles[i].ay;
 		particles[i].vz += dt * particles[i].az;
 		particles[i].x  += 0.5* dt * particles[i].vx;
 		particles[i].y  += 0.5* dt * particles[i].vy;
 		particles[i].z  += 0.5* dt * particles[i].vz;
+		if (wrap){
+			reb_boundary_wrap_particle(&w, &particles[i]);
+		}
 	}
-	r->t+=dt/2.;
 	r->dt_last_done = r->dt;
 }
+
+void reb_integrator_leapfrog_part1(struct reb_simulation* r){
+	reb_integrator_leapfrog_drift(r, 0);
+}
+void reb_integrator_leapfrog_part2(struct reb_simulation* r){
+	reb_integrator_leapfrog_kick_drift(r, 0);
+}
+void reb_integrator_leapfrog_part1_boundary(struct reb_simulation* r){
+	reb_integrator_leapfrog_drift(r, 1);
+}
+void reb_integrator_leapfrog_part2_boundary(struct reb_simulation* r){
+	reb_integrator_leapfrog_kick_drift(r, 1);
+}
 	
 void reb_integrator_leapfrog_synchronize(struct reb_simulation* r){
 	// Do nothing.
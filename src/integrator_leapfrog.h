@@ -26,6 +26,8 @@
 #define _INTEGRATOR_LEAPFROG_H
 void reb_integrator_leapfrog_part1(struct reb_simulation* r);          ///< Internal function used to call a specific integrator
 void reb_integrator_leapfrog_part2(struct reb_simulation* r);          ///< Internal function used to call a specific integrator
+void reb_integrator_leapfrog_part1_boundary(struct reb_simulation* r); ///< Same as part1 but also applies periodic or shear boundary conditions
+void reb_integrator_leapfrog_part2_boundary(struct reb_simulation* r); ///< Same as part2 but also applies periodic or shear boundary conditions
 void reb_integrator_leapfrog_synchronize(struct reb_simulation* r);    ///< Internal function used to call a specific integrator
 void reb_integrator_leapfrog_reset(struct reb_simulation* r);          ///< Internal function used to call a specific integrator
 #endif
@@ -43,57 +43,32 @@
 
 double reb_integrator_mercurius_L_mercury(const struct reb_simulation* const r, double d, double dcrit){
     // This is the changeover function used by the Mercury integrator.
-    double y = (d-0.1*dcrit)/(0.9*dcrit);
-    if (y<0.){
-        return 0.;
-    }else if (y>1.){
-        return 1.;
-    }else{
-        return 10.*(y*y*y) - 15.*(y*y*y*y) + 6.*(y*y*y*y*y);
-    }
+    return reb_integrator_mercurius_L_eval(r, REB_MERCURIUS_L_MERCURY, d, dcrit);
 }
 
 double reb_integrator_mercurius_L_C4(const struct reb_simulation* const r, double d, double dcrit){
     // This is the changeover function C4 proposed by Hernandez (2019)
-    double y = (d-0.1*dcrit)/(0.9*dcrit);
-    if (y<0.){
-        return 0.;
-    }else if (y>1.){
-        return 1.;
-    }else{
-        return (70.*y*y*y*y -315.*y*y*y +540.*y*y -420.*y +126.)*y*y*y*y*y;
-    }
+    return reb_integrator_mercurius_L_eval(r, REB_MERCURIUS_L_C4, d, dcrit);
 }
 
 double reb_integrator_mercurius_L_C5(const struct reb_simulation* const r, double d, double dcrit){
     // This is the changeover function C5 proposed by Hernandez (2019)
-    double y = (d-0.1*dcrit)/(0.9*dcrit);
-    if (y<0.){
-        return 0.;
-    }else if (y>1.){
-        return 1.;
-    }else{
-        return (-252.*y*y*y*y*y +1386.*y*y*y*y -3080.*y*y*y +3465.*y*y -1980.*y +462.)*y*y*y*y*y*y;
-    }
-}
-
-static double f(double x){
-    if (x<0) return 0;
-    return exp(-1./x);
+    return reb_integrator_mercurius_L_eval(r, REB_MERCURIUS_L_C5, d, dcrit);
 }
 
 double reb_integrator_mercurius_L_infinity(const struct reb_simulation* const r, double d, double dcrit){
     // Infinitely differentiable function.
-    double y = (d-0.1*dcrit)/(0.9*dcrit);
-    if (y<0.){
-        return 0.;
-    }else if (y>1.){
-        return 1.;
-    }else{
-        return f(y) /(f(y) + f(1.-y));
-    }
+    return reb_integrator_mercurius_L_eval(r, REB_MERCURIUS_L_INFINITY, d, dcrit);
 }
 
+enum REB_MERCURIUS_L reb_integrator_mercurius_L_type(const struct reb_simulation* const r){
+    double (*L) (const struct reb_simulation* const r, double d, double dcrit) = r->ri_mercurius.L;
+    if (L==reb_integrator_mercurius_L_mercury) return REB_MERCURIUS_L_MERCURY;
+    if (L==reb_integrator_mercurius_L_C4) return REB_MERCURIUS_L_C4;
+    if (L==reb_integrator_mercurius_L_C5) return REB_MERCURIUS_L_C5;
+    if (L==reb_integrator_mercurius_L_infinity) return REB_MERCURIUS_L_INFINITY;
+    return REB_MERCURIUS_L_CUSTOM;
+}
 
 void reb_integrator_mercurius_inertial_to_dh(struct reb_simulation* r){
     struct reb_particle* restrict const particles = r->particles;
@@ -170,10 +145,104 @@ void reb_integrator_mercurius_dh_to_inertial(struct reb_simulation* r){
 }
 
 
+void reb_integrator_mercurius_encounter_pairs_add(struct reb_simulation* r, int i, int j){
+    struct reb_simulation_integrator_mercurius* rim = &(r->ri_mercurius);
+    if (rim->encounter_pairs_allocatedN<=rim->encounter_pairs_N){
+        rim->encounter_pairs_allocatedN = rim->encounter_pairs_allocatedN ? rim->encounter_pairs_allocatedN * 2 : 32;
+        rim->encounter_pairs = realloc(rim->encounter_pairs, sizeof(int)*2*rim->encounter_pairs_allocatedN);
+    }
+    rim->encounter_pairs[2*rim->encounter_pairs_N] = i;
+    rim->encounter_pairs[2*rim->encounter_pairs_N+1] = j;
+    rim->encounter_pairs_N++;
+}
+
+// Returns the minimum of the squared distance between particles i and j during the timestep.
+// The squared distance is interpolated with a cubic polynomial using the old and new positions and velocities.
+static inline double reb_mercurius_encounter_rmin2(const struct reb_particle* const particles, const struct reb_particle* const particles_backup, const int i, const int j, const double dt){
+    const double dxn = particles[i].x - particles[j].x;
+    const double dyn = particles[i].y - particles[j].y;
+    const double dzn = particles[i].z - particles[j].z;
+    const double dvxn = particles[i].vx - particles[j].vx;
+    const double dvyn = particles[i].vy - particles[j].vy;
+    const double dvzn = particles[i].vz - particles[j].vz;
+    const double rn = (dxn*dxn + dyn*dyn + dzn*dzn);
+    const double dxo = particles_backup[i].x - particles_backup[j].x;
+    const double dyo = particles_backup[i].y - particles_backup[j].y;
+    const double dzo = particles_backup[i].z - particles_backup[j].z;
+    const double dvxo = particles_backup[i].vx - particles_backup[j].vx;
+    const double dvyo = particles_backup[i].vy - particles_backup[j].vy;
+    const double dvzo = particles_backup[i].vz - particles_backup[j].vz;
+    const double ro = (dxo*dxo + dyo*dyo + dzo*dzo);
+
+    const double drndt = (dxn*dvxn+dyn*dvyn+dzn*dvzn)*2.;
+    const double drodt = (dxo*dvxo+dyo*dvyo+dzo*dvzo)*2.;
+
+    const double a = 6.*(ro-rn)+3.*dt*(drodt+drndt); 
+    const double b = 6.*(rn-ro)-2.*dt*(2.*drodt+drndt); 
+    const double c = dt*drodt; 
+
+    double rmin = MIN(rn,ro);
+
+    const double s = b*b-4.*a*c;
+    const double sr = sqrt(MAX(0.,s));
+    const double tmin1 = (-b + sr)/(2.*a); 
+    const double tmin2 = (-b - sr)/(2.*a); 
+    if (tmin1>0. && tmin1<1.){
+        const double rmin1 = (1.-tmin1)*(1.-tmin1)*(1.+2.*tmin1)*ro
+                             + tmin1*tmin1*(3.-2.*tmin1)*rn
+                             + tmin1*(1.-tmin1)*(1.-tmin1)*dt*drodt
+                             - tmin1*tmin1*(1.-tmin1)*dt*drndt;
+        rmin = MIN(MAX(rmin1,0.),rmin);
+    }
+    if (tmin2>0. && tmin2<1.){
+        const double rmin2 = (1.-tmin2)*(1.-tmin2)*(1.+2.*tmin2)*ro
+                             + tmin2*tmin2*(3.-2.*tmin2)*rn
+                             + tmin2*(1.-tmin2)*(1.-tmin2)*dt*drodt
+                             - tmin2*tmin2*(1.-tmin2)*dt*drndt;
+        rmin = MIN(MAX(rmin2,0.),rmin);
+    }
+    return rmin;
+}
+
+// Appends the pair (i,j) to a list of pairs.
+static inline void reb_mercurius_encounter_list_append(int** list, int* list_N, int* list_allocatedN, const int i, const int j){
+    if ((*list_allocatedN)<=(*list_N)){
+        *list_allocatedN = (*list_allocatedN) ? (*list_allocatedN) * 2 : 32;
+        *list = realloc(*list, sizeof(int)*2*(*list_allocatedN));
+    }
+    (*list)[2*(*list_N)] = i;
+    (*list)[2*(*list_N)+1] = j;
+    (*list_N)++;
+}
+
+// Sorts pairs by the first index and then by the second index.
+static int reb_mercurius_encounter_pair_compare(const void* a, const void* b){
+    const int* const pa = a;
+    const int* const pb = b;
+    if (pa[0]!=pb[0]) return pa[0]<pb[0]?-1:1;
+    if (pa[1]!=pb[1]) return pa[1]<pb[1]?-1:1;
+    return 0;
+}
+
+static int reb_mercurius_encounter_index_compare(const void* a, const void* b){
+    const int ia = *(const int*)a;
+    const int ib = *(const int*)b;
+    if (ia!=ib) return ia<ib?-1:1;
+    return 0;
+}
+
 static void reb_mercurius_encounter_predict(struct reb_simulation* const r){
     // This function predicts close encounters during the timestep
     // It makes use of the old and new position and velocities obtained
     // after the Kepler step.
+    //
+    // A broad phase first finds all pairs whose swept bounding boxes overlap.
+    // Every particle's box contains its old and new position and is padded by
+    // 1.1*dcrit + dt*|v|max + |x_new-x_old|/2. If the padded boxes of two particles
+    // do not overlap, the cubic interpolation of their squared distance stays above
+    // (1.1*max(dcrit))^2 during the entire timestep. Only the remaining pairs are
+    // tested with the cubic interpolation (narrow phase). The boxes of massive
+    // particles are binned on a uniform grid which is then queried by all particles.
     struct reb_simulation_integrator_mercurius* rim = &(r->ri_mercurius);
     struct reb_particle* const particles = r->particles;
     struct reb_particle* const particles_backup = rim->particles_backup;
@@ -181,78 +250,181 @@ static void reb_mercurius_encounter_predict(struct reb_simulation* const r){
     const int N = r->N;
     const int N_active = r->N_active==-1?r->N:r->N_active;
     const double dt = r->dt;
+    // The encounter map is a sorted list of the indices of all particles having
+    // an encounter. The star is always included.
     rim->encounterN = 1;
-    rim->encounter_map[0] = 1;
+    rim->encounter_map[0] = 0;
+    rim->encounter_pairs_N = 0;
     if (r->testparticle_type==1){
         rim->tponly_encounter = 0; // testparticles affect massive particles
     }else{
         rim->tponly_encounter = 1;
     }
-    for (int i=1; i<N; i++){
-        rim->encounter_map[i] = 0;
+    if (N_active<1 || N<2){
+        return;
     }
+
+    // Padded swept bounding boxes (xmin, ymin, zmin, xmax, ymax, zmax)
+    double* const box = malloc(sizeof(double)*6*N);
+#pragma omp parallel for schedule(guided)
+    for (int i=0; i<N; i++){
+        const struct reb_particle pn = particles[i];
+        const struct reb_particle po = particles_backup[i];
+        const double dx = pn.x-po.x;
+        const double dy = pn.y-po.y;
+        const double dz = pn.z-po.z;
+        const double vmax = sqrt(MAX(pn.vx*pn.vx+pn.vy*pn.vy+pn.vz*pn.vz, po.vx*po.vx+po.vy*po.vy+po.vz*po.vz));
+        // The factor 1.01 guards against round-off.
+        const double pad = 1.01*(1.1*dcrit[i] + fabs(dt)*vmax + 0.5*sqrt(dx*dx+dy*dy+dz*dz));
+        box[6*i+0] = MIN(pn.x,po.x) - pad;
+        box[6*i+1] = MIN(pn.y,po.y) - pad;
+        box[6*i+2] = MIN(pn.z,po.z) - pad;
+        box[6*i+3] = MAX(pn.x,po.x) + pad;
+        box[6*i+4] = MAX(pn.y,po.y) + pad;
+        box[6*i+5] = MAX(pn.z,po.z) + pad;
+    }
+
+    // Uniform grid covering the boxes of all massive particles.
+    // The cell size is the average box size. The number of cells is limited to about 8*N_active.
+    double gmin[3] = {box[0], box[1], box[2]};
+    double gmax[3] = {box[3], box[4], box[5]};
+    double size = 0.;
     for (int i=0; i<N_active; i++){
-        for (int j=i+1; j<N; j++){
-            const double dxn = particles[i].x - particles[j].x;
-            const double dyn = particles[i].y - particles[j].y;
-            const double dzn = particles[i].z - particles[j].z;
-            const double dvxn = particles[i].vx - particles[j].vx;
-            const double dvyn = particles[i].vy - particles[j].vy;
-            const double dvzn = particles[i].vz - particles[j].vz;
-            const double rn = (dxn*dxn + dyn*dyn + dzn*dzn);
-            const double dxo = particles_backup[i].x - particles_backup[j].x;
-            const double dyo = particles_backup[i].y - particles_backup[j].y;
-            const double dzo = particles_backup[i].z - particles_backup[j].z;
-            const double dvxo = particles_backup[i].vx - particles_backup[j].vx;
-            const double dvyo = particles_backup[i].vy - particles_backup[j].vy;
-            const double dvzo = particles_backup[i].vz - particles_backup[j].vz;
-            const double ro = (dxo*dxo + dyo*dyo + dzo*dzo);
-
-            const double drndt = (dxn*dvxn+dyn*dvyn+dzn*dvzn)*2.;
-            const double drodt = (dxo*dvxo+dyo*dvyo+dzo*dvzo)*2.;
-
-            const double a = 6.*(ro-rn)+3.*dt*(drodt+drndt); 
-            const double b = 6.*(rn-ro)-2.*dt*(2.*drodt+drndt); 
-            const double c = dt*drodt; 
-
-            double rmin = MIN(rn,ro);
-
-            const double s = b*b-4.*a*c;
-            const double sr = sqrt(MAX(0.,s));
-            const double tmin1 = (-b + sr)/(2.*a); 
-            const double tmin2 = (-b - sr)/(2.*a); 
-            if (tmin1>0. && tmin1<1.){
-                const double rmin1 = (1.-tmin1)*(1.-tmin1)*(1.+2.*tmin1)*ro
-                                     + tmin1*tmin1*(3.-2.*tmin1)*rn
-                                     + tmin1*(1.-tmin1)*(1.-tmin1)*dt*drodt
-                                     - tmin1*tmin1*(1.-tmin1)*dt*drndt;
-                rmin = MIN(MAX(rmin1,0.),rmin);
-            }
-            if (tmin2>0. && tmin2<1.){
-                const double rmin2 = (1.-tmin2)*(1.-tmin2)*(1.+2.*tmin2)*ro
-                                     + tmin2*tmin2*(3.-2.*tmin2)*rn
-                                     + tmin2*(1.-tmin2)*(1.-tmin2)*dt*drodt
-                                     - tmin2*tmin2*(1.-tmin2)*dt*drndt;
-                rmin = MIN(MAX(rmin2,0.),rmin);
-            }
+        for (int k=0; k<3; k++){
+            gmin[k] = MIN(gmin[k], box[6*i+k]);
+            gmax[k] = MAX(gmax[k], box[6*i+3+k]);
+            size += box[6*i+3+k] - box[6*i+k];
+        }
+    }
+    size /= 3.*N_active;
+    const int ncellmax = (int)cbrt(8.*N_active)+1;
+    int ncell[3];
+    double cellinv[3];
+    for (int k=0; k<3; k++){
+        const double extent = gmax[k]-gmin[k];
+        ncell[k] = (size>0. && isfinite(extent))?(int)MIN(extent/size+1., (double)ncellmax):1;
+        cellinv[k] = extent>0.?ncell[k]/extent:0.;
+    }
+    const int ncells = ncell[0]*ncell[1]*ncell[2];
+    #define CELL(q, k) ((int)MIN(MAX(((q)-gmin[k])*cellinv[k], 0.), ncell[k]-1.))
 
-            double dcritmax2 = MAX(dcrit[i],dcrit[j]);
-            dcritmax2 *= 1.21*dcritmax2;
-            if (rmin < dcritmax2){
-                if (rim->encounter_map[i]==0){
-                    rim->encounter_map[i] = i;
-                    rim->encounterN++;
+    // Store the massive particles in each cell (compressed row storage, sorted by index)
+    int* const cell_start = calloc(ncells+1, sizeof(int));
+    for (int i=0; i<N_active; i++){
+        const int c0[3] = {CELL(box[6*i+0],0), CELL(box[6*i+1],1), CELL(box[6*i+2],2)};
+        const int c1[3] = {CELL(box[6*i+3],0), CELL(box[6*i+4],1), CELL(box[6*i+5],2)};
+        for (int cx=c0[0]; cx<=c1[0]; cx++){
+        for (int cy=c0[1]; cy<=c1[1]; cy++){
+        for (int cz=c0[2]; cz<=c1[2]; cz++){
+            cell_start[(cx*ncell[1]+cy)*ncell[2]+cz+1]++;
+        }
+        }
+        }
+    }
+    for (int c=0; c<ncells; c++){
+        cell_start[c+1] += cell_start[c];
+    }
+    int* const cell_items = malloc(sizeof(int)*MAX(cell_start[ncells],1));
+    int* const cell_fill = malloc(sizeof(int)*ncells);
+    memcpy(cell_fill, cell_start, sizeof(int)*ncells);
+    for (int i=0; i<N_active; i++){
+        const int c0[3] = {CELL(box[6*i+0],0), CELL(box[6*i+1],1), CELL(box[6*i+2],2)};
+        const int c1[3] = {CELL(box[6*i+3],0), CELL(box[6*i+4],1), CELL(box[6*i+5],2)};
+        for (int cx=c0[0]; cx<=c1[0]; cx++){
+        for (int cy=c0[1]; cy<=c1[1]; cy++){
+        for (int cz=c0[2]; cz<=c1[2]; cz++){
+            cell_items[cell_fill[(cx*ncell[1]+cy)*ncell[2]+cz]++] = i;
+        }
+        }
+        }
+    }
+    free(cell_fill);
+
+    // Every particle j queries the cells overlapping its box for massive particles i<j.
+    // A pair is only tested in the cell which contains the lower corner of the
+    // intersection of both boxes. This ensures every pair is tested exactly once.
+    int* pairs = NULL;
+    int pairs_N = 0;
+    int pairs_allocatedN = 0;
+#pragma omp parallel
+    {
+    int* pairs_local = NULL;
+    int pairs_local_N = 0;
+    int pairs_local_allocatedN = 0;
+#pragma omp for schedule(guided)
+    for (int j=1; j<N; j++){
+        const double* const bj = &box[6*j];
+        if (bj[3]<gmin[0] || bj[4]<gmin[1] || bj[5]<gmin[2] || bj[0]>gmax[0] || bj[1]>gmax[1] || bj[2]>gmax[2]){
+            continue;
+        }
+        const int c0[3] = {CELL(bj[0],0), CELL(bj[1],1), CELL(bj[2],2)};
+        const int c1[3] = {CELL(bj[3],0), CELL(bj[4],1), CELL(bj[5],2)};
+        for (int cx=c0[0]; cx<=c1[0]; cx++){
+        for (int cy=c0[1]; cy<=c1[1]; cy++){
+        for (int cz=c0[2]; cz<=c1[2]; cz++){
+            const int c = (cx*ncell[1]+cy)*ncell[2]+cz;
+            for (int n=cell_start[c]; n<cell_start[c+1]; n++){
+                const int i = cell_items[n];
+                if (i>=j) break; // Items are sorted by index
+                const double* const bi = &box[6*i];
+                if (bi[3]<bj[0] || bi[4]<bj[1] || bi[5]<bj[2] || bi[0]>bj[3] || bi[1]>bj[4] || bi[2]>bj[5]){
+                    continue;
                 }
-                if (rim->encounter_map[j]==0){
-                    rim->encounter_map[j] = j;
-                    rim->encounterN++;
+                if (CELL(MAX(bi[0],bj[0]),0)!=cx || CELL(MAX(bi[1],bj[1]),1)!=cy || CELL(MAX(bi[2],bj[2]),2)!=cz){
+                    continue;
                 }
-                if (j<N_active){ // Two massive particles have a close encounter
-                    rim->tponly_encounter = 0;
+                double dcritmax2 = MAX(dcrit[i],dcrit[j]);
+                dcritmax2 *= 1.21*dcritmax2;
+                if (reb_mercurius_encounter_rmin2(particles, particles_backup, i, j, dt) < dcritmax2){
+                    reb_mercurius_encounter_list_append(&pairs_local, &pairs_local_N, &pairs_local_allocatedN, i, j);
                 }
             }
         }
+        }
+        }
+    }
+    if (pairs_local_N){
+#pragma omp critical
+        {
+            for (int n=0; n<pairs_local_N; n++){
+                reb_mercurius_encounter_list_append(&pairs, &pairs_N, &pairs_allocatedN, pairs_local[2*n], pairs_local[2*n+1]);
+            }
+        }
     }
+    free(pairs_local);
+    }
+    #undef CELL
+    free(cell_items);
+    free(cell_start);
+    free(box);
+
+    // Sort the pairs so that the result does not depend on the number of threads
+    // and is identical to testing all pairs in order.
+    qsort(pairs, pairs_N, sizeof(int)*2, reb_mercurius_encounter_pair_compare);
+    if (pairs_N){
+        // Collect the indices of all particles in the pairs without touching all N particles.
+        int* const indices = malloc(sizeof(int)*2*pairs_N);
+        memcpy(indices, pairs, sizeof(int)*2*pairs_N);
+        qsort(indices, 2*pairs_N, sizeof(int), reb_mercurius_encounter_index_compare);
+        for (int n=0; n<2*pairs_N; n++){
+            if (indices[n]!=rim->encounter_map[rim->encounterN-1]){
+                rim->encounter_map[rim->encounterN] = indices[n];
+                rim->encounterN++;
+            }
+        }
+        free(indices);
+    }
+    for (int n=0; n<pairs_N; n++){
+        const int i = pairs[2*n];
+        const int j = pairs[2*n+1];
+        if (j<N_active){ // Two massive particles have a close encounter
+            rim->tponly_encounter = 0;
+        }
+        if (i>0){ // Collisions with the star are checked for all particles in the encounter
+            reb_integrator_mercurius_encounter_pairs_add(r, i, j);
+        }
+    }
+    free(pairs);
 }
     
 void reb_integrator_mercurius_interaction_step(struct reb_simulation* const r, double dt){
@@ -294,49 +466,15 @@ void reb_integrator_mercurius_com_step(struct reb_simulation* const r, double dt
 
 void reb_integrator_mercurius_kepler_step(struct reb_simulation* const r, double dt){
     struct reb_particle* restrict const particles = r->particles;
+    double* const kepler_guess = r->ri_mercurius.kepler_guess;
     const int N = r->N;
     for (int i=1;i<N;i++){
-        reb_whfast_kepler_solver(r,particles,r->G*particles[0].m,i,dt); // in dh
+        reb_whfast_kepler_solver(r,particles,r->G*particles[0].m,i,dt,kepler_guess); // in dh
     }
 }
 
-static void reb_mercurius_encounter_step(struct reb_simulation* const r, const double _dt){
-    // Only particles having a close encounter are integrated by IAS15.
-    struct reb_simulation_integrator_mercurius* rim = &(r->ri_mercurius);
-    if (rim->encounterN<2){
-        return; // If there are no particles (other than the star) having a close encounter, then there is nothing to do.
-    }
-
-    int i_enc = 0;
-    rim->encounterNactive = 0;
-    for (unsigned int i=0; i<r->N; i++){
-        if(rim->encounter_map[i]){  
-            struct reb_particle tmp = r->particles[i];      // Copy for potential use for tponly_encounter
-            r->particles[i] = rim->particles_backup[i];     // Use coordinates before whfast step
-            rim->encounter_map[i_enc] = i;
-            i_enc++;
-            if (r->N_active==-1 || i<r->N_active){
-                rim->encounterNactive++;
-                if (rim->tponly_encounter){
-                    rim->particles_backup[i] = tmp;         // Make copy of particles after the kepler step.
-                                                            // used to restore the massive objects' states in the case
-                                                            // of only massless test-particle encounters
-                }
-            }
-        }
-    }
-
-    rim->mode = 1;
-    
-    // run
-    const double old_dt = r->dt;
-    const double old_t = r->t;
-    double t_needed = r->t + _dt; 
-        
-    reb_integrator_ias15_reset(r);
-    
-    r->dt = 0.0001*_dt; // start with a small timestep.
-    
+// Integrates the particles in the encounter map with IAS15 until t_needed.
+static void reb_mercurius_encounter_ias15(struct reb_simulation* const r, const double t_needed, const double old_dt){
     while(r->t < t_needed && fabs(r->dt/old_dt)>1e-14 ){
         struct reb_particle star = r->particles[0]; // backup velocity
         r->particles[0].vx = 0; // star does not move in dh 
@@ -382,6 +520,178 @@ static void reb_mercurius_encounter_step(struct reb_simulation* const r, const d
             }
         }
     }
+}
+
+// Integrates every test particle in the encounter map independently.
+// Each test particle is integrated with IAS15 together with all massive particles
+// in the encounter map (which include the star). This uses one small 
+// simulation per thread. The massive particles are not changed. Their initial 
+// state is taken from the array massive.
+static void reb_mercurius_encounter_step_split(struct reb_simulation* const r, const double _dt, const struct reb_particle* const massive){
+    struct reb_simulation_integrator_mercurius* const rim = &(r->ri_mercurius);
+    const int encounterNactive = rim->encounterNactive;
+    const int encounterNtp = rim->encounterN - encounterNactive;
+#pragma omp parallel
+    {
+    struct reb_simulation* const s = reb_create_simulation();
+    s->integrator = REB_INTEGRATOR_MERCURIUS;
+    s->gravity = REB_GRAVITY_MERCURIUS;
+    s->G = r->G;
+    s->softening = r->softening;
+    s->N_active = encounterNactive;
+    s->testparticle_type = 0;
+    s->ri_ias15.epsilon = r->ri_ias15.epsilon;
+    s->ri_ias15.min_dt = r->ri_ias15.min_dt;
+    s->ri_ias15.epsilon_global = r->ri_ias15.epsilon_global;
+    s->ri_ias15.dt_mode = r->ri_ias15.dt_mode;
+    struct reb_simulation_integrator_mercurius* const srim = &(s->ri_mercurius);
+    srim->L = rim->L;
+    srim->mode = 1;
+    srim->encounterN = encounterNactive+1;
+    srim->encounterNactive = encounterNactive;
+    srim->tponly_encounter = 1;
+    srim->allocatedN = encounterNactive+1;
+    srim->encounter_map = malloc(sizeof(int)*(encounterNactive+1));
+    srim->dcrit_allocatedN = encounterNactive+1;
+    srim->dcrit = malloc(sizeof(double)*(encounterNactive+1));
+    for (int i=0; i<=encounterNactive; i++){
+        srim->encounter_map[i] = i;
+    }
+    for (int i=0; i<encounterNactive; i++){
+        srim->dcrit[i] = rim->dcrit[rim->encounter_map[i]];
+    }
+    s->allocatedN = encounterNactive+1;
+    s->particles = malloc(sizeof(struct reb_particle)*(encounterNactive+1));
+    s->N = encounterNactive+1;
+#pragma omp for schedule(dynamic)
+    for (int k=0; k<encounterNtp; k++){
+        const int mi = rim->encounter_map[encounterNactive+k];
+        for (int i=0; i<encounterNactive; i++){
+            s->particles[i] = massive[rim->encounter_map[i]];
+        }
+        s->particles[encounterNactive] = r->particles[mi];
+        srim->dcrit[encounterNactive] = rim->dcrit[mi];
+        s->t = r->t;
+        s->dt = 0.0001*_dt; // start with a small timestep.
+        reb_integrator_ias15_reset(s);
+        reb_mercurius_encounter_ias15(s, r->t + _dt, r->dt);
+        r->particles[mi] = s->particles[encounterNactive];
+    }
+    reb_free_simulation(s);
+    }
+}
+
+#ifdef MPI
+// Encounter step for the MPI test particle decomposition. Every node has a copy of the 
+// massive particles but different test particles. To keep the massive particles identical
+// on all nodes, they are integrated without test particles. If two massive particles have 
+// a close encounter, all massive particles are integrated with IAS15. Test particles are 
+// integrated separately, each one together with all massive particles.
+static void reb_mercurius_encounter_step_testparticle_decomposition(struct reb_simulation* const r, const double _dt){
+    struct reb_simulation_integrator_mercurius* rim = &(r->ri_mercurius);
+    const int N_active = r->N_active;
+    // The encounter map is sorted. Move the test particles to the end and 
+    // replace the massive particles by all massive particles.
+    int kt = 0;
+    while (kt<rim->encounterN && rim->encounter_map[kt]<N_active){
+        kt++;
+    }
+    const int encounterNtp = rim->encounterN - kt;
+    memmove(rim->encounter_map+N_active, rim->encounter_map+kt, sizeof(int)*encounterNtp);
+    for (int i=0; i<N_active; i++){
+        rim->encounter_map[i] = i;
+    }
+    rim->encounterNactive = N_active;
+    rim->encounterN = N_active + encounterNtp;
+    for (int k=N_active; k<rim->encounterN; k++){
+        const int i = rim->encounter_map[k];
+        r->particles[i] = rim->particles_backup[i];     // Use coordinates before whfast step
+    }
+
+    rim->mode = 1;
+    const double old_dt = r->dt;
+    const double old_t = r->t;
+
+    if (encounterNtp){
+        reb_mercurius_encounter_step_split(r, _dt, rim->particles_backup);
+    }
+
+    if (!rim->tponly_encounter){
+        // Two massive particles have a close encounter. This is the same on all nodes.
+        for (int i=0; i<N_active; i++){
+            r->particles[i] = rim->particles_backup[i];
+        }
+        rim->encounterN = N_active;
+        // Only pairs of massive particles are checked for collisions.
+        unsigned int encounter_pairs_N = 0;
+        for (unsigned int n=0; n<rim->encounter_pairs_N; n++){
+            const int i = rim->encounter_pairs[2*n];
+            const int j = rim->encounter_pairs[2*n+1];
+            if (i>=N_active || j>=N_active) continue;
+            rim->encounter_pairs[2*encounter_pairs_N] = i;
+            rim->encounter_pairs[2*encounter_pairs_N+1] = j;
+            encounter_pairs_N++;
+        }
+        rim->encounter_pairs_N = encounter_pairs_N;
+
+        reb_integrator_ias15_reset(r);
+        r->dt = 0.0001*_dt; // start with a small timestep.
+        reb_mercurius_encounter_ias15(r, old_t + _dt, old_dt);
+    }
+
+    // Reset constant for global particles
+    r->t = old_t;
+    r->dt = old_dt;
+    rim->mode = 0;
+}
+#endif // MPI
+
+static void reb_mercurius_encounter_step(struct reb_simulation* const r, const double _dt){
+    // Only particles having a close encounter are integrated by IAS15.
+    struct reb_simulation_integrator_mercurius* rim = &(r->ri_mercurius);
+    if (rim->encounterN<2){
+        return; // If there are no particles (other than the star) having a close encounter, then there is nothing to do.
+    }
+#ifdef MPI
+    if (r->mpi_decomposition==REB_MPI_DECOMPOSITION_TESTPARTICLES){
+        reb_mercurius_encounter_step_testparticle_decomposition(r, _dt);
+        return;
+    }
+#endif // MPI
+
+    // Only the particles in the encounter map are touched.
+    rim->encounterNactive = 0;
+    for (unsigned int k=0; k<rim->encounterN; k++){
+        const int i = rim->encounter_map[k];
+        struct reb_particle tmp = r->particles[i];      // Copy for potential use for tponly_encounter
+        r->particles[i] = rim->particles_backup[i];     // Use coordinates before whfast step
+        if (r->N_active==-1 || i<r->N_active){
+            rim->encounterNactive++;
+            if (rim->tponly_encounter){
+                rim->particles_backup[i] = tmp;         // Make copy of particles after the kepler step.
+                                                        // used to restore the massive objects' states in the case
+                                                        // of only massless test-particle encounters
+            }
+        }
+    }
+
+    rim->mode = 1;
+    
+    // run
+    const double old_dt = r->dt;
+    const double old_t = r->t;
+    double t_needed = r->t + _dt; 
+        
+    if (rim->split_tponly_encounters && rim->tponly_encounter && r->collision==REB_COLLISION_NONE && r->post_timestep_modifications==NULL){
+        // Test particles only interact with massive particles. Their encounters are independent.
+        reb_mercurius_encounter_step_split(r, _dt, r->particles);
+    }else{
+        reb_integrator_ias15_reset(r);
+        
+        r->dt = 0.0001*_dt; // start with a small timestep.
+        
+        reb_mercurius_encounter_ias15(r, t_needed, old_dt);
+    }
 
     // if only test particles encountered massive bodies, reset the
     // massive body coordinates to their post Kepler step state
@@ -399,33 +709,62 @@ static void reb_mercurius_encounter_step(struct reb_simulation* const r, const d
 
 }
 
-double reb_integrator_mercurius_calculate_dcrit_for_particle(struct reb_simulation* r, unsigned int i){
-    struct reb_simulation_integrator_mercurius* const rim = &(r->ri_mercurius);
-    const double m0 = r->particles[0].m;
-    const double dx  = r->particles[i].x;  // in dh
-    const double dy  = r->particles[i].y;
-    const double dz  = r->particles[i].z;
-    const double dvx = r->particles[i].vx - r->particles[0].vx; 
-    const double dvy = r->particles[i].vy - r->particles[0].vy; 
-    const double dvz = r->particles[i].vz - r->particles[0].vz; 
+static inline double reb_mercurius_dcrit(const struct reb_particle p, const struct reb_particle star, const double G, const double dt, const double hillfac){
+    const double m0 = star.m;
+    const double dx  = p.x;  // in dh
+    const double dy  = p.y;
+    const double dz  = p.z;
+    const double dvx = p.vx - star.vx; 
+    const double dvy = p.vy - star.vy; 
+    const double dvz = p.vz - star.vz; 
     const double _r = sqrt(dx*dx + dy*dy + dz*dz);
     const double v2 = dvx*dvx + dvy*dvy + dvz*dvz;
 
-    const double GM = r->G*(m0+r->particles[i].m);
+    const double GM = G*(m0+p.m);
     const double a = GM*_r / (2.*GM - _r*v2);
     const double vc = sqrt(GM/fabs(a));
     double dcrit = 0;
     // Criteria 1: average velocity
-    dcrit = MAX(dcrit, vc*0.4*r->dt);
+    dcrit = MAX(dcrit, vc*0.4*dt);
     // Criteria 2: current velocity
-    dcrit = MAX(dcrit, sqrt(v2)*0.4*r->dt);
+    dcrit = MAX(dcrit, sqrt(v2)*0.4*dt);
     // Criteria 3: Hill radius
-    dcrit = MAX(dcrit, rim->hillfac*a*cbrt(r->particles[i].m/(3.*r->particles[0].m)));
+    dcrit = MAX(dcrit, hillfac*a*cbrt(p.m/(3.*m0)));
     // Criteria 4: physical radius
-    dcrit = MAX(dcrit, 2.*r->particles[i].r);
+    dcrit = MAX(dcrit, 2.*p.r);
     return dcrit;
 }
 
+double reb_integrator_mercurius_calculate_dcrit_for_particle(struct reb_simulation* r, unsigned int i){
+    return reb_mercurius_dcrit(r->particles[i], r->particles[0], r->G, r->dt, r->ri_mercurius.hillfac);
+}
+
+// Calculates dcrit for all particles (all=1) or only for those with a negative dcrit (all=0).
+static void reb_mercurius_calculate_dcrit(struct reb_simulation* const r, const int all){
+    const struct reb_particle* const particles = r->particles;
+    double* const dcrit = r->ri_mercurius.dcrit;
+    const struct reb_particle star = particles[0];
+    const double G = r->G;
+    const double dt = r->dt;
+    const double hillfac = r->ri_mercurius.hillfac;
+    const int N = r->N;
+    if (all || dcrit[0]<0.){
+        dcrit[0] = 2.*star.r; // central object only uses physical radius
+    }
+    if (all){
+#pragma omp parallel for schedule(static) if(N>1000)
+        for (int i=1;i<N;i++){
+            dcrit[i] = reb_mercurius_dcrit(particles[i], star, G, dt, hillfac);
+        }
+    }else{
+        for (int i=1;i<N;i++){
+            if (dcrit[i]<0.){
+                dcrit[i] = reb_mercurius_dcrit(particles[i], star, G, dt, hillfac);
+            }
+        }
+    }
+}
+
 
 void reb_integrator_mercurius_part1(struct reb_simulation* r){
     if (r->var_config_N){
@@ -438,13 +777,29 @@ void reb_integrator_mercurius_part1(struct reb_simulation* r){
     if (rim->dcrit_allocatedN<N){
         // Need to safe these arrays in SimulationArchive
         rim->dcrit              = realloc(rim->dcrit, sizeof(double)*N);
+        // If particle number increased (or this is the first step), need to calculate critical radii of new particles
+        for (int i=rim->dcrit_allocatedN;i<N;i++){
+            rim->dcrit[i] = -1.;
+        }
         rim->dcrit_allocatedN = N;
-        // If particle number increased (or this is the first step), need to calculate critical radii
-        rim->recalculate_dcrit_this_timestep        = 1;
+        rim->dcrit_pending = 1;
         // Heliocentric coordinates were never calculated.
         // This will get triggered on first step only (not when loaded from archive)
         rim->recalculate_coordinates_this_timestep = 1;
     }
+    if (rim->kepler_warmstart && rim->kepler_guess_allocatedN<N){
+        // Also saved in SimulationArchive. New particles start without a correction.
+        rim->kepler_guess       = realloc(rim->kepler_guess, sizeof(double)*N);
+        for (int i=rim->kepler_guess_allocatedN;i<N;i++){
+            rim->kepler_guess[i] = 0.;
+        }
+        rim->kepler_guess_allocatedN = N;
+    }
+    if (!rim->kepler_warmstart && rim->kepler_guess){
+        free(rim->kepler_guess);
+        rim->kepler_guess = NULL;
+        rim->kepler_guess_allocatedN = 0;
+    }
     if (rim->allocatedN<N){
         // These arrays are only used within one timestep. 
         // Can be recreated without loosing bit-wise reproducibility
@@ -461,7 +816,15 @@ void reb_integrator_mercurius_part1(struct reb_simulation* r){
         rim->recalculate_coordinates_this_timestep = 0;
     }
 
-    if (rim->recalculate_dcrit_this_timestep){
+    int dcrit_needed = rim->recalculate_dcrit_this_timestep;
+    if (rim->dcrit_pending){
+        rim->dcrit_pending = 0;
+        for (int i=0;i<N && !dcrit_needed;i++){
+            dcrit_needed = rim->dcrit[i]<0.;
+        }
+    }
+    if (dcrit_needed){
+        const int all = rim->recalculate_dcrit_this_timestep;
         rim->recalculate_dcrit_this_timestep = 0;
         if (rim->is_synchronized==0){
             reb_integrator_mercurius_synchronize(r);
@@ -469,10 +832,7 @@ void reb_integrator_mercurius_part1(struct reb_simulation* r){
             rim->recalculate_coordinates_this_timestep = 0;
             reb_warning(r,"MERCURIUS: Recalculating dcrit but pos/vel were not synchronized before.");
         }
-        rim->dcrit[0] = 2.*r->particles[0].r; // central object only uses physical radius
-        for (int i=1;i<N;i++){
-            rim->dcrit[i] = reb_integrator_mercurius_calculate_dcrit_for_particle(r, i);
-        }
+        reb_mercurius_calculate_dcrit(r, all);
     }
     
     // Calculate collisions only with DIRECT method
@@ -554,6 +914,7 @@ void reb_integrator_mercurius_reset(struct reb_simulation* r){
     r->ri_mercurius.encounterNactive = 0;
     r->ri_mercurius.hillfac = 3;
     r->ri_mercurius.tponly_encounter = 0;
+    r->ri_mercurius.kepler_warmstart = 0;
     r->ri_mercurius.recalculate_coordinates_this_timestep = 0;
     // Internal arrays (only used within one timestep)
     free(r->ri_mercurius.particles_backup);
@@ -562,11 +923,19 @@ void reb_integrator_mercurius_reset(struct reb_simulation* r){
     r->ri_mercurius.particles_backup_additionalforces = NULL;
     free(r->ri_mercurius.encounter_map);
     r->ri_mercurius.encounter_map = NULL;
+    free(r->ri_mercurius.encounter_pairs);
+    r->ri_mercurius.encounter_pairs = NULL;
+    r->ri_mercurius.encounter_pairs_N = 0;
+    r->ri_mercurius.encounter_pairs_allocatedN = 0;
     r->ri_mercurius.allocatedN = 0;
     r->ri_mercurius.allocatedN_additionalforces = 0;
     // dcrit array
     free(r->ri_mercurius.dcrit);
     r->ri_mercurius.dcrit = NULL;
     r->ri_mercurius.dcrit_allocatedN = 0;
+    r->ri_mercurius.dcrit_pending = 0;
+    free(r->ri_mercurius.kepler_guess);
+    r->ri_mercurius.kepler_guess = NULL;
+    r->ri_mercurius.kepler_guess_allocatedN = 0;
 }
 
@@ -24,6 +24,8 @@
  */
 #ifndef _INTEGRATOR_MERCURIUS_H
 #define _INTEGRATOR_MERCURIUS_H
+#include <math.h>
+#include "rebound.h"
 void reb_integrator_mercurius_part1(struct reb_simulation* r);          ///< Internal function used to call a specific integrator
 void reb_integrator_mercurius_part2(struct reb_simulation* r);          ///< Internal function used to call a specific integrator
 void reb_integrator_mercurius_synchronize(struct reb_simulation* r);    ///< Internal function used to call a specific integrator
@@ -31,4 +33,56 @@ void reb_integrator_mercurius_reset(struct reb_simulation* r);          ///< Int
 void reb_integrator_mercurius_inertial_to_dh(struct reb_simulation* r); ///< Internal in-place coordinate transformation
 void reb_integrator_mercurius_dh_to_inertial(struct reb_simulation* r); ///< Internal in-place coordinate transformation
 double reb_integrator_mercurius_calculate_dcrit_for_particle(struct reb_simulation* r, unsigned int i); ///< Internal function for calculating dcrit in reb_add_local
+void reb_integrator_mercurius_encounter_pairs_add(struct reb_simulation* r, int i, int j); ///< Internal function to store a pair of particles having a close encounter (used by the collision search)
+
+// Built-in switching functions. The gravity kernels use these to inline the switching function.
+enum REB_MERCURIUS_L {
+    REB_MERCURIUS_L_CUSTOM = 0,     // User-provided function, called through the pointer
+    REB_MERCURIUS_L_MERCURY = 1,
+    REB_MERCURIUS_L_C4 = 2,
+    REB_MERCURIUS_L_C5 = 3,
+    REB_MERCURIUS_L_INFINITY = 4,
+};
+enum REB_MERCURIUS_L reb_integrator_mercurius_L_type(const struct reb_simulation* const r); ///< Internal function returning the type of the current switching function
+
+static inline double reb_integrator_mercurius_L_f(double x){
+    if (x<0) return 0;
+    return exp(-1./x);
+}
+
+/**
+ * @brief Evaluates the switching function of type L_type.
+ * @details L_type is loop invariant in the gravity kernels, so the compiler can 
+ * inline the polynomial and move the switch out of the pair loop. All built-in 
+ * functions are exactly 1 for d>dcrit, which is checked first as most pairs are 
+ * far outside the changeover region.
+ */
+static inline double reb_integrator_mercurius_L_eval(const struct reb_simulation* const r, const enum REB_MERCURIUS_L L_type, const double d, const double dcrit){
+    if (L_type==REB_MERCURIUS_L_CUSTOM){
+        return r->ri_mercurius.L(r, d, dcrit);
+    }
+    if (d>dcrit){
+        return 1.;
+    }
+    const double y = (d-0.1*dcrit)/(0.9*dcrit);
+    if (y<0.){
+        return 0.;
+    }else if (y>1.){
+        return 1.;
+    }
+    switch (L_type){
+        case REB_MERCURIUS_L_C4:
+            // This is the changeover function C4 proposed by Hernandez (2019)
+            return (70.*y*y*y*y -315.*y*y*y +540.*y*y -420.*y +126.)*y*y*y*y*y;
+        case REB_MERCURIUS_L_C5:
+            // This is the changeover function C5 proposed by Hernandez (2019)
+            return (-252.*y*y*y*y*y +1386.*y*y*y*y -3080.*y*y*y +3465.*y*y -1980.*y +462.)*y*y*y*y*y*y;
+        case REB_MERCURIUS_L_INFINITY:
+            // Infinitely differentiable function.
+            return reb_integrator_mercurius_L_f(y) /(reb_integrator_mercurius_L_f(y) + reb_integrator_mercurius_L_f(1.-y));
+        default:
+            // This is the changeover function used by the Mercury integrator.
+            return 10.*(y*y*y) - 15.*(y*y*y*y) + 6.*(y*y*y*y*y);
+    }
+}
 #endif
@@ -43,42 +43,7 @@
 #define MAX(a, b) ((a) < (b) ? (b) : (a))   ///< Returns the maximum of a and b
 #define MIN(a, b) ((a) > (b) ? (b) : (a))   ///< Returns the minimum of a and b
 
-// Returns the number of stages for a given type of integrator (not including corrector)
-static int reb_saba_stages(const int type){
-    switch(type){
-        case REB_SABA_1:
-        case REB_SABA_CM_1:
-        case REB_SABA_CL_1:
-            return 1;
-        case REB_SABA_2:
-        case REB_SABA_CM_2:
-        case REB_SABA_CL_2:
-            return 2;
-        case REB_SABA_3:
-        case REB_SABA_CM_3:
-        case REB_SABA_CL_3:
-            return 3;
-        case REB_SABA_4:
-        case REB_SABA_CM_4:
-        case REB_SABA_CL_4:
-            return 4;
-        case REB_SABA_H_8_4_4:
-            return 6;
-        case REB_SABA_10_4:
-        case REB_SABA_8_6_4:
-            return 7;
-        case REB_SABA_10_6_4:
-        case REB_SABA_H_8_6_4:
-            return 8;
-        case REB_SABA_H_10_6_4:
-            return 9;
-        default:
-            return 0;
-    }
-}
-
-
-// Some coefficients appear multiple times to simplify the loop structures. 
+// Coefficients of the drift (c) and kick (d) steps of each method.
 const static double reb_saba_c[10][5] = {
         {0.5, }, // SABA1
         {0.2113248654051871177454256097490212721762, 0.5773502691896257645091487805019574556476, }, // SABA2
@@ -128,6 +93,19 @@ const static double reb_saba_cc[4] = {
 }; 
     
 
+static inline void reb_saba_drift(struct reb_simulation* const r, const double a){
+    reb_whfast_kepler_step(r, a);
+    reb_whfast_com_step(r, a);
+}
+
+static inline void reb_saba_kick(struct reb_simulation* const r, const double b){
+    struct reb_particle* restrict const particles = r->particles;
+    const int N = r->N;
+    reb_transformations_jacobi_to_inertial_pos(particles, r->ri_whfast.p_jh, particles, N, N);
+    reb_update_acceleration(r);
+    reb_whfast_interaction_step(r, b);
+}
+
 static void reb_saba_corrector_step(struct reb_simulation* r, double cc){
     struct reb_simulation_integrator_whfast* const ri_whfast = &(r->ri_whfast);
     struct reb_particle* const p_j = ri_whfast->p_jh;
@@ -266,9 +244,11 @@ void reb_integrator_saba_synchronize(struct reb_simulation* const r){
     struct reb_simulation_integrator_saba* const ri_saba = &(r->ri_saba);
     int type = ri_saba->type;
         struct reb_particle* sync_pj  = NULL;
+        double* sync_guess = NULL;
         if (ri_saba->keep_unsynchronized){
             sync_pj = malloc(sizeof(struct reb_particle)*r->N);
             memcpy(sync_pj,r->ri_whfast.p_jh,r->N*sizeof(struct reb_particle));
+            sync_guess = reb_tools_copy_aligned(r->ri_whfast.kepler_guess, sizeof(double), r->N);
         }
     if (ri_saba->is_synchronized == 0){
         const int N = r->N;
@@ -283,6 +263,10 @@ void reb_integrator_saba_synchronize(struct reb_simulation* const r){
         if (ri_saba->keep_unsynchronized){
             memcpy(r->ri_whfast.p_jh,sync_pj,r->N*sizeof(struct reb_particle));
             free(sync_pj);
+            if (sync_guess){
+                memcpy(r->ri_whfast.kepler_guess,sync_guess,r->N*sizeof(double));
+                free(sync_guess);
+            }
         }else{
             ri_saba->is_synchronized = 1;
         }
@@ -292,37 +276,141 @@ void reb_integrator_saba_synchronize(struct reb_simulation* const r){
 void reb_integrator_saba_part2(struct reb_simulation* const r){
     struct reb_simulation_integrator_whfast* const ri_whfast = &(r->ri_whfast);
     struct reb_simulation_integrator_saba* const ri_saba = &(r->ri_saba);
-    struct reb_particle* restrict const particles = r->particles;
     const int type = ri_saba->type;
-    const int stages = reb_saba_stages(type);
-    const int N = r->N;
+    const double dt = r->dt;
     if (ri_whfast->p_jh==NULL){
         // Non recoverable error occured earlier. 
         // Skipping rest of integration to avoid segmentation fault.
         return;
     }
     
-    reb_whfast_interaction_step(r, reb_saba_d[type%0x100][0]*r->dt);
-  
-    for(int j=1;j<stages;j++){
-        {
-            int i = j;
-            if (j>stages/2){
-                i = stages-j;
-            }
-            reb_whfast_kepler_step(r, reb_saba_c[type%0x100][i]*r->dt);   
-            reb_whfast_com_step(r, reb_saba_c[type%0x100][i]*r->dt);
-        }
-        {
-            int i = j;
-            if (j>(stages-1)/2){
-                i = stages-j-1;
-            }
-            reb_transformations_jacobi_to_inertial_pos(particles, ri_whfast->p_jh, particles, N, N);
-            reb_update_acceleration(r);
-            reb_whfast_interaction_step(r, reb_saba_d[type%0x100][i]*r->dt);
-        }
-    } 
+    // The operator sequence of every method is written out explicitly so that 
+    // all coefficients are compile time constants. The first kick uses the 
+    // accelerations calculated between part1 and part2. 
+    switch(type%0x100){
+        case 0x0: // SABA1
+            reb_whfast_interaction_step(r, reb_saba_d[0x0][0]*dt);
+            break;
+        case 0x1: // SABA2
+            reb_whfast_interaction_step(r, reb_saba_d[0x1][0]*dt);
+            reb_saba_drift(r, reb_saba_c[0x1][1]*dt);
+            reb_saba_kick(r, reb_saba_d[0x1][0]*dt);
+            break;
+        case 0x2: // SABA3
+            reb_whfast_interaction_step(r, reb_saba_d[0x2][0]*dt);
+            reb_saba_drift(r, reb_saba_c[0x2][1]*dt);
+            reb_saba_kick(r, reb_saba_d[0x2][1]*dt);
+            reb_saba_drift(r, reb_saba_c[0x2][1]*dt);
+            reb_saba_kick(r, reb_saba_d[0x2][0]*dt);
+            break;
+        case 0x3: // SABA4
+            reb_whfast_interaction_step(r, reb_saba_d[0x3][0]*dt);
+            reb_saba_drift(r, reb_saba_c[0x3][1]*dt);
+            reb_saba_kick(r, reb_saba_d[0x3][1]*dt);
+            reb_saba_drift(r, reb_saba_c[0x3][2]*dt);
+            reb_saba_kick(r, reb_saba_d[0x3][1]*dt);
+            reb_saba_drift(r, reb_saba_c[0x3][1]*dt);
+            reb_saba_kick(r, reb_saba_d[0x3][0]*dt);
+            break;
+        case 0x4: // ABA(10,4)
+            reb_whfast_interaction_step(r, reb_saba_d[0x4][0]*dt);
+            reb_saba_drift(r, reb_saba_c[0x4][1]*dt);
+            reb_saba_kick(r, reb_saba_d[0x4][1]*dt);
+            reb_saba_drift(r, reb_saba_c[0x4][2]*dt);
+            reb_saba_kick(r, reb_saba_d[0x4][2]*dt);
+            reb_saba_drift(r, reb_saba_c[0x4][3]*dt);
+            reb_saba_kick(r, reb_saba_d[0x4][3]*dt);
+            reb_saba_drift(r, reb_saba_c[0x4][3]*dt);
+            reb_saba_kick(r, reb_saba_d[0x4][2]*dt);
+            reb_saba_drift(r, reb_saba_c[0x4][2]*dt);
+            reb_saba_kick(r, reb_saba_d[0x4][1]*dt);
+            reb_saba_drift(r, reb_saba_c[0x4][1]*dt);
+            reb_saba_kick(r, reb_saba_d[0x4][0]*dt);
+            break;
+        case 0x5: // ABA(8,6,4)
+            reb_whfast_interaction_step(r, reb_saba_d[0x5][0]*dt);
+            reb_saba_drift(r, reb_saba_c[0x5][1]*dt);
+            reb_saba_kick(r, reb_saba_d[0x5][1]*dt);
+            reb_saba_drift(r, reb_saba_c[0x5][2]*dt);
+            reb_saba_kick(r, reb_saba_d[0x5][2]*dt);
+            reb_saba_drift(r, reb_saba_c[0x5][3]*dt);
+            reb_saba_kick(r, reb_saba_d[0x5][3]*dt);
+            reb_saba_drift(r, reb_saba_c[0x5][3]*dt);
+            reb_saba_kick(r, reb_saba_d[0x5][2]*dt);
+            reb_saba_drift(r, reb_saba_c[0x5][2]*dt);
+            reb_saba_kick(r, reb_saba_d[0x5][1]*dt);
+            reb_saba_drift(r, reb_saba_c[0x5][1]*dt);
+            reb_saba_kick(r, reb_saba_d[0x5][0]*dt);
+            break;
+        case 0x6: // ABA(10,6,4)
+            reb_whfast_interaction_step(r, reb_saba_d[0x6][0]*dt);
+            reb_saba_drift(r, reb_saba_c[0x6][1]*dt);
+            reb_saba_kick(r, reb_saba_d[0x6][1]*dt);
+            reb_saba_drift(r, reb_saba_c[0x6][2]*dt);
+            reb_saba_kick(r, reb_saba_d[0x6][2]*dt);
+            reb_saba_drift(r, reb_saba_c[0x6][3]*dt);
+            reb_saba_kick(r, reb_saba_d[0x6][3]*dt);
+            reb_saba_drift(r, reb_saba_c[0x6][4]*dt);
+            reb_saba_kick(r, reb_saba_d[0x6][3]*dt);
+            reb_saba_drift(r, reb_saba_c[0x6][3]*dt);
+            reb_saba_kick(r, reb_saba_d[0x6][2]*dt);
+            reb_saba_drift(r, reb_saba_c[0x6][2]*dt);
+            reb_saba_kick(r, reb_saba_d[0x6][1]*dt);
+            reb_saba_drift(r, reb_saba_c[0x6][1]*dt);
+            reb_saba_kick(r, reb_saba_d[0x6][0]*dt);
+            break;
+        case 0x7: // ABAH(8,4,4)
+            reb_whfast_interaction_step(r, reb_saba_d[0x7][0]*dt);
+            reb_saba_drift(r, reb_saba_c[0x7][1]*dt);
+            reb_saba_kick(r, reb_saba_d[0x7][1]*dt);
+            reb_saba_drift(r, reb_saba_c[0x7][2]*dt);
+            reb_saba_kick(r, reb_saba_d[0x7][2]*dt);
+            reb_saba_drift(r, reb_saba_c[0x7][3]*dt);
+            reb_saba_kick(r, reb_saba_d[0x7][2]*dt);
+            reb_saba_drift(r, reb_saba_c[0x7][2]*dt);
+            reb_saba_kick(r, reb_saba_d[0x7][1]*dt);
+            reb_saba_drift(r, reb_saba_c[0x7][1]*dt);
+            reb_saba_kick(r, reb_saba_d[0x7][0]*dt);
+            break;
+        case 0x8: // ABAH(8,6,4)
+            reb_whfast_interaction_step(r, reb_saba_d[0x8][0]*dt);
+            reb_saba_drift(r, reb_saba_c[0x8][1]*dt);
+            reb_saba_kick(r, reb_saba_d[0x8][1]*dt);
+            reb_saba_drift(r, reb_saba_c[0x8][2]*dt);
+            reb_saba_kick(r, reb_saba_d[0x8][2]*dt);
+            reb_saba_drift(r, reb_saba_c[0x8][3]*dt);
+            reb_saba_kick(r, reb_saba_d[0x8][3]*dt);
+            reb_saba_drift(r, reb_saba_c[0x8][4]*dt);
+            reb_saba_kick(r, reb_saba_d[0x8][3]*dt);
+            reb_saba_drift(r, reb_saba_c[0x8][3]*dt);
+            reb_saba_kick(r, reb_saba_d[0x8][2]*dt);
+            reb_saba_drift(r, reb_saba_c[0x8][2]*dt);
+            reb_saba_kick(r, reb_saba_d[0x8][1]*dt);
+            reb_saba_drift(r, reb_saba_c[0x8][1]*dt);
+            reb_saba_kick(r, reb_saba_d[0x8][0]*dt);
+            break;
+        case 0x9: // ABAH(10,6,4)
+            reb_whfast_interaction_step(r, reb_saba_d[0x9][0]*dt);
+            reb_saba_drift(r, reb_saba_c[0x9][1]*dt);
+            reb_saba_kick(r, reb_saba_d[0x9][1]*dt);
+            reb_saba_drift(r, reb_saba_c[0x9][2]*dt);
+            reb_saba_kick(r, reb_saba_d[0x9][2]*dt);
+            reb_saba_drift(r, reb_saba_c[0x9][3]*dt);
+            reb_saba_kick(r, reb_saba_d[0x9][3]*dt);
+            reb_saba_drift(r, reb_saba_c[0x9][4]*dt);
+            reb_saba_kick(r, reb_saba_d[0x9][4]*dt);
+            reb_saba_drift(r, reb_saba_c[0x9][4]*dt);
+            reb_saba_kick(r, reb_saba_d[0x9][3]*dt);
+            reb_saba_drift(r, reb_saba_c[0x9][3]*dt);
+            reb_saba_kick(r, reb_saba_d[0x9][2]*dt);
+            reb_saba_drift(r, reb_saba_c[0x9][2]*dt);
+            reb_saba_kick(r, reb_saba_d[0x9][1]*dt);
+            reb_saba_drift(r, reb_saba_c[0x9][1]*dt);
+            reb_saba_kick(r, reb_saba_d[0x9][0]*dt);
+            break;
+        default:
+            break;
+    }
 
     if (ri_saba->type>=0x100){ // correctors on
         // Always need to do drift step if correctors are turned on
@@ -60,7 +60,9 @@ void reb_integrator_sei_init(struct reb_simulation* const r){
     r->ri_sei.lastdt = r->dt;
 }
 
-void reb_integrator_sei_part1(struct reb_simulation* const r){
+// If wrap is set, shear or periodic boundary conditions are 
+// applied in the same loop as the H012 operator.
+static inline void reb_integrator_sei_drift(struct reb_simulation* const r, const int wrap){
     r->gravity_ignore_terms = 0;
 	const int N = r->N;
 	struct reb_particle* const particles = r->particles;
@@ -71,26 +73,52 @@ void reb_integrator_sei_part1(struct reb_simulation* const r){
         reb_integrator_sei_init(r);
 	}
 	const struct reb_simulation_integrator_sei ri_sei = r->ri_sei;
+	const double dt = r->dt;
+	r->t+=dt/2.;
+	const struct reb_boundary_wrap w = wrap?reb_boundary_wrap_init(r, r->t):(struct reb_boundary_wrap){0};
 #pragma omp parallel for schedule(guided)
 	for (int i=0;i<N;i++){
-		operator_H012(r->dt, ri_sei, &(particles[i]));
+		operator_H012(dt, ri_sei, &(particles[i]));
+		if (wrap){
+			reb_boundary_wrap_particle(&w, &particles[i]);
+		}
 	}
-	r->t+=r->dt/2.;
 }
 
-void reb_integrator_sei_part2(struct reb_simulation* r){
+static inline void reb_integrator_sei_kick_drift(struct reb_simulation* const r, const int wrap){
 	const int N = r->N;
 	struct reb_particle* const particles = r->particles;
 	const struct reb_simulation_integrator_sei ri_sei = r->ri_sei;
+	const double dt = r->dt;
+	r->t+=dt/2.;
+	const struct reb_boundary_wrap w = wrap?reb_boundary_wrap_init(r, r->t):(struct reb_boundary_wrap){0};
 #pragma omp parallel for schedule(guided)
 	for (int i=0;i<N;i++){
-		operator_phi1(r->dt, &(particles[i]));
-		operator_H012(r->dt, ri_sei, &(particles[i]));
+		operator_phi1(dt, &(particles[i]));
+		operator_H012(dt, ri_sei, &(particles[i]));
+		if (wrap){
+			reb_boundary_wrap_particle(&w, &particles[i]);
+		}
 	}
-	r->t+=r->dt/2.;
 	r->dt_last_done = r->dt;
 }
 
+void reb_integrator_sei_part1(struct reb_simulation* const r){
+	reb_integrator_sei_drift(r, 0);
+}
+
+void reb_integrator_sei_part2(struct reb_simulation* r){
+	reb_integrator_sei_kick_drift(r, 0);
+}
+
+void reb_integrator_sei_part1_boundary(struct reb_simulation* r){
+	reb_integrator_sei_drift(r, 1);
+}
+
+void reb_integrator_sei_part2_boundary(struct reb_simulation* r){
+	reb_integrator_sei_kick_drift(r, 1);
+}
+
 void reb_integrator_sei_synchronize(struct reb_simulation* r){
 	// Do nothing.
 }
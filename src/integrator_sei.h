@@ -26,6 +26,8 @@
 #define _INTEGRATOR_SEI_H
 void reb_integrator_sei_part1(struct reb_simulation* r);       ///< Internal function used to call a specific integrator
 void reb_integrator_sei_part2(struct reb_simulation* r);       ///< Internal function used to call a specific integrator
+void reb_integrator_sei_part1_boundary(struct reb_simulation* r); ///< Same as part1 but also applies shear or periodic boundary conditions
+void reb_integrator_sei_part2_boundary(struct reb_simulation* r); ///< Same as part2 but also applies shear or periodic boundary conditions
 void reb_integrator_sei_synchronize(struct reb_simulation* r); ///< Internal function used to call a specific integrator
 void reb_integrator_sei_reset(struct reb_simulation* r);       ///< Internal function used to call a specific integrator
 void reb_integrator_sei_init(struct reb_simulation* const r);  ///< Used to initialize constants. 
@@ -39,6 +39,8 @@
 #define PI 3.141592653589793238462643383279
 #define PI_SQ_X4 (4.0*PI*PI)
 #define MAX_NEWTON_ITERATIONS 50
+#define TES_POOL_ALIGNMENT 64     // Every array in the memory pool starts on a new cache line.
+#define TES_PARALLEL_N 100        // Particle loops run in parallel (if OpenMP is enabled) for N larger than this.
 #define STUMPF_ITERATIONS 13 
 
 // Coefficients
@@ -99,6 +101,8 @@ static controlVars_const control_vars_cast(controlVars in)
 // Top level functions
 static void reb_tes_init(struct reb_simulation* r, uint32_t z_n);
 static void reb_tes_free(struct reb_simulation* r);
+static size_t reb_tes_pool_size(uint32_t z_n, uint32_t z_stagesPerStep);
+static void* reb_tes_pool_take(struct reb_simulation* r, size_t size);
 
 // Gravity functions
 static void reb_dhem_perform_summation(struct reb_simulation* r, double * Q, double * P,
@@ -116,18 +120,14 @@ static uint32_t reb_dhem_rectify(struct reb_simulation* r, double t, double * Q,
                             double * dQ, double * dP, uint32_t * rectifiedArray, uint32_t stageNumber);
 static double reb_find_min_particle_period(struct reb_simulation* r);
 static void reb_dhem_init(struct reb_simulation* r, double z_rectificationPeriodDefault, uint32_t z_stagesPerStep);
-static void reb_dhem_free(struct reb_simulation* r);
 
 // Radau functions
 static void reb_radau_init(struct reb_simulation* r);
-static void reb_radau_free(struct reb_simulation* r);
 static double reb_calc_stepsize(struct reb_simulation* r, double h, double hLast, double t);
 static void reb_clear_rectified_b_fields(struct reb_simulation* r, controlVars * B, uint32_t * rectifiedArray);
 static double reb_single_step(struct reb_simulation* r, double z_t, double dt, double dt_last_done);
 static void reb_init_radau_step(struct reb_simulation* r);
-static void reb_free_radau_step(struct reb_simulation* r);
-static void reb_free_controlvars(controlVars * var);
-static void reb_init_controlvars(controlVars * var, uint32_t size);
+static void reb_init_controlvars(struct reb_simulation* r, controlVars * var, uint32_t size);
 static void reb_clear_controlvars(controlVars * var);
 static void reb_calc_predictors(double h, double hSample, double const * __restrict__ z_state0, double const * __restrict__ z_dState, 
                          double const * __restrict__ z_ddState, controlVars const * z_B, double * __restrict__ z_predictors, 
@@ -145,7 +145,6 @@ static double reb_calc_step_error(struct reb_simulation* r, double h, double t);
 
 // Universal variables functions
 static void reb_init_uvars(struct reb_simulation* const r);
-static void reb_free_uvars(struct reb_simulation* r);
 static void reb_rebasis_osc_orbits(struct reb_simulation* r, double * z_Q, double * z_P, double z_t, uint32_t i);
 static void reb_calc_osc_orbits(struct reb_simulation* r, double **Xosc_map, 
                                             const double t0, const double h, double const * const h_array, 
@@ -214,7 +213,7 @@ void reb_integrator_tes_part2(struct reb_simulation* r){
         r->ri_tes.mass[0] = particles[0].m; // Keep mass[0] as stellar mass.
 
         reb_init_uvars(r);
-        reb_dhem_init(r, r->ri_tes.orbital_period/r->ri_tes.recti_per_orbit, 9);
+        reb_dhem_init(r, r->ri_tes.orbital_period/r->ri_tes.recti_per_orbit, OSCULATING_ORBIT_SLOTS);
         reb_dhem_init_osc_orbits(r, r->ri_tes.Q_dh, r->ri_tes.P_dh, r->t);
         reb_radau_init(r);  
 
@@ -288,21 +287,16 @@ void reb_integrator_tes_synchronize(struct reb_simulation* r){
 }
 
 void reb_integrator_tes_reset(struct reb_simulation* r){
-    if(r->ri_tes.allocated_N != 0)
-    {
-      reb_free_uvars(r);
-      reb_dhem_free(r);
-      reb_radau_free(r);
-      reb_tes_free(r);    
-    }
-
+    // All module memory lives in the pool, so a single free releases everything.
+    reb_tes_free(r);
+    r->ri_tes.allocated_N = 0;
 }
 
 void reb_integrator_tes_allocate_memory(struct reb_simulation* r)
 {
     reb_tes_init(r, r->N);
     reb_init_uvars(r);
-    reb_dhem_init(r, r->ri_tes.orbital_period/r->ri_tes.recti_per_orbit, 9);
+    reb_dhem_init(r, r->ri_tes.orbital_period/r->ri_tes.recti_per_orbit, OSCULATING_ORBIT_SLOTS);
     reb_radau_init(r);          
 }
 
@@ -312,34 +306,85 @@ void reb_integrator_tes_allocate_memory(struct reb_simulation* r)
 ///////////////////////////////////////////////////////////////////////////////////
 static void reb_tes_init(struct reb_simulation* r, uint32_t z_n)
 {
-  if(r->ri_tes.allocated_N != 0)
-  {
-    reb_tes_free(r);
-  }
+  reb_tes_free(r);
   
   // Set control variables to initial values
-  r->ri_tes.stateVectorLength = 2*3*r->N;
+  r->ri_tes.stateVectorLength = 2*3*z_n;
   r->ri_tes.stateVectorSize = r->ri_tes.stateVectorLength * sizeof(double);
-  r->ri_tes.controlVectorSize = r->N * sizeof(double);
-
-  // Allocate memory
-  r->ri_tes.mass = (double *)malloc(r->ri_tes.controlVectorSize);
-  r->ri_tes.X_dh = (double *)malloc(r->ri_tes.stateVectorSize);
-  r->ri_tes.particles_dh = (struct reb_particle*)malloc(sizeof(struct reb_particle)*r->N);
+  r->ri_tes.controlVectorSize = z_n * sizeof(double);
+
+  // The working memory of all modules (uvars, dhem, radau) is allocated here in one
+  // go and then handed out by reb_tes_pool_take(). The pool is zeroed so that every
+  // module starts from a clean state for each integration.
+  r->ri_tes.pool_size = reb_tes_pool_size(z_n, OSCULATING_ORBIT_SLOTS);
+  r->ri_tes.pool_used = 0;
+  r->ri_tes.pool = aligned_alloc(TES_POOL_ALIGNMENT, r->ri_tes.pool_size);
+  memset(r->ri_tes.pool, 0, r->ri_tes.pool_size);
+
+  r->ri_tes.mass = (double *)reb_tes_pool_take(r, r->ri_tes.controlVectorSize);
+  r->ri_tes.X_dh = (double *)reb_tes_pool_take(r, r->ri_tes.stateVectorSize);
+  r->ri_tes.particles_dh = (struct reb_particle*)reb_tes_pool_take(r, sizeof(struct reb_particle)*z_n);
   r->ri_tes.Q_dh = r->ri_tes.X_dh;
   r->ri_tes.P_dh = &r->ri_tes.X_dh[r->ri_tes.stateVectorLength/2];
-
-  // Ensure we are clean for each integration.
-  memset(r->ri_tes.mass, 0, r->ri_tes.controlVectorSize);
-  memset(r->ri_tes.X_dh, 0, r->ri_tes.stateVectorSize);
 }
 
 
 static void reb_tes_free(struct reb_simulation* r)
 {
-  free(r->ri_tes.mass);
-  free(r->ri_tes.X_dh);
-  free(r->ri_tes.particles_dh);
+  free(r->ri_tes.pool);
+  r->ri_tes.pool = NULL;
+  r->ri_tes.pool_size = 0;
+  r->ri_tes.pool_used = 0;
+  r->ri_tes.mass = NULL;
+  r->ri_tes.X_dh = NULL;
+  r->ri_tes.Q_dh = NULL;
+  r->ri_tes.P_dh = NULL;
+  r->ri_tes.particles_dh = NULL;
+  r->ri_tes.uVars = NULL;
+  r->ri_tes.rhs = NULL;
+  r->ri_tes.radau = NULL;
+}
+
+static size_t reb_tes_pool_chunk(size_t size)
+{
+  return (size + TES_POOL_ALIGNMENT - 1) / TES_POOL_ALIGNMENT * TES_POOL_ALIGNMENT;
+}
+
+// Total number of bytes taken from the pool by reb_tes_init(), reb_init_uvars(),
+// reb_dhem_init() and reb_radau_init(). Must be kept in sync with those functions.
+static size_t reb_tes_pool_size(uint32_t z_n, uint32_t z_stagesPerStep)
+{
+  const size_t cv = reb_tes_pool_chunk(z_n*sizeof(double));       // one double per particle
+  const size_t hv = reb_tes_pool_chunk(3*z_n*sizeof(double));     // positions or momenta
+  const size_t sv = reb_tes_pool_chunk(6*z_n*sizeof(double));     // full state vector
+  const size_t oscStore = reb_tes_pool_chunk(z_stagesPerStep*6*z_n*sizeof(double));
+  const size_t stagePtrs = reb_tes_pool_chunk(z_stagesPerStep*sizeof(double*));
+
+  size_t size = 0;
+  // Simulation: mass, X_dh, particles_dh
+  size += cv + sv + reb_tes_pool_chunk(z_n*sizeof(struct reb_particle));
+  // Universal variables: 10 arrays of length 3N and 19 of length N
+  size += reb_tes_pool_chunk(sizeof(UNIVERSAL_VARS)) + 10*hv + 19*cv;
+  // DHEM: X, rectification times and periods, m_inv, osculating orbit stores
+  size += reb_tes_pool_chunk(sizeof(DHEM)) + sv + 3*cv + 4*oscStore + 4*stagePtrs;
+  // Radau: dX, Xout, predictors, b6_store, rectifiedArray, 8 sets of control
+  // variables and 9 further state vectors used in the step.
+  size += reb_tes_pool_chunk(sizeof(RADAU)) + 4*sv + reb_tes_pool_chunk(6*z_n*sizeof(uint32_t)) + 8*7*sv + 9*sv;
+  return size;
+}
+
+// Hands out the next aligned, zeroed chunk of the pool.
+static void* reb_tes_pool_take(struct reb_simulation* r, size_t size)
+{
+  void* p = r->ri_tes.pool + r->ri_tes.pool_used;
+  r->ri_tes.pool_used += reb_tes_pool_chunk(size);
+  if(r->ri_tes.pool_used > r->ri_tes.pool_size)
+  {
+    reb_error(r, "TES memory pool too small. This is a bug.");
+    r->status = REB_EXIT_ERROR;
+    return NULL;
+  }
+  return p;
 }
 
 
@@ -416,7 +461,7 @@ static void reb_dhem_rhs(struct reb_simulation* r, double const * __restrict__ c
       dQ_dot[3*i+2] = (dP[3*i+2] / m[i]) + vCentral[2];
   }
 
-  #pragma GCC ivdep
+#pragma omp parallel for simd if(n>TES_PARALLEL_N)
   for(uint32_t i = 1; i < n; i++)
   {
     const double GMM = G*m[0]*m[i];
@@ -449,6 +494,47 @@ static void reb_dhem_rhs(struct reb_simulation* r, double const * __restrict__ c
   }
   
   const double istart = 1;
+#ifdef OPENMP
+  if(n>TES_PARALLEL_N)
+  {
+    // Every thread accumulates the interactions of its own particles only. Both
+    // halves of a pair are evaluated exactly as in the serial loop below and are
+    // added in the same order, so the result is independent of the number of threads.
+#pragma omp parallel for schedule(guided)
+    for(uint32_t i = istart; i < n; i++)
+    {
+      for(uint32_t j = istart; j < i; j++)
+      {
+          const double GMM = G*m[i]*m[j];
+          const double dx = Q[3*j+0] - Q[3*i+0];
+          const double dy = Q[3*j+1] - Q[3*i+1];
+          const double dz = Q[3*j+2] - Q[3*i+2];
+
+          const double sepNorm = sqrt(dx*dx+dy*dy+dz*dz);
+          const double GMM_SepNorm3Inv = (GMM/(sepNorm*sepNorm*sepNorm));
+
+          dP_dot[3*i+0] += dx*GMM_SepNorm3Inv;
+          dP_dot[3*i+1] += dy*GMM_SepNorm3Inv;
+          dP_dot[3*i+2] += dz*GMM_SepNorm3Inv;
+      }
+      for(uint32_t j = i+1; j < n; j++)
+      {
+          const double GMM = G*m[j]*m[i];
+          const double dx = Q[3*i+0] - Q[3*j+0];
+          const double dy = Q[3*i+1] - Q[3*j+1];
+          const double dz = Q[3*i+2] - Q[3*j+2];
+
+          const double sepNorm = sqrt(dx*dx+dy*dy+dz*dz);
+          const double GMM_SepNorm3Inv = (GMM/(sepNorm*sepNorm*sepNorm));
+
+          dP_dot[3*i+0] -= dx*GMM_SepNorm3Inv;
+          dP_dot[3*i+1] -= dy*GMM_SepNorm3Inv;
+          dP_dot[3*i+2] -= dz*GMM_SepNorm3Inv;
+      }
+    }
+  }
+  else
+#endif // OPENMP
   for(uint32_t i = istart; i < n; i++)
   {
       const double GM = G*m[i];
@@ -585,6 +671,7 @@ uint32_t reb_dhem_rectify(struct reb_simulation* r, double t, double * Q, double
     }
   }
 
+#pragma omp parallel for if(r->N>TES_PARALLEL_N) reduction(+:rectifiedCount)
   for(int32_t i = 1; i < r->N; i++)
   {
     if(rectifyFlag != 0)
@@ -641,6 +728,7 @@ static void reb_dhem_calc_osc_orbit_derivs(struct reb_simulation* r, double cons
   DHEM * dhem = r->ri_tes.rhs;
   const double GM0 = -r->G*dhem->m[0];
 
+#pragma omp parallel for if(r->N>TES_PARALLEL_N)
   for(int32_t i = 1; i < r->N; i++)
   {
     const double m = r->ri_tes.mass[i];
@@ -698,45 +786,28 @@ static double reb_find_min_particle_period(struct reb_simulation* r)
 
 static void reb_dhem_init(struct reb_simulation* r, double z_rectificationPeriodDefault, uint32_t z_stagesPerStep)
 {
-  // Get memory for the dhem state vectors.
-  r->ri_tes.rhs = (DHEM*)malloc(sizeof(DHEM));
-  memset(r->ri_tes.rhs, 0, sizeof(DHEM));
+  // Get memory for the dhem state vectors. The pool is already zeroed.
+  r->ri_tes.rhs = (DHEM*)reb_tes_pool_take(r, sizeof(DHEM));
   DHEM * dhem = r->ri_tes.rhs;
 
-  dhem->X = (double*)malloc(r->ri_tes.stateVectorSize);
-  dhem->rectifyTimeArray = (double*)malloc(r->ri_tes.controlVectorSize);
-  dhem->rectificationPeriod = (double*)malloc(r->ri_tes.controlVectorSize);
+  dhem->X = (double*)reb_tes_pool_take(r, r->ri_tes.stateVectorSize);
+  dhem->rectifyTimeArray = (double*)reb_tes_pool_take(r, r->ri_tes.controlVectorSize);
+  dhem->rectificationPeriod = (double*)reb_tes_pool_take(r, r->ri_tes.controlVectorSize);
 
   // Create space to allow for all of the osculating orbits for a step to be stored.
-  dhem->XoscStore = (double*)malloc(z_stagesPerStep*r->ri_tes.stateVectorSize);
-  dhem->XoscArr = (double **)malloc(z_stagesPerStep*sizeof(double*));
-  dhem->Xosc_dotStore = (double*)malloc(z_stagesPerStep*r->ri_tes.stateVectorSize);
-  dhem->Xosc_dotArr = (double **)malloc(z_stagesPerStep*sizeof(double*));
+  dhem->XoscStore = (double*)reb_tes_pool_take(r, z_stagesPerStep*r->ri_tes.stateVectorSize);
+  dhem->XoscArr = (double **)reb_tes_pool_take(r, z_stagesPerStep*sizeof(double*));
+  dhem->Xosc_dotStore = (double*)reb_tes_pool_take(r, z_stagesPerStep*r->ri_tes.stateVectorSize);
+  dhem->Xosc_dotArr = (double **)reb_tes_pool_take(r, z_stagesPerStep*sizeof(double*));
 
   // Create space to allow for all of the osculating orbits for a step to be stored.
-  dhem->XoscPredStore = (double*)malloc(z_stagesPerStep*r->ri_tes.stateVectorSize);
-  dhem->XoscPredArr = (double **)malloc(z_stagesPerStep*sizeof(double*));
+  dhem->XoscPredStore = (double*)reb_tes_pool_take(r, z_stagesPerStep*r->ri_tes.stateVectorSize);
+  dhem->XoscPredArr = (double **)reb_tes_pool_take(r, z_stagesPerStep*sizeof(double*));
 
 
   // Creat space for osculating orbit compensated summation variables
-  dhem->XoscStore_cs = (double*)malloc(z_stagesPerStep*r->ri_tes.stateVectorSize);
-  dhem->XoscArr_cs = (double **)malloc(z_stagesPerStep*sizeof(double*));
-  
-  // Set required arrays to zero.
-  memset(dhem->X, 0, r->ri_tes.stateVectorSize);
-  memset(dhem->rectifyTimeArray, 0, r->ri_tes.controlVectorSize);
-  memset(dhem->rectificationPeriod, 0, r->ri_tes.controlVectorSize);
-
-  memset(dhem->XoscStore, 0, z_stagesPerStep*r->ri_tes.stateVectorSize);
-  memset(dhem->XoscArr, 0, z_stagesPerStep*sizeof(double *));
-  memset(dhem->Xosc_dotStore, 0, z_stagesPerStep*r->ri_tes.stateVectorSize);
-  memset(dhem->Xosc_dotArr, 0, z_stagesPerStep*sizeof(double *));
-
-  memset(dhem->XoscPredStore, 0, z_stagesPerStep*r->ri_tes.stateVectorSize);
-  memset(dhem->XoscPredArr, 0, z_stagesPerStep*sizeof(double *));
-
-  memset(dhem->XoscStore_cs, 0, z_stagesPerStep*r->ri_tes.stateVectorSize);
-  memset(dhem->XoscArr_cs, 0, z_stagesPerStep*sizeof(double *));
+  dhem->XoscStore_cs = (double*)reb_tes_pool_take(r, z_stagesPerStep*r->ri_tes.stateVectorSize);
+  dhem->XoscArr_cs = (double **)reb_tes_pool_take(r, z_stagesPerStep*sizeof(double*));
 
   // To enable easier access to the osculating orbits.
   for(uint32_t i = 0; i < z_stagesPerStep; i++)
@@ -764,7 +835,7 @@ static void reb_dhem_init(struct reb_simulation* r, double z_rectificationPeriod
   dhem->m = r->ri_tes.mass;
   dhem->mTotal = 0;
 
-  dhem->m_inv = (double*)malloc(r->N*sizeof(double));
+  dhem->m_inv = (double*)reb_tes_pool_take(r, r->ri_tes.controlVectorSize);
 
   for(int32_t i = 0; i < r->N; i++)
   {
@@ -775,25 +846,6 @@ static void reb_dhem_init(struct reb_simulation* r, double z_rectificationPeriod
   }
 }
 
-static void reb_dhem_free(struct reb_simulation* r)
-{
-  DHEM * rhs = r->ri_tes.rhs;
-  free(rhs->X);
-  free(rhs->rectifyTimeArray);
-  free(rhs->rectificationPeriod);
-  free(rhs->XoscStore);
-  free(rhs->XoscArr);
-  free(rhs->Xosc_dotStore);
-  free(rhs->Xosc_dotArr);
-  free(rhs->XoscPredStore);
-  free(rhs->XoscPredArr);
-  free(rhs->XoscStore_cs);
-  free(rhs->XoscArr_cs);
-  free(rhs->m_inv);
-  free(rhs);
-  rhs = NULL;
-}
-
 static inline void add_cs(double* out, double* cs, double inp)
 {
     const double y = inp - cs[0];
@@ -842,17 +894,12 @@ double reb_single_step(struct reb_simulation* r, double z_t, double dt, double d
 
 static void reb_radau_init(struct reb_simulation* r)
 {
-  r->ri_tes.radau = (RADAU *)malloc(sizeof(RADAU));
-  memset(r->ri_tes.radau, 0, sizeof(RADAU));
+  r->ri_tes.radau = (RADAU *)reb_tes_pool_take(r, sizeof(RADAU));
   RADAU * radau = r->ri_tes.radau;
 
-  radau->dX = (double*)malloc(r->ri_tes.stateVectorSize);
-  radau->Xout = (double*)malloc(r->ri_tes.stateVectorSize);
-  radau->predictors = (double*)malloc(r->ri_tes.stateVectorSize);
-
-  memset(radau->dX, 0, r->ri_tes.stateVectorSize);
-  memset(radau->Xout, 0, r->ri_tes.stateVectorSize);
-  memset(radau->predictors, 0, r->ri_tes.stateVectorSize);
+  radau->dX = (double*)reb_tes_pool_take(r, r->ri_tes.stateVectorSize);
+  radau->Xout = (double*)reb_tes_pool_take(r, r->ri_tes.stateVectorSize);
+  radau->predictors = (double*)reb_tes_pool_take(r, r->ri_tes.stateVectorSize);
 
   radau->dQ = radau->dX;
   radau->dP = &radau->dX[3*r->N];
@@ -863,12 +910,8 @@ static void reb_radau_init(struct reb_simulation* r)
   memcpy(radau->Qout, r->ri_tes.Q_dh, r->ri_tes.stateVectorSize / 2);
   memcpy(radau->Pout, r->ri_tes.P_dh, r->ri_tes.stateVectorSize / 2);
 
-  radau->rectifiedArray = (uint32_t*)malloc(sizeof(uint32_t)*r->ri_tes.stateVectorLength);
-  memset(radau->rectifiedArray, 0, sizeof(uint32_t)*r->ri_tes.stateVectorLength);
-
-  radau->b6_store = (double*)malloc(r->ri_tes.stateVectorSize);
-
-  memset(radau->b6_store, 0, r->ri_tes.stateVectorSize);
+  radau->rectifiedArray = (uint32_t*)reb_tes_pool_take(r, sizeof(uint32_t)*r->ri_tes.stateVectorLength);
+  radau->b6_store = (double*)reb_tes_pool_take(r, r->ri_tes.stateVectorSize);
 
   //@todo should be able to remove these, but test.
   radau->fCalls = 0;
@@ -878,19 +921,6 @@ static void reb_radau_init(struct reb_simulation* r)
   reb_init_radau_step(r);
 }
 
-static void reb_radau_free(struct reb_simulation* r)
-{
-  RADAU * radau = r->ri_tes.radau;
-  reb_free_radau_step(r);
-  free(radau->dX);
-  free(radau->Xout);
-  free(radau->predictors);
-  free(radau->rectifiedArray);
-  free(radau->b6_store);
-  free(radau);
-  radau = NULL;
-}
-
 double reb_calc_stepsize(struct reb_simulation* r, double h, double hLast, double t)
 {
   double hTrial = 0.0;
@@ -1486,96 +1516,43 @@ static void reb_update_state(double h, double * z_dState, double * z_ddState,
 static void reb_init_radau_step(struct reb_simulation* r)
 {
     RADAU * radau = r->ri_tes.radau;
-    reb_init_controlvars(&radau->G, r->ri_tes.stateVectorSize);    
-    reb_init_controlvars(&radau->B, r->ri_tes.stateVectorSize);    
-    reb_init_controlvars(&radau->Blast, r->ri_tes.stateVectorSize);   
-    reb_init_controlvars(&radau->Blast_1st, r->ri_tes.stateVectorSize);
-    reb_init_controlvars(&radau->G_1st, r->ri_tes.stateVectorSize);
-    reb_init_controlvars(&radau->B_1st, r->ri_tes.stateVectorSize);
+    reb_init_controlvars(r, &radau->G, r->ri_tes.stateVectorSize);    
+    reb_init_controlvars(r, &radau->B, r->ri_tes.stateVectorSize);    
+    reb_init_controlvars(r, &radau->Blast, r->ri_tes.stateVectorSize);   
+    reb_init_controlvars(r, &radau->Blast_1st, r->ri_tes.stateVectorSize);
+    reb_init_controlvars(r, &radau->G_1st, r->ri_tes.stateVectorSize);
+    reb_init_controlvars(r, &radau->B_1st, r->ri_tes.stateVectorSize);
     
-    reb_init_controlvars(&radau->cs_B1st, r->ri_tes.stateVectorSize);
-    reb_init_controlvars(&radau->cs_B, r->ri_tes.stateVectorSize);
-
-    radau->dState0 = (double *)malloc(r->ri_tes.stateVectorSize);
-    radau->ddState0 = (double *)malloc(r->ri_tes.stateVectorSize);
-    radau->dState = (double *)malloc(r->ri_tes.stateVectorSize);
-    radau->ddState = (double *)malloc(r->ri_tes.stateVectorSize);
+    reb_init_controlvars(r, &radau->cs_B1st, r->ri_tes.stateVectorSize);
+    reb_init_controlvars(r, &radau->cs_B, r->ri_tes.stateVectorSize);
 
-    memset(radau->dState0, 0, r->ri_tes.stateVectorSize);
-    memset(radau->ddState0, 0, r->ri_tes.stateVectorSize);
-    memset(radau->dState, 0, r->ri_tes.stateVectorSize);
-    memset(radau->ddState, 0, r->ri_tes.stateVectorSize);
+    radau->dState0 = (double *)reb_tes_pool_take(r, r->ri_tes.stateVectorSize);
+    radau->ddState0 = (double *)reb_tes_pool_take(r, r->ri_tes.stateVectorSize);
+    radau->dState = (double *)reb_tes_pool_take(r, r->ri_tes.stateVectorSize);
+    radau->ddState = (double *)reb_tes_pool_take(r, r->ri_tes.stateVectorSize);
 
     // Compensated summation arrays
-    radau->cs_dState0 = (double *)malloc(r->ri_tes.stateVectorSize);
-    radau->cs_ddState0 = (double *)malloc(r->ri_tes.stateVectorSize);
-    radau->cs_dState = (double *)malloc(r->ri_tes.stateVectorSize);
-    radau->cs_ddState = (double *)malloc(r->ri_tes.stateVectorSize);
+    radau->cs_dState0 = (double *)reb_tes_pool_take(r, r->ri_tes.stateVectorSize);
+    radau->cs_ddState0 = (double *)reb_tes_pool_take(r, r->ri_tes.stateVectorSize);
+    radau->cs_dState = (double *)reb_tes_pool_take(r, r->ri_tes.stateVectorSize);
+    radau->cs_ddState = (double *)reb_tes_pool_take(r, r->ri_tes.stateVectorSize);
 
-    memset(radau->cs_dState0, 0, r->ri_tes.stateVectorSize);
-    memset(radau->cs_ddState0, 0, r->ri_tes.stateVectorSize);
-    memset(radau->cs_dState, 0, r->ri_tes.stateVectorSize);
-    memset(radau->cs_ddState, 0, r->ri_tes.stateVectorSize);
-
-    radau->cs_dX = (double *)malloc(r->ri_tes.stateVectorSize);
+    radau->cs_dX = (double *)reb_tes_pool_take(r, r->ri_tes.stateVectorSize);
     radau->cs_dq = radau->cs_dX;
     radau->cs_dp = &radau->cs_dX[(int)r->ri_tes.stateVectorLength/2];
-
-    memset(radau->cs_dX, 0, r->ri_tes.stateVectorSize);
 }
 
-static void reb_free_radau_step(struct reb_simulation* r)
-{
-  RADAU * radau = r->ri_tes.radau;
-  reb_free_controlvars(&r->ri_tes.radau->G);
-  reb_free_controlvars(&r->ri_tes.radau->B);
-  reb_free_controlvars(&r->ri_tes.radau->Blast);
-  reb_free_controlvars(&r->ri_tes.radau->Blast_1st);
-  reb_free_controlvars(&r->ri_tes.radau->G_1st);
-  reb_free_controlvars(&r->ri_tes.radau->B_1st);    
-  reb_free_controlvars(&r->ri_tes.radau->cs_B1st);
-  reb_free_controlvars(&r->ri_tes.radau->cs_B);
-  free(radau->dState0);
-  free(radau->ddState0);
-  free(radau->dState);
-  free(radau->ddState);
-  free(radau->cs_dState0);
-  free(radau->cs_ddState0);
-  free(radau->cs_dState);
-  free(radau->cs_ddState);
-  free(radau->cs_dX);
-}
 
-
-static void reb_init_controlvars(controlVars * var, uint32_t size)
+static void reb_init_controlvars(struct reb_simulation* r, controlVars * var, uint32_t size)
 {
   var->size = size;
-  var->p0 = (double*)malloc(size);
-  var->p1 = (double*)malloc(size);
-  var->p2 = (double*)malloc(size);
-  var->p3 = (double*)malloc(size);
-  var->p4 = (double*)malloc(size);
-  var->p5 = (double*)malloc(size);
-  var->p6 = (double*)malloc(size);
-
-  memset(var->p0, 0, size);
-  memset(var->p1, 0, size);
-  memset(var->p2, 0, size);
-  memset(var->p3, 0, size);
-  memset(var->p4, 0, size);
-  memset(var->p5, 0, size);
-  memset(var->p6, 0, size);
-}
-
-static void reb_free_controlvars(controlVars * var)
-{
-  free(var->p0);
-  free(var->p1);
-  free(var->p2);
-  free(var->p3);
-  free(var->p4);
-  free(var->p5);
-  free(var->p6);
+  var->p0 = (double*)reb_tes_pool_take(r, size);
+  var->p1 = (double*)reb_tes_pool_take(r, size);
+  var->p2 = (double*)reb_tes_pool_take(r, size);
+  var->p3 = (double*)reb_tes_pool_take(r, size);
+  var->p4 = (double*)reb_tes_pool_take(r, size);
+  var->p5 = (double*)reb_tes_pool_take(r, size);
+  var->p6 = (double*)reb_tes_pool_take(r, size);
 }
 
 static void reb_clear_controlvars(controlVars * var)
@@ -1619,26 +1596,30 @@ static void reb_calc_osc_orbits(struct reb_simulation* r, double **Xosc_map,
       dt = h*(h_array[stage]-t_last_rebasis); 
     }
 
-    double C[4] = {0.0, 0.0, 0.0, 0.0};
+    // The dt value is wrapped around the orbital period of each particle in turn.
+    // The wrapped value seen by particle i is stored in p_uVars->dt[i] so that the 
+    // Kepler solves below are independent of each other and can run in parallel.
     for(int32_t i = 1; i < r->N; i++)
-    {  
-      // Calculate the dt value and wrap around the orbital period.
+    {
       dt = fmod(dt, p_uVars->period[i]);
+      p_uVars->dt[i] = dt;
+    }
 
+#pragma omp parallel for if(r->N>TES_PARALLEL_N)
+    for(int32_t i = 1; i < r->N; i++)
+    {  
       // Calculate our step since last time we were called and update storage of tLast.
       double h = t - p_uVars->tLast[i];
       p_uVars->tLast[i] = t;
 
-      reb_solve_for_universal_anomaly(r, dt, h, i, C);
+      double C[4] = {0.0, 0.0, 0.0, 0.0};
+      reb_solve_for_universal_anomaly(r, p_uVars->dt[i], h, i, C);
 
       p_uVars->C.c0[i] = C[0];
       p_uVars->C.c1[i] = C[1];
       p_uVars->C.c2[i] = C[2];
       p_uVars->C.c3[i] = C[3];
-    }
 
-    for(int32_t i = 1; i < r->N; i++)
-    {    
       double * Qout = Xosc_map[stage];
       double * Pout = &Qout[3*r->N];      
       const double X = p_uVars->X[i];
@@ -1736,6 +1717,7 @@ static void reb_apply_osc_orbit_corrector(struct reb_simulation* r, double **Xos
     double * Qout = Xosc_map[z_stagePerStep-1];
     double * Pout = &Qout[3*r->N];      
 
+#pragma omp parallel for if(r->N>TES_PARALLEL_N)
     for(int32_t i = 1; i < r->N; i++)
     {
         for(uint32_t j = 0; j < 3; j++)
@@ -1890,107 +1872,45 @@ static void reb_init_uvars(struct reb_simulation* const r)
 {
   int N = r->N;
   // Create the main control data structure for universal variables.
-  r->ri_tes.uVars = (UNIVERSAL_VARS *)malloc(sizeof(UNIVERSAL_VARS));
-  memset(r->ri_tes.uVars, 0, sizeof(UNIVERSAL_VARS));
+  r->ri_tes.uVars = (UNIVERSAL_VARS *)reb_tes_pool_take(r, sizeof(UNIVERSAL_VARS));
   UNIVERSAL_VARS * p_uVars = r->ri_tes.uVars;
 
   p_uVars->stateVectorSize = 3 * N * sizeof(double);
   p_uVars->controlVectorSize = N * sizeof(double);
 
-  // Allocate memory for all objects used in universal vars
-  p_uVars->Q0 = (double *)malloc(p_uVars->stateVectorSize);
-  p_uVars->V0 = (double *)malloc(p_uVars->stateVectorSize);
-  p_uVars->Q1 = (double *)malloc(p_uVars->stateVectorSize);
-  p_uVars->V1 = (double *)malloc(p_uVars->stateVectorSize);
-  p_uVars->P0 = (double *)malloc(p_uVars->stateVectorSize);
-  p_uVars->P1 = (double *)malloc(p_uVars->stateVectorSize);
-  p_uVars->t0 = (double *)malloc(N*sizeof(double));
-  p_uVars->tLast = (double *)malloc(N*sizeof(double));
-  p_uVars->Q0_norm = (double *)malloc(p_uVars->controlVectorSize);
-  p_uVars->beta = (double *)malloc(p_uVars->controlVectorSize);
-  p_uVars->eta =  (double *)malloc(p_uVars->controlVectorSize);
-  p_uVars->zeta = (double *)malloc(p_uVars->controlVectorSize);
-  p_uVars->period = (double *)malloc(p_uVars->controlVectorSize);
-  p_uVars->Xperiod = (double *)malloc(p_uVars->controlVectorSize);
-  p_uVars->X = (double *)malloc(p_uVars->controlVectorSize);
-  p_uVars->dt = (double *)malloc(p_uVars->controlVectorSize);
+  // Allocate memory for all objects used in universal vars. The pool is already zeroed.
+  p_uVars->Q0 = (double *)reb_tes_pool_take(r, p_uVars->stateVectorSize);
+  p_uVars->V0 = (double *)reb_tes_pool_take(r, p_uVars->stateVectorSize);
+  p_uVars->Q1 = (double *)reb_tes_pool_take(r, p_uVars->stateVectorSize);
+  p_uVars->V1 = (double *)reb_tes_pool_take(r, p_uVars->stateVectorSize);
+  p_uVars->P0 = (double *)reb_tes_pool_take(r, p_uVars->stateVectorSize);
+  p_uVars->P1 = (double *)reb_tes_pool_take(r, p_uVars->stateVectorSize);
+  p_uVars->t0 = (double *)reb_tes_pool_take(r, N*sizeof(double));
+  p_uVars->tLast = (double *)reb_tes_pool_take(r, N*sizeof(double));
+  p_uVars->Q0_norm = (double *)reb_tes_pool_take(r, p_uVars->controlVectorSize);
+  p_uVars->beta = (double *)reb_tes_pool_take(r, p_uVars->controlVectorSize);
+  p_uVars->eta =  (double *)reb_tes_pool_take(r, p_uVars->controlVectorSize);
+  p_uVars->zeta = (double *)reb_tes_pool_take(r, p_uVars->controlVectorSize);
+  p_uVars->period = (double *)reb_tes_pool_take(r, p_uVars->controlVectorSize);
+  p_uVars->Xperiod = (double *)reb_tes_pool_take(r, p_uVars->controlVectorSize);
+  p_uVars->X = (double *)reb_tes_pool_take(r, p_uVars->controlVectorSize);
+  p_uVars->dt = (double *)reb_tes_pool_take(r, p_uVars->controlVectorSize);
 
   p_uVars->mu = (double)r->G*(double)r->ri_tes.mass[0];
-  p_uVars->e = (double *)malloc(p_uVars->controlVectorSize);
-  p_uVars->a = (double *)malloc(p_uVars->controlVectorSize);
-  p_uVars->h = (double *)malloc(p_uVars->stateVectorSize);
-  p_uVars->h_norm = (double *)malloc(p_uVars->controlVectorSize);
-  p_uVars->peri = (double *)malloc(p_uVars->controlVectorSize);
-  p_uVars->apo = (double *)malloc(p_uVars->controlVectorSize);
+  p_uVars->e = (double *)reb_tes_pool_take(r, p_uVars->controlVectorSize);
+  p_uVars->a = (double *)reb_tes_pool_take(r, p_uVars->controlVectorSize);
+  p_uVars->h = (double *)reb_tes_pool_take(r, p_uVars->stateVectorSize);
+  p_uVars->h_norm = (double *)reb_tes_pool_take(r, p_uVars->controlVectorSize);
+  p_uVars->peri = (double *)reb_tes_pool_take(r, p_uVars->controlVectorSize);
+  p_uVars->apo = (double *)reb_tes_pool_take(r, p_uVars->controlVectorSize);
   
-  p_uVars->C.c0 = (double *)malloc(p_uVars->controlVectorSize);
-  p_uVars->C.c1 = (double *)malloc(p_uVars->controlVectorSize);
-  p_uVars->C.c2 = (double *)malloc(p_uVars->controlVectorSize);
-  p_uVars->C.c3 = (double *)malloc(p_uVars->controlVectorSize);
-
-  memset(p_uVars->Q0, 0, p_uVars->stateVectorSize);
-  memset(p_uVars->V0, 0, p_uVars->stateVectorSize);
-  memset(p_uVars->Q1, 0, p_uVars->stateVectorSize);
-  memset(p_uVars->V1, 0, p_uVars->stateVectorSize);
-  memset(p_uVars->P0, 0, p_uVars->stateVectorSize);
-  memset(p_uVars->P1, 0, p_uVars->stateVectorSize);
-  memset(p_uVars->t0, 0, N*sizeof(double));
-  memset(p_uVars->tLast, 0, N*sizeof(double));
-  memset(p_uVars->Q0_norm, 0, p_uVars->controlVectorSize);
-  memset(p_uVars->beta, 0, p_uVars->controlVectorSize);
-  memset(p_uVars->eta, 0, p_uVars->controlVectorSize);
-  memset(p_uVars->zeta, 0, p_uVars->controlVectorSize);
-  memset(p_uVars->period, 0, p_uVars->controlVectorSize);
-  memset(p_uVars->Xperiod, 0, p_uVars->controlVectorSize);
-  memset(p_uVars->X, 0, p_uVars->controlVectorSize);
-  memset(p_uVars->a, 0, p_uVars->controlVectorSize);
-  memset(p_uVars->e, 0, p_uVars->controlVectorSize);
-  memset(p_uVars->h, 0, p_uVars->stateVectorSize);
-  memset(p_uVars->h_norm, 0, p_uVars->controlVectorSize);
-  memset(p_uVars->peri, 0, p_uVars->controlVectorSize);
-  memset(p_uVars->apo, 0, p_uVars->controlVectorSize);
-  memset(p_uVars->dt, 0, p_uVars->controlVectorSize);
+  p_uVars->C.c0 = (double *)reb_tes_pool_take(r, p_uVars->controlVectorSize);
+  p_uVars->C.c1 = (double *)reb_tes_pool_take(r, p_uVars->controlVectorSize);
+  p_uVars->C.c2 = (double *)reb_tes_pool_take(r, p_uVars->controlVectorSize);
+  p_uVars->C.c3 = (double *)reb_tes_pool_take(r, p_uVars->controlVectorSize);
 
   // CS vars
-  p_uVars->uv_csq = (double *)malloc(p_uVars->stateVectorSize);
-  p_uVars->uv_csv = (double *)malloc(p_uVars->stateVectorSize);
-  p_uVars->uv_csp = (double *)malloc(p_uVars->stateVectorSize);
-  memset(p_uVars->uv_csq, 0, p_uVars->stateVectorSize);
-  memset(p_uVars->uv_csv, 0, p_uVars->stateVectorSize);
-  memset(p_uVars->uv_csp, 0, p_uVars->stateVectorSize);  
-}
-
-static void reb_free_uvars(struct reb_simulation* r)
-{
-  UNIVERSAL_VARS * p_uVars = r->ri_tes.uVars;
-  free(p_uVars->Q0);
-  free(p_uVars->V0);
-  free(p_uVars->Q1);
-  free(p_uVars->V1);
-  free(p_uVars->P0);
-  free(p_uVars->P1);
-  free(p_uVars->t0);
-  free(p_uVars->tLast);
-  free(p_uVars->Q0_norm);
-  free(p_uVars->beta);
-  free(p_uVars->eta);
-  free(p_uVars->zeta);
-  free(p_uVars->period);
-  free(p_uVars->Xperiod);
-  free(p_uVars->X);
-  free(p_uVars->dt);
-  free(p_uVars->e);
-  free(p_uVars->a);
-  free(p_uVars->h);
-  free(p_uVars->h_norm);
-  free(p_uVars->peri);
-  free(p_uVars->apo);
-  free(p_uVars->C.c0);
-  free(p_uVars->C.c1);
-  free(p_uVars->C.c2);
-  free(p_uVars->C.c3);
-  free(p_uVars->uv_csq);
-  free(p_uVars->uv_csv);
-  free(p_uVars->uv_csp);
-  free(p_uVars);
+  p_uVars->uv_csq = (double *)reb_tes_pool_take(r, p_uVars->stateVectorSize);
+  p_uVars->uv_csv = (double *)reb_tes_pool_take(r, p_uVars->stateVectorSize);
+  p_uVars->uv_csp = (double *)reb_tes_pool_take(r, p_uVars->stateVectorSize);
 }
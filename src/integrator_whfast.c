@@ -40,6 +40,7 @@
 #include "boundary.h"
 #include "integrator.h"
 #include "integrator_whfast.h"
+#include "profiling.h"
 
 #define MAX(a, b) ((a) < (b) ? (b) : (a))   ///< Returns the maximum of a and b
 #define MIN(a, b) ((a) > (b) ? (b) : (a))   ///< Returns the minimum of a and b
@@ -161,7 +162,11 @@ static void stiefel_Gs3(double *restrict Gs, double beta, double X) {
 #define WHFAST_NMAX_NEWT  32    ///< Maximum number of iterations for Newton's method
 /************************************
  * Keplerian motion for one planet  */
-void reb_whfast_kepler_solver(const struct reb_simulation* const r, struct reb_particle* const restrict p_j, const double M, unsigned int i, double _dt){
+// If kepler_guess is not NULL, kepler_guess[i] is used to improve the initial guess and 
+// updated afterwards. It stores the relative error of the second order guess in the last 
+// call divided by dt^2. This is (nearly) independent of the timestep, so that the drifts 
+// of different length in the kernels, correctors, and SABA stages can share one cache.
+void reb_whfast_kepler_solver(const struct reb_simulation* const r, struct reb_particle* const restrict p_j, const double M, unsigned int i, double _dt, double* const restrict kepler_guess){
     const struct reb_particle p1 = p_j[i];
 
     const double r0 = sqrt(p1.x*p1.x + p1.y*p1.y + p1.z*p1.z);
@@ -174,6 +179,7 @@ void reb_whfast_kepler_solver(const struct reb_simulation* const r, struct reb_p
     double Gs[6]; 
     double invperiod=0;  // only used for beta>0. Set to 0 only to suppress compiler warnings.
     double X_per_period = nan(""); // only used for beta>0. nan triggers Newton's method for beta<0.
+    double X_guess = 0.;  // second order guess, only used for beta>0.
         
     if (beta>0.){
         // Elliptic orbit
@@ -192,6 +198,11 @@ void reb_whfast_kepler_solver(const struct reb_simulation* const r, struct reb_p
         X = dtr0i * (1. - dtr0i*eta0*0.5*r0i); // second order guess
         //X = dtr0i *(1.- 0.5*dtr0i*r0i*(eta0-dtr0i*(eta0*eta0*r0i-1./3.*zeta0))); // third order guess
         //X = _dt*beta/M + eta0/M*(0.85*sqrt(1.+zeta0*zeta0/beta/eta0/eta0) - 1.);  // Dan's version 
+        X_guess = X;
+        if (kepler_guess){
+            // Warm start: correct by the relative error of the guess in the last step
+            X *= 1. + kepler_guess[i]*_dt*_dt;
+        }
     }else{
         // Hyperbolic orbit
         X = 0.; // Initial guess 
@@ -289,6 +300,12 @@ void reb_whfast_kepler_solver(const struct reb_simulation* const r, struct reb_p
         const double eta0Gs1zeta0Gs2 = eta0*Gs[1] + zeta0*Gs[2];
         ri = 1./(r0 + eta0Gs1zeta0Gs2);
     }
+    if (kepler_guess){
+        // Only small corrections are remembered. Large ones (e.g. timestep close to 
+        // the orbital period) would not be good predictors for the next step.
+        const double correction = X_guess!=0.?X/X_guess-1.:0.;
+        kepler_guess[i] = (_dt!=0. && fastabs(correction)<0.1)?correction/(_dt*_dt):0.;
+    }
     if (isnan(ri)){
         // Exception for (almost) straight line motion in hyperbolic case
         ri = 0.;
@@ -347,10 +364,226 @@ void reb_whfast_kepler_solver(const struct reb_simulation* const r, struct reb_p
 
 }
 
+/************************************
+ * Keplerian motion for a batch of 
+ * particles                        */
+
+#define WHFAST_BATCH 8      ///< Number of particles processed together by the batch Kepler solver
+
+// Same as stiefel_Gs3() for a batch of particles. The loops over the batch can be vectorized.
+// The range reduction of z is done for all particles in the batch but only applied where needed.
+// Only the first W<=WHFAST_BATCH slots are used. The results are identical to stiefel_Gs3().
+static inline void stiefel_Gs3_batch(double Gs[4][WHFAST_BATCH], const double* restrict beta, const double* restrict X, const int W){
+    double z[WHFAST_BATCH];
+    unsigned int n[WHFAST_BATCH];
+#pragma omp simd
+    for (int l=0;l<W;l++){
+        z[l] = beta[l]*(X[l]*X[l]);
+        n[l] = 0;
+    }
+    unsigned int nmaxred = 0;
+    while(1){
+        int reduce_any = 0;
+#pragma omp simd reduction(|:reduce_any)
+        for (int l=0;l<W;l++){
+            const int reduce = fabs(z[l])>0.1;
+            z[l] = reduce ? z[l]/4. : z[l];
+            n[l] += reduce;
+            reduce_any |= reduce;
+        }
+        if (!reduce_any){
+            break;
+        }
+        nmaxred++;
+    }
+    const int nmax = 13;
+#pragma omp simd
+    for (int l=0;l<W;l++){
+        double c_odd  = invfactorial[nmax];
+        double c_even = invfactorial[nmax-1];
+        for(int np=nmax-2;np>=3;np-=2){
+            c_odd  = invfactorial[np]    - z[l] *c_odd;
+            c_even = invfactorial[np-1]  - z[l] *c_even;
+        }
+        Gs[3][l] = c_odd;
+        Gs[2][l] = c_even;
+        Gs[1][l] = invfactorial[1]  - z[l] *c_odd;
+        Gs[0][l] = invfactorial[0]  - z[l] *c_even;
+    }
+    for (unsigned int k=0;k<nmaxred;k++){
+#pragma omp simd
+        for (int l=0;l<W;l++){
+            const double cs3 = (Gs[2][l]+Gs[0][l]*Gs[3][l])*0.25;
+            const double cs2 = Gs[1][l]*Gs[1][l]*0.5;
+            const double cs1 = Gs[0][l]*Gs[1][l];
+            const double cs0 = 2.*Gs[0][l]*Gs[0][l]-1.;
+            const int apply = k<n[l];
+            Gs[3][l] = apply ? cs3 : Gs[3][l];
+            Gs[2][l] = apply ? cs2 : Gs[2][l];
+            Gs[1][l] = apply ? cs1 : Gs[1][l];
+            Gs[0][l] = apply ? cs0 : Gs[0][l];
+        }
+    }
+#pragma omp simd
+    for (int l=0;l<W;l++){
+        const double X2 = X[l]*X[l];
+        Gs[1][l] *= X[l]; 
+        Gs[2][l] *= X2; 
+        Gs[3][l] *= X2*X[l];
+    }
+}
+
+// Solves Kepler's equation for the particles i0 to i0+N-1 (N<=WHFAST_BATCH) with the 
+// masses M[0] to M[N-1]. Variational particles are not supported.
+// This follows the Newton branch of reb_whfast_kepler_solver() for all particles 
+// in the batch at once. Each particle stops iterating once it has converged.
+// Particles which need the quartic solver, do not converge, or are on 
+// (almost) straight line orbits are passed on to reb_whfast_kepler_solver().
+// kepler_guess is used and updated in the same way as in reb_whfast_kepler_solver().
+// Only the first W slots of the batch are used (N<=W<=WHFAST_BATCH).
+static inline void reb_whfast_kepler_solver_batch_width(const struct reb_simulation* const r, struct reb_particle* const restrict p_j, const double* const M, const unsigned int i0, const unsigned int N, const double _dt, double* const restrict kepler_guess, const int W){
+    double x[WHFAST_BATCH], y[WHFAST_BATCH], z[WHFAST_BATCH];
+    double vx[WHFAST_BATCH], vy[WHFAST_BATCH], vz[WHFAST_BATCH];
+    double _M[WHFAST_BATCH];
+    double guess[WHFAST_BATCH];
+    for (int l=0;l<W;l++){
+        // Unused slots are filled with copies of the first particle. Their results are discarded.
+        const unsigned int i = i0 + ((unsigned int)l<N?(unsigned int)l:0);
+        x[l]  = p_j[i].x;  y[l]  = p_j[i].y;  z[l]  = p_j[i].z;
+        vx[l] = p_j[i].vx; vy[l] = p_j[i].vy; vz[l] = p_j[i].vz;
+        _M[l] = M[(unsigned int)l<N?l:0];
+        guess[l] = kepler_guess?kepler_guess[i]:0.;
+    }
+
+    double r0[WHFAST_BATCH], r0i[WHFAST_BATCH], beta[WHFAST_BATCH], eta0[WHFAST_BATCH], zeta0[WHFAST_BATCH];
+    double X[WHFAST_BATCH], X_guess[WHFAST_BATCH], oldX[WHFAST_BATCH], oldX2[WHFAST_BATCH], ri[WHFAST_BATCH];
+    double Gs[4][WHFAST_BATCH];
+    double Gsn[4][WHFAST_BATCH];
+    int active[WHFAST_BATCH];
+    int fallback[WHFAST_BATCH];
+    int warning = 0;
+#pragma omp simd reduction(|:warning)
+    for (int l=0;l<W;l++){
+        r0[l] = sqrt(x[l]*x[l] + y[l]*y[l] + z[l]*z[l]);
+        r0i[l] = 1./r0[l];
+        const double v2 = vx[l]*vx[l] + vy[l]*vy[l] + vz[l]*vz[l];
+        beta[l] = 2.*_M[l]*r0i[l] - v2;
+        eta0[l] = x[l]*vx[l] + y[l]*vy[l] + z[l]*vz[l];
+        zeta0[l] = _M[l] - beta[l]*r0[l];
+        const int elliptic = beta[l]>0.;
+        const double sqrt_beta = sqrt(fabs(beta[l]));
+        const double invperiod = sqrt_beta*beta[l]/(2.*M_PI*_M[l]);
+        warning |= elliptic && fabs(_dt)*invperiod>1.;
+        const double dtr0i = _dt*r0i[l];
+        X_guess[l] = elliptic ? dtr0i * (1. - dtr0i*eta0[l]*0.5*r0i[l]) : 0.;
+        X[l] = X_guess[l]*(1. + guess[l]*_dt*_dt);
+        oldX[l] = X[l];
+    }
+    if (warning && r->ri_whfast.timestep_warning == 0){
+        ((struct reb_simulation* const)r)->ri_whfast.timestep_warning++;
+        reb_warning((struct reb_simulation* const)r,"WHFast convergence issue. Timestep is larger than at least one orbital period.");
+    }
+
+    // Do one Newton step and choose the solver as in reb_whfast_kepler_solver()
+    stiefel_Gs3_batch(Gs, beta, X, W);
+#pragma omp simd
+    for (int l=0;l<W;l++){
+        const double eta0Gs1zeta0Gs2 = eta0[l]*Gs[1][l] + zeta0[l]*Gs[2][l];
+        ri[l] = 1./(r0[l] + eta0Gs1zeta0Gs2);
+        X[l]  = ri[l]*(X[l]*eta0Gs1zeta0Gs2-eta0[l]*Gs[2][l]-zeta0[l]*Gs[3][l]+_dt);
+        const double X_per_period = 2.*M_PI/sqrt(beta[l]); // nan for hyperbolic orbits
+        fallback[l] = fabs(X[l]-oldX[l]) > 0.01*X_per_period;
+        active[l] = !fallback[l];
+        oldX2[l] = nan("");
+    }
+
+    // Newton's method
+    for (int n_hg=1;n_hg<WHFAST_NMAX_NEWT;n_hg++){
+        stiefel_Gs3_batch(Gsn, beta, X, W);
+        int any_active = 0;
+#pragma omp simd reduction(|:any_active)
+        for (int l=0;l<W;l++){
+            const double eta0Gs1zeta0Gs2 = eta0[l]*Gsn[1][l] + zeta0[l]*Gsn[2][l];
+            const double rin = 1./(r0[l] + eta0Gs1zeta0Gs2);
+            const double Xn  = rin*(X[l]*eta0Gs1zeta0Gs2-eta0[l]*Gsn[2][l]-zeta0[l]*Gsn[3][l]+_dt);
+            const int a = active[l];
+            const int converged = a && (Xn==X[l] || Xn==oldX[l]);
+            oldX2[l] = a ? oldX[l] : oldX2[l];
+            oldX[l] = a ? X[l] : oldX[l];
+            X[l] = a ? Xn : X[l];
+            ri[l] = a ? rin : ri[l];
+            Gs[1][l] = a ? Gsn[1][l] : Gs[1][l];
+            Gs[2][l] = a ? Gsn[2][l] : Gs[2][l];
+            Gs[3][l] = a ? Gsn[3][l] : Gs[3][l];
+            active[l] = a && !converged;
+            any_active |= active[l];
+        }
+        if (!any_active){
+            break;
+        }
+    }
+
+#pragma omp simd
+    for (int l=0;l<W;l++){
+        // Particles which have not converged or are on (almost) straight line orbits use the scalar solver.
+        fallback[l] = fallback[l] || active[l] || isnan(ri[l]);
+        // Note: These are not the traditional f and g functions.
+        const double f = -_M[l]*Gs[2][l]*r0i[l];
+        const double g = _dt - _M[l]*Gs[3][l];
+        const double fd = -_M[l]*Gs[1][l]*r0i[l]*ri[l]; 
+        const double gd = -_M[l]*Gs[2][l]*ri[l]; 
+        const double x1 = x[l], y1 = y[l], z1 = z[l];
+        x[l] += f*x1 + g*vx[l];
+        y[l] += f*y1 + g*vy[l];
+        z[l] += f*z1 + g*vz[l];
+        vx[l] += fd*x1 + gd*vx[l];
+        vy[l] += fd*y1 + gd*vy[l];
+        vz[l] += fd*z1 + gd*vz[l];
+        const double correction = X_guess[l]!=0.?X[l]/X_guess[l]-1.:0.;
+        guess[l] = (_dt!=0. && fabs(correction)<0.1)?correction/(_dt*_dt):0.;
+    }
+
+    // N<=W. The explicit bound lets the compiler see that only initialized slots are read.
+    const unsigned int N_used = N<(unsigned int)W?N:(unsigned int)W;
+    for (unsigned int l=0;l<N_used;l++){
+        const unsigned int i = i0 + l;
+        if (fallback[l]){
+            reb_whfast_kepler_solver(r, p_j, M[l], i, _dt, kepler_guess);
+        }else{
+            p_j[i].x  = x[l];  p_j[i].y  = y[l];  p_j[i].z  = z[l];
+            p_j[i].vx = vx[l]; p_j[i].vy = vy[l]; p_j[i].vz = vz[l];
+            if (kepler_guess){
+                kepler_guess[i] = guess[l];
+            }
+        }
+    }
+}
+
+// Small systems, for example 3 to 10 planets, only fill part of a batch. The width of the 
+// batch is therefore chosen from N. It is a constant in each call below, so the compiler 
+// generates one version with fixed loop lengths for every width. The slots are independent, 
+// so the results do not depend on the width.
+static void reb_whfast_kepler_solver_batch(const struct reb_simulation* const r, struct reb_particle* const restrict p_j, const double* const M, const unsigned int i0, const unsigned int N, const double _dt, double* const restrict kepler_guess){
+    if (N<=2){
+        reb_whfast_kepler_solver_batch_width(r, p_j, M, i0, N, _dt, kepler_guess, 2);
+    }else if (N<=4){
+        reb_whfast_kepler_solver_batch_width(r, p_j, M, i0, N, _dt, kepler_guess, 4);
+    }else{
+        reb_whfast_kepler_solver_batch_width(r, p_j, M, i0, N, _dt, kepler_guess, WHFAST_BATCH);
+    }
+}
+
 /***************************** 
  * Interaction Hamiltonian  */
+// Number of particles the Kepler, jump and interaction operators act on.
+// While the test particles are deferred to the partitioned step, only the massive bodies are evolved.
+static inline unsigned int reb_whfast_N_evolved(const struct reb_simulation* const r){
+    return r->ri_whfast.testparticles_deferred?(unsigned int)r->N_active:(unsigned int)(r->N-r->N_var);
+}
+
 void reb_whfast_interaction_step(struct reb_simulation* const r, const double _dt){
-    const unsigned int N_real = r->N-r->N_var;
+    reb_profiling_start(r, REB_PROFILING_INTERACTION);
+    const unsigned int N_real = reb_whfast_N_evolved(r);
     const int N_active = (r->N_active==-1 || r->testparticle_type ==1)?N_real:r->N_active;
     const double G = r->G;
     struct reb_particle* particles = r->particles;
@@ -432,20 +665,18 @@ void reb_whfast_interaction_step(struct reb_simulation* const r, const double _d
             }
             break;
     };
+    reb_profiling_stop(r, REB_PROFILING_INTERACTION);
 }
-void reb_whfast_jump_step(const struct reb_simulation* const r, const double _dt){
-    const struct reb_simulation_integrator_whfast* const ri_whfast = &(r->ri_whfast);
-    struct reb_particle* const p_h = r->ri_whfast.p_jh;
+// Momentum of the massive bodies which shifts the positions in the jump step.
+// For democratic heliocentric coordinates this is the velocity of the central object (px/m0).
+static struct reb_vec3d reb_whfast_jump_momentum(const struct reb_simulation* const r){
+    const struct reb_particle* const p_h = r->ri_whfast.p_jh;
     const int N_real = r->N - r->N_var;
     const int N_active = (r->N_active==-1 || r->testparticle_type ==1)?N_real:r->N_active;
     const double m0 = r->particles[0].m;
-    switch (ri_whfast->coordinates){
-        case REB_WHFAST_COORDINATES_JACOBI:
-            // Nothing to be done.
-            break;
+    double px=0, py=0, pz=0;
+    switch (r->ri_whfast.coordinates){
         case REB_WHFAST_COORDINATES_DEMOCRATICHELIOCENTRIC:
-            {
-            double px=0, py=0, pz=0;
 #pragma omp parallel for reduction (+:px), reduction (+:py), reduction (+:pz)
             for(int i=1;i<N_active;i++){
                 const double m = r->particles[i].m;
@@ -453,53 +684,113 @@ void reb_whfast_jump_step(const struct reb_simulation* const r, const double _dt
                 py += m * p_h[i].vy;
                 pz += m * p_h[i].vz;
             }
-#pragma omp parallel for 
-            for(int i=1;i<N_real;i++){
-                p_h[i].x += _dt * (px/m0);
-                p_h[i].y += _dt * (py/m0);
-                p_h[i].z += _dt * (pz/m0);
-            }
-            }
-            break;
+            return (struct reb_vec3d){.x = px/m0, .y = py/m0, .z = pz/m0};
         case REB_WHFAST_COORDINATES_WHDS:
-            {
-            double px=0, py=0, pz=0;
 #pragma omp parallel for reduction (+:px), reduction (+:py), reduction (+:pz)
             for(int i=1;i<N_active;i++){
                 const double m = r->particles[i].m;
                 px += m * p_h[i].vx / (m0+m);
                 py += m * p_h[i].vy / (m0+m);
                 pz += m * p_h[i].vz / (m0+m);
-             }
+            }
+            return (struct reb_vec3d){.x = px, .y = py, .z = pz};
+        default:
+            return (struct reb_vec3d){0};
+    }
+}
+
+void reb_whfast_jump_step(const struct reb_simulation* const r, const double _dt){
+    reb_profiling_start(r, REB_PROFILING_JUMP);
+    const struct reb_simulation_integrator_whfast* const ri_whfast = &(r->ri_whfast);
+    struct reb_particle* const p_h = r->ri_whfast.p_jh;
+    const int N_real = reb_whfast_N_evolved(r);
+    const int N_active = (r->N_active==-1 || r->testparticle_type ==1)?N_real:r->N_active;
+    const double m0 = r->particles[0].m;
+    switch (ri_whfast->coordinates){
+        case REB_WHFAST_COORDINATES_JACOBI:
+            // Nothing to be done.
+            break;
+        case REB_WHFAST_COORDINATES_DEMOCRATICHELIOCENTRIC:
+            {
+            const struct reb_vec3d v0 = reb_whfast_jump_momentum(r);
+#pragma omp parallel for 
+            for(int i=1;i<N_real;i++){
+                p_h[i].x += _dt * v0.x;
+                p_h[i].y += _dt * v0.y;
+                p_h[i].z += _dt * v0.z;
+            }
+            }
+            break;
+        case REB_WHFAST_COORDINATES_WHDS:
+            {
+            const struct reb_vec3d P = reb_whfast_jump_momentum(r);
 #pragma omp parallel for 
             for(int i=1;i<N_active;i++){
                 const double m = r->particles[i].m;
-                p_h[i].x += _dt * (px - (m * p_h[i].vx / (m0+m)) );
-                p_h[i].y += _dt * (py - (m * p_h[i].vy / (m0+m)) );
-                p_h[i].z += _dt * (pz - (m * p_h[i].vz / (m0+m)) );
+                p_h[i].x += _dt * (P.x - (m * p_h[i].vx / (m0+m)) );
+                p_h[i].y += _dt * (P.y - (m * p_h[i].vy / (m0+m)) );
+                p_h[i].z += _dt * (P.z - (m * p_h[i].vz / (m0+m)) );
             }
 #pragma omp parallel for 
             for(int i=N_active;i<N_real;i++){
-                p_h[i].x += _dt * px;
-                p_h[i].y += _dt * py;
-                p_h[i].z += _dt * pz;
+                p_h[i].x += _dt * P.x;
+                p_h[i].y += _dt * P.y;
+                p_h[i].z += _dt * P.z;
             }
             }
             break;
     };
+    reb_profiling_stop(r, REB_PROFILING_JUMP);
 }
 
 /***************************** 
  * DKD Scheme                */
 
 void reb_whfast_kepler_step(const struct reb_simulation* const r, const double _dt){
+    reb_profiling_start(r, REB_PROFILING_KEPLER);
     const double m0 = r->particles[0].m;
     const double G = r->G;
-    const unsigned int N_real = r->N-r->N_var;
+    const unsigned int N_real = reb_whfast_N_evolved(r);
     const int N_active = (r->N_active==-1 || r->testparticle_type ==1)?N_real:r->N_active;
     const int coordinates = r->ri_whfast.coordinates;
     struct reb_particle* const p_j = r->ri_whfast.p_jh;
+    double* const kepler_guess = r->ri_whfast.kepler_guess;
     double eta = m0;
+    if (r->var_config_N==0){
+        // Process particles in batches. Active particles and test particles are never in the same batch.
+        const unsigned int N_massive = MIN(MAX(N_active,1),N_real);
+        // Active particles. These are done in order because the Jacobi masses are cumulative.
+        for (unsigned int i0=1;i0<N_massive;i0+=WHFAST_BATCH){
+            const unsigned int N = MIN(WHFAST_BATCH, N_massive-i0);
+            double M[WHFAST_BATCH];
+            for (unsigned int l=0;l<N;l++){
+                switch (coordinates){
+                    case REB_WHFAST_COORDINATES_JACOBI:
+                        eta += p_j[i0+l].m;
+                        M[l] = eta*G;
+                        break;
+                    case REB_WHFAST_COORDINATES_DEMOCRATICHELIOCENTRIC:
+                        M[l] = m0*G;
+                        break;
+                    case REB_WHFAST_COORDINATES_WHDS:
+                        M[l] = (m0+p_j[i0+l].m)*G;
+                        break;
+                }
+            }
+            reb_whfast_kepler_solver_batch(r, p_j, M, i0, N, _dt, kepler_guess);
+        }
+        // Test particles all use the same mass. 
+        double M[WHFAST_BATCH];
+        for (unsigned int l=0;l<WHFAST_BATCH;l++){
+            M[l] = (coordinates==REB_WHFAST_COORDINATES_JACOBI?eta:m0)*G;
+        }
+#pragma omp parallel for 
+        for (unsigned int i0=N_massive;i0<N_real;i0+=WHFAST_BATCH){
+            reb_whfast_kepler_solver_batch(r, p_j, M, i0, MIN(WHFAST_BATCH, N_real-i0), _dt, kepler_guess);
+        }
+        reb_profiling_stop(r, REB_PROFILING_KEPLER);
+        return;
+    }
     switch (coordinates){
         case REB_WHFAST_COORDINATES_JACOBI:
 #pragma omp parallel for 
@@ -507,13 +798,13 @@ void reb_whfast_kepler_step(const struct reb_simulation* const r, const double _
                 if (i<N_active){
                     eta += p_j[i].m;
                 }
-                reb_whfast_kepler_solver(r, p_j, eta*G, i, _dt);
+                reb_whfast_kepler_solver(r, p_j, eta*G, i, _dt, kepler_guess);
             }
             break;
         case REB_WHFAST_COORDINATES_DEMOCRATICHELIOCENTRIC:
 #pragma omp parallel for 
             for (unsigned int i=1;i<N_real;i++){
-                reb_whfast_kepler_solver(r, p_j, eta*G, i, _dt); //  eta = m0
+                reb_whfast_kepler_solver(r, p_j, eta*G, i, _dt, kepler_guess); //  eta = m0
             }
             break;
         case REB_WHFAST_COORDINATES_WHDS:
@@ -524,10 +815,11 @@ void reb_whfast_kepler_step(const struct reb_simulation* const r, const double _
                 }else{
                     eta = m0;
                 }
-                reb_whfast_kepler_solver(r, p_j, eta*G, i, _dt);
+                reb_whfast_kepler_solver(r, p_j, eta*G, i, _dt, kepler_guess);
             }
             break;
     };
+    reb_profiling_stop(r, REB_PROFILING_KEPLER);
 }
 
 void reb_whfast_com_step(const struct reb_simulation* const r, const double _dt){
@@ -799,14 +1091,25 @@ int reb_integrator_whfast_init(struct reb_simulation* const r){
     }
     const int N = r->N;
     if (ri_whfast->allocated_N != N){
+        ri_whfast->p_jh = reb_tools_realloc_aligned(ri_whfast->p_jh, sizeof(struct reb_particle), ri_whfast->allocated_N, N);
+        // Particles might have been added or removed. The Kepler solver starts without a correction.
+        free(ri_whfast->kepler_guess);
+        ri_whfast->kepler_guess = NULL;
         ri_whfast->allocated_N = N;
-        ri_whfast->p_jh = realloc(ri_whfast->p_jh,sizeof(struct reb_particle)*N);
         ri_whfast->recalculate_coordinates_this_timestep = 1;
     }
+    if (ri_whfast->kepler_warmstart && ri_whfast->kepler_guess==NULL){
+        ri_whfast->kepler_guess = calloc(N, sizeof(double));
+    }
+    if (!ri_whfast->kepler_warmstart && ri_whfast->kepler_guess){
+        free(ri_whfast->kepler_guess);
+        ri_whfast->kepler_guess = NULL;
+    }
     return 0;
 }
 
 void reb_integrator_whfast_from_inertial(struct reb_simulation* const r){
+    reb_profiling_start(r, REB_PROFILING_COORDINATES);
     struct reb_simulation_integrator_whfast* const ri_whfast = &(r->ri_whfast);
     struct reb_particle* restrict const particles = r->particles;
     const int N = r->N;
@@ -828,13 +1131,14 @@ void reb_integrator_whfast_from_inertial(struct reb_simulation* const r){
             reb_transformations_inertial_to_whds_posvel(particles, ri_whfast->p_jh, N_real, N_active);
             break;
     };
+    reb_profiling_stop(r, REB_PROFILING_COORDINATES);
 }
 
 void reb_integrator_whfast_to_inertial(struct reb_simulation* const r){
+    reb_profiling_start(r, REB_PROFILING_COORDINATES);
     struct reb_simulation_integrator_whfast* const ri_whfast = &(r->ri_whfast);
     struct reb_particle* restrict const particles = r->particles;
-    const int N = r->N;
-    const int N_real = N-r->N_var;
+    const int N_real = reb_whfast_N_evolved(r);
     const int N_active = (r->N_active==-1 || r->testparticle_type==1)?N_real:r->N_active;
     
     // Prepare coordinates for KICK step
@@ -863,6 +1167,7 @@ void reb_integrator_whfast_to_inertial(struct reb_simulation* const r){
                 break;
         };
     }
+    reb_profiling_stop(r, REB_PROFILING_COORDINATES);
 }
 
 void reb_integrator_whfast_debug_operator_kepler(struct reb_simulation* const r,double dt){
@@ -888,6 +1193,101 @@ void reb_integrator_whfast_debug_operator_interaction(struct reb_simulation* con
     reb_integrator_whfast_to_inertial(r);
 }
 
+// Returns 1 if the test particles can be integrated in partitions this timestep.
+// Turns the partitions off with a warning if the simulation setup does not allow them.
+static int reb_whfast_testparticle_partitions_enabled(struct reb_simulation* const r){
+    struct reb_simulation_integrator_whfast* const ri_whfast = &(r->ri_whfast);
+    if (ri_whfast->testparticle_partitions==0){
+        return 0;
+    }
+    if ((ri_whfast->coordinates!=REB_WHFAST_COORDINATES_DEMOCRATICHELIOCENTRIC && ri_whfast->coordinates!=REB_WHFAST_COORDINATES_WHDS)
+            || ri_whfast->kernel!=REB_WHFAST_KERNEL_DEFAULT
+            || r->var_config_N>0
+            || r->testparticle_type!=0
+            || r->gravity!=REB_GRAVITY_BASIC
+            || r->additional_forces
+            || r->nghostx || r->nghosty || r->nghostz){
+        reb_warning(r, "Test particle partitions require democratic heliocentric or WHDS coordinates, the default kernel, BASIC gravity, no variational particles, no additional forces, no ghost boxes, and testparticle_type=0. Turning them off.");
+        ri_whfast->testparticle_partitions = 0;
+        return 0;
+    }
+    const int N_real = r->N-r->N_var;
+    return r->N_active>0 && r->N_active<N_real;
+}
+
+// Advances all test particles by one timestep in a single pass. The test particles are split
+// into testparticle_partitions contiguous partitions, each of which is processed by one thread.
+// The massive bodies have already been advanced and are only read. P1 and P2 are the jump
+// momenta before and after the massive bodies are kicked. The operators are applied in the 
+// same order and with the same expressions as in the unpartitioned scheme.
+static void reb_whfast_testparticle_partitions_step(struct reb_simulation* const r, const struct reb_vec3d P1, const struct reb_vec3d P2){
+    const struct reb_simulation_integrator_whfast* const ri_whfast = &(r->ri_whfast);
+    const struct reb_particle* const p_massive = r->particles;
+    struct reb_particle* const particles = r->particles;
+    struct reb_particle* const p_h = ri_whfast->p_jh;
+    const int N_active = r->N_active;
+    const int N_real = r->N-r->N_var;
+    const unsigned int P = ri_whfast->testparticle_partitions;
+    const double dt = r->dt;
+    const double dt_drift = ri_whfast->testparticles_deferred==1?dt/2.:dt;
+    const double G = r->G;
+    const double softening2 = r->softening*r->softening;
+    const struct reb_vec3d x0 = {.x = particles[0].x, .y = particles[0].y, .z = particles[0].z};
+    const struct reb_vec3d v0 = {.x = p_h[0].vx, .y = p_h[0].vy, .z = p_h[0].vz};
+    double M[WHFAST_BATCH];
+    for (unsigned int l=0;l<WHFAST_BATCH;l++){
+        M[l] = particles[0].m*G;
+    }
+    // Partition boundaries are aligned with the batches of the Kepler solver.
+    const int batches = (N_real-N_active+WHFAST_BATCH-1)/WHFAST_BATCH;
+#pragma omp parallel for schedule(static)
+    for (unsigned int p=0;p<P;p++){
+        const int i_start = N_active + (int)(((long)batches*p)/P)*WHFAST_BATCH;
+        const int i_end = MIN(N_real, N_active + (int)(((long)batches*(p+1))/P)*WHFAST_BATCH);
+        for (int i0=i_start;i0<i_end;i0+=WHFAST_BATCH){
+            const int n = MIN(WHFAST_BATCH, i_end-i0);
+            reb_whfast_kepler_solver_batch(r, p_h, M, i0, n, dt_drift, ri_whfast->kepler_guess);
+            for (int i=i0;i<i0+n;i++){
+                p_h[i].x += dt/2. * P1.x;
+                p_h[i].y += dt/2. * P1.y;
+                p_h[i].z += dt/2. * P1.z;
+                const double x = p_h[i].x+x0.x;
+                const double y = p_h[i].y+x0.y;
+                const double z = p_h[i].z+x0.z;
+                particles[i].x = x;
+                particles[i].y = y;
+                particles[i].z = z;
+                particles[i].vx = p_h[i].vx+v0.x;
+                particles[i].vy = p_h[i].vy+v0.y;
+                particles[i].vz = p_h[i].vz+v0.z;
+                double ax = 0.;
+                double ay = 0.;
+                double az = 0.;
+                for (int j=1; j<N_active; j++){
+                    const double dx = x - p_massive[j].x;
+                    const double dy = y - p_massive[j].y;
+                    const double dz = z - p_massive[j].z;
+                    const double _r = sqrt(dx*dx + dy*dy + dz*dz + softening2);
+                    const double prefact = G/(_r*_r*_r);
+                    const double prefactj = -prefact*p_massive[j].m;
+                    ax += prefactj*dx;
+                    ay += prefactj*dy;
+                    az += prefactj*dz;
+                }
+                particles[i].ax = ax;
+                particles[i].ay = ay;
+                particles[i].az = az;
+                p_h[i].vx += dt*ax;
+                p_h[i].vy += dt*ay;
+                p_h[i].vz += dt*az;
+                p_h[i].x += dt/2. * P2.x;
+                p_h[i].y += dt/2. * P2.y;
+                p_h[i].z += dt/2. * P2.z;
+            }
+        }
+    }
+}
+
 void reb_integrator_whfast_part1(struct reb_simulation* const r){
     struct reb_simulation_integrator_whfast* const ri_whfast = &(r->ri_whfast);
     struct reb_particle* restrict const particles = r->particles;
@@ -911,6 +1311,10 @@ void reb_integrator_whfast_part1(struct reb_simulation* const r){
         reb_integrator_whfast_from_inertial(r);
         ri_whfast->recalculate_coordinates_this_timestep = 0;
     }
+    if (reb_whfast_testparticle_partitions_enabled(r)){
+        // Only the massive bodies are evolved until the partitioned step in part2.
+        ri_whfast->testparticles_deferred = ri_whfast->is_synchronized?1:2;
+    }
     if (ri_whfast->is_synchronized){
         // First half DRIFT step
         if (ri_whfast->corrector){
@@ -969,9 +1373,12 @@ void reb_integrator_whfast_synchronize(struct reb_simulation* const r){
         const int N_real = r->N-r->N_var;
         const int N_active = (r->N_active==-1 || r->testparticle_type==1)?N_real:r->N_active;
         struct reb_particle* sync_pj  = NULL;
+        double* sync_guess = NULL;
         if (ri_whfast->keep_unsynchronized){
             sync_pj = malloc(sizeof(struct reb_particle)*r->N);
             memcpy(sync_pj,r->ri_whfast.p_jh,r->N*sizeof(struct reb_particle));
+            // The Kepler solver corrections are also reverted, so that synchronizing does not change the trajectory.
+            sync_guess = reb_tools_copy_aligned(r->ri_whfast.kepler_guess, sizeof(double), r->N);
         }
         switch (ri_whfast->kernel){
             case REB_WHFAST_KERNEL_DEFAULT: 
@@ -1012,6 +1419,10 @@ void reb_integrator_whfast_synchronize(struct reb_simulation* const r){
         if (ri_whfast->keep_unsynchronized){
             memcpy(r->ri_whfast.p_jh,sync_pj,r->N*sizeof(struct reb_particle));
             free(sync_pj);
+            if (sync_guess){
+                memcpy(r->ri_whfast.kepler_guess,sync_guess,r->N*sizeof(double));
+                free(sync_guess);
+            }
         }else{
             ri_whfast->is_synchronized = 1;
         }
@@ -1034,6 +1445,15 @@ void reb_integrator_whfast_part2(struct reb_simulation* const r){
     
     switch (ri_whfast->kernel){
         case REB_WHFAST_KERNEL_DEFAULT: 
+            if (ri_whfast->testparticles_deferred){
+                const struct reb_vec3d P1 = reb_whfast_jump_momentum(r);
+                reb_whfast_interaction_step(r, dt);
+                const struct reb_vec3d P2 = reb_whfast_jump_momentum(r);
+                reb_whfast_jump_step(r,dt/2.);
+                reb_whfast_testparticle_partitions_step(r, P1, P2);
+                ri_whfast->testparticles_deferred = 0;
+                break;
+            }
             reb_whfast_interaction_step(r, dt);
 
             reb_whfast_jump_step(r,dt/2.);
@@ -1218,6 +1638,9 @@ void reb_integrator_whfast_reset(struct reb_simulation* const r){
     ri_whfast->allocated_Ntemp = 0;
     ri_whfast->timestep_warning = 0;
     ri_whfast->recalculate_coordinates_but_not_synchronized_warning = 0;
+    ri_whfast->testparticle_partitions = 0;
+    ri_whfast->testparticles_deferred = 0;
+    ri_whfast->kepler_warmstart = 0;
     if (ri_whfast->p_jh){
         free(ri_whfast->p_jh);
         ri_whfast->p_jh = NULL;
@@ -1226,4 +1649,8 @@ void reb_integrator_whfast_reset(struct reb_simulation* const r){
         free(ri_whfast->p_temp);
         ri_whfast->p_temp = NULL;
     }
+    if (ri_whfast->kepler_guess){
+        free(ri_whfast->kepler_guess);
+        ri_whfast->kepler_guess = NULL;
+    }
 }
@@ -30,7 +30,7 @@
 void reb_integrator_whfast_part1(struct reb_simulation* r);		///< Internal function used to call a specific integrator
 void reb_integrator_whfast_part2(struct reb_simulation* r);		///< Internal function used to call a specific integrator
 void reb_integrator_whfast_synchronize(struct reb_simulation* r);	///< Internal function used to call a specific integrator
-void reb_whfast_kepler_solver(const struct reb_simulation* const r, struct reb_particle* const restrict p_j, const double M, unsigned int i, double _dt);   ///< Internal function (Main WHFast Kepler Solver)
+void reb_whfast_kepler_solver(const struct reb_simulation* const r, struct reb_particle* const restrict p_j, const double M, unsigned int i, double _dt, double* const restrict kepler_guess);   ///< Internal function (Main WHFast Kepler Solver)
 void reb_whfast_calculate_jerk(struct reb_simulation* r);       ///< Calculates "jerk" term
 int reb_integrator_whfast_init(struct reb_simulation* r);       ///< Init routine (also used by WHFast512)
 
@@ -42,6 +42,60 @@
 #include "integrator_whfast.h"
 #include "integrator_whfast512.h"
 
+// Checks if all assumptions are satisfied and allocates memory.
+// Returns 1 on success, 0 otherwise.
+static int reb_whfast512_allocate(struct reb_simulation* const r){
+    struct reb_simulation_integrator_whfast512* const ri_whfast512 = &(r->ri_whfast512);
+    // Check if all assumptions are satisfied.
+    // Note: These are not checked every timestep. 
+    // So it is possible for the user to screw things up.
+    if (r->dt<=0.0){
+        reb_error(r, "WHFast512 does not support negative timesteps. To integrate backwards, flip the sign of the velocities.");
+        r->status = REB_EXIT_ERROR;
+        return 0;
+    }
+    if (r->N_var!=0){
+        reb_error(r, "WHFast512 does not support variational particles.");
+        r->status = REB_EXIT_ERROR;
+        return 0;
+    }
+    if (r->exact_finish_time!=0){
+        reb_error(r, "WHFast512 requires exact_finish_time=0.");
+        r->status = REB_EXIT_ERROR;
+        return 0;
+    }
+    const int N_active = (r->N_active==-1)?r->N:r->N_active;
+    if (N_active>9){
+        reb_error(r, "WHFast512 supports a maximum of 9 massive particles.");
+        r->status = REB_EXIT_ERROR;
+        return 0;
+    }
+    if (r->G!=1.0){
+        reb_error(r, "WHFast512 requires units in which G=1. Please rescale your system.");
+        r->status = REB_EXIT_ERROR;
+        return 0;
+    }
+    if (N_active!=r->N && r->testparticle_type!=0){
+        reb_error(r, "WHFast512 only supports test particles with testparticle_type=0.");
+        r->status = REB_EXIT_ERROR;
+        return 0;
+    }
+    ri_whfast512->p_jh = aligned_alloc(64,sizeof(struct reb_particle_avx512));
+    ri_whfast512->allocated_N_testparticles = r->N - N_active;
+    if (ri_whfast512->allocated_N_testparticles){
+        ri_whfast512->p_jh_tp = aligned_alloc(64,sizeof(struct reb_particle_avx512)*((ri_whfast512->allocated_N_testparticles+7)/8));
+    }
+    if (!ri_whfast512->p_jh || (ri_whfast512->allocated_N_testparticles && !ri_whfast512->p_jh_tp)){
+        reb_error(r, "WHFast512 was not able to allocate memory.");
+        r->status = REB_EXIT_ERROR;
+        return 0;
+    }
+    ri_whfast512->allocated_N=1;
+    ri_whfast512->recalculate_constants = 1;
+    r->gravity = REB_GRAVITY_NONE; // WHFast512 uses its own gravity routine.
+    return 1;
+}
+
 #ifdef AVX512
 
 #ifdef PROF
@@ -117,14 +171,8 @@ static void inline mm_stiefel_Gs03_avx512(__m512d * Gs0, __m512d * Gs1, __m512d
     *Gs2 = _mm512_mul_pd(*Gs2,X2); 
 };
 
-// Performs one full Kepler step
-static void inline reb_whfast512_kepler_step(const struct reb_simulation* const r, const double dt){
-#ifdef PROF
-    struct timeval time_beginning;
-    gettimeofday(&time_beginning,NULL);
-#endif
-    struct reb_particle_avx512 * restrict p512  = r->ri_whfast512.p_jh;
-    __m512d _dt = _mm512_set1_pd(dt); 
+// Performs one full Kepler step for a group of 8 particles orbiting a central mass M
+static void inline reb_whfast512_kepler_step_group(struct reb_particle_avx512 * restrict p512, const __m512d _dt, const __m512d M){
         
     __m512d r2 = _mm512_mul_pd(p512->x, p512->x);
     r2 = _mm512_fmadd_pd(p512->y, p512->y, r2);
@@ -136,14 +184,14 @@ static void inline reb_whfast512_kepler_step(const struct reb_simulation* const
     v2 = _mm512_fmadd_pd(p512->vy, p512->vy, v2);
     v2 = _mm512_fmadd_pd(p512->vz, p512->vz, v2);
     
-    __m512d beta = _mm512_mul_pd(two, _M);
+    __m512d beta = _mm512_mul_pd(two, M);
     beta = _mm512_fmsub_pd(beta, r0i, v2);
 
     __m512d eta0 = _mm512_mul_pd(p512->x, p512->vx);
     eta0 = _mm512_fmadd_pd(p512->y, p512->vy, eta0);
     eta0 = _mm512_fmadd_pd(p512->z, p512->vz, eta0);
 
-    __m512d zeta0 = _mm512_fnmadd_pd(beta, r0, _M);
+    __m512d zeta0 = _mm512_fnmadd_pd(beta, r0, M);
 
     __m512d Gs1;
     __m512d Gs2;
@@ -211,16 +259,16 @@ static void inline reb_whfast512_kepler_step(const struct reb_simulation* const
 
     // f and g function
 
-    __m512d nf = _mm512_mul_pd(_M,Gs2); //negative f
+    __m512d nf = _mm512_mul_pd(M,Gs2); //negative f
     nf = _mm512_mul_pd(nf,r0i); 
 
-    __m512d g = _mm512_fnmadd_pd(_M, Gs3, _dt);
+    __m512d g = _mm512_fnmadd_pd(M, Gs3, _dt);
 
-    __m512d nfd = _mm512_mul_pd(_M, Gs1); // negative fd
+    __m512d nfd = _mm512_mul_pd(M, Gs1); // negative fd
     nfd = _mm512_mul_pd(nfd, r0i);
     nfd = _mm512_mul_pd(nfd, ri);
 
-    __m512d ngd = _mm512_mul_pd(_M, Gs2); // negative gd
+    __m512d ngd = _mm512_mul_pd(M, Gs2); // negative gd
     ngd = _mm512_mul_pd(ngd, ri);
 
     __m512d nx = _mm512_fnmadd_pd(nf, p512->x, p512->x);
@@ -240,6 +288,22 @@ static void inline reb_whfast512_kepler_step(const struct reb_simulation* const
     p512->x = nx;
     p512->y = ny;
     p512->z = nz;
+}
+
+// Performs one full Kepler step for the planets and all test particles
+static void reb_whfast512_kepler_step(const struct reb_simulation* const r, const double dt){
+#ifdef PROF
+    struct timeval time_beginning;
+    gettimeofday(&time_beginning,NULL);
+#endif
+    struct reb_particle_avx512* const p_jh_tp = r->ri_whfast512.p_jh_tp;
+    const int N_groups = (r->ri_whfast512.allocated_N_testparticles+7)/8;
+    __m512d _dt = _mm512_set1_pd(dt); 
+    reb_whfast512_kepler_step_group(r->ri_whfast512.p_jh, _dt, _M);
+#pragma omp parallel for
+    for (int g=0; g<N_groups; g++){
+        reb_whfast512_kepler_step_group(&p_jh_tp[g], _dt, _M);
+    }
 #ifdef PROF
     struct timeval time_end;
     gettimeofday(&time_end,NULL);
@@ -462,6 +526,69 @@ static void reb_whfast512_interaction_step(struct reb_simulation * r, double dt)
 #endif
 }
 
+// Performs one full interaction step for the test particles.
+// Test particles feel the planets but not each other. Every planet is
+// broadcast to all lanes and kicks a group of 8 test particles at once.
+static void reb_whfast512_interaction_step_testparticles(struct reb_simulation * r, double dt){
+#ifdef PROF
+    struct timeval time_beginning;
+    gettimeofday(&time_beginning,NULL);
+#endif
+    struct reb_simulation_integrator_whfast512* const ri_whfast512 = &(r->ri_whfast512);
+    struct reb_particle_avx512* restrict p_jh = ri_whfast512->p_jh;
+    struct reb_particle_avx512* restrict p_jh_tp = ri_whfast512->p_jh_tp;
+    const int N_groups = (ri_whfast512->allocated_N_testparticles+7)/8;
+    const int N_planets = r->N_active - 1;
+    const int gr_potential = ri_whfast512->gr_potential;
+    __m512d dt512 = _mm512_set1_pd(dt); 
+    
+    double x_j[8], y_j[8], z_j[8], m_j[8];
+    _mm512_storeu_pd(&x_j, p_jh->x);
+    _mm512_storeu_pd(&y_j, p_jh->y);
+    _mm512_storeu_pd(&z_j, p_jh->z);
+    _mm512_storeu_pd(&m_j, _mm512_mul_pd(p_jh->m, dt512));
+
+#pragma omp parallel for
+    for (int g=0; g<N_groups; g++){
+        struct reb_particle_avx512* const tp = &p_jh_tp[g];
+        __m512d vx = tp->vx;
+        __m512d vy = tp->vy;
+        __m512d vz = tp->vz;
+        
+        // General relativistic corrections (no back reaction onto star)
+        if (gr_potential){
+            __m512d r2 = _mm512_mul_pd(tp->x, tp->x);
+            r2 = _mm512_fmadd_pd(tp->y, tp->y, r2);
+            r2 = _mm512_fmadd_pd(tp->z, tp->z, r2);
+            const __m512d r4 = _mm512_mul_pd(r2, r2);
+            __m512d prefac = _mm512_div_pd(gr_prefac,r4);
+            prefac = _mm512_mul_pd(prefac, dt512);
+            vx = _mm512_fnmadd_pd(prefac, tp->x, vx);
+            vy = _mm512_fnmadd_pd(prefac, tp->y, vy);
+            vz = _mm512_fnmadd_pd(prefac, tp->z, vz);
+        }
+
+        for (int j=0; j<N_planets; j++){
+            const __m512d dx = _mm512_sub_pd(tp->x, _mm512_set1_pd(x_j[j]));
+            const __m512d dy = _mm512_sub_pd(tp->y, _mm512_set1_pd(y_j[j]));
+            const __m512d dz = _mm512_sub_pd(tp->z, _mm512_set1_pd(z_j[j]));
+            const __m512d prefact = gravity_prefactor_avx512(_mm512_set1_pd(m_j[j]), dx, dy, dz);
+            vx = _mm512_fnmadd_pd(prefact, dx, vx); 
+            vy = _mm512_fnmadd_pd(prefact, dy, vy); 
+            vz = _mm512_fnmadd_pd(prefact, dz, vz); 
+        }
+        tp->vx = vx;
+        tp->vy = vy;
+        tp->vz = vz;
+    }
+
+#ifdef PROF
+    struct timeval time_end;
+    gettimeofday(&time_end,NULL);
+    walltime_interaction += time_end.tv_sec-time_beginning.tv_sec+(time_end.tv_usec-time_beginning.tv_usec)/1e6;
+#endif
+}
+
 
 // Convert inertial coordinates to democratic heliocentric coordinates
 // Note: this is only called at the beginning. Speed is not a concern.
@@ -470,13 +597,15 @@ static void inertial_to_democraticheliocentric_posvel(struct reb_simulation* r){
     struct reb_particle_avx512* p512 = aligned_alloc(64,sizeof(struct reb_particle_avx512));
     struct reb_particle* particles = r->particles;
     struct reb_particle_avx512* p_jh = ri_whfast512->p_jh;
+    struct reb_particle_avx512* p_jh_tp = ri_whfast512->p_jh_tp;
     const int N = r->N;
+    const int N_active = (r->N_active==-1)?r->N:r->N_active;
     double val[8];
 #define CONVERT2AVX(x, p) \
-    for (int i=1;i<N;i++){\
+    for (int i=1;i<N_active;i++){\
         val[i-1] = particles[i].x;\
     }\
-    for (int i=N;i<9;i++){\
+    for (int i=N_active;i<9;i++){\
         if (p){\
             val[i-1] = 100+i;\
         }else{\
@@ -530,7 +659,31 @@ static void inertial_to_democraticheliocentric_posvel(struct reb_simulation* r){
     p_jh->vy = _mm512_sub_pd(p512->vy, vym);
     vzm = _mm512_set1_pd( vz0);
     p_jh->vz = _mm512_sub_pd(p512->vz, vzm);
-     
+    
+    free(p512);
+
+    // Test particles are packed in groups of 8. Unused lanes in the 
+    // last group are filled with copies of the first test particle.
+    const int N_tp = N - N_active;
+    for (int g=0; g<(N_tp+7)/8; g++){
+        double x[8], y[8], z[8], vx[8], vy[8], vz[8];
+        for (int l=0; l<8; l++){
+            const int i = N_active + 8*g + ((8*g+l<N_tp)?l:0);
+            x[l]  = particles[i].x - particles[0].x;
+            y[l]  = particles[i].y - particles[0].y;
+            z[l]  = particles[i].z - particles[0].z;
+            vx[l] = particles[i].vx - vx0;
+            vy[l] = particles[i].vy - vy0;
+            vz[l] = particles[i].vz - vz0;
+        }
+        p_jh_tp[g].m  = _mm512_setzero_pd();
+        p_jh_tp[g].x  = _mm512_loadu_pd(&x);
+        p_jh_tp[g].y  = _mm512_loadu_pd(&y);
+        p_jh_tp[g].z  = _mm512_loadu_pd(&z);
+        p_jh_tp[g].vx = _mm512_loadu_pd(&vx);
+        p_jh_tp[g].vy = _mm512_loadu_pd(&vy);
+        p_jh_tp[g].vz = _mm512_loadu_pd(&vz);
+    }
 }
 
 // Convert democratic heliocentric coordinates to inertial coordinates
@@ -540,8 +693,10 @@ static void democraticheliocentric_to_inertial_posvel(struct reb_simulation* r){
     struct reb_particle* particles = r->particles;
     struct reb_particle_avx512* p512 = aligned_alloc(64,sizeof(struct reb_particle_avx512));
     struct reb_particle_avx512* p_jh = ri_whfast512->p_jh;
+    struct reb_particle_avx512* p_jh_tp = ri_whfast512->p_jh_tp;
     const double mtot = ri_whfast512->p_jh0.m;
     const int N = r->N;
+    const int N_active = (r->N_active==-1)?r->N:r->N_active;
     
     __m512d x0 = _mm512_mul_pd(p_jh->x,p_jh->m);
     double x0s = _mm512_reduce_add_pd(x0)/mtot;
@@ -588,7 +743,7 @@ static void democraticheliocentric_to_inertial_posvel(struct reb_simulation* r){
     double val[8];
 #define CONVERT2PAR(x) \
     _mm512_storeu_pd(&val, p512->x);\
-    for (int i=1;i<N;i++){\
+    for (int i=1;i<N_active;i++){\
         particles[i].x = val[i-1];\
     }
    
@@ -599,6 +754,22 @@ static void democraticheliocentric_to_inertial_posvel(struct reb_simulation* r){
     CONVERT2PAR(vy); 
     CONVERT2PAR(vz); 
     free(p512);
+
+    const int N_tp = N - N_active;
+#define CONVERT2PARTP(x, x0) \
+    _mm512_storeu_pd(&val, p_jh_tp[g].x);\
+    for (int l=0;l<8 && 8*g+l<N_tp;l++){\
+        particles[N_active+8*g+l].x = val[l] + x0;\
+    }
+    
+    for (int g=0; g<(N_tp+7)/8; g++){
+        CONVERT2PARTP(x, particles[0].x);
+        CONVERT2PARTP(y, particles[0].y);
+        CONVERT2PARTP(z, particles[0].z);
+        CONVERT2PARTP(vx, ri_whfast512->p_jh0.vx);
+        CONVERT2PARTP(vy, ri_whfast512->p_jh0.vy);
+        CONVERT2PARTP(vz, ri_whfast512->p_jh0.vz);
+    }
 }
 
 // Performs one complete jump step
@@ -609,6 +780,8 @@ static void reb_whfast512_jump_step(struct reb_simulation* r, const double _dt){
 #endif
     struct reb_simulation_integrator_whfast512* ri_whfast512 = &(r->ri_whfast512);
     struct reb_particle_avx512* p_jh = ri_whfast512->p_jh;
+    struct reb_particle_avx512* p_jh_tp = ri_whfast512->p_jh_tp;
+    const int N_groups = (ri_whfast512->allocated_N_testparticles+7)/8;
     double m0 = r->particles[0].m;
     
     __m512d pf512 = _mm512_set1_pd(_dt/m0);
@@ -634,6 +807,13 @@ static void reb_whfast512_jump_step(struct reb_simulation* r, const double _dt){
     p_jh->y = _mm512_fmadd_pd(sumy, pf512, p_jh->y); 
     p_jh->z = _mm512_fmadd_pd(sumz, pf512, p_jh->z); 
 
+    // Test particles do not contribute to the momentum of the star
+    for (int g=0; g<N_groups; g++){
+        p_jh_tp[g].x = _mm512_fmadd_pd(sumx, pf512, p_jh_tp[g].x); 
+        p_jh_tp[g].y = _mm512_fmadd_pd(sumy, pf512, p_jh_tp[g].y); 
+        p_jh_tp[g].z = _mm512_fmadd_pd(sumz, pf512, p_jh_tp[g].z); 
+    }
+
 #ifdef PROF
     struct timeval time_end;
     gettimeofday(&time_end,NULL);
@@ -657,31 +837,36 @@ static void reb_whfast512_com_step(struct reb_simulation* r, const double _dt){
 #endif
 }
 
-// Precalculate various constants and put them in 512 bit vectors.
-void static recalculate_constants(struct reb_simulation* r){
-    struct reb_simulation_integrator_whfast512* const ri_whfast512 = &(r->ri_whfast512);
-    const int N = r->N;
+// Put constants which do not depend on the simulation in 512 bit vectors.
+void static initialize_constants(){
     half = _mm512_set1_pd(0.5); 
     one = _mm512_add_pd(half, half); 
     two = _mm512_add_pd(one, one); 
     five = _mm512_set1_pd(5.); 
     sixteen = _mm512_set1_pd(16.); 
     twenty = _mm512_set1_pd(20.); 
-    _M = _mm512_set1_pd(r->particles[0].m); 
     so1 = _mm512_set_epi64(1,2,3,0,6,7,4,5);
     so2 = _mm512_set_epi64(3,2,1,0,6,5,4,7);
     for(int i=0;i<35;i++){
         invfactorial512[i] = _mm512_set1_pd(invfactorial[i]); 
     }
+}
+
+// Precalculate various constants and put them in 512 bit vectors.
+void static recalculate_constants(struct reb_simulation* r){
+    struct reb_simulation_integrator_whfast512* const ri_whfast512 = &(r->ri_whfast512);
+    const int N_active = (r->N_active==-1)?r->N:r->N_active;
+    initialize_constants();
+    _M = _mm512_set1_pd(r->particles[0].m); 
 
     // GR prefactors. Note: assumes units of AU, year/2pi.
     double c = 10065.32;
     gr_prefac = _mm512_set1_pd(6.*r->particles[0].m*r->particles[0].m/(c*c));
     double _gr_prefac2[8];
-    for(int i=1;i<N;i++){
+    for(int i=1;i<N_active;i++){
         _gr_prefac2[i-1] = r->particles[i].m/r->particles[0].m;
     }
-    for(int i=N;i<9;i++){
+    for(int i=N_active;i<9;i++){
         _gr_prefac2[i-1] = 0;
     }
     gr_prefac2 = _mm512_loadu_pd(&_gr_prefac2);
@@ -694,49 +879,8 @@ void reb_integrator_whfast512_part1(struct reb_simulation* const r){
     struct reb_simulation_integrator_whfast512* const ri_whfast512 = &(r->ri_whfast512);
     const double dt = r->dt;
     
-    if (ri_whfast512->allocated_N==0){
-        // Check if all assumptions are satisfied.
-        // Note: These are not checked every timestep. 
-        // So it is possible for the user to screw things up.
-        if (r->dt<=0.0){
-            reb_error(r, "WHFast512 does not support negative timesteps. To integrate backwards, flip the sign of the velocities.");
-            r->status = REB_EXIT_ERROR;
-            return;
-        }
-        if (r->N_var!=0){
-            reb_error(r, "WHFast512 does not support variational particles.");
-            r->status = REB_EXIT_ERROR;
-            return;
-        }
-        if (r->exact_finish_time!=0){
-            reb_error(r, "WHFast512 requires exact_finish_time=0.");
-            r->status = REB_EXIT_ERROR;
-            return;
-        }
-        if (r->N>9){
-            reb_error(r, "WHFast512 supports a maximum of 9 particles.");
-            r->status = REB_EXIT_ERROR;
-            return;
-        }
-        if (r->G!=1.0){
-            reb_error(r, "WHFast512 requires units in which G=1. Please rescale your system.");
-            r->status = REB_EXIT_ERROR;
-            return;
-        }
-        if (r->N_active!=-1 && r->N_active!=r->N){
-            reb_error(r, "WHFast512 does not support test particles.");
-            r->status = REB_EXIT_ERROR;
-            return;
-        }
-        ri_whfast512->p_jh = aligned_alloc(64,sizeof(struct reb_particle_avx512));
-        if (!ri_whfast512->p_jh){
-            reb_error(r, "WHFast512 was not able to allocate memory.");
-            r->status = REB_EXIT_ERROR;
-            return;
-        }
-        ri_whfast512->allocated_N=1;
-        ri_whfast512->recalculate_constants = 1;
-        r->gravity = REB_GRAVITY_NONE; // WHFast512 uses its own gravity routine.
+    if (ri_whfast512->allocated_N==0 && !reb_whfast512_allocate(r)){
+        return;
     }
 
     if (ri_whfast512->recalculate_constants){
@@ -764,6 +908,7 @@ void reb_integrator_whfast512_part1(struct reb_simulation* const r){
     }
 
     reb_whfast512_interaction_step(r, dt);
+    reb_whfast512_interaction_step_testparticles(r, dt);
     
     if (ri_whfast512->gr_potential){
         reb_whfast512_jump_step(r, dt/2.);
@@ -775,12 +920,890 @@ void reb_integrator_whfast512_part1(struct reb_simulation* const r){
     r->dt_last_done = dt;
 }
 
+// Ensemble integration.
+// Every lane holds a different simulation. Groups of 8 simulations are 
+// integrated in lockstep. The k-th planet of all simulations in a group
+// is stored in p[k]. The centre of mass of every simulation is stored 
+// in p0 where the mass field holds the total mass.
+
+// Converts a group of simulations to democratic heliocentric coordinates. 
+// Unused lanes are filled with copies of the last simulation.
+static void reb_whfast512_ensemble_to_lanes(struct reb_simulation** const sims, const int N_sims, const int g, struct reb_particle_avx512* const p, struct reb_particle_avx512* const p0, __m512d* const m0){
+    const int N_planets = sims[0]->N-1;
+    double com[7][8];
+    double val[7][8];
+    for (int l=0; l<8; l++){
+        struct reb_simulation* const r = sims[(8*g+l<N_sims)?8*g+l:N_sims-1];
+        const struct reb_particle c = reb_get_com(r);
+        com[0][l] = c.m;
+        com[1][l] = c.x;
+        com[2][l] = c.y;
+        com[3][l] = c.z;
+        com[4][l] = c.vx;
+        com[5][l] = c.vy;
+        com[6][l] = c.vz;
+        val[0][l] = r->particles[0].m;
+    }
+    *m0 = _mm512_loadu_pd(&val[0]);
+    p0->m  = _mm512_loadu_pd(&com[0]);
+    p0->x  = _mm512_loadu_pd(&com[1]);
+    p0->y  = _mm512_loadu_pd(&com[2]);
+    p0->z  = _mm512_loadu_pd(&com[3]);
+    p0->vx = _mm512_loadu_pd(&com[4]);
+    p0->vy = _mm512_loadu_pd(&com[5]);
+    p0->vz = _mm512_loadu_pd(&com[6]);
+
+    for (int k=0; k<N_planets; k++){
+        for (int l=0; l<8; l++){
+            const struct reb_particle* const particles = sims[(8*g+l<N_sims)?8*g+l:N_sims-1]->particles;
+            val[0][l] = particles[k+1].m;
+            val[1][l] = particles[k+1].x - particles[0].x;
+            val[2][l] = particles[k+1].y - particles[0].y;
+            val[3][l] = particles[k+1].z - particles[0].z;
+            val[4][l] = particles[k+1].vx - com[4][l];
+            val[5][l] = particles[k+1].vy - com[5][l];
+            val[6][l] = particles[k+1].vz - com[6][l];
+        }
+        p[k].m  = _mm512_loadu_pd(&val[0]);
+        p[k].x  = _mm512_loadu_pd(&val[1]);
+        p[k].y  = _mm512_loadu_pd(&val[2]);
+        p[k].z  = _mm512_loadu_pd(&val[3]);
+        p[k].vx = _mm512_loadu_pd(&val[4]);
+        p[k].vy = _mm512_loadu_pd(&val[5]);
+        p[k].vz = _mm512_loadu_pd(&val[6]);
+    }
+}
+
+// Converts a group of simulations back to inertial coordinates.
+static void reb_whfast512_ensemble_from_lanes(struct reb_simulation** const sims, const int N_sims, const int g, const struct reb_particle_avx512* const p, const struct reb_particle_avx512* const p0, const __m512d m0){
+    const int N_planets = sims[0]->N-1;
+    __m512d sx = _mm512_setzero_pd();
+    __m512d sy = _mm512_setzero_pd();
+    __m512d sz = _mm512_setzero_pd();
+    __m512d svx = _mm512_setzero_pd();
+    __m512d svy = _mm512_setzero_pd();
+    __m512d svz = _mm512_setzero_pd();
+    for (int k=0; k<N_planets; k++){
+        sx  = _mm512_fmadd_pd(p[k].m, p[k].x,  sx);
+        sy  = _mm512_fmadd_pd(p[k].m, p[k].y,  sy);
+        sz  = _mm512_fmadd_pd(p[k].m, p[k].z,  sz);
+        svx = _mm512_fmadd_pd(p[k].m, p[k].vx, svx);
+        svy = _mm512_fmadd_pd(p[k].m, p[k].vy, svy);
+        svz = _mm512_fmadd_pd(p[k].m, p[k].vz, svz);
+    }
+    const __m512d x0 = _mm512_sub_pd(p0->x, _mm512_div_pd(sx, p0->m));
+    const __m512d y0 = _mm512_sub_pd(p0->y, _mm512_div_pd(sy, p0->m));
+    const __m512d z0 = _mm512_sub_pd(p0->z, _mm512_div_pd(sz, p0->m));
+    
+    double val[6][8];
+    _mm512_storeu_pd(&val[0], x0);
+    _mm512_storeu_pd(&val[1], y0);
+    _mm512_storeu_pd(&val[2], z0);
+    _mm512_storeu_pd(&val[3], _mm512_sub_pd(p0->vx, _mm512_div_pd(svx, m0)));
+    _mm512_storeu_pd(&val[4], _mm512_sub_pd(p0->vy, _mm512_div_pd(svy, m0)));
+    _mm512_storeu_pd(&val[5], _mm512_sub_pd(p0->vz, _mm512_div_pd(svz, m0)));
+    for (int k=-1; k<N_planets; k++){
+        if (k>=0){
+            _mm512_storeu_pd(&val[0], _mm512_add_pd(p[k].x, x0));
+            _mm512_storeu_pd(&val[1], _mm512_add_pd(p[k].y, y0));
+            _mm512_storeu_pd(&val[2], _mm512_add_pd(p[k].z, z0));
+            _mm512_storeu_pd(&val[3], _mm512_add_pd(p[k].vx, p0->vx));
+            _mm512_storeu_pd(&val[4], _mm512_add_pd(p[k].vy, p0->vy));
+            _mm512_storeu_pd(&val[5], _mm512_add_pd(p[k].vz, p0->vz));
+        }
+        for (int l=0; l<8 && 8*g+l<N_sims; l++){
+            struct reb_particle* const pi = &(sims[8*g+l]->particles[k+1]);
+            pi->x  = val[0][l];
+            pi->y  = val[1][l];
+            pi->z  = val[2][l];
+            pi->vx = val[3][l];
+            pi->vy = val[4][l];
+            pi->vz = val[5][l];
+        }
+    }
+}
+
+// Kick from the interaction between planets (and the GR potential). 
+static void reb_whfast512_ensemble_interaction_step(struct reb_particle_avx512* const p, const int N_planets, const __m512d dt, const int gr_potential, const __m512d gr_prefac_e, const __m512d m0){
+    if (gr_potential){
+        __m512d svx = _mm512_setzero_pd();
+        __m512d svy = _mm512_setzero_pd();
+        __m512d svz = _mm512_setzero_pd();
+        for (int k=0; k<N_planets; k++){
+            __m512d r2 = _mm512_mul_pd(p[k].x, p[k].x);
+            r2 = _mm512_fmadd_pd(p[k].y, p[k].y, r2);
+            r2 = _mm512_fmadd_pd(p[k].z, p[k].z, r2);
+            const __m512d r4 = _mm512_mul_pd(r2, r2);
+            __m512d prefac = _mm512_div_pd(gr_prefac_e, r4);
+            prefac = _mm512_mul_pd(prefac, dt);
+            const __m512d dvx = _mm512_mul_pd(prefac, p[k].x); 
+            const __m512d dvy = _mm512_mul_pd(prefac, p[k].y); 
+            const __m512d dvz = _mm512_mul_pd(prefac, p[k].z); 
+            p[k].vx = _mm512_sub_pd(p[k].vx, dvx);
+            p[k].vy = _mm512_sub_pd(p[k].vy, dvy);
+            p[k].vz = _mm512_sub_pd(p[k].vz, dvz);
+            // Back reaction onto star
+            const __m512d mr = _mm512_div_pd(p[k].m, m0);
+            svx = _mm512_fmadd_pd(mr, dvx, svx);
+            svy = _mm512_fmadd_pd(mr, dvy, svy);
+            svz = _mm512_fmadd_pd(mr, dvz, svz);
+        }
+        for (int k=0; k<N_planets; k++){
+            p[k].vx = _mm512_sub_pd(p[k].vx, svx);
+            p[k].vy = _mm512_sub_pd(p[k].vy, svy);
+            p[k].vz = _mm512_sub_pd(p[k].vz, svz);
+        }
+    }
+    
+    for (int i=0; i<N_planets; i++){
+        for (int j=i+1; j<N_planets; j++){
+            const __m512d dx = _mm512_sub_pd(p[i].x, p[j].x);
+            const __m512d dy = _mm512_sub_pd(p[i].y, p[j].y);
+            const __m512d dz = _mm512_sub_pd(p[i].z, p[j].z);
+            const __m512d prefact = _mm512_mul_pd(gravity_prefactor_avx512_one(dx, dy, dz), dt);
+            const __m512d prefacti = _mm512_mul_pd(prefact, p[j].m);
+            p[i].vx = _mm512_fnmadd_pd(prefacti, dx, p[i].vx); 
+            p[i].vy = _mm512_fnmadd_pd(prefacti, dy, p[i].vy); 
+            p[i].vz = _mm512_fnmadd_pd(prefacti, dz, p[i].vz); 
+            const __m512d prefactj = _mm512_mul_pd(prefact, p[i].m);
+            p[j].vx = _mm512_fmadd_pd(prefactj, dx, p[j].vx); 
+            p[j].vy = _mm512_fmadd_pd(prefactj, dy, p[j].vy); 
+            p[j].vz = _mm512_fmadd_pd(prefactj, dz, p[j].vz); 
+        }
+    }
+}
+
+// Drift from the momentum of the star.
+static void reb_whfast512_ensemble_jump_step(struct reb_particle_avx512* const p, const int N_planets, const __m512d pf512){
+    __m512d sumx = _mm512_setzero_pd();
+    __m512d sumy = _mm512_setzero_pd();
+    __m512d sumz = _mm512_setzero_pd();
+    for (int k=0; k<N_planets; k++){
+        sumx = _mm512_fmadd_pd(p[k].m, p[k].vx, sumx);
+        sumy = _mm512_fmadd_pd(p[k].m, p[k].vy, sumy);
+        sumz = _mm512_fmadd_pd(p[k].m, p[k].vz, sumz);
+    }
+    for (int k=0; k<N_planets; k++){
+        p[k].x = _mm512_fmadd_pd(sumx, pf512, p[k].x); 
+        p[k].y = _mm512_fmadd_pd(sumy, pf512, p[k].y); 
+        p[k].z = _mm512_fmadd_pd(sumz, pf512, p[k].z); 
+    }
+}
+
+// Kepler and centre of mass drift.
+static void reb_whfast512_ensemble_drift_step(struct reb_particle_avx512* const p, struct reb_particle_avx512* const p0, const int N_planets, const double dt, const __m512d m0){
+    const __m512d _dt = _mm512_set1_pd(dt);
+    for (int k=0; k<N_planets; k++){
+        reb_whfast512_kepler_step_group(&p[k], _dt, m0);
+    }
+    p0->x = _mm512_fmadd_pd(_dt, p0->vx, p0->x);
+    p0->y = _mm512_fmadd_pd(_dt, p0->vy, p0->y);
+    p0->z = _mm512_fmadd_pd(_dt, p0->vz, p0->z);
+}
+
+enum REB_STATUS reb_whfast512_ensemble_integrate(struct reb_simulation** const sims, const int N_sims, const double tmax){
+    if (N_sims<1){
+        return REB_EXIT_SUCCESS;
+    }
+    const struct reb_simulation* const r0 = sims[0];
+    for (int s=0; s<N_sims; s++){
+        struct reb_simulation* const r = sims[s];
+        const char* error = NULL;
+        if (r->N!=r0->N){
+            error = "All simulations in a WHFast512 ensemble need to have the same number of particles.";
+        }else if (r->N<2 || r->N>9){
+            error = "Simulations in a WHFast512 ensemble need to have between 2 and 9 particles.";
+        }else if (r->N_active!=-1 && r->N_active!=r->N){
+            error = "WHFast512 ensembles do not support test particles.";
+        }else if (r->N_var!=0){
+            error = "WHFast512 does not support variational particles.";
+        }else if (r->G!=1.0){
+            error = "WHFast512 requires units in which G=1. Please rescale your system.";
+        }else if (r->dt<=0.0){
+            error = "WHFast512 does not support negative timesteps. To integrate backwards, flip the sign of the velocities.";
+        }else if (r->dt!=r0->dt || r->t!=r0->t){
+            error = "All simulations in a WHFast512 ensemble need to have the same time and timestep.";
+        }else if (r->ri_whfast512.gr_potential!=r0->ri_whfast512.gr_potential){
+            error = "All simulations in a WHFast512 ensemble need to have the same gr_potential setting.";
+        }
+        if (error){
+            reb_error(r, error);
+            r->status = REB_EXIT_ERROR;
+            return REB_EXIT_ERROR;
+        }
+    }
+    for (int s=0; s<N_sims; s++){
+        reb_integrator_synchronize(sims[s]);
+    }
+
+    const double dt = r0->dt;
+    const int N_planets = r0->N-1;
+    const int gr_potential = r0->ri_whfast512.gr_potential;
+    // Same stopping condition as reb_integrate() with exact_finish_time=0
+    double t = r0->t;
+    unsigned long long N_steps = 0;
+    while (t<tmax){
+        t += dt;
+        N_steps++;
+    }
+    if (N_steps==0){
+        return REB_EXIT_SUCCESS;
+    }
+    initialize_constants();
+
+    const int N_groups = (N_sims+7)/8;
+#pragma omp parallel for
+    for (int g=0; g<N_groups; g++){
+        struct reb_particle_avx512* p = aligned_alloc(64,sizeof(struct reb_particle_avx512)*N_planets);
+        struct reb_particle_avx512* p0 = aligned_alloc(64,sizeof(struct reb_particle_avx512));
+        __m512d m0;
+        reb_whfast512_ensemble_to_lanes(sims, N_sims, g, p, p0, &m0);
+        
+        // GR prefactors. Note: assumes units of AU, year/2pi.
+        const double c = 10065.32;
+        const __m512d gr_prefac_e = _mm512_div_pd(_mm512_mul_pd(_mm512_set1_pd(6.), _mm512_mul_pd(m0, m0)), _mm512_set1_pd(c*c));
+        const __m512d dt512 = _mm512_set1_pd(dt);
+        const __m512d pf512 = _mm512_div_pd(_mm512_set1_pd(gr_potential?dt/2.:dt), m0);
+
+        for (unsigned long long step=0; step<N_steps; step++){
+            // First half drift step, then combined drift steps
+            reb_whfast512_ensemble_drift_step(p, p0, N_planets, step?dt:dt/2., m0);
+            reb_whfast512_ensemble_jump_step(p, N_planets, pf512);
+            reb_whfast512_ensemble_interaction_step(p, N_planets, dt512, gr_potential, gr_prefac_e, m0);
+            if (gr_potential){
+                reb_whfast512_ensemble_jump_step(p, N_planets, pf512);
+            }
+        }
+        // Synchronize 
+        reb_whfast512_ensemble_drift_step(p, p0, N_planets, dt/2., m0);
+
+        reb_whfast512_ensemble_from_lanes(sims, N_sims, g, p, p0, m0);
+        free(p);
+        free(p0);
+    }
+
+    for (int s=0; s<N_sims; s++){
+        struct reb_simulation* const r = sims[s];
+        r->t = t;
+        r->dt_last_done = dt;
+        r->steps_done += N_steps;
+        r->ri_whfast512.is_synchronized = 1;
+        r->status = REB_EXIT_SUCCESS;
+    }
+    return REB_EXIT_SUCCESS;
+}
+
 #else // AVX512
-// Dummy function when AVX512 is not available
+
+// If REBOUND is compiled without AVX512 support, an implementation using
+// AVX2 and FMA instructions is used instead if the CPU supports them. 
+// Every vector of 8 planets is stored in two 256 bit registers. The CPU
+// features are detected at runtime so that one binary runs everywhere.
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define WHFAST512_AVX2
+#endif
+
+#ifdef WHFAST512_AVX2
+#include <immintrin.h>
+
+#ifdef __clang__
+#pragma clang attribute push (__attribute__((target("avx2,fma"))), apply_to=function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+#endif
+
+struct reb_particle_avx2 {
+    __m256d m;
+    __m256d x;
+    __m256d y;
+    __m256d z;
+    __m256d vx;
+    __m256d vy;
+    __m256d vz;
+};
+
+static __m256d invfactorial256[35];
+static __m256d gr_prefac256;
+static double gr_prefac2_avx2[8];
+static __m256d half256;
+static __m256d one256;
+static __m256d two256;
+static __m256d five256;
+static __m256d sixteen256;
+static __m256d twenty256;
+static __m256d _M256;
+
+static const double invfactorial[35] = {1., 1., 1./2., 1./6., 1./24., 1./120., 1./720., 1./5040., 1./40320., 1./362880., 1./3628800., 1./39916800., 1./479001600., 1./6227020800., 1./87178291200., 1./1307674368000., 1./20922789888000., 1./355687428096000., 1./6402373705728000., 1./121645100408832000., 1./2432902008176640000., 1./51090942171709440000., 1./1124000727777607680000., 1./25852016738884976640000., 1./620448401733239439360000., 1./15511210043330985984000000., 1./403291461126605635584000000., 1./10888869450418352160768000000., 1./304888344611713860501504000000., 1./8841761993739701954543616000000., 1./265252859812191058636308480000000., 1./8222838654177922817725562880000000., 1./263130836933693530167218012160000000., 1./8683317618811886495518194401280000000., 1./295232799039604140847618609643520000000.};
+
+// Stiefel function for Newton's method, returning Gs1, Gs2, and Gs3
+static void inline mm_stiefel_Gs13_avx2(__m256d * Gs1, __m256d * Gs2, __m256d * Gs3, __m256d beta, __m256d X){
+    __m256d X2 = _mm256_mul_pd(X,X); 
+    __m256d z = _mm256_mul_pd(X2,beta); 
+
+    // stumpff_cs. Note: assuming n = 0
+    const int nmax = 19;
+   *Gs3 = invfactorial256[nmax]; 
+   *Gs2 = invfactorial256[nmax-1]; 
+
+    for(int np=nmax-2;np>=3;np-=2){
+        *Gs3 = _mm256_fnmadd_pd(z, *Gs3, invfactorial256[np]);
+        *Gs2 = _mm256_fnmadd_pd(z, *Gs2, invfactorial256[np-1]);
+    }
+    *Gs3 = _mm256_mul_pd(*Gs3,X); 
+    *Gs1 = _mm256_fnmadd_pd(z, *Gs3, X);
+    *Gs3 = _mm256_mul_pd(*Gs3,X2); 
+    *Gs2 = _mm256_mul_pd(*Gs2,X2); 
+};
+
+// Stiefel function for Halley's method, returning Gs0, Gs1, Gs2, and Gs3
+static void inline mm_stiefel_Gs03_avx2(__m256d * Gs0, __m256d * Gs1, __m256d * Gs2, __m256d * Gs3, __m256d beta, __m256d X){
+    __m256d X2 = _mm256_mul_pd(X,X); 
+    __m256d z = _mm256_mul_pd(X2,beta); 
+
+    // stumpff_cs. Note: assuming n = 0
+    const int nmax = 11; // Note: reduced! needs to be improved with mm_stiefel_Gs13_avx2 on last step(s)
+   *Gs3 = invfactorial256[nmax]; 
+   *Gs2 = invfactorial256[nmax-1]; 
+
+    for(int np=nmax-2;np>=3;np-=2){
+        *Gs3 = _mm256_fnmadd_pd(z, *Gs3, invfactorial256[np]);
+        *Gs2 = _mm256_fnmadd_pd(z, *Gs2, invfactorial256[np-1]);
+    }
+    *Gs0 = _mm256_fnmadd_pd(z, *Gs2, one256);
+    *Gs3 = _mm256_mul_pd(*Gs3,X); 
+    *Gs1 = _mm256_fnmadd_pd(z, *Gs3, X);
+    *Gs3 = _mm256_mul_pd(*Gs3,X2); 
+    *Gs2 = _mm256_mul_pd(*Gs2,X2); 
+};
+
+// Performs one full Kepler step for a group of 4 particles orbiting a central mass M
+static void inline reb_whfast512_avx2_kepler_step_group(struct reb_particle_avx2 * restrict p256, const __m256d _dt, const __m256d M){
+        
+    __m256d r2 = _mm256_mul_pd(p256->x, p256->x);
+    r2 = _mm256_fmadd_pd(p256->y, p256->y, r2);
+    r2 = _mm256_fmadd_pd(p256->z, p256->z, r2);
+    __m256d r0 = _mm256_sqrt_pd(r2);
+    __m256d r0i = _mm256_div_pd(one256,r0);
+
+    __m256d v2 = _mm256_mul_pd(p256->vx, p256->vx);
+    v2 = _mm256_fmadd_pd(p256->vy, p256->vy, v2);
+    v2 = _mm256_fmadd_pd(p256->vz, p256->vz, v2);
+    
+    __m256d beta = _mm256_mul_pd(two256, M);
+    beta = _mm256_fmsub_pd(beta, r0i, v2);
+
+    __m256d eta0 = _mm256_mul_pd(p256->x, p256->vx);
+    eta0 = _mm256_fmadd_pd(p256->y, p256->vy, eta0);
+    eta0 = _mm256_fmadd_pd(p256->z, p256->vz, eta0);
+
+    __m256d zeta0 = _mm256_fnmadd_pd(beta, r0, M);
+
+    __m256d Gs1;
+    __m256d Gs2;
+    __m256d Gs3;
+    __m256d eta0Gs1zeta0Gs2; 
+    __m256d ri; 
+
+#define NEWTON_STEP() \
+    mm_stiefel_Gs13_avx2(&Gs1, &Gs2, &Gs3, beta, X);\
+    eta0Gs1zeta0Gs2 = _mm256_mul_pd(eta0, Gs1); \
+    eta0Gs1zeta0Gs2 = _mm256_fmadd_pd(zeta0,Gs2, eta0Gs1zeta0Gs2); \
+    ri = _mm256_add_pd(r0, eta0Gs1zeta0Gs2); \
+    ri = _mm256_div_pd(one256, ri); \
+    \
+    X = _mm256_mul_pd(X, eta0Gs1zeta0Gs2);\
+    X = _mm256_fnmadd_pd(eta0, Gs2, X);\
+    X = _mm256_fnmadd_pd(zeta0, Gs3, X);\
+    X = _mm256_add_pd(_dt, X);\
+    X = _mm256_mul_pd(ri, X);
+
+
+#define HALLEY_STEP() \
+    mm_stiefel_Gs03_avx2(&Gs0, &Gs1, &Gs2, &Gs3, beta, X);\
+    f = _mm256_fmsub_pd(r0,X,_dt);\
+    f = _mm256_fmadd_pd(eta0, Gs2, f);\
+    f = _mm256_fmadd_pd(zeta0, Gs3, f);\
+    \
+    fp = _mm256_fmadd_pd(eta0, Gs1, r0);\
+    fp = _mm256_fmadd_pd(zeta0, Gs2, fp);\
+    \
+    fpp = _mm256_mul_pd(eta0, Gs0);\
+    fpp = _mm256_fmadd_pd(zeta0, Gs1, fpp);\
+    \
+    denom = _mm256_mul_pd(fp,fp);\
+    denom = _mm256_mul_pd(denom,sixteen256);\
+    \
+    denom = _mm256_fnmadd_pd(_mm256_mul_pd(f,fpp),twenty256, denom);\
+    /* not included: _mm256_abs_pd(denom) */;\
+    denom = _mm256_sqrt_pd(denom);\
+    denom = _mm256_add_pd(fp, denom);\
+    \
+    X = _mm256_fmsub_pd(X, denom, _mm256_mul_pd(f, five256));\
+    X = _mm256_div_pd(X, denom);
+
+    // Initial guess
+    __m256d dtr0i = _mm256_mul_pd(_dt,r0i);
+    __m256d X = _mm256_mul_pd(dtr0i,eta0);
+    X = _mm256_mul_pd(X,half256);
+    X = _mm256_fnmadd_pd(X,r0i,one256);
+    X = _mm256_mul_pd(dtr0i,X);
+
+    // Iterations
+    __m256d f, fp, fpp, denom, Gs0;
+    HALLEY_STEP();
+    HALLEY_STEP();
+    NEWTON_STEP();
+    // +1 below
+    
+    // Final Newton step (note: X not needed after this) 
+    mm_stiefel_Gs13_avx2(&Gs1, &Gs2, &Gs3, beta, X);
+    eta0Gs1zeta0Gs2 = _mm256_mul_pd(eta0, Gs1); 
+    eta0Gs1zeta0Gs2 = _mm256_fmadd_pd(zeta0,Gs2, eta0Gs1zeta0Gs2); 
+    ri = _mm256_add_pd(r0, eta0Gs1zeta0Gs2); 
+    ri = _mm256_div_pd(one256, ri); 
+
+    // f and g function
+
+    __m256d nf = _mm256_mul_pd(M,Gs2); //negative f
+    nf = _mm256_mul_pd(nf,r0i); 
+
+    __m256d g = _mm256_fnmadd_pd(M, Gs3, _dt);
+
+    __m256d nfd = _mm256_mul_pd(M, Gs1); // negative fd
+    nfd = _mm256_mul_pd(nfd, r0i);
+    nfd = _mm256_mul_pd(nfd, ri);
+
+    __m256d ngd = _mm256_mul_pd(M, Gs2); // negative gd
+    ngd = _mm256_mul_pd(ngd, ri);
+
+    __m256d nx = _mm256_fnmadd_pd(nf, p256->x, p256->x);
+    nx = _mm256_fmadd_pd(g, p256->vx, nx);
+    __m256d ny = _mm256_fnmadd_pd(nf, p256->y, p256->y);
+    ny = _mm256_fmadd_pd(g, p256->vy, ny);
+    __m256d nz = _mm256_fnmadd_pd(nf, p256->z, p256->z);
+    nz = _mm256_fmadd_pd(g, p256->vz, nz);
+
+    p256->vx = _mm256_fnmadd_pd(ngd, p256->vx, p256->vx);
+    p256->vx = _mm256_fnmadd_pd(nfd, p256->x, p256->vx);
+    p256->vy = _mm256_fnmadd_pd(ngd, p256->vy, p256->vy);
+    p256->vy = _mm256_fnmadd_pd(nfd, p256->y, p256->vy);
+    p256->vz = _mm256_fnmadd_pd(ngd, p256->vz, p256->vz);
+    p256->vz = _mm256_fnmadd_pd(nfd, p256->z, p256->vz);
+
+    p256->x = nx;
+    p256->y = ny;
+    p256->z = nz;
+}
+
+// Loads lanes 4*h..4*h+3 of a group of 8 particles
+static inline void reb_whfast512_avx2_load(struct reb_particle_avx2* const p256, const struct reb_particle_avx512* const p512, const int h){
+    p256->m  = _mm256_loadu_pd(&p512->m[4*h]);
+    p256->x  = _mm256_loadu_pd(&p512->x[4*h]);
+    p256->y  = _mm256_loadu_pd(&p512->y[4*h]);
+    p256->z  = _mm256_loadu_pd(&p512->z[4*h]);
+    p256->vx = _mm256_loadu_pd(&p512->vx[4*h]);
+    p256->vy = _mm256_loadu_pd(&p512->vy[4*h]);
+    p256->vz = _mm256_loadu_pd(&p512->vz[4*h]);
+}
+
+// Stores lanes 4*h..4*h+3 of a group of 8 particles
+static inline void reb_whfast512_avx2_store(struct reb_particle_avx512* const p512, const struct reb_particle_avx2* const p256, const int h){
+    _mm256_storeu_pd(&p512->x[4*h], p256->x);
+    _mm256_storeu_pd(&p512->y[4*h], p256->y);
+    _mm256_storeu_pd(&p512->z[4*h], p256->z);
+    _mm256_storeu_pd(&p512->vx[4*h], p256->vx);
+    _mm256_storeu_pd(&p512->vy[4*h], p256->vy);
+    _mm256_storeu_pd(&p512->vz[4*h], p256->vz);
+}
+
+// Performs one full Kepler step for the planets and all test particles
+static void reb_whfast512_avx2_kepler_step(const struct reb_simulation* const r, const double dt){
+    const int N_groups = 1 + (r->ri_whfast512.allocated_N_testparticles+7)/8;
+    const __m256d _dt = _mm256_set1_pd(dt); 
+#pragma omp parallel for
+    for (int g=0; g<N_groups; g++){
+        struct reb_particle_avx512* const p512 = g?&r->ri_whfast512.p_jh_tp[g-1]:r->ri_whfast512.p_jh;
+        for (int h=0; h<2; h++){
+            struct reb_particle_avx2 p256;
+            reb_whfast512_avx2_load(&p256, p512, h);
+            reb_whfast512_avx2_kepler_step_group(&p256, _dt, _M256);
+            reb_whfast512_avx2_store(p512, &p256, h);
+        }
+    }
+}
+
+// Returns the sum over all 8 lanes in every lane
+static inline __m256d reb_whfast512_avx2_sum(const __m256d lo, const __m256d hi){
+    __m256d s = _mm256_add_pd(lo, hi);
+    s = _mm256_add_pd(s, _mm256_permute2f128_pd(s, s, 0x01));
+    return _mm256_add_pd(s, _mm256_permute_pd(s, 0x05));
+}
+
+// Rotates the 8 lanes stored in lo and hi by s, i.e. lane i of the result is lane (i+s)%8 of the input.
+static inline void reb_whfast512_avx2_rotate(const __m256d lo, const __m256d hi, const int s, __m256d* const rlo, __m256d* const rhi){
+    const __m256d lohi = _mm256_permute2f128_pd(lo, hi, 0x21); // 2345
+    const __m256d hilo = _mm256_permute2f128_pd(hi, lo, 0x21); // 6701
+    switch (s%4){
+        case 0:
+            *rlo = lo;
+            *rhi = hi;
+            break;
+        case 1:
+            *rlo = _mm256_shuffle_pd(lo, lohi, 0x05); // 1234
+            *rhi = _mm256_shuffle_pd(hi, hilo, 0x05); // 5670
+            break;
+        case 2:
+            *rlo = lohi;
+            *rhi = hilo;
+            break;
+        case 3:
+            *rlo = _mm256_shuffle_pd(lohi, hi, 0x05); // 3456
+            *rhi = _mm256_shuffle_pd(hilo, lo, 0x05); // 7012
+            break;
+    }
+    if (s>=4){
+        const __m256d t = *rlo;
+        *rlo = *rhi;
+        *rhi = t;
+    }
+}
+
+// Performs one full interaction step for the planets
+static void reb_whfast512_avx2_interaction_step(struct reb_simulation * r, double dt){
+    struct reb_simulation_integrator_whfast512* const ri_whfast512 = &(r->ri_whfast512);
+    struct reb_particle_avx512* restrict p_jh = ri_whfast512->p_jh;
+    const __m256d dt256 = _mm256_set1_pd(dt); 
+    struct reb_particle_avx2 p[2];
+    reb_whfast512_avx2_load(&p[0], p_jh, 0);
+    reb_whfast512_avx2_load(&p[1], p_jh, 1);
+
+    // General relativistic corrections
+    if (ri_whfast512->gr_potential){
+        __m256d dvx[2], dvy[2], dvz[2];
+        for (int h=0; h<2; h++){
+            __m256d r2 = _mm256_mul_pd(p[h].x, p[h].x);
+            r2 = _mm256_fmadd_pd(p[h].y, p[h].y, r2);
+            r2 = _mm256_fmadd_pd(p[h].z, p[h].z, r2);
+            const __m256d r4 = _mm256_mul_pd(r2, r2);
+            __m256d prefac = _mm256_div_pd(gr_prefac256,r4);
+            prefac = _mm256_mul_pd(prefac, dt256);
+            dvx[h] = _mm256_mul_pd(prefac, p[h].x); 
+            dvy[h] = _mm256_mul_pd(prefac, p[h].y); 
+            dvz[h] = _mm256_mul_pd(prefac, p[h].z); 
+            p[h].vx = _mm256_sub_pd(p[h].vx, dvx[h]);
+            p[h].vy = _mm256_sub_pd(p[h].vy, dvy[h]);
+            p[h].vz = _mm256_sub_pd(p[h].vz, dvz[h]);
+            // Back reaction onto star
+            const __m256d prefac2 = _mm256_loadu_pd(&gr_prefac2_avx2[4*h]);
+            dvx[h] = _mm256_mul_pd(prefac2, dvx[h]); 
+            dvy[h] = _mm256_mul_pd(prefac2, dvy[h]); 
+            dvz[h] = _mm256_mul_pd(prefac2, dvz[h]); 
+        }
+        const __m256d svx = reb_whfast512_avx2_sum(dvx[0], dvx[1]);
+        const __m256d svy = reb_whfast512_avx2_sum(dvy[0], dvy[1]);
+        const __m256d svz = reb_whfast512_avx2_sum(dvz[0], dvz[1]);
+        for (int h=0; h<2; h++){
+            p[h].vx = _mm256_sub_pd(p[h].vx, svx);
+            p[h].vy = _mm256_sub_pd(p[h].vy, svy);
+            p[h].vz = _mm256_sub_pd(p[h].vz, svz);
+        }
+    }
+
+    const __m256d m[2] = {_mm256_mul_pd(p[0].m, dt256), _mm256_mul_pd(p[1].m, dt256)};
+    // Interactions between planet i and i+s. Every pair is calculated once. 
+    for (int s=1; s<=4; s++){
+        __m256d xs[2], ys[2], zs[2], ms[2];
+        reb_whfast512_avx2_rotate(p[0].x, p[1].x, s, &xs[0], &xs[1]);
+        reb_whfast512_avx2_rotate(p[0].y, p[1].y, s, &ys[0], &ys[1]);
+        reb_whfast512_avx2_rotate(p[0].z, p[1].z, s, &zs[0], &zs[1]);
+        reb_whfast512_avx2_rotate(m[0], m[1], s, &ms[0], &ms[1]);
+        __m256d bx[2], by[2], bz[2];
+        for (int h=0; h<2; h++){
+            const __m256d dx = _mm256_sub_pd(p[h].x, xs[h]);
+            const __m256d dy = _mm256_sub_pd(p[h].y, ys[h]);
+            const __m256d dz = _mm256_sub_pd(p[h].z, zs[h]);
+            __m256d r2 = _mm256_mul_pd(dx, dx);
+            r2 = _mm256_fmadd_pd(dy, dy, r2);
+            r2 = _mm256_fmadd_pd(dz, dz, r2);
+            const __m256d prefact = _mm256_div_pd(one256, _mm256_mul_pd(_mm256_sqrt_pd(r2), r2));
+            const __m256d prefacti = _mm256_mul_pd(prefact, ms[h]);
+            p[h].vx = _mm256_fnmadd_pd(prefacti, dx, p[h].vx); 
+            p[h].vy = _mm256_fnmadd_pd(prefacti, dy, p[h].vy); 
+            p[h].vz = _mm256_fnmadd_pd(prefacti, dz, p[h].vz); 
+            // Back reaction onto planet i+s
+            const __m256d prefactj = _mm256_mul_pd(prefact, m[h]);
+            bx[h] = _mm256_mul_pd(prefactj, dx);
+            by[h] = _mm256_mul_pd(prefactj, dy);
+            bz[h] = _mm256_mul_pd(prefactj, dz);
+        }
+        if (s<4){ // For s=4 both directions are included above
+            reb_whfast512_avx2_rotate(bx[0], bx[1], 8-s, &bx[0], &bx[1]);
+            reb_whfast512_avx2_rotate(by[0], by[1], 8-s, &by[0], &by[1]);
+            reb_whfast512_avx2_rotate(bz[0], bz[1], 8-s, &bz[0], &bz[1]);
+            for (int h=0; h<2; h++){
+                p[h].vx = _mm256_add_pd(p[h].vx, bx[h]);
+                p[h].vy = _mm256_add_pd(p[h].vy, by[h]);
+                p[h].vz = _mm256_add_pd(p[h].vz, bz[h]);
+            }
+        }
+    }
+    reb_whfast512_avx2_store(p_jh, &p[0], 0);
+    reb_whfast512_avx2_store(p_jh, &p[1], 1);
+}
+
+// Performs one full interaction step for the test particles.
+static void reb_whfast512_avx2_interaction_step_testparticles(struct reb_simulation * r, double dt){
+    struct reb_simulation_integrator_whfast512* const ri_whfast512 = &(r->ri_whfast512);
+    const struct reb_particle_avx512* restrict p_jh = ri_whfast512->p_jh;
+    struct reb_particle_avx512* restrict p_jh_tp = ri_whfast512->p_jh_tp;
+    const int N_groups = (ri_whfast512->allocated_N_testparticles+7)/8;
+    const int N_planets = r->N_active - 1;
+    const int gr_potential = ri_whfast512->gr_potential;
+    const __m256d dt256 = _mm256_set1_pd(dt); 
+
+#pragma omp parallel for
+    for (int g=0; g<N_groups; g++){
+        for (int h=0; h<2; h++){
+            struct reb_particle_avx2 tp;
+            reb_whfast512_avx2_load(&tp, &p_jh_tp[g], h);
+            if (gr_potential){
+                __m256d r2 = _mm256_mul_pd(tp.x, tp.x);
+                r2 = _mm256_fmadd_pd(tp.y, tp.y, r2);
+                r2 = _mm256_fmadd_pd(tp.z, tp.z, r2);
+                const __m256d r4 = _mm256_mul_pd(r2, r2);
+                __m256d prefac = _mm256_div_pd(gr_prefac256,r4);
+                prefac = _mm256_mul_pd(prefac, dt256);
+                tp.vx = _mm256_fnmadd_pd(prefac, tp.x, tp.vx);
+                tp.vy = _mm256_fnmadd_pd(prefac, tp.y, tp.vy);
+                tp.vz = _mm256_fnmadd_pd(prefac, tp.z, tp.vz);
+            }
+            for (int j=0; j<N_planets; j++){
+                const __m256d dx = _mm256_sub_pd(tp.x, _mm256_set1_pd(p_jh->x[j]));
+                const __m256d dy = _mm256_sub_pd(tp.y, _mm256_set1_pd(p_jh->y[j]));
+                const __m256d dz = _mm256_sub_pd(tp.z, _mm256_set1_pd(p_jh->z[j]));
+                __m256d r2 = _mm256_mul_pd(dx, dx);
+                r2 = _mm256_fmadd_pd(dy, dy, r2);
+                r2 = _mm256_fmadd_pd(dz, dz, r2);
+                const __m256d prefact = _mm256_div_pd(_mm256_set1_pd(p_jh->m[j]*dt), _mm256_mul_pd(_mm256_sqrt_pd(r2), r2));
+                tp.vx = _mm256_fnmadd_pd(prefact, dx, tp.vx); 
+                tp.vy = _mm256_fnmadd_pd(prefact, dy, tp.vy); 
+                tp.vz = _mm256_fnmadd_pd(prefact, dz, tp.vz); 
+            }
+            reb_whfast512_avx2_store(&p_jh_tp[g], &tp, h);
+        }
+    }
+}
+
+// Performs one complete jump step
+static void reb_whfast512_avx2_jump_step(struct reb_simulation* r, const double _dt){
+    struct reb_simulation_integrator_whfast512* ri_whfast512 = &(r->ri_whfast512);
+    const int N_groups = 1 + (ri_whfast512->allocated_N_testparticles+7)/8;
+    const struct reb_particle_avx512* const p_jh = ri_whfast512->p_jh;
+    const __m256d pf256 = _mm256_set1_pd(_dt/r->particles[0].m);
+    __m256d m[2], sumx, sumy, sumz;
+    m[0] = _mm256_loadu_pd(&p_jh->m[0]);
+    m[1] = _mm256_loadu_pd(&p_jh->m[4]);
+    sumx = reb_whfast512_avx2_sum(_mm256_mul_pd(m[0], _mm256_loadu_pd(&p_jh->vx[0])), _mm256_mul_pd(m[1], _mm256_loadu_pd(&p_jh->vx[4])));
+    sumy = reb_whfast512_avx2_sum(_mm256_mul_pd(m[0], _mm256_loadu_pd(&p_jh->vy[0])), _mm256_mul_pd(m[1], _mm256_loadu_pd(&p_jh->vy[4])));
+    sumz = reb_whfast512_avx2_sum(_mm256_mul_pd(m[0], _mm256_loadu_pd(&p_jh->vz[0])), _mm256_mul_pd(m[1], _mm256_loadu_pd(&p_jh->vz[4])));
+    // Test particles do not contribute to the momentum of the star
+    for (int g=0; g<N_groups; g++){
+        struct reb_particle_avx512* const p512 = g?&ri_whfast512->p_jh_tp[g-1]:ri_whfast512->p_jh;
+        for (int h=0; h<2; h++){
+            _mm256_storeu_pd(&p512->x[4*h], _mm256_fmadd_pd(sumx, pf256, _mm256_loadu_pd(&p512->x[4*h])));
+            _mm256_storeu_pd(&p512->y[4*h], _mm256_fmadd_pd(sumy, pf256, _mm256_loadu_pd(&p512->y[4*h])));
+            _mm256_storeu_pd(&p512->z[4*h], _mm256_fmadd_pd(sumz, pf256, _mm256_loadu_pd(&p512->z[4*h])));
+        }
+    }
+}
+
+// Precalculate various constants and put them in 256 bit vectors.
+static void reb_whfast512_avx2_recalculate_constants(struct reb_simulation* r){
+    const int N_active = (r->N_active==-1)?r->N:r->N_active;
+    half256 = _mm256_set1_pd(0.5); 
+    one256 = _mm256_add_pd(half256, half256); 
+    two256 = _mm256_add_pd(one256, one256); 
+    five256 = _mm256_set1_pd(5.); 
+    sixteen256 = _mm256_set1_pd(16.); 
+    twenty256 = _mm256_set1_pd(20.); 
+    for(int i=0;i<35;i++){
+        invfactorial256[i] = _mm256_set1_pd(invfactorial[i]); 
+    }
+    _M256 = _mm256_set1_pd(r->particles[0].m); 
+
+    // GR prefactors. Note: assumes units of AU, year/2pi.
+    double c = 10065.32;
+    gr_prefac256 = _mm256_set1_pd(6.*r->particles[0].m*r->particles[0].m/(c*c));
+    for(int i=1;i<9;i++){
+        gr_prefac2_avx2[i-1] = i<N_active ? r->particles[i].m/r->particles[0].m : 0.;
+    }
+    r->ri_whfast512.recalculate_constants = 0;
+}
+
+#ifdef __clang__
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+
+// Returns 1 if the CPU supports the instructions used in the AVX2 implementation.
+static int reb_whfast512_avx2_available(){
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+
+// Convert inertial coordinates to democratic heliocentric coordinates.
+// Unused lanes are filled in the same way as in the AVX512 version.
+static void reb_whfast512_avx2_inertial_to_democraticheliocentric_posvel(struct reb_simulation* r){
+    struct reb_simulation_integrator_whfast512* const ri_whfast512 = &(r->ri_whfast512);
+    const struct reb_particle* const particles = r->particles;
+    struct reb_particle_avx512* const p_jh = ri_whfast512->p_jh;
+    struct reb_particle_avx512* const p_jh_tp = ri_whfast512->p_jh_tp;
+    const int N = r->N;
+    const int N_active = (r->N_active==-1)?r->N:r->N_active;
+    struct reb_particle p0 = {0};
+    for (int i=0; i<N_active; i++){
+        p0.m  += particles[i].m;
+        p0.x  += particles[i].m*particles[i].x;
+        p0.y  += particles[i].m*particles[i].y;
+        p0.z  += particles[i].m*particles[i].z;
+        p0.vx += particles[i].m*particles[i].vx;
+        p0.vy += particles[i].m*particles[i].vy;
+        p0.vz += particles[i].m*particles[i].vz;
+    }
+    p0.x /= p0.m;
+    p0.y /= p0.m;
+    p0.z /= p0.m;
+    p0.vx /= p0.m;
+    p0.vy /= p0.m;
+    p0.vz /= p0.m;
+    ri_whfast512->p_jh0 = p0;
+    for (int i=1; i<9; i++){
+        if (i<N_active){
+            p_jh->m[i-1]  = particles[i].m;
+            p_jh->x[i-1]  = particles[i].x - particles[0].x;
+            p_jh->y[i-1]  = particles[i].y - particles[0].y;
+            p_jh->z[i-1]  = particles[i].z - particles[0].z;
+            p_jh->vx[i-1] = particles[i].vx - p0.vx;
+            p_jh->vy[i-1] = particles[i].vy - p0.vy;
+            p_jh->vz[i-1] = particles[i].vz - p0.vz;
+        }else{
+            p_jh->m[i-1]  = 0.;
+            p_jh->x[i-1]  = 100+i - particles[0].x;
+            p_jh->y[i-1]  = 100+i - particles[0].y;
+            p_jh->z[i-1]  = 100+i - particles[0].z;
+            p_jh->vx[i-1] = -p0.vx;
+            p_jh->vy[i-1] = -p0.vy;
+            p_jh->vz[i-1] = -p0.vz;
+        }
+    }
+    const int N_tp = N - N_active;
+    for (int g=0; g<(N_tp+7)/8; g++){
+        for (int l=0; l<8; l++){
+            const int i = N_active + 8*g + ((8*g+l<N_tp)?l:0);
+            p_jh_tp[g].m[l]  = 0.;
+            p_jh_tp[g].x[l]  = particles[i].x - particles[0].x;
+            p_jh_tp[g].y[l]  = particles[i].y - particles[0].y;
+            p_jh_tp[g].z[l]  = particles[i].z - particles[0].z;
+            p_jh_tp[g].vx[l] = particles[i].vx - p0.vx;
+            p_jh_tp[g].vy[l] = particles[i].vy - p0.vy;
+            p_jh_tp[g].vz[l] = particles[i].vz - p0.vz;
+        }
+    }
+}
+
+// Convert democratic heliocentric coordinates to inertial coordinates
+static void reb_whfast512_avx2_democraticheliocentric_to_inertial_posvel(struct reb_simulation* r){
+    struct reb_simulation_integrator_whfast512* const ri_whfast512 = &(r->ri_whfast512);
+    struct reb_particle* const particles = r->particles;
+    const struct reb_particle_avx512* const p_jh = ri_whfast512->p_jh;
+    const struct reb_particle_avx512* const p_jh_tp = ri_whfast512->p_jh_tp;
+    const struct reb_particle p0 = ri_whfast512->p_jh0;
+    const int N = r->N;
+    const int N_active = (r->N_active==-1)?r->N:r->N_active;
+    const double m0 = particles[0].m;
+    double sx = 0, sy = 0, sz = 0, svx = 0, svy = 0, svz = 0;
+    for (int i=1; i<N_active; i++){
+        sx  += p_jh->m[i-1]*p_jh->x[i-1];
+        sy  += p_jh->m[i-1]*p_jh->y[i-1];
+        sz  += p_jh->m[i-1]*p_jh->z[i-1];
+        svx += p_jh->m[i-1]*p_jh->vx[i-1];
+        svy += p_jh->m[i-1]*p_jh->vy[i-1];
+        svz += p_jh->m[i-1]*p_jh->vz[i-1];
+    }
+    particles[0].x  = p0.x - sx/p0.m;
+    particles[0].y  = p0.y - sy/p0.m;
+    particles[0].z  = p0.z - sz/p0.m;
+    particles[0].vx = p0.vx - svx/m0;
+    particles[0].vy = p0.vy - svy/m0;
+    particles[0].vz = p0.vz - svz/m0;
+    for (int i=1; i<N; i++){
+        const struct reb_particle_avx512* const p512 = i<N_active?p_jh:&p_jh_tp[(i-N_active)/8];
+        const int l = i<N_active?i-1:(i-N_active)%8;
+        particles[i].x  = p512->x[l] + particles[0].x;
+        particles[i].y  = p512->y[l] + particles[0].y;
+        particles[i].z  = p512->z[l] + particles[0].z;
+        particles[i].vx = p512->vx[l] + p0.vx;
+        particles[i].vy = p512->vy[l] + p0.vy;
+        particles[i].vz = p512->vz[l] + p0.vz;
+    }
+}
+
+// Performs one full centre of mass step (H_0)
+static void reb_whfast512_avx2_com_step(struct reb_simulation* r, const double _dt){
+    r->ri_whfast512.p_jh0.x += _dt*r->ri_whfast512.p_jh0.vx;
+    r->ri_whfast512.p_jh0.y += _dt*r->ri_whfast512.p_jh0.vy;
+    r->ri_whfast512.p_jh0.z += _dt*r->ri_whfast512.p_jh0.vz;
+}
+
+#endif // WHFAST512_AVX2
+
+// Main integration routine (AVX2 version)
 void reb_integrator_whfast512_part1(struct reb_simulation* const r){
+#ifdef WHFAST512_AVX2
+    if (reb_whfast512_avx2_available()){
+        struct reb_simulation_integrator_whfast512* const ri_whfast512 = &(r->ri_whfast512);
+        const double dt = r->dt;
+        if (ri_whfast512->allocated_N==0 && !reb_whfast512_allocate(r)){
+            return;
+        }
+        if (ri_whfast512->recalculate_constants){
+            reb_whfast512_avx2_recalculate_constants(r);
+        } 
+        if (ri_whfast512->is_synchronized){
+            reb_whfast512_avx2_inertial_to_democraticheliocentric_posvel(r);
+            // First half DRIFT step
+            reb_whfast512_avx2_kepler_step(r, dt/2.);    
+            reb_whfast512_avx2_com_step(r, dt/2.);
+        }else{
+            // Combined DRIFT step
+            reb_whfast512_avx2_kepler_step(r, dt);
+            reb_whfast512_avx2_com_step(r, dt);
+        }
+        reb_whfast512_avx2_jump_step(r, ri_whfast512->gr_potential?dt/2.:dt);
+        reb_whfast512_avx2_interaction_step(r, dt);
+        reb_whfast512_avx2_interaction_step_testparticles(r, dt);
+        if (ri_whfast512->gr_potential){
+            reb_whfast512_avx2_jump_step(r, dt/2.);
+        }
+        ri_whfast512->is_synchronized = 0;
+        r->t += dt;
+        r->dt_last_done = dt;
+        return;
+    }
+#endif // WHFAST512_AVX2
     reb_error(r, "WHFast512 is not available. Please make sure your CPU supports AVX512 instructions, then recompile REBOUND with the AVX512 option turned on in the Makefile or setup.py file.");
     r->status = REB_EXIT_ERROR;
 }
+
+// Dummy function when AVX512 is not available
+enum REB_STATUS reb_whfast512_ensemble_integrate(struct reb_simulation** const sims, const int N_sims, const double tmax){
+    for (int s=0; s<N_sims; s++){
+        reb_error(sims[s], "WHFast512 is not available. Please make sure your CPU supports AVX512 instructions, then recompile REBOUND with the AVX512 option turned on in the Makefile or setup.py file.");
+        sims[s]->status = REB_EXIT_ERROR;
+    }
+    return REB_EXIT_ERROR;
+}
 #endif // AVX512
 
 // Synchronization routine. Called every time an output is needed.
@@ -789,7 +1812,9 @@ void reb_integrator_whfast512_synchronize(struct reb_simulation* const r){
     if (ri_whfast512->is_synchronized == 0){
 #ifdef AVX512
         struct reb_particle_avx512* sync_pj = NULL;
+        struct reb_particle_avx512* sync_pj_tp = NULL;
         struct reb_particle sync_pj0 = {0};
+        const size_t size_tp = sizeof(struct reb_particle_avx512)*((ri_whfast512->allocated_N_testparticles+7)/8);
         if (ri_whfast512->recalculate_constants){ 
             // Needed if no step has ever been done before (like SA)
             recalculate_constants(r);
@@ -797,6 +1822,10 @@ void reb_integrator_whfast512_synchronize(struct reb_simulation* const r){
         if (ri_whfast512->keep_unsynchronized){
             sync_pj = aligned_alloc(64,sizeof(struct reb_particle_avx512));
             memcpy(sync_pj,ri_whfast512->p_jh, sizeof(struct reb_particle_avx512));
+            if (size_tp){
+                sync_pj_tp = aligned_alloc(64,size_tp);
+                memcpy(sync_pj_tp,ri_whfast512->p_jh_tp, size_tp);
+            }
             sync_pj0 = ri_whfast512->p_jh0;
         }
         reb_whfast512_kepler_step(r, r->dt/2.);    
@@ -804,19 +1833,59 @@ void reb_integrator_whfast512_synchronize(struct reb_simulation* const r){
         democraticheliocentric_to_inertial_posvel(r);
         if (ri_whfast512->keep_unsynchronized){
             memcpy(ri_whfast512->p_jh, sync_pj, sizeof(struct reb_particle_avx512));
+            if (size_tp){
+                memcpy(ri_whfast512->p_jh_tp, sync_pj_tp, size_tp);
+            }
             ri_whfast512->p_jh0 = sync_pj0;
             free(sync_pj);
+            free(sync_pj_tp);
         }else{
             ri_whfast512->is_synchronized = 1;
         }
 #else // No AVX512 available
+#ifdef WHFAST512_AVX2
+        if (reb_whfast512_avx2_available()){
+            struct reb_particle_avx512* sync_pj = NULL;
+            struct reb_particle_avx512* sync_pj_tp = NULL;
+            struct reb_particle sync_pj0 = {0};
+            const size_t size_tp = sizeof(struct reb_particle_avx512)*((ri_whfast512->allocated_N_testparticles+7)/8);
+            if (ri_whfast512->recalculate_constants){ 
+                reb_whfast512_avx2_recalculate_constants(r);
+            } 
+            if (ri_whfast512->keep_unsynchronized){
+                sync_pj = aligned_alloc(64,sizeof(struct reb_particle_avx512));
+                memcpy(sync_pj,ri_whfast512->p_jh, sizeof(struct reb_particle_avx512));
+                if (size_tp){
+                    sync_pj_tp = aligned_alloc(64,size_tp);
+                    memcpy(sync_pj_tp,ri_whfast512->p_jh_tp, size_tp);
+                }
+                sync_pj0 = ri_whfast512->p_jh0;
+            }
+            reb_whfast512_avx2_kepler_step(r, r->dt/2.);    
+            reb_whfast512_avx2_com_step(r, r->dt/2.);
+            reb_whfast512_avx2_democraticheliocentric_to_inertial_posvel(r);
+            if (ri_whfast512->keep_unsynchronized){
+                memcpy(ri_whfast512->p_jh, sync_pj, sizeof(struct reb_particle_avx512));
+                if (size_tp){
+                    memcpy(ri_whfast512->p_jh_tp, sync_pj_tp, size_tp);
+                }
+                ri_whfast512->p_jh0 = sync_pj0;
+                free(sync_pj);
+                free(sync_pj_tp);
+            }else{
+                ri_whfast512->is_synchronized = 1;
+            }
+            return;
+        }
+#endif // WHFAST512_AVX2
       // Using WHFast as a workaround.
       // Not bit-wise reproducible. 
         struct reb_simulation_integrator_whfast* const ri_whfast = &(r->ri_whfast);
         reb_warning(r, "WHFast512 is not available. Synchronization is provided using WHFast and is not bit-compatible to WHFast512.");
         reb_integrator_whfast_init(r);
         ri_whfast->p_jh[0] = ri_whfast512->p_jh0;
-        for (int i=1;i<r->N;i++){
+        const int N_active = r->N - ri_whfast512->allocated_N_testparticles;
+        for (int i=1;i<N_active;i++){
             ri_whfast->p_jh[i].m = ri_whfast512->p_jh->m[i-1];
             ri_whfast->p_jh[i].x = ri_whfast512->p_jh->x[i-1];
             ri_whfast->p_jh[i].y = ri_whfast512->p_jh->y[i-1];
@@ -825,6 +1894,17 @@ void reb_integrator_whfast512_synchronize(struct reb_simulation* const r){
             ri_whfast->p_jh[i].vy = ri_whfast512->p_jh->vy[i-1];
             ri_whfast->p_jh[i].vz = ri_whfast512->p_jh->vz[i-1];
         }
+        for (int i=N_active;i<r->N;i++){
+            const struct reb_particle_avx512* const tp = &ri_whfast512->p_jh_tp[(i-N_active)/8];
+            const int l = (i-N_active)%8;
+            ri_whfast->p_jh[i].m = r->particles[i].m;
+            ri_whfast->p_jh[i].x = tp->x[l];
+            ri_whfast->p_jh[i].y = tp->y[l];
+            ri_whfast->p_jh[i].z = tp->z[l];
+            ri_whfast->p_jh[i].vx = tp->vx[l];
+            ri_whfast->p_jh[i].vy = tp->vy[l];
+            ri_whfast->p_jh[i].vz = tp->vz[l];
+        }
         ri_whfast->coordinates = REB_WHFAST_COORDINATES_DEMOCRATICHELIOCENTRIC;
         ri_whfast->is_synchronized = 0;
         reb_integrator_whfast_synchronize(r);
@@ -843,6 +1923,9 @@ void reb_integrator_whfast512_reset(struct reb_simulation* const r){
     }
     ri_whfast512->p_jh = NULL;
     ri_whfast512->allocated_N = 0;
+    free(ri_whfast512->p_jh_tp);
+    ri_whfast512->p_jh_tp = NULL;
+    ri_whfast512->allocated_N_testparticles = 0;
     ri_whfast512->gr_potential = 0;
     ri_whfast512->is_synchronized = 1;
     ri_whfast512->keep_unsynchronized = 0;
@@ -0,0 +1,178 @@
+/**
+ * @file 	memory.c
+ * @brief 	Accounting of the memory allocated by a simulation.
+ * @author 	Hanno Rein <hanno@hanno-rein.de>
+ *
+ * @details 	The memory used by every subsystem is calculated from the 
+ * allocated sizes which are stored next to every buffer that lives longer
+ * than a single function call. Temporary buffers are not included.
+ *
+ * @section LICENSE
+ * Copyright (c) 2023 Hanno Rein
+ *
+ * This file is part of rebound.
+ *
+ * rebound is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rebound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rebound.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rebound.h"
+#include "memory.h"
+#include "tree.h"
+#include "compact.h"
+
+static const char* reb_memory_names[REB_MEMORY_N] = {
+    "particles",
+    "lookup table",
+    "gravity",
+    "tree",
+    "collision",
+    "boundary",
+    "integrator",
+    "mpi",
+    "display",
+    "other",
+};
+
+// Number of extrapolation stages of the BS integrator (see integrator_bs.c).
+#define REB_MEMORY_BS_SEQUENCE_LENGTH 9
+
+static size_t reb_memory_integrator(const struct reb_simulation* const r){
+    size_t bytes = 0;
+    // IAS15: seven arrays and six reb_dp7s with seven arrays each. Every dp7 array is padded to a multiple of 8.
+    const struct reb_simulation_integrator_ias15* const ri_ias15 = &r->ri_ias15;
+    if (ri_ias15->allocatedN>0){
+        bytes += sizeof(double)*7*ri_ias15->allocatedN;
+        bytes += sizeof(double)*6*7*((ri_ias15->allocatedN+7)/8*8);
+    }
+    bytes += sizeof(int)*ri_ias15->map_allocated_N;
+    // WHFast and SABA
+    bytes += sizeof(struct reb_particle)*(r->ri_whfast.allocated_N + r->ri_whfast.allocated_Ntemp);
+    // WHFast512
+    if (r->ri_whfast512.allocated_N){
+        bytes += sizeof(struct reb_particle_avx512)*(1+(r->ri_whfast512.allocated_N_testparticles+7)/8);
+    }
+    // MERCURIUS
+    const struct reb_simulation_integrator_mercurius* const rim = &r->ri_mercurius;
+    bytes += (sizeof(struct reb_particle)+sizeof(int))*rim->allocatedN;
+    bytes += sizeof(struct reb_particle)*rim->allocatedN_additionalforces;
+    bytes += sizeof(double)*rim->dcrit_allocatedN;
+    bytes += sizeof(int)*2*rim->encounter_pairs_allocatedN;
+    // JANUS
+    bytes += sizeof(struct reb_particle_int)*r->ri_janus.allocated_N;
+    // TES: all arrays are taken from one memory pool
+    bytes += r->ri_tes.pool_size;
+    // Block timesteps
+    bytes += (sizeof(unsigned int)+sizeof(unsigned long long)+sizeof(struct reb_vec3d)+sizeof(struct reb_particle)+sizeof(int))*r->ri_block.allocatedN;
+    // ODEs, including the N-body ODE of BS
+    for (int i=0;i<r->odes_N;i++){
+        bytes += sizeof(struct reb_ode) + sizeof(double)*(7+REB_MEMORY_BS_SEQUENCE_LENGTH)*r->odes[i]->allocatedN;
+    }
+    return bytes;
+}
+
+static size_t reb_memory_display(const struct reb_simulation* const r){
+    const struct reb_display_data* const data = r->display_data;
+    if (data==NULL){
+        return 0;
+    }
+    size_t bytes = sizeof(struct reb_display_data);
+    bytes += (sizeof(struct reb_particle_opengl)+sizeof(struct reb_orbit_opengl))*data->allocated_N;
+    bytes += sizeof(struct reb_orbit_invariants)*data->allocated_N_orbit_invariants;
+    for (int i=0;i<3;i++){
+        bytes += sizeof(struct reb_particle)*(data->snapshots[i].allocated_N + data->snapshots[i].allocated_N_whfast);
+    }
+    return bytes;
+}
+
+void reb_memory_usage(const struct reb_simulation* const r, struct reb_memory_report* const report){
+    memset(report, 0, sizeof(struct reb_memory_report));
+    size_t* const bytes = report->bytes;
+
+    bytes[REB_MEMORY_PARTICLES] = sizeof(struct reb_particle)*r->allocatedN + sizeof(int)*2*r->frozen_swaps_allocatedN
+        + reb_compact_memory(&r->compact);
+    bytes[REB_MEMORY_LOOKUP] = sizeof(struct reb_hash_pointer_pair)*r->allocatedN_lookup;
+
+    bytes[REB_MEMORY_GRAVITY] = sizeof(struct reb_vec3d)*r->gravity_cs_allocatedN
+        + sizeof(double)*5*r->particles_soa_allocatedN
+        + sizeof(double)*9*r->gravity_gpu_allocatedN
+        + sizeof(int)*r->gravity_tree_cost_N
+        + sizeof(double)*9*r->additional_forces_soa_allocatedN;
+
+    if (r->tree_root){
+        bytes[REB_MEMORY_TREE] += sizeof(struct reb_treecell*)*r->root_n;
+    }
+    bytes[REB_MEMORY_TREE] += (sizeof(struct reb_treecell*)+sizeof(struct reb_treecell)*REB_TREE_CELLS_PER_CHUNK)*r->tree_cells_chunks_N
+        + sizeof(struct reb_tree_key)*r->tree_keys_allocatedN;
+
+    bytes[REB_MEMORY_COLLISION] = sizeof(struct reb_collision)*r->collisions_allocatedN
+        + sizeof(int)*(r->collision_grid_bucket_allocatedN + r->collision_grid_particles_allocatedN)
+        + (sizeof(int)+2*sizeof(double))*r->collision_sap_allocatedN
+        + (2*sizeof(int)+6*sizeof(double))*(2*r->collision_bvh_allocatedN)
+        + sizeof(double)*7*r->collision_line_soa_allocatedN
+        + sizeof(double)*6*r->collision_line_xv0_allocatedN
+        + sizeof(double)*31*r->collision_line_poly_allocatedN
+        + sizeof(double)*7*r->collision_gpu_allocatedN
+        + sizeof(int)*2*r->collision_gpu_pairs_allocatedN
+        + sizeof(int)*3*r->collision_neighbours_allocatedN
+        + sizeof(double)*4*r->collision_neighbours_x_allocatedN;
+
+    bytes[REB_MEMORY_BOUNDARY] = sizeof(struct reb_ghostbox)*r->ghostboxes_allocatedN;
+
+    bytes[REB_MEMORY_INTEGRATOR] = reb_memory_integrator(r);
+
+#ifdef MPI
+    if (r->particles_send_Nmax){
+        for (int i=0;i<r->mpi_num;i++){
+            bytes[REB_MEMORY_MPI] += sizeof(struct reb_particle)*(r->particles_send_Nmax[i] + r->particles_recv_Nmax[i]);
+            bytes[REB_MEMORY_MPI] += sizeof(int)*(r->particles_send_Nmax[i] + r->particles_recv_Nmax[i]);
+            bytes[REB_MEMORY_MPI] += sizeof(struct reb_treecell)*(r->tree_essential_send_Nmax[i] + r->tree_essential_recv_Nmax[i]);
+        }
+    }
+#endif // MPI
+
+    bytes[REB_MEMORY_DISPLAY] = reb_memory_display(r);
+
+    bytes[REB_MEMORY_OTHER] = sizeof(struct reb_variational_configuration)*r->var_config_N;
+    for (int t=0;t<r->profiling_threads_N;t++){
+        bytes[REB_MEMORY_OTHER] += sizeof(struct reb_profiling_thread) + sizeof(struct reb_profiling_event)*r->profiling_threads[t].trace_allocated_N;
+    }
+
+    for (int i=0;i<REB_MEMORY_N;i++){
+        report->total += bytes[i];
+    }
+}
+
+const char* reb_memory_name(const enum REB_MEMORY subsystem){
+    if (subsystem<0 || subsystem>=REB_MEMORY_N) return NULL;
+    return reb_memory_names[subsystem];
+}
+
+void reb_memory_check(struct reb_simulation* const r){
+    struct reb_memory_report report;
+    reb_memory_usage(r, &report);
+    int grown = 0;
+    for (int i=0;i<REB_MEMORY_N;i++){
+        if (report.bytes[i]>r->memory_report_last.bytes[i]){
+            grown = 1;
+        }
+    }
+    r->memory_report_last = report;
+    if (grown){
+        r->memory_grown(r, &report);
+    }
+}
@@ -0,0 +1,35 @@
+/**
+ * @file 	memory.h
+ * @brief 	Accounting of the memory allocated by a simulation.
+ * @author 	Hanno Rein <hanno@hanno-rein.de>
+ *
+ * @section LICENSE
+ * Copyright (c) 2023 Hanno Rein
+ *
+ * This file is part of rebound.
+ *
+ * rebound is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rebound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rebound.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef _MEMORY_H
+#define _MEMORY_H
+#include "rebound.h"
+
+/**
+ * @brief Calls r->memory_grown if any subsystem uses more memory than at the last call.
+ * @details Called at the end of every timestep if r->memory_grown is set.
+ */
+void reb_memory_check(struct reb_simulation* const r);
+
+#endif // _MEMORY_H
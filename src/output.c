@@ -29,6 +29,7 @@
 #include <time.h>
 #include <string.h>
 #include <sys/time.h>
+#include <pthread.h>
 #include "particle.h"
 #include "rebound.h"
 #include "tools.h"
@@ -43,6 +44,9 @@
 #include "mpi.h"
 #endif // MPI
 
+#define MIN(a, b) ((a) > (b) ? (b) : (a))    ///< Returns the minimum of a and b
+#define MAX(a, b) ((a) > (b) ? (a) : (b))    ///< Returns the maximum of a and b
+
 /** 
  * @brief Replacement for open_memstream
  */
@@ -81,24 +85,26 @@ int reb_output_check(struct reb_simulation* r, double interval){
 }
 
 
-#ifdef PROFILING
-#warning PROFILING enabled. Rebound is NOT thread-safe.
-double profiling_time_sum[PROFILING_CAT_NUM];
-double profiling_time_initial   = 0;
-double profiling_timing_initial = 0;
-double profiling_time_final     = 0;
-void profiling_start(void){
-    struct timeval tim;
-    gettimeofday(&tim, NULL);
-    profiling_time_initial = tim.tv_sec+(tim.tv_usec/1000000.0);
-}
-void profiling_stop(int cat){
-    struct timeval tim;
-    gettimeofday(&tim, NULL);
-    profiling_time_final = tim.tv_sec+(tim.tv_usec/1000000.0);
-    profiling_time_sum[cat] += profiling_time_final - profiling_time_initial;
-}
-#endif // PROFILING
+// Nesting level of the profiling scopes in the table printed by reb_output_timing().
+static const int reb_output_profiling_level[REB_PROFILING_N] = {
+    [REB_PROFILING_STEP] = 0,
+    [REB_PROFILING_INTEGRATOR_PART1] = 1,
+    [REB_PROFILING_INTEGRATOR_PART2] = 1,
+    [REB_PROFILING_KEPLER] = 2,
+    [REB_PROFILING_INTERACTION] = 2,
+    [REB_PROFILING_JUMP] = 2,
+    [REB_PROFILING_COORDINATES] = 2,
+    [REB_PROFILING_BOUNDARY] = 1,
+    [REB_PROFILING_TREE_BUILD] = 1,
+    [REB_PROFILING_TREE_MOMENTS] = 1,
+    [REB_PROFILING_GRAVITY] = 1,
+    [REB_PROFILING_ADDITIONAL_FORCES] = 1,
+    [REB_PROFILING_COLLISION_SEARCH] = 1,
+    [REB_PROFILING_COLLISION_RESOLVE] = 2,
+    [REB_PROFILING_HEARTBEAT] = 0,
+    [REB_PROFILING_IO] = 0,
+    [REB_PROFILING_MPI] = 2,
+};
 
 void reb_output_timing(struct reb_simulation* r, const double tmax){
     const int N = r->N;
@@ -116,12 +122,11 @@ void reb_output_timing(struct reb_simulation* r, const double tmax){
         r->output_timing_last = temp;
     }else{
         printf("\r");
-#ifdef PROFILING
-        fputs("\033[A\033[2K",stdout);
-        for (int i=0;i<=PROFILING_CAT_NUM;i++){
-            fputs("\033[A\033[2K",stdout);
+        if (r->profiling){
+            for (int i=0;i<=REB_PROFILING_N;i++){
+                fputs("\033[A\033[2K",stdout);
+            }
         }
-#endif // PROFILING
     }
     printf("N_tot= %- 9d  ",N_tot);
     if (r->integrator==REB_INTEGRATOR_SEI){
@@ -134,51 +139,66 @@ void reb_output_timing(struct reb_simulation* r, const double tmax){
     if (tmax>0){
         printf("t/tmax= %5.2f%%",r->t/tmax*100.0);
     }
-#ifdef PROFILING
-    if (profiling_timing_initial==0){
-        struct timeval tim;
-        gettimeofday(&tim, NULL);
-        profiling_timing_initial = tim.tv_sec+(tim.tv_usec/1000000.0);
-    }
-    printf("\nCATEGORY       TIME \n");
-    double _sum = 0;
-    for (int i=0;i<=PROFILING_CAT_NUM;i++){
-        switch (i){
-            case PROFILING_CAT_INTEGRATOR:
-                printf("Integrator     ");
-                break;
-            case PROFILING_CAT_BOUNDARY:
-                printf("Boundary check ");
-                break;
-            case PROFILING_CAT_GRAVITY:
-                printf("Gravity/Forces ");
-                break;
-            case PROFILING_CAT_COLLISION:
-                printf("Collisions     ");
-                break;
-#ifdef OPENGL
-            case PROFILING_CAT_VISUALIZATION:
-                printf("Visualization  ");
-                break;
-#endif // OPENGL
-            case PROFILING_CAT_NUM:
-                printf("Other          ");
-                break;
-        }
-        if (i==PROFILING_CAT_NUM){
-            printf("%5.2f%%",(1.-_sum/(profiling_time_final - profiling_timing_initial))*100.);
-        }else{
-            printf("%5.2f%%\n",profiling_time_sum[i]/(profiling_time_final - profiling_timing_initial)*100.);
-            _sum += profiling_time_sum[i];
+    if (r->profiling){
+        // Scopes at level 0 do not overlap.
+        double total = 0.;
+        for (int i=0;i<REB_PROFILING_N;i++){
+            if (reb_output_profiling_level[i]==0){
+                total += reb_profiling_time(r, i, -1);
+            }
+        }
+        printf("\nSCOPE                    TOTAL     SELF        CALLS");
+#ifdef PERF_EVENTS
+        // Hardware counters are averaged over all timesteps.
+        const unsigned long steps = reb_profiling_calls(r, REB_PROFILING_STEP, -1);
+        printf("    IPC  LLC MISS  INSTR/STEP  MISS/STEP");
+#endif // PERF_EVENTS
+        for (int i=0;i<REB_PROFILING_N;i++){
+            char name[64];
+            sprintf(name, "%*s%s", 2*reb_output_profiling_level[i], "", reb_profiling_name(i));
+            const double time = reb_profiling_time(r, i, -1);
+            const double time_self = reb_profiling_time_self(r, i, -1);
+            printf("\n%-22s %6.2f%%  %6.2f%%  %11lu", name, total>0.?time/total*100.:0., total>0.?time_self/total*100.:0., reb_profiling_calls(r, i, -1));
+#ifdef PERF_EVENTS
+            const double cycles = reb_profiling_counter(r, i, REB_PROFILING_COUNTER_CYCLES, -1);
+            const double instructions = reb_profiling_counter(r, i, REB_PROFILING_COUNTER_INSTRUCTIONS, -1);
+            const double references = reb_profiling_counter(r, i, REB_PROFILING_COUNTER_CACHE_REFERENCES, -1);
+            const double misses = reb_profiling_counter(r, i, REB_PROFILING_COUNTER_CACHE_MISSES, -1);
+            printf("  %5.2f  %7.2f%%  %10.3e  %9.3e", cycles>0.?instructions/cycles:0., references>0.?misses/references*100.:0., steps?instructions/steps:0., steps?misses/steps:0.);
+#endif // PERF_EVENTS
         }
     }
-#endif // PROFILING
     fflush(stdout);
     r->output_timing_last = temp;
 }
 
 
-void reb_output_ascii(struct reb_simulation* r, char* filename){
+// Particles are formatted in chunks of this size. Chunks are independent of
+// each other and are formatted in parallel if OpenMP is enabled. 
+#define REB_OUTPUT_TEXT_CHUNK 4096
+// Upper limit on the number of characters per %e formatted value, including separator.
+#define REB_OUTPUT_TEXT_VALUE_MAX 16
+
+// Formats particles [start, end) into buf. If orbits is not NULL, the 
+// orbital elements are written instead of the positions and velocities.
+// Returns the number of characters written.
+static size_t reb_output_text_chunk(struct reb_simulation* r, char* buf, int start, int end, const struct reb_orbit* const orbits){
+    size_t size = 0;
+    for (int i=start;i<end;i++){
+        if (orbits){
+            const struct reb_orbit o = orbits[i];
+            size += sprintf(buf+size,"%e\t%e\t%e\t%e\t%e\t%e\t%e\t%e\t%e\n",r->t,o.a,o.e,o.inc,o.Omega,o.omega,o.l,o.P,o.f);
+        }else{
+            struct reb_particle p = r->particles[i];
+            size += sprintf(buf+size,"%e\t%e\t%e\t%e\t%e\t%e\n",p.x,p.y,p.z,p.vx,p.vy,p.vz);
+        }
+    }
+    return size;
+}
+
+// Formats all particles into per-chunk buffers and writes them to 
+// the file in order. Orbits are Jacobi elements. 
+static void reb_output_text(struct reb_simulation* r, char* filename, int orbits){
     const int N = r->N;
 #ifdef MPI
     char filename_mpi[1024];
@@ -191,54 +211,101 @@ void reb_output_ascii(struct reb_simulation* r, char* filename){
         reb_error(r, "Can not open file.");
         return;
     }
-    for (int i=0;i<N;i++){
-        struct reb_particle p = r->particles[i];
-        fprintf(of,"%e\t%e\t%e\t%e\t%e\t%e\n",p.x,p.y,p.z,p.vx,p.vy,p.vz);
+    const int start = orbits?1:0; // No orbit for first particle
+    if (N<=start){
+        fclose(of);
+        return;
+    }
+    const int N_chunks = (N-start+REB_OUTPUT_TEXT_CHUNK-1)/REB_OUTPUT_TEXT_CHUNK;
+    const size_t line_max = (orbits?9:6)*REB_OUTPUT_TEXT_VALUE_MAX+1;
+    struct reb_orbit* o = NULL;
+    if (orbits){
+        // Jacobi elements of all particles, calculated in parallel.
+        o = malloc(sizeof(struct reb_orbit)*N);
+        reb_tools_particles_to_orbits_err(r->G, r->particles, NULL, 0, N, o, NULL);
+    }
+    char** bufs = malloc(sizeof(char*)*N_chunks);
+    size_t* sizes = malloc(sizeof(size_t)*N_chunks);
+#pragma omp parallel for schedule(dynamic)
+    for (int c=0;c<N_chunks;c++){
+        const int cstart = start+c*REB_OUTPUT_TEXT_CHUNK;
+        const int cend = cstart+REB_OUTPUT_TEXT_CHUNK<N ? cstart+REB_OUTPUT_TEXT_CHUNK : N;
+        bufs[c] = malloc(line_max*(cend-cstart)+1);
+        sizes[c] = reb_output_text_chunk(r, bufs[c], cstart, cend, o);
     }
+    for (int c=0;c<N_chunks;c++){
+        fwrite(bufs[c], sizes[c], 1, of);
+        free(bufs[c]);
+    }
+    free(bufs);
+    free(sizes);
+    free(o);
     fclose(of);
 }
 
+void reb_output_ascii(struct reb_simulation* r, char* filename){
+    reb_output_text(r, filename, 0);
+}
+
 void reb_output_orbits(struct reb_simulation* r, char* filename){
-    const int N = r->N;
-#ifdef MPI
-    char filename_mpi[1024];
-    sprintf(filename_mpi,"%s_%d",filename,r->mpi_id);
-    FILE* of = fopen(filename_mpi,"a"); 
-#else // MPI
-    FILE* of = fopen(filename,"a"); 
-#endif // MPI
-    if (of==NULL){
-        reb_error(r, "Can not open file.");
-        return;
-    }
-    struct reb_particle com = r->particles[0];
-    for (int i=1;i<N;i++){
-        struct reb_orbit o = reb_tools_particle_to_orbit(r->G, r->particles[i],com);
-        fprintf(of,"%e\t%e\t%e\t%e\t%e\t%e\t%e\t%e\t%e\n",r->t,o.a,o.e,o.inc,o.Omega,o.omega,o.l,o.P,o.f);
-        com = reb_get_com_of_pair(com,r->particles[i]);
+    reb_output_text(r, filename, 1);
+}
+
+// Destination of the binary serialization. If file is set, data is written to 
+// the file. Otherwise, data is copied to buf if it is set. size counts the 
+// number of bytes in either case, so a pass with buf=NULL calculates the size.
+// If particles_skip is set, the PARTICLES field is sized for particles_N 
+// particles but the particle data itself is not written. size then still
+// corresponds to the offset in the final file, particles_offset to the 
+// position of the particle data, and particles_skipped to the number of bytes 
+// missing from buf. This is used for MPI-IO checkpoints.
+// If partial_N is set, only the first partial_N particles and the corresponding
+// integrator data are written. This is used for partial SimulationArchive snapshots.
+struct reb_output_stream {
+    FILE* file;
+    char* buf;
+    size_t allocated;
+    size_t size;
+    int particles_skip;
+    int particles_N;
+    size_t particles_offset;
+    size_t particles_skipped;
+    int partial_N;
+};
+
+static inline void reb_output_stream_put(struct reb_output_stream* s, const void* data, size_t size){
+    if (s->file){
+        fwrite(data, size, 1, s->file);
+    }else if (s->buf){
+        const size_t pos = s->size-s->particles_skipped;
+        if (pos+size>s->allocated){ // Should not happen if size was calculated in first pass.
+            s->allocated = pos+size;
+            s->buf = realloc(s->buf, s->allocated);
+        }
+        memcpy(s->buf+pos, data, size);
     }
-    fclose(of);
+    s->size += size;
 }
 
-void static inline reb_save_dp7(struct reb_dp7* dp7, const int N3, char** bufp, size_t* sizep, size_t* allocatedsize){
-    reb_output_stream_write(bufp, allocatedsize, sizep, dp7->p0,sizeof(double)*N3);
-    reb_output_stream_write(bufp, allocatedsize, sizep, dp7->p1,sizeof(double)*N3);
-    reb_output_stream_write(bufp, allocatedsize, sizep, dp7->p2,sizeof(double)*N3);
-    reb_output_stream_write(bufp, allocatedsize, sizep, dp7->p3,sizeof(double)*N3);
-    reb_output_stream_write(bufp, allocatedsize, sizep, dp7->p4,sizeof(double)*N3);
-    reb_output_stream_write(bufp, allocatedsize, sizep, dp7->p5,sizeof(double)*N3);
-    reb_output_stream_write(bufp, allocatedsize, sizep, dp7->p6,sizeof(double)*N3);
+void static inline reb_save_dp7(struct reb_dp7* dp7, const int N3, struct reb_output_stream* s){
+    reb_output_stream_put(s, dp7->p0,sizeof(double)*N3);
+    reb_output_stream_put(s, dp7->p1,sizeof(double)*N3);
+    reb_output_stream_put(s, dp7->p2,sizeof(double)*N3);
+    reb_output_stream_put(s, dp7->p3,sizeof(double)*N3);
+    reb_output_stream_put(s, dp7->p4,sizeof(double)*N3);
+    reb_output_stream_put(s, dp7->p5,sizeof(double)*N3);
+    reb_output_stream_put(s, dp7->p6,sizeof(double)*N3);
 }
 
-void static inline reb_save_controlVars(controlVars* dp7, const int N3, char** bufp, size_t* sizep, size_t* allocatedsize){
-    reb_output_stream_write(bufp, allocatedsize, sizep, &dp7->size, sizeof(uint32_t));
-    reb_output_stream_write(bufp, allocatedsize, sizep, dp7->p0, dp7->size);
-    reb_output_stream_write(bufp, allocatedsize, sizep, dp7->p1, dp7->size);
-    reb_output_stream_write(bufp, allocatedsize, sizep, dp7->p2, dp7->size);
-    reb_output_stream_write(bufp, allocatedsize, sizep, dp7->p3, dp7->size);
-    reb_output_stream_write(bufp, allocatedsize, sizep, dp7->p4, dp7->size);
-    reb_output_stream_write(bufp, allocatedsize, sizep, dp7->p5, dp7->size);
-    reb_output_stream_write(bufp, allocatedsize, sizep, dp7->p6, dp7->size);
+void static inline reb_save_controlVars(controlVars* dp7, const int N3, struct reb_output_stream* s){
+    reb_output_stream_put(s, &dp7->size, sizeof(uint32_t));
+    reb_output_stream_put(s, dp7->p0, dp7->size);
+    reb_output_stream_put(s, dp7->p1, dp7->size);
+    reb_output_stream_put(s, dp7->p2, dp7->size);
+    reb_output_stream_put(s, dp7->p3, dp7->size);
+    reb_output_stream_put(s, dp7->p4, dp7->size);
+    reb_output_stream_put(s, dp7->p5, dp7->size);
+    reb_output_stream_put(s, dp7->p6, dp7->size);
 }
 
 
@@ -250,30 +317,27 @@ void static inline reb_save_controlVars(controlVars* dp7, const int N3, char** b
         memset(&field,0,sizeof(struct reb_binary_field));\
         field.type = REB_BINARY_FIELD_TYPE_##typename;\
         field.size = (length);\
-        reb_output_stream_write(bufp, &allocatedsize, sizep, &field,sizeof(struct reb_binary_field));\
-        reb_output_stream_write(bufp, &allocatedsize, sizep, value,field.size);\
+        reb_output_stream_put(s, &field,sizeof(struct reb_binary_field));\
+        reb_output_stream_put(s, value,field.size);\
     }
 
 
-void reb_output_binary_to_stream(struct reb_simulation* r, char** bufp, size_t* sizep){
-    size_t allocatedsize = 0;
-    *bufp = NULL;
-    *sizep = 0;
-    // Init integrators. This helps with bit-by-bit reproducibility.
-    reb_integrator_init(r);
-
+// Writes the binary representation of the simulation to s. 
+static void reb_output_binary_serialize(struct reb_simulation* r, struct reb_output_stream* s){
     // Output header.
     char header[64] = "\0";
     int cwritten = sprintf(header,"REBOUND Binary File. Version: %s",reb_version_str);
     snprintf(header+cwritten+1,64-cwritten-1,"%s",reb_githash_str);
-    reb_output_stream_write(bufp, &allocatedsize, sizep, header,sizeof(char)*64);
+    reb_output_stream_put(s, header,sizeof(char)*64);
    
     WRITE_FIELD(T,                  &r->t,                              sizeof(double));
     WRITE_FIELD(G,                  &r->G,                              sizeof(double));
     WRITE_FIELD(SOFTENING,          &r->softening,                      sizeof(double));
     WRITE_FIELD(DT,                 &r->dt,                             sizeof(double));
     WRITE_FIELD(DTLASTDONE,         &r->dt_last_done,                   sizeof(double));
-    WRITE_FIELD(N,                  &r->N,                              sizeof(int));
+    const int N_write = s->partial_N?s->partial_N:r->N; // Number of local particles written
+    const int N = s->particles_skip?s->particles_N:N_write;
+    WRITE_FIELD(N,                  &N,                                 sizeof(int));
     WRITE_FIELD(NVAR,               &r->N_var,                          sizeof(int));
     WRITE_FIELD(VARCONFIGN,         &r->var_config_N,                   sizeof(int));
     WRITE_FIELD(NACTIVE,            &r->N_active,                       sizeof(int));
@@ -281,6 +345,7 @@ void reb_output_binary_to_stream(struct reb_simulation* r, char** bufp, size_t*
     WRITE_FIELD(TESTPARTICLEHIDEWARNINGS, &r->testparticle_hidewarnings,sizeof(int));
     WRITE_FIELD(HASHCTR,            &r->hash_ctr,                       sizeof(int));
     WRITE_FIELD(OPENINGANGLE2,      &r->opening_angle2,                 sizeof(double));
+    WRITE_FIELD(GRAVITYFMMORDER,    &r->gravity_fmm_order,              sizeof(int));
     WRITE_FIELD(STATUS,             &r->status,                         sizeof(int));
     WRITE_FIELD(EXACTFINISHTIME,    &r->exact_finish_time,              sizeof(int));
     WRITE_FIELD(FORCEISVELOCITYDEP, &r->force_is_velocity_dependent,    sizeof(unsigned int));
@@ -290,6 +355,7 @@ void reb_output_binary_to_stream(struct reb_simulation* r, char** bufp, size_t*
     WRITE_FIELD(EXITMAXDISTANCE,    &r->exit_max_distance,              sizeof(double));
     WRITE_FIELD(EXITMINDISTANCE,    &r->exit_min_distance,              sizeof(double));
     WRITE_FIELD(USLEEP,             &r->usleep,                         sizeof(double));
+    WRITE_FIELD(DISPLAYSTRIDE,      &r->display_stride,                 sizeof(int));
     WRITE_FIELD(TRACKENERGYOFFSET,  &r->track_energy_offset,            sizeof(int));
     WRITE_FIELD(ENERGYOFFSET,       &r->energy_offset,                  sizeof(double));
     WRITE_FIELD(BOXSIZE,            &r->boxsize,                        sizeof(struct reb_vec3d));
@@ -307,6 +373,44 @@ void reb_output_binary_to_stream(struct reb_simulation* r, char** bufp, size_t*
     WRITE_FIELD(COLLISIONSPLOG,     &r->collisions_plog,                sizeof(double));
     WRITE_FIELD(MAXRADIUS,          &r->max_radius,                     2*sizeof(double));
     WRITE_FIELD(COLLISIONSNLOG,     &r->collisions_Nlog,                sizeof(long));
+    WRITE_FIELD(COLLISIONSKIPTESTPARTICLEPAIRS, &r->collision_skip_testparticle_pairs, sizeof(int));
+    WRITE_FIELD(COLLISIONGRIDCELLSIZE, &r->collision_grid_cellsize,     sizeof(double));
+    WRITE_FIELD(COLLISIONRESOLVEPARALLEL, &r->collision_resolve_parallel, sizeof(int));
+    WRITE_FIELD(COLLISIONSKIN,      &r->collision_skin,                 sizeof(double));
+    WRITE_FIELD(TRACKCOLLISIONSTATISTICS, &r->track_collision_statistics, sizeof(int));
+    WRITE_FIELD(COLLISIONTIMEOFIMPACT, &r->collision_time_of_impact, sizeof(int));
+    WRITE_FIELD(COLLISIONLINEHERMITE,  &r->collision_line_hermite,   sizeof(int));
+    WRITE_FIELD(COLLISIONLINEIAS15,    &r->collision_line_ias15,     sizeof(int));
+    WRITE_FIELD(SLEEPV,             &r->sleep_v,                        sizeof(double));
+    WRITE_FIELD(SLEEPA,             &r->sleep_a,                        sizeof(double));
+    WRITE_FIELD(SLEEPSTEPS,         &r->sleep_steps,                    sizeof(int));
+    WRITE_FIELD(COMPACTPRECISION,   &r->compact.precision,              sizeof(int));
+    WRITE_FIELD(COMPACTNREMOVED,    &r->compact.N_removed,              sizeof(long));
+    WRITE_FIELD(INJECTRATE,         &r->inject_rate,                    sizeof(double));
+    WRITE_FIELD(INJECTCARRY,        &r->inject_carry,                   sizeof(double));
+    WRITE_FIELD(INJECTPOOL,         &r->inject_pool,                    sizeof(int));
+    WRITE_FIELD(NINJECTED,          &r->N_injected,                     sizeof(long));
+    WRITE_FIELD(SAFULLEVERY,        &r->simulationarchive_full_every,   sizeof(unsigned int));
+    WRITE_FIELD(SAFULLCOUNTER,      &r->simulationarchive_full_counter, sizeof(unsigned long long));
+    WRITE_FIELD(SAFULLT,            &r->simulationarchive_full_t,       sizeof(double));
+    WRITE_FIELD(GRAVITYDETERMINISTIC, &r->gravity_deterministic,        sizeof(int));
+    WRITE_FIELD(GRAVITYTREEFARFIELD, &r->gravity_tree_far_field,       sizeof(int));
+    if (r->compact.N && !s->partial_N){
+        if (r->compact.precision==REB_COMPACT_CHUNKED){
+            WRITE_FIELD(COMPACTORIGIN,  r->compact.origin,                  sizeof(double)*6*((r->compact.N+REB_COMPACT_CHUNK-1)/REB_COMPACT_CHUNK));
+        }
+        WRITE_FIELD(COMPACTXYZ,     r->compact.xyz,                     sizeof(float)*3*r->compact.N);
+        WRITE_FIELD(COMPACTVXYZ,    r->compact.vxyz,                    sizeof(float)*3*r->compact.N);
+        WRITE_FIELD(COMPACTR,       r->compact.r,                       sizeof(float)*r->compact.N);
+        WRITE_FIELD(COMPACTHASH,    r->compact.hash,                    sizeof(uint32_t)*r->compact.N);
+    }
+    WRITE_FIELD(TREEREBUILD,        &r->tree_rebuild,                   sizeof(int));
+    WRITE_FIELD(SPATIALSORTINTERVAL, &r->spatial_sort_interval,         sizeof(int));
+    WRITE_FIELD(USESOA,             &r->use_soa,                        sizeof(int));
+    WRITE_FIELD(SAASYNC,            &r->simulationarchive_async,        sizeof(int));
+    WRITE_FIELD(SACOMPRESS,         &r->simulationarchive_compress,     sizeof(int));
+    WRITE_FIELD(TREEACTIVEONLY,     &r->tree_active_only,               sizeof(int));
+    WRITE_FIELD(TREEGROUPSIZE,      &r->tree_group_size,                sizeof(int));
     WRITE_FIELD(CALCULATEMEGNO,     &r->calculate_megno,                sizeof(int));
     WRITE_FIELD(MEGNOYS,            &r->megno_Ys,                       sizeof(double));
     WRITE_FIELD(MEGNOYSS,           &r->megno_Yss,                      sizeof(double));
@@ -321,11 +425,14 @@ void reb_output_binary_to_stream(struct reb_simulation* r, char** bufp, size_t*
     WRITE_FIELD(SAAUTOWALLTIME,     &r->simulationarchive_auto_walltime, sizeof(double));
     WRITE_FIELD(SANEXT,             &r->simulationarchive_next,         sizeof(double));
     WRITE_FIELD(WALLTIME,           &r->walltime,                       sizeof(double));
-    WRITE_FIELD(COLLISION,          &r->collision,                      sizeof(int));
+    // If a routine is selected automatically, the mode is stored. The routine is selected again after loading.
+    int collision = r->collision_autotune.mode?r->collision_autotune.mode:r->collision;
+    int gravity = r->gravity_autotune.mode?r->gravity_autotune.mode:r->gravity;
+    WRITE_FIELD(COLLISION,          &collision,                         sizeof(int));
     WRITE_FIELD(VISUALIZATION,      &r->visualization,                  sizeof(int));
     WRITE_FIELD(INTEGRATOR,         &r->integrator,                     sizeof(int));
     WRITE_FIELD(BOUNDARY,           &r->boundary,                       sizeof(int));
-    WRITE_FIELD(GRAVITY,            &r->gravity,                        sizeof(int));
+    WRITE_FIELD(GRAVITY,            &gravity,                           sizeof(int));
     WRITE_FIELD(SEI_OMEGA,          &r->ri_sei.OMEGA,                   sizeof(double));
     WRITE_FIELD(SEI_OMEGAZ,         &r->ri_sei.OMEGAZ,                  sizeof(double));
     WRITE_FIELD(SEI_LASTDT,         &r->ri_sei.lastdt,                  sizeof(double));
@@ -337,17 +444,27 @@ void reb_output_binary_to_stream(struct reb_simulation* r, char** bufp, size_t*
     WRITE_FIELD(WHFAST_RECALCJAC,   &r->ri_whfast.recalculate_coordinates_this_timestep, sizeof(unsigned int));
     WRITE_FIELD(WHFAST_SAFEMODE,    &r->ri_whfast.safe_mode,            sizeof(unsigned int));
     WRITE_FIELD(WHFAST_KEEPUNSYNC,  &r->ri_whfast.keep_unsynchronized,  sizeof(unsigned int));
+    WRITE_FIELD(WHFAST_TPPARTITIONS, &r->ri_whfast.testparticle_partitions, sizeof(unsigned int));
+    WRITE_FIELD(WHFAST_KEPLERWARMSTART, &r->ri_whfast.kepler_warmstart, sizeof(unsigned int));
     WRITE_FIELD(WHFAST_ISSYNCHRON,  &r->ri_whfast.is_synchronized,      sizeof(unsigned int));
     WRITE_FIELD(WHFAST_TIMESTEPWARN,&r->ri_whfast.timestep_warning,     sizeof(unsigned int));
-    WRITE_FIELD(WHFAST_PJ,          r->ri_whfast.p_jh,                  sizeof(struct reb_particle)*r->ri_whfast.allocated_N);
+    {
+        const unsigned int allocated_N = s->partial_N && r->ri_whfast.allocated_N>(unsigned int)N_write?(unsigned int)N_write:r->ri_whfast.allocated_N;
+        WRITE_FIELD(WHFAST_PJ,          r->ri_whfast.p_jh,                  sizeof(struct reb_particle)*allocated_N);
+        if (r->ri_whfast.kepler_guess){
+            WRITE_FIELD(WHFAST_KEPLERGUESS, r->ri_whfast.kepler_guess,  sizeof(double)*allocated_N);
+        }
+    }
     WRITE_FIELD(WHFAST_COORDINATES, &r->ri_whfast.coordinates,          sizeof(int));
     WRITE_FIELD(IAS15_EPSILON,      &r->ri_ias15.epsilon,               sizeof(double));
     WRITE_FIELD(IAS15_MINDT,        &r->ri_ias15.min_dt,                sizeof(double));
     WRITE_FIELD(IAS15_EPSILONGLOBAL,&r->ri_ias15.epsilon_global,        sizeof(unsigned int));
     WRITE_FIELD(IAS15_ITERATIONSMAX,&r->ri_ias15.iterations_max_exceeded,sizeof(unsigned long));
     WRITE_FIELD(IAS15_DTMODE,       &r->ri_ias15.dt_mode,               sizeof(unsigned int));
-    if (r->ri_ias15.allocatedN>r->N*3){
-        int N3 = 3*r->N; // Useful to avoid file size increase if particles got removed
+    WRITE_FIELD(IAS15_TPSUBSTEPS,   &r->ri_ias15.testparticle_substeps, sizeof(unsigned int));
+    WRITE_FIELD(IAS15_TPCOMPENSATED, &r->ri_ias15.testparticle_compensated, sizeof(unsigned int));
+    if (r->ri_ias15.allocatedN>N_write*3){
+        int N3 = 3*N_write; // Useful to avoid file size increase if particles got removed
         WRITE_FIELD(IAS15_ALLOCATEDN,   &N3,            sizeof(int));
     }else{
         WRITE_FIELD(IAS15_ALLOCATEDN,   &r->ri_ias15.allocatedN,            sizeof(int));
@@ -360,9 +477,12 @@ void reb_output_binary_to_stream(struct reb_simulation* r, char** bufp, size_t*
     WRITE_FIELD(JANUS_PINT,         r->ri_janus.p_int,                  sizeof(struct reb_particle_int)*r->ri_janus.allocated_N);
     WRITE_FIELD(MERCURIUS_HILLFAC,  &r->ri_mercurius.hillfac,           sizeof(double));
     WRITE_FIELD(MERCURIUS_SAFEMODE, &r->ri_mercurius.safe_mode,         sizeof(unsigned int));
+    WRITE_FIELD(MERCURIUS_SPLITTPONLY, &r->ri_mercurius.split_tponly_encounters, sizeof(unsigned int));
+    WRITE_FIELD(MERCURIUS_KEPLERWARMSTART, &r->ri_mercurius.kepler_warmstart, sizeof(unsigned int));
     WRITE_FIELD(MERCURIUS_ISSYNCHRON, &r->ri_mercurius.is_synchronized, sizeof(unsigned int));
     WRITE_FIELD(MERCURIUS_RECALCULATE_COORD, &r->ri_mercurius.recalculate_coordinates_this_timestep, sizeof(unsigned int));
     WRITE_FIELD(MERCURIUS_DCRIT,    r->ri_mercurius.dcrit,              sizeof(double)*r->ri_mercurius.dcrit_allocatedN);
+    WRITE_FIELD(MERCURIUS_KEPLERGUESS, r->ri_mercurius.kepler_guess,    sizeof(double)*r->ri_mercurius.kepler_guess_allocatedN);
     WRITE_FIELD(MERCURIUS_COMPOS,   &(r->ri_mercurius.com_pos),         sizeof(struct reb_vec3d));
     WRITE_FIELD(MERCURIUS_COMVEL,   &(r->ri_mercurius.com_vel),         sizeof(struct reb_vec3d));
     WRITE_FIELD(PYTHON_UNIT_L,      &r->python_unit_l,                  sizeof(uint32_t));
@@ -390,10 +510,15 @@ void reb_output_binary_to_stream(struct reb_simulation* r, char** bufp, size_t*
     WRITE_FIELD(BS_FIRSTORLASTSTEP, &r->ri_bs.firstOrLastStep,          sizeof(int));
     WRITE_FIELD(BS_PREVIOUSREJECTED,&r->ri_bs.previousRejected,         sizeof(int));
     WRITE_FIELD(BS_TARGETITER,      &r->ri_bs.targetIter,               sizeof(int));
+    WRITE_FIELD(BLOCK_ETA,          &r->ri_block.eta,                   sizeof(double));
+    WRITE_FIELD(BLOCK_MAXLEVEL,     &r->ri_block.max_level,             sizeof(unsigned int));
+    WRITE_FIELD(BLOCK_PARTICLESTEPS,&r->ri_block.particle_steps,        sizeof(unsigned long long));
     int functionpointersused = 0;
     if (r->coefficient_of_restitution ||
         r->collision_resolve ||
+        r->collision_resolve_batch ||
         r->additional_forces ||
+        r->additional_forces_soa ||
         r->heartbeat ||
         r->post_timestep_modifications ||
         r->free_particle_ap){
@@ -404,22 +529,30 @@ void reb_output_binary_to_stream(struct reb_simulation* r, char** bufp, size_t*
         struct reb_binary_field field;
         memset(&field,0,sizeof(struct reb_binary_field));
         field.type = REB_BINARY_FIELD_TYPE_PARTICLES;
-        field.size = sizeof(struct reb_particle)*r->N;
-        reb_output_stream_write(bufp, &allocatedsize, sizep, &field,sizeof(struct reb_binary_field));
-        // output one particle at a time to sanitize pointers.
-        for (int l=0;l<r->N;l++){
-            struct reb_particle op = r->particles[l];
-            op.c = NULL;
-            op.ap = NULL;
-            op.sim = NULL;
-            reb_output_stream_write(bufp, &allocatedsize, sizep, &op,sizeof(struct reb_particle));
+        field.size = sizeof(struct reb_particle)*N;
+        reb_output_stream_put(s, &field,sizeof(struct reb_binary_field));
+        if (s->particles_skip){
+            // Particle data is written separately.
+            s->particles_offset = s->size;
+            s->particles_skipped = field.size;
+            s->size += field.size;
+        }else{
+            // output one particle at a time to sanitize pointers. 
+            // Particles are not copied into a temporary array.
+            for (int l=0;l<N_write;l++){
+                struct reb_particle op = r->particles[l];
+                op.c = NULL;
+                op.ap = NULL;
+                op.sim = NULL;
+                reb_output_stream_put(s, &op,sizeof(struct reb_particle));
+            }
         }
     } 
     if (r->var_config){
         WRITE_FIELD(VARCONFIG,      r->var_config,                      sizeof(struct reb_variational_configuration)*r->var_config_N);
     }
     if (r->ri_ias15.allocatedN){
-        int N3 = 3*r->N; // Only outut useful data (useful if particles got removed)
+        int N3 = 3*N_write; // Only outut useful data (useful if particles got removed)
         WRITE_FIELD(IAS15_AT,   r->ri_ias15.at,     sizeof(double)*N3);
         WRITE_FIELD(IAS15_X0,   r->ri_ias15.x0,     sizeof(double)*N3);
         WRITE_FIELD(IAS15_V0,   r->ri_ias15.v0,     sizeof(double)*N3);
@@ -429,33 +562,33 @@ void reb_output_binary_to_stream(struct reb_simulation* r, char** bufp, size_t*
         WRITE_FIELD(IAS15_CSA0, r->ri_ias15.csa0,   sizeof(double)*N3);
         {
             struct reb_binary_field field = {.type = REB_BINARY_FIELD_TYPE_IAS15_G, .size = sizeof(double)*N3*7};
-            reb_output_stream_write(bufp, &allocatedsize, sizep, &field,sizeof(struct reb_binary_field));
-            reb_save_dp7(&(r->ri_ias15.g),N3,bufp,sizep,&allocatedsize);
+            reb_output_stream_put(s, &field,sizeof(struct reb_binary_field));
+            reb_save_dp7(&(r->ri_ias15.g),N3,s);
         }
         {
             struct reb_binary_field field = {.type = REB_BINARY_FIELD_TYPE_IAS15_B, .size = sizeof(double)*N3*7};
-            reb_output_stream_write(bufp, &allocatedsize, sizep, &field,sizeof(struct reb_binary_field));
-            reb_save_dp7(&(r->ri_ias15.b),N3,bufp,sizep,&allocatedsize);
+            reb_output_stream_put(s, &field,sizeof(struct reb_binary_field));
+            reb_save_dp7(&(r->ri_ias15.b),N3,s);
         }
         {
             struct reb_binary_field field = {.type = REB_BINARY_FIELD_TYPE_IAS15_CSB, .size = sizeof(double)*N3*7};
-            reb_output_stream_write(bufp, &allocatedsize, sizep, &field,sizeof(struct reb_binary_field));
-            reb_save_dp7(&(r->ri_ias15.csb),N3,bufp,sizep,&allocatedsize);
+            reb_output_stream_put(s, &field,sizeof(struct reb_binary_field));
+            reb_save_dp7(&(r->ri_ias15.csb),N3,s);
         }
         {
             struct reb_binary_field field = {.type = REB_BINARY_FIELD_TYPE_IAS15_E, .size = sizeof(double)*N3*7};
-            reb_output_stream_write(bufp, &allocatedsize, sizep, &field,sizeof(struct reb_binary_field));
-            reb_save_dp7(&(r->ri_ias15.e),N3,bufp,sizep,&allocatedsize);
+            reb_output_stream_put(s, &field,sizeof(struct reb_binary_field));
+            reb_save_dp7(&(r->ri_ias15.e),N3,s);
         }
         {
             struct reb_binary_field field = {.type = REB_BINARY_FIELD_TYPE_IAS15_BR, .size = sizeof(double)*N3*7};
-            reb_output_stream_write(bufp, &allocatedsize, sizep, &field,sizeof(struct reb_binary_field));
-            reb_save_dp7(&(r->ri_ias15.br),N3,bufp,sizep,&allocatedsize);
+            reb_output_stream_put(s, &field,sizeof(struct reb_binary_field));
+            reb_save_dp7(&(r->ri_ias15.br),N3,s);
         }
         {
             struct reb_binary_field field = {.type = REB_BINARY_FIELD_TYPE_IAS15_ER, .size = sizeof(double)*N3*7};
-            reb_output_stream_write(bufp, &allocatedsize, sizep, &field,sizeof(struct reb_binary_field));
-            reb_save_dp7(&(r->ri_ias15.er),N3,bufp,sizep,&allocatedsize);
+            reb_output_stream_put(s, &field,sizeof(struct reb_binary_field));
+            reb_save_dp7(&(r->ri_ias15.er),N3,s);
         }
     }
 
@@ -529,50 +662,50 @@ void reb_output_binary_to_stream(struct reb_simulation* r, char** bufp, size_t*
         {
             uint32_t array_size = r->ri_tes.radau->B.size;
             struct reb_binary_field field = {.type = REB_BINARY_FIELD_TYPE_TES_RADAU_B, .size = 7*array_size+sizeof(uint32_t)};
-            reb_output_stream_write(bufp, &allocatedsize, sizep, &field,sizeof(struct reb_binary_field));
-            reb_save_controlVars(&r->ri_tes.radau->B, 3*r->allocatedN,bufp,sizep,&allocatedsize);
+            reb_output_stream_put(s, &field,sizeof(struct reb_binary_field));
+            reb_save_controlVars(&r->ri_tes.radau->B, 3*r->allocatedN,s);
         }
         {
             uint32_t array_size = r->ri_tes.radau->Blast.size;
             struct reb_binary_field field = {.type = REB_BINARY_FIELD_TYPE_TES_RADAU_BLAST, .size = 7*array_size+sizeof(uint32_t)};
-            reb_output_stream_write(bufp, &allocatedsize, sizep, &field,sizeof(struct reb_binary_field));
-            reb_save_controlVars(&r->ri_tes.radau->Blast,3*r->allocatedN,bufp,sizep,&allocatedsize);
+            reb_output_stream_put(s, &field,sizeof(struct reb_binary_field));
+            reb_save_controlVars(&r->ri_tes.radau->Blast,3*r->allocatedN,s);
         }
         {
             uint32_t array_size = r->ri_tes.radau->B_1st.size;
             struct reb_binary_field field = {.type = REB_BINARY_FIELD_TYPE_TES_RADAU_B_1ST, .size = 7*array_size+sizeof(uint32_t)};
-            reb_output_stream_write(bufp, &allocatedsize, sizep, &field,sizeof(struct reb_binary_field));
-            reb_save_controlVars(&r->ri_tes.radau->B_1st,3*r->allocatedN,bufp,sizep,&allocatedsize);
+            reb_output_stream_put(s, &field,sizeof(struct reb_binary_field));
+            reb_save_controlVars(&r->ri_tes.radau->B_1st,3*r->allocatedN,s);
         }
         {
             uint32_t array_size = r->ri_tes.radau->Blast_1st.size;
             struct reb_binary_field field = {.type = REB_BINARY_FIELD_TYPE_TES_RADAU_BLAST_1ST, .size = 7*array_size+sizeof(uint32_t)};
-            reb_output_stream_write(bufp, &allocatedsize, sizep, &field,sizeof(struct reb_binary_field));
-            reb_save_controlVars(&r->ri_tes.radau->Blast_1st,3*r->allocatedN,bufp,sizep,&allocatedsize);
+            reb_output_stream_put(s, &field,sizeof(struct reb_binary_field));
+            reb_save_controlVars(&r->ri_tes.radau->Blast_1st,3*r->allocatedN,s);
         }
         {
             uint32_t array_size = r->ri_tes.radau->cs_B.size;
             struct reb_binary_field field = {.type = REB_BINARY_FIELD_TYPE_TES_RADAU_CS_B, .size = 7*array_size+sizeof(uint32_t)};
-            reb_output_stream_write(bufp, &allocatedsize, sizep, &field,sizeof(struct reb_binary_field));
-            reb_save_controlVars(&r->ri_tes.radau->cs_B,3*r->allocatedN,bufp,sizep,&allocatedsize);
+            reb_output_stream_put(s, &field,sizeof(struct reb_binary_field));
+            reb_save_controlVars(&r->ri_tes.radau->cs_B,3*r->allocatedN,s);
         }
         {
             uint32_t array_size = r->ri_tes.radau->cs_B1st.size;
             struct reb_binary_field field = {.type = REB_BINARY_FIELD_TYPE_TES_RADAU_CS_B_1ST, .size = 7*array_size+sizeof(uint32_t)};
-            reb_output_stream_write(bufp, &allocatedsize, sizep, &field,sizeof(struct reb_binary_field));
-            reb_save_controlVars(&r->ri_tes.radau->cs_B1st,3*r->allocatedN,bufp,sizep,&allocatedsize);
+            reb_output_stream_put(s, &field,sizeof(struct reb_binary_field));
+            reb_save_controlVars(&r->ri_tes.radau->cs_B1st,3*r->allocatedN,s);
         }          
         {
             uint32_t array_size = r->ri_tes.radau->G.size;
             struct reb_binary_field field = {.type = REB_BINARY_FIELD_TYPE_TES_RADAU_G, .size = 7*array_size+sizeof(uint32_t)};
-            reb_output_stream_write(bufp, &allocatedsize, sizep, &field,sizeof(struct reb_binary_field));
-            reb_save_controlVars(&r->ri_tes.radau->G,3*r->allocatedN,bufp,sizep,&allocatedsize);
+            reb_output_stream_put(s, &field,sizeof(struct reb_binary_field));
+            reb_save_controlVars(&r->ri_tes.radau->G,3*r->allocatedN,s);
         }
         {
             uint32_t array_size = r->ri_tes.radau->G_1st.size;
             struct reb_binary_field field = {.type = REB_BINARY_FIELD_TYPE_TES_RADAU_G_1ST, .size = 7*array_size+sizeof(uint32_t)};
-            reb_output_stream_write(bufp, &allocatedsize, sizep, &field,sizeof(struct reb_binary_field));
-            reb_save_controlVars(&r->ri_tes.radau->G_1st,3*r->allocatedN,bufp,sizep,&allocatedsize);
+            reb_output_stream_put(s, &field,sizeof(struct reb_binary_field));
+            reb_save_controlVars(&r->ri_tes.radau->G_1st,3*r->allocatedN,s);
         }  
         // force model vars
         WRITE_FIELD(TES_DHEM_XOSC_STORE, r->ri_tes.rhs->XoscStore, 9*r->ri_tes.stateVectorSize);
@@ -587,35 +720,61 @@ void reb_output_binary_to_stream(struct reb_simulation* r, char** bufp, size_t*
     
     }
    
+    int output_whfast512 = r->integrator==REB_INTEGRATOR_WHFAST512; // WHFast512 might use the AVX2 implementation
 #ifdef AVX512 
-    WRITE_FIELD(WHFAST512_KEEPUNSYNC, &r->ri_whfast512.keep_unsynchronized, sizeof(unsigned int));
-    WRITE_FIELD(WHFAST512_ISSYNCHRON, &r->ri_whfast512.is_synchronized, sizeof(unsigned int));
-    WRITE_FIELD(WHFAST512_GRPOTENTIAL, &r->ri_whfast512.gr_potential, sizeof(unsigned int));
-    WRITE_FIELD(WHFAST512_ALLOCATEDN, &r->ri_whfast512.allocated_N, sizeof(unsigned int));
-    if (r->ri_whfast512.allocated_N){
-        WRITE_FIELD(WHFAST512_PJH, r->ri_whfast512.p_jh, sizeof(struct reb_particle_avx512));
-        WRITE_FIELD(WHFAST512_PJH0, &r->ri_whfast512.p_jh0, sizeof(struct reb_particle));
-    }
+    output_whfast512 = 1;
 #endif // AVX512
+    if (output_whfast512){
+        WRITE_FIELD(WHFAST512_KEEPUNSYNC, &r->ri_whfast512.keep_unsynchronized, sizeof(unsigned int));
+        WRITE_FIELD(WHFAST512_ISSYNCHRON, &r->ri_whfast512.is_synchronized, sizeof(unsigned int));
+        WRITE_FIELD(WHFAST512_GRPOTENTIAL, &r->ri_whfast512.gr_potential, sizeof(unsigned int));
+        WRITE_FIELD(WHFAST512_ALLOCATEDN, &r->ri_whfast512.allocated_N, sizeof(unsigned int));
+        if (r->ri_whfast512.allocated_N){
+            WRITE_FIELD(WHFAST512_PJH, r->ri_whfast512.p_jh, sizeof(struct reb_particle_avx512));
+            WRITE_FIELD(WHFAST512_PJH0, &r->ri_whfast512.p_jh0, sizeof(struct reb_particle));
+            if (r->ri_whfast512.allocated_N_testparticles){
+                WRITE_FIELD(WHFAST512_ALLOCATEDNTP, &r->ri_whfast512.allocated_N_testparticles, sizeof(unsigned int));
+                WRITE_FIELD(WHFAST512_PJHTP, r->ri_whfast512.p_jh_tp, sizeof(struct reb_particle_avx512)*((r->ri_whfast512.allocated_N_testparticles+7)/8));
+            }
+        }
+    }
 
     // To output size of binary file, need to calculate it first. 
     if (r->simulationarchive_version<3){ // to be removed in a future release
-        r->simulationarchive_size_first = (*sizep)+sizeof(struct reb_binary_field)*2+sizeof(long)+sizeof(struct reb_simulationarchive_blob16);
+        r->simulationarchive_size_first = s->size+sizeof(struct reb_binary_field)*2+sizeof(long)+sizeof(struct reb_simulationarchive_blob16);
     }else{
-        r->simulationarchive_size_first = (*sizep)+sizeof(struct reb_binary_field)*2+sizeof(long)+sizeof(struct reb_simulationarchive_blob);
+        r->simulationarchive_size_first = s->size+sizeof(struct reb_binary_field)*2+sizeof(long)+sizeof(struct reb_simulationarchive_blob);
     }
     WRITE_FIELD(SASIZEFIRST,        &r->simulationarchive_size_first,   sizeof(long));
     int end_null = 0;
     WRITE_FIELD(END, &end_null, 0);
     if (r->simulationarchive_version<3){ // to be removed in a future release
         struct reb_simulationarchive_blob16 blob = {0};
-        reb_output_stream_write(bufp, &allocatedsize, sizep, &blob, sizeof(struct reb_simulationarchive_blob16));
+        reb_output_stream_put(s, &blob, sizeof(struct reb_simulationarchive_blob16));
     }else{
         struct reb_simulationarchive_blob blob = {0};
-        reb_output_stream_write(bufp, &allocatedsize, sizep, &blob, sizeof(struct reb_simulationarchive_blob));
+        reb_output_stream_put(s, &blob, sizeof(struct reb_simulationarchive_blob));
     }
 }
 
+void reb_output_binary_to_stream(struct reb_simulation* r, char** bufp, size_t* sizep){
+    reb_output_binary_to_stream_partial(r, bufp, sizep, 0);
+}
+
+void reb_output_binary_to_stream_partial(struct reb_simulation* r, char** bufp, size_t* sizep, int N_partial){
+    // Init integrators. This helps with bit-by-bit reproducibility.
+    reb_integrator_init(r);
+    // First pass only calculates the size, second pass fills a buffer of exactly that size.
+    struct reb_output_stream s = {.partial_N = N_partial};
+    reb_output_binary_serialize(r, &s);
+    s.allocated = s.size;
+    s.buf = malloc(s.allocated);
+    s.size = 0;
+    reb_output_binary_serialize(r, &s);
+    *bufp = s.buf;
+    *sizep = s.size;
+}
+
 void reb_output_binary(struct reb_simulation* r, const char* filename){
 #ifdef MPI
     char filename_mpi[1024];
@@ -628,14 +787,85 @@ void reb_output_binary(struct reb_simulation* r, const char* filename){
         reb_error(r, "Can not open file.");
         return;
     }
-    char* bufp;
-    size_t sizep;
-    reb_output_binary_to_stream(r, &bufp,&sizep);
-    fwrite(bufp,sizep,1,of);
-    free(bufp);
+    // Init integrators. This helps with bit-by-bit reproducibility.
+    reb_integrator_init(r);
+    // Stream arrays directly from the simulation into the file. No 
+    // buffer holding the entire simulation is needed.
+    struct reb_output_stream s = {.file = of};
+    reb_output_binary_serialize(r, &s);
     fclose(of);
 }
 
+#ifdef MPI
+void reb_output_binary_mpi(struct reb_simulation* r, const char* filename){
+    // Integrator arrays with one entry per particle cannot be combined 
+    // across nodes. Only integrators without such state are supported.
+    int unsupported = r->ri_ias15.allocatedN || r->ri_whfast.allocated_N || r->ri_janus.allocated_N || r->ri_mercurius.dcrit_allocatedN || r->ri_tes.allocated_N || r->ri_whfast512.allocated_N || r->var_config_N;
+    MPI_Allreduce(MPI_IN_PLACE, &unsupported, 1, MPI_INT, MPI_LOR, MPI_COMM_WORLD); 
+    if (unsupported){
+        reb_error(r, "MPI-IO checkpoints are not supported for integrators which store data for every particle or with variational particles.");
+        return;
+    }
+    // Init integrators. This helps with bit-by-bit reproducibility.
+    reb_integrator_init(r);
+
+    // Every node writes its particles contiguously, ordered by node id.
+    long N_local = r->N;
+    long N_prefix = 0;
+    long N_tot = 0;
+    MPI_Exscan(&N_local, &N_prefix, 1, MPI_LONG, MPI_SUM, MPI_COMM_WORLD); 
+    MPI_Allreduce(&N_local, &N_tot, 1, MPI_LONG, MPI_SUM, MPI_COMM_WORLD); 
+    if (r->mpi_id==0){
+        N_prefix = 0; // Result of MPI_Exscan is undefined on first node.
+    }
+
+    // The first node serializes everything but the particle data.
+    struct reb_output_stream s = {.particles_skip = 1, .particles_N = (int)N_tot};
+    long offsets[2] = {0, 0}; // offset of particle data, total file size
+    if (r->mpi_id==0){
+        reb_output_binary_serialize(r, &s);
+        s.allocated = s.size-s.particles_skipped;
+        s.buf = malloc(s.allocated);
+        s.size = 0;
+        s.particles_skipped = 0;
+        reb_output_binary_serialize(r, &s);
+        offsets[0] = s.particles_offset;
+        offsets[1] = s.size;
+    }
+    MPI_Bcast(offsets, 2, MPI_LONG, 0, MPI_COMM_WORLD);
+
+    MPI_File fh;
+    if (MPI_File_open(MPI_COMM_WORLD, filename, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &fh)!=MPI_SUCCESS){
+        reb_error(r, "Can not open file.");
+        free(s.buf);
+        return;
+    }
+    MPI_File_set_size(fh, offsets[1]);
+    if (r->mpi_id==0){
+        const long size_particles = sizeof(struct reb_particle)*N_tot;
+        MPI_File_write_at(fh, 0, s.buf, offsets[0], MPI_CHAR, MPI_STATUS_IGNORE);
+        MPI_File_write_at(fh, offsets[0]+size_particles, s.buf+offsets[0], offsets[1]-offsets[0]-size_particles, MPI_CHAR, MPI_STATUS_IGNORE);
+        free(s.buf);
+    }
+
+    // Sanitize pointers before writing particles.
+    struct reb_particle* particles = malloc(sizeof(struct reb_particle)*(N_local?N_local:1));
+    for (int l=0;l<N_local;l++){
+        particles[l] = r->particles[l];
+        particles[l].c = NULL;
+        particles[l].ap = NULL;
+        particles[l].sim = NULL;
+    }
+    MPI_Datatype mpi_particle;
+    MPI_Type_contiguous(sizeof(struct reb_particle), MPI_CHAR, &mpi_particle);
+    MPI_Type_commit(&mpi_particle);
+    MPI_File_write_at_all(fh, offsets[0]+sizeof(struct reb_particle)*N_prefix, particles, N_local, mpi_particle, MPI_STATUS_IGNORE);
+    MPI_Type_free(&mpi_particle);
+    free(particles);
+    MPI_File_close(&fh);
+}
+#endif // MPI
+
 void reb_output_binary_positions(struct reb_simulation* r, const char* filename){
     const int N = r->N;
 #ifdef MPI
@@ -659,6 +889,233 @@ void reb_output_binary_positions(struct reb_simulation* r, const char* filename)
     fclose(of);
 }
 
+void reb_output_columns(struct reb_simulation* r, const char* filename, unsigned int columns){
+    const int N = r->N;
+#ifdef MPI
+    char filename_mpi[1024];
+    sprintf(filename_mpi,"%s_%d",filename,r->mpi_id);
+    FILE* of = fopen(filename_mpi,"ab"); 
+#else // MPI
+    FILE* of = fopen(filename,"ab"); 
+#endif // MPI
+    if (of==NULL){
+        reb_error(r, "Can not open file.");
+        return;
+    }
+    const unsigned int columns_orbit = REB_OUTPUT_COLUMN_A | REB_OUTPUT_COLUMN_E | REB_OUTPUT_COLUMN_INC | REB_OUTPUT_COLUMN_OMEGA | REB_OUTPUT_COLUMN_POMEGA | REB_OUTPUT_COLUMN_L | REB_OUTPUT_COLUMN_F;
+    columns &= REB_OUTPUT_COLUMN_F*2-1; // Ignore unknown columns
+    struct reb_output_columns_header header = {.magic = REB_OUTPUT_COLUMNS_MAGIC, .columns = columns, .N = N, .t = r->t};
+    fwrite(&header, sizeof(struct reb_output_columns_header), 1, of);
+
+    struct reb_orbit* orbits = NULL;
+    if (columns & columns_orbit){
+        // Calculate orbits only once for all orbital element columns.
+        // The first particle has no primary. Its orbital elements are NaN.
+        orbits = malloc(sizeof(struct reb_orbit)*N);
+        reb_tools_particles_to_orbits_err(r->G, r->particles, NULL, 0, N, orbits, NULL);
+    }
+    if (columns & REB_OUTPUT_COLUMN_HASH){
+        uint32_t* col = malloc(sizeof(uint32_t)*N);
+        for (int i=0;i<N;i++){
+            col[i] = r->particles[i].hash;
+        }
+        fwrite(col, sizeof(uint32_t), N, of);
+        free(col);
+    }
+    double* col = malloc(sizeof(double)*N);
+    for (unsigned int column=REB_OUTPUT_COLUMN_X; column<=REB_OUTPUT_COLUMN_F; column<<=1){
+        if (!(columns & column)) continue;
+        for (int i=0;i<N;i++){
+            const struct reb_particle* p = &r->particles[i];
+            switch (column){
+                case REB_OUTPUT_COLUMN_X:       col[i] = p->x;              break;
+                case REB_OUTPUT_COLUMN_Y:       col[i] = p->y;              break;
+                case REB_OUTPUT_COLUMN_Z:       col[i] = p->z;              break;
+                case REB_OUTPUT_COLUMN_VX:      col[i] = p->vx;             break;
+                case REB_OUTPUT_COLUMN_VY:      col[i] = p->vy;             break;
+                case REB_OUTPUT_COLUMN_VZ:      col[i] = p->vz;             break;
+                case REB_OUTPUT_COLUMN_M:       col[i] = p->m;              break;
+                case REB_OUTPUT_COLUMN_R:       col[i] = p->r;              break;
+                case REB_OUTPUT_COLUMN_A:       col[i] = orbits[i].a;       break;
+                case REB_OUTPUT_COLUMN_E:       col[i] = orbits[i].e;       break;
+                case REB_OUTPUT_COLUMN_INC:     col[i] = orbits[i].inc;     break;
+                case REB_OUTPUT_COLUMN_OMEGA:   col[i] = orbits[i].Omega;   break;
+                case REB_OUTPUT_COLUMN_POMEGA:  col[i] = orbits[i].omega;   break;
+                case REB_OUTPUT_COLUMN_L:       col[i] = orbits[i].l;       break;
+                case REB_OUTPUT_COLUMN_F:       col[i] = orbits[i].f;       break;
+            }
+        }
+        fwrite(col, sizeof(double), N, of);
+    }
+    free(col);
+    free(orbits);
+    fclose(of);
+}
+
+// State of the background thread of reb_output_positions_quantized(). 
+// Only the newest frame is kept. The integrator never waits for the output.
+struct reb_output_quantized_writer {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;    // Signals new frames and shutdown
+    char* filename;
+    char* pending;          // Newest frame which has not been written yet, or NULL
+    size_t pending_size;
+    int shutdown;
+    int error;              // Set if the file could not be opened or written
+};
+
+static void* reb_output_quantized_writer_thread(void* args){
+    struct reb_output_quantized_writer* const w = args;
+    // Opening a named pipe blocks until there is a reader. This only blocks this thread.
+    FILE* of = fopen(w->filename, "ab");
+    pthread_mutex_lock(&w->mutex);
+    while (1){
+        while (w->pending==NULL && !w->shutdown){
+            pthread_cond_wait(&w->cond, &w->mutex);
+        }
+        if (w->pending==NULL){ // Shutdown and last frame written
+            break;
+        }
+        char* buf = w->pending;
+        const size_t size = w->pending_size;
+        w->pending = NULL;
+        pthread_mutex_unlock(&w->mutex);
+        int error = 0;
+        if (of==NULL || fwrite(buf, size, 1, of)!=1 || fflush(of)){
+            error = 1;
+        }
+        free(buf);
+        pthread_mutex_lock(&w->mutex);
+        w->error |= error;
+    }
+    pthread_mutex_unlock(&w->mutex);
+    if (of){
+        fclose(of);
+    }
+    return NULL;
+}
+
+void reb_output_positions_quantized_close(struct reb_simulation* r){
+    struct reb_output_quantized_writer* const w = r->output_quantized_writer;
+    if (w==NULL){
+        return;
+    }
+    pthread_mutex_lock(&w->mutex);
+    w->shutdown = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+    pthread_join(w->thread, NULL);
+    if (w->error){
+        reb_warning(r, "Error while writing quantized positions.");
+    }
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->mutex);
+    free(w->filename);
+    free(w);
+    r->output_quantized_writer = NULL;
+}
+
+void reb_output_positions_quantized(struct reb_simulation* r, const char* filename, enum REB_OUTPUT_QUANTIZED format, int stride, int hashes){
+    if (format!=REB_OUTPUT_QUANTIZED_FLOAT32 && format!=REB_OUTPUT_QUANTIZED_UINT16){
+        reb_error(r, "Unknown format for quantized positions.");
+        return;
+    }
+    if (stride<1){
+        stride = 1;
+    }
+#ifdef MPI
+    char filename_mpi[1024];
+    sprintf(filename_mpi,"%s_%d",filename,r->mpi_id);
+    filename = filename_mpi;
+#endif // MPI
+    struct reb_output_quantized_writer* w = r->output_quantized_writer;
+    if (w && strcmp(w->filename, filename)!=0){
+        reb_output_positions_quantized_close(r);
+        w = NULL;
+    }
+    if (w==NULL){
+        w = calloc(1, sizeof(struct reb_output_quantized_writer));
+        w->filename = malloc((strlen(filename)+1)*sizeof(char));
+        strcpy(w->filename, filename);
+        pthread_mutex_init(&w->mutex, NULL);
+        pthread_cond_init(&w->cond, NULL);
+        if (pthread_create(&w->thread, NULL, reb_output_quantized_writer_thread, w)){
+            pthread_cond_destroy(&w->cond);
+            pthread_mutex_destroy(&w->mutex);
+            free(w->filename);
+            free(w);
+            reb_error(r, "Cannot create thread for quantized positions.");
+            return;
+        }
+        r->output_quantized_writer = w;
+    }
+
+    // Prepare the frame on this thread. 
+    const struct reb_particle* const particles = r->particles;
+    const uint64_t N = (r->N+stride-1)/stride;
+    struct reb_output_quantized_header header = {
+        .magic = REB_OUTPUT_QUANTIZED_MAGIC, 
+        .format = format,
+        .N = N,
+        .hashes = hashes?1:0,
+        .stride = stride,
+        .t = r->t,
+    };
+    if (N){
+        header.min[0] = header.max[0] = particles[0].x;
+        header.min[1] = header.max[1] = particles[0].y;
+        header.min[2] = header.max[2] = particles[0].z;
+    }
+    for (int i=0;i<r->N;i+=stride){
+        header.min[0] = MIN(header.min[0], particles[i].x);
+        header.min[1] = MIN(header.min[1], particles[i].y);
+        header.min[2] = MIN(header.min[2], particles[i].z);
+        header.max[0] = MAX(header.max[0], particles[i].x);
+        header.max[1] = MAX(header.max[1], particles[i].y);
+        header.max[2] = MAX(header.max[2], particles[i].z);
+    }
+    const size_t size_value = format==REB_OUTPUT_QUANTIZED_UINT16 ? sizeof(uint16_t) : sizeof(float);
+    const size_t size = sizeof(header) + (hashes?sizeof(uint32_t)*N:0) + 3*size_value*N;
+    char* buf = malloc(size);
+    memcpy(buf, &header, sizeof(header));
+    char* pos = buf+sizeof(header);
+    if (hashes){
+        uint32_t* h = (uint32_t*)pos;
+        for (int i=0,j=0;i<r->N;i+=stride,j++){
+            h[j] = particles[i].hash;
+        }
+        pos += sizeof(uint32_t)*N;
+    }
+    if (format==REB_OUTPUT_QUANTIZED_UINT16){
+        double scale[3];
+        for (int k=0;k<3;k++){
+            scale[k] = header.max[k]>header.min[k] ? 65535./(header.max[k]-header.min[k]) : 0.;
+        }
+        uint16_t* q = (uint16_t*)pos;
+        for (int i=0,j=0;i<r->N;i+=stride,j+=3){
+            q[j+0] = (uint16_t)((particles[i].x-header.min[0])*scale[0]+0.5);
+            q[j+1] = (uint16_t)((particles[i].y-header.min[1])*scale[1]+0.5);
+            q[j+2] = (uint16_t)((particles[i].z-header.min[2])*scale[2]+0.5);
+        }
+    }else{
+        float* f = (float*)pos;
+        for (int i=0,j=0;i<r->N;i+=stride,j+=3){
+            f[j+0] = particles[i].x;
+            f[j+1] = particles[i].y;
+            f[j+2] = particles[i].z;
+        }
+    }
+
+    // Hand over the frame. A frame which has not been written yet is dropped.
+    pthread_mutex_lock(&w->mutex);
+    free(w->pending);
+    w->pending = buf;
+    w->pending_size = size;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+}
+
 void reb_output_velocity_dispersion(struct reb_simulation* r, char* filename){
     const int N = r->N;
     // Algorithm with reduced roundoff errors (see wikipedia)
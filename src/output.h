@@ -28,29 +28,8 @@ struct reb_simulation;
 
 #include <stdio.h>
 void reb_output_binary_to_stream(struct reb_simulation* r, char** bufp, size_t* sizep);
+// Same as reb_output_binary_to_stream but only the first N_partial particles are written (all if N_partial is 0).
+void reb_output_binary_to_stream_partial(struct reb_simulation* r, char** bufp, size_t* sizep, int N_partial);
 void reb_output_stream_write(char** bufp, size_t* allocatedsize, size_t* sizep, void* restrict data, size_t size); ///< Replacement for memstream
 
-#ifdef PROFILING
-/**
- * Profiling categories
- */
-enum profiling_categories {
-	PROFILING_CAT_INTEGRATOR,
-	PROFILING_CAT_BOUNDARY,
-	PROFILING_CAT_GRAVITY,
-	PROFILING_CAT_COLLISION,
-#ifdef OPENGL
-	PROFILING_CAT_VISUALIZATION,
-#endif // OPENGL
-	PROFILING_CAT_NUM,
-};
-void profiling_start(void);
-void profiling_stop(int cat);
-#define PROFILING_START() profiling_start();	///< Start profiling block 
-#define PROFILING_STOP(C) profiling_stop(C);	///< Stop profiling block 
-#else // PROFILING
-#define PROFILING_START()	///< Start profiling block (dummy, does nothing) 
-#define PROFILING_STOP(C)	///< Stop profiling block (dummy, does nothing)
-#endif // PROFILING
-
 #endif
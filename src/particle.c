@@ -28,8 +28,10 @@
 #include <math.h>
 #include <time.h>
 #include <stdint.h>
+#include <string.h>
 #include "rebound.h"
 #include "tree.h"
+#include "tools.h"
 #include "boundary.h"
 #include "particle.h"
 #include "integrator_ias15.h"
@@ -46,20 +48,28 @@
 extern double gravity_minimum_mass;
 #endif // GRAVITY_GRAPE
 
+static void reb_lookup_table_add(struct reb_simulation* const r, const int index);
+
 static void reb_add_local(struct reb_simulation* const r, struct reb_particle pt){
 	if (reb_boundary_particle_is_in_box(r, pt)==0){
 		// reb_particle has left the box. Do not add.
 		reb_error(r,"Particle outside of box boundaries. Did not add particle.");
 		return;
 	}
-	while (r->allocatedN<=r->N){
-		r->allocatedN = r->allocatedN ? r->allocatedN * 2 : 128;
-		r->particles = realloc(r->particles,sizeof(struct reb_particle)*r->allocatedN);
+	if (r->allocatedN<=r->N){
+		int allocatedN = r->allocatedN;
+		while (allocatedN<=r->N){
+			allocatedN = allocatedN ? allocatedN * 2 : 128;
+		}
+		r->particles = reb_tools_realloc_aligned(r->particles, sizeof(struct reb_particle), r->N, allocatedN);
+		r->allocatedN = allocatedN;
 	}
 
 	r->particles[r->N] = pt;
 	r->particles[r->N].sim = r;
-	if (r->gravity==REB_GRAVITY_TREE || r->collision==REB_COLLISION_TREE || r->collision==REB_COLLISION_LINETREE){
+	r->particles[r->N].frozen = 0; // Particles are always added unfrozen.
+	r->particles[r->N].c = NULL; // Set below if the particle is added to the tree.
+	if (r->gravity==REB_GRAVITY_TREE || r->gravity==REB_GRAVITY_FMM || r->collision==REB_COLLISION_TREE || r->collision==REB_COLLISION_LINETREE){
         if (r->root_size==-1){
             reb_error(r,"root_size is -1. Make sure you call reb_configure_box() before using a tree based gravity or collision solver.");
             return;
@@ -68,13 +78,23 @@ static void reb_add_local(struct reb_simulation* const r, struct reb_particle pt
             reb_error(r,"Cannot add particle outside of simulation box.");
             return;
         }
-		reb_tree_add_particle_to_tree(r, r->N);
+        if (reb_tree_active_only(r)){ 
+            r->particles[r->N].c = NULL; // The tree is built from scratch during the next update.
+        }else{
+		    reb_tree_add_particle_to_tree(r, r->N);
+        }
 	}
 	(r->N)++;
+	reb_lookup_table_add(r, r->N-1);
     if (r->integrator == REB_INTEGRATOR_MERCURIUS){
         struct reb_simulation_integrator_mercurius* rim = &(r->ri_mercurius);
         if (r->ri_mercurius.mode==0){ //WHFast part
-            rim->recalculate_dcrit_this_timestep       = 1;
+            // Only the new particle needs a critical radius. It is calculated 
+            // in heliocentric coordinates at the beginning of the next timestep.
+            if (rim->dcrit_allocatedN>=r->N){
+                rim->dcrit[r->N-1] = -1.;
+            }
+            rim->dcrit_pending                         = 1;
             rim->recalculate_coordinates_this_timestep = 1;
         }else{  // IAS15 part
             reb_integrator_ias15_reset(r);
@@ -95,31 +115,42 @@ static void reb_add_local(struct reb_simulation* const r, struct reb_particle pt
                 // Otherwise, assume we're adding non active particle. 
                 rim->encounterNactive++;
             }
+            // The new particle might collide with any other active particle in the encounter.
+            // With the star, and between test particles, collisions are checked without the pair list.
+            const unsigned int kmax = (r->N_active==-1)?rim->encounterN-1:rim->encounterNactive;
+            for (unsigned int k=1;k<kmax;k++){
+                reb_integrator_mercurius_encounter_pairs_add(r, rim->encounter_map[k], r->N-1);
+            }
         }
     }
 }
 
-void reb_add(struct reb_simulation* const r, struct reb_particle pt){
+// Keeps track of the two largest radii.
+static void reb_max_radius_update(struct reb_simulation* const r, const double radius){
 #ifndef COLLISIONS_NONE
-	if (pt.r>=r->max_radius[0]){
+	if (radius>=r->max_radius[0]){
 		r->max_radius[1] = r->max_radius[0];
-		r->max_radius[0] = pt.r;
+		r->max_radius[0] = radius;
 	}else{
-		if (pt.r>=r->max_radius[1]){
-			r->max_radius[1] = pt.r;
+		if (radius>=r->max_radius[1]){
+			r->max_radius[1] = radius;
 		}
 	}
 #endif 	// COLLISIONS_NONE
+}
+
+void reb_add(struct reb_simulation* const r, struct reb_particle pt){
+    reb_max_radius_update(r, pt.r);
 #ifdef GRAVITY_GRAPE
 	if (pt.m<gravity_minimum_mass){
 		gravity_minimum_mass = pt.m;
 	}
 #endif // GRAVITY_GRAPE
 #ifdef MPI
+	// With the test particle decomposition, particles always stay on the node they are added on.
 	int rootbox = reb_get_rootbox_for_particle(r, pt);
-	int root_n_per_node = r->root_n/r->mpi_num;
-	int proc_id = rootbox/root_n_per_node;
-	if (proc_id != r->mpi_id && r->N >= r->N_active){
+	int proc_id = reb_communication_mpi_rootbox_owner(r, rootbox);
+	if (r->mpi_decomposition==REB_MPI_DECOMPOSITION_ROOTBOXES && proc_id != r->mpi_id && r->N >= r->N_active){
 		// Add particle to array and send them to proc_id later. 
 		reb_communication_mpi_add_particle_to_send_queue(r,pt,proc_id);
 		return;
@@ -129,6 +160,37 @@ void reb_add(struct reb_simulation* const r, struct reb_particle pt){
 	reb_add_local(r, pt);
 }
 
+void reb_reserve(struct reb_simulation* const r, const int N){
+	if (N>r->allocatedN){
+		r->particles = reb_tools_realloc_aligned(r->particles, sizeof(struct reb_particle), r->N, N);
+		r->allocatedN = N;
+	}
+}
+
+void reb_add_many(struct reb_simulation* const r, const struct reb_particle* const particles, const int N){
+	if (N<=0){
+		return;
+	}
+	// Grow the particle array (and MERCURIUS' encounter arrays) only once.
+	reb_reserve(r, r->N+N);
+	if (r->integrator == REB_INTEGRATOR_MERCURIUS && r->ri_mercurius.mode==1){
+		struct reb_simulation_integrator_mercurius* rim = &(r->ri_mercurius);
+		const int Nnew = r->N+N;
+		if (rim->dcrit_allocatedN<Nnew){
+			rim->dcrit              = realloc(rim->dcrit, sizeof(double)*Nnew);
+			rim->dcrit_allocatedN = Nnew;
+		}
+		if (rim->allocatedN<Nnew){
+			rim->particles_backup   = realloc(rim->particles_backup,sizeof(struct reb_particle)*Nnew);
+			rim->encounter_map      = realloc(rim->encounter_map,sizeof(int)*Nnew);
+			rim->allocatedN = Nnew;
+		}
+	}
+	for (int i=0;i<N;i++){
+		reb_add(r, particles[i]);
+	}
+}
+
 int reb_particle_check_testparticles(struct reb_simulation* const r){
     if (r->N_active == r->N || r->N_active == -1){
         return 0;
@@ -168,85 +230,139 @@ int reb_get_particle_index(struct reb_particle* p){
 	return i;
 }
 
-static struct reb_particle* reb_search_lookup_table(struct reb_simulation* const r, uint32_t hash){
+// The particle lookup table is an open-addressing hash map with linear probing.
+// Empty slots have index -1. The capacity (allocatedN_lookup) is a power of two
+// and kept at least twice the number of entries (N_lookup). Entries are updated 
+// incrementally when particles are added or removed. Because particles can be 
+// reordered and hashes can be changed without REBOUND noticing, every entry is 
+// verified against the particle array before it is used. The table is rebuilt 
+// in O(N) only if an entry is missing or stale.
+
+static inline int reb_lookup_table_slot(uint32_t hash, const int capacity){
+    // Mix bits (murmur3 finalizer) so that sequential hashes spread out.
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return (int)(hash & (uint32_t)(capacity-1));
+}
+
+// Returns the slot containing hash or -1 if hash is not in the table.
+static int reb_lookup_table_find(const struct reb_simulation* const r, const uint32_t hash){
     const struct reb_hash_pointer_pair* const lookup = r->particle_lookup_table;
     if (lookup == NULL){
-        return NULL;
+        return -1;
     }
-
-    int left = 0;
-    int right = r->N_lookup-1;
-    int middle;
-    while(left <= right){
-        middle = (left + right)/2;
-        uint32_t lookuphash = lookup[middle].hash;
-        if(lookuphash < hash){
-            left = middle+1;
-        }
-        else if(lookuphash > hash){
-            right = middle-1;
+    const int mask = r->allocatedN_lookup-1;
+    int slot = reb_lookup_table_slot(hash, r->allocatedN_lookup);
+    while (lookup[slot].index != -1){
+        if (lookup[slot].hash == hash){
+            return slot;
         }
-        else if(lookuphash == hash){
-            if(lookup[middle].index < r->N){
-                return &r->particles[lookup[middle].index];
-            }
-            else{ // found lookup table entry pointing beyond r->N in particles array. Needs update
-                return NULL;
-            }
+        slot = (slot+1) & mask;
+    }
+    return -1;
+}
+
+// Inserts a hash or overwrites the index of an existing entry. Table must not be full.
+static void reb_lookup_table_set(struct reb_simulation* const r, const uint32_t hash, const int index){
+    struct reb_hash_pointer_pair* const lookup = r->particle_lookup_table;
+    const int mask = r->allocatedN_lookup-1;
+    int slot = reb_lookup_table_slot(hash, r->allocatedN_lookup);
+    while (lookup[slot].index != -1){
+        if (lookup[slot].hash == hash){
+            lookup[slot].index = index;
+            return;
         }
+        slot = (slot+1) & mask;
     }
-    return NULL;
+    lookup[slot].hash = hash;
+    lookup[slot].index = index;
+    r->N_lookup++;
 }
 
-static int compare_hash(const void* a, const void* b){
-    struct reb_hash_pointer_pair* ia = (struct reb_hash_pointer_pair*)a; 
-    struct reb_hash_pointer_pair* ib = (struct reb_hash_pointer_pair*)b;
-    return (ia->hash > ib->hash) - (ia->hash < ib->hash); // to avoid overflow possibilities
+// Removes the entry in the given slot using backward shift deletion (no tombstones).
+static void reb_lookup_table_delete_slot(struct reb_simulation* const r, int slot){
+    struct reb_hash_pointer_pair* const lookup = r->particle_lookup_table;
+    const int mask = r->allocatedN_lookup-1;
+    int next = (slot+1) & mask;
+    while (lookup[next].index != -1){
+        const int home = reb_lookup_table_slot(lookup[next].hash, r->allocatedN_lookup);
+        // Move entry back if its home slot is not within (slot, next]
+        if (((next-home) & mask) >= ((next-slot) & mask)){
+            lookup[slot] = lookup[next];
+            slot = next;
+        }
+        next = (next+1) & mask;
+    }
+    lookup[slot].index = -1;
+    r->N_lookup--;
 }
 
 static void reb_update_particle_lookup_table(struct reb_simulation* const r){
-    const struct reb_particle* const particles = r->particles;
-    int N_hash = 0;
-    int zerohash = -1;
-    for(int i=0; i<r->N; i++){
-        if(N_hash >= r->allocatedN_lookup){
-            r->allocatedN_lookup = r->allocatedN_lookup ? r->allocatedN_lookup * 2 : 128;
-            r->particle_lookup_table = realloc(r->particle_lookup_table, sizeof(struct reb_hash_pointer_pair)*r->allocatedN_lookup);
-        }
-        if(particles[i].hash == 0){ // default hash (0) special case
-            if (zerohash == -1){    // first zero hash
-                zerohash = i;
-                r->particle_lookup_table[zerohash].hash = particles[i].hash;
-                r->particle_lookup_table[zerohash].index = i;
-                N_hash++;
-            }
-            else{                   // update zero hash entry in lookup without incrementing N_hash
-                r->particle_lookup_table[zerohash].index = i;
-            }
-        }
-        else{                   
-            r->particle_lookup_table[N_hash].hash = particles[i].hash;
-            r->particle_lookup_table[N_hash].index = i;
-            N_hash++;
-        }
+    int capacity = 16;
+    while (capacity < 2*(r->N+1)){
+        capacity *= 2;
+    }
+    if (capacity > r->allocatedN_lookup){
+        r->allocatedN_lookup = capacity;
+        r->particle_lookup_table = realloc(r->particle_lookup_table, sizeof(struct reb_hash_pointer_pair)*r->allocatedN_lookup);
+    }
+    for (int i=0; i<r->allocatedN_lookup; i++){
+        r->particle_lookup_table[i].index = -1;
+    }
+    r->N_lookup = 0;
+    // If several particles share a hash (e.g. the default hash 0), the last one wins.
+    for (int i=0; i<r->N; i++){
+        reb_lookup_table_set(r, r->particles[i].hash, i);
+    }
+}
+
+// Called after the particle at index has been added to the particles array.
+static void reb_lookup_table_add(struct reb_simulation* const r, const int index){
+    if (r->particle_lookup_table == NULL){
+        return; // Built lazily on first lookup.
+    }
+    if (2*(r->N_lookup+1) > r->allocatedN_lookup){
+        reb_update_particle_lookup_table(r);
+    }else{
+        reb_lookup_table_set(r, r->particles[index].hash, index);
+    }
+}
+
+// Called when the particle currently at index old_index is being moved to new_index.
+// Use new_index=-1 if the particle is removed.
+static void reb_lookup_table_move(struct reb_simulation* const r, const uint32_t hash, const int old_index, const int new_index){
+    const int slot = reb_lookup_table_find(r, hash);
+    if (slot == -1 || r->particle_lookup_table[slot].index != old_index){
+        return; // Not in table or entry belongs to another particle with the same hash. 
+    }
+    if (new_index == -1){
+        reb_lookup_table_delete_slot(r, slot);
+    }else{
+        r->particle_lookup_table[slot].index = new_index;
     }
-    r->N_lookup = N_hash;
-    qsort(r->particle_lookup_table, r->N_lookup, sizeof(*r->particle_lookup_table), compare_hash); // only sort the first N_lookup entries that are initialized.
+}
+
+static struct reb_particle* reb_search_lookup_table(struct reb_simulation* const r, uint32_t hash){
+    const int slot = reb_lookup_table_find(r, hash);
+    if (slot == -1){
+        return NULL;
+    }
+    const int index = r->particle_lookup_table[slot].index;
+    if (index < r->N && r->particles[index].hash == hash){
+        return &r->particles[index];
+    }
+    return NULL; // Stale entry. Needs update.
 }
 
 struct reb_particle* reb_get_particle_by_hash(struct reb_simulation* const r, uint32_t hash){
-    struct reb_particle* p; 
-    p = reb_search_lookup_table(r, hash);
+    struct reb_particle* p = reb_search_lookup_table(r, hash);
     if (p == NULL){
         reb_update_particle_lookup_table(r);
         p = reb_search_lookup_table(r, hash);
     }
-    else{
-        if (p->hash != hash){
-            reb_update_particle_lookup_table(r);
-            p = reb_search_lookup_table(r, hash);
-        }
-    }
     return p;
 }
 
@@ -287,8 +403,24 @@ void reb_remove_all(struct reb_simulation* const r){
 	r->allocatedN 	= 0;
 	r->N_active 	= -1;
 	r->N_var 	= 0;
+	r->N_frozen 	= 0;
+	r->N_asleep 	= 0;
 	free(r->particles);
 	r->particles 	= NULL;
+	reb_tree_clear(r);
+}
+
+/**
+ * @brief Updates N_frozen and N_asleep before particle p is removed.
+ * @details Only the FROZEN and ASLEEP bits count, the other bits of p->frozen store the sleep state.
+ */
+static void reb_frozen_forget(struct reb_simulation* const r, const struct reb_particle* const p){
+    if ((p->frozen & REB_PARTICLE_FROZEN) && r->N_frozen>0){
+        r->N_frozen--;
+    }
+    if ((p->frozen & REB_PARTICLE_ASLEEP) && r->N_asleep>0){
+        r->N_asleep--;
+    }
 }
 
 int reb_remove(struct reb_simulation* const r, int index, int keepSorted){
@@ -302,6 +434,9 @@ int reb_remove(struct reb_simulation* const r, int index, int keepSorted){
                 }
             }
         }
+        for (int i=index;i<r->N-1 && i+1<(int)rim->kepler_guess_allocatedN;i++){
+            rim->kepler_guess[i] = rim->kepler_guess[i+1];
+        }
         reb_integrator_ias15_reset(r);
         if (r->ri_mercurius.mode==1){
             struct reb_simulation_integrator_mercurius* rim = &(r->ri_mercurius);
@@ -320,10 +455,22 @@ int reb_remove(struct reb_simulation* const r, int index, int keepSorted){
                 rim->encounterNactive--;
             }
             rim->encounterN--;
+            unsigned int encounter_pairs_N = 0;
+            for (unsigned int i=0;i<rim->encounter_pairs_N;i++){
+                const int p1 = rim->encounter_pairs[2*i];
+                const int p2 = rim->encounter_pairs[2*i+1];
+                if (p1==index || p2==index) continue;
+                rim->encounter_pairs[2*encounter_pairs_N] = p1>index?p1-1:p1;
+                rim->encounter_pairs[2*encounter_pairs_N+1] = p2>index?p2-1:p2;
+                encounter_pairs_N++;
+            }
+            rim->encounter_pairs_N = encounter_pairs_N;
         }
     }
-	if (r->N==1){
+	if (r->N==1 && !r->tree_root){ // In a tree, the particle is flagged below.
 	    r->N = 0;
+        r->N_frozen = 0;
+        r->N_asleep = 0;
         if(r->free_particle_ap){
             r->free_particle_ap(&r->particles[index]);
         }
@@ -340,7 +487,14 @@ int reb_remove(struct reb_simulation* const r, int index, int keepSorted){
 		reb_error(r, "Removing particles not supported when calculating MEGNO.  Did not remove particle.");
 		return 0;
 	}
+    reb_frozen_forget(r, &r->particles[index]);
 	if(keepSorted){
+        if (r->particle_lookup_table){
+            reb_lookup_table_move(r, r->particles[index].hash, index, -1);
+            for(int j=index+1; j<r->N; j++){
+                reb_lookup_table_move(r, r->particles[j].hash, j, j-1);
+            }
+        }
 	    r->N--;
         if(r->free_particle_ap){
             r->free_particle_ap(&r->particles[index]);
@@ -363,6 +517,12 @@ int reb_remove(struct reb_simulation* const r, int index, int keepSorted){
                 r->free_particle_ap(&r->particles[index]);
             }
         }else{
+            if (r->particle_lookup_table){
+                reb_lookup_table_move(r, r->particles[index].hash, index, -1);
+                if (index != r->N-1){
+                    reb_lookup_table_move(r, r->particles[r->N-1].hash, r->N-1, index);
+                }
+            }
 	        r->N--;
             if(r->free_particle_ap){
                 r->free_particle_ap(&r->particles[index]);
@@ -374,6 +534,325 @@ int reb_remove(struct reb_simulation* const r, int index, int keepSorted){
 	return 1;
 }
 
+void reb_remove_multiple(struct reb_simulation* const r, const int* const indices, const int indices_N, int keepSorted){
+    if (indices_N==0){
+        return;
+    }
+	if (r->N_var){
+		reb_error(r, "Removing particles not supported when calculating MEGNO.  Did not remove particle.");
+		return;
+	}
+    if (r->integrator == REB_INTEGRATOR_MERCURIUS){
+        keepSorted = 1; // Force keepSorted for hybrid integrator
+    }
+    const int N = r->N;
+    // newindex[i] is the index of particle i after the removal or -1 if it is removed
+    int* newindex = malloc(sizeof(int)*N);
+    for (int i=0;i<N;i++){
+        newindex[i] = i;
+    }
+    for (int k=0;k<indices_N;k++){
+        newindex[indices[k]] = -1;
+        reb_frozen_forget(r, &r->particles[indices[k]]);
+        if(r->free_particle_ap){
+            r->free_particle_ap(&r->particles[indices[k]]);
+        }
+    }
+    struct reb_particle* const particles = r->particles;
+    int N_new = 0;
+    if (keepSorted){
+        int N_active_removed = 0;
+        for (int i=0;i<N;i++){
+            if (newindex[i]==-1){
+                if (i<r->N_active){
+                    N_active_removed++;
+                }
+                continue;
+            }
+            newindex[i] = N_new;
+            particles[N_new] = particles[i];
+            N_new++;
+        }
+        r->N_active -= N_active_removed;
+    }else{
+        // Same order as repeatedly moving the last particle into the removed particle's slot.
+        int* position = malloc(sizeof(int)*N);  // Current index of original particle i
+        int* original = malloc(sizeof(int)*N);  // Original index of the particle currently at index i
+        for (int i=0;i<N;i++){
+            position[i] = i;
+            original[i] = i;
+        }
+        N_new = N;
+        for (int k=0;k<indices_N;k++){
+            const int index = position[indices[k]];
+            N_new--;
+            particles[index] = particles[N_new];
+            original[index] = original[N_new];
+            position[original[index]] = index;
+        }
+        for (int i=0;i<N_new;i++){
+            newindex[original[i]] = i;
+        }
+        free(position);
+        free(original);
+    }
+    r->N = N_new;
+    if (N_new==0){
+		reb_warning(r, "Last particle removed.");
+    }
+
+    if (r->integrator == REB_INTEGRATOR_MERCURIUS){
+        struct reb_simulation_integrator_mercurius* rim = &(r->ri_mercurius);
+        if (rim->dcrit_allocatedN>0){
+            for (int i=0;i<N && i<rim->dcrit_allocatedN;i++){
+                if (newindex[i]!=-1){
+                    rim->dcrit[newindex[i]] = rim->dcrit[i];
+                }
+            }
+        }
+        for (int i=0;i<N && i<(int)rim->kepler_guess_allocatedN;i++){
+            if (newindex[i]!=-1){
+                rim->kepler_guess[newindex[i]] = rim->kepler_guess[i];
+            }
+        }
+        reb_integrator_ias15_reset(r);
+        if (rim->mode==1){
+            unsigned int encounterN = 0;
+            unsigned int encounterNactive = rim->encounterNactive;
+            for (unsigned int i=0;i<rim->encounterN;i++){
+                const int index = newindex[rim->encounter_map[i]];
+                if (index==-1){
+                    if (i<rim->encounterNactive){
+                        encounterNactive--;
+                    }
+                    continue;
+                }
+                rim->encounter_map[encounterN] = index;
+                encounterN++;
+            }
+            rim->encounterN = encounterN;
+            rim->encounterNactive = encounterNactive;
+            unsigned int encounter_pairs_N = 0;
+            for (unsigned int i=0;i<rim->encounter_pairs_N;i++){
+                const int p1 = newindex[rim->encounter_pairs[2*i]];
+                const int p2 = newindex[rim->encounter_pairs[2*i+1]];
+                if (p1==-1 || p2==-1) continue;
+                rim->encounter_pairs[2*encounter_pairs_N] = p1;
+                rim->encounter_pairs[2*encounter_pairs_N+1] = p2;
+                encounter_pairs_N++;
+            }
+            rim->encounter_pairs_N = encounter_pairs_N;
+        }
+    }
+
+    // Keep the order of the sweep and prune search so that it does not need to be sorted from scratch
+    if (r->collision_sap_N==N){
+        int k_new = 0;
+        for (int k=0;k<N;k++){
+            const int index = newindex[r->collision_sap_particles[k]];
+            if (index==-1) continue;
+            r->collision_sap_particles[k_new] = index;
+            r->collision_sap_lower[k_new] = r->collision_sap_lower[k];
+            r->collision_sap_upper[k_new] = r->collision_sap_upper[k];
+            k_new++;
+        }
+        r->collision_sap_N = k_new;
+    }
+
+    // Update lookup table
+    if (r->particle_lookup_table){
+        reb_update_particle_lookup_table(r);
+    }
+    free(newindex);
+}
+
+/**
+ * @brief Morton key of a particle used by reb_sort_particles_spatially().
+ */
+struct reb_particle_sort_key {
+    uint64_t key;
+    int index;
+};
+
+static int reb_particle_sort_key_compare(const void* a, const void* b){
+    const struct reb_particle_sort_key* ka = a;
+    const struct reb_particle_sort_key* kb = b;
+    if (ka->key < kb->key) return -1;
+    if (ka->key > kb->key) return 1;
+    return (ka->index > kb->index) - (ka->index < kb->index);
+}
+
+// Spreads the lowest 21 bits of v so that there are two zero bits between each of them.
+static uint64_t reb_particle_morton_spread(uint64_t v){
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffull;
+    v = (v | v << 16) & 0x1f0000ff0000ffull;
+    v = (v | v << 8)  & 0x100f00f00f00f00full;
+    v = (v | v << 4)  & 0x10c30c30c30c30c3ull;
+    v = (v | v << 2)  & 0x1249249249249249ull;
+    return v;
+}
+
+// Converts a coordinate to an integer between 0 and 2^21-1. NaNs are mapped to 0.
+static uint64_t reb_particle_morton_coordinate(double q, double qmin, double scale){
+    const double f = (q-qmin)*scale;
+    if (f>0.){
+        return f<2097151. ? (uint64_t)f : 2097151;
+    }
+    return 0;
+}
+
+// Applies the permutation given by the sorted keys to N_sort consecutive blocks of n doubles, starting at block start.
+static void reb_particle_permute_doubles(double* const a, const struct reb_particle_sort_key* const keys, const int start, const int N_sort, const int n, double* const tmp){
+    for (int k=0; k<N_sort; k++){
+        for (int d=0; d<n; d++){
+            tmp[k*n+d] = a[keys[k].index*n+d];
+        }
+    }
+    memcpy(a+start*n, tmp, sizeof(double)*n*N_sort);
+}
+
+void reb_sort_particles_spatially(struct reb_simulation* const r){
+    switch (r->integrator){
+        case REB_INTEGRATOR_IAS15:
+        case REB_INTEGRATOR_LEAPFROG:
+        case REB_INTEGRATOR_SEI:
+        case REB_INTEGRATOR_NONE:
+            break;
+        case REB_INTEGRATOR_WHFAST:
+        case REB_INTEGRATOR_SABA:
+            if (r->ri_whfast.coordinates==REB_WHFAST_COORDINATES_JACOBI && (r->N_active==-1 || r->testparticle_type==1)){
+                reb_warning(r, "Particles cannot be sorted spatially when Jacobi coordinates depend on their order.");
+                return;
+            }
+            break;
+        default:
+            reb_warning(r, "Sorting particles spatially is not supported by this integrator."); 
+            return;
+    }
+    if (r->N_var){
+        reb_warning(r, "Particles cannot be sorted spatially when variational particles are present."); 
+        return;
+    }
+    // Only test particles are sorted if N_active is set.
+    const int N = r->N;
+    const int start = r->N_active==-1?0:r->N_active;
+    const int N_sort = N-start;
+    if (N_sort<2){
+        return;
+    }
+    struct reb_particle* const particles = r->particles;
+    double qmin[3] = {INFINITY, INFINITY, INFINITY};
+    double qmax[3] = {-INFINITY, -INFINITY, -INFINITY};
+    for (int i=start; i<N; i++){
+        const double q[3] = {particles[i].x, particles[i].y, particles[i].z};
+        for (int d=0; d<3; d++){
+            if (q[d]<qmin[d]) qmin[d] = q[d];
+            if (q[d]>qmax[d]) qmax[d] = q[d];
+        }
+    }
+    double width = 0.;
+    for (int d=0; d<3; d++){
+        if (qmax[d]-qmin[d]>width) width = qmax[d]-qmin[d];
+    }
+    if (!(width>0.)){
+        return;
+    }
+    const double scale = 2097152./width;
+    struct reb_particle_sort_key* keys = malloc(sizeof(struct reb_particle_sort_key)*N_sort);
+#pragma omp parallel for
+    for (int k=0; k<N_sort; k++){
+        const struct reb_particle p = particles[start+k];
+        keys[k].key = reb_particle_morton_spread(reb_particle_morton_coordinate(p.x, qmin[0], scale))
+                    | reb_particle_morton_spread(reb_particle_morton_coordinate(p.y, qmin[1], scale))<<1
+                    | reb_particle_morton_spread(reb_particle_morton_coordinate(p.z, qmin[2], scale))<<2;
+        keys[k].index = start+k;
+    }
+    qsort(keys, N_sort, sizeof(struct reb_particle_sort_key), reb_particle_sort_key_compare);
+
+    int* newindex = malloc(sizeof(int)*N);
+    for (int i=0; i<start; i++){
+        newindex[i] = i;
+    }
+    for (int k=0; k<N_sort; k++){
+        newindex[keys[k].index] = start+k;
+    }
+    struct reb_particle* tmp = malloc(sizeof(struct reb_particle)*N_sort);
+    for (int k=0; k<N_sort; k++){
+        tmp[k] = particles[keys[k].index];
+    }
+    memcpy(particles+start, tmp, sizeof(struct reb_particle)*N_sort);
+
+    // Integrator arrays
+    struct reb_simulation_integrator_whfast* const ri_whfast = &(r->ri_whfast);
+    if (ri_whfast->p_jh && ri_whfast->allocated_N==N){
+        for (int k=0; k<N_sort; k++){
+            tmp[k] = ri_whfast->p_jh[keys[k].index];
+        }
+        memcpy(ri_whfast->p_jh+start, tmp, sizeof(struct reb_particle)*N_sort);
+        if (ri_whfast->kepler_guess){
+            double* tmpd = malloc(sizeof(double)*N_sort);
+            reb_particle_permute_doubles(ri_whfast->kepler_guess, keys, start, N_sort, 1, tmpd);
+            free(tmpd);
+        }
+    }
+    free(tmp);
+    struct reb_simulation_integrator_ias15* const ri_ias15 = &(r->ri_ias15);
+    if (ri_ias15->allocatedN>=3*N){
+        double* tmpd = malloc(sizeof(double)*3*N_sort);
+        double* vec3[] = {ri_ias15->at, ri_ias15->x0, ri_ias15->v0, ri_ias15->a0, ri_ias15->csx, ri_ias15->csv, ri_ias15->csa0};
+        for (int v=0; v<sizeof(vec3)/sizeof(vec3[0]); v++){
+            reb_particle_permute_doubles(vec3[v], keys, start, N_sort, 3, tmpd);
+        }
+        struct reb_dp7* dp7[] = {&ri_ias15->g, &ri_ias15->b, &ri_ias15->csb, &ri_ias15->e, &ri_ias15->br, &ri_ias15->er};
+        for (int v=0; v<sizeof(dp7)/sizeof(dp7[0]); v++){
+            double* p[] = {dp7[v]->p0, dp7[v]->p1, dp7[v]->p2, dp7[v]->p3, dp7[v]->p4, dp7[v]->p5, dp7[v]->p6};
+            for (int j=0; j<7; j++){
+                reb_particle_permute_doubles(p[j], keys, start, N_sort, 3, tmpd);
+            }
+        }
+        free(tmpd);
+    }
+
+    // Costs of the tree gravity calculation
+    if (r->gravity_tree_cost_N==N){
+        int* tmpi = malloc(sizeof(int)*N_sort);
+        for (int k=0; k<N_sort; k++){
+            tmpi[k] = r->gravity_tree_cost[keys[k].index];
+        }
+        memcpy(r->gravity_tree_cost+start, tmpi, sizeof(int)*N_sort);
+        free(tmpi);
+    }
+
+    // Tree cells
+    if (r->tree_root){
+        for (int i=start; i<N; i++){
+            if (particles[i].c){
+                particles[i].c->pt = i;
+            }
+        }
+    }
+
+    // Collision search data
+    if (r->collision_sap_N==N){
+        for (int k=0; k<N; k++){
+            r->collision_sap_particles[k] = newindex[r->collision_sap_particles[k]];
+        }
+    }
+    r->collision_neighbours_built[0] = -1; // Force a rebuild of the neighbour list
+
+    // Lookup table, hashes stay in their slots
+    if (r->particle_lookup_table){
+        for (int i=0; i<r->allocatedN_lookup; i++){
+            if (r->particle_lookup_table[i].index!=-1 && r->particle_lookup_table[i].index<N){
+                r->particle_lookup_table[i].index = newindex[r->particle_lookup_table[i].index];
+            }
+        }
+    }
+    free(newindex);
+    free(keys);
+}
+
 int reb_remove_by_hash(struct reb_simulation* const r, uint32_t hash, int keepSorted){
     struct reb_particle* p = reb_get_particle_by_hash(r, hash);
     if(p == NULL){
@@ -381,11 +860,387 @@ int reb_remove_by_hash(struct reb_simulation* const r, uint32_t hash, int keepSo
         return 0;
     }
     else{
-        int index = reb_get_particle_index(p);
+        int index = (int)(p - r->particles);
         return reb_remove(r, index, keepSorted);
     }
 }
 
+int reb_remove_many(struct reb_simulation* const r, const int* const indices, const int N_indices, int keepSorted){
+    if (N_indices<=0){
+        return 1;
+    }
+    if (r->N_var){
+        reb_error(r, "Removing particles not supported when calculating MEGNO.  Did not remove particles.");
+        return 0;
+    }
+    if (r->integrator == REB_INTEGRATOR_MERCURIUS){
+        keepSorted = 1; // Force keepSorted for hybrid integrator
+    }
+    if (r->tree_root && keepSorted){
+        reb_error(r, "REBOUND cannot remove particles with a tree and keep the particles sorted. Did not remove particles.");
+        return 0;
+    }
+    // Check all indices before anything is changed
+    char* removed = calloc(r->N, sizeof(char));
+    for (int k=0;k<N_indices;k++){
+        const int index = indices[k];
+        if (index >= r->N || index < 0){
+            char warning[1024];
+            sprintf(warning, "Index %d passed to reb_remove_many was out of range (N=%d).  Did not remove particles.", index, r->N);
+            reb_error(r, warning);
+            free(removed);
+            return 0;
+        }
+        if (removed[index]){
+            char warning[1024];
+            sprintf(warning, "Index %d passed to reb_remove_many more than once.  Did not remove particles.", index);
+            reb_error(r, warning);
+            free(removed);
+            return 0;
+        }
+        removed[index] = 1;
+    }
+    free(removed);
+    if (r->tree_root){
+        // Just flag particles, will be removed in tree_update.
+        for (int k=0;k<N_indices;k++){
+            r->particles[indices[k]].y = nan("");
+            if(r->free_particle_ap){
+                r->free_particle_ap(&r->particles[indices[k]]);
+            }
+        }
+        return 1;
+    }
+    reb_remove_multiple(r, indices, N_indices, keepSorted);
+    return 1;
+}
+
+int reb_remove_by_hash_many(struct reb_simulation* const r, const uint32_t* const hashes, const int N_hashes, int keepSorted){
+    if (N_hashes<=0){
+        return 1;
+    }
+    int* indices = malloc(sizeof(int)*N_hashes);
+    for (int k=0;k<N_hashes;k++){
+        struct reb_particle* p = reb_get_particle_by_hash(r, hashes[k]);
+        if (p == NULL){
+            reb_error(r,"Particle to be removed not found in simulation.  Did not remove particles.");
+            free(indices);
+            return 0;
+        }
+        indices[k] = (int)(p - r->particles);
+    }
+    const int success = reb_remove_many(r, indices, N_hashes, keepSorted);
+    free(indices);
+    return success;
+}
+
+// Returns 1 if frozen particles can be used with the current settings. Otherwise prints an error and returns 0.
+// Returns an error message if frozen particles are not supported, NULL otherwise.
+static const char* reb_frozen_unsupported(const struct reb_simulation* const r){
+    if (r->N_active<=0){
+        return "Only test particles can be frozen. Set N_active first.";
+    }
+    if (r->N_var || r->var_config_N){
+        return "Frozen particles are not supported with variational particles.";
+    }
+    if (r->tree_root || r->gravity==REB_GRAVITY_TREE || r->gravity==REB_GRAVITY_FMM || r->collision==REB_COLLISION_TREE || r->collision==REB_COLLISION_LINETREE){
+        return "Frozen particles are not supported with trees.";
+    }
+    if (r->integrator==REB_INTEGRATOR_MERCURIUS){
+        return "Frozen particles are not supported with MERCURIUS.";
+    }
+    if (r->boundary==REB_BOUNDARY_OPEN){
+        // Particles leaving the box would be removed while the frozen particles are hidden.
+        return "Frozen particles are not supported with open boundaries.";
+    }
+#ifdef MPI
+    return "Frozen particles are not supported with MPI.";
+#endif // MPI
+    return NULL;
+}
+
+static int reb_frozen_check(struct reb_simulation* const r){
+    const char* const msg = reb_frozen_unsupported(r);
+    if (msg){
+        reb_error(r, msg);
+        return 0;
+    }
+    return 1;
+}
+
+static int reb_freeze_set(struct reb_simulation* const r, int index, uint32_t frozen){
+    if (index<0 || index>=r->N){
+        char warning[1024];
+        sprintf(warning, "Index %d out of range (N=%d). Did not change particle.", index, r->N);
+        reb_error(r, warning);
+        return 0;
+    }
+    if (frozen && !reb_frozen_check(r)){
+        return 0;
+    }
+    if (index<r->N_active){
+        reb_error(r, "Only test particles (index >= N_active) can be frozen.");
+        return 0;
+    }
+    if ((r->particles[index].frozen & REB_PARTICLE_FROZEN)==frozen){
+        return 1;
+    }
+    // The integrators' internal coordinates refer to the current set of frozen particles.
+    reb_integrator_synchronize(r);
+    if ((r->particles[index].frozen & REB_PARTICLE_ASLEEP) && r->N_asleep>0){
+        r->N_asleep--; // Frozen and unfrozen particles are awake.
+    }
+    r->particles[index].frozen = frozen?REB_PARTICLE_FROZEN:0;
+    r->N_frozen += frozen?1:-1;
+    r->ri_whfast.recalculate_coordinates_this_timestep = 1;
+    r->ri_mercurius.recalculate_coordinates_this_timestep = 1;
+    return 1;
+}
+
+int reb_freeze(struct reb_simulation* const r, int index){
+    return reb_freeze_set(r, index, 1);
+}
+
+int reb_unfreeze(struct reb_simulation* const r, int index){
+    return reb_freeze_set(r, index, 0);
+}
+
+int reb_remove_frozen(struct reb_simulation* const r){
+    if (r->N_frozen==0){
+        return 0;
+    }
+    int* indices = malloc(sizeof(int)*r->N_frozen);
+    int indices_N = 0;
+    for (int i=0;i<r->N;i++){
+        if ((r->particles[i].frozen & REB_PARTICLE_FROZEN) && indices_N<r->N_frozen){
+            indices[indices_N++] = i;
+        }
+    }
+    if (!reb_remove_many(r, indices, indices_N, 1)){
+        indices_N = 0;
+    }
+    free(indices);
+    return indices_N;
+}
+
+int reb_sink_slot(struct reb_simulation* const r, const int index){
+    if (index<r->N_active || index>=r->N || r->frozen_hidden || reb_frozen_unsupported(r)){
+        return 0;
+    }
+    struct reb_particle* const p = &r->particles[index];
+    if (p->frozen & REB_PARTICLE_FREE){
+        return 1;
+    }
+    // The integrators' internal coordinates refer to the current set of frozen particles.
+    reb_integrator_synchronize(r);
+    if (r->free_particle_ap){
+        r->free_particle_ap(p);
+    }
+    p->ap = NULL;
+    // The hash no longer refers to a particle.
+    reb_lookup_table_move(r, p->hash, index, -1);
+    p->hash = 0;
+    if (!(p->frozen & REB_PARTICLE_FROZEN)){
+        r->N_frozen++;
+    }
+    if ((p->frozen & REB_PARTICLE_ASLEEP) && r->N_asleep>0){
+        r->N_asleep--;
+    }
+    p->frozen = REB_PARTICLE_FROZEN | REB_PARTICLE_FREE;
+    r->ri_whfast.recalculate_coordinates_this_timestep = 1;
+    return 1;
+}
+
+int reb_sink(struct reb_simulation* const r, int index){
+    if (reb_sink_slot(r, index)){
+        return 1;
+    }
+    return reb_remove(r, index, 1);
+}
+
+// Adds a particle in the first free slot at or after *cursor. Returns the index or -1 on failure.
+static int reb_inject_from(struct reb_simulation* const r, struct reb_particle pt, int* const cursor){
+    if (r->N_frozen && !r->frozen_hidden){
+        for (int i=*cursor;i<r->N;i++){
+            if (!(r->particles[i].frozen & REB_PARTICLE_FREE)){
+                continue;
+            }
+            *cursor = i+1;
+            reb_integrator_synchronize(r);
+            reb_max_radius_update(r, pt.r);
+            pt.sim = r;
+            pt.c = NULL;
+            pt.frozen = 0;
+            r->particles[i] = pt;
+            r->N_frozen--;
+            reb_lookup_table_add(r, i);
+            r->ri_whfast.recalculate_coordinates_this_timestep = 1;
+            r->N_injected++;
+            return i;
+        }
+        *cursor = r->N;
+    }
+    const int N = r->N;
+    reb_add(r, pt);
+    if (r->N==N){
+        return -1;
+    }
+    r->N_injected++;
+    return r->N-1;
+}
+
+int reb_inject(struct reb_simulation* const r, struct reb_particle pt){
+    int cursor = r->N_active>0?r->N_active:0;
+    return reb_inject_from(r, pt, &cursor);
+}
+
+void reb_inject_update(struct reb_simulation* const r){
+    if (r->injector==NULL || r->inject_rate<=0.){
+        return;
+    }
+    const double n = r->inject_carry + r->inject_rate*fabs(r->dt);
+    const int N_new = (int)n;
+    r->inject_carry = n-N_new;
+    if (N_new==0){
+        return;
+    }
+    if (r->inject_pool>0 && r->allocatedN<r->N+N_new){
+        // Grow once so that the next injections do not need to reallocate the particle array.
+        int allocatedN = r->allocatedN;
+        while (allocatedN<r->N+N_new){
+            allocatedN = allocatedN*2>r->N+N_new+r->inject_pool ? allocatedN*2 : r->N+N_new+r->inject_pool;
+        }
+        r->particles = reb_tools_realloc_aligned(r->particles, sizeof(struct reb_particle), r->N, allocatedN);
+        r->allocatedN = allocatedN;
+    }
+    int cursor = r->N_active>0?r->N_active:0;
+    for (int k=0;k<N_new;k++){
+        struct reb_particle p = {0};
+        r->injector(r, &p);
+        reb_inject_from(r, p, &cursor);
+    }
+}
+
+void reb_frozen_recount(struct reb_simulation* const r){
+    int N_frozen = 0;
+    int N_asleep = 0;
+    for (int i=0;i<r->N && i<r->allocatedN;i++){
+        uint32_t state = r->particles[i].frozen;
+        if (r->sleep_v<=0. && state>REB_PARTICLE_FROZEN && state!=(REB_PARTICLE_FROZEN|REB_PARTICLE_FREE)){
+            state = 0; // Clears uninitialized values in old files.
+        }
+        if (i<r->N_active){
+            state &= ~(REB_PARTICLE_FROZEN|REB_PARTICLE_FREE); // Only test particles can be frozen.
+        }
+        N_frozen += (state & REB_PARTICLE_FROZEN)?1:0;
+        N_asleep += (state & REB_PARTICLE_ASLEEP)?1:0;
+        r->particles[i].frozen = state;
+    }
+    r->N_frozen = N_frozen;
+    r->N_asleep = N_asleep;
+}
+
+void reb_sleep_update(struct reb_simulation* const r){
+    if (r->sleep_v<=0. && r->N_asleep==0){
+        return;
+    }
+    if (r->sleep_v>0. && r->integrator!=REB_INTEGRATOR_LEAPFROG){
+        reb_error(r, "Sleeping particles are only supported with the LEAPFROG integrator. Sleeping disabled.");
+        r->sleep_v = 0.;
+    }
+    const double v2max = r->sleep_v*r->sleep_v;
+    const double a2max = r->sleep_a*r->sleep_a;
+    const uint32_t sleep_steps = r->sleep_steps>1?r->sleep_steps:1;
+    struct reb_particle* const particles = r->particles;
+    int N_asleep = 0;
+    for (int i=0;i<r->N;i++){
+        struct reb_particle* const p = &particles[i];
+        const uint32_t state = p->frozen;
+        if (r->sleep_v<=0. || (state & REB_PARTICLE_FROZEN)){
+            p->frozen = state & REB_PARTICLE_FROZEN; // Wake up and reset the counter.
+            continue;
+        }
+        const double v2 = p->vx*p->vx + p->vy*p->vy + p->vz*p->vz;
+        const double a2 = p->ax*p->ax + p->ay*p->ay + p->az*p->az;
+        const int quiet = v2<v2max && (r->sleep_a<=0. || a2<a2max);
+        if (!quiet){
+            p->frozen = 0;
+            continue;
+        }
+        const uint32_t steps = (state & REB_PARTICLE_ASLEEP)?sleep_steps:(state>>8)+1;
+        if (steps<sleep_steps){
+            p->frozen = steps<<8;
+            continue;
+        }
+        // Sleeping particles are at rest. Small velocity changes from collisions are discarded.
+        p->frozen = REB_PARTICLE_ASLEEP;
+        p->vx = 0.;
+        p->vy = 0.;
+        p->vz = 0.;
+        N_asleep++;
+    }
+    r->N_asleep = N_asleep;
+}
+
+int reb_frozen_hide(struct reb_simulation* const r){
+    if (r->N_frozen==0 || r->frozen_hidden){
+        return 0;
+    }
+    if (!reb_frozen_check(r)){
+        r->status = REB_EXIT_ERROR;
+        return 0;
+    }
+    // Partition the test particles: visible particles in [N_active, lo), frozen particles in [lo, N).
+    // Only frozen particles in front of the boundary are swapped with visible particles behind it.
+    struct reb_particle* const particles = r->particles;
+    int lo = r->N_active;
+    int hi = r->N-1;
+    int swaps_N = 0;
+    while (lo<=hi){
+        if (!(particles[lo].frozen & REB_PARTICLE_FROZEN)){
+            lo++;
+        }else if (particles[hi].frozen & REB_PARTICLE_FROZEN){
+            hi--;
+        }else{
+            if (r->frozen_swaps_allocatedN<=swaps_N){
+                r->frozen_swaps_allocatedN = r->frozen_swaps_allocatedN ? r->frozen_swaps_allocatedN*2 : 32;
+                r->frozen_swaps = realloc(r->frozen_swaps, sizeof(int)*2*r->frozen_swaps_allocatedN);
+            }
+            const struct reb_particle tmp = particles[lo];
+            particles[lo] = particles[hi];
+            particles[hi] = tmp;
+            r->frozen_swaps[2*swaps_N] = lo;
+            r->frozen_swaps[2*swaps_N+1] = hi;
+            swaps_N++;
+            lo++;
+            hi--;
+        }
+    }
+    // The scan also recounts the frozen particles in case particles were removed.
+    r->N_frozen = r->N-lo;
+    r->frozen_hidden = r->N_frozen;
+    r->frozen_swaps_N = swaps_N;
+    r->N = lo;
+    return r->frozen_hidden>0;
+}
+
+void reb_frozen_restore(struct reb_simulation* const r){
+    if (r->frozen_hidden==0){
+        return;
+    }
+    r->N += r->frozen_hidden;
+    r->frozen_hidden = 0;
+    struct reb_particle* const particles = r->particles;
+    for (int k=r->frozen_swaps_N-1;k>=0;k--){
+        const int lo = r->frozen_swaps[2*k];
+        const int hi = r->frozen_swaps[2*k+1];
+        const struct reb_particle tmp = particles[lo];
+        particles[lo] = particles[hi];
+        particles[hi] = tmp;
+    }
+    r->frozen_swaps_N = 0;
+}
+
 void reb_particle_isub(struct reb_particle* p1, struct reb_particle* p2){
     p1->x -= p2->x;
     p1->y -= p2->y;
@@ -439,8 +1294,38 @@ struct reb_particle reb_particle_nan(void){
     p.lastcollision = nan("");
     p.c = NULL;
     p.hash = 0;
+    p.frozen = 0;
     p.ap = NULL;
     p.sim = NULL;
 
     return p;
 }
+
+int reb_particles_soa_update(struct reb_simulation* const r, const int N, const int radii){
+    const int Np = (N+7)&~7;
+    if (r->particles_soa_allocatedN<Np){
+        free(r->particles_soa);
+        r->particles_soa = aligned_alloc(64, sizeof(double)*5*Np);
+        r->particles_soa_allocatedN = Np;
+    }
+    double* const soa = r->particles_soa;
+    const struct reb_particle* const particles = r->particles;
+    for (int i=0; i<N; i++){
+        soa[i]      = particles[i].x;
+        soa[Np+i]   = particles[i].y;
+        soa[2*Np+i] = particles[i].z;
+        soa[3*Np+i] = particles[i].m;
+    }
+    if (radii){
+        for (int i=0; i<N; i++){
+            soa[4*Np+i] = particles[i].r;
+        }
+    }
+    const int N_arrays = radii?5:4;
+    for (int k=0; k<N_arrays; k++){
+        for (int i=N; i<Np; i++){
+            soa[k*Np+i] = 0.;
+        }
+    }
+    return Np;
+}
@@ -40,4 +40,75 @@ int reb_get_rootbox_for_particle(const struct reb_simulation* const r, struct re
  * @brief Returns 1 if a testparticle of type 0 has a finite mass.
  */
 int reb_particle_check_testparticles(struct reb_simulation* const r);
+
+/**
+ * @brief Removes several particles at once.
+ * @details The result is the same as calling reb_remove() for every particle 
+ * in the given order, but the particle array, the hash lookup table and 
+ * the MERCURIUS encounter map are only updated once. Does not work with
+ * a tree (particles are flagged by reb_remove() and removed in reb_tree_update()).
+ * @param r REBOUND simulation to work on.
+ * @param indices Indices of the particles to be removed. All indices refer
+ * to the particle array before any particle is removed and must be unique. 
+ * @param indices_N Number of particles to be removed.
+ * @param keepSorted If 1, the order of the remaining particles is preserved.
+ */
+void reb_remove_multiple(struct reb_simulation* const r, const int* const indices, const int indices_N, int keepSorted);
+
+/**
+ * @brief Copies the particle data into the structure of arrays r->particles_soa.
+ * @details The arrays x, y, z, m and r follow each other in this order. 
+ * Each has the returned length, is aligned to 64 bytes, and padded with zeros 
+ * to a multiple of 8 particles. The particle array stays the authoritative copy.
+ * @param r REBOUND simulation to work on.
+ * @param N Number of particles to copy.
+ * @param radii If 0, only positions and masses are copied.
+ * @return The padded length of every array.
+ */
+int reb_particles_soa_update(struct reb_simulation* const r, const int N, const int radii);
+
+/**
+ * @brief Moves the frozen test particles behind the first r->N particles.
+ * @details Frozen particles are swapped with visible test particles from the end of the 
+ * array and r->N is reduced, so that integrators, gravity routines and additional forces
+ * do not see them. The permutation only depends on the set of frozen particles.
+ * Does nothing if no particles are frozen or they are already hidden.
+ * @return 1 if particles were hidden and reb_frozen_restore() needs to be called.
+ */
+int reb_frozen_hide(struct reb_simulation* const r);
+
+/**
+ * @brief Undoes reb_frozen_hide(). All particles are back at their original index.
+ */
+void reb_frozen_restore(struct reb_simulation* const r);
+
+/**
+ * @brief Recalculates r->N_frozen and r->N_asleep, e.g. after the particles have been read from a file.
+ */
+void reb_frozen_recount(struct reb_simulation* const r);
+
+/**
+ * @brief Puts particles to sleep and wakes them up. Called at the beginning of every timestep.
+ * @details Awake particles which have been slower than sleep_v (and have had an acceleration 
+ * below sleep_a if set) during the last sleep_steps timesteps fall asleep. Their velocity is set 
+ * to zero. Sleeping particles wake up as soon as they no longer satisfy these conditions, 
+ * for example after a collision with an awake particle. Otherwise their velocity is set to 
+ * zero again. Also recounts r->N_asleep.
+ */
+void reb_sleep_update(struct reb_simulation* const r);
+
+/**
+ * @brief Turns a test particle into a free slot which can be reused by reb_inject().
+ * @details The particle is frozen and flagged with REB_PARTICLE_FREE. Does nothing and 
+ * returns 0 if frozen particles are not supported in this simulation.
+ * @return 1 if the slot is free.
+ */
+int reb_sink_slot(struct reb_simulation* const r, const int index);
+
+/**
+ * @brief Calls the injector inject_rate*dt times (on average). Called at the beginning of every timestep.
+ * @details If inject_pool is set, the particle array is grown at once so that it has room 
+ * for at least inject_pool more particles. Free slots are filled first.
+ */
+void reb_inject_update(struct reb_simulation* const r);
 #endif // _PARTICLE_H
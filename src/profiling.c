@@ -0,0 +1,366 @@
+/**
+ * @file 	profiling.c
+ * @brief 	Per-simulation profiler with nested scopes.
+ * @author 	Hanno Rein <hanno@hanno-rein.de>
+ *
+ * @details 	If r->profiling is set, the time spent between
+ * reb_profiling_start() and reb_profiling_stop() is accumulated for every
+ * scope in enum REB_PROFILING. Scopes can be nested. The time of a nested
+ * scope is also counted as part of the enclosing scope, and separately
+ * recorded as nested time so that the time spent in a scope itself can be
+ * calculated. Every OpenMP thread has its own accumulators, so scopes can
+ * be used within parallel regions. A monotonic clock is used.
+ *
+ * If r->profiling_trace is larger than zero, every thread additionally
+ * records the start time and duration of the most recent scopes in a ring
+ * buffer. The events can be written to a file in the Chrome trace format
+ * with reb_profiling_trace_write() and inspected with Perfetto or
+ * chrome://tracing to see, for example, load imbalance between threads.
+ *
+ * If compiled with PERF_EVENTS=1 (Linux only), hardware performance
+ * counters such as cycles, instructions and cache misses are read with
+ * perf_event_open() when the outermost instance of a scope is entered
+ * and left. Every thread opens its own counters the first time it enters
+ * a scope. Reading the counters requires one system call per scope, so
+ * this is off by default.
+ *
+ * @section LICENSE
+ * Copyright (c) 2023 Hanno Rein
+ *
+ * This file is part of rebound.
+ *
+ * rebound is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rebound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rebound.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "rebound.h"
+#include "profiling.h"
+#ifdef OPENMP
+#include <omp.h>
+#endif // OPENMP
+#ifdef PERF_EVENTS
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif // PERF_EVENTS
+
+static const char* reb_profiling_names[REB_PROFILING_N] = {
+    "step",
+    "integrator part1",
+    "integrator part2",
+    "kepler",
+    "interaction",
+    "jump",
+    "coordinates",
+    "boundary",
+    "tree build",
+    "tree moments",
+    "gravity",
+    "additional forces",
+    "collision search",
+    "collision resolve",
+    "heartbeat",
+    "io",
+    "mpi",
+};
+
+static const char* reb_profiling_counter_names[REB_PROFILING_COUNTER_N] = {
+    "cycles",
+    "instructions",
+    "cache references",
+    "cache misses",
+    "branch misses",
+};
+
+#ifdef PERF_EVENTS
+static const uint64_t reb_profiling_counter_config[REB_PROFILING_COUNTER_N] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_REFERENCES,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+// Opens the hardware counters of the calling thread as one group so that 
+// they can be read with a single system call. Returns 0 if not available.
+static int reb_profiling_counters_open(struct reb_profiling_thread* const pt){
+    for (int c=0;c<REB_PROFILING_COUNTER_N;c++){
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = reb_profiling_counter_config[c];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+        const int group_fd = c==0?-1:pt->counters_fd[0];
+        const int fd = syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+        if (fd<0){
+            for (int d=0;d<c;d++){
+                close(pt->counters_fd[d]);
+            }
+            for (int d=0;d<REB_PROFILING_COUNTER_N;d++){
+                pt->counters_fd[d] = -1;
+            }
+            return 0;
+        }
+        pt->counters_fd[c] = fd;
+    }
+    return 1;
+}
+
+// Reads all hardware counters of the calling thread. Returns 0 if not available.
+static int reb_profiling_counters_read(struct reb_profiling_thread* const pt, unsigned long long* const values){
+    if (pt->counters_fd[0]==0){
+        reb_profiling_counters_open(pt);
+    }
+    if (pt->counters_fd[0]<0){
+        return 0;
+    }
+    struct {
+        uint64_t nr;
+        uint64_t values[REB_PROFILING_COUNTER_N];
+    } data;
+    if (read(pt->counters_fd[0], &data, sizeof(data))!=sizeof(data)){
+        return 0;
+    }
+    for (int c=0;c<REB_PROFILING_COUNTER_N;c++){
+        values[c] = data.values[c];
+    }
+    return 1;
+}
+#endif // PERF_EVENTS
+
+static double reb_profiling_clock(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static struct reb_profiling_thread* reb_profiling_thread(const struct reb_simulation* const r){
+#ifdef OPENMP
+    const int t = omp_get_thread_num();
+#else // OPENMP
+    const int t = 0;
+#endif // OPENMP
+    if (t>=r->profiling_threads_N){
+        // Not allocated yet or more threads than at the beginning of the timestep.
+        return NULL;
+    }
+    return &r->profiling_threads[t];
+}
+
+void reb_profiling_prepare(struct reb_simulation* const r){
+#ifdef OPENMP
+    const int threads = omp_get_max_threads();
+#else // OPENMP
+    const int threads = 1;
+#endif // OPENMP
+    if (threads>r->profiling_threads_N){
+        r->profiling_threads = realloc(r->profiling_threads, sizeof(struct reb_profiling_thread)*threads);
+        memset(r->profiling_threads+r->profiling_threads_N, 0, sizeof(struct reb_profiling_thread)*(threads-r->profiling_threads_N));
+        r->profiling_threads_N = threads;
+    }
+    for (int t=0;t<r->profiling_threads_N;t++){
+        struct reb_profiling_thread* const pt = &r->profiling_threads[t];
+        pt->stack_N = 0;
+        memset(pt->active, 0, sizeof(pt->active));
+        const int trace_N = r->profiling_trace>0?r->profiling_trace:0;
+        if (pt->trace_allocated_N!=trace_N){
+            free(pt->trace);
+            pt->trace = trace_N?malloc(sizeof(struct reb_profiling_event)*trace_N):NULL;
+            pt->trace_allocated_N = trace_N;
+            pt->trace_N = 0;
+        }
+    }
+#ifdef PERF_EVENTS
+    // The counters of other threads are opened when they first enter a scope.
+    struct reb_profiling_thread* const pt = reb_profiling_thread(r);
+    if (pt && pt->counters_fd[0]==0 && !reb_profiling_counters_open(pt)){
+        reb_warning(r, "Hardware performance counters are not available. Check /proc/sys/kernel/perf_event_paranoid.");
+    }
+#endif // PERF_EVENTS
+}
+
+void reb_profiling_free(struct reb_simulation* const r){
+    for (int t=0;t<r->profiling_threads_N;t++){
+        struct reb_profiling_thread* const pt = &r->profiling_threads[t];
+        free(pt->trace);
+#ifdef PERF_EVENTS
+        for (int c=0;c<REB_PROFILING_COUNTER_N;c++){
+            if (pt->counters_fd[c]>0){
+                close(pt->counters_fd[c]);
+            }
+        }
+#endif // PERF_EVENTS
+    }
+    free(r->profiling_threads);
+    r->profiling_threads = NULL;
+    r->profiling_threads_N = 0;
+}
+
+void reb_profiling_start_internal(const struct reb_simulation* const r, const enum REB_PROFILING scope){
+    struct reb_profiling_thread* const pt = reb_profiling_thread(r);
+    if (pt==NULL || pt->stack_N>=REB_PROFILING_DEPTH_MAX){
+        return;
+    }
+    pt->calls[scope]++;
+    pt->active[scope]++;
+    pt->stack[pt->stack_N] = scope;
+#ifdef PERF_EVENTS
+    if (pt->active[scope]==1){
+        reb_profiling_counters_read(pt, pt->stack_counters[pt->stack_N]);
+    }
+#endif // PERF_EVENTS
+    pt->stack_start[pt->stack_N] = reb_profiling_clock();
+    pt->stack_N++;
+}
+
+void reb_profiling_stop_internal(const struct reb_simulation* const r, const enum REB_PROFILING scope){
+    struct reb_profiling_thread* const pt = reb_profiling_thread(r);
+    if (pt==NULL || pt->stack_N==0 || pt->stack[pt->stack_N-1]!=(int)scope){
+        // Profiling was turned on within this scope or scopes are not nested properly.
+        return;
+    }
+    pt->stack_N--;
+    pt->active[scope]--;
+    if (pt->active[scope]){
+        // Recursive call. Only the outermost scope is timed.
+        return;
+    }
+    const double dt = reb_profiling_clock() - pt->stack_start[pt->stack_N];
+    pt->time[scope] += dt;
+#ifdef PERF_EVENTS
+    unsigned long long values[REB_PROFILING_COUNTER_N];
+    if (reb_profiling_counters_read(pt, values)){
+        for (int c=0;c<REB_PROFILING_COUNTER_N;c++){
+            pt->counters[scope][c] += values[c] - pt->stack_counters[pt->stack_N][c];
+        }
+    }
+#endif // PERF_EVENTS
+    if (pt->trace_allocated_N){
+        struct reb_profiling_event* const e = &pt->trace[pt->trace_N%pt->trace_allocated_N];
+        e->start = pt->stack_start[pt->stack_N];
+        e->duration = dt;
+        e->scope = scope;
+        pt->trace_N++;
+    }
+    if (pt->stack_N>0){
+        pt->time_nested[pt->stack[pt->stack_N-1]] += dt;
+    }
+}
+
+double reb_profiling_time(const struct reb_simulation* const r, const enum REB_PROFILING scope, const int thread){
+    if (scope<0 || scope>=REB_PROFILING_N) return 0.;
+    double time = 0.;
+    for (int t=0;t<r->profiling_threads_N;t++){
+        if (thread==-1 || thread==t){
+            time += r->profiling_threads[t].time[scope];
+        }
+    }
+    return time;
+}
+
+double reb_profiling_time_self(const struct reb_simulation* const r, const enum REB_PROFILING scope, const int thread){
+    if (scope<0 || scope>=REB_PROFILING_N) return 0.;
+    double time = 0.;
+    for (int t=0;t<r->profiling_threads_N;t++){
+        if (thread==-1 || thread==t){
+            time += r->profiling_threads[t].time[scope] - r->profiling_threads[t].time_nested[scope];
+        }
+    }
+    return time;
+}
+
+unsigned long reb_profiling_calls(const struct reb_simulation* const r, const enum REB_PROFILING scope, const int thread){
+    if (scope<0 || scope>=REB_PROFILING_N) return 0;
+    unsigned long calls = 0;
+    for (int t=0;t<r->profiling_threads_N;t++){
+        if (thread==-1 || thread==t){
+            calls += r->profiling_threads[t].calls[scope];
+        }
+    }
+    return calls;
+}
+
+const char* reb_profiling_name(const enum REB_PROFILING scope){
+    if (scope<0 || scope>=REB_PROFILING_N) return NULL;
+    return reb_profiling_names[scope];
+}
+
+unsigned long long reb_profiling_counter(const struct reb_simulation* const r, const enum REB_PROFILING scope, const enum REB_PROFILING_COUNTER counter, const int thread){
+    if (scope<0 || scope>=REB_PROFILING_N) return 0;
+    if (counter<0 || counter>=REB_PROFILING_COUNTER_N) return 0;
+    unsigned long long value = 0;
+    for (int t=0;t<r->profiling_threads_N;t++){
+        if (thread==-1 || thread==t){
+            value += r->profiling_threads[t].counters[scope][counter];
+        }
+    }
+    return value;
+}
+
+const char* reb_profiling_counter_name(const enum REB_PROFILING_COUNTER counter){
+    if (counter<0 || counter>=REB_PROFILING_COUNTER_N) return NULL;
+    return reb_profiling_counter_names[counter];
+}
+
+void reb_profiling_reset(struct reb_simulation* const r){
+    for (int t=0;t<r->profiling_threads_N;t++){
+        struct reb_profiling_thread* const pt = &r->profiling_threads[t];
+        memset(pt->time, 0, sizeof(pt->time));
+        memset(pt->time_nested, 0, sizeof(pt->time_nested));
+        memset(pt->calls, 0, sizeof(pt->calls));
+        memset(pt->counters, 0, sizeof(pt->counters));
+        pt->trace_N = 0;
+    }
+}
+
+void reb_profiling_trace_write(struct reb_simulation* const r, const char* const filename){
+#ifdef MPI
+    char filename_mpi[1024];
+    sprintf(filename_mpi,"%s_%d",filename,r->mpi_id);
+    FILE* of = fopen(filename_mpi,"w"); 
+    const int pid = r->mpi_id;
+#else // MPI
+    FILE* of = fopen(filename,"w"); 
+    const int pid = 0;
+#endif // MPI
+    if (of==NULL){
+        reb_error(r, "Can not open file.");
+        return;
+    }
+    // Timestamps are in microseconds. Files written by different MPI nodes 
+    // on the same machine share the same clock and can be merged.
+    fprintf(of, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(of, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"rebound %d\"}}", pid, pid);
+    for (int t=0;t<r->profiling_threads_N;t++){
+        const struct reb_profiling_thread* const pt = &r->profiling_threads[t];
+        fprintf(of, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}", pid, t, t);
+        if (pt->trace_allocated_N==0) continue;
+        // Oldest event first. Older events have been overwritten if the ring buffer is full.
+        const unsigned long first = pt->trace_N>(unsigned long)pt->trace_allocated_N?pt->trace_N-pt->trace_allocated_N:0;
+        for (unsigned long i=first;i<pt->trace_N;i++){
+            const struct reb_profiling_event* const e = &pt->trace[i%pt->trace_allocated_N];
+            fprintf(of, ",\n{\"name\":\"%s\",\"cat\":\"rebound\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d}", reb_profiling_names[e->scope], e->start*1e6, e->duration*1e6, pid, t);
+        }
+    }
+    fprintf(of, "\n]}\n");
+    fclose(of);
+}
@@ -0,0 +1,64 @@
+/**
+ * @file 	profiling.h
+ * @brief 	Per-simulation profiler with nested scopes.
+ * @author 	Hanno Rein <hanno@hanno-rein.de>
+ *
+ * @section LICENSE
+ * Copyright (c) 2023 Hanno Rein
+ *
+ * This file is part of rebound.
+ *
+ * rebound is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rebound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rebound.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef _PROFILING_H
+#define _PROFILING_H
+#include "rebound.h"
+
+/**
+ * @brief Allocates one set of accumulators per OpenMP thread if needed.
+ * @details Called at the beginning of every timestep if profiling is enabled,
+ * outside of any parallel region and scope. Scopes which were left open
+ * because profiling was turned off within them are discarded.
+ */
+void reb_profiling_prepare(struct reb_simulation* const r);
+
+/**
+ * @brief Frees the accumulators and closes the hardware counters.
+ */
+void reb_profiling_free(struct reb_simulation* const r);
+
+void reb_profiling_start_internal(const struct reb_simulation* const r, const enum REB_PROFILING scope);
+void reb_profiling_stop_internal(const struct reb_simulation* const r, const enum REB_PROFILING scope);
+
+/**
+ * @brief Enters a profiling scope. Does nothing but one branch if profiling is disabled.
+ * @details Can be called from within a parallel region. Every thread accumulates its own times.
+ */
+static inline void reb_profiling_start(const struct reb_simulation* const r, const enum REB_PROFILING scope){
+    if (r->profiling){
+        reb_profiling_start_internal(r, scope);
+    }
+}
+
+/**
+ * @brief Leaves a profiling scope previously entered with reb_profiling_start().
+ */
+static inline void reb_profiling_stop(const struct reb_simulation* const r, const enum REB_PROFILING scope){
+    if (r->profiling){
+        reb_profiling_stop_internal(r, scope);
+    }
+}
+
+#endif // _PROFILING_H
@@ -34,6 +34,7 @@
 #include <sys/wait.h>
 #include <pthread.h>
 #include <fcntl.h>
+#include <errno.h>
 #include "rebound.h"
 #include "integrator.h"
 #include "integrator_saba.h"
@@ -41,10 +42,16 @@
 #include "integrator_ias15.h"
 #include "integrator_mercurius.h"
 #include "integrator_bs.h"
+#include "integrator_block.h"
 #include "integrator_tes.h"
 #include "boundary.h"
 #include "gravity.h"
 #include "collision.h"
+#include "autotune.h"
+#include "profiling.h"
+#include "memory.h"
+#include "ephemeris.h"
+#include "compact.h"
 #include "tree.h"
 #include "output.h"
 #include "tools.h"
@@ -71,73 +78,183 @@ const char* reb_githash_str = STRINGIFY(GITHASH);             // This line gets
 
 static int reb_error_message_waiting(struct reb_simulation* const r);
 
+static void reb_heartbeat_async_flush(struct reb_simulation* const r);
+
+static void reb_step_core(struct reb_simulation* const r);
+
 void reb_steps(struct reb_simulation* const r, unsigned int N_steps){
     for (unsigned int i=0;i<N_steps;i++){
         reb_step(r);
     }
 }
+
+void reb_steps_fast(struct reb_simulation* const r, unsigned int N_steps){
+    // Choose gravity and collision routines if they are selected automatically.
+    reb_autotune_select(r);
+    if (r->pre_timestep_modifications || r->post_timestep_modifications || r->gravity_autotune.mode || r->collision_autotune.mode){
+        // These need to synchronize or time every step.
+        reb_steps(r, N_steps);
+        return;
+    }
+    struct timeval time_beginning;
+    gettimeofday(&time_beginning,NULL);
+    for (unsigned int i=0;i<N_steps;i++){
+        reb_step_core(r);
+        r->steps_done++;
+    }
+    struct timeval time_end;
+    gettimeofday(&time_end,NULL);
+    r->walltime += time_end.tv_sec-time_beginning.tv_sec+(time_end.tv_usec-time_beginning.tv_usec)/1e6;
+}
+
 void reb_step(struct reb_simulation* const r){
     // Update walltime
     struct timeval time_beginning;
     gettimeofday(&time_beginning,NULL);
 
+    // Choose gravity and collision routines if they are selected automatically.
+    reb_autotune_select(r);
+
+    reb_step_core(r);
+    
+    // Update walltime
+    struct timeval time_end;
+    gettimeofday(&time_end,NULL);
+    const double walltime_step = time_end.tv_sec-time_beginning.tv_sec+(time_end.tv_usec-time_beginning.tv_usec)/1e6;
+    r->walltime += walltime_step;
+    reb_autotune_update(r, walltime_step);
+    // Update step counter
+    r->steps_done++; // This also counts failed IAS15 steps
+}
+
+// One timestep without walltime accounting and without updating steps_done.
+static void reb_step_core(struct reb_simulation* const r){
+#ifdef MPI
+    if (r->mpi_decomposition==REB_MPI_DECOMPOSITION_TESTPARTICLES && !reb_communication_mpi_testparticle_decomposition_supported(r)){
+        return;
+    }
+#endif // MPI
+    if (r->profiling){
+        reb_profiling_prepare(r);
+    }
+    reb_profiling_start(r, REB_PROFILING_STEP);
     // A 'DKD'-like integrator will do the first 'D' part.
-    PROFILING_START()
+    reb_profiling_start(r, REB_PROFILING_INTEGRATOR_PART1);
     if (r->pre_timestep_modifications){
         reb_integrator_synchronize(r);
         r->pre_timestep_modifications(r);
         r->ri_whfast.recalculate_coordinates_this_timestep = 1;
         r->ri_mercurius.recalculate_coordinates_this_timestep = 1;
     }
+    // New test particles from the injector.
+    reb_inject_update(r);
+    // Sleeping particles are skipped by the integrator.
+    reb_sleep_update(r);
+    if ((r->collision_line_hermite || r->collision_line_ias15) && r->collision==REB_COLLISION_LINE){
+        reb_collision_line_store(r);
+    }
+    // Frozen particles are moved out of sight until the integrator step is complete.
+    const int frozen_hidden = reb_frozen_hide(r);
    
-    reb_integrator_part1(r);
-    PROFILING_STOP(PROFILING_CAT_INTEGRATOR)
+    // Leapfrog and SEI can shift particles back into the box during their drift.
+    const int drift_applies_boundary = reb_integrator_drift_applies_boundary(r);
+    const int needs_tree = r->tree_needs_update || r->gravity==REB_GRAVITY_TREE || r->gravity==REB_GRAVITY_FMM || r->collision==REB_COLLISION_TREE || r->collision==REB_COLLISION_LINETREE;
+    if (needs_tree && drift_applies_boundary){
+        reb_integrator_part1_boundary(r);
+    }else{
+        reb_integrator_part1(r);
+    }
+    if (r->compact.N){
+        reb_compact_drift(r);
+    }
+    reb_profiling_stop(r, REB_PROFILING_INTEGRATOR_PART1);
 
     // Update and simplify tree. 
     // Prepare particles for distribution to other nodes. 
     // This function also creates the tree if called for the first time.
-    if (r->tree_needs_update || r->gravity==REB_GRAVITY_TREE || r->collision==REB_COLLISION_TREE || r->collision==REB_COLLISION_LINETREE){
+    if (needs_tree){
         // Check for root crossings.
-        PROFILING_START()
-        reb_boundary_check(r);     
-        PROFILING_STOP(PROFILING_CAT_BOUNDARY)
+        if (!drift_applies_boundary){
+            reb_profiling_start(r, REB_PROFILING_BOUNDARY);
+            reb_boundary_check(r);     
+            reb_profiling_stop(r, REB_PROFILING_BOUNDARY);
+        }
 
         // Update tree (this will remove particles which left the box)
-        PROFILING_START()
+        reb_profiling_start(r, REB_PROFILING_TREE_BUILD);
         reb_tree_update(r);          
-        PROFILING_STOP(PROFILING_CAT_GRAVITY)
+#ifdef MPI
+        // Measure the cost of each root box and reassign root boxes to nodes if needed.
+        reb_communication_mpi_update_rootbox_cost(r);
+        if (r->mpi_rebalance_interval>0 && (r->steps_done+1)%r->mpi_rebalance_interval==0){
+            reb_communication_mpi_rebalance(r);
+        }
+#endif // MPI
+        reb_profiling_stop(r, REB_PROFILING_TREE_BUILD);
     }
 
-    PROFILING_START()
 #ifdef MPI
     // Distribute particles and add newly received particles to tree.
-    reb_communication_mpi_distribute_particles(r);
+    // Particles never move between nodes with the test particle decomposition.
+    if (r->mpi_decomposition==REB_MPI_DECOMPOSITION_ROOTBOXES){
+        reb_communication_mpi_distribute_particles(r);
+    }
 #endif // MPI
 
     if (r->tree_root!=NULL && r->gravity==REB_GRAVITY_TREE){
         // Update center of mass and quadrupole moments in tree in preparation of force calculation.
+        reb_profiling_start(r, REB_PROFILING_TREE_MOMENTS);
         reb_tree_update_gravity_data(r); 
+        reb_profiling_stop(r, REB_PROFILING_TREE_MOMENTS);
 #ifdef MPI
         // Prepare essential tree (and particles close to the boundary needed for collisions) for distribution to other nodes.
         reb_tree_prepare_essential_tree_for_gravity(r);
 
-        // Transfer essential tree and particles needed for collisions.
-        reb_communication_mpi_distribute_essential_tree_for_gravity(r);
+        // Start transferring the essential tree. The gravity routine computes
+        // the local part of the forces first and adds remote cells as they arrive.
+        reb_communication_mpi_distribute_essential_tree_for_gravity_start(r);
 #endif // MPI
     }
 
     // Calculate accelerations. 
+    if (r->ephemeris){
+        reb_ephemeris_update_particles(r);
+    }
+    reb_profiling_start(r, REB_PROFILING_GRAVITY);
     reb_calculate_acceleration(r);
+#ifdef MPI
+    // Complete the essential tree exchange if the gravity routine has not done so.
+    while (reb_communication_mpi_distribute_essential_tree_for_gravity_next(r)>=0){ }
+#endif // MPI
     if (r->N_var){
         reb_calculate_acceleration_var(r);
     }
+    reb_profiling_stop(r, REB_PROFILING_GRAVITY);
     // Calculate non-gravity accelerations. 
-    if (r->additional_forces) r->additional_forces(r);
-    PROFILING_STOP(PROFILING_CAT_GRAVITY)
+    reb_profiling_start(r, REB_PROFILING_ADDITIONAL_FORCES);
+    reb_calculate_additional_forces(r);
+    reb_profiling_stop(r, REB_PROFILING_ADDITIONAL_FORCES);
+    if (r->ephemeris){
+        reb_ephemeris_update_accelerations(r);
+    }
 
     // A 'DKD'-like integrator will do the 'KD' part.
-    PROFILING_START()
-    reb_integrator_part2(r);
+    reb_profiling_start(r, REB_PROFILING_INTEGRATOR_PART2);
+    if (r->compact.N){
+        // Compact test particles need the accelerations of the active particles at the half step.
+        reb_compact_kick_drift(r);
+    }
+    // The boundary conditions can only be applied during the drift if
+    // nothing else modifies the particles after the integrator step.
+    const int part2_applies_boundary = drift_applies_boundary && !r->post_timestep_modifications && !r->N_var;
+    if (part2_applies_boundary){
+        reb_integrator_part2_boundary(r);
+    }else{
+        reb_integrator_part2(r);
+    }
+    if (frozen_hidden){
+        reb_frozen_restore(r);
+    }
     
     if (r->post_timestep_modifications){
         reb_integrator_synchronize(r);
@@ -149,29 +266,38 @@ void reb_step(struct reb_simulation* const r){
     if (r->N_var){
         reb_var_rescale(r);
     }
-    PROFILING_STOP(PROFILING_CAT_INTEGRATOR)
+    if (r->ephemeris){
+        // The integrator has moved the active particles. Put them back onto the ephemeris.
+        reb_ephemeris_update_particles(r);
+    }
+    reb_profiling_stop(r, REB_PROFILING_INTEGRATOR_PART2);
 
     // Do collisions here. We need both the positions and velocities at the same time.
     // Check for root crossings.
-    PROFILING_START()
-    reb_boundary_check(r);     
+    if (!part2_applies_boundary){
+        reb_profiling_start(r, REB_PROFILING_BOUNDARY);
+        reb_boundary_check(r);     
+        reb_profiling_stop(r, REB_PROFILING_BOUNDARY);
+    }
     if (r->tree_needs_update){
         // Update tree (this will remove particles which left the box)
+        reb_profiling_start(r, REB_PROFILING_TREE_BUILD);
         reb_tree_update(r);          
+        reb_profiling_stop(r, REB_PROFILING_TREE_BUILD);
     }
-    PROFILING_STOP(PROFILING_CAT_BOUNDARY)
 
     // Search for collisions using local and essential tree.
-    PROFILING_START()
     reb_collision_search(r);
-    PROFILING_STOP(PROFILING_CAT_COLLISION)
-    
-    // Update walltime
-    struct timeval time_end;
-    gettimeofday(&time_end,NULL);
-    r->walltime += time_end.tv_sec-time_beginning.tv_sec+(time_end.tv_usec-time_beginning.tv_usec)/1e6;
-    // Update step counter
-    r->steps_done++; // This also counts failed IAS15 steps
+
+    // Reorder particles to improve cache locality
+    if (r->spatial_sort_interval>0 && (r->steps_done+1)%r->spatial_sort_interval==0){
+        reb_sort_particles_spatially(r);
+    }
+    reb_profiling_stop(r, REB_PROFILING_STEP);
+
+    if (r->memory_grown){
+        reb_memory_check(r);
+    }
 }
 
 void reb_exit(const char* const msg){
@@ -278,7 +404,7 @@ void reb_configure_box(struct reb_simulation* const r, const double root_size, c
 void reb_mpi_init(struct reb_simulation* const r){
     reb_communication_mpi_init(r,0,NULL);
     // Make sure domain can be decomposed into equal number of root boxes per node.
-    if ((r->root_n/r->mpi_num)*r->mpi_num != r->root_n){
+    if (r->mpi_decomposition==REB_MPI_DECOMPOSITION_ROOTBOXES && (r->root_n/r->mpi_num)*r->mpi_num != r->root_n){
         if (r->mpi_id==0) fprintf(stderr,"ERROR: Number of root boxes (%d) not a multiple of mpi nodes (%d).\n",r->root_n,r->mpi_num);
         exit(-1);
     }
@@ -308,30 +434,93 @@ void reb_free_simulation(struct reb_simulation* const r){
 }
 
 void reb_free_pointers(struct reb_simulation* const r){
+    reb_simulationarchive_flush(r);
+    reb_heartbeat_async_flush(r);
+    reb_output_positions_quantized_close(r);
+    reb_collision_log_close(r);
     if (r->simulationarchive_filename){
         free(r->simulationarchive_filename);
     }
     reb_tree_delete(r);
     if(r->display_data){
-        pthread_mutex_destroy(&(r->display_data->mutex));
-        free(r->display_data->r_copy);
-        free(r->display_data->particles_copy);
-        free(r->display_data->p_jh_copy);
+        for (int i=0; i<3; i++){
+            free(r->display_data->snapshots[i].particles);
+            free(r->display_data->snapshots[i].p_jh);
+        }
         free(r->display_data->particle_data);
         free(r->display_data->orbit_data);
+        free(r->display_data->orbit_invariants);
         free(r->display_data); // TODO: Free other pointers in display_data
     }
     if (r->gravity_cs){
         free(r->gravity_cs  );
     }
+    if (r->particles_soa){
+        free(r->particles_soa);
+    }
+    if (r->additional_forces_soa_buffer){
+        free(r->additional_forces_soa_buffer);
+    }
+    if (r->frozen_swaps){
+        free(r->frozen_swaps);
+    }
+    if (r->gravity_tree_cost){
+        free(r->gravity_tree_cost);
+    }
+    reb_compact_free(&r->compact);
+#ifdef GPU
+    reb_gravity_gpu_free(r);
+    reb_collision_gpu_free(r);
+#endif // GPU
     if (r->collisions){
         free(r->collisions  );
     }
+    if (r->ghostboxes){
+        free(r->ghostboxes);
+    }
+    reb_profiling_free(r);
+    if (r->collision_grid_bucket){
+        free(r->collision_grid_bucket);
+    }
+    if (r->collision_grid_particles){
+        free(r->collision_grid_particles);
+    }
+    if (r->collision_sap_particles){
+        free(r->collision_sap_particles);
+    }
+    if (r->collision_sap_lower){
+        free(r->collision_sap_lower);
+    }
+    if (r->collision_bvh_box){
+        free(r->collision_bvh_box);
+    }
+    if (r->collision_bvh_child){
+        free(r->collision_bvh_child);
+    }
+    if (r->collision_sap_upper){
+        free(r->collision_sap_upper);
+    }
+    if (r->collision_line_soa){
+        free(r->collision_line_soa);
+    }
+    if (r->collision_line_xv0){
+        free(r->collision_line_xv0);
+    }
+    if (r->collision_line_poly){
+        free(r->collision_line_poly);
+    }
+    if (r->collision_neighbours){
+        free(r->collision_neighbours);
+    }
+    if (r->collision_neighbours_x){
+        free(r->collision_neighbours_x);
+    }
     reb_integrator_whfast_reset(r);
     reb_integrator_ias15_reset(r);
     reb_integrator_mercurius_reset(r);
     reb_integrator_bs_reset(r);
     reb_integrator_tes_reset(r);
+    reb_integrator_block_reset(r);
     if(r->free_particle_ap){
         for(int i=0; i<r->N; i++){
             r->free_particle_ap(&r->particles[i]);
@@ -366,10 +555,62 @@ void reb_reset_temporary_pointers(struct reb_simulation* const r){
     // Note: this will not clear the particle array.
     r->gravity_cs_allocatedN    = 0;
     r->gravity_cs           = NULL;
+    r->particles_soa          = NULL;
+    r->particles_soa_allocatedN   = 0;
+    r->additional_forces_soa_buffer = NULL;
+    r->additional_forces_soa_allocatedN = 0;
+    r->frozen_swaps = NULL;
+    r->frozen_swaps_N = 0;
+    r->frozen_swaps_allocatedN = 0;
+    r->frozen_hidden = 0;
+    r->gravity_gpu          = NULL;
+    r->gravity_gpu_allocatedN   = 0;
+    r->gravity_tree_cost    = NULL;
+    r->gravity_tree_cost_N  = 0;
     r->collisions_allocatedN    = 0;
     r->collisions           = NULL;
+    r->ghostboxes = NULL;
+    r->ghostboxes_allocatedN = 0;
+    r->profiling_threads = NULL;
+    r->profiling_threads_N = 0;
+    r->collision_grid_bucket_allocatedN = 0;
+    r->collision_grid_bucket = NULL;
+    r->collision_grid_particles_allocatedN = 0;
+    r->collision_grid_particles = NULL;
+    r->collision_sap_particles = NULL;
+    r->collision_sap_lower = NULL;
+    r->collision_sap_upper = NULL;
+    r->collision_sap_N = 0;
+    r->collision_sap_allocatedN = 0;
+    r->collision_sap_axis = 0;
+    r->collision_bvh_box = NULL;
+    r->collision_bvh_child = NULL;
+    r->collision_bvh_N = -1;
+    r->collision_bvh_allocatedN = 0;
+    r->collision_bvh_cost = 0.;
+    r->collision_line_soa = NULL;
+    r->collision_line_soa_allocatedN = 0;
+    r->collision_line_xv0 = NULL;
+    r->collision_line_xv0_N = -1;
+    r->collision_line_xv0_allocatedN = 0;
+    r->collision_line_poly = NULL;
+    r->collision_line_poly_allocatedN = 0;
+    r->collision_gpu = NULL;
+    r->collision_gpu_allocatedN = 0;
+    r->collision_gpu_pairs = NULL;
+    r->collision_gpu_pairs_allocatedN = 0;
+    r->collision_neighbours = NULL;
+    r->collision_neighbours_N = 0;
+    r->collision_neighbours_allocatedN = 0;
+    r->collision_neighbours_x = NULL;
+    r->collision_neighbours_x_allocatedN = 0;
+    r->collision_neighbours_built[0] = -1;
     r->extras               = NULL;
     r->messages             = NULL;
+    r->simulationarchive_writer = NULL;
+    r->output_quantized_writer = NULL;
+    r->collision_log_writer = NULL;
+    r->heartbeat_async_worker = NULL;
     // ********** Lookup Table
     r->particle_lookup_table = NULL;
     r->N_lookup = 0;
@@ -379,6 +620,7 @@ void reb_reset_temporary_pointers(struct reb_simulation* const r){
     r->ri_whfast.allocated_Ntemp= 0;
     r->ri_whfast.p_jh           = NULL;
     r->ri_whfast.p_temp         = NULL;
+    r->ri_whfast.kepler_guess   = NULL;
     r->ri_whfast.keep_unsynchronized = 0;
     // ********** IAS15
     r->ri_ias15.allocatedN      = 0;
@@ -403,9 +645,14 @@ void reb_reset_temporary_pointers(struct reb_simulation* const r){
     r->ri_mercurius.allocatedN_additionalforces = 0;
     r->ri_mercurius.dcrit_allocatedN = 0;
     r->ri_mercurius.dcrit = NULL;
+    r->ri_mercurius.kepler_guess_allocatedN = 0;
+    r->ri_mercurius.kepler_guess = NULL;
     r->ri_mercurius.particles_backup = NULL;
     r->ri_mercurius.particles_backup_additionalforces = NULL;
     r->ri_mercurius.encounter_map = NULL;
+    r->ri_mercurius.encounter_pairs = NULL;
+    r->ri_mercurius.encounter_pairs_N = 0;
+    r->ri_mercurius.encounter_pairs_allocatedN = 0;
     // ********** JANUS
     r->ri_janus.allocated_N = 0;
     r->ri_janus.p_int = NULL;
@@ -419,30 +666,53 @@ void reb_reset_temporary_pointers(struct reb_simulation* const r){
     r->odes_allocatedN = 0;
     // ********** TES
     r->ri_tes.particles_dh = NULL;
+    r->ri_tes.pool = NULL;
+    r->ri_tes.pool_size = 0;
+    r->ri_tes.pool_used = 0;
+    // ********** BLOCK
+    r->ri_block.allocatedN = 0;
+    r->ri_block.level = NULL;
+    r->ri_block.t_last = NULL;
+    r->ri_block.jerk = NULL;
+    r->ri_block.p_pred = NULL;
+    r->ri_block.due = NULL;
+    // ********** WHFAST512
+    r->ri_whfast512.allocated_N = 0;
+    r->ri_whfast512.p_jh = NULL;
+    r->ri_whfast512.allocated_N_testparticles = 0;
+    r->ri_whfast512.p_jh_tp = NULL;
 }
 
 int reb_reset_function_pointers(struct reb_simulation* const r){
     int wasnotnull = 0;
     if (r->coefficient_of_restitution ||
         r->collision_resolve ||
+        r->collision_resolve_batch ||
         r->additional_forces ||
+        r->additional_forces_soa ||
         r->heartbeat ||
         r->display_heartbeat ||
         r->pre_timestep_modifications ||
         r->post_timestep_modifications ||
         r->free_particle_ap ||
-        r->extras_cleanup){
+        r->extras_cleanup ||
+        r->memory_grown ||
+        r->injector){
       wasnotnull = 1;
     }
     r->coefficient_of_restitution   = NULL;
     r->collision_resolve        = NULL;
+    r->collision_resolve_batch  = NULL;
     r->additional_forces        = NULL;
+    r->additional_forces_soa    = NULL;
     r->heartbeat            = NULL;
     r->display_heartbeat    = NULL;
     r->pre_timestep_modifications  = NULL;
     r->post_timestep_modifications  = NULL;
     r->free_particle_ap = NULL;
     r->extras_cleanup = NULL;
+    r->memory_grown = NULL;
+    r->injector = NULL;
     return wasnotnull;
 }
 
@@ -453,7 +723,124 @@ struct reb_simulation* reb_create_simulation(){
 }
 
 
+// Returns 1 if the simulation can be copied with reb_copy_simulation_direct().
+static int reb_copy_simulation_direct_supported(const struct reb_simulation* const r){
+#ifdef MPI
+    return 0;
+#else // MPI
+    if (r->tree_root || r->ri_tes.allocated_N || r->ri_whfast512.allocated_N){
+        // The tree needs to be rebuilt and TES/WHFast512 use nested buffers. Use binary serialization.
+        return 0;
+    }
+    return 1;
+#endif // MPI
+}
+
+// Copies the simulation structure and duplicates all buffers which are part of the 
+// binary format. The result is the same as serializing and reading the simulation,
+// but buffers are copied directly. Temporary buffers and function pointers are reset.
+static void reb_copy_simulation_direct(struct reb_simulation* r_copy, struct reb_simulation* r, enum reb_input_binary_messages* warnings){
+    // Init integrators. Same as when a binary file is written.
+    reb_integrator_init(r);
+    *r_copy = *r;
+
+    // Buffers are recreated when needed.
+    reb_reset_temporary_pointers(r_copy);
+    if (reb_reset_function_pointers(r_copy) && warnings){
+        *warnings |= REB_INPUT_BINARY_WARNING_POINTERS;
+    }
+    r_copy->display_data = NULL;
+    r_copy->simulationarchive_filename = NULL;
+    r_copy->tree_cells_chunks = NULL;
+    r_copy->tree_cells_chunks_N = 0;
+    r_copy->tree_cells_N = 0;
+    r_copy->tree_cells_free = NULL;
+    r_copy->tree_keys = NULL;
+    r_copy->tree_keys_allocatedN = 0;
+    r_copy->ri_bs.nbody_ode = NULL;
+    r_copy->ri_bs.sequence = NULL;
+    r_copy->ri_bs.costPerStep = NULL;
+    r_copy->ri_bs.costPerTimeUnit = NULL;
+    r_copy->ri_bs.optimalStep = NULL;
+    r_copy->ri_bs.coeff = NULL;
+    r_copy->ri_bs.user_ode_needs_nbody = 0;
+    r_copy->ri_tes.mass = NULL;
+    r_copy->ri_tes.X_dh = NULL;
+    r_copy->ri_tes.Q_dh = NULL;
+    r_copy->ri_tes.P_dh = NULL;
+    r_copy->ri_tes.uVars = NULL;
+    r_copy->ri_tes.rhs = NULL;
+    r_copy->ri_tes.radau = NULL;
+    // Restore settings which are part of the binary format but reset above.
+    r_copy->ri_whfast.keep_unsynchronized = r->ri_whfast.keep_unsynchronized;
+    r_copy->ri_janus.order = r->ri_janus.order;
+    r_copy->ri_janus.scale_pos = r->ri_janus.scale_pos;
+    r_copy->ri_janus.scale_vel = r->ri_janus.scale_vel;
+    r_copy->ri_janus.recalculate_integer_coordinates_this_timestep = r->ri_janus.recalculate_integer_coordinates_this_timestep;
+    // Automatically selected routines are stored as requested (see reb_output_binary_to_stream()).
+    // The copy starts its own selection.
+    if (r->gravity_autotune.mode){
+        r_copy->gravity = r->gravity_autotune.mode;
+    }
+    if (r->collision_autotune.mode){
+        r_copy->collision = r->collision_autotune.mode;
+    }
+    memset(&r_copy->gravity_autotune, 0, sizeof(struct reb_autotune));
+    memset(&r_copy->collision_autotune, 0, sizeof(struct reb_autotune));
+
+    // Particles
+    r_copy->allocatedN = r->N;
+    r_copy->particles = reb_tools_copy_aligned(r->particles, sizeof(struct reb_particle), r->N);
+    for (int i=0;i<r->N;i++){
+        r_copy->particles[i].c = NULL;
+        r_copy->particles[i].ap = NULL;
+        r_copy->particles[i].sim = r_copy;
+    }
+    if (r->var_config_N>0){
+        r_copy->var_config = malloc(sizeof(struct reb_variational_configuration)*r->var_config_N);
+        memcpy(r_copy->var_config, r->var_config, sizeof(struct reb_variational_configuration)*r->var_config_N);
+        for (int i=0;i<r->var_config_N;i++){
+            r_copy->var_config[i].sim = r_copy;
+        }
+    }else{
+        r_copy->var_config = NULL;
+    }
+
+    reb_compact_copy(&r_copy->compact, &r->compact);
+
+    // Integrator buffers
+    r_copy->ri_whfast.allocated_N = r->ri_whfast.allocated_N;
+    r_copy->ri_whfast.p_jh = reb_tools_copy_aligned(r->ri_whfast.p_jh, sizeof(struct reb_particle), r->ri_whfast.allocated_N);
+    r_copy->ri_whfast.kepler_guess = reb_tools_copy_aligned(r->ri_whfast.kepler_guess, sizeof(double), r->ri_whfast.allocated_N);
+    r_copy->ri_janus.allocated_N = r->ri_janus.allocated_N;
+    r_copy->ri_janus.p_int = reb_tools_copy_aligned(r->ri_janus.p_int, sizeof(struct reb_particle_int), r->ri_janus.allocated_N);
+    r_copy->ri_mercurius.dcrit_allocatedN = r->ri_mercurius.dcrit_allocatedN;
+    r_copy->ri_mercurius.dcrit = reb_tools_copy_aligned(r->ri_mercurius.dcrit, sizeof(double), r->ri_mercurius.dcrit_allocatedN);
+    r_copy->ri_mercurius.kepler_guess_allocatedN = r->ri_mercurius.kepler_guess_allocatedN;
+    r_copy->ri_mercurius.kepler_guess = reb_tools_copy_aligned(r->ri_mercurius.kepler_guess, sizeof(double), r->ri_mercurius.kepler_guess_allocatedN);
+    const int N3 = r->ri_ias15.allocatedN;
+    if (N3 && r->ri_ias15.at){
+        r_copy->ri_ias15.allocatedN = N3;
+        r_copy->ri_ias15.at   = reb_tools_copy_aligned(r->ri_ias15.at,   sizeof(double), N3);
+        r_copy->ri_ias15.x0   = reb_tools_copy_aligned(r->ri_ias15.x0,   sizeof(double), N3);
+        r_copy->ri_ias15.v0   = reb_tools_copy_aligned(r->ri_ias15.v0,   sizeof(double), N3);
+        r_copy->ri_ias15.a0   = reb_tools_copy_aligned(r->ri_ias15.a0,   sizeof(double), N3);
+        r_copy->ri_ias15.csx  = reb_tools_copy_aligned(r->ri_ias15.csx,  sizeof(double), N3);
+        r_copy->ri_ias15.csv  = reb_tools_copy_aligned(r->ri_ias15.csv,  sizeof(double), N3);
+        r_copy->ri_ias15.csa0 = reb_tools_copy_aligned(r->ri_ias15.csa0, sizeof(double), N3);
+        struct reb_dp7* const dp7s[6] = {&r->ri_ias15.g, &r->ri_ias15.b, &r->ri_ias15.csb, &r->ri_ias15.e, &r->ri_ias15.br, &r->ri_ias15.er};
+        struct reb_dp7* const dp7s_copy[6] = {&r_copy->ri_ias15.g, &r_copy->ri_ias15.b, &r_copy->ri_ias15.csb, &r_copy->ri_ias15.e, &r_copy->ri_ias15.br, &r_copy->ri_ias15.er};
+        for (int l=0;l<6;l++){
+            reb_integrator_ias15_copy_dp7(dp7s_copy[l], dp7s[l], N3);
+        }
+    }
+}
+
 void reb_copy_simulation_with_messages(struct reb_simulation* r_copy,  struct reb_simulation* r, enum reb_input_binary_messages* warnings){
+    if (reb_copy_simulation_direct_supported(r)){
+        reb_copy_simulation_direct(r_copy, r, warnings);
+        return;
+    }
     char* bufp;
     size_t sizep;
     reb_output_binary_to_stream(r, &bufp,&sizep);
@@ -468,6 +855,8 @@ void reb_copy_simulation_with_messages(struct reb_simulation* r_copy,  struct re
     char* bufp_beginning = bufp; // bufp will be changed
     while(reb_input_field(r_copy, NULL, warnings, &bufp)){ }
     free(bufp_beginning);
+    // The ephemeris is not part of the binary format. Copies share it.
+    r_copy->ephemeris = r->ephemeris;
     
 }
 
@@ -536,6 +925,8 @@ void reb_init_simulation(struct reb_simulation* r){
     r->var_config   = NULL;     
     r->exit_min_distance    = 0;    
     r->exit_max_distance    = 0;    
+    r->exit_encounter_i     = -1;
+    r->exit_encounter_j     = -1;
     r->max_radius[0]    = 0.;   
     r->max_radius[1]    = 0.;   
     r->status       = REB_RUNNING;
@@ -547,12 +938,23 @@ void reb_init_simulation(struct reb_simulation* r){
     r->save_messages = 0;
     r->track_energy_offset = 0;
     r->display_data = NULL;
+    r->display_stride = 1;
     r->walltime = 0;
 
     r->minimum_collision_velocity = 0;
     r->collisions_plog  = 0;
     r->collisions_Nlog  = 0;    
     r->collision_resolve_keep_sorted   = 0;    
+    r->collision_skip_testparticle_pairs = 0;
+    r->collision_grid_cellsize = 0;
+    r->collision_resolve_parallel = 0;
+    r->collision_skin = 0;
+    r->collision_time_of_impact = 0;
+    r->collision_line_hermite = 0;
+    r->collision_line_ias15 = 0;
+    r->collision_neighbours_builds = 0;
+    r->collision_bvh_builds = 0;
+    r->track_collision_statistics = 0;
     
     r->simulationarchive_size_first    = 0;    
     r->simulationarchive_size_snapshot = 0;    
@@ -563,6 +965,8 @@ void reb_init_simulation(struct reb_simulation* r){
     r->simulationarchive_next          = 0.;    
     r->simulationarchive_next_step     = 0;    
     r->simulationarchive_filename      = NULL;    
+    r->simulationarchive_async         = 0;    
+    r->simulationarchive_compress      = 0;    
     
     // Default modules
 #ifdef OPENGL
@@ -574,6 +978,15 @@ void reb_init_simulation(struct reb_simulation* r){
     r->boundary     = REB_BOUNDARY_NONE;
     r->gravity      = REB_GRAVITY_BASIC;
     r->collision    = REB_COLLISION_NONE;
+    r->gravity_autotune.mode    = 0;
+    r->collision_autotune.mode  = 0;
+    r->profiling    = 0;
+    r->profiling_trace = 0;
+    r->N_frozen     = 0;
+    r->sleep_v      = 0;
+    r->sleep_a      = 0;
+    r->sleep_steps  = 10;
+    r->N_asleep     = 0;
 
 
     // Integrators  
@@ -589,6 +1002,9 @@ void reb_init_simulation(struct reb_simulation* r){
     r->ri_whfast.is_synchronized = 1;
     r->ri_whfast.timestep_warning = 0;
     r->ri_whfast.recalculate_coordinates_but_not_synchronized_warning = 0;
+    r->ri_whfast.testparticle_partitions = 0;
+    r->ri_whfast.kepler_warmstart = 0;
+    r->ri_whfast.testparticles_deferred = 0;
     
     // ********** WHFAST512
     r->ri_whfast512.is_synchronized = 1;
@@ -607,6 +1023,8 @@ void reb_init_simulation(struct reb_simulation* r){
     r->ri_ias15.epsilon_global  = 1;
     r->ri_ias15.iterations_max_exceeded = 0;
     r->ri_ias15.dt_mode = 0;
+    r->ri_ias15.testparticle_substeps = 0;
+    r->ri_ias15.testparticle_compensated = 1;
     
     // ********** SEI
     r->ri_sei.OMEGA     = 1;
@@ -616,8 +1034,11 @@ void reb_init_simulation(struct reb_simulation* r){
     // ********** MERCURIUS
     r->ri_mercurius.mode = 0;
     r->ri_mercurius.safe_mode = 1;
+    r->ri_mercurius.split_tponly_encounters = 0;
+    r->ri_mercurius.kepler_warmstart = 0;
     r->ri_mercurius.recalculate_coordinates_this_timestep = 0;
     r->ri_mercurius.recalculate_dcrit_this_timestep = 0;
+    r->ri_mercurius.dcrit_pending = 0;
     r->ri_mercurius.is_synchronized = 1;
     r->ri_mercurius.encounterN = 0;
     r->ri_mercurius.hillfac = 3;
@@ -639,10 +1060,27 @@ void reb_init_simulation(struct reb_simulation* r){
     r->ri_tes.epsilon = 1e-6;
     r->ri_tes.allocated_N = 0;
 
+    // ********** BLOCK
+    r->ri_block.eta = 0.02;
+    r->ri_block.max_level = 10;
+    r->ri_block.particle_steps = 0;
+
     // Tree parameters. Will not be used unless gravity or collision search makes use of tree.
     r->tree_needs_update= 0;
     r->tree_root        = NULL;
+    r->tree_cells_chunks    = NULL;
+    r->tree_cells_chunks_N  = 0;
+    r->tree_cells_N     = 0;
+    r->tree_cells_free  = NULL;
+    r->tree_rebuild     = 0;
+    r->tree_active_only = 0;
+    r->tree_group_size  = 0;
+    r->spatial_sort_interval = 0;
+    r->use_soa          = 0;
+    r->tree_keys        = NULL;
+    r->tree_keys_allocatedN = 0;
     r->opening_angle2   = 0.25;
+    r->gravity_fmm_order= 4;
 
 #ifdef MPI
     r->mpi_id = 0;                            
@@ -653,6 +1091,8 @@ void reb_init_simulation(struct reb_simulation* r){
     r->particles_recv = NULL;     
     r->particles_recv_N = 0;                  
     r->particles_recv_Nmax = 0;               
+    r->particles_send_index = NULL;
+    r->particles_recv_index = NULL;
     
     r->tree_essential_send = NULL;
     r->tree_essential_send_N = 0;             
@@ -660,6 +1100,12 @@ void reb_init_simulation(struct reb_simulation* r){
     r->tree_essential_recv = NULL;
     r->tree_essential_recv_N = 0;             
     r->tree_essential_recv_Nmax = 0;          
+    r->tree_essential_requests = NULL;
+    r->tree_essential_pending = 0;
+    r->mpi_rootbox_owner = NULL;
+    r->mpi_rootbox_cost = NULL;
+    r->mpi_rebalance_interval = 0;
+    r->mpi_decomposition = REB_MPI_DECOMPOSITION_ROOTBOXES;
 
 #else // MPI
 #ifndef LIBREBOUND
@@ -744,8 +1190,129 @@ int reb_check_exit(struct reb_simulation* const r, const double tmax, double* la
 }
 
 
+// Helper thread running the heartbeat on a copy of the simulation (see enum REB_HEARTBEAT_ASYNC).
+struct reb_heartbeat_async {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;                    // Signals new snapshots, finished heartbeats, and shutdown.
+    struct reb_display_snapshot snapshot;   // Copy passed to the heartbeat. Owned by the helper thread while pending.
+    int pending;                            // 1 if the snapshot has not been processed yet.
+    int shutdown;
+    enum REB_STATUS status;                 // Exit status set by the heartbeat on the copy (e.g. by reb_stop()), REB_RUNNING otherwise.
+};
+
+static void* reb_heartbeat_async_thread(void* args){
+    struct reb_heartbeat_async* const w = args;
+    struct reb_simulation* const s = &w->snapshot.r;
+    pthread_mutex_lock(&w->mutex);
+    while (1){
+        while (!w->pending && !w->shutdown){
+            pthread_cond_wait(&w->cond, &w->mutex);
+        }
+        if (!w->pending){
+            break; // Shutdown and no heartbeat left.
+        }
+        pthread_mutex_unlock(&w->mutex);
+        for (int i=0;i<s->N;i++){
+            s->particles[i].sim = s;
+        }
+        if (s->integrator==REB_INTEGRATOR_WHFAST){
+            // Only the copy is synchronized. Other integrators would need 
+            // internal arrays which are not part of the snapshot.
+            reb_integrator_synchronize(s);
+        }
+        s->heartbeat(s);
+        if (s->particle_lookup_table){
+            // Created by a lookup on the copy.
+            free(s->particle_lookup_table);
+            s->particle_lookup_table = NULL;
+        }
+        pthread_mutex_lock(&w->mutex);
+        if (s->status>=0){
+            w->status = s->status;
+        }
+        w->pending = 0;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->mutex);
+    return NULL;
+}
+
+// Hands a copy of the simulation to the helper thread. Creates the thread if needed.
+static void reb_heartbeat_async_submit(struct reb_simulation* const r){
+    struct reb_heartbeat_async* w = r->heartbeat_async_worker;
+    if (w==NULL){
+        w = calloc(1, sizeof(struct reb_heartbeat_async));
+        w->status = REB_RUNNING;
+        pthread_mutex_init(&w->mutex, NULL);
+        pthread_cond_init(&w->cond, NULL);
+        if (pthread_create(&w->thread, NULL, reb_heartbeat_async_thread, w)){
+            pthread_mutex_destroy(&w->mutex);
+            pthread_cond_destroy(&w->cond);
+            free(w);
+            reb_warning(r, "Cannot create a thread for the asynchronous heartbeat. Running heartbeat synchronously.");
+            r->heartbeat_async = REB_HEARTBEAT_ASYNC_NONE;
+            r->heartbeat(r);
+            return;
+        }
+        r->heartbeat_async_worker = w;
+    }
+    pthread_mutex_lock(&w->mutex);
+    if (w->pending && r->heartbeat_async==REB_HEARTBEAT_ASYNC_SKIP){
+        r->heartbeat_async_skipped++;
+    }else{
+        while (w->pending){
+            pthread_cond_wait(&w->cond, &w->mutex);
+        }
+        reb_display_snapshot_take(r, &w->snapshot, 1);
+        struct reb_simulation* const s = &w->snapshot.r;
+        // Pointers which the heartbeat could modify through the copy.
+        s->messages = NULL; // Warnings are printed directly.
+        s->particle_lookup_table = NULL;
+        s->N_lookup = 0;
+        s->allocatedN_lookup = 0;
+        s->heartbeat_async_worker = NULL;
+        w->pending = 1;
+        pthread_cond_broadcast(&w->cond);
+    }
+    if (w->status>=0){
+        r->status = w->status;
+        w->status = REB_RUNNING;
+    }
+    pthread_mutex_unlock(&w->mutex);
+}
+
+// Waits for the last heartbeat and stops the helper thread.
+static void reb_heartbeat_async_flush(struct reb_simulation* const r){
+    struct reb_heartbeat_async* const w = r->heartbeat_async_worker;
+    if (w==NULL){
+        return;
+    }
+    pthread_mutex_lock(&w->mutex);
+    w->shutdown = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+    pthread_join(w->thread, NULL);
+    if (w->status>=0){
+        r->status = w->status;
+    }
+    pthread_mutex_destroy(&w->mutex);
+    pthread_cond_destroy(&w->cond);
+    free(w->snapshot.particles);
+    free(w->snapshot.p_jh);
+    free(w);
+    r->heartbeat_async_worker = NULL;
+}
+
 void reb_run_heartbeat(struct reb_simulation* const r){
-    if (r->heartbeat){ r->heartbeat(r); }               // Heartbeat
+    reb_profiling_start(r, REB_PROFILING_HEARTBEAT);
+    if (r->heartbeat){                                  // Heartbeat
+        if (r->heartbeat_async){
+            reb_heartbeat_async_submit(r);
+        }else{
+            r->heartbeat(r);
+        }
+    }
     if (r->display_heartbeat){ reb_check_for_display_heartbeat(r); } 
     if (r->exit_max_distance){
         // Check for escaping particles
@@ -757,28 +1324,20 @@ void reb_run_heartbeat(struct reb_simulation* const r){
             double r2 = p.x*p.x + p.y*p.y + p.z*p.z;
             if (r2>max2){
                 r->status = REB_EXIT_ESCAPE;
+                break;
             }
         }
     }
     if (r->exit_min_distance){
         // Check for close encounters
-        const double min2 = r->exit_min_distance * r->exit_min_distance;
-        const struct reb_particle* const particles = r->particles;
-        const int N = r->N - r->N_var;
-        for (int i=0;i<N;i++){
-            struct reb_particle pi = particles[i];
-            for (int j=0;j<i;j++){
-                struct reb_particle pj = particles[j];
-                const double x = pi.x-pj.x;
-                const double y = pi.y-pj.y;
-                const double z = pi.z-pj.z;
-                const double r2 = x*x + y*y + z*z;
-                if (r2<min2){
-                    r->status = REB_EXIT_ENCOUNTER;
-                }
-            }
+        int i, j;
+        if (reb_collision_find_close_pair(r, r->exit_min_distance, &i, &j)){
+            r->status = REB_EXIT_ENCOUNTER;
+            r->exit_encounter_i = i;
+            r->exit_encounter_j = j;
         }
     }
+    reb_profiling_stop(r, REB_PROFILING_HEARTBEAT);
 }
 
 ////////////////////////////////////////////////////
@@ -799,13 +1358,13 @@ void reb_sigint_handler(int signum) {
 }
 
 static void* reb_integrate_raw(void* args){
-    reb_sigint = 0;
-    signal(SIGINT, reb_sigint_handler);
     struct reb_thread_info* thread_info = (struct reb_thread_info*)args;
 	struct reb_simulation* const r = thread_info->r;
 #ifdef MPI
     // Distribute particles
-    reb_communication_mpi_distribute_particles(r);
+    if (r->mpi_decomposition==REB_MPI_DECOMPOSITION_ROOTBOXES){
+        reb_communication_mpi_distribute_particles(r);
+    }
 #endif // MPI
 
     if (thread_info->tmax != r->t){
@@ -821,13 +1380,11 @@ static void* reb_integrate_raw(void* args){
     }
 
     r->status = REB_RUNNING;
+    if (r->profiling){
+        reb_profiling_prepare(r);
+    }
     reb_run_heartbeat(r);
     while(reb_check_exit(r,thread_info->tmax,&last_full_dt)<0){
-#ifdef OPENGL
-        if (r->display_data){
-            if (r->display_data->opengl_enabled){ pthread_mutex_lock(&(r->display_data->mutex)); }
-        }
-#endif // OPENGL
         if (r->simulationarchive_filename){ reb_simulationarchive_heartbeat(r);}
         reb_step(r); 
         reb_run_heartbeat(r);
@@ -836,15 +1393,22 @@ static void* reb_integrate_raw(void* args){
         }
 #ifdef OPENGL
         if (r->display_data){
-            if (r->display_data->opengl_enabled){ pthread_mutex_unlock(&(r->display_data->mutex)); }
+            // Does not block. Only copies the particles if the last snapshot has been picked up.
+            if (r->display_data->opengl_enabled){ reb_display_publish(r); }
         }
 #endif // OPENGL
         if (r->usleep > 0){
             usleep(r->usleep);
         }
     }
+    reb_heartbeat_async_flush(r); // Wait for the last heartbeat.
 
     reb_integrator_synchronize(r);
+#ifdef OPENGL
+    if (r->display_data){
+        if (r->display_data->opengl_enabled){ reb_display_publish(r); }
+    }
+#endif // OPENGL
     if (r->display_heartbeat){                          // Display Heartbeat
         r->display_heartbeat(r); 
     }
@@ -861,6 +1425,8 @@ enum REB_STATUS reb_integrate(struct reb_simulation* const r, double tmax){
         .r = r,
         .tmax = tmax, 
     };
+    reb_sigint = 0;
+    signal(SIGINT, reb_sigint_handler);
     switch (r->visualization){
         case REB_VISUALIZATION_NONE:
             {
@@ -875,6 +1441,8 @@ enum REB_STATUS reb_integrate(struct reb_simulation* const r, double tmax){
 #ifdef OPENGL
                 reb_display_init_data(r);
                 r->display_data->opengl_enabled = 1;
+                // Make sure the display thread has something to show before the simulation thread starts.
+                reb_display_publish(r);
 
                 pthread_t compute_thread;
                 if (pthread_create(&compute_thread,NULL,reb_integrate_raw,&thread_info)){
@@ -902,6 +1470,231 @@ enum REB_STATUS reb_integrate(struct reb_simulation* const r, double tmax){
     return r->status;
 }
 
+struct reb_ensemble_info {
+    struct reb_simulation** sims;
+    int N;
+    double tmax;
+    int next;               // Index of the next simulation to be integrated
+    pthread_mutex_t mutex;  // Protects next
+};
+
+static void* reb_ensemble_worker(void* args){
+    struct reb_ensemble_info* ensemble = (struct reb_ensemble_info*)args;
+#ifdef OPENMP
+    omp_set_num_threads(1); // Every simulation runs single-threaded
+#endif // OPENMP
+    while(1){
+        pthread_mutex_lock(&ensemble->mutex);
+        int i = ensemble->next++;
+        pthread_mutex_unlock(&ensemble->mutex);
+        if (i>=ensemble->N){
+            break;
+        }
+        struct reb_simulation* const r = ensemble->sims[i];
+        if (reb_sigint){
+            r->status = REB_EXIT_SIGINT; // Do not start new simulations after an interrupt
+            continue;
+        }
+        if (r->display_data){
+            r->display_data->opengl_enabled = 0;
+        }
+        struct reb_thread_info thread_info = {
+            .r = r,
+            .tmax = ensemble->tmax,
+        };
+        reb_integrate_raw(&thread_info);
+    }
+    return NULL;
+}
+
+int reb_ensemble_integrate(struct reb_simulation** const sims, int N, double tmax, int N_threads){
+    if (N_threads<=0){
+        N_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (N_threads>N){
+        N_threads = N;
+    }
+    if (N_threads<1){
+        N_threads = 1;
+    }
+    struct reb_ensemble_info ensemble = {
+        .sims = sims,
+        .N = N,
+        .tmax = tmax,
+        .next = 0,
+    };
+    pthread_mutex_init(&ensemble.mutex, NULL);
+    reb_sigint = 0;
+    signal(SIGINT, reb_sigint_handler);
+
+    // The calling thread works on the ensemble as well.
+    pthread_t* threads = malloc(sizeof(pthread_t)*(N_threads-1));
+    int N_started = 0;
+    for (int t=0; t<N_threads-1; t++){
+        if (pthread_create(&threads[t], NULL, reb_ensemble_worker, &ensemble)){
+            break;
+        }
+        N_started++;
+    }
+    reb_ensemble_worker(&ensemble);
+    for (int t=0; t<N_started; t++){
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&ensemble.mutex);
+
+    int N_failed = 0;
+    for (int i=0; i<N; i++){
+        if (sims[i]->status!=REB_EXIT_SUCCESS){
+            N_failed++;
+        }
+    }
+    return N_failed;
+}
+
+// Shared between the calling process and all forked processes.
+struct reb_ensemble_fork_table {
+    int next;               // Index of the next member to be integrated. Incremented atomically.
+    int status[];           // Exit status of every member, followed by the results table.
+};
+
+static void reb_ensemble_fork_member(struct reb_simulation* const r, const int member, const double tmax,
+        void (*setup)(struct reb_simulation* const r, const int member),
+        void (*result)(struct reb_simulation* const r, const int member, double* const row),
+        double* const row, const char* filename_format){
+    // Background threads of the parent do not exist in a forked process.
+    r->simulationarchive_writer = NULL;
+    r->output_quantized_writer = NULL;
+    r->collision_log_writer = NULL;
+    r->heartbeat_async_worker = NULL;
+    if (r->display_data){
+        r->display_data->opengl_enabled = 0;
+    }
+    if (setup){
+        setup(r, member);
+    }
+    if (filename_format){
+        char filename[1024];
+        snprintf(filename, 1024, filename_format, member);
+        r->simulationarchive_filename = NULL; // Belongs to the parent.
+        if (r->simulationarchive_auto_interval==0. && r->simulationarchive_auto_walltime==0. && r->simulationarchive_auto_step==0){
+            // No automatic snapshots. Write the initial and the final state.
+            reb_simulationarchive_snapshot(r, filename);
+        }else{
+            r->simulationarchive_filename = strdup(filename);
+        }
+    }
+    struct reb_thread_info thread_info = {
+        .r = r,
+        .tmax = tmax,
+    };
+    reb_integrate_raw(&thread_info);
+    if (filename_format){
+        if (r->simulationarchive_filename==NULL){
+            char filename[1024];
+            snprintf(filename, 1024, filename_format, member);
+            reb_simulationarchive_snapshot(r, filename);
+        }
+        reb_simulationarchive_flush(r);
+    }
+    if (result){
+        result(r, member, row);
+    }
+}
+
+int reb_ensemble_integrate_fork(struct reb_simulation* const r, const int N, const double tmax, int N_procs,
+        void (*setup)(struct reb_simulation* const r, const int member),
+        void (*result)(struct reb_simulation* const r, const int member, double* const row),
+        const int N_columns, double* const results, enum REB_STATUS* const status, const char* filename_format){
+    if (N<=0){
+        return 0;
+    }
+    if (N_procs<=0){
+        N_procs = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (N_procs>N){
+        N_procs = N;
+    }
+    if (N_procs<1){
+        N_procs = 1;
+    }
+    const int N_row = (result && results)?N_columns:0;
+    const size_t size = sizeof(struct reb_ensemble_fork_table) + sizeof(int)*N + sizeof(double)*N*N_row;
+    struct reb_ensemble_fork_table* table = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (table==MAP_FAILED){
+        reb_error(r, "Cannot allocate shared memory for the ensemble.");
+        return N;
+    }
+    double* const rows = (double*)(table->status+N);
+    table->next = 0;
+    for (int i=0; i<N; i++){
+        table->status[i] = REB_EXIT_ERROR; // Overwritten by members which finish
+    }
+    reb_sigint = 0;
+    signal(SIGINT, reb_sigint_handler);
+    fflush(stdout);
+    fflush(stderr);
+
+    // Every worker forks once more for each member. The worker itself never
+    // modifies the simulation, so every member starts from the same state.
+    pid_t* workers = malloc(sizeof(pid_t)*N_procs);
+    int N_started = 0;
+    for (int w=0; w<N_procs; w++){
+        const pid_t pid = fork();
+        if (pid<0){
+            break;
+        }
+        if (pid==0){
+#ifdef OPENMP
+            omp_set_num_threads(1); // Every member runs single-threaded
+#endif // OPENMP
+            while(1){
+                const int i = __atomic_fetch_add(&table->next, 1, __ATOMIC_RELAXED);
+                if (i>=N){
+                    break;
+                }
+                if (reb_sigint){
+                    table->status[i] = REB_EXIT_SIGINT; // Do not start new members after an interrupt
+                    continue;
+                }
+                const pid_t member = fork();
+                if (member==0){
+                    reb_ensemble_fork_member(r, i, tmax, setup, result, N_row?rows+i*N_row:NULL, filename_format);
+                    table->status[i] = r->status;
+                    _exit(0);
+                }
+                if (member>0){
+                    while (waitpid(member, NULL, 0)<0 && errno==EINTR);
+                }
+            }
+            _exit(0);
+        }
+        workers[N_started++] = pid;
+    }
+    if (N_started==0){
+        reb_error(r, "Cannot fork worker processes.");
+    }
+    for (int w=0; w<N_started; w++){
+        while (waitpid(workers[w], NULL, 0)<0 && errno==EINTR);
+    }
+    free(workers);
+
+    int N_failed = 0;
+    for (int i=0; i<N; i++){
+        if (table->status[i]!=REB_EXIT_SUCCESS){
+            N_failed++;
+        }
+        if (status){
+            status[i] = table->status[i];
+        }
+    }
+    if (N_row){
+        memcpy(results, rows, sizeof(double)*N*N_row);
+    }
+    munmap(table, size);
+    return N_failed;
+}
+
   
 #ifdef OPENMP
 void reb_omp_set_num_threads(int num_threads){
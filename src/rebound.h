@@ -58,6 +58,11 @@ extern volatile sig_atomic_t reb_sigint;  ///< Graceful global interrupt handler
 struct reb_simulation;
 struct reb_display_data;
 struct reb_treecell;
+struct reb_simulationarchive_writer;
+struct reb_heartbeat_async;
+struct reb_output_quantized_writer;
+struct reb_collision_log_writer;
+struct reb_tree_key;
 struct reb_variational_configuration;
 
 struct reb_particle {
@@ -75,10 +80,15 @@ struct reb_particle {
     double lastcollision;       // Last time the particle had a physical collision.
     struct reb_treecell* c;     // Pointer to the cell the particle is currently in.
     uint32_t hash;              // Hash, can be used to identify particle.
+    uint32_t frozen;            // REB_PARTICLE_FROZEN if the (test) particle is frozen. Use reb_freeze() and reb_unfreeze() to change. The other bits store the sleep state (see sleep_v).
     void* ap;                   // This pointer allows REBOUNDx to add additional properties to the particle.
     struct reb_simulation* sim; // Pointer to the parent simulation.
 };
 
+#define REB_PARTICLE_FROZEN 0x1     // Set in reb_particle.frozen if the particle is frozen.
+#define REB_PARTICLE_ASLEEP 0x2     // Set in reb_particle.frozen if the particle is asleep. Bits 8-31 count the quiet steps of awake particles.
+#define REB_PARTICLE_FREE 0x4       // Set together with REB_PARTICLE_FROZEN if the slot of a removed test particle can be reused. See reb_sink().
+
 // Generic 3d vector
 struct reb_vec3d {
     double x;
@@ -120,6 +130,8 @@ struct reb_simulation_integrator_ias15 {
     double min_dt;
     unsigned int epsilon_global;
     unsigned int dt_mode;
+    unsigned int testparticle_substeps; // If 1, test particles are not included in the timestep criterion and are substepped individually if needed 
+    unsigned int testparticle_compensated; // If 0, test particles use plain instead of compensated summation. Default: 1.
    
     // Internal use
     unsigned long iterations_max_exceeded; // Counter how many times the iteration did not converge. 
@@ -149,6 +161,8 @@ struct reb_simulation_integrator_mercurius {
     unsigned int recalculate_coordinates_this_timestep;
     unsigned int recalculate_dcrit_this_timestep;
     unsigned int safe_mode;
+    unsigned int split_tponly_encounters; // If 1, encounters involving only test particles are integrated independently for each test particle
+    unsigned int kepler_warmstart;  // If 1, the Kepler solver starts from the correction of the last step
    
     // Internal use
     unsigned int is_synchronized;   
@@ -159,10 +173,16 @@ struct reb_simulation_integrator_mercurius {
     unsigned int allocatedN;
     unsigned int allocatedN_additionalforces;
     unsigned int dcrit_allocatedN;  // Current size of dcrit arrays
+    unsigned int dcrit_pending;     // 1 if particles with a negative dcrit (added since the last timestep) need their dcrit calculated
     double* dcrit;                  // Precalculated switching radii for particles
+    unsigned int kepler_guess_allocatedN;
+    double* kepler_guess;           // Correction to the initial guess of the Kepler solver, per particle (only used with kepler_warmstart)
     struct reb_particle* REBOUND_RESTRICT particles_backup; //  contains coordinates before Kepler step for encounter prediction
     struct reb_particle* REBOUND_RESTRICT particles_backup_additionalforces; // contains coordinates before Kepler step for encounter prediction
     int* encounter_map;             // Map to represent which particles are integrated with ias15
+    int* encounter_pairs;           // Pairs of particles (two indices each) predicted to have a close encounter during the timestep
+    unsigned int encounter_pairs_N; // Number of pairs in encounter_pairs
+    unsigned int encounter_pairs_allocatedN;
     struct reb_vec3d com_pos;       // Used to keep track of the centre of mass during the timestep
     struct reb_vec3d com_vel;
 };
@@ -221,9 +241,13 @@ struct reb_simulation_integrator_whfast {
     unsigned int recalculate_coordinates_this_timestep;
     unsigned int safe_mode;
     unsigned int keep_unsynchronized;
+    unsigned int testparticle_partitions;           // Number of partitions for the test particles (0 = off, default)
+    unsigned int kepler_warmstart;                  // If 1, the Kepler solver starts from the correction of the last step (0 = off, default)
     // Internal 
+    unsigned int testparticles_deferred;            // 1/2 if the test particles still need a half/full drift this step
     struct reb_particle* REBOUND_RESTRICT p_jh;     // Jacobi/heliocentric/WHDS coordinates
     struct reb_particle* REBOUND_RESTRICT p_temp;   // Used for lazy implementer's kernel 
+    double* REBOUND_RESTRICT kepler_guess;          // Correction to the initial guess of the Kepler solver, per particle (same size as p_jh, only used with kepler_warmstart)
     unsigned int is_synchronized;
     unsigned int allocated_N;
     unsigned int allocated_Ntemp;
@@ -259,6 +283,8 @@ struct reb_simulation_integrator_whfast512 {
     unsigned int recalculate_constants;
     struct reb_particle_avx512* p_jh;
     struct reb_particle p_jh0;
+    unsigned int allocated_N_testparticles;     // Number of test particles, packed in groups of 8 in p_jh_tp
+    struct reb_particle_avx512* p_jh_tp;
 };
 
 struct reb_ode{ // defines an ODE 
@@ -279,6 +305,8 @@ struct reb_ode{ // defines an ODE
     void (*post_timestep)(struct reb_ode* const ode, const double* const y0); // gets called just after the ODE integration (optional)
     struct reb_simulation* r; // weak reference to main simulation 
     void* ref;  // pointer to any additional data needed for derivatives
+    unsigned int batch_N;       // number of identical systems stored contiguously in y (1 unless created with reb_create_ode_batch)
+    unsigned int batch_length;  // number of components of each system. System i uses y[i*batch_length] to y[(i+1)*batch_length-1]
 };
 
 
@@ -471,6 +499,25 @@ struct reb_simulation_integrator_tes {
 
     double mStar_last;              /// Mass of the star last step.
     uint32_t warnings;              /// Number of times warning has been shown
+
+    // Working memory. All arrays of the modules above point into this single block.
+    char* pool;                     /// 64 byte aligned memory pool
+    size_t pool_size;               /// Size of the pool in bytes
+    size_t pool_used;               /// Number of bytes handed out from the pool
+};
+
+struct reb_simulation_integrator_block {
+    double eta;                     // Accuracy parameter. A particle uses the largest timestep dt/2^n which is smaller than eta*|a|/|jerk|.
+    unsigned int max_level;         // Maximum level n. The shortest timestep is dt/2^max_level.
+    unsigned long long particle_steps; // Counter how many individual particle steps have been done.
+
+    // Internal use
+    int allocatedN;
+    unsigned int* level;            // Current level of each particle
+    unsigned long long* t_last;     // Time of the last correction of each particle in units of dt/2^max_level
+    struct reb_vec3d* jerk;         // Jerk of each particle at the time of the last correction
+    struct reb_particle* p_pred;    // Predicted particles at the current substep
+    int* due;                       // Indices of the particles which are corrected at the current substep
 };
 
 enum REB_EOS_TYPE {
@@ -519,6 +566,149 @@ struct reb_collision{
     int p2;
     struct reb_ghostbox gb;
     int ri;
+    double t;           // Time of impact. For the line based searches with collision_time_of_impact set, this is when the particles first touched during the last timestep, otherwise the current time.
+};
+
+// Work done by the last collision search. Only updated if track_collision_statistics is set.
+struct reb_collision_statistics {
+    long pairs;         // Number of particle pairs tested (candidates for grid, sweep and prune, and neighbour list searches)
+    long nodes;         // Number of tree cells visited (tree based searches only)
+    long ghostboxes;    // Number of ghost boxes searched. In tree based searches every particle searches the ghost boxes separately.
+    long hits;          // Number of collisions found
+    long resolved;      // Number of collisions passed to the resolve function
+    long removed;       // Number of particles removed
+};
+
+#define REB_AUTOTUNE_CANDIDATES_MAX 8  // Maximum number of routines compared by the automatic selection.
+
+// Internal state of the automatic selection of the gravity or collision routine (REB_GRAVITY_AUTO, REB_COLLISION_AUTO, REB_COLLISION_LINEAUTO).
+struct reb_autotune {
+    int mode;           // Requested mode, e.g. REB_GRAVITY_AUTO. 0 if the routine is not selected automatically.
+    int selected;       // Routine used for the next timestep.
+    int candidates[REB_AUTOTUNE_CANDIDATES_MAX];    // Routines to compare
+    int candidates_N;   // Number of routines to compare
+    int current;        // Index of the candidate currently being timed. Equal to candidates_N once the fastest routine has been selected.
+    int steps;          // Number of timesteps done with the current candidate
+    double time[REB_AUTOTUNE_CANDIDATES_MAX];   // Walltime of the timed steps for every candidate
+    int N;              // Number of particles when the candidates were last timed
+    int threads;        // Number of OpenMP threads when the candidates were last timed
+};
+
+// Scopes measured by the profiler (see reb_simulation.profiling). Scopes can be nested,
+// e.g. the gravity calculation of IAS15 is measured within REB_PROFILING_INTEGRATOR_PART2.
+enum REB_PROFILING {
+    REB_PROFILING_STEP = 0,             // One timestep (reb_step)
+    REB_PROFILING_INTEGRATOR_PART1 = 1, // First part of the integrator, e.g. the first drift
+    REB_PROFILING_INTEGRATOR_PART2 = 2, // Second part of the integrator
+    REB_PROFILING_KEPLER = 3,           // Kepler steps of WHFast and SABA
+    REB_PROFILING_INTERACTION = 4,      // Interaction steps of WHFast and SABA
+    REB_PROFILING_JUMP = 5,             // Jump steps of WHFast and SABA
+    REB_PROFILING_COORDINATES = 6,      // Coordinate transformations of WHFast and SABA
+    REB_PROFILING_BOUNDARY = 7,         // Boundary conditions
+    REB_PROFILING_TREE_BUILD = 8,       // Updating the tree structure
+    REB_PROFILING_TREE_MOMENTS = 9,     // Updating the centre of mass and multipole moments of tree cells
+    REB_PROFILING_GRAVITY = 10,         // Gravitational accelerations
+    REB_PROFILING_ADDITIONAL_FORCES = 11,   // Additional (user defined) forces
+    REB_PROFILING_COLLISION_SEARCH = 12,// Collision search
+    REB_PROFILING_COLLISION_RESOLVE = 13,   // Collision resolution
+    REB_PROFILING_HEARTBEAT = 14,       // Heartbeat function and exit conditions
+    REB_PROFILING_IO = 15,              // Simulationarchive and binary output
+    REB_PROFILING_MPI = 16,             // MPI communication, including the time spent waiting for other nodes
+    REB_PROFILING_N = 17,               // Number of scopes
+};
+
+#define REB_PROFILING_DEPTH_MAX 16  // Maximum nesting depth of profiling scopes.
+
+// Hardware performance counters measured in every profiling scope. 
+// Only available on Linux if compiled with PERF_EVENTS=1.
+enum REB_PROFILING_COUNTER {
+    REB_PROFILING_COUNTER_CYCLES = 0,           // CPU cycles
+    REB_PROFILING_COUNTER_INSTRUCTIONS = 1,     // Instructions retired
+    REB_PROFILING_COUNTER_CACHE_REFERENCES = 2, // Last level cache accesses
+    REB_PROFILING_COUNTER_CACHE_MISSES = 3,     // Last level cache misses
+    REB_PROFILING_COUNTER_BRANCH_MISSES = 4,    // Mispredicted branches
+    REB_PROFILING_COUNTER_N = 5,                // Number of counters
+};
+
+// One event recorded by the tracer (see reb_simulation.profiling_trace).
+struct reb_profiling_event {
+    double start;                           // Time in seconds when the scope was entered (monotonic clock)
+    double duration;                        // Time in seconds spent in the scope
+    int scope;                              // Scope, see enum REB_PROFILING
+};
+
+// Times accumulated by the profiler. There is one such struct for every thread.
+struct reb_profiling_thread {
+    double time[REB_PROFILING_N];           // Time in seconds spent in each scope, including nested scopes
+    double time_nested[REB_PROFILING_N];    // Time in seconds spent in nested scopes
+    unsigned long calls[REB_PROFILING_N];   // Number of times each scope was entered
+    int active[REB_PROFILING_N];            // Number of times each scope is currently open (only the outermost one is timed)
+    int stack[REB_PROFILING_DEPTH_MAX];     // Scopes currently open
+    double stack_start[REB_PROFILING_DEPTH_MAX];    // Time when the open scopes were entered
+    int stack_N;                            // Number of scopes currently open
+    struct reb_profiling_event* trace;      // Ring buffer with the most recent events if tracing is enabled
+    int trace_allocated_N;                  // Size of the ring buffer
+    unsigned long trace_N;                  // Number of events recorded since the last reset (may exceed the size of the ring buffer)
+    unsigned long long counters[REB_PROFILING_N][REB_PROFILING_COUNTER_N];  // Hardware counters accumulated in each scope, including nested scopes
+    unsigned long long stack_counters[REB_PROFILING_DEPTH_MAX][REB_PROFILING_COUNTER_N]; // Hardware counters when the open scopes were entered
+    int counters_fd[REB_PROFILING_COUNTER_N];   // File descriptors of the hardware counters. 0: not opened yet, -1: not available
+    char padding[64];                       // Avoids false sharing between threads
+};
+
+// Subsystems whose memory is reported by reb_memory_usage().
+enum REB_MEMORY {
+    REB_MEMORY_PARTICLES = 0,   // Particle array
+    REB_MEMORY_LOOKUP = 1,      // Hash lookup table
+    REB_MEMORY_GRAVITY = 2,     // Buffers of the gravity routines (compensated summation, structure of arrays copies, GPU buffers)
+    REB_MEMORY_TREE = 3,        // Tree cells and Morton keys
+    REB_MEMORY_COLLISION = 4,   // Collision list and buffers of the collision searches
+    REB_MEMORY_BOUNDARY = 5,    // Ghost boxes
+    REB_MEMORY_INTEGRATOR = 6,  // Internal arrays of all integrators, e.g. the IAS15 dp7 buffers, and ODEs
+    REB_MEMORY_MPI = 7,         // MPI send and receive buffers
+    REB_MEMORY_DISPLAY = 8,     // Copies of the simulation for the visualization
+    REB_MEMORY_OTHER = 9,       // Variational configurations and profiling data
+    REB_MEMORY_N = 10,          // Number of subsystems
+};
+
+// Memory allocated by a simulation, see reb_memory_usage().
+struct reb_memory_report {
+    size_t bytes[REB_MEMORY_N]; // Allocated bytes per subsystem
+    size_t total;               // Sum over all subsystems
+};
+
+// Storage formats of compact test particles.
+enum REB_COMPACT_PRECISION {
+    REB_COMPACT_FLOAT32 = 0,    // Positions and velocities are stored as float
+    REB_COMPACT_CHUNKED = 1,    // Positions and velocities are stored as float relative to a double precision origin per chunk
+};
+
+#define REB_COMPACT_CHUNK 256   // Number of compact test particles sharing one origin with REB_COMPACT_CHUNKED.
+
+// Massless test particles stored in single precision. See reb_compact_add().
+struct reb_compact_particles {
+    int N;                      // Number of compact test particles
+    int allocatedN;             // Internal. Number of allocated entries.
+    enum REB_COMPACT_PRECISION precision; // Storage format. Cannot be changed once particles have been added. Default: REB_COMPACT_FLOAT32.
+    long N_removed;             // Number of compact test particles removed by collisions or by the open boundary
+    double* origin;             // Internal. Positions and velocities of the chunk origins (6 per chunk). REB_COMPACT_CHUNKED only.
+    float* xyz;                 // Internal. Positions (3 per particle)
+    float* vxyz;                // Internal. Velocities (3 per particle)
+    float* r;                   // Internal. Radii
+    uint32_t* hash;             // Internal. Hashes
+};
+
+// Precomputed trajectories of massive bodies, stored as piecewise Chebyshev polynomials. See reb_create_ephemeris().
+struct reb_ephemeris {
+    int N;                  // Number of massive bodies
+    int order;              // Number of Chebyshev coefficients per coordinate and segment
+    long segments_N;        // Number of segments
+    double t_start;         // Time at the beginning of the first segment
+    double segment;         // Length of one segment in simulation time
+    double G;               // Gravitational constant used to compute the ephemeris
+    double* m;              // Masses (length N)
+    double* radius;         // Radii (length N)
+    uint32_t* hash;         // Hashes (length N)
+    double* coefficients;   // Coefficients of x, y, z, vx, vy, vz (length segments_N*N*6*order)
 };
 
 // Possible return values of of rebound_integrate
@@ -536,6 +726,14 @@ enum REB_STATUS {
     REB_EXIT_COLLISION = 7,     // The integration ends early because two particles collided. 
 };
 
+// Modes for running the heartbeat asynchronously. The heartbeat then receives a synchronized, read-only copy of the simulation.
+// Changes to the copy have no effect, except that reb_stop() on the copy stops the integration (a few steps later).
+enum REB_HEARTBEAT_ASYNC {
+    REB_HEARTBEAT_ASYNC_NONE = 0,   // Heartbeat runs on the simulation thread (default). Required if the heartbeat modifies the simulation.
+    REB_HEARTBEAT_ASYNC_SKIP = 1,   // Heartbeat runs on a helper thread. If the last heartbeat has not finished yet, the current one is skipped.
+    REB_HEARTBEAT_ASYNC_BLOCK = 2,  // Heartbeat runs on a helper thread. If the last heartbeat has not finished yet, the simulation waits for it.
+};
+
 // IDs for content of a binary field. Used to read and write binary files.
 enum REB_BINARY_FIELD_TYPE {
     REB_BINARY_FIELD_TYPE_T = 0,
@@ -673,6 +871,54 @@ enum REB_BINARY_FIELD_TYPE {
     REB_BINARY_FIELD_TYPE_BS_PREVIOUSREJECTED = 161,
     REB_BINARY_FIELD_TYPE_BS_TARGETITER = 162,
     REB_BINARY_FIELD_TYPE_VARRESCALEWARNING = 163,
+    REB_BINARY_FIELD_TYPE_COLLISIONSKIPTESTPARTICLEPAIRS = 164,
+    REB_BINARY_FIELD_TYPE_COLLISIONGRIDCELLSIZE = 165,
+    REB_BINARY_FIELD_TYPE_COLLISIONRESOLVEPARALLEL = 166,
+    REB_BINARY_FIELD_TYPE_COLLISIONSKIN = 167,
+    REB_BINARY_FIELD_TYPE_TRACKCOLLISIONSTATISTICS = 168,
+    REB_BINARY_FIELD_TYPE_COLLISIONTIMEOFIMPACT = 169,
+    REB_BINARY_FIELD_TYPE_TREEREBUILD = 170,
+    REB_BINARY_FIELD_TYPE_SPATIALSORTINTERVAL = 171,
+    REB_BINARY_FIELD_TYPE_TREEACTIVEONLY = 172,
+    REB_BINARY_FIELD_TYPE_TREEGROUPSIZE = 173,
+    REB_BINARY_FIELD_TYPE_GRAVITYFMMORDER = 174,
+    REB_BINARY_FIELD_TYPE_IAS15_TPSUBSTEPS = 175,
+    REB_BINARY_FIELD_TYPE_BLOCK_ETA = 176,
+    REB_BINARY_FIELD_TYPE_BLOCK_MAXLEVEL = 177,
+    REB_BINARY_FIELD_TYPE_BLOCK_PARTICLESTEPS = 178,
+    REB_BINARY_FIELD_TYPE_MERCURIUS_SPLITTPONLY = 179,
+    REB_BINARY_FIELD_TYPE_USESOA = 180,
+    REB_BINARY_FIELD_TYPE_SAASYNC = 181,
+    REB_BINARY_FIELD_TYPE_SACOMPRESS = 182,
+    REB_BINARY_FIELD_TYPE_PARTICLES_XOR = 183,
+    REB_BINARY_FIELD_TYPE_DISPLAYSTRIDE = 184,
+    REB_BINARY_FIELD_TYPE_WHFAST_TPPARTITIONS = 185,
+    REB_BINARY_FIELD_TYPE_WHFAST_KEPLERWARMSTART = 186,
+    REB_BINARY_FIELD_TYPE_WHFAST_KEPLERGUESS = 187,
+    REB_BINARY_FIELD_TYPE_MERCURIUS_KEPLERWARMSTART = 188,
+    REB_BINARY_FIELD_TYPE_MERCURIUS_KEPLERGUESS = 189,
+    REB_BINARY_FIELD_TYPE_IAS15_TPCOMPENSATED = 190,
+    REB_BINARY_FIELD_TYPE_COLLISIONLINEHERMITE = 191,
+    REB_BINARY_FIELD_TYPE_COLLISIONLINEIAS15 = 192,
+    REB_BINARY_FIELD_TYPE_SLEEPV = 193,
+    REB_BINARY_FIELD_TYPE_SLEEPA = 194,
+    REB_BINARY_FIELD_TYPE_SLEEPSTEPS = 195,
+    REB_BINARY_FIELD_TYPE_COMPACTPRECISION = 196,
+    REB_BINARY_FIELD_TYPE_COMPACTNREMOVED = 197,
+    REB_BINARY_FIELD_TYPE_COMPACTORIGIN = 198,
+    REB_BINARY_FIELD_TYPE_COMPACTXYZ = 199,
+    REB_BINARY_FIELD_TYPE_COMPACTVXYZ = 200,
+    REB_BINARY_FIELD_TYPE_COMPACTR = 201,
+    REB_BINARY_FIELD_TYPE_COMPACTHASH = 202,
+    REB_BINARY_FIELD_TYPE_INJECTRATE = 203,
+    REB_BINARY_FIELD_TYPE_INJECTCARRY = 204,
+    REB_BINARY_FIELD_TYPE_INJECTPOOL = 205,
+    REB_BINARY_FIELD_TYPE_NINJECTED = 206,
+    REB_BINARY_FIELD_TYPE_SAFULLEVERY = 207,
+    REB_BINARY_FIELD_TYPE_SAFULLCOUNTER = 208,
+    REB_BINARY_FIELD_TYPE_SAFULLT = 209,
+    REB_BINARY_FIELD_TYPE_GRAVITYDETERMINISTIC = 210,
+    REB_BINARY_FIELD_TYPE_GRAVITYTREEFARFIELD = 211,
 
     REB_BINARY_FIELD_TYPE_TES_DQ_MAX = 300,
     REB_BINARY_FIELD_TYPE_TES_RECTI_PER_ORBIT = 301,
@@ -758,6 +1004,8 @@ enum REB_BINARY_FIELD_TYPE {
     REB_BINARY_FIELD_TYPE_WHFAST512_ALLOCATEDN = 393,
     REB_BINARY_FIELD_TYPE_WHFAST512_PJH = 394,
     REB_BINARY_FIELD_TYPE_WHFAST512_PJH0 = 395,
+    REB_BINARY_FIELD_TYPE_WHFAST512_ALLOCATEDNTP = 396,
+    REB_BINARY_FIELD_TYPE_WHFAST512_PJHTP = 397,
 
     REB_BINARY_FIELD_TYPE_HEADER = 1329743186,  // Corresponds to REBO (first characters of header text)
     REB_BINARY_FIELD_TYPE_SABLOB = 9998,        // SA Blob
@@ -770,7 +1018,7 @@ struct reb_binary_field {
     uint64_t size;  // Size in bytes of field (only counting what follows, not the binary field, itself).
 };
 
-// Holds a particle's hash and the particle's index in the particles array. Used for particle_lookup_table.
+// Holds a particle's hash and the particle's index in the particles array. Used for particle_lookup_table (index is -1 for empty slots).
 struct reb_hash_pointer_pair{
     uint32_t hash;
     int index;
@@ -792,17 +1040,39 @@ struct reb_simulation {
     int     N_active;
     int     testparticle_type;
     int     testparticle_hidewarnings;
-    struct reb_hash_pointer_pair* particle_lookup_table; // Array of pairs that map particles' hashes to their index in the particles array.
+    struct reb_hash_pointer_pair* particle_lookup_table; // Open-addressing hash map from particles' hashes to their index in the particles array.
     int     hash_ctr;               // Counter for number of assigned hashes to assign unique values.
-    int     N_lookup;               // Number of entries in the particle lookup table.
-    int     allocatedN_lookup;      // Number of lookup table entries allocated.
+    int     N_lookup;               // Number of entries in the particle lookup table (may include stale entries).
+    int     allocatedN_lookup;      // Number of lookup table slots allocated (power of two).
     int     allocatedN;             // Current maximum space allocated in the particles array on this node. 
     struct reb_particle* particles;
     struct reb_vec3d* gravity_cs;   // Containing the information for compensated gravity summation 
     int     gravity_cs_allocatedN;
+    double* particles_soa;          // Internal. Copy of the particle data as a structure of arrays (x, y, z, m, r), see reb_particles_soa_update().
+    int     particles_soa_allocatedN; // Internal. Padded length of every array in particles_soa.
+    double* gravity_gpu;            // Internal. Positions and accelerations of test particles, mirrored on the GPU if REBOUND is compiled with GPU=1.
+    int     gravity_gpu_allocatedN; // Internal. Number of particles for which gravity_gpu is allocated.
+    int*    gravity_tree_cost;      // Internal. Number of interactions of every particle in the last REB_GRAVITY_TREE calculation. Used to balance OpenMP threads.
+    int     gravity_tree_cost_N;    // Internal. Number of particles in gravity_tree_cost. The costs are only used if this is equal to N.
+    double* additional_forces_soa_buffer;       // Internal. Positions, velocities and accelerations passed to additional_forces_soa.
+    int     additional_forces_soa_allocatedN;   // Internal. Number of particles for which additional_forces_soa_buffer is allocated.
+    int     spatial_sort_interval;  // If >0, reb_sort_particles_spatially() is called every spatial_sort_interval timesteps.
+    int     use_soa;                // If 1, REB_COLLISION_DIRECT works on a structure of arrays copy of the particle data. Default: 0.
     struct reb_treecell** tree_root;// Pointer to the roots of the trees. 
     int     tree_needs_update;      // Flag to force a tree update (after boundary check)
+    struct reb_treecell** tree_cells_chunks;// Chunks of memory from which tree cells are allocated.
+    int     tree_cells_chunks_N;    // Number of allocated chunks.
+    int     tree_cells_N;           // Number of cells taken from the chunks (including cells on the free list).
+    struct reb_treecell* tree_cells_free;   // Linked list (via oct[0]) of cells that can be reused.
+    int     tree_rebuild;           // If 1, the tree is built from scratch using Morton keys every timestep instead of being updated. 
+    int     tree_active_only;       // If 1, only active particles are added to the tree. Test particles only query it. See reb_tree_active_only().
+    int     tree_group_size;        // If >0, particles in subtrees with at most this many particles share one interaction list in the tree gravity calculation.
+    struct reb_tree_key* tree_keys; // Internal. Morton keys used to build the tree (two buffers for sorting).
+    int     tree_keys_allocatedN;
     double opening_angle2;
+    int     gravity_fmm_order;      // Expansion order used by REB_GRAVITY_FMM.
+    int     gravity_deterministic;  // If 1, partial sums of forces use a fixed blocking, so that the result does not depend on the number of OpenMP threads.
+    int     gravity_tree_far_field; // If 1, REB_GRAVITY_TREE sums the gravity of distant root boxes (including their images in ghost boxes) with local expansions of order gravity_fmm_order.
     enum REB_STATUS status;
     int     exact_finish_time;
 
@@ -814,8 +1084,14 @@ struct reb_simulation {
     char** messages;                // Array of strings containing last messages (only used if save_messages==1). 
     double exit_max_distance;
     double exit_min_distance;
+    int exit_encounter_i;           // Indices of the pair of particles which triggered REB_EXIT_ENCOUNTER (i<j). -1 if none.
+    int exit_encounter_j;
     double usleep;
     struct reb_display_data* display_data; // Datastructure stores visualization related data. Does not have to be modified by the user. 
+    int display_stride;             // Only every display_stride-th particle is copied to and shown by the visualization. Default: 1.
+    int heartbeat_async;            // Runs the heartbeat on a copy of the simulation in a helper thread. See enum REB_HEARTBEAT_ASYNC. Default: 0 (synchronous).
+    long heartbeat_async_skipped;   // Number of heartbeats skipped because the helper thread was busy (REB_HEARTBEAT_ASYNC_SKIP only).
+    struct reb_heartbeat_async* heartbeat_async_worker; // Internal. Helper thread running the heartbeat.
     int track_energy_offset;
     double energy_offset;
     double walltime;
@@ -834,6 +1110,9 @@ struct reb_simulation {
     int     nghostx;
     int     nghosty;
     int     nghostz;
+    struct reb_ghostbox* ghostboxes;    // Internal. Shifts of all ghost boxes, see reb_boundary_ghostboxes().
+    int     ghostboxes_allocatedN;      // Internal. Allocated size of ghostboxes.
+    double  ghostboxes_key[9];          // Internal. Time, boundary, boxsize, nghostx/y/z and OMEGA for which ghostboxes was calculated.
 
 #ifdef MPI
     int    mpi_id;                              // Unique id of this node (starting at 0). Used for MPI only.
@@ -844,6 +1123,8 @@ struct reb_simulation {
     struct reb_particle** particles_recv;       // Receive buffer for particles. There is one buffer per node. 
     int*   particles_recv_N;                    // Current length of particle receive buffer. 
     int*   particles_recv_Nmax;                 // Maximal length of particle receive beffer before realloc() is needed. */
+    int**  particles_send_index;                // Local index of every particle in particles_send. Same length as particles_send. 
+    int**  particles_recv_index;                // Index of every particle in particles_recv on the node which sent it. Only set for the collision search. 
 
     struct reb_treecell** tree_essential_send;  // Send buffer for cells. There is one buffer per node. 
     int*   tree_essential_send_N;               // Current length of cell send buffer. 
@@ -851,6 +1132,22 @@ struct reb_simulation {
     struct reb_treecell** tree_essential_recv;  // Receive buffer for cells. There is one buffer per node. 
     int*   tree_essential_recv_N;               // Current length of cell receive buffer. 
     int*   tree_essential_recv_Nmax;            // Maximal length of cell receive beffer before realloc() is needed. 
+    MPI_Request* tree_essential_requests;       // Pending receive (first mpi_num) and send (last mpi_num) requests of the gravity essential tree exchange.
+    int    tree_essential_pending;              // 1 while the gravity essential tree exchange is in flight. 
+
+    int*   mpi_rootbox_owner;                   // Id of the node that owns each root box. 
+    double* mpi_rootbox_cost;                   // Number of particles times steps in each local root box since the last rebalance. 
+    int    mpi_rebalance_interval;              // If >0, root boxes are reassigned to nodes every mpi_rebalance_interval steps. Default: 0.
+
+    MPI_Datatype mpi_particle_type;             // Particle without pointers. Used when particles move to another node. 
+    MPI_Datatype mpi_particle_collision_type;   // Only the particle fields needed for collisions with remote particles. 
+    MPI_Datatype mpi_cell_gravity_type;         // Only the cell fields needed to calculate gravity from remote cells. 
+    MPI_Datatype mpi_cell_collision_type;       // Only the cell fields needed to search for collisions in remote cells.
+
+    enum {
+        REB_MPI_DECOMPOSITION_ROOTBOXES = 0,     // Every node owns a set of root boxes and the particles in them (default)
+        REB_MPI_DECOMPOSITION_TESTPARTICLES = 1, // Every node has a copy of the active particles and owns a slice of the test particles
+        } mpi_decomposition;                    // Needs to be set before reb_mpi_init().
 #endif // MPI
 
     int collision_resolve_keep_sorted;
@@ -860,6 +1157,52 @@ struct reb_simulation {
     double collisions_plog;
     double max_radius[2];               // Two largest particle radii, set automatically, needed for collision search.
     long collisions_Nlog;
+    int collision_skip_testparticle_pairs; // If 1, test particles (index >= N_active) are not checked for collisions with each other. Default: 0.
+    double collision_grid_cellsize;         // Cell size used by REB_COLLISION_GRID. If <=0 (default), twice the largest particle radius is used.
+    int collision_resolve_parallel;         // If 1, hard-sphere collisions are resolved in batches of independent collisions, in parallel with OpenMP. Default: 0.
+    double collision_skin;                  // Skin width used by REB_COLLISION_NEIGHBOURLIST and REB_COLLISION_ACTIVELIST. If <=0 (default), the largest particle radius is used.
+    int collision_time_of_impact;           // If 1, line based searches record the time of impact and collisions are resolved in time order. Default: 0.
+    int collision_line_hermite;             // If 1, REB_COLLISION_LINE interpolates the distance of two particles with a cubic Hermite polynomial using the positions and velocities at the beginning and end of the timestep. Default: 0.
+    int collision_line_ias15;               // If 1 and the integrator is IAS15, REB_COLLISION_LINE uses the polynomial trajectories of the last IAS15 step (cubic Hermite polynomials for particles without one). Default: 0.
+    int* collision_grid_bucket;             // Internal. Offset of the first particle of every hash bucket in collision_grid_particles.
+    int collision_grid_bucket_allocatedN;   // Internal. Allocated size of collision_grid_bucket.
+    int* collision_grid_particles;          // Internal. Particle indices sorted by hash bucket.
+    int collision_grid_particles_allocatedN;// Internal. Allocated size of collision_grid_particles.
+    int* collision_sap_particles;           // Internal. Particle indices sorted by the lower bound of their interval along the sweep axis.
+    double* collision_sap_lower;            // Internal. Lower bounds of the intervals, same order as collision_sap_particles.
+    double* collision_sap_upper;            // Internal. Upper bounds of the intervals, same order as collision_sap_particles.
+    int collision_sap_N;                    // Internal. Number of sorted particles. Particles are resorted from scratch if this changes.
+    int collision_sap_allocatedN;           // Internal. Allocated size of the sweep and prune arrays.
+    int collision_sap_axis;                 // Internal. Sweep axis (0=x, 1=y, 2=z), chosen when particles are resorted from scratch.
+    double* collision_bvh_box;              // Internal. Bounding boxes (xmin, ymin, zmin, xmax, ymax, zmax) of all nodes of the bounding volume hierarchy.
+    int* collision_bvh_child;               // Internal. Children of all nodes. Leaves store -1-i for particle i.
+    int collision_bvh_N;                    // Internal. Number of particles when the hierarchy was last built. The hierarchy is rebuilt if this changes.
+    int collision_bvh_allocatedN;           // Internal. Number of particles for which the hierarchy is allocated.
+    double collision_bvh_cost;              // Internal. Total surface area of all inner boxes right after the last build.
+    long collision_bvh_builds;              // Number of times the bounding volume hierarchy has been built.
+    double* collision_line_soa;             // Internal. Packed positions, velocities and radii (structure of arrays) used by REB_COLLISION_LINE.
+    int collision_line_soa_allocatedN;      // Internal. Number of particles for which collision_line_soa is allocated.
+    double* collision_line_xv0;             // Internal. Positions and velocities (x, y, z, vx, vy, vz) of all particles at the beginning of the timestep. Only stored if collision_line_hermite is set.
+    int collision_line_xv0_N;               // Internal. Number of particles stored in collision_line_xv0, -1 if the data is not valid for the current timestep.
+    int collision_line_xv0_allocatedN;      // Internal. Number of particles for which collision_line_xv0 is allocated.
+    double* collision_line_poly;            // Internal. Coefficients of the IAS15 trajectories (x, y, z, 10 each) and the radius of their bounding sphere, 31 doubles per particle.
+    int collision_line_poly_allocatedN;     // Internal. Number of particles for which collision_line_poly is allocated.
+    double* collision_gpu;                  // Internal. Positions, velocities and radii of all particles, mirrored on the GPU if REBOUND is compiled with GPU=1.
+    int collision_gpu_allocatedN;           // Internal. Number of particles for which collision_gpu is allocated.
+    int* collision_gpu_pairs;               // Internal. Colliding pairs (p1, p2) found on the GPU, mirrored on the GPU.
+    int collision_gpu_pairs_allocatedN;     // Internal. Number of pairs for which collision_gpu_pairs is allocated.
+    int* collision_neighbours;              // Internal. Candidate pairs (p1, p2, ghost box index) found when the neighbour list was last built.
+    int collision_neighbours_N;             // Internal. Number of candidate pairs.
+    int collision_neighbours_allocatedN;    // Internal. Number of candidate pairs for which collision_neighbours is allocated.
+    double* collision_neighbours_x;         // Internal. Positions and radii (x, y, z, r) of all particles when the neighbour list was last built.
+    int collision_neighbours_x_allocatedN;  // Internal. Number of particles for which collision_neighbours_x is allocated.
+    double collision_neighbours_gb[81];     // Internal. Shifts of the 27 inner ghost boxes when the neighbour list was last built.
+    double collision_neighbours_skin;       // Internal. Skin width used when the neighbour list was last built.
+    int collision_neighbours_built[3];      // Internal. N, Ninner and Nactive when the neighbour list was last built. N=-1 forces a rebuild.
+    long collision_neighbours_builds;       // Number of times the neighbour list has been built.
+    int track_collision_statistics;         // If 1, collision_statistics is updated by every collision search. Default: 0.
+    struct reb_collision_statistics collision_statistics;
+    struct reb_collision_log_writer* collision_log_writer;  // Internal. Background writer thread for reb_collision_log_open().
     
     // MEGNO
     int calculate_megno;    // Do not change manually. Internal flag that determines if megno is calculated (default=0, but megno_init() sets it to the index of variational particles used for megno)
@@ -882,6 +1225,13 @@ struct reb_simulation {
     double simulationarchive_next;                  // Next output time (simulation tim or wall time, depending on wether auto_interval or auto_walltime is set)
     unsigned long long simulationarchive_next_step; // Next output step (only used if auto_steps is set)
     char*  simulationarchive_filename;              // Name of output file
+    int    simulationarchive_async;                 // If 1, snapshots are written by a background thread (SA version 3 only, not with MPI)
+    int    simulationarchive_compress;              // If 1, particle data in snapshots is XOR encoded against the first snapshot and compressed (SA version 3 only)
+    struct reb_simulationarchive_writer* simulationarchive_writer; // Internal. Background writer thread for asynchronous snapshots.
+    unsigned int simulationarchive_full_every;      // If >1, only every n-th snapshot contains all particles. Other snapshots only contain the first N_active particles (SA version 3 only)
+    unsigned long long simulationarchive_full_counter; // Internal. Number of snapshots taken, used to schedule full snapshots
+    double simulationarchive_full_t;                // Internal. Time of the last snapshot containing all particles
+    struct reb_output_quantized_writer* output_quantized_writer;  // Internal. Background writer thread for reb_output_positions_quantized().
 
     // Modules
     enum {
@@ -895,6 +1245,15 @@ struct reb_simulation {
         REB_COLLISION_TREE = 2,     // Tree based collision search O(N log(N))
         REB_COLLISION_LINE = 4,     // Direct collision search O(N^2), looks for collisions by assuming a linear path over the last timestep
         REB_COLLISION_LINETREE = 5, // Tree-based collision search O(N log(N)), looks for collisions by assuming a linear path over the last timestep
+        REB_COLLISION_GRID = 6,     // Collision search using a hashed uniform grid O(N), best for particles of similar size
+        REB_COLLISION_SAP = 7,      // Sweep and prune collision search along one axis, keeps particles sorted between timesteps
+        REB_COLLISION_LINESAP = 8,  // Sweep and prune collision search, looks for collisions by assuming a linear path over the last timestep
+        REB_COLLISION_NEIGHBOURLIST = 9, // Checks cached candidate pairs which are only updated when particles moved more than collision_skin
+        REB_COLLISION_AUTO = 10,    // Times DIRECT, SAP, BVH, GRID, NEIGHBOURLIST and TREE (if a box is configured) and uses the fastest
+        REB_COLLISION_LINEAUTO = 11,// Times LINE, LINESAP, LINEBVH and LINETREE (if a box is configured) and uses the fastest
+        REB_COLLISION_ACTIVELIST = 12, // Like NEIGHBOURLIST, but only pairs involving an active particle, built with a sweep around every active particle
+        REB_COLLISION_BVH = 13,     // Bounding volume hierarchy with one box per particle, refitted every timestep. Best for particles with very different radii
+        REB_COLLISION_LINEBVH = 14, // Bounding volume hierarchy, looks for collisions by assuming a linear path over the last timestep
         } collision;
     enum {
         REB_INTEGRATOR_IAS15 = 0,    // IAS15 integrator, 15th order, non-symplectic (default)
@@ -909,6 +1268,7 @@ struct reb_simulation {
         REB_INTEGRATOR_BS = 12,      // Gragg-Bulirsch-Stoer 
         REB_INTEGRATOR_TES = 20,     // Terrestrial Exoplanet Simulator (TES) 
         REB_INTEGRATOR_WHFAST512 = 21,   // WHFast integrator, optimized for AVX512
+        REB_INTEGRATOR_BLOCK = 22,   // Fourth order Hermite integrator with hierarchical block timesteps
         } integrator;
     enum {
         REB_BOUNDARY_NONE = 0,      // Do not check for anything (default)
@@ -923,7 +1283,34 @@ struct reb_simulation {
         REB_GRAVITY_TREE = 3,       // Use the tree to calculate gravity, O(N log(N)), set opening_angle2 to adjust accuracy.
         REB_GRAVITY_MERCURIUS = 4,  // Special gravity routine only for MERCURIUS
         REB_GRAVITY_JACOBI = 5,     // Special gravity routine which includes the Jacobi terms for WH integrators 
+        REB_GRAVITY_FMM = 6,        // Fast multipole method using the tree, O(N), set opening_angle2 and gravity_fmm_order to adjust accuracy.
+        REB_GRAVITY_AUTO = 7,       // Times BASIC, TREE and FMM (if they can be used) and uses the fastest
+        REB_GRAVITY_EWALD = 8,      // Ewald summation for periodic and shearing sheet boundary conditions. Ignores nghostx/y/z.
         } gravity;
+    struct reb_autotune gravity_autotune;   // Internal. State of the automatic selection of the gravity routine.
+    struct reb_autotune collision_autotune; // Internal. State of the automatic selection of the collision routine.
+    int profiling;                          // Set to 1 to measure the time spent in different parts of the code. See reb_profiling_time(). Default: 0.
+    struct reb_profiling_thread* profiling_threads; // Internal. Accumulated times, one entry per OpenMP thread.
+    int profiling_threads_N;                // Internal. Number of entries in profiling_threads.
+    int profiling_trace;                    // Number of events kept per thread for reb_profiling_trace_write(). Requires profiling to be 1. Default: 0 (no tracing).
+    void (*memory_grown)(struct reb_simulation* const r, const struct reb_memory_report* const report); // Called at the end of a timestep if any subsystem has allocated more memory since the last call. Default: NULL.
+    struct reb_memory_report memory_report_last;    // Internal. Memory used when memory_grown was last checked.
+    const struct reb_ephemeris* ephemeris;  // If set, the active particles follow this ephemeris. Not owned by the simulation. See reb_attach_ephemeris(). Default: NULL.
+    int N_frozen;                           // Number of frozen test particles. See reb_freeze().
+    int frozen_hidden;                      // Internal. Number of frozen particles currently moved behind the first N particles.
+    int* frozen_swaps;                      // Internal. Pairs of indices swapped to move the frozen particles to the end of the array.
+    int frozen_swaps_N;                     // Internal. Number of pairs in frozen_swaps.
+    int frozen_swaps_allocatedN;            // Internal. Number of pairs allocated in frozen_swaps.
+    double sleep_v;                         // Particles slower than this for sleep_steps consecutive steps fall asleep (LEAPFROG only). Default: 0 (no sleeping).
+    double sleep_a;                         // If >0, the acceleration of a particle also needs to be below this value for it to fall asleep. Default: 0.
+    int sleep_steps;                        // Number of consecutive quiet steps after which a particle falls asleep. Default: 10.
+    int N_asleep;                           // Number of sleeping particles. Updated at the beginning of every timestep.
+    struct reb_compact_particles compact;   // Massless test particles stored in single precision (LEAPFROG only). See reb_compact_add().
+    void (*injector)(struct reb_simulation* const r, struct reb_particle* const p); // Fills in a new test particle. Called inject_rate*dt times per timestep on average. See reb_inject(). Default: NULL.
+    double inject_rate;                     // Number of test particles created by the injector per unit time. Default: 0.
+    double inject_carry;                    // Internal. Fraction of a particle carried over to the next timestep.
+    int inject_pool;                        // If larger than 0, the particle array keeps room for this many injected particles and test particles removed in collisions become free slots. Default: 0.
+    long N_injected;                        // Number of particles added with reb_inject().
 
     // Integrators
     struct reb_simulation_integrator_sei ri_sei;            // The SEI struct 
@@ -936,6 +1323,7 @@ struct reb_simulation {
     struct reb_simulation_integrator_eos ri_eos;            // The EOS struct 
     struct reb_simulation_integrator_bs ri_bs;              // The BS struct
     struct reb_simulation_integrator_tes ri_tes;            // TES struct
+    struct reb_simulation_integrator_block ri_block;        // The BLOCK struct
 
     // ODEs
     struct reb_ode** odes;  // all ode sets (includes nbody if BS set as integrator)
@@ -945,12 +1333,17 @@ struct reb_simulation {
 
      // Callback functions
     void (*additional_forces) (struct reb_simulation* const r);
+    // Same as additional_forces but positions and velocities of the N=r->N-r->N_var real particles are passed as arrays in
+    // structure of arrays layout: x of particle i is pos[i], y is pos[N+i], and z is pos[2*N+i]. Accelerations are written 
+    // to acc in the same layout. acc is zeroed before the call and the accelerations are added to the particles afterwards.
+    void (*additional_forces_soa) (struct reb_simulation* const r, const int N, const double* const pos, const double* const vel, double* const acc);
     void (*pre_timestep_modifications) (struct reb_simulation* const r);    // used by REBOUNDx
     void (*post_timestep_modifications) (struct reb_simulation* const r);   // used by REBOUNDx
     void (*heartbeat) (struct reb_simulation* r);
     void (*display_heartbeat) (struct reb_simulation* r);
     double (*coefficient_of_restitution) (const struct reb_simulation* const r, double v); 
     int (*collision_resolve) (struct reb_simulation* const r, struct reb_collision);
+    void (*collision_resolve_batch) (struct reb_simulation* const r, struct reb_collision* const collisions, const int collisions_N, int* const outcomes); // If set, called once per timestep with all collisions instead of collision_resolve.
     void (*free_particle_ap) (struct reb_particle* p);   // used by REBOUNDx 
     void (*extras_cleanup) (struct reb_simulation* r);
     void* extras; // Pointer to connect additional (optional) libraries, e.g., reboundx
@@ -1005,9 +1398,33 @@ int reb_get_next_message(struct reb_simulation* const r, char* const buf); // Ge
 // Timestepping
 void reb_step(struct reb_simulation* const r);
 void reb_steps(struct reb_simulation* const r, unsigned int N_steps);
+// Same as reb_steps but the walltime is only measured once for all steps. Falls back to reb_steps if pre/post_timestep_modifications are set or routines are selected automatically.
+void reb_steps_fast(struct reb_simulation* const r, unsigned int N_steps);
 enum REB_STATUS reb_integrate(struct reb_simulation* const r, double tmax);
+// Integrates N independent simulations to tmax using a pool of N_threads threads (N_threads<=0 uses all cores).
+// Every simulation runs single-threaded. Threads pick up the next simulation as soon as they are done, so runs of uneven length are balanced.
+// Visualization is ignored. Returns the number of simulations which did not finish with REB_EXIT_SUCCESS. The status of each simulation is stored in sims[i]->status.
+int reb_ensemble_integrate(struct reb_simulation** const sims, int N, double tmax, int N_threads);
+// Integrates N members of an ensemble derived from r to tmax using N_procs forked processes (POSIX only, N_procs<=0 uses all cores).
+// Every member is a forked copy of r which shares memory with r copy-on-write. r itself is not modified.
+// setup(r, member) is called in the member's process before the integration (e.g. to perturb initial conditions).
+// result(r, member, row) is called after the integration and writes N_columns doubles which are returned in results[member*N_columns].
+// If filename_format is not NULL (e.g. "member%04d.bin"), every member writes a SimulationArchive. The automatic snapshot
+// interval of r is used, otherwise the initial and final states are stored. Background writers of r and visualization are not inherited.
+// The exit status of each member is stored in status (can be NULL). Returns the number of members which did not finish with REB_EXIT_SUCCESS.
+int reb_ensemble_integrate_fork(struct reb_simulation* const r, const int N, const double tmax, int N_procs,
+        void (*setup)(struct reb_simulation* const r, const int member),
+        void (*result)(struct reb_simulation* const r, const int member, double* const row),
+        const int N_columns, double* const results, enum REB_STATUS* const status, const char* filename_format);
 void reb_integrator_synchronize(struct reb_simulation* r);
+// Copies the synchronized states of the particles indices[0..N_indices-1] into particles_out without synchronizing the simulation itself. 
+// The integrator's internal state is not modified, so the integration continues exactly as if the function had not been called.
+// Returns 0 on success and 1 if an index is out of range.
+int reb_integrator_synchronize_particles(struct reb_simulation* const r, const int* const indices, const int N_indices, struct reb_particle* const particles_out);
 void reb_integrator_reset(struct reb_simulation* r);
+// Integrates N_sims independent simulations with WHFast512 in lockstep. Every SIMD lane holds one simulation. 
+// All simulations need to have the same number of particles (at most 9), the same time, and the same timestep.
+enum REB_STATUS reb_whfast512_ensemble_integrate(struct reb_simulation** const sims, const int N_sims, const double tmax);
 void reb_update_acceleration(struct reb_simulation* r);
 void reb_stop(struct reb_simulation* const r); // Stop current integration
 
@@ -1026,17 +1443,88 @@ double reb_integrator_mercurius_L_C5(const struct reb_simulation* const r, doubl
 int reb_collision_resolve_halt(struct reb_simulation* const r, struct reb_collision c);
 int reb_collision_resolve_hardsphere(struct reb_simulation* const r, struct reb_collision c);
 int reb_collision_resolve_merge(struct reb_simulation* const r, struct reb_collision c);
+// Batched versions, same results as the functions above but only called once per timestep
+void reb_collision_resolve_hardsphere_batch(struct reb_simulation* const r, struct reb_collision* const collisions, const int collisions_N, int* const outcomes);
+void reb_collision_resolve_merge_batch(struct reb_simulation* const r, struct reb_collision* const collisions, const int collisions_N, int* const outcomes);
+
+#define REB_COLLISION_LOG_MAGIC 0x474C4352 // Corresponds to RCLG
+// Header at the beginning of a file written by reb_collision_log_open(). It is followed by reb_collision_event entries.
+struct reb_collision_log_header {
+    uint32_t magic;         // REB_COLLISION_LOG_MAGIC
+    uint32_t size;          // sizeof(struct reb_collision_event)
+    uint64_t reserved;
+};
+// One resolved collision in the collision log.
+struct reb_collision_event {
+    double t;               // Time of the collision (the time of impact if collision_time_of_impact is set)
+    uint32_t hash1;         // Hashes of the two particles
+    uint32_t hash2;
+    double x, y, z;         // Position of the second particle relative to the first one, before the collision was resolved
+    double vx, vy, vz;      // Relative velocity, before the collision was resolved
+    int32_t outcome;        // Return value of the collision resolve function (1: first particle removed, 2: second particle removed, 3: both)
+    uint32_t reserved;
+};
+// Appends every resolved collision to a binary file. Works with all collision resolve functions, including
+// the built-in ones. Events are buffered and written by a background thread. The file header is written if the file is empty.
+void reb_collision_log_open(struct reb_simulation* r, const char* filename);
+// Waits until all logged collisions have been written to the file.
+void reb_collision_log_flush(struct reb_simulation* r);
+// Writes all logged collisions and stops the background thread. Called automatically when the simulation is freed.
+void reb_collision_log_close(struct reb_simulation* r);
 
 // Random sampling
 double reb_random_uniform(struct reb_simulation* r, double min, double max);
 double reb_random_powerlaw(struct reb_simulation* r, double min, double max, double slope);
 double reb_random_normal(struct reb_simulation* r, double variance);
 double reb_random_rayleigh(struct reb_simulation* r, double sigma);
+// Counter based versions of the above which fill an array with N random numbers. Value i only depends on 
+// r->rand_seed, stream, and the index first+i. It does not depend on the order of calls or the number of 
+// OpenMP threads. rand_seed is not modified. Use different streams for independent random variables.
+void reb_random_uniform_array(struct reb_simulation* r, uint32_t stream, uint64_t first, int N, double min, double max, double* values);
+void reb_random_powerlaw_array(struct reb_simulation* r, uint32_t stream, uint64_t first, int N, double min, double max, double slope, double* values);
+void reb_random_normal_array(struct reb_simulation* r, uint32_t stream, uint64_t first, int N, double variance, double* values);
+void reb_random_rayleigh_array(struct reb_simulation* r, uint32_t stream, uint64_t first, int N, double sigma, double* values);
 
 // Serialization functions.
 void reb_serialize_particle_data(struct reb_simulation* r, uint32_t* hash, double* m, double* radius, double (*xyz)[3], double (*vxvyvz)[3], double (*xyzvxvyvz)[6]); // NULL pointers will not be set.
 void reb_set_serialized_particle_data(struct reb_simulation* r, uint32_t* hash, double* m, double* radius, double (*xyz)[3], double (*vxvyvz)[3], double (*xyzvxvyvz)[6]); // Null pointers will be ignored.
 
+// Profiling functions. Only record data if r->profiling is 1. 
+// If thread is -1, the times of all threads are added up.
+double reb_profiling_time(const struct reb_simulation* const r, const enum REB_PROFILING scope, const int thread);      // Seconds spent in a scope, including nested scopes.
+double reb_profiling_time_self(const struct reb_simulation* const r, const enum REB_PROFILING scope, const int thread); // Seconds spent in a scope, excluding nested scopes.
+unsigned long reb_profiling_calls(const struct reb_simulation* const r, const enum REB_PROFILING scope, const int thread);
+const char* reb_profiling_name(const enum REB_PROFILING scope);
+unsigned long long reb_profiling_counter(const struct reb_simulation* const r, const enum REB_PROFILING scope, const enum REB_PROFILING_COUNTER counter, const int thread); // Hardware counter accumulated in a scope. Requires PERF_EVENTS.
+const char* reb_profiling_counter_name(const enum REB_PROFILING_COUNTER counter);
+void reb_profiling_reset(struct reb_simulation* const r);
+void reb_profiling_trace_write(struct reb_simulation* const r, const char* const filename); // Writes the events recorded if profiling_trace>0 in the Chrome trace (JSON) format. Can be opened with Perfetto.
+
+// Memory accounting. Only buffers which persist between timesteps are included.
+void reb_memory_usage(const struct reb_simulation* const r, struct reb_memory_report* const report);
+const char* reb_memory_name(const enum REB_MEMORY subsystem);
+
+// Ephemeris of massive bodies for test particle integrations. 
+// reb_create_ephemeris() integrates r to tmax and fits Chebyshev polynomials with order coefficients to every segment. Returns NULL on failure.
+// The reb_ephemeris_compute() and reb_ephemeris_read() variants fill an existing struct and return 1 on failure. reb_ephemeris_write() also returns 1 on failure.
+struct reb_ephemeris* reb_create_ephemeris(struct reb_simulation* const r, const double tmax, const double segment, const int order);
+int reb_ephemeris_compute(struct reb_ephemeris* const e, struct reb_simulation* const r, const double tmax, const double segment, const int order);
+struct reb_ephemeris* reb_open_ephemeris(const char* const filename);
+int reb_ephemeris_read(struct reb_ephemeris* const e, const char* const filename);
+int reb_ephemeris_write(const struct reb_ephemeris* const e, const char* const filename);
+void reb_ephemeris_evaluate(const struct reb_ephemeris* const e, const double t, struct reb_particle* const particles); // Sets positions, velocities and accelerations of e->N particles.
+// Adds the massive bodies to an empty simulation. They then follow the ephemeris and only the test particles are integrated (IAS15 and LEAPFROG only).
+// The ephemeris is not copied and needs to outlive the simulation. Many simulations can share one ephemeris.
+void reb_attach_ephemeris(struct reb_simulation* const r, const struct reb_ephemeris* const e);
+void reb_free_ephemeris_pointers(struct reb_ephemeris* const e);
+void reb_free_ephemeris(struct reb_ephemeris* const e);
+
+// Compact test particles are massless and stored in single precision (32 instead of 128 bytes per particle).
+// They feel the gravity of the active particles and are integrated with the LEAPFROG integrator.
+// They are removed if they hit an active particle (if collisions are enabled) or leave an open box.
+void reb_compact_add(struct reb_simulation* const r, struct reb_particle pt);
+struct reb_particle reb_compact_get(const struct reb_simulation* const r, const int index); // Returns a particle with NaN coordinates if the index is out of range.
+
 // Output functions
 int reb_output_check(struct reb_simulation* r, double interval);
 void reb_output_timing(struct reb_simulation* r, const double tmax);
@@ -1046,15 +1534,71 @@ void reb_output_ascii(struct reb_simulation* r, char* filename);
 void reb_output_binary_positions(struct reb_simulation* r, const char* filename);
 void reb_output_velocity_dispersion(struct reb_simulation* r, char* filename);
 
+// Columns available in reb_output_columns(). Combine with bitwise or.
+enum REB_OUTPUT_COLUMN {
+    REB_OUTPUT_COLUMN_HASH  = 1<<0,    // uint32_t, all other columns are double
+    REB_OUTPUT_COLUMN_X     = 1<<1,
+    REB_OUTPUT_COLUMN_Y     = 1<<2,
+    REB_OUTPUT_COLUMN_Z     = 1<<3,
+    REB_OUTPUT_COLUMN_VX    = 1<<4,
+    REB_OUTPUT_COLUMN_VY    = 1<<5,
+    REB_OUTPUT_COLUMN_VZ    = 1<<6,
+    REB_OUTPUT_COLUMN_M     = 1<<7,
+    REB_OUTPUT_COLUMN_R     = 1<<8,
+    REB_OUTPUT_COLUMN_A     = 1<<9,    // Orbital elements are Jacobi elements as in reb_output_orbits().
+    REB_OUTPUT_COLUMN_E     = 1<<10,   // They are NaN for the particle with index 0.
+    REB_OUTPUT_COLUMN_INC   = 1<<11,
+    REB_OUTPUT_COLUMN_OMEGA = 1<<12,   // Longitude of ascending node
+    REB_OUTPUT_COLUMN_POMEGA= 1<<13,   // Argument of pericenter (omega)
+    REB_OUTPUT_COLUMN_L     = 1<<14,   // Mean longitude
+    REB_OUTPUT_COLUMN_F     = 1<<15,   // True anomaly
+};
+#define REB_OUTPUT_COLUMNS_MAGIC 0x4C4F4352 // Corresponds to RCOL
+// Header of one output in a file written by reb_output_columns(). It is followed by 
+// one array of N values for each column in the bitmask, in the order of enum REB_OUTPUT_COLUMN.
+struct reb_output_columns_header {
+    uint32_t magic;         // REB_OUTPUT_COLUMNS_MAGIC
+    uint32_t columns;       // Bitmask of enum REB_OUTPUT_COLUMN
+    uint64_t N;             // Number of values per column
+    double t;               // Simulation time
+};
+// Appends one output with the selected columns of all particles to a binary file.
+void reb_output_columns(struct reb_simulation* r, const char* filename, unsigned int columns);
+
+// Formats for reb_output_positions_quantized().
+enum REB_OUTPUT_QUANTIZED {
+    REB_OUTPUT_QUANTIZED_FLOAT32 = 0,   // Positions as 32 bit floats.
+    REB_OUTPUT_QUANTIZED_UINT16 = 1,    // Positions as 16 bit integers relative to the bounding box of all written particles.
+};
+#define REB_OUTPUT_QUANTIZED_MAGIC 0x5A514252 // Corresponds to RBQZ
+// Header of one frame in a file written by reb_output_positions_quantized(). It is followed by 
+// N uint32_t hashes (if hashes is 1) and then by x, y, z of each particle, interleaved.
+struct reb_output_quantized_header {
+    uint32_t magic;         // REB_OUTPUT_QUANTIZED_MAGIC
+    uint32_t format;        // enum REB_OUTPUT_QUANTIZED
+    uint64_t N;             // Number of particles in this frame
+    uint32_t hashes;        // 1 if hashes are included
+    uint32_t stride;        // Only every stride-th particle is included
+    double t;               // Simulation time
+    double min[3];          // Bounding box. A uint16 value q corresponds to min+q/65535*(max-min).
+    double max[3];
+};
+// Queues one frame with low precision positions for a background thread which appends it to a file or named pipe. 
+// Never waits for the output. If the previous frame has not been written yet, it is replaced by the new one.
+void reb_output_positions_quantized(struct reb_simulation* r, const char* filename, enum REB_OUTPUT_QUANTIZED format, int stride, int hashes);
+// Writes the last queued frame and stops the background thread. Called automatically when the simulation is freed.
+void reb_output_positions_quantized_close(struct reb_simulation* r);
+
 // Compares two simulations, stores difference in buffer.
 void reb_binary_diff(char* buf1, size_t size1, char* buf2, size_t size2, char** bufp, size_t* sizep); 
 // Same as reb_binary_diff, but with options.
-// output_option If set to 0, the differences are written to bufp. If set to 1, printed on the screen. If set to 2, then only the return value indicates any differences.
+// output_option If set to 0, the differences are written to bufp. If set to 1, printed on the screen. If set to 2, then only the return value indicates any differences. If set to 3, same as 0 but changed particle fields are XOR encoded against buf1 and compressed.
 // returns 0 is returned if the simulations do not differ (are equal). 1 is return if they differ.
 int reb_binary_diff_with_options(char* buf1, size_t size1, char* buf2, size_t size2, char** bufp, size_t* sizep, int output_option);
 
 // Input functions
 struct reb_simulation* reb_create_simulation_from_binary(char* filename);
+struct reb_simulation* reb_create_simulation_from_binary_with_skip(char* filename, unsigned int skip);
 
 // Possible errors that might occur during binary file reading.
 enum reb_input_binary_messages {
@@ -1071,8 +1615,18 @@ enum reb_input_binary_messages {
     REB_INPUT_BINARY_WARNING_CORRUPTFILE = 512,
 };
 
+// Groups of binary fields that can be skipped when reading a simulation.
+// Skipped integrator state is rebuilt from the particles on the next step.
+enum REB_INPUT_SKIP {
+    REB_INPUT_SKIP_NONE = 0,
+    REB_INPUT_SKIP_IAS15 = 1<<0,    // IAS15 predictor/corrector arrays
+    REB_INPUT_SKIP_TES = 1<<1,      // TES state, UVARS, RADAU and DHEM arrays
+};
+
 // ODE functions
 struct reb_ode* reb_create_ode(struct reb_simulation* r, unsigned int length);
+// Creates one ODE which holds N identical systems with length components each. The derivatives function is called once for all systems.
+struct reb_ode* reb_create_ode_batch(struct reb_simulation* r, unsigned int length, unsigned int N);
 void reb_free_ode(struct reb_ode* ode);
 
 // Miscellaneous functions
@@ -1081,6 +1635,9 @@ double reb_tools_mod2pi(double f);
 double reb_tools_M_to_f(double e, double M); // True anomaly for a given eccentricity and mean anomaly
 double reb_tools_E_to_f(double e, double M); // True anomaly for a given eccentricity and eccentric anomaly
 double reb_tools_M_to_E(double e, double M); // Eccentric anomaly for a given eccentricity and mean anomaly
+// Batch versions of the above for N orbits. Faster than calling the scalar functions N times. Parallelized with OpenMP and vectorized.
+void reb_tools_M_to_E_batch(const int N, const double* const e, const double* const M, double* const E);
+void reb_tools_M_to_f_batch(const int N, const double* const e, const double* const M, double* const f);
 void reb_tools_init_plummer(struct reb_simulation* r, int _N, double M, double R); // This function sets up a Plummer sphere, N=number of particles, M=total mass, R=characteristic radius
 void reb_run_heartbeat(struct reb_simulation* const r);  // used internally
 
@@ -1092,24 +1649,52 @@ void reb_tools_xyz_to_spherical(struct reb_vec3d const xyz, double* mag, double*
 // Functions to add and initialize particles
 struct reb_particle reb_particle_nan(void); // Returns a reb_particle structure with fields/hash/ptrs initialized to nan/0/NULL. 
 void reb_add(struct reb_simulation* const r, struct reb_particle pt);
+void reb_add_many(struct reb_simulation* const r, const struct reb_particle* const particles, const int N); // Adds N particles at once, growing the particle array only once.
+void reb_reserve(struct reb_simulation* const r, const int N); // Preallocates memory for at least N particles.
 void reb_add_fmt(struct reb_simulation* r, const char* fmt, ...);
 struct reb_particle reb_particle_new(struct reb_simulation* r, const char* fmt, ...);    // Same as reb_add_fmt() but returns the particle instead of adding it to the simualtion.
 struct reb_particle reb_tools_orbit_to_particle_err(double G, struct reb_particle primary, double m, double a, double e, double i, double Omega, double omega, double f, int* err);
 struct reb_particle reb_tools_orbit_to_particle(double G, struct reb_particle primary, double m, double a, double e, double i, double Omega, double omega, double f);
+// Batch version of the above. Element arrays have length N. Arrays other than a can be NULL in which case 0 is used.
+// If f is NULL, the true anomalies are calculated from the mean anomalies M with reb_tools_M_to_f_batch().
+// primaries has length N_primaries which is either N or 1 (shared primary). err can be NULL, otherwise err[i] is 0 on success. 
+void reb_tools_orbits_to_particles_err(double G, const struct reb_particle* const primaries, const int N_primaries, const int N, const double* const m, const double* const a, const double* const e, const double* const inc, const double* const Omega, const double* const omega, const double* const f, const double* const M, struct reb_particle* const particles, int* const err);
 struct reb_particle reb_tools_pal_to_particle(double G, struct reb_particle primary, double m, double a, double lambda, double k, double h, double ix, double iy);
 
 // Functions to access and remove particles
 void reb_remove_all(struct reb_simulation* const r);
 int reb_remove(struct reb_simulation* const r, int index, int keepSorted);
 int reb_remove_by_hash(struct reb_simulation* const r, uint32_t hash, int keepSorted);
+// Remove N_indices particles at once. Indices refer to the particle array before the removal and must be unique. 
+// The particle array and the integrators' internal arrays are only compacted once. Returns 1 on success and 0 (without removing any particle) otherwise.
+int reb_remove_many(struct reb_simulation* const r, const int* const indices, const int N_indices, int keepSorted);
+// Frozen test particles keep their index, position and velocity, but are skipped by the integrators and the gravity 
+// routines, and do not collide. They can be removed later all at once with reb_remove_frozen(). 
+// Only test particles (index >= N_active) can be frozen. Not supported with trees, MPI, variational particles, and MERCURIUS. 
+// Returns 1 on success and 0 otherwise.
+int reb_freeze(struct reb_simulation* const r, int index);
+int reb_unfreeze(struct reb_simulation* const r, int index);
+// Removes all frozen particles, keeping the order of the other particles. Returns the number of removed particles.
+int reb_remove_frozen(struct reb_simulation* const r);
+// Source and sink of test particles. reb_sink() removes a test particle. If frozen particles are supported, the particle 
+// becomes a frozen free slot instead and no other index changes. Returns 1 on success.
+// reb_inject() adds a test particle in the first free slot (or at the end if there is none) and returns its index.
+int reb_sink(struct reb_simulation* const r, int index);
+int reb_inject(struct reb_simulation* const r, struct reb_particle pt);
+int reb_remove_by_hash_many(struct reb_simulation* const r, const uint32_t* const hashes, const int N_hashes, int keepSorted);
 struct reb_particle* reb_get_particle_by_hash(struct reb_simulation* const r, uint32_t hash);
 struct reb_particle reb_get_remote_particle_by_hash(struct reb_simulation* const r, uint32_t hash);
+void reb_sort_particles_spatially(struct reb_simulation* const r); // Sorts particles along a Morton curve to improve cache locality. Only test particles are sorted if N_active is set.
 int reb_get_particle_index(struct reb_particle* p); // Returns a particle's index in the simulation it's in. Needs to be in the simulation its sim pointer is pointing to. Otherwise -1 returned.
 struct reb_particle reb_get_jacobi_com(struct reb_particle* p); // Returns the Jacobi center of mass for a given particle. Used by python. Particle needs to be in a simulation.
 
 // Orbit calculation
 struct reb_orbit reb_tools_particle_to_orbit_err(double G, struct reb_particle p, struct reb_particle primary, int* err);
 struct reb_orbit reb_tools_particle_to_orbit(double G, struct reb_particle p, struct reb_particle primary);
+// Batch versions of the above. Particle i uses primaries[i] if N_primaries==N, or a shared primary primaries[0] if N_primaries==1.
+// If primaries is NULL, the Jacobi center of mass of all previous particles is used (orbits[0] is then NaN). 
+// err can be NULL, otherwise err[i] contains the error code for particle i (0 on success). Parallelized with OpenMP.
+void reb_tools_particles_to_orbits_err(double G, const struct reb_particle* const particles, const struct reb_particle* const primaries, const int N_primaries, const int N, struct reb_orbit* const orbits, int* const err);
 
 // Chaos indicators
 void reb_tools_megno_init(struct reb_simulation* const r);
@@ -1253,7 +1838,13 @@ void reb_move_to_hel(struct reb_simulation* const r);
 void reb_move_to_com(struct reb_simulation* const r);
 
 // Diangnostic functions
-double reb_tools_energy(const struct reb_simulation* const r);
+double reb_tools_energy(const struct reb_simulation* const r);    // Parallelized with OpenMP, uses compensated summation.
+// Approximate energy using the moments of the tree and opening_angle2 in the same way as REB_GRAVITY_TREE. All particles are treated as active. 
+// Requires a tree (REB_GRAVITY_TREE or REB_COLLISION_TREE), falls back to reb_tools_energy() otherwise. Intended for monitoring large simulations.
+double reb_tools_energy_tree(struct reb_simulation* const r);
+// Contribution of the particles with the given indices to reb_tools_energy() (kinetic energy and all potential energy terms involving them, without energy_offset).
+// The cost is O(N_indices*N_active) for test particles. Call before removing particles to update energy_offset.
+double reb_tools_energy_particles(const struct reb_simulation* const r, const int* const indices, const int N_indices);
 struct reb_vec3d reb_tools_angular_momentum(const struct reb_simulation* const r);
 struct reb_particle reb_get_com(struct reb_simulation* r);
 struct reb_particle reb_get_com_of_pair(struct reb_particle p1, struct reb_particle p2);
@@ -1284,16 +1875,47 @@ struct reb_simulationarchive{
     long nblobs;                 // Total number of snapshots (including initial binary)
     uint64_t* offset64;            // Index of offsets in file (length nblobs)
     double* t;                   // Index of simulation times in file (length nblobs)
+    char* mmap_data;             // Read-only memory map of the file (NULL if file could not be mapped)
+    size_t mmap_size;            // Size of the memory map in bytes
 };
 struct reb_simulation* reb_create_simulation_from_simulationarchive(struct reb_simulationarchive* sa, long snapshot);
 void reb_create_simulation_from_simulationarchive_with_messages(struct reb_simulation* r, struct reb_simulationarchive* sa, long snapshot, enum reb_input_binary_messages* warnings);
+void reb_create_simulation_from_simulationarchive_with_skip(struct reb_simulation* r, struct reb_simulationarchive* sa, long snapshot, unsigned int skip, enum reb_input_binary_messages* warnings);
 struct reb_simulationarchive* reb_open_simulationarchive(const char* filename);
 void reb_close_simulationarchive(struct reb_simulationarchive* sa);
 void reb_simulationarchive_snapshot(struct reb_simulation* r, const char* filename);
 void reb_simulationarchive_automate_interval(struct reb_simulation* const r, const char* filename, double interval);
 void reb_simulationarchive_automate_walltime(struct reb_simulation* const r, const char* filename, double walltime);
 void reb_simulationarchive_automate_step(struct reb_simulation* const r, const char* filename, unsigned long long step);
+void reb_simulationarchive_flush(struct reb_simulation* const r); // Waits until all asynchronous snapshots have been written.
 void reb_free_simulationarchive_pointers(struct reb_simulationarchive* sa);
+// Quantities which can be extracted with reb_simulationarchive_extract().
+// Orbital elements are calculated in Jacobi coordinates, the same as the default of particle.orbit() in python.
+enum REB_SA_FIELD {
+    REB_SA_FIELD_X = 0,
+    REB_SA_FIELD_Y = 1,
+    REB_SA_FIELD_Z = 2,
+    REB_SA_FIELD_VX = 3,
+    REB_SA_FIELD_VY = 4,
+    REB_SA_FIELD_VZ = 5,
+    REB_SA_FIELD_MASS = 6,
+    REB_SA_FIELD_RADIUS = 7,
+    REB_SA_FIELD_A = 8,         // Semi-major axis. This and all following fields are orbital elements.
+    REB_SA_FIELD_E = 9,         // Eccentricity
+    REB_SA_FIELD_INC = 10,      // Inclination
+    REB_SA_FIELD_OMEGA = 11,    // Longitude of the ascending node
+    REB_SA_FIELD_ARGPERI = 12,  // Argument of pericenter
+    REB_SA_FIELD_F = 13,        // True anomaly
+    REB_SA_FIELD_MEANANOM = 14, // Mean anomaly
+    REB_SA_FIELD_P = 15,        // Orbital period
+};
+// Extracts N_fields quantities of N_particles particles from the N_snapshots snapshots starting at first (negative values count from the end).
+// Particles are identified by their hashes, or by their index if hashes is NULL. The values are stored in out[(k*N_particles+j)*N_fields+f] 
+// for the k-th snapshot, j-th particle and f-th field. Particles which do not exist in a snapshot are NaN. Orbital elements of particle 0 are NaN.
+// Snapshots are decoded directly from the archive without creating simulations, using N_threads threads (N_threads<=0 uses all cores).
+// Compact test particles are not included. Requires version 2 or higher. Returns the number of snapshots which could not be decoded
+// (their values are NaN), or -1 if the arguments are invalid or the archive cannot be read.
+int reb_simulationarchive_extract(struct reb_simulationarchive* sa, long first, const long N_snapshots, const uint32_t* hashes, const int N_particles, const enum REB_SA_FIELD* fields, const int N_fields, double* out, int N_threads);
 
 
 // Functions to convert between coordinate systems
@@ -1346,6 +1968,10 @@ void reb_rotation_to_orbital(struct reb_rotation q, double* Omega, double* inc,
 #ifdef MPI
 void reb_mpi_init(struct reb_simulation* const r);
 void reb_mpi_finalize(struct reb_simulation* const r);
+// Collective checkpoint. All nodes write their particles into one shared binary file using MPI-IO.
+void reb_output_binary_mpi(struct reb_simulation* r, const char* filename);
+// Collective restart from a binary file. Initializes MPI and distributes the particles to the nodes owning their root boxes.
+struct reb_simulation* reb_create_simulation_from_binary_mpi(char* filename);
 #endif // MPI
 
 #ifdef OPENMP
@@ -1367,22 +1993,47 @@ struct reb_orbit_opengl {
     float a, e, f;
     float omega, Omega, inc;
 };
+// Used by the display to decide if the orbital elements of a particle need to be recalculated.
+struct reb_orbit_invariants {
+    double hx, hy, hz;          // Specific angular momentum.
+    double ex, ey, ez;          // Eccentricity vector.
+    double E;                   // Specific energy.
+    double Px, Py, Pz;          // Unit vector towards pericenter.
+    double Qx, Qy, Qz;          // Unit vector perpendicular to P in the orbital plane.
+};
+
+// Copy of the simulation taken by the simulation thread for the visualization.
+struct reb_display_snapshot {
+    struct reb_simulation r;            // Only particles and ri_whfast.p_jh point to data owned by the snapshot.
+    struct reb_particle* particles;     // Every display_stride-th particle.
+    struct reb_particle* p_jh;          // Jacobi coordinates if WHFast was not synchronized.
+    unsigned long allocated_N;
+    unsigned long allocated_N_whfast;
+};
 
 struct reb_display_data {
     struct reb_simulation* r;
-    struct reb_simulation* r_copy;
+    struct reb_simulation* r_copy;  // Snapshot currently shown, owned by the display thread.
     struct reb_particle_opengl* particle_data;
     struct reb_orbit_opengl* orbit_data;
-    struct reb_particle* particles_copy;
-    struct reb_particle* p_jh_copy;
     unsigned long allocated_N;
-    unsigned long allocated_N_whfast;
     unsigned int opengl_enabled;
     double scale;
     double mouse_x;
     double mouse_y;
     double retina;
-    pthread_mutex_t mutex;          // Mutex to guarantee non-flickering
+    // Triple buffer. The simulation thread writes into snapshots[snapshot_write] and publishes it by 
+    // exchanging it with snapshot_ready. The display thread picks it up by exchanging snapshot_ready 
+    // with snapshot_read. Both exchanges are atomic, neither thread ever waits for the other.
+    struct reb_display_snapshot snapshots[3];
+    int snapshot_write;             // Owned by the simulation thread.
+    int snapshot_ready;             // Index of the latest snapshot, plus REB_DISPLAY_SNAPSHOT_FRESH if not yet picked up.
+    int snapshot_read;              // Owned by the display thread.
+    int prepared;                   // 1 if particle_data is up to date with r_copy.
+    int prepared_orbits;            // 1 if orbit_data is up to date with r_copy.
+    struct reb_orbit_invariants* orbit_invariants;  // Invariants of the orbits when their elements were last calculated.
+    unsigned long allocated_N_orbit_invariants;
+    int N_orbit_invariants;         // Number of valid entries in orbit_invariants.
     int spheres;                    // Switches between point sprite and real spheres.
     int pause;                      // Pauses visualization, but keep simulation running
     int wire;                       // Shows/hides orbit wires.
@@ -1419,7 +2070,8 @@ struct reb_display_data {
     unsigned int orbit_shader_mvp_location;
     unsigned int orbit_shader_program;
     unsigned int orbit_shader_particle_vao;
-    unsigned int orbit_shader_vertex_count;
+    unsigned int orbit_shader_vertex_count;         // Vertices per orbit. Reduced for large N.
+    unsigned int orbit_shader_vertex_count_location;
 };
 
 
@@ -31,6 +31,8 @@
 #include <sys/time.h>
 #include <sys/stat.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include "particle.h"
 #include "rebound.h"
 #include "binarydiff.h"
@@ -39,9 +41,44 @@
 #include "input.h"
 #include "output.h"
 #include "integrator_ias15.h"
+#include "profiling.h"
+#include "compact.h"
 
+#define MIN(a, b) ((a) > (b) ? (b) : (a))    ///< Returns the minimum of a and b
+#define MAX(a, b) ((a) > (b) ? (a) : (b))    ///< Returns the maximum of a and b
+
+// Partial snapshots only contain the first N_active particles. The test particles
+// are added from the last full snapshot, i.e. they correspond to an earlier time.
+static void reb_simulationarchive_add_testparticles(struct reb_simulation* r, struct reb_simulationarchive* sa, long snapshot, unsigned int skip, enum reb_input_binary_messages* warnings){
+    if (r->simulationarchive_full_every<=1 || r->simulationarchive_full_t==r->t){
+        return; // Full snapshot
+    }
+    long full = snapshot-1;
+    while (full>=0 && sa->t[full]!=r->simulationarchive_full_t){
+        full--;
+    }
+    if (full<0){
+        *warnings |= REB_INPUT_BINARY_WARNING_CORRUPTFILE;
+        return;
+    }
+    struct reb_simulation* rf = reb_create_simulation();
+    reb_create_simulation_from_simulationarchive_with_skip(rf, sa, full, skip, warnings);
+    const int N_active = rf->N_active<0?rf->N:rf->N_active;
+    for (int i=N_active; i<rf->N; i++){
+        reb_add(r, rf->particles[i]);
+    }
+    if (rf->compact.N){
+        reb_compact_free(&r->compact);
+        reb_compact_copy(&r->compact, &rf->compact);
+    }
+    reb_free_simulation(rf);
+}
 
 void reb_create_simulation_from_simulationarchive_with_messages(struct reb_simulation* r, struct reb_simulationarchive* sa, long snapshot, enum reb_input_binary_messages* warnings){
+    reb_create_simulation_from_simulationarchive_with_skip(r, sa, snapshot, REB_INPUT_SKIP_NONE, warnings);
+}
+
+void reb_create_simulation_from_simulationarchive_with_skip(struct reb_simulation* r, struct reb_simulationarchive* sa, long snapshot, unsigned int skip, enum reb_input_binary_messages* warnings){
     FILE* inf = sa->inf;
     if (inf == NULL){
         *warnings |= REB_INPUT_BINARY_ERROR_FILENOTOPEN;
@@ -63,12 +100,25 @@ void reb_create_simulation_from_simulationarchive_with_messages(struct reb_simul
     // Set to old version by default. Will be overwritten if new version was used.
     r->simulationarchive_version = 0;
 
-    fseek(inf, 0, SEEK_SET);
-    while(reb_input_field(r, inf, warnings,NULL)){ }
+    if (sa->mmap_data){
+        // Parse fields directly from the memory map.
+        char* mem_stream = sa->mmap_data;
+        while(reb_input_field_with_skip(r, NULL, warnings, &mem_stream, skip)){ }
+    }else{
+        fseek(inf, 0, SEEK_SET);
+        while(reb_input_field_with_skip(r, inf, warnings, NULL, skip)){ }
+    }
 
     // Done?
     if (snapshot==0) return;
 
+    if (r->simulationarchive_version>=2 && sa->mmap_data){
+        char* mem_stream = sa->mmap_data + sa->offset64[snapshot];
+        while(reb_input_field_with_skip(r, NULL, warnings, &mem_stream, skip)){ }
+        reb_simulationarchive_add_testparticles(r, sa, snapshot, skip, warnings);
+        return;
+    }
+
     // Read SA snapshot
     if(fseek(inf, sa->offset64[snapshot], SEEK_SET)){
         *warnings |= REB_INPUT_BINARY_ERROR_SEEK;
@@ -217,7 +267,8 @@ void reb_create_simulation_from_simulationarchive_with_messages(struct reb_simul
         }
     }else{
         // Version 2 or higher
-        while(reb_input_field(r, inf, warnings,NULL)){ }
+        while(reb_input_field_with_skip(r, inf, warnings, NULL, skip)){ }
+        reb_simulationarchive_add_testparticles(r, sa, snapshot, skip, warnings);
     }
     return;
 }
@@ -232,13 +283,122 @@ struct reb_simulation* reb_create_simulation_from_simulationarchive(struct reb_s
     return r; // might be null if error occured
 }
 
+// Reads size bytes at offset pos of the archive. Uses the memory map if available. Returns 1 on success.
+static int reb_simulationarchive_read_at(struct reb_simulationarchive* sa, const uint64_t pos, void* ptr, const size_t size){
+    if (sa->mmap_data){
+        if (pos+size > sa->mmap_size){
+            return 0;
+        }
+        memcpy(ptr, sa->mmap_data+pos, size);
+        return 1;
+    }
+    if (fseek(sa->inf, pos, SEEK_SET)){
+        return 0;
+    }
+    return fread(ptr, size, 1, sa->inf)==1;
+}
+
+static void reb_simulationarchive_unmap(struct reb_simulationarchive* sa){
+    if (sa->mmap_data){
+        munmap(sa->mmap_data, sa->mmap_size);
+    }
+    sa->mmap_data = NULL;
+    sa->mmap_size = 0;
+}
+
+// Index file. Written next to version 3 archives so that they can be opened without 
+// scanning all snapshots. Contains a header followed by one entry per snapshot.
+#define REB_SIMULATIONARCHIVE_INDEX_MAGIC "REBOUND SA Index"
+
+struct reb_simulationarchive_index_header {
+    char magic[16];
+    uint64_t size_archive;  // Size of the archive when the index was last updated
+    uint64_t nblobs;        // Number of entries
+};
+
+struct reb_simulationarchive_index_entry {
+    uint64_t offset;        // Offset of the snapshot in the archive
+    double t;               // Simulation time of the snapshot
+};
+
+static char* reb_simulationarchive_index_filename(const char* filename){
+    char* filename_index = malloc(strlen(filename)+strlen(".index")+1);
+    sprintf(filename_index, "%s.index", filename);
+    return filename_index;
+}
+
+// Loads offsets and times from the index file. Returns 1 on success, 0 if the index 
+// is missing or does not match the archive. 
+static int reb_simulationarchive_index_read(struct reb_simulationarchive* sa){
+    struct stat file_stat;
+    if (fstat(fileno(sa->inf), &file_stat)){
+        return 0;
+    }
+    const uint64_t size_archive = file_stat.st_size;
+    char* filename_index = reb_simulationarchive_index_filename(sa->filename);
+    FILE* inf = fopen(filename_index, "rb");
+    free(filename_index);
+    if (inf==NULL){
+        return 0;
+    }
+    struct reb_simulationarchive_index_header header;
+    if (fread(&header, sizeof(header), 1, inf)!=1
+            || memcmp(header.magic, REB_SIMULATIONARCHIVE_INDEX_MAGIC, sizeof(header.magic))!=0
+            || header.size_archive!=size_archive
+            || header.nblobs==0 
+            || header.nblobs>size_archive/sizeof(struct reb_simulationarchive_blob)){
+        fclose(inf);
+        return 0;
+    }
+    const long nblobs = header.nblobs;
+    struct reb_simulationarchive_index_entry* entries = malloc(sizeof(struct reb_simulationarchive_index_entry)*nblobs);
+    int valid = fread(entries, sizeof(struct reb_simulationarchive_index_entry), nblobs, inf)==(size_t)nblobs;
+    fclose(inf);
+    valid = valid && entries[0].offset==0;
+    for (long i=1; i<nblobs && valid; i++){
+        valid = entries[i].offset>entries[i-1].offset && entries[i].offset<size_archive;
+    }
+    // The archive ends with the blob following the last snapshot.
+    struct reb_simulationarchive_blob blob = {0};
+    valid = valid && reb_simulationarchive_read_at(sa, size_archive-sizeof(struct reb_simulationarchive_blob), &blob, sizeof(struct reb_simulationarchive_blob));
+    valid = valid && blob.index==nblobs-1 && blob.offset_next==0;
+    if (valid && nblobs>1){
+        valid = entries[nblobs-1].offset + blob.offset_prev + sizeof(struct reb_simulationarchive_blob) == size_archive;
+    }
+    if (!valid){
+        free(entries);
+        return 0;
+    }
+    sa->nblobs = nblobs;
+    sa->t = malloc(sizeof(double)*nblobs);
+    sa->offset64 = malloc(sizeof(uint64_t)*nblobs);
+    for (long i=0; i<nblobs; i++){
+        sa->offset64[i] = entries[i].offset;
+        sa->t[i] = entries[i].t;
+    }
+    free(entries);
+    return 1;
+}
+
 void reb_read_simulationarchive_with_messages(struct reb_simulationarchive* sa, const char* filename,  struct reb_simulationarchive* sa_index, enum reb_input_binary_messages* warnings){
     const int debug = 0;
+    sa->mmap_data = NULL;
+    sa->mmap_size = 0;
     sa->inf = fopen(filename,"r");
     if (sa->inf==NULL){
         *warnings |= REB_INPUT_BINARY_ERROR_NOFILE;
         return;
     }
+    // Map the file into memory. Snapshots are then parsed directly from the 
+    // page cache. Falls back to reading the file if mapping fails.
+    struct stat file_stat;
+    if (fstat(fileno(sa->inf), &file_stat)==0 && file_stat.st_size>0){
+        void* data = mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, fileno(sa->inf), 0);
+        if (data!=MAP_FAILED){
+            sa->mmap_data = data;
+            sa->mmap_size = file_stat.st_size;
+        }
+    }
     sa->filename = malloc(strlen(filename)+1);
     strcpy(sa->filename,filename);
     
@@ -302,6 +462,7 @@ void reb_read_simulationarchive_with_messages(struct reb_simulationarchive* sa,
     if (sa->version<2){
         // Old version
         if (sa->size_first==-1 || sa->size_snapshot==-1){
+            reb_simulationarchive_unmap(sa);
             free(sa->filename);
             fclose(sa->inf);
             *warnings |= REB_INPUT_BINARY_ERROR_OUTOFRANGE;
@@ -323,37 +484,37 @@ void reb_read_simulationarchive_with_messages(struct reb_simulationarchive* sa,
         // New version
         if (debug) printf("=============\n");
         if (debug) printf("SA Version: 2\n");
-        if (sa_index == NULL){ // Need to construct offset index from file.
+        if (sa_index == NULL && sa->version>=3 && reb_simulationarchive_index_read(sa)){
+            // Offsets and times loaded from index file.
+            if (debug) printf("SA Index loaded from file.\n");
+        }else if (sa_index == NULL){ // Need to construct offset index from file.
             long nblobsmax = 1024;
             sa->t = malloc(sizeof(double)*nblobsmax);
             sa->offset64 = malloc(sizeof(uint64_t)*nblobsmax);
-            fseek(sa->inf, 0, SEEK_SET);  
             sa->nblobs = 0;
             int read_error = 0;
+            uint64_t pos = 0; // Current position in file
             for(long i=0;i<nblobsmax;i++){
                 struct reb_binary_field field = {0};
-                sa->offset64[i] = ftell(sa->inf);
+                sa->offset64[i] = pos;
                 int blob_finished = 0;
                 do{
-                    size_t r1 = fread(&field,sizeof(struct reb_binary_field),1,sa->inf);
-                    if (r1==1){
+                    if (reb_simulationarchive_read_at(sa, pos, &field, sizeof(struct reb_binary_field))){
+                        pos += sizeof(struct reb_binary_field);
                         switch (field.type){
                             case REB_BINARY_FIELD_TYPE_HEADER:
                                 {
                                     if (debug) printf("SA Field. type=HEADER\n");
-                                    int s1 = fseek(sa->inf,64 - sizeof(struct reb_binary_field),SEEK_CUR);
-                                    if (s1){
-                                        read_error = 1;
-                                    }
+                                    pos += 64 - sizeof(struct reb_binary_field);
                                 }
                                 break;
                             case REB_BINARY_FIELD_TYPE_T:
                                 {
-                                    size_t r2 = fread(&(sa->t[i]), sizeof(double),1,sa->inf);
-                                    if (debug) printf("SA Field. type=TIME      value=%.10f\n",sa->t[1]);
-                                    if (r2!=1){
+                                    if (!reb_simulationarchive_read_at(sa, pos, &(sa->t[i]), sizeof(double))){
                                         read_error = 1;
                                     }
+                                    pos += sizeof(double);
+                                    if (debug) printf("SA Field. type=TIME      value=%.10f\n",sa->t[i]);
                                 }
                                 break;
                             case REB_BINARY_FIELD_TYPE_END:
@@ -364,11 +525,8 @@ void reb_read_simulationarchive_with_messages(struct reb_simulationarchive* sa,
                                 break;
                             default:
                                 {
-                                    int s2 = fseek(sa->inf,field.size,SEEK_CUR);
+                                    pos += field.size;
                                     if (debug) printf("SA Field. type=%-6d    size=%llu\n",field.type,(unsigned long long)field.size);
-                                    if (s2){
-                                        read_error = 1;
-                                    }
                                 }
                                 break;
                         }
@@ -382,70 +540,61 @@ void reb_read_simulationarchive_with_messages(struct reb_simulationarchive* sa,
                     break;
                 }
                 // Everything looks normal so far. Attempt to read next blob
+                int16_t offset_prev16 = 0;
+                int16_t offset_next16 = 0;
+                struct reb_simulationarchive_blob blob = {0};
                 if (sa->version<3) { // will be removed in a future release
-                    struct reb_simulationarchive_blob16 blob = {0};
-                    size_t r3 = fread(&blob, sizeof(struct reb_simulationarchive_blob16), 1, sa->inf);
-                    if (r3!=1){ // Next snapshot is definitly corrupted. Assume current might also be.
+                    struct reb_simulationarchive_blob16 blob16 = {0};
+                    if (!reb_simulationarchive_read_at(sa, pos, &blob16, sizeof(struct reb_simulationarchive_blob16))){
+                        // Next snapshot is definitly corrupted. Assume current might also be.
                         if (debug) printf("SA Error. Error while reading next blob.\n");
                         read_error = 1;
                         break;
                     }
-                    if (i>0){
-                        // Checking the offsets. Acts like a checksum.
-                        if (((long)blob.offset_prev) + ((long)sizeof(struct reb_simulationarchive_blob16)) != ftell(sa->inf) - ((long)sa->offset64[i]) ){
-                            // Offsets don't work. Next snapshot is definitly corrupted. Assume current one as well.
-                            if (debug) printf("SA Error. Offset mismatch: %lu != %ld.\n",blob.offset_prev + sizeof(struct reb_simulationarchive_blob16), (long unsigned int)(ftell(sa->inf) - sa->offset64[i]) );
-                            read_error = 1;
-                            break;
-                        }
-                    }
-                    // All tests passed. Accept current snapshot. Increase blob count.
-                    sa->nblobs = i+1;
-                    if (blob.offset_next==0){
-                        // Last blob. 
-                        if (debug) printf("SA Reached final blob.\n");
+                    pos += sizeof(struct reb_simulationarchive_blob16);
+                    offset_prev16 = blob16.offset_prev;
+                    offset_next16 = blob16.offset_next;
+                    blob.offset_prev = offset_prev16;
+                    blob.offset_next = offset_next16;
+                    if (i>0 && ((long)offset_prev16) + ((long)sizeof(struct reb_simulationarchive_blob16)) != (long)(pos - sa->offset64[i])){
+                        // Offsets don't work. Next snapshot is definitly corrupted. Assume current one as well.
+                        if (debug) printf("SA Error. Offset mismatch.\n");
+                        read_error = 1;
                         break;
                     }
-                    if (i==nblobsmax-1){ // Increase 
-                        nblobsmax += 1024;
-                        sa->t = realloc(sa->t,sizeof(double)*nblobsmax);
-                        sa->offset64 = realloc(sa->offset64,sizeof(uint64_t)*nblobsmax);
-                    }
                 }else{
-                    struct reb_simulationarchive_blob blob = {0};
-                    size_t r3 = fread(&blob, sizeof(struct reb_simulationarchive_blob), 1, sa->inf);
-                    if (r3!=1){ // Next snapshot is definitly corrupted. Assume current might also be.
+                    if (!reb_simulationarchive_read_at(sa, pos, &blob, sizeof(struct reb_simulationarchive_blob))){
+                        // Next snapshot is definitly corrupted. Assume current might also be.
                         if (debug) printf("SA Error. Error while reading next blob.\n");
                         read_error = 1;
                         break;
                     }
-                    if (i>0){
-                        // Checking the offsets. Acts like a checksum.
-                        if (((long)blob.offset_prev )+ ((long)sizeof(struct reb_simulationarchive_blob)) != ftell(sa->inf) - ((long)sa->offset64[i]) ){
-                            // Offsets don't work. Next snapshot is definitly corrupted. Assume current one as well.
-                            if (debug) printf("SA Error. Offset mismatch: %lu != %ld.\n",blob.offset_prev + sizeof(struct reb_simulationarchive_blob), (long unsigned int)(ftell(sa->inf) - sa->offset64[i]) );
-                            read_error = 1;
-                            break;
-                        }
-                    }
-                    // All tests passed. Accept current snapshot. Increase blob count.
-                    sa->nblobs = i+1;
-                    if (blob.offset_next==0){
-                        // Last blob. 
-                        if (debug) printf("SA Reached final blob.\n");
+                    pos += sizeof(struct reb_simulationarchive_blob);
+                    if (i>0 && ((long)blob.offset_prev) + ((long)sizeof(struct reb_simulationarchive_blob)) != (long)(pos - sa->offset64[i])){
+                        // Offsets don't work. Next snapshot is definitly corrupted. Assume current one as well.
+                        if (debug) printf("SA Error. Offset mismatch.\n");
+                        read_error = 1;
                         break;
                     }
-                    if (i==nblobsmax-1){ // Increase 
-                        nblobsmax += 1024;
-                        sa->t = realloc(sa->t,sizeof(double)*nblobsmax);
-                        sa->offset64 = realloc(sa->offset64,sizeof(uint64_t)*nblobsmax);
-                    }
+                }
+                // All tests passed. Accept current snapshot. Increase blob count.
+                sa->nblobs = i+1;
+                if (blob.offset_next==0){
+                    // Last blob. 
+                    if (debug) printf("SA Reached final blob.\n");
+                    break;
+                }
+                if (i==nblobsmax-1){ // Increase 
+                    nblobsmax += 1024;
+                    sa->t = realloc(sa->t,sizeof(double)*nblobsmax);
+                    sa->offset64 = realloc(sa->offset64,sizeof(uint64_t)*nblobsmax);
                 }
             }
             if (read_error){
                 if (sa->nblobs>0){
                     *warnings |= REB_INPUT_BINARY_WARNING_CORRUPTFILE;
                 }else{
+                    reb_simulationarchive_unmap(sa);
                     fclose(sa->inf);
                     free(sa->filename);
                     free(sa->t);
@@ -460,6 +609,9 @@ void reb_read_simulationarchive_with_messages(struct reb_simulationarchive* sa,
             // This is an optimzation for loading many large SAs.
             // It assumes the structure of this SA is *exactly* the same as in sa_index.
             // Unexpected behaviour if the shape is not the same.
+            // The offsets have not been verified for this file. Read snapshots with 
+            // fread() rather than parsing them from the memory map.
+            reb_simulationarchive_unmap(sa);
             sa->nblobs = sa_index->nblobs;
             sa->t = malloc(sizeof(double)*sa->nblobs);
             sa->offset64 = malloc(sizeof(uint64_t)*sa->nblobs);
@@ -492,6 +644,7 @@ void reb_close_simulationarchive(struct reb_simulationarchive* sa){
 
 void reb_free_simulationarchive_pointers(struct reb_simulationarchive* sa){
     if (sa==NULL) return;
+    reb_simulationarchive_unmap(sa);
     if (sa->inf){
         fclose(sa->inf);
     }
@@ -499,6 +652,359 @@ void reb_free_simulationarchive_pointers(struct reb_simulationarchive* sa){
     free(sa->t);
     free(sa->offset64);
 }
+
+// Particle data of one snapshot, decoded by reb_simulationarchive_extract() without creating a simulation.
+struct reb_simulationarchive_state {
+    double t;
+    double G;
+    int N;
+    int N_active;
+    unsigned int full_every;
+    double full_t;
+    int allocatedN;                     // Number of particles in particles, same as r->allocatedN after reading the PARTICLES field
+    struct reb_particle* particles;
+};
+
+// Same as reb_simulationarchive_read_at() but can be called from several threads at once. Returns 1 on success.
+static int reb_simulationarchive_pread(const struct reb_simulationarchive* sa, const uint64_t pos, void* ptr, const size_t size){
+    if (sa->mmap_data){
+        if (pos+size > sa->mmap_size){
+            return 0;
+        }
+        memcpy(ptr, sa->mmap_data+pos, size);
+        return 1;
+    }
+    return pread(fileno(sa->inf), ptr, size, pos)==(ssize_t)size;
+}
+
+// Applies the fields of the blob at pos to s. Only the fields needed to reconstruct the particles are read,
+// everything else is skipped. Returns 1 on success.
+static int reb_simulationarchive_state_read(const struct reb_simulationarchive* sa, uint64_t pos, struct reb_simulationarchive_state* s){
+    while (1){
+        struct reb_binary_field field;
+        if (!reb_simulationarchive_pread(sa, pos, &field, sizeof(struct reb_binary_field))){
+            return 0;
+        }
+        pos += sizeof(struct reb_binary_field);
+        int ok = 1;
+        switch (field.type){
+            case REB_BINARY_FIELD_TYPE_END:
+                return 1;
+            case REB_BINARY_FIELD_TYPE_HEADER:
+                // The header has a fixed size of 64 bytes, including the field.
+                field.size = 64 - sizeof(struct reb_binary_field);
+                break;
+            case REB_BINARY_FIELD_TYPE_T:
+                ok = reb_simulationarchive_pread(sa, pos, &s->t, sizeof(double));
+                break;
+            case REB_BINARY_FIELD_TYPE_G:
+                ok = reb_simulationarchive_pread(sa, pos, &s->G, sizeof(double));
+                break;
+            case REB_BINARY_FIELD_TYPE_N:
+                ok = reb_simulationarchive_pread(sa, pos, &s->N, sizeof(int));
+                break;
+            case REB_BINARY_FIELD_TYPE_NACTIVE:
+                ok = reb_simulationarchive_pread(sa, pos, &s->N_active, sizeof(int));
+                break;
+            case REB_BINARY_FIELD_TYPE_SAFULLEVERY:
+                ok = reb_simulationarchive_pread(sa, pos, &s->full_every, sizeof(unsigned int));
+                break;
+            case REB_BINARY_FIELD_TYPE_SAFULLT:
+                ok = reb_simulationarchive_pread(sa, pos, &s->full_t, sizeof(double));
+                break;
+            case REB_BINARY_FIELD_TYPE_PARTICLES:
+                s->allocatedN = (int)(field.size/sizeof(struct reb_particle));
+                s->particles = realloc(s->particles, field.size?field.size:sizeof(struct reb_particle));
+                ok = !field.size || reb_simulationarchive_pread(sa, pos, s->particles, field.size);
+                break;
+            case REB_BINARY_FIELD_TYPE_PARTICLES_XOR:
+                {
+                    // Encoded against the particles of the first snapshot, see reb_input_field().
+                    char* enc = malloc(field.size);
+                    const size_t size = s->allocatedN*sizeof(struct reb_particle);
+                    ok = reb_simulationarchive_pread(sa, pos, enc, field.size)
+                        && s->particles && reb_binary_xor_decode(enc, field.size, (char*)s->particles, size);
+                    free(enc);
+                }
+                break;
+        }
+        if (!ok){
+            return 0;
+        }
+        pos += field.size;
+    }
+}
+
+// Decodes snapshot into s, starting from the decoded first snapshot base. Partial snapshots are not completed. Returns 1 on success.
+static int reb_simulationarchive_state_decode(const struct reb_simulationarchive* sa, const struct reb_simulationarchive_state* base, const long snapshot, struct reb_simulationarchive_state* s){
+    struct reb_particle* particles = realloc(s->particles, sizeof(struct reb_particle)*(base->allocatedN?base->allocatedN:1));
+    *s = *base;
+    s->particles = particles;
+    memcpy(s->particles, base->particles, sizeof(struct reb_particle)*base->allocatedN);
+    if (snapshot>0 && !reb_simulationarchive_state_read(sa, sa->offset64[snapshot], s)){
+        return 0;
+    }
+    return s->N>=0 && s->N<=s->allocatedN;
+}
+
+#define REB_SIMULATIONARCHIVE_EXTRACT_CHUNK 16   ///< Number of consecutive snapshots decoded by a thread at once.
+
+struct reb_simulationarchive_extract_info {
+    const struct reb_simulationarchive* sa;
+    struct reb_simulationarchive_state base;    // Decoded first snapshot of the archive
+    long first;
+    long N_snapshots;
+    const uint32_t* hashes;
+    int N_particles;
+    const int* table;                           // Open addressing hash table, column for every hash (-1 if empty)
+    uint32_t table_mask;
+    const enum REB_SA_FIELD* fields;
+    int N_fields;
+    int orbits;                                 // 1 if orbital elements are requested
+    double* out;
+    long next;                                  // Next snapshot to be decoded
+    int N_failed;
+    pthread_mutex_t mutex;                      // Protects next and N_failed
+};
+
+static uint32_t reb_simulationarchive_extract_slot(const uint32_t hash, const uint32_t mask){
+    return (hash*2654435761u)&mask;
+}
+
+static double reb_simulationarchive_extract_value(const enum REB_SA_FIELD field, const struct reb_particle* const p, const struct reb_orbit* const o){
+    switch (field){
+        case REB_SA_FIELD_X:        return p->x;
+        case REB_SA_FIELD_Y:        return p->y;
+        case REB_SA_FIELD_Z:        return p->z;
+        case REB_SA_FIELD_VX:       return p->vx;
+        case REB_SA_FIELD_VY:       return p->vy;
+        case REB_SA_FIELD_VZ:       return p->vz;
+        case REB_SA_FIELD_MASS:     return p->m;
+        case REB_SA_FIELD_RADIUS:   return p->r;
+        default:
+            break;
+    }
+    if (o==NULL){
+        return NAN;
+    }
+    switch (field){
+        case REB_SA_FIELD_A:        return o->a;
+        case REB_SA_FIELD_E:        return o->e;
+        case REB_SA_FIELD_INC:      return o->inc;
+        case REB_SA_FIELD_OMEGA:    return o->Omega;
+        case REB_SA_FIELD_ARGPERI:  return o->omega;
+        case REB_SA_FIELD_F:        return o->f;
+        case REB_SA_FIELD_MEANANOM: return o->M;
+        case REB_SA_FIELD_P:        return o->P;
+        default:
+            return NAN;
+    }
+}
+
+static void* reb_simulationarchive_extract_worker(void* args){
+    struct reb_simulationarchive_extract_info* info = (struct reb_simulationarchive_extract_info*)args;
+    const struct reb_simulationarchive* const sa = info->sa;
+    const int N_particles = info->N_particles;
+    const int N_fields = info->N_fields;
+    struct reb_simulationarchive_state s = {0};
+    struct reb_simulationarchive_state full = {0};  // Last full snapshot used to complete partial snapshots
+    long full_snapshot = -1;
+    int* index = malloc(sizeof(int)*N_particles);
+    struct reb_particle* com = NULL;                // Jacobi center of mass of the particles interior to every particle
+    int com_allocatedN = 0;
+    int N_failed = 0;
+    while(1){
+        pthread_mutex_lock(&info->mutex);
+        const long k0 = info->next;
+        info->next += REB_SIMULATIONARCHIVE_EXTRACT_CHUNK;
+        pthread_mutex_unlock(&info->mutex);
+        if (k0>=info->N_snapshots){
+            break;
+        }
+        const long k1 = MIN(k0+REB_SIMULATIONARCHIVE_EXTRACT_CHUNK, info->N_snapshots);
+        for (long k=k0; k<k1; k++){
+            const long snapshot = info->first+k;
+            double* const row = info->out + k*N_particles*N_fields;
+            int ok = reb_simulationarchive_state_decode(sa, &info->base, snapshot, &s);
+            if (ok && s.full_every>1 && s.full_t!=s.t){
+                // Partial snapshot. Test particles are added from the last full snapshot, see reb_simulationarchive_add_testparticles().
+                if (full_snapshot<0 || full_snapshot>=snapshot || sa->t[full_snapshot]!=s.full_t){
+                    full_snapshot = snapshot-1;
+                    while (full_snapshot>=0 && sa->t[full_snapshot]!=s.full_t){
+                        full_snapshot--;
+                    }
+                    if (full_snapshot>=0 && !reb_simulationarchive_state_decode(sa, &info->base, full_snapshot, &full)){
+                        full_snapshot = -1;
+                    }
+                }
+                if (full_snapshot<0){
+                    ok = 0;
+                }else{
+                    const int N_active = full.N_active<0?full.N:full.N_active;
+                    const int N_add = MAX(full.N-N_active, 0);
+                    s.particles = realloc(s.particles, sizeof(struct reb_particle)*(s.N+N_add+1));
+                    memcpy(s.particles+s.N, full.particles+N_active, sizeof(struct reb_particle)*N_add);
+                    s.N += N_add;
+                }
+            }
+            if (!ok){
+                for (int j=0; j<N_particles*N_fields; j++){
+                    row[j] = NAN;
+                }
+                N_failed++;
+                continue;
+            }
+            // Find particles
+            for (int j=0; j<N_particles; j++){
+                index[j] = info->hashes?-1:(j<s.N?j:-1);
+            }
+            int max_index = -1;
+            if (info->hashes){
+                for (int i=0; i<s.N; i++){
+                    const uint32_t hash = s.particles[i].hash;
+                    uint32_t slot = reb_simulationarchive_extract_slot(hash, info->table_mask);
+                    while (info->table[slot]>=0){
+                        const int j = info->table[slot];
+                        if (info->hashes[j]==hash){
+                            if (index[j]<0){
+                                index[j] = i;
+                                max_index = MAX(max_index, i);
+                            }
+                            break;
+                        }
+                        slot = (slot+1)&info->table_mask;
+                    }
+                }
+            }else{
+                max_index = MIN(N_particles, s.N)-1;
+            }
+            if (info->orbits && max_index>0){
+                if (com_allocatedN<max_index+1){
+                    com = realloc(com, sizeof(struct reb_particle)*(max_index+1));
+                    com_allocatedN = max_index+1;
+                }
+                struct reb_particle c = {0};
+                for (int i=0; i<=max_index; i++){
+                    com[i] = c;
+                    c = reb_get_com_of_pair(c, s.particles[i]);
+                }
+            }
+            for (int j=0; j<N_particles; j++){
+                double* const values = row + j*N_fields;
+                const int i = index[j];
+                if (i<0){
+                    for (int f=0; f<N_fields; f++){
+                        values[f] = NAN;
+                    }
+                    continue;
+                }
+                struct reb_orbit o;
+                int has_orbit = 0;
+                if (info->orbits && i>0){
+                    int err = 0;
+                    o = reb_tools_particle_to_orbit_err(s.G, s.particles[i], com[i], &err);
+                    has_orbit = !err;
+                }
+                for (int f=0; f<N_fields; f++){
+                    values[f] = reb_simulationarchive_extract_value(info->fields[f], &s.particles[i], has_orbit?&o:NULL);
+                }
+            }
+        }
+    }
+    pthread_mutex_lock(&info->mutex);
+    info->N_failed += N_failed;
+    pthread_mutex_unlock(&info->mutex);
+    free(s.particles);
+    free(full.particles);
+    free(com);
+    free(index);
+    return NULL;
+}
+
+int reb_simulationarchive_extract(struct reb_simulationarchive* sa, long first, const long N_snapshots, const uint32_t* hashes, const int N_particles, const enum REB_SA_FIELD* fields, const int N_fields, double* out, int N_threads){
+    if (sa==NULL || sa->version<2 || N_snapshots<0 || N_particles<0 || N_fields<0){
+        return -1;
+    }
+    if (first<0) first += sa->nblobs;
+    if (first<0 || first+N_snapshots>sa->nblobs){
+        return -1;
+    }
+    if (N_snapshots==0 || N_particles==0 || N_fields==0){
+        return 0;
+    }
+    struct reb_simulationarchive_extract_info info = {
+        .sa = sa,
+        .base = {.G = 1., .N_active = -1},
+        .first = first,
+        .N_snapshots = N_snapshots,
+        .hashes = hashes,
+        .N_particles = N_particles,
+        .fields = fields,
+        .N_fields = N_fields,
+        .out = out,
+    };
+    for (int f=0; f<N_fields; f++){
+        if (fields[f]>=REB_SA_FIELD_A){
+            info.orbits = 1;
+        }
+    }
+    if (!reb_simulationarchive_state_read(sa, 0, &info.base)){
+        free(info.base.particles);
+        return -1;
+    }
+    int* table = NULL;
+    if (hashes){
+        uint32_t size = 16;
+        while (size<2u*N_particles){
+            size *= 2;
+        }
+        table = malloc(sizeof(int)*size);
+        for (uint32_t k=0; k<size; k++){
+            table[k] = -1;
+        }
+        info.table_mask = size-1;
+        for (int j=0; j<N_particles; j++){
+            uint32_t slot = reb_simulationarchive_extract_slot(hashes[j], info.table_mask);
+            while (table[slot]>=0 && hashes[table[slot]]!=hashes[j]){
+                slot = (slot+1)&info.table_mask;
+            }
+            if (table[slot]<0){
+                table[slot] = j;
+            }
+        }
+        info.table = table;
+    }
+
+    const long N_chunks = (N_snapshots+REB_SIMULATIONARCHIVE_EXTRACT_CHUNK-1)/REB_SIMULATIONARCHIVE_EXTRACT_CHUNK;
+    if (N_threads<=0){
+        N_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (N_threads>N_chunks){
+        N_threads = N_chunks;
+    }
+    if (N_threads<1){
+        N_threads = 1;
+    }
+    pthread_mutex_init(&info.mutex, NULL);
+    // The calling thread decodes snapshots as well.
+    pthread_t* threads = malloc(sizeof(pthread_t)*N_threads);
+    int N_started = 0;
+    for (int t=0; t<N_threads-1; t++){
+        if (pthread_create(&threads[t], NULL, reb_simulationarchive_extract_worker, &info)){
+            break;
+        }
+        N_started++;
+    }
+    reb_simulationarchive_extract_worker(&info);
+    for (int t=0; t<N_started; t++){
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&info.mutex);
+    free(table);
+    free(info.base.particles);
+    return info.N_failed;
+}
     
 static int reb_simulationarchive_snapshotsize(struct reb_simulation* const r){
     int size_snapshot = 0;
@@ -528,6 +1034,7 @@ static int reb_simulationarchive_snapshotsize(struct reb_simulation* const r){
 
 void reb_simulationarchive_heartbeat(struct reb_simulation* const r){
     if (r->simulationarchive_filename!=NULL){
+        reb_profiling_start(r, REB_PROFILING_IO);
         int modes = 0;
         if (r->simulationarchive_auto_interval!=0) modes++;
         if (r->simulationarchive_auto_walltime!=0.) modes++;
@@ -557,6 +1064,7 @@ void reb_simulationarchive_heartbeat(struct reb_simulation* const r){
                 reb_simulationarchive_snapshot(r, NULL);
             }
         } 
+        reb_profiling_stop(r, REB_PROFILING_IO);
     }
 }
 static inline void reb_save_dp7_old(struct reb_dp7* dp7, const int N3, FILE* of){
@@ -569,8 +1077,385 @@ static inline void reb_save_dp7_old(struct reb_dp7* dp7, const int N3, FILE* of)
     fwrite(dp7->p6,sizeof(double),N3,of);
 }
 
+// Writes a new index file for the archive. 
+static void reb_simulationarchive_index_write(const char* filename, const uint64_t size_archive, const long nblobs, const uint64_t* offset64, const double* t){
+    char* filename_index = reb_simulationarchive_index_filename(filename);
+    FILE* of = fopen(filename_index, "wb");
+    free(filename_index);
+    if (of==NULL){
+        return; // Index is optional.
+    }
+    struct reb_simulationarchive_index_header header = {.size_archive = size_archive, .nblobs = nblobs};
+    memcpy(header.magic, REB_SIMULATIONARCHIVE_INDEX_MAGIC, sizeof(header.magic));
+    fwrite(&header, sizeof(header), 1, of);
+    for (long i=0; i<nblobs; i++){
+        struct reb_simulationarchive_index_entry entry = {.offset = offset64[i], .t = t[i]};
+        fwrite(&entry, sizeof(entry), 1, of);
+    }
+    fclose(of);
+}
+
+// Adds the snapshot just appended to the archive to its index. If the index is missing 
+// or was not up to date before the snapshot was appended, it is rebuilt by scanning the archive.
+static void reb_simulationarchive_index_append(const char* filename, const uint64_t size_old, const uint64_t size_new, const long nblobs, const uint64_t offset, const double t){
+    char* filename_index = reb_simulationarchive_index_filename(filename);
+    FILE* of = fopen(filename_index, "r+b");
+    free(filename_index);
+    if (of){
+        struct reb_simulationarchive_index_header header;
+        if (fread(&header, sizeof(header), 1, of)==1
+                && memcmp(header.magic, REB_SIMULATIONARCHIVE_INDEX_MAGIC, sizeof(header.magic))==0
+                && header.size_archive==size_old
+                && (long)header.nblobs==nblobs-1){
+            struct reb_simulationarchive_index_entry entry = {.offset = offset, .t = t};
+            fseek(of, sizeof(header)+header.nblobs*sizeof(entry), SEEK_SET);
+            fwrite(&entry, sizeof(entry), 1, of);
+            header.size_archive = size_new;
+            header.nblobs = nblobs;
+            fseek(of, 0, SEEK_SET);
+            fwrite(&header, sizeof(header), 1, of);
+            fclose(of);
+            return;
+        }
+        fclose(of);
+    }
+    struct reb_simulationarchive* sa = malloc(sizeof(struct reb_simulationarchive));
+    enum reb_input_binary_messages warnings = REB_INPUT_BINARY_WARNING_NONE;
+    reb_read_simulationarchive_with_messages(sa, filename, NULL, &warnings);
+    if (warnings & REB_INPUT_BINARY_ERROR_NOFILE){
+        free(sa);
+        return;
+    }
+    if (warnings & REB_INPUT_BINARY_ERROR_SEEK){
+        return; // sa has already been freed.
+    }
+    if (!(warnings & REB_INPUT_BINARY_WARNING_CORRUPTFILE)){
+        reb_simulationarchive_index_write(filename, size_new, sa->nblobs, sa->offset64, sa->t);
+    }
+    reb_close_simulationarchive(sa);
+}
+
+// Status flags returned by reb_simulationarchive_write_buffer()
+#define REB_SIMULATIONARCHIVE_WRITE_OK          0
+#define REB_SIMULATIONARCHIVE_WRITE_REPAIRED    1   // Archive was corrupted. Snapshot appended after last valid snapshot.
+#define REB_SIMULATIONARCHIVE_WRITE_FAILED      2   // Archive was corrupted and could not be repaired. No snapshot saved.
+#define REB_SIMULATIONARCHIVE_WRITE_CANNOT_OPEN 4   // File could not be opened. No snapshot saved.
+
+// Appends the serialized simulation buf_new to a version 3 SimulationArchive (diffed 
+// against the first snapshot). Creates the file if it does not exist. Does not access 
+// the simulation, so it can run on the writer thread. t is the time of the snapshot 
+// and is stored in the index file.
+static int reb_simulationarchive_write_buffer(const char* filename, char* buf_new, const size_t size_new, const int compress, const double t){
+    struct stat buffer;
+    if (stat(filename, &buffer) < 0){
+        // File does not exist. Output binary.
+        FILE* of = fopen(filename,"wb"); 
+        if (of==NULL){
+            return REB_SIMULATIONARCHIVE_WRITE_CANNOT_OPEN;
+        }
+        fwrite(buf_new,size_new,1,of);
+        fclose(of);
+        const uint64_t offset0 = 0;
+        reb_simulationarchive_index_write(filename, size_new, 1, &offset0, &t);
+        return REB_SIMULATIONARCHIVE_WRITE_OK;
+    }
+    // Create buffer containing original binary file
+    FILE* of = fopen(filename,"r+b");
+    if (of==NULL){
+        return REB_SIMULATIONARCHIVE_WRITE_CANNOT_OPEN;
+    }
+    fseek(of, 64, SEEK_SET); // Header
+    struct reb_binary_field field = {0};
+    struct reb_simulationarchive_blob blob = {0};
+    int bytesread;
+    do{
+        bytesread = fread(&field,sizeof(struct reb_binary_field),1,of);
+        fseek(of, field.size, SEEK_CUR);
+    }while(field.type!=REB_BINARY_FIELD_TYPE_END && bytesread);
+    long size_old = ftell(of);
+    if (bytesread!=1){
+        fclose(of);
+        return REB_SIMULATIONARCHIVE_WRITE_FAILED;
+    }
+        
+    bytesread = fread(&blob,sizeof(struct reb_simulationarchive_blob),1,of);
+    if (bytesread!=1){
+        fclose(of);
+        return REB_SIMULATIONARCHIVE_WRITE_FAILED;
+    }
+    int archive_contains_more_than_one_blob = 0;
+    if (blob.offset_next>0){
+        archive_contains_more_than_one_blob = 1;
+    }
+
+    
+    char* buf_old = malloc(size_old);
+    fseek(of, 0, SEEK_SET);  
+    fread(buf_old, size_old,1,of);
+
+    // Create buffer containing diff
+    char* buf_diff;
+    size_t size_diff;
+    reb_binary_diff_with_options(buf_old, size_old, buf_new, size_new, &buf_diff, &size_diff, compress?3:0);
+        
+    int status = REB_SIMULATIONARCHIVE_WRITE_OK;
+    int file_corrupt = 0;
+    int seek_ok = fseek(of, -sizeof(struct reb_simulationarchive_blob), SEEK_END);
+    int blobs_read = fread(&blob, sizeof(struct reb_simulationarchive_blob), 1, of);
+    if (seek_ok !=0 || blobs_read != 1){ // cannot read blob
+        file_corrupt = 1;
+    }
+    if ( (archive_contains_more_than_one_blob && blob.offset_prev <=0) || blob.offset_next != 0){ // blob contains unexpected data. Note: First blob is all zeros.
+        file_corrupt = 1;
+    }
+    if (file_corrupt==0 && archive_contains_more_than_one_blob ){
+        // Check if last two blobs are consistent.
+        seek_ok = fseek(of, - sizeof(struct reb_simulationarchive_blob) - sizeof(struct reb_binary_field), SEEK_CUR);  
+        bytesread = fread(&field, sizeof(struct reb_binary_field), 1, of);
+        if (seek_ok!=0 || bytesread!=1){
+            file_corrupt = 1;
+        }
+        if (field.type != REB_BINARY_FIELD_TYPE_END || field.size !=0){
+            // expected an END field
+            file_corrupt = 1;
+        }
+        seek_ok = fseek(of, -blob.offset_prev - sizeof(struct reb_simulationarchive_blob), SEEK_CUR);  
+        struct reb_simulationarchive_blob blob2 = {0};
+        blobs_read = fread(&blob2, sizeof(struct reb_simulationarchive_blob), 1, of);
+        if (seek_ok!=0 || blobs_read!=1 || blob2.offset_next != blob.offset_prev){
+            file_corrupt = 1;
+        }
+    }
+
+    if (file_corrupt){
+        // Find last valid snapshot to allow for restarting and appending to archives where last snapshot was cut off
+        status = REB_SIMULATIONARCHIVE_WRITE_REPAIRED;
+        int seek_ok;
+        seek_ok = fseek(of, size_old, SEEK_SET);
+        long last_blob = size_old + sizeof(struct reb_simulationarchive_blob);
+        do
+        {
+            seek_ok = fseek(of, -sizeof(struct reb_binary_field), SEEK_CUR);
+            if (seek_ok != 0){
+                break;
+            }
+            bytesread = fread(&field, sizeof(struct reb_binary_field), 1, of);
+            if (bytesread != 1 || field.type != REB_BINARY_FIELD_TYPE_END){ // could be EOF or corrupt snapshot
+                break;
+            }
+            bytesread = fread(&blob, sizeof(struct reb_simulationarchive_blob), 1, of);
+            if (bytesread != 1){
+                break;
+            }
+            last_blob = ftell(of);
+            if (blob.offset_next>0){
+                seek_ok = fseek(of, blob.offset_next, SEEK_CUR);
+            }else{
+                break;
+            }
+            if (seek_ok != 0){
+                break;
+            }
+        } while(1);
+
+        // To append diff, seek to last valid location (=EOF if all snapshots valid)
+        fseek(of, last_blob, SEEK_SET);
+    }else{
+        // File is not corrupt. Start at end to save time.
+        fseek(of, 0, SEEK_END);  
+    }
+
+    // Update blob info and Write diff to binary file
+    fseek(of, -sizeof(struct reb_simulationarchive_blob), SEEK_CUR);  
+    fread(&blob, sizeof(struct reb_simulationarchive_blob), 1, of);
+    blob.offset_next = size_diff+sizeof(struct reb_binary_field);
+    fseek(of, -sizeof(struct reb_simulationarchive_blob), SEEK_CUR);  
+    fwrite(&blob, sizeof(struct reb_simulationarchive_blob), 1, of);
+    const uint64_t offset = ftell(of);
+    fwrite(buf_diff, size_diff, 1, of); 
+    field.type = REB_BINARY_FIELD_TYPE_END;
+    field.size = 0;
+    fwrite(&field,sizeof(struct reb_binary_field), 1, of);
+    blob.index++;
+    blob.offset_prev = blob.offset_next;
+    blob.offset_next = 0;
+    fwrite(&blob, sizeof(struct reb_simulationarchive_blob), 1, of);
+    const uint64_t size_archive = ftell(of);
+
+    fclose(of);
+    free(buf_old);
+    free(buf_diff);
+    if (status==REB_SIMULATIONARCHIVE_WRITE_OK){
+        reb_simulationarchive_index_append(filename, buffer.st_size, size_archive, blob.index+1, offset, t);
+    }else{
+        // Repaired archives may contain data past the last snapshot. Readers fall back to scanning.
+        char* filename_index = reb_simulationarchive_index_filename(filename);
+        remove(filename_index);
+        free(filename_index);
+    }
+    return status;
+}
+
+static void reb_simulationarchive_report_status(struct reb_simulation* const r, const int status){
+    if (status & REB_SIMULATIONARCHIVE_WRITE_CANNOT_OPEN){
+        reb_error(r, "Can not open file.");
+    }
+    if (status & REB_SIMULATIONARCHIVE_WRITE_FAILED){
+        reb_warning(r, "SimulationArchive appears to be corrupted. A recovery attempt has failed. No snapshot has been saved.\n");
+    }
+    if (status & REB_SIMULATIONARCHIVE_WRITE_REPAIRED){
+        reb_warning(r, "SimulationArchive appears to be corrupted. REBOUND will attempt to fix it before appending more snapshots.\n");
+    }
+}
+
+// Decides whether the next snapshot contains all particles and updates the schedule. 
+// Returns the number of particles to be written, or 0 if all particles are written.
+// Partial snapshots only contain the first N_active particles. When the archive is
+// read, the test particles are added from the last full snapshot. The first 
+// snapshot of a file is always full. Integrators with additional per-particle 
+// data other than IAS15 and WHFast always write full snapshots.
+static int reb_simulationarchive_schedule(struct reb_simulation* const r, const char* filename){
+    int N_partial = 0;
+    struct stat buffer;
+    if (r->simulationarchive_full_every>1 && r->simulationarchive_full_counter%r->simulationarchive_full_every!=0 && stat(filename, &buffer)==0){
+        if (r->N_active>0 && (r->N_active<r->N || r->compact.N) && r->N_var==0 && r->ri_janus.allocated_N==0 && r->ri_mercurius.dcrit_allocatedN==0 && r->ri_tes.allocated_N==0 && r->ri_whfast512.allocated_N==0){
+            N_partial = r->N_active;
+        }
+    }
+    if (N_partial==0){
+        r->simulationarchive_full_t = r->t;
+    }
+    r->simulationarchive_full_counter++;
+    return N_partial;
+}
+
+#ifndef MPI
+#define REB_SIMULATIONARCHIVE_ASYNC_BUFFERS 2   // Maximum number of snapshots waiting to be written (including the one being written).
+
+struct reb_simulationarchive_job {
+    char* buf;      // Serialized simulation
+    size_t size;
+    int compress;   // Value of simulationarchive_compress when the snapshot was taken
+    double t;       // Time of the snapshot
+};
+
+// Background thread writing snapshots. Jobs are written in order.
+struct reb_simulationarchive_writer {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;    // Signals new jobs, finished jobs and shutdown
+    char* filename;
+    struct reb_simulationarchive_job jobs[REB_SIMULATIONARCHIVE_ASYNC_BUFFERS];
+    int jobs_first;         // Index of the oldest job (the one being written)
+    int jobs_N;             // Number of jobs in the queue
+    int shutdown;
+    int status;             // Status flags of finished jobs, not yet reported
+};
+
+static void* reb_simulationarchive_writer_thread(void* args){
+    struct reb_simulationarchive_writer* const w = args;
+    pthread_mutex_lock(&w->mutex);
+    while (1){
+        while (w->jobs_N==0 && !w->shutdown){
+            pthread_cond_wait(&w->cond, &w->mutex);
+        }
+        if (w->jobs_N==0){ // Shutdown and all jobs written
+            break;
+        }
+        // The job stays in the queue while it is written so it counts towards the buffer limit.
+        struct reb_simulationarchive_job job = w->jobs[w->jobs_first];
+        pthread_mutex_unlock(&w->mutex);
+        const int status = reb_simulationarchive_write_buffer(w->filename, job.buf, job.size, job.compress, job.t);
+        free(job.buf);
+        pthread_mutex_lock(&w->mutex);
+        w->status |= status;
+        w->jobs_first = (w->jobs_first+1)%REB_SIMULATIONARCHIVE_ASYNC_BUFFERS;
+        w->jobs_N--;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->mutex);
+    return NULL;
+}
+
+void reb_simulationarchive_flush(struct reb_simulation* const r){
+    struct reb_simulationarchive_writer* const w = r->simulationarchive_writer;
+    if (w==NULL){
+        return;
+    }
+    pthread_mutex_lock(&w->mutex);
+    w->shutdown = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+    pthread_join(w->thread, NULL);
+    reb_simulationarchive_report_status(r, w->status);
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->mutex);
+    free(w->filename);
+    free(w);
+    r->simulationarchive_writer = NULL;
+}
+
+static void reb_simulationarchive_snapshot_async(struct reb_simulation* const r, const char* filename){
+    struct reb_simulationarchive_writer* w = r->simulationarchive_writer;
+    if (w && strcmp(w->filename, filename)!=0){
+        reb_simulationarchive_flush(r);
+        w = NULL;
+    }
+    if (w==NULL){
+        w = calloc(1, sizeof(struct reb_simulationarchive_writer));
+        w->filename = malloc((strlen(filename)+1)*sizeof(char));
+        strcpy(w->filename, filename);
+        pthread_mutex_init(&w->mutex, NULL);
+        pthread_cond_init(&w->cond, NULL);
+        if (pthread_create(&w->thread, NULL, reb_simulationarchive_writer_thread, w)){
+            pthread_cond_destroy(&w->cond);
+            pthread_mutex_destroy(&w->mutex);
+            free(w->filename);
+            free(w);
+            reb_warning(r, "Cannot create thread for asynchronous SimulationArchive. Snapshot will be written synchronously.");
+            char* buf;
+            size_t size;
+            reb_output_binary_to_stream_partial(r, &buf, &size, reb_simulationarchive_schedule(r, filename));
+            reb_simulationarchive_report_status(r, reb_simulationarchive_write_buffer(filename, buf, size, r->simulationarchive_compress, r->t));
+            free(buf);
+            return;
+        }
+        r->simulationarchive_writer = w;
+    }
+    // Serialize on this thread. The integrator can continue once the buffer is queued.
+    struct reb_simulationarchive_job job;
+    reb_output_binary_to_stream_partial(r, &job.buf, &job.size, reb_simulationarchive_schedule(r, filename));
+    job.compress = r->simulationarchive_compress;
+    job.t = r->t;
+    pthread_mutex_lock(&w->mutex);
+    while (w->jobs_N==REB_SIMULATIONARCHIVE_ASYNC_BUFFERS){
+        // Backpressure: wait until the writer has finished the oldest snapshot.
+        pthread_cond_wait(&w->cond, &w->mutex);
+    }
+    w->jobs[(w->jobs_first+w->jobs_N)%REB_SIMULATIONARCHIVE_ASYNC_BUFFERS] = job;
+    w->jobs_N++;
+    const int status = w->status;
+    w->status = 0;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+    reb_simulationarchive_report_status(r, status);
+}
+#else // MPI
+void reb_simulationarchive_flush(struct reb_simulation* const r){
+    // Asynchronous snapshots are not available with MPI. There is nothing to flush.
+}
+#endif // MPI
+
 void reb_simulationarchive_snapshot(struct reb_simulation* const r, const char* filename){
     if (filename==NULL) filename = r->simulationarchive_filename;
+#ifndef MPI
+    if (r->simulationarchive_async && r->simulationarchive_version>=3){
+        reb_simulationarchive_snapshot_async(r, filename);
+        return;
+    }
+#endif // MPI
+    // Pending asynchronous snapshots need to be written first.
+    reb_simulationarchive_flush(r);
     struct stat buffer;
     if (stat(filename, &buffer) < 0){
         // File does not exist. Output binary.
@@ -578,7 +1463,14 @@ void reb_simulationarchive_snapshot(struct reb_simulation* const r, const char*
             // Old version
             r->simulationarchive_size_snapshot = reb_simulationarchive_snapshotsize(r);
         }
+        if (r->simulationarchive_version>=3){
+            reb_simulationarchive_schedule(r, filename);
+        }
         reb_output_binary(r,filename);
+        if (r->simulationarchive_version>=3 && stat(filename, &buffer)==0){
+            const uint64_t offset0 = 0;
+            reb_simulationarchive_index_write(filename, buffer.st_size, 1, &offset0, &r->t);
+        }
     }else{
         // File exists, append snapshot.
         if (r->simulationarchive_version<2){
@@ -787,132 +1679,11 @@ void reb_simulationarchive_snapshot(struct reb_simulation* const r, const char*
                 free(buf_old);
                 free(buf_diff);
             }else{ // Duplicate (version 3 of SimulationArchive. This is the part that will remain. Above duplicate will be removed in future release.
-                // Create buffer containing original binary file
-                FILE* of = fopen(filename,"r+b");
-                fseek(of, 64, SEEK_SET); // Header
-                struct reb_binary_field field = {0};
-                struct reb_simulationarchive_blob blob = {0};
-                int bytesread;
-                do{
-                    bytesread = fread(&field,sizeof(struct reb_binary_field),1,of);
-                    fseek(of, field.size, SEEK_CUR);
-                }while(field.type!=REB_BINARY_FIELD_TYPE_END && bytesread);
-                long size_old = ftell(of);
-                if (bytesread!=1){
-                    reb_warning(r, "SimulationArchive appears to be corrupted. A recovery attempt has failed. No snapshot has been saved.\n");
-                    return;
-                }
-                    
-                bytesread = fread(&blob,sizeof(struct reb_simulationarchive_blob),1,of);
-                if (bytesread!=1){
-                    reb_warning(r, "SimulationArchive appears to be corrupted. A recovery attempt has failed. No snapshot has been saved.\n");
-                    return;
-                }
-                int archive_contains_more_than_one_blob = 0;
-                if (blob.offset_next>0){
-                    archive_contains_more_than_one_blob = 1;
-                }
-
-                
-                char* buf_old = malloc(size_old);
-                fseek(of, 0, SEEK_SET);  
-                fread(buf_old, size_old,1,of);
-
-                // Create buffer containing current binary file
                 char* buf_new;
                 size_t size_new;
-                reb_output_binary_to_stream(r, &buf_new, &size_new);
-                
-                // Create buffer containing diff
-                char* buf_diff;
-                size_t size_diff;
-                reb_binary_diff(buf_old, size_old, buf_new, size_new, &buf_diff, &size_diff);
-        
-                int file_corrupt = 0;
-                int seek_ok = fseek(of, -sizeof(struct reb_simulationarchive_blob), SEEK_END);
-                int blobs_read = fread(&blob, sizeof(struct reb_simulationarchive_blob), 1, of);
-                if (seek_ok !=0 || blobs_read != 1){ // cannot read blob
-                    file_corrupt = 1;
-                }
-                if ( (archive_contains_more_than_one_blob && blob.offset_prev <=0) || blob.offset_next != 0){ // blob contains unexpected data. Note: First blob is all zeros.
-                    file_corrupt = 1;
-                }
-                if (file_corrupt==0 && archive_contains_more_than_one_blob ){
-                    // Check if last two blobs are consistent.
-                    seek_ok = fseek(of, - sizeof(struct reb_simulationarchive_blob) - sizeof(struct reb_binary_field), SEEK_CUR);  
-                    bytesread = fread(&field, sizeof(struct reb_binary_field), 1, of);
-                    if (seek_ok!=0 || bytesread!=1){
-                        file_corrupt = 1;
-                    }
-                    if (field.type != REB_BINARY_FIELD_TYPE_END || field.size !=0){
-                        // expected an END field
-                        file_corrupt = 1;
-                    }
-                    seek_ok = fseek(of, -blob.offset_prev - sizeof(struct reb_simulationarchive_blob), SEEK_CUR);  
-                    struct reb_simulationarchive_blob blob2 = {0};
-                    blobs_read = fread(&blob2, sizeof(struct reb_simulationarchive_blob), 1, of);
-                    if (seek_ok!=0 || blobs_read!=1 || blob2.offset_next != blob.offset_prev){
-                        file_corrupt = 1;
-                    }
-                }
-
-                if (file_corrupt){
-                    // Find last valid snapshot to allow for restarting and appending to archives where last snapshot was cut off
-                    reb_warning(r, "SimulationArchive appears to be corrupted. REBOUND will attempt to fix it before appending more snapshots.\n");
-                    int seek_ok;
-                    seek_ok = fseek(of, size_old, SEEK_SET);
-                    long last_blob = size_old + sizeof(struct reb_simulationarchive_blob);
-                    do
-                    {
-                        seek_ok = fseek(of, -sizeof(struct reb_binary_field), SEEK_CUR);
-                        if (seek_ok != 0){
-                            break;
-                        }
-                        bytesread = fread(&field, sizeof(struct reb_binary_field), 1, of);
-                        if (bytesread != 1 || field.type != REB_BINARY_FIELD_TYPE_END){ // could be EOF or corrupt snapshot
-                            break;
-                        }
-                        bytesread = fread(&blob, sizeof(struct reb_simulationarchive_blob), 1, of);
-                        if (bytesread != 1){
-                            break;
-                        }
-                        last_blob = ftell(of);
-                        if (blob.offset_next>0){
-                            seek_ok = fseek(of, blob.offset_next, SEEK_CUR);
-                        }else{
-                            break;
-                        }
-                        if (seek_ok != 0){
-                            break;
-                        }
-                    } while(1);
-
-                    // To append diff, seek to last valid location (=EOF if all snapshots valid)
-                    fseek(of, last_blob, SEEK_SET);
-                }else{
-                    // File is not corrupt. Start at end to save time.
-                    fseek(of, 0, SEEK_END);  
-                }
-
-                // Update blob info and Write diff to binary file
-                fseek(of, -sizeof(struct reb_simulationarchive_blob), SEEK_CUR);  
-                fread(&blob, sizeof(struct reb_simulationarchive_blob), 1, of);
-                blob.offset_next = size_diff+sizeof(struct reb_binary_field);
-                fseek(of, -sizeof(struct reb_simulationarchive_blob), SEEK_CUR);  
-                fwrite(&blob, sizeof(struct reb_simulationarchive_blob), 1, of);
-                fwrite(buf_diff, size_diff, 1, of); 
-                field.type = REB_BINARY_FIELD_TYPE_END;
-                field.size = 0;
-                fwrite(&field,sizeof(struct reb_binary_field), 1, of);
-                blob.index++;
-                blob.offset_prev = blob.offset_next;
-                blob.offset_next = 0;
-                fwrite(&blob, sizeof(struct reb_simulationarchive_blob), 1, of);
-
-                fclose(of);
+                reb_output_binary_to_stream_partial(r, &buf_new, &size_new, reb_simulationarchive_schedule(r, filename));
+                reb_simulationarchive_report_status(r, reb_simulationarchive_write_buffer(filename, buf_new, size_new, r->simulationarchive_compress, r->t));
                 free(buf_new);
-                free(buf_old);
-                free(buf_diff);
             }
         }
     }
@@ -39,7 +39,70 @@
 #ifdef MPI
 #include "communication_mpi.h"
 #endif // MPI
+#if defined(HUGEPAGES) && defined(__linux__)
+#include <sys/mman.h>
+#endif // HUGEPAGES
 #define MAX(a, b) ((a) > (b) ? (a) : (b))    ///< Returns the maximum of a and b
+#define MIN(a, b) ((a) < (b) ? (a) : (b))    ///< Returns the minimum of a and b
+
+#define REB_FIRST_TOUCH_MIN_N 1024      ///< Below this number of elements, buffers are initialized by one thread.
+#define REB_HUGEPAGE_SIZE (2*1024*1024) ///< Size of a transparent huge page.
+
+// Allocates an aligned buffer for N_new elements, copies the first N_copy elements from src and zeros the rest.
+static void* reb_tools_alloc_aligned_copy(const void* src, const size_t size, const int N_copy, const int N_new){
+    size_t alignment = 64;
+    size_t bytes = size*N_new;
+#if defined(HUGEPAGES) && defined(__linux__)
+    if (bytes>=REB_HUGEPAGE_SIZE){
+        alignment = REB_HUGEPAGE_SIZE;
+    }
+#endif // HUGEPAGES
+    bytes = (bytes+alignment-1)/alignment*alignment; // aligned_alloc requires a multiple of the alignment
+    char* const new_ptr = aligned_alloc(alignment, bytes);
+#if defined(HUGEPAGES) && defined(__linux__)
+    if (alignment==REB_HUGEPAGE_SIZE){
+        madvise(new_ptr, bytes, MADV_HUGEPAGE);
+    }
+#endif // HUGEPAGES
+    const char* const old_ptr = src;
+#ifdef OPENMP
+    if (N_new>=REB_FIRST_TOUCH_MIN_N){
+        // Same static schedule as the loops over particles. Every thread touches its own pages first.
+#pragma omp parallel for schedule(static)
+        for (int i=0;i<N_new;i++){
+            if (i<N_copy){
+                memcpy(new_ptr+size*i, old_ptr+size*i, size);
+            }else{
+                memset(new_ptr+size*i, 0, size);
+            }
+        }
+    }else
+#endif // OPENMP
+    {
+        if (N_copy){
+            memcpy(new_ptr, old_ptr, size*N_copy);
+        }
+        memset(new_ptr+size*N_copy, 0, size*(N_new-N_copy));
+    }
+    return new_ptr;
+}
+
+void* reb_tools_realloc_aligned(void* ptr, const size_t size, const int N_old, const int N_new){
+    if (N_new<=0){
+        free(ptr);
+        return NULL;
+    }
+    void* const new_ptr = reb_tools_alloc_aligned_copy(ptr, size, ptr?MIN(N_old,N_new):0, N_new);
+    free(ptr);
+    return new_ptr;
+}
+
+void* reb_tools_copy_aligned(const void* ptr, const size_t size, const int N){
+    if (ptr==NULL || N<=0){
+        return NULL;
+    }
+    return reb_tools_alloc_aligned_copy(ptr, size, N, N);
+}
 
 
 void reb_tools_init_srand(struct reb_simulation* r){
@@ -75,44 +138,264 @@ double reb_random_rayleigh(struct reb_simulation* r, double sigma){
 	return sigma*sqrt(-2*log(y));
 }
 
+// Counter based random number generator Philox4x32-10 (Salmon et al. 2011). 
+// Encrypts the counter ctr with the key. The output is statistically 
+// independent for every distinct (ctr, key) pair.
+static inline void reb_random_philox(uint32_t ctr[4], uint32_t key0, uint32_t key1){
+    for (int round=0; round<10; round++){
+        const uint64_t p0 = (uint64_t)0xD2511F53*ctr[0];
+        const uint64_t p1 = (uint64_t)0xCD9E8D57*ctr[2];
+        const uint32_t c0 = (uint32_t)(p1>>32) ^ ctr[1] ^ key0;
+        const uint32_t c2 = (uint32_t)(p0>>32) ^ ctr[3] ^ key1;
+        ctr[1] = (uint32_t)p1;
+        ctr[3] = (uint32_t)p0;
+        ctr[0] = c0;
+        ctr[2] = c2;
+        key0 += 0x9E3779B9;
+        key1 += 0xBB67AE85;
+    }
+}
+
+// Returns two uniformly distributed random numbers in [0,1) which only 
+// depend on the seed, stream, index and n. 
+static inline void reb_random_counter(uint32_t seed, uint32_t stream, uint64_t index, uint32_t n, double* u0, double* u1){
+    uint32_t ctr[4] = {(uint32_t)index, (uint32_t)(index>>32), n, 0};
+    reb_random_philox(ctr, seed, stream);
+    *u0 = (double)((((uint64_t)ctr[0]<<32) | ctr[1])>>11) * 0x1.0p-53;
+    *u1 = (double)((((uint64_t)ctr[2]<<32) | ctr[3])>>11) * 0x1.0p-53;
+}
+
+void reb_random_uniform_array(struct reb_simulation* r, uint32_t stream, uint64_t first, int N, double min, double max, double* values){
+    const uint32_t seed = r->rand_seed;
+#pragma omp parallel for simd schedule(static)
+    for (int i=0; i<N; i++){
+        double u0, u1;
+        reb_random_counter(seed, stream, first+i, 0, &u0, &u1);
+        values[i] = u0*(max-min)+min;
+    }
+}
+
+void reb_random_powerlaw_array(struct reb_simulation* r, uint32_t stream, uint64_t first, int N, double min, double max, double slope, double* values){
+    reb_random_uniform_array(r, stream, first, N, 0., 1., values);
+#pragma omp parallel for schedule(static)
+    for (int i=0; i<N; i++){
+        const double y = values[i];
+        if(slope == -1) values[i] = exp(y*log(max/min) + log(min));
+        else values[i] = pow( (pow(max,slope+1.)-pow(min,slope+1.))*y+pow(min,slope+1.), 1./(slope+1.));
+    }
+}
+
+void reb_random_normal_array(struct reb_simulation* r, uint32_t stream, uint64_t first, int N, double variance, double* values){
+    const uint32_t seed = r->rand_seed;
+    // Box-Muller transform. Unlike the polar method used in reb_random_normal(), 
+    // there is no rejection loop.
+#pragma omp parallel for simd schedule(static)
+    for (int i=0; i<N; i++){
+        double u0, u1;
+        reb_random_counter(seed, stream, first+i, 0, &u0, &u1);
+        values[i] = sqrt(-2.*variance*log(1.-u0))*cos(2.*M_PI*u1);
+    }
+}
+
+void reb_random_rayleigh_array(struct reb_simulation* r, uint32_t stream, uint64_t first, int N, double sigma, double* values){
+    const uint32_t seed = r->rand_seed;
+#pragma omp parallel for simd schedule(static)
+    for (int i=0; i<N; i++){
+        double u0, u1;
+        reb_random_counter(seed, stream, first+i, 0, &u0, &u1);
+        values[i] = sigma*sqrt(-2.*log(1.-u0));
+    }
+}
+
 /// Other helper routines
+static inline void add_cs(double* p, double* csp, double inp){
+    const double y = inp - *csp;
+    const double t = *p + y;
+    *csp = (t - *p) - y;
+    *p = t;
+}
+
+// Adds up the energy of every row and the compensation terms in order. 
+// The result does therefore not depend on the number of threads.
+static double reb_tools_energy_sum_rows(const double* const e_row, const double* const cs_row, const int N){
+    double e = 0.;
+    double cs = 0.;
+    for (int i=0;i<N;i++){
+        add_cs(&e, &cs, e_row[i]);
+        add_cs(&e, &cs, -cs_row[i]);
+    }
+    return e;
+}
+
 double reb_tools_energy(const struct reb_simulation* const r){
     const int N = r->N;
     const int N_var = r->N_var;
     const int _N_active = (r->N_active==-1)?(N-N_var):r->N_active;
     const struct reb_particle* restrict const particles = r->particles;
+    const double G = r->G;
+    int N_interact = (r->testparticle_type==0)?_N_active:(N-N_var);
+    if (N_interact<=0){
+        return r->energy_offset;
+    }
+    double* const e_row = malloc(sizeof(double)*2*N_interact);
+    double* const cs_row = e_row + N_interact;
+#pragma omp parallel for schedule(guided)
+    for (int i=0;i<N_interact;i++){
+        struct reb_particle pi = particles[i];
+        double e = 0.5 * pi.m * (pi.vx*pi.vx + pi.vy*pi.vy + pi.vz*pi.vz);
+        double cs = 0.;
+        if (i<_N_active){
+            for (int j=i+1;j<N_interact;j++){
+                struct reb_particle pj = particles[j];
+                double dx = pi.x - pj.x;
+                double dy = pi.y - pj.y;
+                double dz = pi.z - pj.z;
+                add_cs(&e, &cs, -G*pj.m*pi.m/sqrt(dx*dx + dy*dy + dz*dz));
+            }
+        }
+        e_row[i] = e;
+        cs_row[i] = cs;
+    }
+    double e = reb_tools_energy_sum_rows(e_row, cs_row, N_interact);
+    free(e_row);
+    return e + r->energy_offset;
+}
+
+// Potential (without G) at position x,y,z due to all particles in node, except particle pt.
+static double reb_tools_potential_from_cell(const struct reb_simulation* const r, const int pt, const struct reb_treecell* const node, const double x, const double y, const double z){
+    const double dx = x - node->mx;
+    const double dy = y - node->my;
+    const double dz = z - node->mz;
+    const double r2 = dx*dx + dy*dy + dz*dz;
+    if (node->pt < 0){ // Not a leaf
+        if (node->w*node->w > r->opening_angle2*r2){
+            double phi = 0.;
+            for (int o=0; o<8; o++){
+                if (node->oct[o] != NULL){
+                    phi += reb_tools_potential_from_cell(r, pt, node->oct[o], x, y, z);
+                }
+            }
+            return phi;
+        }
+        const double _r = sqrt(r2);
+        double phi = -node->m/_r;
+#ifdef QUADRUPOLE
+        const double mrr = dx*dx*node->mxx     + dy*dy*node->myy     + dz*dz*node->mzz
+                    + 2.*dx*dy*node->mxy     + 2.*dx*dz*node->mxz     + 2.*dy*dz*node->myz; 
+        phi -= mrr/(2.*_r*_r*_r*_r*_r);
+#endif // QUADRUPOLE
+        return phi;
+    }
+    // It's a leaf node
+    if (node->remote == 0 && node->pt == pt) return 0.;
+    return -node->m/sqrt(r2);
+}
+
+double reb_tools_energy_tree(struct reb_simulation* const r){
+    if (r->tree_root==NULL){
+        reb_warning(r, "reb_tools_energy_tree() requires a tree (REB_GRAVITY_TREE or REB_COLLISION_TREE). Calculating the energy by direct summation.");
+        return reb_tools_energy(r);
+    }
+    if (r->tree_needs_update){
+        reb_tree_update(r);
+    }
+    reb_tree_update_gravity_data(r);
+    const int N_real = r->N - r->N_var;
+    if (N_real<=0){
+        return r->energy_offset;
+    }
+    const struct reb_particle* const particles = r->particles;
+    const double G = r->G;
+    double* const e_row = malloc(sizeof(double)*2*N_real);
+    double* const cs_row = e_row + N_real;
+#pragma omp parallel for schedule(guided)
+    for (int i=0;i<N_real;i++){
+        struct reb_particle pi = particles[i];
+        double phi = 0.;
+        for (int k=0;k<r->root_n;k++){
+            const struct reb_treecell* const node = r->tree_root[k];
+            if (node!=NULL){
+                phi += reb_tools_potential_from_cell(r, i, node, pi.x, pi.y, pi.z);
+            }
+        }
+        // Every pair is counted twice
+        e_row[i] = 0.5 * pi.m * (pi.vx*pi.vx + pi.vy*pi.vy + pi.vz*pi.vz) + 0.5*G*pi.m*phi;
+        cs_row[i] = 0.;
+    }
+    double e = reb_tools_energy_sum_rows(e_row, cs_row, N_real);
+    free(e_row);
+    return e + r->energy_offset;
+}
+
+double reb_tools_energy_particles_ignore(const struct reb_simulation* const r, const int* const indices, const int N_indices, const int ignore){
+    const int N = r->N;
+    const int N_var = r->N_var;
+    const int _N_active = (r->N_active==-1)?(N-N_var):r->N_active;
+    const struct reb_particle* restrict const particles = r->particles;
+    const double G = r->G;
     double e_kin = 0.;
     double e_pot = 0.;
+    // Same terms as in reb_tools_energy()
     int N_interact = (r->testparticle_type==0)?_N_active:(N-N_var);
-    for (int i=0;i<N_interact;i++){
+    for (int k=0;k<N_indices;k++){
+        const int i = indices[k];
+        if (i>=N_interact){
+            continue;
+        }
         struct reb_particle pi = particles[i];
         e_kin += 0.5 * pi.m * (pi.vx*pi.vx + pi.vy*pi.vy + pi.vz*pi.vz);
+        // Active particles interact with all other particles, test particles only with active ones
+        const int N_j = (i<_N_active)?N_interact:_N_active;
+        for (int j=0;j<N_j;j++){
+            if (j==i || j==ignore){
+                continue;
+            }
+            struct reb_particle pj = particles[j];
+            double dx = pi.x - pj.x;
+            double dy = pi.y - pj.y;
+            double dz = pi.z - pj.z;
+            e_pot -= G*pj.m*pi.m/sqrt(dx*dx + dy*dy + dz*dz);
+        }
     }
-    for (int i=0;i<_N_active;i++){
+    // Interactions within the set have been counted twice
+    for (int k=0;k<N_indices;k++){
+        const int i = indices[k];
+        if (i>=_N_active){
+            continue;
+        }
         struct reb_particle pi = particles[i];
-        for (int j=i+1;j<N_interact;j++){
+        for (int l=0;l<N_indices;l++){
+            const int j = indices[l];
+            if (j>=N_interact || j==ignore || (j<_N_active && j<=i)){
+                continue;
+            }
             struct reb_particle pj = particles[j];
             double dx = pi.x - pj.x;
             double dy = pi.y - pj.y;
             double dz = pi.z - pj.z;
-            e_pot -= r->G*pj.m*pi.m/sqrt(dx*dx + dy*dy + dz*dz);
+            e_pot += G*pj.m*pi.m/sqrt(dx*dx + dy*dy + dz*dz);
         }
     }
-    
-    return e_kin + e_pot + r->energy_offset;
+    return e_kin + e_pot;
+}
+
+double reb_tools_energy_particles(const struct reb_simulation* const r, const int* const indices, const int N_indices){
+    return reb_tools_energy_particles_ignore(r, indices, N_indices, -1);
 }
 
 struct reb_vec3d reb_tools_angular_momentum(const struct reb_simulation* const r){
 	const int N = r->N;
 	const struct reb_particle* restrict const particles = r->particles;
 	const int N_var = r->N_var;
-    struct reb_vec3d L = {0};
+    double Lx = 0., Ly = 0., Lz = 0.;
+#pragma omp parallel for reduction(+:Lx,Ly,Lz)
     for (int i=0;i<N-N_var;i++){
 		struct reb_particle pi = particles[i];
-        L.x += pi.m*(pi.y*pi.vz - pi.z*pi.vy);
-        L.y += pi.m*(pi.z*pi.vx - pi.x*pi.vz);
-        L.z += pi.m*(pi.x*pi.vy - pi.y*pi.vx);
+        Lx += pi.m*(pi.y*pi.vz - pi.z*pi.vy);
+        Ly += pi.m*(pi.z*pi.vx - pi.x*pi.vz);
+        Lz += pi.m*(pi.x*pi.vy - pi.y*pi.vx);
 	}
+    struct reb_vec3d L = {.x = Lx, .y = Ly, .z = Lz};
 	return L;
 }
 
@@ -122,6 +405,7 @@ void reb_move_to_hel(struct reb_simulation* const r){
 	    struct reb_particle* restrict const particles = r->particles;
         struct reb_particle hel = r->particles[0];
         // Note: Variational particles will not be affected.
+#pragma omp parallel for schedule(static) if(N_real>1000)
         for (int i=1;i<N_real;i++){
             particles[i].x  -= hel.x;
             particles[i].y  -= hel.y;
@@ -297,6 +581,7 @@ void reb_move_to_com(struct reb_simulation* const r){
     }
 	
     // Finally do normal particles
+#pragma omp parallel for schedule(static) if(N_real>1000)
     for (int i=0;i<N_real;i++){
 		particles[i].x  -= com.x;
 		particles[i].y  -= com.y;
@@ -308,7 +593,7 @@ void reb_move_to_com(struct reb_simulation* const r){
     
     // Check boundaries and update tree if needed
     reb_boundary_check(r);     
-    if (r->gravity==REB_GRAVITY_TREE || r->collision==REB_COLLISION_TREE || r->collision==REB_COLLISION_LINETREE){
+    if (r->gravity==REB_GRAVITY_TREE || r->gravity==REB_GRAVITY_FMM || r->collision==REB_COLLISION_TREE || r->collision==REB_COLLISION_LINETREE){
         reb_tree_update(r);          
     }
 #ifdef MPI
@@ -418,50 +703,71 @@ struct reb_particle reb_get_com_range(struct reb_simulation* r, int first, int l
 	return com;
 }
 
+// Mass weighted sums of positions, velocities and accelerations (sums[0..8]) and the total mass (sums[9]) of particles first to last-1.
+static void reb_get_com_sums(const struct reb_simulation* const r, const int first, const int last, double sums[10]){
+    const struct reb_particle* const particles = r->particles;
+    double mx = 0., my = 0., mz = 0., mvx = 0., mvy = 0., mvz = 0., max = 0., may = 0., maz = 0., m = 0.;
+#pragma omp parallel for reduction(+:mx,my,mz,mvx,mvy,mvz,max,may,maz,m)
+    for (int i=first; i<last; i++){
+        const struct reb_particle p = particles[i];
+        mx  += p.x*p.m;
+        my  += p.y*p.m;
+        mz  += p.z*p.m;
+        mvx += p.vx*p.m;
+        mvy += p.vy*p.m;
+        mvz += p.vz*p.m;
+        max += p.ax*p.m;
+        may += p.ay*p.m;
+        maz += p.az*p.m;
+        m   += p.m;
+    }
+    sums[0] = mx;  sums[1] = my;  sums[2] = mz;
+    sums[3] = mvx; sums[4] = mvy; sums[5] = mvz;
+    sums[6] = max; sums[7] = may; sums[8] = maz;
+    sums[9] = m;
+}
+
 struct reb_particle reb_get_com(struct reb_simulation* r){
+    double sums[10];
 #ifdef MPI
-    reb_communication_mpi_distribute_particles(r);
-    int N_real = r->N-r->N_var;
-    struct reb_particle com_local = reb_get_com_range(r, 0, N_real);
-	struct reb_particle com = {0};
-    com_local.x  *= com_local.m;
-    com_local.y  *= com_local.m;
-    com_local.z  *= com_local.m;
-    com_local.vx *= com_local.m;
-    com_local.vy *= com_local.m;
-    com_local.vz *= com_local.m;
-    com_local.ax *= com_local.m;
-    com_local.ay *= com_local.m;
-    com_local.az *= com_local.m;
-
-    MPI_Allreduce(&com_local.x, &com.x, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
-    MPI_Allreduce(&com_local.x, &com.y, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
-    MPI_Allreduce(&com_local.x, &com.z, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
-    MPI_Allreduce(&com_local.vx, &com.vx, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
-    MPI_Allreduce(&com_local.vx, &com.vy, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
-    MPI_Allreduce(&com_local.vx, &com.vz, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
-    MPI_Allreduce(&com_local.ax, &com.ax, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
-    MPI_Allreduce(&com_local.ax, &com.ay, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
-    MPI_Allreduce(&com_local.ax, &com.az, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
-    MPI_Allreduce(&com_local.m, &com.m, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
-    
-    if (com.m > 0){
-        com.x  /= com.m;
-        com.y  /= com.m;
-        com.z  /= com.m;
-        com.vx /= com.m;
-        com.vy /= com.m;
-        com.vz /= com.m;
-        com.ax /= com.m;
-        com.ay /= com.m;
-        com.az /= com.m;
+    if (r->mpi_decomposition!=REB_MPI_DECOMPOSITION_TESTPARTICLES){
+        reb_communication_mpi_distribute_particles(r);
+    }
+    // Only count particles after they have been distributed.
+    const int N_real = r->N-r->N_var;
+    // With the test particle decomposition, every node has a copy of the 
+    // active particles. They are only counted once.
+    int N_replicated = 0;
+    if (r->mpi_decomposition==REB_MPI_DECOMPOSITION_TESTPARTICLES){
+        N_replicated = r->N_active==-1?N_real:r->N_active;
+    }
+    reb_get_com_sums(r, N_replicated, N_real, sums);
+    MPI_Allreduce(MPI_IN_PLACE, sums, 10, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+    if (N_replicated){
+        double sums_replicated[10];
+        reb_get_com_sums(r, 0, N_replicated, sums_replicated);
+        for (int k=0;k<10;k++){
+            sums[k] += sums_replicated[k];
+        }
     }
-
-	return com; 
 #else // MPI
-    int N_real = r->N-r->N_var;
-    return reb_get_com_range(r, 0, N_real);
+    const int N_real = r->N-r->N_var;
+    reb_get_com_sums(r, 0, N_real, sums);
 #endif // MPI
+    struct reb_particle com = {0};
+    com.m = sums[9];
+    if (com.m > 0){
+        com.x  = sums[0]/com.m;
+        com.y  = sums[1]/com.m;
+        com.z  = sums[2]/com.m;
+        com.vx = sums[3]/com.m;
+        com.vy = sums[4]/com.m;
+        com.vz = sums[5]/com.m;
+        com.ax = sums[6]/com.m;
+        com.ay = sums[7]/com.m;
+        com.az = sums[8]/com.m;
+    }
+	return com; 
 }
 
 struct reb_particle reb_get_jacobi_com(struct reb_particle* p){
@@ -473,26 +779,34 @@ struct reb_particle reb_get_jacobi_com(struct reb_particle* p){
 void reb_tools_init_plummer(struct reb_simulation* r, int _N, double M, double R) {
 	// Algorithm from:	
 	// http://adsabs.harvard.edu/abs/1974A%26A....37..183A
+	// Random numbers are counter based and only depend on rand_seed and 
+	// the particle index. The particles are sampled in parallel.
 	
 	double E = 3./64.*M_PI*M*M/R;
+	const uint32_t seed = r->rand_seed;
+	const uint32_t stream = 0x504c554d; // "PLUM"
+	const uint64_t first = r->N;
+	struct reb_particle* stars = calloc(_N, sizeof(struct reb_particle));
+#pragma omp parallel for schedule(static)
 	for (int i=0;i<_N;i++){
 		struct reb_particle star = {0};
-		double _r = pow(pow(reb_random_uniform(r, 0,1),-2./3.)-1.,-1./2.);
-		double x2 = reb_random_uniform(r, 0,1);
-		double x3 = reb_random_uniform(r, 0,2.*M_PI);
+		uint32_t n = 0;
+		double x1, x2, x3, x5, x6, x7, q, g, unused;
+		reb_random_counter(seed, stream, first+i, n++, &x1, &x2);
+		reb_random_counter(seed, stream, first+i, n++, &x3, &x6);
+		x3 *= 2.*M_PI;
+		double _r = pow(pow(x1,-2./3.)-1.,-1./2.);
 		star.z = (1.-2.*x2)*_r;
 		star.x = sqrt(_r*_r-star.z*star.z)*cos(x3);
 		star.y = sqrt(_r*_r-star.z*star.z)*sin(x3);
-		double x5,g,q;
 		do{
-			x5 = reb_random_uniform(r, 0.,1.);
-			q = reb_random_uniform(r, 0.,1.);
+			reb_random_counter(seed, stream, first+i, n++, &x5, &q);
 			g = q*q*pow(1.-q*q,7./2.);
 		}while(0.1*x5>g);
 		double ve = pow(2.,1./2.)*pow(1.+_r*_r,-1./4.);
 		double v = q*ve;
-		double x6 = reb_random_uniform(r, 0.,1.);
-		double x7 = reb_random_uniform(r, 0.,2.*M_PI);
+		reb_random_counter(seed, stream, first+i, n++, &x7, &unused);
+		x7 *= 2.*M_PI;
 		star.vz = (1.-2.*x6)*v;
 		star.vx = sqrt(v*v-star.vz*star.vz)*cos(x7);
 		star.vy = sqrt(v*v-star.vz*star.vz)*sin(x7);
@@ -507,8 +821,10 @@ void reb_tools_init_plummer(struct reb_simulation* r, int _N, double M, double R
 
 		star.m = M/(double)_N;
 
-		reb_add(r, star);
+		stars[i] = star;
 	}
+	reb_add_many(r, stars, _N);
+	free(stars);
 }
 
 double reb_tools_mod2pi(double f){
@@ -561,6 +877,59 @@ double reb_tools_M_to_f(double e, double M){
     return reb_tools_E_to_f(e, E);
 }
 
+// Branch free solver for elliptic orbits (0<=e<1) used by the batch functions below. 
+// Starts with the cubic approximation of Markley (1995), accurate to 1e-4 for all e and M, 
+// followed by a fixed number of fourth order corrections (Danby 1988). Two corrections 
+// are enough to reach machine precision. Without data dependent branches, the compiler 
+// can vectorize loops calling this function.
+static inline double reb_tools_M_to_E_elliptic(const double e, double M){
+    M = reb_tools_mod2pi(M);
+    const double x = M > M_PI ? M-2.*M_PI : M; // x in [-pi,pi]
+    const double ax = fabs(x);
+    const double pi2 = M_PI*M_PI;
+    const double alpha = (3.*pi2 + 1.6*M_PI*(M_PI-ax)/(1.+e))/(pi2-6.);
+    const double d = 3.*(1.-e) + alpha*e;
+    const double q = 2.*alpha*d*(1.-e) - ax*ax;
+    const double r = 3.*alpha*d*(d-1.+e)*ax + ax*ax*ax;
+    const double w = cbrt(fabs(r) + sqrt(q*q*q + r*r));
+    const double w2 = w*w;
+    double E = (2.*r*w2/(w2*w2 + w2*q + q*q) + ax)/d;
+    for (int i=0; i<2; i++){
+        const double es = e*sin(E);
+        const double ec = e*cos(E);
+        const double F = E - es - ax;
+        const double F1 = 1. - ec;
+        const double d1 = -F/F1;
+        const double d2 = -F/(F1 + 0.5*d1*es);
+        const double d3 = -F/(F1 + 0.5*d2*es + d2*d2*ec/6.);
+        E += d3;
+    }
+    E = x < 0. ? 2.*M_PI-E : E; // back to [0,2pi)
+    return E;
+}
+
+void reb_tools_M_to_E_batch(const int N, const double* const e, const double* const M, double* const E){
+#pragma omp parallel for simd schedule(static)
+    for (int i=0; i<N; i++){
+        E[i] = reb_tools_M_to_E_elliptic(e[i], M[i]);
+    }
+    // Hyperbolic orbits are masked out above. They are rare and use the scalar solver.
+#pragma omp parallel for schedule(static)
+    for (int i=0; i<N; i++){
+        if (e[i] >= 1.){
+            E[i] = reb_tools_M_to_E(e[i], M[i]);
+        }
+    }
+}
+
+void reb_tools_M_to_f_batch(const int N, const double* const e, const double* const M, double* const f){
+    reb_tools_M_to_E_batch(N, e, M, f);
+#pragma omp parallel for schedule(static)
+    for (int i=0; i<N; i++){
+        f[i] = reb_tools_E_to_f(e[i], f[i]);
+    }
+}
+
 static const char* reb_string_for_particle_error(int err){
     if (err==1)
         return "Cannot set e exactly to 1.";
@@ -811,8 +1180,12 @@ static struct reb_particle reb_particle_new_errV(struct reb_simulation* r, int*
     }
     if (!primary_given){
 #ifdef MPI
-        reb_error(r, "When using MPI, you need to provide a primary to reb_add_fmt() when using orbital elements.");
-        return reb_particle_nan();
+        if (r->mpi_decomposition!=REB_MPI_DECOMPOSITION_TESTPARTICLES){
+            reb_error(r, "When using MPI, you need to provide a primary to reb_add_fmt() when using orbital elements.");
+            return reb_particle_nan();
+        }
+        // Every node has a copy of the active particles.
+        primary = reb_get_com_range(r, 0, r->N_active==-1?r->N:r->N_active);
 #else // MPI
         primary = reb_get_com(r);
 #endif // MPI
@@ -1178,6 +1551,80 @@ struct reb_orbit reb_tools_particle_to_orbit(double G, struct reb_particle p, st
 	return reb_tools_particle_to_orbit_err(G, p, primary, &err);
 }
 
+// Returns the array of primaries used by the batch conversion functions below. 
+// Particle i uses element i*stride. If primaries is NULL, a new array with the Jacobi 
+// center of mass of all particles before i is allocated. The caller needs to free it.
+static struct reb_particle* reb_tools_batch_primaries(const struct reb_particle* const particles, const struct reb_particle* const primaries, const int N_primaries, const int N, int* const stride){
+    if (primaries){
+        *stride = N_primaries==1?0:1;
+        return (struct reb_particle*)primaries;
+    }
+    *stride = 1;
+    struct reb_particle* jacobi = malloc(sizeof(struct reb_particle)*N);
+    if (N>0){
+        jacobi[0] = reb_particle_nan(); // First particle has no primary
+        jacobi[0].m = 0;
+    }
+    struct reb_particle com = N>0?particles[0]:reb_particle_nan();
+    for (int i=1;i<N;i++){
+        jacobi[i] = com;
+        com = reb_get_com_of_pair(com,particles[i]);
+    }
+    return jacobi;
+}
+
+void reb_tools_particles_to_orbits_err(double G, const struct reb_particle* const particles, const struct reb_particle* const primaries, const int N_primaries, const int N, struct reb_orbit* const orbits, int* const err){
+    if (primaries && N_primaries!=1 && N_primaries!=N){
+        reb_warning(NULL, "Number of primaries must be either 1 or N.");
+        return;
+    }
+    int stride;
+    struct reb_particle* const prim = reb_tools_batch_primaries(particles, primaries, N_primaries, N, &stride);
+    // Every conversion is independent. The scalar kernel is used so that results 
+    // are bitwise identical to calling reb_tools_particle_to_orbit_err() N times.
+#pragma omp parallel for schedule(static)
+    for (int i=0;i<N;i++){
+        int err_i = 0;
+        orbits[i] = reb_tools_particle_to_orbit_err(G, particles[i], prim[i*stride], &err_i);
+        if (err){
+            err[i] = err_i;
+        }
+    }
+    if (prim != primaries){
+        free(prim);
+    }
+}
+
+void reb_tools_orbits_to_particles_err(double G, const struct reb_particle* const primaries, const int N_primaries, const int N, const double* const m, const double* const a, const double* const e, const double* const inc, const double* const Omega, const double* const omega, const double* const f, const double* const M, struct reb_particle* const particles, int* const err){
+    if (primaries==NULL || (N_primaries!=1 && N_primaries!=N)){
+        reb_warning(NULL, "Number of primaries must be either 1 or N.");
+        return;
+    }
+    const int stride = N_primaries==1?0:1;
+    double* f_M = NULL;
+    if (f==NULL && M!=NULL){
+        // Solve Kepler's equation for all particles at once.
+        f_M = malloc(sizeof(double)*N);
+        if (e){
+            reb_tools_M_to_f_batch(N, e, M, f_M);
+        }else{
+            double* e0 = calloc(N, sizeof(double));
+            reb_tools_M_to_f_batch(N, e0, M, f_M);
+            free(e0);
+        }
+    }
+    const double* const f_i = f_M?f_M:f;
+#pragma omp parallel for schedule(static)
+    for (int i=0;i<N;i++){
+        int err_i = 0;
+        particles[i] = reb_tools_orbit_to_particle_err(G, primaries[i*stride], m?m[i]:0., a[i], e?e[i]:0., inc?inc[i]:0., Omega?Omega[i]:0., omega?omega[i]:0., f_i?f_i[i]:0., &err_i);
+        if (err){
+            err[i] = err_i;
+        }
+    }
+    free(f_M);
+}
+
 
 void reb_tools_solve_kepler_pal(double h, double k, double lambda, double* p, double* q){
     double e2 = h*h + k*k;
@@ -1285,6 +1732,29 @@ void reb_var_rescale(struct reb_simulation* const r){
         return;
     }
 
+    // The variational particles are stored after the real particles. In almost every 
+    // timestep none of them is large and a single (parallel) pass over all of them suffices.
+    // Only if a large coordinate is found, the sets are checked one by one below.
+    {
+        const struct reb_particle* const particles = r->particles + (r->N - r->N_var);
+        const int N_var = r->N_var;
+        double scale = 0;
+#pragma omp parallel for reduction(max:scale) if(N_var>1000)
+        for (int i=0; i<N_var; i++){
+            const struct reb_particle p = particles[i];
+            double s = MAX(fabs(p.x), 0.);
+            s = MAX(fabs(p.y), s);
+            s = MAX(fabs(p.z), s);
+            s = MAX(fabs(p.vx), s);
+            s = MAX(fabs(p.vy), s);
+            s = MAX(fabs(p.vz), s);
+            scale = MAX(s, scale);
+        }
+        if (!(scale > 1e100)){
+            return;
+        }
+    }
+
     for (int v=0;v<r->var_config_N;v++){
         struct reb_variational_configuration* vc = &(r->var_config[v]);
 
@@ -1564,6 +2034,7 @@ uint32_t reb_hash(const char* str){
 void reb_simulation_imul(struct reb_simulation* r, double scalar_pos, double scalar_vel){
     const int N = r->N;
     struct reb_particle* restrict const particles = r->particles;
+#pragma omp parallel for schedule(static) if(N>1000)
 	for (int i=0;i<N;i++){
         particles[i].x *= scalar_pos;
         particles[i].y *= scalar_pos;
@@ -1580,6 +2051,7 @@ int reb_simulation_iadd(struct reb_simulation* r, struct reb_simulation* r2){
     if (N!=N2) return -1;
     struct reb_particle* restrict const particles = r->particles;
     const struct reb_particle* restrict const particles2 = r2->particles;
+#pragma omp parallel for schedule(static) if(N>1000)
 	for (int i=0;i<N;i++){
         particles[i].x += particles2[i].x;
         particles[i].y += particles2[i].y;
@@ -1597,6 +2069,7 @@ int reb_simulation_isub(struct reb_simulation* r, struct reb_simulation* r2){
     if (N!=N2) return -1;
     struct reb_particle* restrict const particles = r->particles;
     const struct reb_particle* restrict const particles2 = r2->particles;
+#pragma omp parallel for schedule(static) if(N>1000)
 	for (int i=0;i<N;i++){
         particles[i].x -= particles2[i].x;
         particles[i].y -= particles2[i].y;
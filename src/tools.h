@@ -78,4 +78,37 @@ void reb_tools_particle_to_pal(double G, struct reb_particle p, struct reb_parti
  * @brief internal function to handle outputs for the Fast Simulation Restarter.
  */
 void reb_fsr_heartbeat(struct reb_simulation* const r);
+
+/**
+ * @brief Resizes an array to N_new elements in a 64 byte aligned buffer.
+ * @details Works like realloc(), but the new buffer is always freshly allocated 
+ * with 64 byte alignment. The first min(N_old,N_new) elements are copied, the 
+ * remaining ones are set to zero. With OpenMP, large buffers are copied/zeroed 
+ * by all threads with the same static schedule that the particle loops use. The 
+ * memory pages therefore end up on the NUMA node of the thread that works on them 
+ * (first touch policy). If compiled with HUGEPAGES, large buffers are aligned to 
+ * 2MB and transparent huge pages are requested. The buffer can be freed with free().
+ * @param ptr Pointer to the old buffer or NULL.
+ * @param size Size of one element in bytes.
+ * @param N_old Number of valid elements in the old buffer.
+ * @param N_new Number of elements in the new buffer.
+ * @return Pointer to the new buffer.
+ */
+void* reb_tools_realloc_aligned(void* ptr, const size_t size, const int N_old, const int N_new);
+
+/**
+ * @brief Returns an aligned copy of a buffer, allocated in the same way as in reb_tools_realloc_aligned().
+ * @param ptr Buffer to be copied. If NULL, NULL is returned.
+ * @param size Size of one element in bytes.
+ * @param N Number of elements to copy.
+ * @return Pointer to the new buffer.
+ */
+void* reb_tools_copy_aligned(const void* ptr, const size_t size, const int N);
+
+/**
+ * @brief Same as reb_tools_energy_particles() but interactions with particle ignore are not included.
+ * @details Used when two particles are merged and the merged particle has not been removed yet.
+ * @param ignore Index of the particle to ignore or -1.
+ */
+double reb_tools_energy_particles_ignore(const struct reb_simulation* const r, const int* const indices, const int N_indices, const int ignore);
 #endif 	// TOOLS_H
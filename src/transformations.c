@@ -28,6 +28,9 @@
 #include "transformations.h"
 #include "rebound.h"
 
+// Loops over fewer particles than this are not worth parallelizing.
+#define TRANSFORMATIONS_PARALLEL_N 2000
+
 /******************************
  * Jacobi */
 
@@ -59,15 +62,17 @@ void reb_transformations_inertial_to_jacobi_posvel(const struct reb_particle* co
         s_vz = s_vz * pme + p_mass[i].m*p_j[i].vz;
     }
     const double ei = 1./eta;
-    for (unsigned int i=N_active;i<N;i++){
-        const struct reb_particle pi = particles[i];
-        p_j[i].m = pi.m;
-        p_j[i].x = pi.x - s_x*ei;
-        p_j[i].y = pi.y - s_y*ei;
-        p_j[i].z = pi.z - s_z*ei;
-        p_j[i].vx = pi.vx - s_vx*ei;
-        p_j[i].vy = pi.vy - s_vy*ei;
-        p_j[i].vz = pi.vz - s_vz*ei;
+    // Test particles are shifted by the centre of mass of all active particles.
+    const double cx = s_x*ei, cy = s_y*ei, cz = s_z*ei, cvx = s_vx*ei, cvy = s_vy*ei, cvz = s_vz*ei;
+#pragma omp parallel for if(N-N_active>TRANSFORMATIONS_PARALLEL_N)
+    for (int i=N_active;i<(int)N;i++){
+        p_j[i].m = particles[i].m;
+        p_j[i].x = particles[i].x - cx;
+        p_j[i].y = particles[i].y - cy;
+        p_j[i].z = particles[i].z - cz;
+        p_j[i].vx = particles[i].vx - cvx;
+        p_j[i].vy = particles[i].vy - cvy;
+        p_j[i].vz = particles[i].vz - cvz;
     }
     const double Mtotal  = eta;
     const double Mtotali = 1./Mtotal;
@@ -117,18 +122,20 @@ void reb_transformations_inertial_to_jacobi_posvelacc(const struct reb_particle*
         s_az = s_az * pme + p_mass[i].m*p_j[i].az;
     }
     const double ei = 1./eta;
-    for (unsigned int i=N_active;i<N;i++){
-        const struct reb_particle pi = particles[i];
-        p_j[i].m = pi.m;
-        p_j[i].x = pi.x - s_x*ei;
-        p_j[i].y = pi.y - s_y*ei;
-        p_j[i].z = pi.z - s_z*ei;
-        p_j[i].vx = pi.vx - s_vx*ei;
-        p_j[i].vy = pi.vy - s_vy*ei;
-        p_j[i].vz = pi.vz - s_vz*ei;
-        p_j[i].ax = pi.ax - s_ax*ei;
-        p_j[i].ay = pi.ay - s_ay*ei;
-        p_j[i].az = pi.az - s_az*ei;
+    const double cx = s_x*ei, cy = s_y*ei, cz = s_z*ei, cvx = s_vx*ei, cvy = s_vy*ei, cvz = s_vz*ei;
+    const double cax = s_ax*ei, cay = s_ay*ei, caz = s_az*ei;
+#pragma omp parallel for if(N-N_active>TRANSFORMATIONS_PARALLEL_N)
+    for (int i=N_active;i<(int)N;i++){
+        p_j[i].m = particles[i].m;
+        p_j[i].x = particles[i].x - cx;
+        p_j[i].y = particles[i].y - cy;
+        p_j[i].z = particles[i].z - cz;
+        p_j[i].vx = particles[i].vx - cvx;
+        p_j[i].vy = particles[i].vy - cvy;
+        p_j[i].vz = particles[i].vz - cvz;
+        p_j[i].ax = particles[i].ax - cax;
+        p_j[i].ay = particles[i].ay - cay;
+        p_j[i].az = particles[i].az - caz;
     }
     const double Mtotal  = eta;
     const double Mtotali = 1./Mtotal;
@@ -162,11 +169,12 @@ void reb_transformations_inertial_to_jacobi_acc(const struct reb_particle* const
         s_az = s_az * pme + p_mass[i].m*p_j[i].az;
     }
     const double ei = 1./eta;
-    for (unsigned int i=N_active;i<N;i++){
-        const struct reb_particle pi = particles[i];
-        p_j[i].ax = pi.ax - s_ax*ei;
-        p_j[i].ay = pi.ay - s_ay*ei;
-        p_j[i].az = pi.az - s_az*ei;
+    const double cax = s_ax*ei, cay = s_ay*ei, caz = s_az*ei;
+#pragma omp parallel for if(N-N_active>TRANSFORMATIONS_PARALLEL_N)
+    for (int i=N_active;i<(int)N;i++){
+        p_j[i].ax = particles[i].ax - cax;
+        p_j[i].ay = particles[i].ay - cay;
+        p_j[i].az = particles[i].az - caz;
     }
     const double Mtotal  = eta;
     const double Mtotali = 1./Mtotal;
@@ -183,15 +191,19 @@ void reb_transformations_jacobi_to_inertial_posvel(struct reb_particle* const pa
     double s_vx = p_j[0].vx * eta;
     double s_vy = p_j[0].vy * eta;
     double s_vz = p_j[0].vz * eta;
-    for (unsigned int i=N-1;i>=N_active;i--){
-        const struct reb_particle pji = p_j[i];
+    {
+        // Test particles are shifted by the centre of mass of all active particles.
         const double ei = 1./eta;
-        particles[i].x  = pji.x  + s_x  * ei;
-        particles[i].y  = pji.y  + s_y  * ei;
-        particles[i].z  = pji.z  + s_z  * ei;
-        particles[i].vx = pji.vx + s_vx * ei;
-        particles[i].vy = pji.vy + s_vy * ei;
-        particles[i].vz = pji.vz + s_vz * ei;
+        const double cx = s_x*ei, cy = s_y*ei, cz = s_z*ei, cvx = s_vx*ei, cvy = s_vy*ei, cvz = s_vz*ei;
+#pragma omp parallel for if(N-N_active>TRANSFORMATIONS_PARALLEL_N)
+        for (int i=N_active;i<(int)N;i++){
+            particles[i].x  = p_j[i].x  + cx;
+            particles[i].y  = p_j[i].y  + cy;
+            particles[i].z  = p_j[i].z  + cz;
+            particles[i].vx = p_j[i].vx + cvx;
+            particles[i].vy = p_j[i].vy + cvy;
+            particles[i].vz = p_j[i].vz + cvz;
+        }
     }
     for (unsigned int i=N_active-1;i>0;i--){
         const struct reb_particle pji = p_j[i];
@@ -230,12 +242,15 @@ void reb_transformations_jacobi_to_inertial_pos(struct reb_particle* const parti
     double s_x  = p_j[0].x  * eta;
     double s_y  = p_j[0].y  * eta;
     double s_z  = p_j[0].z  * eta;
-    for (unsigned int i=N-1;i>=N_active;i--){
-        const struct reb_particle pji = p_j[i];
+    {
         const double ei = 1./eta;
-        particles[i].x  = pji.x  + s_x*ei ;
-        particles[i].y  = pji.y  + s_y*ei ;
-        particles[i].z  = pji.z  + s_z*ei ;
+        const double cx = s_x*ei, cy = s_y*ei, cz = s_z*ei;
+#pragma omp parallel for if(N-N_active>TRANSFORMATIONS_PARALLEL_N)
+        for (int i=N_active;i<(int)N;i++){
+            particles[i].x  = p_j[i].x  + cx;
+            particles[i].y  = p_j[i].y  + cy;
+            particles[i].z  = p_j[i].z  + cz;
+        }
     }
     for (unsigned int i=N_active-1;i>0;i--){
         const struct reb_particle pji = p_j[i];
@@ -262,12 +277,15 @@ void reb_transformations_jacobi_to_inertial_acc(struct reb_particle* const parti
     double s_ax  = p_j[0].ax  * eta;
     double s_ay  = p_j[0].ay  * eta;
     double s_az  = p_j[0].az  * eta;
-    for (unsigned int i=N-1;i>=N_active;i--){
-        const struct reb_particle pji = p_j[i];
+    {
         const double ei = 1./eta;
-        particles[i].ax  = pji.ax  + s_ax * ei;
-        particles[i].ay  = pji.ay  + s_ay * ei;
-        particles[i].az  = pji.az  + s_az * ei;
+        const double cax = s_ax*ei, cay = s_ay*ei, caz = s_az*ei;
+#pragma omp parallel for if(N-N_active>TRANSFORMATIONS_PARALLEL_N)
+        for (int i=N_active;i<(int)N;i++){
+            particles[i].ax  = p_j[i].ax  + cax;
+            particles[i].ay  = p_j[i].ay  + cay;
+            particles[i].az  = p_j[i].az  + caz;
+        }
     }
     for (unsigned int i=N_active-1;i>0;i--){
         const struct reb_particle pji = p_j[i];
@@ -300,7 +318,7 @@ void reb_transformations_inertial_to_whds_posvel(const struct reb_particle* cons
     double vy0 = 0.;
     double vz0 = 0.;
     double m0  = 0.;
-#pragma omp parallel for reduction(+:x0) reduction(+:y0) reduction(+:z0) reduction(+:vx0) reduction(+:vy0) reduction(+:vz0) reduction(+:m0)
+#pragma omp parallel for reduction(+:x0) reduction(+:y0) reduction(+:z0) reduction(+:vx0) reduction(+:vy0) reduction(+:vz0) reduction(+:m0) if(N_active>TRANSFORMATIONS_PARALLEL_N)
     for (unsigned int i=0;i<N_active;i++){
         double m = particles[i].m;
         x0  += particles[i].x *m;
@@ -320,7 +338,7 @@ void reb_transformations_inertial_to_whds_posvel(const struct reb_particle* cons
     p_h[0].m = m0;
     
     m0 = particles[0].m;
-#pragma omp parallel for
+#pragma omp parallel for if(N_active>TRANSFORMATIONS_PARALLEL_N)
     for (unsigned int i=1;i<N_active;i++){
         p_h[i].x  = particles[i].x  - particles[0].x ;
         p_h[i].y  = particles[i].y  - particles[0].y ;
@@ -332,14 +350,17 @@ void reb_transformations_inertial_to_whds_posvel(const struct reb_particle* cons
         p_h[i].vz = mf*(particles[i].vz - p_h[0].vz);
         p_h[i].m  = mi;
     }
-#pragma omp parallel for
+    // Test particles are shifted by the star's position and the centre of mass velocity.
+    const double sx = particles[0].x, sy = particles[0].y, sz = particles[0].z;
+    const double cvx = p_h[0].vx, cvy = p_h[0].vy, cvz = p_h[0].vz;
+#pragma omp parallel for if(N-N_active>TRANSFORMATIONS_PARALLEL_N)
     for (unsigned int i=N_active;i<N;i++){
-        p_h[i].x  = particles[i].x  - particles[0].x ;
-        p_h[i].y  = particles[i].y  - particles[0].y ;
-        p_h[i].z  = particles[i].z  - particles[0].z ;
-        p_h[i].vx = particles[i].vx - p_h[0].vx;
-        p_h[i].vy = particles[i].vy - p_h[0].vy;
-        p_h[i].vz = particles[i].vz - p_h[0].vz;
+        p_h[i].x  = particles[i].x  - sx;
+        p_h[i].y  = particles[i].y  - sy;
+        p_h[i].z  = particles[i].z  - sz;
+        p_h[i].vx = particles[i].vx - cvx;
+        p_h[i].vy = particles[i].vy - cvy;
+        p_h[i].vz = particles[i].vz - cvz;
         p_h[i].m  = particles[i].m;
     }
 }
@@ -352,7 +373,7 @@ void reb_transformations_whds_to_inertial_pos(struct reb_particle* const particl
 void reb_transformations_whds_to_inertial_posvel(struct reb_particle* const particles, const struct reb_particle* const p_h, const unsigned int N, const int N_active){
     reb_transformations_whds_to_inertial_pos(particles,p_h,N, N_active);
     const double m0 = particles[0].m;
-#pragma omp parallel for
+#pragma omp parallel for if(N_active>TRANSFORMATIONS_PARALLEL_N)
     for (unsigned int i=1;i<N_active;i++){
         const double mi = particles[i].m;
         double mf = (m0+mi) / m0;
@@ -360,16 +381,17 @@ void reb_transformations_whds_to_inertial_posvel(struct reb_particle* const part
         particles[i].vy = p_h[i].vy/mf+p_h[0].vy;
         particles[i].vz = p_h[i].vz/mf+p_h[0].vz;
     }
-#pragma omp parallel for
+    const double cvx = p_h[0].vx, cvy = p_h[0].vy, cvz = p_h[0].vz;
+#pragma omp parallel for if(N-N_active>TRANSFORMATIONS_PARALLEL_N)
     for (unsigned int i=N_active;i<N;i++){
-        particles[i].vx = p_h[i].vx+p_h[0].vx;
-        particles[i].vy = p_h[i].vy+p_h[0].vy;
-        particles[i].vz = p_h[i].vz+p_h[0].vz;
+        particles[i].vx = p_h[i].vx+cvx;
+        particles[i].vy = p_h[i].vy+cvy;
+        particles[i].vz = p_h[i].vz+cvz;
     }
     double vx0  = 0.;
     double vy0  = 0.;
     double vz0  = 0.;
-#pragma omp parallel for reduction(+:vx0) reduction(+:vy0) reduction(+:vz0) 
+#pragma omp parallel for reduction(+:vx0) reduction(+:vy0) reduction(+:vz0) if(N_active>TRANSFORMATIONS_PARALLEL_N)
     for (int i=1;i<N_active;i++){
         double m = particles[i].m;
         vx0 += p_h[i].vx*m/(m0+m);
@@ -393,7 +415,7 @@ void reb_transformations_inertial_to_democraticheliocentric_posvel(const struct
     double vy0 = 0.;
     double vz0 = 0.;
     double m0  = 0.;
-#pragma omp parallel for reduction(+:x0) reduction(+:y0) reduction(+:z0) reduction(+:vx0) reduction(+:vy0) reduction(+:vz0) reduction(+:m0)
+#pragma omp parallel for reduction(+:x0) reduction(+:y0) reduction(+:z0) reduction(+:vx0) reduction(+:vy0) reduction(+:vz0) reduction(+:m0) if(N_active>TRANSFORMATIONS_PARALLEL_N)
     for (int i=0;i<N_active;i++){
         double m = particles[i].m;
         x0  += particles[i].x *m;
@@ -412,14 +434,17 @@ void reb_transformations_inertial_to_democraticheliocentric_posvel(const struct
     p_h[0].vz = vz0/m0;
     p_h[0].m = m0;
     
-#pragma omp parallel for 
+    // Active and test particles are shifted by the star's position and the centre of mass velocity.
+    const double sx = particles[0].x, sy = particles[0].y, sz = particles[0].z;
+    const double cvx = p_h[0].vx, cvy = p_h[0].vy, cvz = p_h[0].vz;
+#pragma omp parallel for if(N>TRANSFORMATIONS_PARALLEL_N)
     for (unsigned int i=1;i<N;i++){
-        p_h[i].x  = particles[i].x  - particles[0].x ;
-        p_h[i].y  = particles[i].y  - particles[0].y ;
-        p_h[i].z  = particles[i].z  - particles[0].z ;
-        p_h[i].vx = particles[i].vx - p_h[0].vx;
-        p_h[i].vy = particles[i].vy - p_h[0].vy;
-        p_h[i].vz = particles[i].vz - p_h[0].vz;
+        p_h[i].x  = particles[i].x  - sx;
+        p_h[i].y  = particles[i].y  - sy;
+        p_h[i].z  = particles[i].z  - sz;
+        p_h[i].vx = particles[i].vx - cvx;
+        p_h[i].vy = particles[i].vy - cvy;
+        p_h[i].vz = particles[i].vz - cvz;
         p_h[i].m  = particles[i].m;
     }
 }
@@ -429,7 +454,7 @@ void reb_transformations_democraticheliocentric_to_inertial_pos(struct reb_parti
     double x0  = 0.;
     double y0  = 0.;
     double z0  = 0.;
-#pragma omp parallel for reduction(+:x0) reduction(+:y0) reduction(+:z0) 
+#pragma omp parallel for reduction(+:x0) reduction(+:y0) reduction(+:z0) if(N_active>TRANSFORMATIONS_PARALLEL_N)
     for (int i=1;i<N_active;i++){
         double m = p_h[i].m;
         x0 += p_h[i].x*m/mtot;
@@ -440,27 +465,29 @@ void reb_transformations_democraticheliocentric_to_inertial_pos(struct reb_parti
     particles[0].x  = p_h[0].x - x0;
     particles[0].y  = p_h[0].y - y0;
     particles[0].z  = p_h[0].z - z0;
-#pragma omp parallel for 
+    const double sx = particles[0].x, sy = particles[0].y, sz = particles[0].z;
+#pragma omp parallel for if(N>TRANSFORMATIONS_PARALLEL_N)
     for (unsigned int i=1;i<N;i++){
-        particles[i].x = p_h[i].x+particles[0].x;
-        particles[i].y = p_h[i].y+particles[0].y;
-        particles[i].z = p_h[i].z+particles[0].z;
+        particles[i].x = p_h[i].x+sx;
+        particles[i].y = p_h[i].y+sy;
+        particles[i].z = p_h[i].z+sz;
     }
 }
 
 void reb_transformations_democraticheliocentric_to_inertial_posvel(struct reb_particle* const particles, const struct reb_particle* const p_h, const unsigned int N, const int N_active){
     reb_transformations_democraticheliocentric_to_inertial_pos(particles,p_h,N,N_active);
     const double m0 = particles[0].m;
-#pragma omp parallel for 
+    const double cvx = p_h[0].vx, cvy = p_h[0].vy, cvz = p_h[0].vz;
+#pragma omp parallel for if(N>TRANSFORMATIONS_PARALLEL_N)
     for (unsigned int i=1;i<N;i++){
-        particles[i].vx = p_h[i].vx+p_h[0].vx;
-        particles[i].vy = p_h[i].vy+p_h[0].vy;
-        particles[i].vz = p_h[i].vz+p_h[0].vz;
+        particles[i].vx = p_h[i].vx+cvx;
+        particles[i].vy = p_h[i].vy+cvy;
+        particles[i].vz = p_h[i].vz+cvz;
     }
     double vx0  = 0.;
     double vy0  = 0.;
     double vz0  = 0.;
-#pragma omp parallel for reduction(+:vx0) reduction(+:vy0) reduction(+:vz0) 
+#pragma omp parallel for reduction(+:vx0) reduction(+:vy0) reduction(+:vz0) if(N_active>TRANSFORMATIONS_PARALLEL_N)
     for (int i=1;i<N_active;i++){
         double m = particles[i].m;
         vx0 += p_h[i].vx*m/m0;
@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <string.h>
 #include <math.h>
 #include <time.h>
 #include "particle.h"
@@ -36,6 +37,43 @@
 #include "communication_mpi.h"
 #endif // MPI
 
+#define REB_TREE_MORTON_LEVELS 21 		///< Number of levels encoded in a 63 bit Morton key.
+#define REB_TREE_TASK_DEPTH 4 			///< Cells up to this depth are updated in separate OpenMP tasks.
+
+/**
+  * @brief Returns a new, zeroed tree cell. 
+  * @details Cells are taken from the free list if possible. Otherwise they are taken from 
+  * chunks of REB_TREE_CELLS_PER_CHUNK cells which are allocated when needed.
+  * @param r REBOUND simulation to operate on
+  */
+static struct reb_treecell* reb_tree_cell_alloc(struct reb_simulation* const r){
+	struct reb_treecell* node;
+	if (r->tree_cells_free){
+		node = r->tree_cells_free;
+		r->tree_cells_free = node->oct[0];
+	}else{
+		const int chunk = r->tree_cells_N/REB_TREE_CELLS_PER_CHUNK;
+		if (chunk>=r->tree_cells_chunks_N){
+			r->tree_cells_chunks = realloc(r->tree_cells_chunks, sizeof(struct reb_treecell*)*(chunk+1));
+			r->tree_cells_chunks[chunk] = malloc(sizeof(struct reb_treecell)*REB_TREE_CELLS_PER_CHUNK);
+			r->tree_cells_chunks_N = chunk+1;
+		}
+		node = &(r->tree_cells_chunks[chunk][r->tree_cells_N%REB_TREE_CELLS_PER_CHUNK]);
+		r->tree_cells_N++;
+	}
+	memset(node, 0, sizeof(struct reb_treecell));
+	return node;
+}
+
+/**
+  * @brief Puts a tree cell on the free list so that it can be reused.
+  * @param r REBOUND simulation to operate on
+  * @param node is the pointer to the cell.
+  */
+static void reb_tree_cell_free(struct reb_simulation* const r, struct reb_treecell* node){
+	node->oct[0] = r->tree_cells_free;
+	r->tree_cells_free = node;
+}
 
 /**
   * @brief Given a particle and a pointer to a node cell, the function returns the index of the octant which the particle belongs to.
@@ -63,6 +101,41 @@ static int reb_reb_tree_get_octant_for_particle_in_cell(const struct reb_particl
   */
 static struct reb_treecell *reb_tree_add_particle_to_cell(struct reb_simulation* const r, struct reb_treecell *node, int pt, struct reb_treecell *parent, int o);
 
+/**
+  * @brief Builds the tree from scratch. Used instead of an update if tree_rebuild is set.
+  * @param r REBOUND simulation to operate on
+  */
+static void reb_tree_rebuild(struct reb_simulation* const r);
+
+// Morton keys are also used to find the cells which need to be updated in reb_tree_update().
+static uint64_t reb_tree_morton_key_for_particle(const struct reb_simulation* const r, const struct reb_particle p);
+static struct reb_tree_key* reb_tree_sort_keys(struct reb_simulation* const r, int N);
+
+/**
+  * @brief Sets the position and width of a new cell.
+  * @param r REBOUND simulation to operate on
+  * @param node is the pointer to the new cell.
+  * @param p is a particle in the new cell. Only used if the cell is a root.
+  * @param parent is the pointer to the parent cell. NULL if the cell is a root.
+  * @param o is the octant of the parent cell which the new cell occupies.
+  */
+static void reb_tree_set_cell_geometry(const struct reb_simulation* const r, struct reb_treecell* node, const struct reb_particle p, const struct reb_treecell* parent, int o){
+	if (parent == NULL){ // The new node is a root
+		node->w = r->root_size;
+		int i = ((int)floor((p.x + r->boxsize.x/2.)/r->root_size))%r->root_nx;
+		int j = ((int)floor((p.y + r->boxsize.y/2.)/r->root_size))%r->root_ny;
+		int k = ((int)floor((p.z + r->boxsize.z/2.)/r->root_size))%r->root_nz;
+		node->x = -r->boxsize.x/2.+r->root_size*(0.5+(double)i);
+		node->y = -r->boxsize.y/2.+r->root_size*(0.5+(double)j);
+		node->z = -r->boxsize.z/2.+r->root_size*(0.5+(double)k);
+	}else{ // The new node is a normal node
+		node->w 	= parent->w/2.;
+		node->x 	= parent->x + node->w/2.*((o>>0)%2==0?1.:-1);
+		node->y 	= parent->y + node->w/2.*((o>>1)%2==0?1.:-1);
+		node->z 	= parent->z + node->w/2.*((o>>2)%2==0?1.:-1);
+	}
+}
+
 void reb_tree_add_particle_to_tree(struct reb_simulation* const r, int pt){
 	if (r->tree_root==NULL){
 		r->tree_root = calloc(r->root_nx*r->root_ny*r->root_nz,sizeof(struct reb_treecell*));
@@ -71,8 +144,7 @@ void reb_tree_add_particle_to_tree(struct reb_simulation* const r, int pt){
 	int rootbox = reb_get_rootbox_for_particle(r, p);
 #ifdef MPI
 	// Do not add particles that do not belong to this tree (avoid removing active particles)
-	int root_n_per_node = r->root_n/r->mpi_num;
-	int proc_id = rootbox/root_n_per_node;
+	int proc_id = reb_communication_mpi_rootbox_owner(r, rootbox);
 	if (proc_id!=r->mpi_id) return;
 #endif 	// MPI
 	r->tree_root[rootbox] = reb_tree_add_particle_to_cell(r, r->tree_root[rootbox],pt,NULL,0);
@@ -82,22 +154,8 @@ static struct reb_treecell *reb_tree_add_particle_to_cell(struct reb_simulation*
 	struct reb_particle* const particles = r->particles;
 	// Initialize a new node
 	if (node == NULL) {  
-		node = calloc(1, sizeof(struct reb_treecell));
-		struct reb_particle p = particles[pt];
-		if (parent == NULL){ // The new node is a root
-			node->w = r->root_size;
-			int i = ((int)floor((p.x + r->boxsize.x/2.)/r->root_size))%r->root_nx;
-			int j = ((int)floor((p.y + r->boxsize.y/2.)/r->root_size))%r->root_ny;
-			int k = ((int)floor((p.z + r->boxsize.z/2.)/r->root_size))%r->root_nz;
-			node->x = -r->boxsize.x/2.+r->root_size*(0.5+(double)i);
-			node->y = -r->boxsize.y/2.+r->root_size*(0.5+(double)j);
-			node->z = -r->boxsize.z/2.+r->root_size*(0.5+(double)k);
-		}else{ // The new node is a normal node
-			node->w 	= parent->w/2.;
-			node->x 	= parent->x + node->w/2.*((o>>0)%2==0?1.:-1);
-			node->y 	= parent->y + node->w/2.*((o>>1)%2==0?1.:-1);
-			node->z 	= parent->z + node->w/2.*((o>>2)%2==0?1.:-1);
-		}
+		node = reb_tree_cell_alloc(r);
+		reb_tree_set_cell_geometry(r, node, particles[pt], parent, o);
 		node->pt = pt; 
 		particles[pt].c = node;
 		for (int i=0; i<8; i++){
@@ -152,20 +210,53 @@ static int reb_tree_particle_is_inside_cell(const struct reb_simulation* const r
 }
 
 /**
-  * @brief The function is called to walk through the whole tree to update its structure and node->pt at the end of each time step.
+  * @brief The function is called to walk through the tree to update its structure and node->pt at the end of each time step.
   *
+  * @details If keys is not NULL, only the cells on the paths to the leaf cells in keys[lo] 
+  * to keys[hi-1] are visited. All other cells are unchanged since none of their particles 
+  * has left its cell. The cells are visited in the same order as in a walk through the whole tree.
   * @param r REBOUND simulation to operate on
   * @param node is the pointer to a node cell
+  * @param keys Sorted Morton keys of the centers of the leaf cells which particles have left. NULL to walk through the whole tree.
+  * @param lo Index of the first key within node.
+  * @param hi Index one after the last key within node.
+  * @param level Depth of node below its root box.
   */
-static struct reb_treecell *reb_tree_update_cell(struct reb_simulation* const r, struct reb_treecell *node){
+static struct reb_treecell *reb_tree_update_cell(struct reb_simulation* const r, struct reb_treecell *node, const struct reb_tree_key* keys, int lo, int hi, int level){
 	int test = -1; /**< A temporary int variable is used to store the index of an octant when it needs to be freed. */
 	if (node == NULL) {
 		return NULL;
 	}
+	if (keys){
+		if (lo==hi){
+			return node;
+		}
+		for (int k=lo; k<hi; k++){
+			if (keys[k].index==level){
+				// This was a leaf cell but another particle has been added to it in the 
+				// meantime. Its particle may now be in any of the octants.
+				keys = NULL;
+				break;
+			}
+		}
+	}
 	// Non-leaf nodes	
 	if (node->pt < 0) {
-		for (int o=0; o<8; o++) {
-			node->oct[o] = reb_tree_update_cell(r, node->oct[o]);
+		if (keys){
+			const int shift = 3*(REB_TREE_MORTON_LEVELS-1-level);
+			int start = lo;
+			for (int o=0; o<8; o++) {
+				int end = start;
+				while (end<hi && (int)((keys[end].key>>shift)&7)==o){
+					end++;
+				}
+				node->oct[o] = reb_tree_update_cell(r, node->oct[o], keys, start, end, level+1);
+				start = end;
+			}
+		}else{
+			for (int o=0; o<8; o++) {
+				node->oct[o] = reb_tree_update_cell(r, node->oct[o], NULL, 0, 0, level+1);
+			}
 		}
 		node->pt = 0;
 		for (int o=0; o<8; o++) {
@@ -182,12 +273,12 @@ static struct reb_treecell *reb_tree_update_cell(struct reb_simulation* const r,
 		}
 		// Check if the node requires derefinement.
 		if (node->pt == 0) {	// The node is empty.
-			free(node);
+			reb_tree_cell_free(r, node);
 			return NULL;
 		} else if (node->pt == -1) { // The node becomes a leaf.
 			node->pt = node->oct[test]->pt;
 			r->particles[node->pt].c = node;
-			free(node->oct[test]);
+			reb_tree_cell_free(r, node->oct[test]);
 			node->oct[test]=NULL;
 			return node;
 		}
@@ -205,7 +296,7 @@ static struct reb_treecell *reb_tree_update_cell(struct reb_simulation* const r,
                 reb_add(r, reinsertme);
             }
         }
-		free(node);
+		reb_tree_cell_free(r, node);
 		return NULL; 
 	} else {
 		r->particles[node->pt].c = node;
@@ -215,8 +306,11 @@ static struct reb_treecell *reb_tree_update_cell(struct reb_simulation* const r,
 
 /**
   * @brief The function calculates the total mass and center of mass of a node. When QUADRUPOLE is defined, it also calculates the mass quadrupole tensor for all non-leaf nodes.
+  * @details The children of cells up to REB_TREE_TASK_DEPTH are updated in parallel OpenMP tasks. 
+  * Their moments are added in the same order as in a serial update.
+  * @param depth Depth of the node below its root box.
   */
-static void reb_tree_update_gravity_data_in_cell(const struct reb_simulation* const r, struct reb_treecell *node){
+static void reb_tree_update_gravity_data_in_cell(const struct reb_simulation* const r, struct reb_treecell *node, int depth){
 #ifdef QUADRUPOLE
 	node->mxx = 0;
 	node->mxy = 0;
@@ -234,7 +328,14 @@ static void reb_tree_update_gravity_data_in_cell(const struct reb_simulation* co
 		for (int o=0; o<8; o++) {
 			struct reb_treecell* d = node->oct[o];
 			if (d!=NULL){
-				reb_tree_update_gravity_data_in_cell(r, d);
+#pragma omp task if(depth<REB_TREE_TASK_DEPTH && d->pt<0) firstprivate(d)
+				reb_tree_update_gravity_data_in_cell(r, d, depth+1);
+			}
+		}
+#pragma omp taskwait
+		for (int o=0; o<8; o++) {
+			struct reb_treecell* d = node->oct[o];
+			if (d!=NULL){
 				// Calculate the total mass and the center of mass
 				double d_m = d->m;
 				node->mx += d->mx*d_m;
@@ -278,13 +379,70 @@ static void reb_tree_update_gravity_data_in_cell(const struct reb_simulation* co
 	}
 }
 
+/**
+  * @brief The function calculates the largest radius and the largest speed of all particles in a node. These are used to prune the tree during the collision search.
+  * @details The children of cells up to REB_TREE_TASK_DEPTH are updated in parallel OpenMP tasks. 
+  * @param depth Depth of the node below its root box.
+  */
+static void reb_tree_update_collision_data_in_cell(const struct reb_simulation* const r, struct reb_treecell *node, int depth){
+	if (node->pt < 0) {
+		// Non-leaf nodes	
+		node->rmax = 0;
+		node->vmax = 0;
+		for (int o=0; o<8; o++) {
+			struct reb_treecell* d = node->oct[o];
+			if (d!=NULL){
+#pragma omp task if(depth<REB_TREE_TASK_DEPTH && d->pt<0) firstprivate(d)
+				reb_tree_update_collision_data_in_cell(r, d, depth+1);
+			}
+		}
+#pragma omp taskwait
+		for (int o=0; o<8; o++) {
+			struct reb_treecell* d = node->oct[o];
+			if (d!=NULL){
+				if (d->rmax > node->rmax){
+					node->rmax = d->rmax;
+				}
+				if (d->vmax > node->vmax){
+					node->vmax = d->vmax;
+				}
+			}
+		}
+	}else{ 
+		// Leaf nodes
+		const struct reb_particle* const p = &(r->particles[node->pt]);
+		node->rmax = p->r;
+		node->vmax = sqrt(p->vx*p->vx + p->vy*p->vy + p->vz*p->vz);
+	}
+}
+
+void reb_tree_update_collision_data(struct reb_simulation* const r){
+#pragma omp parallel
+#pragma omp single
+	for(int i=0;i<r->root_n;i++){
+#ifdef MPI
+		if (reb_communication_mpi_rootbox_is_local(r, i)==1){
+#endif // MPI
+			if (r->tree_root[i]!=NULL){
+#pragma omp task firstprivate(i)
+				reb_tree_update_collision_data_in_cell(r, r->tree_root[i], 0);
+			}
+#ifdef MPI
+		}
+#endif // MPI
+	}
+}
+
 void reb_tree_update_gravity_data(struct reb_simulation* const r){
+#pragma omp parallel
+#pragma omp single
 	for(int i=0;i<r->root_n;i++){
 #ifdef MPI
 		if (reb_communication_mpi_rootbox_is_local(r, i)==1){
 #endif // MPI
 			if (r->tree_root[i]!=NULL){
-				reb_tree_update_gravity_data_in_cell(r, r->tree_root[i]);
+#pragma omp task firstprivate(i)
+				reb_tree_update_gravity_data_in_cell(r, r->tree_root[i], 0);
 			}
 #ifdef MPI
 		}
@@ -293,42 +451,303 @@ void reb_tree_update_gravity_data(struct reb_simulation* const r){
 }
 
 void reb_tree_update(struct reb_simulation* const r){
+	if (r->tree_rebuild || reb_tree_active_only(r)){
+		reb_tree_rebuild(r);
+		r->tree_needs_update= 0;
+		return;
+	}
 	if (r->tree_root==NULL){
 		r->tree_root = calloc(r->root_nx*r->root_ny*r->root_nz,sizeof(struct reb_treecell*));
 	}
+#ifndef MPI
+	// Find the leaf cells which particles have left (or which contain particles flagged 
+	// for removal). Only the paths to these cells need to be walked through.
+	int all = 0;
+	int N_dirty = 0;
+	struct reb_particle* const particles = r->particles;
+	for (int i=0; i<r->N; i++){
+		struct reb_treecell* const c = particles[i].c;
+		if (c==NULL || c->pt!=i){
+			all = 1; // Particle is not in the tree.
+			break;
+		}
+		if (reb_tree_particle_is_inside_cell(r, c) == 0){
+			int depth = 0;
+			for (double w=r->root_size; w>c->w && depth<REB_TREE_MORTON_LEVELS; w/=2.){
+				depth++;
+			}
+			if (depth>=REB_TREE_MORTON_LEVELS){
+				all = 1; // Cell is deeper than the resolution of the keys.
+				break;
+			}
+			if (r->tree_keys_allocatedN<2*(N_dirty+1)){
+				r->tree_keys_allocatedN = r->tree_keys_allocatedN ? 2*r->tree_keys_allocatedN : 128;
+				r->tree_keys = realloc(r->tree_keys, sizeof(struct reb_tree_key)*r->tree_keys_allocatedN);
+			}
+			struct reb_particle center = {0};
+			center.x = c->x;
+			center.y = c->y;
+			center.z = c->z;
+			r->tree_keys[N_dirty].key = reb_tree_morton_key_for_particle(r, center);
+			r->tree_keys[N_dirty].rootbox = reb_get_rootbox_for_particle(r, center);
+			r->tree_keys[N_dirty].index = depth;
+			N_dirty++;
+		}
+	}
+	if (!all){
+		if (N_dirty){
+			const struct reb_tree_key* const keys = reb_tree_sort_keys(r, N_dirty);
+			int start = 0;
+			while (start<N_dirty){
+				const int rootbox = keys[start].rootbox;
+				int end = start+1;
+				while (end<N_dirty && keys[end].rootbox==rootbox){
+					end++;
+				}
+				r->tree_root[rootbox] = reb_tree_update_cell(r, r->tree_root[rootbox], keys, start, end, 0);
+				start = end;
+			}
+		}
+		r->tree_needs_update= 0;
+		return;
+	}
+#endif // MPI
 	for(int i=0;i<r->root_n;i++){
 
 #ifdef MPI
 		if (reb_communication_mpi_rootbox_is_local(r, i)==1){
 #endif // MPI
-			r->tree_root[i] = reb_tree_update_cell(r, r->tree_root[i]);
+			r->tree_root[i] = reb_tree_update_cell(r, r->tree_root[i], NULL, 0, 0, 0);
 #ifdef MPI
 		}
 #endif // MPI
 	}
     r->tree_needs_update= 0;
 }
-static void reb_tree_delete_cell(struct reb_treecell* node){
-	if (node==NULL){
+/**
+  * @brief Calculates the Morton key of a particle within its root box.
+  * @details The octant on every level is determined with exactly the same 
+  * comparisons as in reb_tree_add_particle_to_cell(). Sorting particles by 
+  * their keys therefore gives the order in which they appear in the tree.
+  * @param r REBOUND simulation to operate on
+  * @param p The particle for which the key is calculated.
+  */
+static uint64_t reb_tree_morton_key_for_particle(const struct reb_simulation* const r, const struct reb_particle p){
+	struct reb_treecell cell[2];
+	reb_tree_set_cell_geometry(r, &cell[0], p, NULL, 0);
+	uint64_t key = 0;
+	for (int l=0; l<REB_TREE_MORTON_LEVELS; l++){
+		const int o = reb_reb_tree_get_octant_for_particle_in_cell(p, &cell[l%2]);
+		key = (key<<3) | o;
+		reb_tree_set_cell_geometry(r, &cell[(l+1)%2], p, &cell[l%2], o);
+	}
+	return key;
+}
+
+/**
+  * @brief Sorts the keys by root box first and by Morton key second using a radix sort.
+  * @param r REBOUND simulation to operate on
+  * @param N Number of keys.
+  * @return Pointer to the sorted keys (either tree_keys or tree_keys+N).
+  */
+static struct reb_tree_key* reb_tree_sort_keys(struct reb_simulation* const r, int N){
+	struct reb_tree_key* in = r->tree_keys;
+	struct reb_tree_key* out = r->tree_keys+N;
+	// Histograms for all 8 bytes of the Morton keys are calculated in one pass.
+	int hist[8][256] = {{0}};
+	for (int i=0; i<N; i++){
+		uint64_t key = in[i].key;
+		for (int b=0; b<8; b++){
+			hist[b][(key>>(8*b))&0xff]++;
+		}
+	}
+	for (int b=0; b<8; b++){
+		if (hist[b][(in[0].key>>(8*b))&0xff]==N){
+			continue; // All keys have the same byte. Nothing to do.
+		}
+		int offset = 0;
+		for (int k=0; k<256; k++){
+			int n = hist[b][k];
+			hist[b][k] = offset;
+			offset += n;
+		}
+		for (int i=0; i<N; i++){
+			out[hist[b][(in[i].key>>(8*b))&0xff]++] = in[i];
+		}
+		struct reb_tree_key* tmp = in; in = out; out = tmp;
+	}
+	if (r->root_n>1){
+		// Stable counting sort by root box.
+		int* offset = calloc(r->root_n+1, sizeof(int));
+		for (int i=0; i<N; i++){
+			offset[in[i].rootbox+1]++;
+		}
+		for (int k=0; k<r->root_n; k++){
+			offset[k+1] += offset[k];
+		}
+		for (int i=0; i<N; i++){
+			out[offset[in[i].rootbox]++] = in[i];
+		}
+		free(offset);
+		in = out;
+	}
+	return in;
+}
+
+/**
+  * @brief Builds the cell containing the particles keys[lo] to keys[hi-1].
+  * @details All these particles have the same Morton key up to the given level.
+  * @param r REBOUND simulation to operate on
+  * @param keys Sorted keys.
+  * @param lo Index of the first key.
+  * @param hi Index one after the last key.
+  * @param parent is the pointer to the parent cell. NULL if the cell is a root.
+  * @param o is the octant of the parent cell which the new cell occupies.
+  * @param level Number of octants which have already been used from the keys.
+  */
+static struct reb_treecell* reb_tree_build_cell(struct reb_simulation* const r, const struct reb_tree_key* const keys, int lo, int hi, struct reb_treecell* parent, int o, int level){
+	struct reb_particle* const particles = r->particles;
+	struct reb_treecell* node = reb_tree_cell_alloc(r);
+	reb_tree_set_cell_geometry(r, node, particles[keys[lo].index], parent, o);
+	node->pt = keys[lo].index;
+	particles[node->pt].c = node;
+	if (hi-lo==1){ // Leaf node
+		return node;
+	}
+	if (level==REB_TREE_MORTON_LEVELS){
+		// The particles are closer to each other than the resolution of the keys. 
+		for (int i=lo+1; i<hi; i++){
+			reb_tree_add_particle_to_cell(r, node, keys[i].index, parent, o);
+		}
+		return node;
+	}
+	node->pt = lo-hi;
+	const int shift = 3*(REB_TREE_MORTON_LEVELS-1-level);
+	int start = lo;
+	while (start<hi){
+		const int oc = (keys[start].key>>shift)&7;
+		int end = start+1;
+		while (end<hi && ((keys[end].key>>shift)&7)==oc){
+			end++;
+		}
+		node->oct[oc] = reb_tree_build_cell(r, keys, start, end, node, oc, level+1);
+		start = end;
+	}
+	return node;
+}
+
+/**
+  * @details Particles flagged for removal are removed first. The Morton keys 
+  * of all particles are then calculated in parallel and sorted. Finally,
+  * the cells are created in the order in which they are walked through.
+  * @param r REBOUND simulation to operate on
+  */
+int reb_tree_active_only(const struct reb_simulation* const r){
+#ifdef MPI
+	return 0;
+#else // MPI
+	return r->tree_active_only && r->N_active!=-1 && r->testparticle_type==0 && r->collision!=REB_COLLISION_TREE && r->collision!=REB_COLLISION_LINETREE;
+#endif // MPI
+}
+
+static void reb_tree_rebuild(struct reb_simulation* const r){
+	const int active_only = reb_tree_active_only(r);
+	if (active_only){
+		// Remove flagged particles, keeping all other particles in order.
+		int N = 0;
+		const int N_active = r->N_active;
+		for (int i=0; i<r->N; i++){
+			if (isnan(r->particles[i].y)){
+				if (i<N_active){
+					r->N_active--;
+				}
+			}else{
+				r->particles[N] = r->particles[i];
+				N++;
+			}
+		}
+		r->N = N;
+	}
+	for (int i=0; i<r->N; i++){
+		struct reb_particle p = r->particles[i];
+		int remove = isnan(p.y);
+#ifdef MPI
+		const int local = !remove && reb_communication_mpi_rootbox_is_local(r, reb_get_rootbox_for_particle(r, p));
+#else // MPI
+		const int local = !remove;
+#endif // MPI
+		if (!local){
+			(r->N)--;
+			r->particles[i] = r->particles[r->N];
+			if (!remove){
+				reb_add(r, p); // Will be sent to another node.
+			}
+			i--;
+		}
+	}
+	reb_tree_clear(r);
+	if (r->tree_root==NULL){
+		r->tree_root = calloc(r->root_nx*r->root_ny*r->root_nz,sizeof(struct reb_treecell*));
+	}
+	// Test particles are not added to the tree if active_only is set.
+	const int N = (active_only && r->N_active<r->N)?r->N_active:r->N;
+	for (int i=N; i<r->N; i++){
+		r->particles[i].c = NULL;
+	}
+	if (N==0){
 		return;
 	}
-    if (node->remote==1){
-        return;
-    }
-	for (int o=0; o<8; o++) {
-		reb_tree_delete_cell(node->oct[o]);
+	if (r->tree_keys_allocatedN<2*N){
+		r->tree_keys_allocatedN = 2*N;
+		r->tree_keys = realloc(r->tree_keys, sizeof(struct reb_tree_key)*r->tree_keys_allocatedN);
+	}
+	struct reb_tree_key* keys = r->tree_keys;
+	const struct reb_particle* const particles = r->particles;
+#pragma omp parallel for schedule(guided)
+	for (int i=0; i<N; i++){
+		keys[i].key = reb_tree_morton_key_for_particle(r, particles[i]);
+		keys[i].rootbox = reb_get_rootbox_for_particle(r, particles[i]);
+		keys[i].index = i;
+	}
+	keys = reb_tree_sort_keys(r, N);
+	int start = 0;
+	while (start<N){
+		const int rootbox = keys[start].rootbox;
+		int end = start+1;
+		while (end<N && keys[end].rootbox==rootbox){
+			end++;
+		}
+		r->tree_root[rootbox] = reb_tree_build_cell(r, keys, start, end, NULL, 0, 0);
+		start = end;
 	}
-	free(node);
 }
 
-void reb_tree_delete(struct reb_simulation* const r){
+void reb_tree_clear(struct reb_simulation* const r){
 	if (r->tree_root!=NULL){
 		for(int i=0;i<r->root_n;i++){
-			reb_tree_delete_cell(r->tree_root[i]);
+			r->tree_root[i] = NULL;
 		}
+	}
+	// All cells are owned by the chunks. Remote cells (MPI) are owned by tree_essential_recv.
+	r->tree_cells_N = 0;
+	r->tree_cells_free = NULL;
+}
+
+void reb_tree_delete(struct reb_simulation* const r){
+	reb_tree_clear(r);
+	if (r->tree_root!=NULL){
 		free(r->tree_root);
 		r->tree_root = NULL;
 	}
+	for(int i=0;i<r->tree_cells_chunks_N;i++){
+		free(r->tree_cells_chunks[i]);
+	}
+	free(r->tree_cells_chunks);
+	r->tree_cells_chunks = NULL;
+	r->tree_cells_chunks_N = 0;
+	free(r->tree_keys);
+	r->tree_keys = NULL;
+	r->tree_keys_allocatedN = 0;
 }
 
 
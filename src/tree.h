@@ -26,6 +26,8 @@
 #ifndef _TREE_H
 #define _TREE_H
 
+#include <stdint.h>
+
 struct reb_treecell; 
 
 /**
@@ -40,6 +42,8 @@ struct reb_treecell {
 	double mx; /**< The x position of the center of mass of a cell */
 	double my; /**< The y position of the center of mass of a cell */
 	double mz; /**< The z position of the center of mass of a cell */
+	double rmax; /**< The largest physical radius of all particles in a cell */
+	double vmax; /**< The largest speed of all particles in a cell */
 #ifdef QUADRUPOLE
 	double mxx; /**< The xx component of the quadrupole tensor of mass of a cell */
 	double mxy; /**< The xy component of the quadrupole tensor of mass of a cell */
@@ -53,11 +57,25 @@ struct reb_treecell {
 			  * of a particle; in a non-leaf node, it equals to (-1)*Total 
 			  * Number of particles within that cell. */ 
     int remote; /**< 0 by default. Set to 1 if this cell is part of an essential tree (MPI).*/ 
+	double* fmm; /**< Multipole and local expansion coefficients of a non-leaf cell (REB_GRAVITY_FMM only). */
+};
+
+#define REB_TREE_CELLS_PER_CHUNK 1024 	///< Number of tree cells allocated at once.
+
+/**
+ * @brief Morton key of a particle, used to build the tree from scratch.
+ */
+struct reb_tree_key {
+	uint64_t key;	/**< Octants of the particle on the first 21 levels below its root box, 3 bits per level */
+	int rootbox;	/**< Index of the root box of the particle */
+	int index;		/**< Index of the particle. During an incremental update: depth of the cell which the particle has left. */
 };
 
 /**
   * @brief This function updates the tree.
   * @details The tree needs to be updated when particles move, this function does that.
+  * Only the paths from the roots to the leaf cells of particles which have left their cell are walked through.
+  * If tree_rebuild is set or only active particles are in the tree, the tree is built from scratch instead.
   * @param r Rebound simulation to operate on
   */
 void reb_tree_update(struct reb_simulation* const r);
@@ -68,6 +86,13 @@ void reb_tree_update(struct reb_simulation* const r);
   */
 void reb_tree_update_gravity_data(struct reb_simulation* const r);
 
+/**
+  * @brief The wrap function calls reb_tree_update_collision_data_in_cell() for each tree.
+  * @details Needs to be called after reb_tree_update() and before the tree is used to search for collisions.
+  * @param r Rebound simulation to operate on
+  */
+void reb_tree_update_collision_data(struct reb_simulation* const r);
+
 /**
   * @brief The wrap function calls reb_tree_add_particle_to_cell() to add the particle into one of the trees. If the tree_root doesn't exist, then it initializes the tree. 
   * @param r Rebound simulation to operate on
@@ -75,6 +100,20 @@ void reb_tree_update_gravity_data(struct reb_simulation* const r);
   */
 void reb_tree_add_particle_to_tree(struct reb_simulation* const r, int pt);
 
+/**
+ * @brief Returns 1 if only active particles are added to the tree.
+ * @details This is the case if tree_active_only is set, N_active is set, testparticle_type is 0 and the collision search does not use the tree. Not supported with MPI.
+  * @param r Rebound simulation to operate on
+ */
+int reb_tree_active_only(const struct reb_simulation* const r);
+
+/**
+ * @brief Removes all cells from the tree in O(1) time. The memory of the cells is kept for reuse.
+ * This will not modify particles.
+  * @param r Rebound simulation to operate on
+ */
+void reb_tree_clear(struct reb_simulation* const r);
+
 /**
  * @brief Free up all space occupied by the tree structure.
  * This will not modify particles.